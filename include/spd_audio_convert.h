@@ -0,0 +1,175 @@
+/*
+ * spd_audio_convert.h - Sample conversions shared by the audio code
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * These run on every sample of audio, so they process 16 bytes at a time
+ * with SSE2 or NEON when the target has them (both are part of the base
+ * x86_64 and aarch64 instruction sets, so no run-time detection is
+ * needed), and otherwise use plain loops that compilers can vectorize.
+ */
+
+#ifndef SPD_AUDIO_CONVERT_H
+#define SPD_AUDIO_CONVERT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* Swaps the bytes of N 16bit samples in place */
+static inline void spd_audio_swap16(void *samples, size_t n)
+{
+	unsigned char *p = samples;
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; n - i >= 8; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + 2 * i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(p + 2 * i), v);
+	}
+#elif defined(__ARM_NEON)
+	for (; n - i >= 8; i += 8) {
+		uint8x16_t v = vld1q_u8(p + 2 * i);
+		vst1q_u8(p + 2 * i, vrev16q_u8(v));
+	}
+#endif
+	for (; i < n; i++) {
+		unsigned char c = p[2 * i];
+		p[2 * i] = p[2 * i + 1];
+		p[2 * i + 1] = c;
+	}
+}
+
+/* Copies N 16bit samples from SRC to DST, swapping their bytes */
+static inline void spd_audio_swap16_copy(void *dst, const void *src, size_t n)
+{
+	unsigned char *d = dst;
+	const unsigned char *p = src;
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	for (; n - i >= 8; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + 2 * i));
+		v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *)(d + 2 * i), v);
+	}
+#elif defined(__ARM_NEON)
+	for (; n - i >= 8; i += 8)
+		vst1q_u8(d + 2 * i, vrev16q_u8(vld1q_u8(p + 2 * i)));
+#endif
+	for (; i < n; i++) {
+		d[2 * i] = p[2 * i + 1];
+		d[2 * i + 1] = p[2 * i];
+	}
+}
+
+/* Gain in 1/256th for an AudioID volume in <-100:100>, 256 at 100 */
+static inline int spd_audio_volume_gain(int volume)
+{
+	return (volume + 100) * 256 / 200;
+}
+
+/* Copies N native 16bit samples from SRC to DST, scaled by GAIN in
+ * 1/256th.  GAIN is at most 256, so the result cannot overflow.  */
+static inline void spd_audio_gain_s16(int16_t *dst, const int16_t *src,
+				      size_t n, int gain)
+{
+	size_t i = 0;
+
+	if (gain >= 256) {
+		memcpy(dst, src, n * sizeof(*src));
+		return;
+	}
+
+#if defined(__SSE2__)
+	{
+		__m128i g = _mm_set1_epi16(gain);
+
+		for (; n - i >= 8; i += 8) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+			__m128i lo = _mm_mullo_epi16(v, g);
+			__m128i hi = _mm_mulhi_epi16(v, g);
+			/* (v * g) >> 8 from the 32bit products */
+			v = _mm_or_si128(_mm_srli_epi16(lo, 8),
+					 _mm_slli_epi16(hi, 8));
+			_mm_storeu_si128((__m128i *)(dst + i), v);
+		}
+	}
+#elif defined(__ARM_NEON)
+	{
+		int16x4_t g = vdup_n_s16(gain);
+
+		for (; n - i >= 8; i += 8) {
+			int16x8_t v = vld1q_s16(src + i);
+			int32x4_t lo = vmull_s16(vget_low_s16(v), g);
+			int32x4_t hi = vmull_s16(vget_high_s16(v), g);
+			vst1q_s16(dst + i, vcombine_s16(vshrn_n_s32(lo, 8),
+							vshrn_n_s32(hi, 8)));
+		}
+	}
+#endif
+	for (; i < n; i++)
+		dst[i] = (src[i] * gain) >> 8;
+}
+
+/* Returns the sum of the products of N samples of A and B */
+static inline int32_t spd_audio_dot_s16(const int16_t *a, const int16_t *b,
+					size_t n)
+{
+	int32_t sum = 0;
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	{
+		__m128i acc = _mm_setzero_si128();
+
+		for (; n - i >= 8; i += 8)
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(
+				_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i))));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0x4e));
+		acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, 0xb1));
+		sum = _mm_cvtsi128_si32(acc);
+	}
+#elif defined(__ARM_NEON)
+	{
+		int32x4_t acc = vdupq_n_s32(0);
+
+		for (; n - i >= 8; i += 8) {
+			int16x8_t va = vld1q_s16(a + i);
+			int16x8_t vb = vld1q_s16(b + i);
+			acc = vmlal_s16(acc, vget_low_s16(va), vget_low_s16(vb));
+			acc = vmlal_s16(acc, vget_high_s16(va), vget_high_s16(vb));
+		}
+		sum = vgetq_lane_s32(acc, 0) + vgetq_lane_s32(acc, 1)
+			+ vgetq_lane_s32(acc, 2) + vgetq_lane_s32(acc, 3);
+	}
+#endif
+	for (a += i, b += i, n -= i; n; n--)
+		sum += *a++ * *b++;
+	return sum;
+}
+
+#endif /* not ifndef SPD_AUDIO_CONVERT_H */
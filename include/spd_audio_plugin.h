@@ -23,6 +23,13 @@
 
 #define SPD_AUDIO_PLUGIN_ENTRY_STR "spd_audio_plugin_get"
 
+/* Plugins which fill the entries of spd_audio_plugin_t after end() also
+   export this function, returning the SPD_AUDIO_PLUGIN_ABI they were built
+   with.  The tables of older plugins stop at end(), so the entries after
+   it are not looked at for plugins without it.  */
+#define SPD_AUDIO_PLUGIN_ABI_STR "spd_audio_plugin_abi"
+#define SPD_AUDIO_PLUGIN_ABI 1
+
 /* *INDENT-OFF* */
 #ifdef __cplusplus
 extern "C" {
@@ -80,6 +87,22 @@ typedef struct spd_audio_plugin {
 	/* Clean up audio after playback. Needs to drain the audio if this
 	   wasn't done already. */
 	int (*end)  (AudioID *id);
+
+	/* Since SPD_AUDIO_PLUGIN_ABI 1 */
+
+	/* Optional, provide both or none */
+	/* Feed track to audio and return without waiting for playback, only
+	   blocking while the audio buffers are full.
+	   bits, num_channels, and sample_rate shall be the same as during begin() call */
+	int (*feed_async) (AudioID *id, AudioTrack track);
+	/* Return the number of microseconds until the audio fed so far is
+	   heard completely, or a negative value on error */
+	int (*get_delay) (AudioID *id);
+
+	/* Optional */
+	/* Get how many times the device ran out of audio, and got suspended,
+	   since it was opened */
+	void (*get_xruns) (AudioID *id, int *xruns, int *suspends);
 } spd_audio_plugin_t;
 
 /* *INDENT-OFF* */
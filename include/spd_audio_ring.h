@@ -0,0 +1,55 @@
+/*
+ * spd_audio_ring.h - Shared-memory audio ring between modules and the server
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The server creates the ring and passes its shm name to the module with
+ * the AUDIO command.  The module is the only writer of head and the server
+ * the only writer of tail.  Both are free running byte counters, the
+ * position in the data is the counter modulo size, which is a power of two.
+ * A chunk of samples is never split across the end of the data, the module
+ * rather skips to the beginning.
+ */
+
+#ifndef SPD_AUDIO_RING_H
+#define SPD_AUDIO_RING_H
+
+#include <stdint.h>
+
+#define SPD_AUDIO_RING_MAGIC 0x53504452	/* "SPDR" */
+
+typedef struct SPDAudioRing {
+	uint32_t magic;
+	uint32_t size;		/* size of the data following the header */
+	uint32_t head;		/* bytes produced by the module */
+	uint32_t tail;		/* bytes consumed by the server */
+} SPDAudioRing;
+
+#define SPD_AUDIO_RING_DATA(ring) ((char *) (ring) + sizeof(SPDAudioRing))
+
+static inline uint32_t spd_audio_ring_get(const uint32_t *counter)
+{
+	return __atomic_load_n(counter, __ATOMIC_ACQUIRE);
+}
+
+static inline void spd_audio_ring_set(uint32_t *counter, uint32_t val)
+{
+	__atomic_store_n(counter, val, __ATOMIC_RELEASE);
+}
+
+#endif /* not ifndef SPD_AUDIO_RING_H */
@@ -79,6 +79,8 @@ typedef enum {
 	SPD_CANCEL = 8,
 	SPD_PAUSE = 16,
 	SPD_RESUME = 32,
+	/* Not about messages, so not part of SPD_ALL */
+	SPD_VOICES_CHANGED = 64,
 
 	SPD_ALL = 0x3f
 } SPDNotification;
@@ -26,6 +26,8 @@
 #include <sys/types.h>
 #include <wchar.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <sys/un.h>
@@ -40,6 +42,7 @@
 #include <ctype.h>
 #include <glib.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <assert.h>
 #include <netdb.h>
 
@@ -65,7 +68,14 @@ static FILE *spd_debug = NULL;
 #endif
 
 static int spd_set_priority(SPDConnection * connection, SPDPriority priority);
-static char *escape_dot(const char *text);
+static const char *spd_priority_name(SPDPriority priority);
+static int spd_send_data_pipelined(SPDConnection * connection,
+				   const char *message, int n, char **replies);
+static int send_escaped_text(SPDConnection * connection, const char *text);
+static char *spd_send_data_fd_wo_mutex(SPDConnection * connection,
+				       const char *message, int pass_fd,
+				       int wfr);
+static int writev_all(int fd, struct iovec *iov, int n);
 static int isanum(char *str);
 static char *get_reply(SPDConnection * connection);
 static int get_err_code(char *reply);
@@ -75,6 +85,11 @@ static int get_param_int(char *reply, int num, int *err);
 static int ret_ok(char *reply);
 static void SPD_DBG(char *format, ...);
 static void *spd_events_handler(void *);
+static void spd_async_stop(SPDConnection * connection);
+static char **spd_execute_command_with_cached_list_reply(SPDConnection *
+							 connection,
+							 const char *command);
+static void spd_lists_invalidate(SPDConnection * connection);
 
 static const int range_low = -100;
 static const int range_high = 100;
@@ -87,6 +102,42 @@ struct SPDConnection_threaddata {
 	pthread_mutex_t mutex_reply_ready;
 	pthread_cond_t cond_reply_ack;
 	pthread_mutex_t mutex_reply_ack;
+
+	/* Replies to LIST commands, see spd_set_list_cache() */
+	pthread_mutex_t mutex_lists;
+	GHashTable *lists;
+	unsigned int lists_generation;
+};
+
+/* Requests queued by the spd_*_async() functions */
+typedef enum {
+	SPD_ASYNC_SAY,
+	SPD_ASYNC_STOP,
+	SPD_ASYNC_CANCEL,
+	SPD_ASYNC_RATE,
+	SPD_ASYNC_PITCH,
+	SPD_ASYNC_VOLUME,
+	SPD_ASYNC_COMMAND
+} SPDAsyncOp;
+
+typedef struct {
+	int id;
+	SPDAsyncOp op;
+	SPDPriority priority;
+	char *text;
+	int value;
+	SPDAsyncCallback callback;
+	void *user_data;
+} SPDAsyncRequest;
+
+struct SPDConnection_asyncdata {
+	pthread_t thread;
+	gboolean running;
+	gboolean quit;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	GQueue requests;
+	int last_id;
 };
 
 /*
@@ -117,60 +168,35 @@ char *strndup(const char *s, size_t n)
 
 #define SPD_REPLY_BUF_SIZE 65536
 
-/** Read from the connection's buffer or socket until a newline is
-    read.  Return a pointer to the beginning of the data, and the
-    length of the data (including newline).  The returned value will
-    not be null-terminated, and will include the newline.  Note that
-    the returned pointer will only be valid until the next call to
-    get_line.
+/* Number of slices of text written at once by send_escaped_text() */
+#define SPD_TEXT_IOV 64
 
-    If, after SPD_REPLY_BUF_SIZE bytes, there is no newline (or in the
-    event of a read error) return NULL.
+/* From this size on spd_say() passes the text in a memfd when it can */
+#define SPD_SPEAK_FD_MIN_BYTES 65536
 
-    Unlike getline, this does not handle embedded \0 bytes.
+/** Read more data from the socket into the connection's buffer, after
+    moving what is still unparsed to its beginning.  Return FALSE on
+    errors and at the end of the connection.
 */
-static
-char *get_line(SPDConnection * conn, int *n)
+static gboolean get_more(SPDConnection * conn)
 {
-	int bytes;
-	int i;
-	char *ret = NULL;
-	int search_start = conn->buf_start;
-	int message_prefix_len;
-
-	while (1) {
-		for (i = search_start; i < conn->buf_used; i++) {
-			if (conn->buf[i] == '\n') {
-				*n = i + 1 - conn->buf_start;
-				ret = conn->buf + conn->buf_start;
-				conn->buf_start = i + 1;
-				return ret;
-			}
-		}
-
-		if (conn->buf_start != 0) {
-			message_prefix_len = conn->buf_used - conn->buf_start;
-			memmove(conn->buf, conn->buf + conn->buf_start,
-				message_prefix_len);
-			search_start = message_prefix_len;
-			conn->buf_used = message_prefix_len;
-			conn->buf_start = 0;
-		}
-
-		if (conn->buf_used == SPD_REPLY_BUF_SIZE) {
-			SPD_FATAL
-			    ("No newline after reading SPD_REPLY_BUF_SIZE");
-			return NULL;
-		}
+	ssize_t bytes;
 
-		bytes =
-		    read(conn->socket, conn->buf + conn->buf_used,
-			 SPD_REPLY_BUF_SIZE - conn->buf_used);
-		if (bytes == -1)
-			return NULL;
-		conn->buf_used += bytes;
+	if (conn->buf_start != 0) {
+		memmove(conn->buf, conn->buf + conn->buf_start,
+			conn->buf_used - conn->buf_start);
+		conn->buf_used -= conn->buf_start;
+		conn->buf_start = 0;
 	}
 
+	do
+		bytes = read(conn->socket, conn->buf + conn->buf_used,
+			     SPD_REPLY_BUF_SIZE - conn->buf_used);
+	while (bytes == -1 && errno == EINTR);
+	if (bytes <= 0)
+		return FALSE;
+	conn->buf_used += bytes;
+	return TRUE;
 }
 
 /* --------------------- Public functions ------------------------- */
@@ -548,6 +574,7 @@ SPDConnection *spd_open2(const char *client_name, const char *connection_name,
 	connection->callback_pause = NULL;
 	connection->callback_resume = NULL;
 	connection->callback_cancel = NULL;
+	connection->callback_audio = NULL;
 
 	connection->mode = mode;
 
@@ -568,6 +595,12 @@ SPDConnection *spd_open2(const char *client_name, const char *connection_name,
 
 	pthread_mutex_init(&connection->ssip_mutex, NULL);
 
+	connection->async = NULL;
+
+	/* File descriptors can only be passed over the Unix socket */
+	connection->no_speak_fd =
+	    (address->method != SPD_METHOD_UNIX_SOCKET);
+
 	if (mode == SPD_MODE_THREADED) {
 		SPD_DBG
 		    ("Initializing threads, condition variables and mutexes...");
@@ -576,6 +609,9 @@ SPDConnection *spd_open2(const char *client_name, const char *connection_name,
 		pthread_mutex_init(&connection->td->mutex_reply_ready, NULL);
 		pthread_cond_init(&connection->td->cond_reply_ack, NULL);
 		pthread_mutex_init(&connection->td->mutex_reply_ack, NULL);
+		pthread_mutex_init(&connection->td->mutex_lists, NULL);
+		connection->td->lists = NULL;
+		connection->td->lists_generation = 0;
 		ret =
 		    pthread_create(&connection->td->events_thread, NULL,
 				   spd_events_handler, connection);
@@ -627,6 +663,9 @@ int spd_get_client_id(SPDConnection * connection)
 void spd_close(SPDConnection * connection)
 {
 
+	/* The async thread takes ssip_mutex itself, so stop it first */
+	spd_async_stop(connection);
+
 	pthread_mutex_lock(&connection->ssip_mutex);
 
 	if (connection->mode == SPD_MODE_THREADED) {
@@ -636,6 +675,9 @@ void spd_close(SPDConnection * connection)
 		pthread_cond_destroy(&connection->td->cond_reply_ready);
 		pthread_cond_destroy(&connection->td->cond_reply_ack);
 		pthread_join(connection->td->events_thread, NULL);
+		if (connection->td->lists)
+			g_hash_table_destroy(connection->td->lists);
+		pthread_mutex_destroy(&connection->td->mutex_lists);
 		connection->mode = SPD_MODE_SINGLE;
 		free(connection->td);
 	}
@@ -656,29 +698,21 @@ void spd_close(SPDConnection * connection)
 /* Helper functions for spd_say. */
 static inline int
 spd_say_prepare(SPDConnection * connection, SPDPriority priority,
-		const char *text, char **escaped_text)
+		const char *text)
 {
 	int ret = 0;
 
 	SPD_DBG("Text to say is: %s", text);
 
-	/* Insure that there is no escape sequence in the text */
-	*escaped_text = escape_dot(text);
-	/* Caller is now responsible for escaped_text. */
-	if (*escaped_text == NULL) {	/* Out of memory. */
-		SPD_DBG("spd_say could not allocate memory.");
-		ret = -1;
-	} else {
-		/* Set priority */
-		SPD_DBG("Setting priority");
-		ret = spd_set_priority(connection, priority);
-		if (!ret) {
-			/* Start the data flow */
-			SPD_DBG("Sending SPEAK");
-			ret = spd_execute_command_wo_mutex(connection, "speak");
-			if (ret) {
-				SPD_DBG("Error: Can't start data flow!");
-			}
+	/* Set priority */
+	SPD_DBG("Setting priority");
+	ret = spd_set_priority(connection, priority);
+	if (!ret) {
+		/* Start the data flow */
+		SPD_DBG("Sending SPEAK");
+		ret = spd_execute_command_wo_mutex(connection, "speak");
+		if (ret) {
+			SPD_DBG("Error: Can't start data flow!");
 		}
 	}
 
@@ -690,13 +724,11 @@ static inline int spd_say_sending(SPDConnection * connection, const char *text)
 	int msg_id = -1;
 	int err = 0;
 	char *reply = NULL;
-	char *pret = NULL;
 
-	/* Send data */
+	/* Send data, making sure that there is no escape sequence in it */
 	SPD_DBG("Sending data");
-	pret = spd_send_data_wo_mutex(connection, text, SPD_NO_REPLY);
-	if (pret == NULL) {
-		SPD_DBG("Can't send data wo mutex");
+	if (send_escaped_text(connection, text)) {
+		SPD_DBG("Can't send data");
 	} else {
 		/* Terminate data flow */
 		SPD_DBG("Terminating data flow");
@@ -715,7 +747,80 @@ static inline int spd_say_sending(SPDConnection * connection, const char *text)
 	}
 
 	free(reply);
-	free(pret);
+	return msg_id;
+}
+
+/* Copy the LEN bytes of TEXT into a new sealed memfd for SPEAK_FD.
+ * Returns the memfd, or -1 if it can't be created. */
+static int spd_text_memfd(const char *text, size_t len)
+{
+#ifdef HAVE_MEMFD_CREATE
+	int fd;
+	size_t done = 0;
+
+	fd = memfd_create("speechd-text", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		return -1;
+
+	while (done < len) {
+		ssize_t n = write(fd, text + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			close(fd);
+			return -1;
+		}
+		done += n;
+	}
+
+	if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE
+		  | F_SEAL_SEAL) < 0) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+#else
+	return -1;
+#endif
+}
+
+/* Send SPEAK_FD with FD passed along.  Returns msg_uid on success, -1
+ * otherwise; if the server doesn't know SPEAK_FD, the connection stops
+ * trying it. */
+static int
+spd_say_fd_wo_mutex(SPDConnection * connection, SPDPriority priority, int fd,
+		    size_t bytes)
+{
+	char *command;
+	char *reply;
+	int msg_id = -1;
+	int err;
+
+	if (spd_set_priority(connection, priority))
+		return -1;
+
+	command = g_strdup_printf("SPEAK_FD %lu\r\n", (unsigned long)bytes);
+	reply = spd_send_data_fd_wo_mutex(connection, command, fd,
+					  SPD_WAIT_REPLY);
+	g_free(command);
+	if (reply == NULL)
+		return -1;
+
+	if (ret_ok(reply)) {
+		msg_id = get_param_int(reply, 1, &err);
+		if (err < 0) {
+			SPD_DBG
+			    ("Can't determine SSIP message unique ID parameter.");
+			msg_id = -1;
+		}
+	} else if (get_err_code(reply) == 500 || get_err_code(reply) == 380) {
+		/* Unknown command, or known but not available on that system */
+		SPD_DBG("The server doesn't support SPEAK_FD");
+		connection->no_speak_fd = 1;
+	}
+
+	free(reply);
 	return msg_id;
 }
 
@@ -723,19 +828,35 @@ static inline int spd_say_sending(SPDConnection * connection, const char *text)
  * Returns msg_uid on success, -1 otherwise. */
 int spd_say(SPDConnection * connection, SPDPriority priority, const char *text)
 {
-	char *escaped_text = NULL;
 	int msg_id = -1;
 	int prepare_failed = 0;
 
 	if (text != NULL) {
+		size_t len = strlen(text);
+
 		pthread_mutex_lock(&connection->ssip_mutex);
 
-		prepare_failed =
-		    spd_say_prepare(connection, priority, text, &escaped_text);
+		/* Large texts are cheaper to hand over in shared memory,
+		   without escaping and socket copies */
+		if (!connection->no_speak_fd && len >= SPD_SPEAK_FD_MIN_BYTES) {
+			int fd = spd_text_memfd(text, len);
+			if (fd >= 0) {
+				msg_id = spd_say_fd_wo_mutex(connection,
+							     priority, fd,
+							     len);
+				close(fd);
+				if (!connection->no_speak_fd) {
+					pthread_mutex_unlock
+					    (&connection->ssip_mutex);
+					return msg_id;
+				}
+			}
+		}
+
+		prepare_failed = spd_say_prepare(connection, priority, text);
 		if (!prepare_failed)
-			msg_id = spd_say_sending(connection, escaped_text);
+			msg_id = spd_say_sending(connection, text);
 
-		free(escaped_text);
 		pthread_mutex_unlock(&connection->ssip_mutex);
 	} else {
 		SPD_DBG("spd_say called with a NULL argument for <text>");
@@ -745,6 +866,149 @@ int spd_say(SPDConnection * connection, SPDPriority priority, const char *text)
 	return msg_id;
 }
 
+/* Have the audio of the next messages sent to callback_audio instead of
+ * being played, or played again.  Events are only read in threaded mode.
+ * Returns 0 on success, -1 otherwise. */
+int spd_set_audio_retrieval(SPDConnection * connection, int enable)
+{
+	char command[40];
+
+	if (connection->mode != SPD_MODE_THREADED)
+		return -1;
+
+	sprintf(command, "SET SELF AUDIO_RETRIEVAL %s", enable ? "on" : "off");
+	return spd_execute_command(connection, command);
+}
+
+/* Say the first BYTES of the sealed memfd FD with priority PRIORITY.
+ * FD stays open and owned by the caller.
+ * Returns msg_uid on success, -1 otherwise. */
+int
+spd_say_memfd(SPDConnection * connection, SPDPriority priority, int fd,
+	      size_t bytes)
+{
+	int msg_id;
+
+	if (fd < 0 || connection->no_speak_fd)
+		return -1;
+
+	pthread_mutex_lock(&connection->ssip_mutex);
+	msg_id = spd_say_fd_wo_mutex(connection, priority, fd, bytes);
+	pthread_mutex_unlock(&connection->ssip_mutex);
+
+	return msg_id;
+}
+
+/* Say TEXT with priority PRIORITY after applying SETTINGS.  The settings,
+ * the priority and the SPEAK command are sent in one write, so that this
+ * costs two round trips to the server whatever the number of settings.
+ * Returns msg_uid on success, -1 otherwise. */
+int
+spd_say_with_settings(SPDConnection * connection, SPDPriority priority,
+		      const SPDSettings * settings, const char *text)
+{
+	static const char *const punct_names[] = {
+		"all", "none", "some", "most"
+	};
+	static const char *const voice_names[] = {
+		NULL, "MALE1", "MALE2", "MALE3", "FEMALE1", "FEMALE2",
+		"FEMALE3", "CHILD_MALE", "CHILD_FEMALE"
+	};
+	char *replies[16];
+	char *reply = NULL;
+	const char *p_name;
+	unsigned int set;
+	GString *commands;
+	int n = 0;
+	int got;
+	int failed = 0;
+	int msg_id = -1;
+	int i;
+
+	if (text == NULL)
+		return -1;
+	p_name = spd_priority_name(priority);
+	if (p_name == NULL)
+		return -1;
+
+	set = settings ? settings->set : 0;
+	commands = g_string_new(NULL);
+
+#define INT_SETTING(flag, name, val) \
+	if (set & (flag)) { \
+		if ((val) < range_low || (val) > range_high) \
+			goto invalid; \
+		g_string_append_printf(commands, "SET SELF %s %d\r\n", \
+				       name, val); \
+		n++; \
+	}
+#define STR_SETTING(flag, name, val) \
+	if (set & (flag)) { \
+		if ((val) == NULL) \
+			goto invalid; \
+		g_string_append_printf(commands, "SET SELF %s %s\r\n", \
+				       name, val); \
+		n++; \
+	}
+
+	INT_SETTING(SPD_SETTING_RATE, SPD_RATE, settings->rate);
+	INT_SETTING(SPD_SETTING_PITCH, SPD_PITCH, settings->pitch);
+	INT_SETTING(SPD_SETTING_VOLUME, SPD_VOLUME, settings->volume);
+	STR_SETTING(SPD_SETTING_LANGUAGE, SPD_LANGUAGE, settings->language);
+	STR_SETTING(SPD_SETTING_PUNCTUATION, "PUNCTUATION",
+		    (settings->punctuation >= 0
+		     && settings->punctuation < G_N_ELEMENTS(punct_names))
+		    ? punct_names[settings->punctuation] : NULL);
+	STR_SETTING(SPD_SETTING_VOICE_TYPE, "VOICE_TYPE",
+		    (settings->voice_type > 0
+		     && settings->voice_type < G_N_ELEMENTS(voice_names))
+		    ? voice_names[settings->voice_type] : NULL);
+	STR_SETTING(SPD_SETTING_SYNTHESIS_VOICE, SPD_SYNTHESIS_VOICE,
+		    settings->synthesis_voice);
+
+#undef INT_SETTING
+#undef STR_SETTING
+
+	g_string_append_printf(commands, "SET SELF PRIORITY %s\r\n", p_name);
+	g_string_append(commands, "SPEAK\r\n");
+	n += 2;
+
+	pthread_mutex_lock(&connection->ssip_mutex);
+
+	got = spd_send_data_pipelined(connection, commands->str, n, replies);
+	for (i = 0; i < got; i++) {
+		if (!ret_ok(replies[i])) {
+			SPD_DBG("Command failed: %s", replies[i]);
+			failed = 1;
+		}
+	}
+
+	if (got == n && ret_ok(replies[n - 1])) {
+		if (!failed) {
+			msg_id = spd_say_sending(connection, text);
+		} else {
+			/* Do not speak with wrong settings, an empty
+			   message is dropped by the server */
+			spd_execute_command_with_reply(connection, ".",
+						       &reply);
+			free(reply);
+		}
+	}
+
+	pthread_mutex_unlock(&connection->ssip_mutex);
+
+	for (i = 0; i < got; i++)
+		free(replies[i]);
+	g_string_free(commands, TRUE);
+
+	return msg_id;
+
+invalid:
+	SPD_DBG("Error: Invalid setting in spd_say_with_settings");
+	g_string_free(commands, TRUE);
+	return -1;
+}
+
 /* The same as spd_say, accepts also formatted strings */
 int
 spd_sayf(SPDConnection * connection, SPDPriority priority, const char *format,
@@ -1339,8 +1603,10 @@ char *spd_get_language(SPDConnection * connection)
 }
 
 // Set functions for output_module
+/* The synthesis voices listed depend on the output module */
 int spd_set_output_module(SPDConnection * connection, const char *output_module)
 {
+	spd_lists_invalidate(connection);
 	return spd_w_set_command_str(connection, SPD_OUTPUT_MODULE,
 				     output_module, SPD_SELF);
 }
@@ -1348,6 +1614,7 @@ int spd_set_output_module(SPDConnection * connection, const char *output_module)
 int spd_set_output_module_all(SPDConnection * connection,
 			      const char *output_module)
 {
+	spd_lists_invalidate(connection);
 	return spd_w_set_command_str(connection, SPD_OUTPUT_MODULE,
 				     output_module, SPD_ALLCLIENTS);
 }
@@ -1462,8 +1729,8 @@ char **spd_list_modules(SPDConnection * connection)
 {
 	char **available_modules;
 	available_modules =
-	    spd_execute_command_with_list_reply(connection,
-						"LIST OUTPUT_MODULES");
+	    spd_execute_command_with_cached_list_reply(connection,
+						       "LIST OUTPUT_MODULES");
 	return available_modules;
 }
 
@@ -1480,7 +1747,9 @@ void free_spd_modules(char **modules)
 char **spd_list_voices(SPDConnection * connection)
 {
 	char **voices;
-	voices = spd_execute_command_with_list_reply(connection, "LIST VOICES");
+	voices =
+	    spd_execute_command_with_cached_list_reply(connection,
+						       "LIST VOICES");
 	return voices;
 }
 
@@ -1504,7 +1773,8 @@ SPDVoice **spd_list_synthesis_voices2(SPDConnection * connection, const char *la
 					language ? language : "",
 					language && variant ? " " : "",
 					variant ? variant : "");
-	svoices_str = spd_execute_command_with_list_reply(connection, command);
+	svoices_str =
+	    spd_execute_command_with_cached_list_reply(connection, command);
 	free(command);
 
 	if (svoices_str == NULL)
@@ -1590,6 +1860,120 @@ char **spd_execute_command_with_list_reply(SPDConnection * connection,
 	return result;
 }
 
+static void spd_list_free(gpointer data)
+{
+	char **list = data;
+	int i;
+
+	for (i = 0; list[i] != NULL; i++)
+		free(list[i]);
+	free(list);
+}
+
+static char **spd_list_copy(char **list)
+{
+	char **copy;
+	int n;
+	int i;
+
+	for (n = 0; list[n] != NULL; n++) ;
+	copy = malloc((n + 1) * sizeof(char *));
+	for (i = 0; i < n; i++)
+		copy[i] = strdup(list[i]);
+	copy[n] = NULL;
+
+	return copy;
+}
+
+/* Drop the cached lists, they will be asked again when needed */
+static void spd_lists_invalidate(SPDConnection * connection)
+{
+	struct SPDConnection_threaddata *td;
+
+	if (connection->mode != SPD_MODE_THREADED)
+		return;
+	td = connection->td;
+
+	pthread_mutex_lock(&td->mutex_lists);
+	td->lists_generation++;
+	if (td->lists)
+		g_hash_table_remove_all(td->lists);
+	pthread_mutex_unlock(&td->mutex_lists);
+}
+
+/* Like spd_execute_command_with_list_reply, but answered from the cache
+   when spd_set_list_cache() enabled it */
+static char **spd_execute_command_with_cached_list_reply(SPDConnection *
+							 connection,
+							 const char *command)
+{
+	struct SPDConnection_threaddata *td;
+	unsigned int generation;
+	char **list;
+
+	if (connection->mode != SPD_MODE_THREADED)
+		return spd_execute_command_with_list_reply(connection, command);
+	td = connection->td;
+
+	pthread_mutex_lock(&td->mutex_lists);
+	if (td->lists == NULL) {
+		pthread_mutex_unlock(&td->mutex_lists);
+		return spd_execute_command_with_list_reply(connection, command);
+	}
+	list = g_hash_table_lookup(td->lists, command);
+	if (list != NULL) {
+		list = spd_list_copy(list);
+		pthread_mutex_unlock(&td->mutex_lists);
+		SPD_DBG("Cached reply to %s", command);
+		return list;
+	}
+	generation = td->lists_generation;
+	pthread_mutex_unlock(&td->mutex_lists);
+
+	list = spd_execute_command_with_list_reply(connection, command);
+	if (list == NULL)
+		return NULL;
+
+	/* Unless it changed while we were asking */
+	pthread_mutex_lock(&td->mutex_lists);
+	if (td->lists && td->lists_generation == generation)
+		g_hash_table_replace(td->lists, g_strdup(command),
+				     spd_list_copy(list));
+	pthread_mutex_unlock(&td->mutex_lists);
+
+	return list;
+}
+
+int spd_set_list_cache(SPDConnection * connection, int enable)
+{
+	struct SPDConnection_threaddata *td;
+	int ret;
+
+	/* The changes are reported as events */
+	if (connection->mode != SPD_MODE_THREADED)
+		return -1;
+	td = connection->td;
+
+	ret = spd_execute_command(connection, enable ?
+				  "SET SELF NOTIFICATION voices_changed on" :
+				  "SET SELF NOTIFICATION voices_changed off");
+	if (ret)
+		return -1;
+
+	pthread_mutex_lock(&td->mutex_lists);
+	td->lists_generation++;
+	if (enable && td->lists == NULL) {
+		td->lists = g_hash_table_new_full(g_str_hash, g_str_equal,
+						  g_free, spd_list_free);
+	} else if (!enable && td->lists != NULL) {
+		g_hash_table_destroy(td->lists);
+		td->lists = NULL;
+	}
+	pthread_mutex_unlock(&td->mutex_lists);
+
+	return 0;
+}
+
 //int
 //spd_get_client_list(SPDConnection *connection, char **client_names, int *client_ids, int* active){
 //        SPD_DBG("spd_get_client_list: History is not yet implemented.");
@@ -1708,6 +2092,50 @@ char *spd_send_data(SPDConnection * connection, const char *message, int wfr)
 char *spd_send_data_wo_mutex(SPDConnection * connection, const char *message,
 			     int wfr)
 {
+	return spd_send_data_fd_wo_mutex(connection, message, -1, wfr);
+}
+
+/* Write MESSAGE to the socket in one sendmsg() passing PASS_FD along */
+static int send_with_fd(int socket, const char *message, int pass_fd)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} control;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	iov.iov_base = (void *)message;
+	iov.iov_len = strlen(message);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+
+	do
+		n = sendmsg(socket, &msg, MSG_NOSIGNAL);
+	while (n < 0 && errno == EINTR);
+	if (n < 0)
+		return -1;
+
+	/* The descriptor went with the first byte, write the rest as usual */
+	iov.iov_base = (char *)message + n;
+	iov.iov_len -= n;
+	return iov.iov_len > 0 ? writev_all(socket, &iov, 1) : 0;
+}
+
+static char *spd_send_data_fd_wo_mutex(SPDConnection * connection,
+				       const char *message, int pass_fd,
+				       int wfr)
+{
 
 	char *reply;
 	int bytes;
@@ -1724,7 +2152,8 @@ char *spd_send_data_wo_mutex(SPDConnection * connection, const char *message,
 	}
 	/* write message to the socket */
 	SPD_DBG("Writing to socket");
-	if (!write(connection->socket, message, strlen(message))) {
+	if (pass_fd >= 0 ? send_with_fd(connection->socket, message, pass_fd)
+	    : !write(connection->socket, message, strlen(message))) {
 		SPD_DBG("Can't write to socket: %s", strerror(errno));
 		if (connection->mode == SPD_MODE_THREADED)
 			pthread_mutex_unlock(&connection->td->mutex_reply_ready);
@@ -1785,30 +2214,324 @@ char *spd_send_data_wo_mutex(SPDConnection * connection, const char *message,
 	return reply;
 }
 
-/* --------------------- Internal functions ------------------------- */
+/* Write MESSAGE, made of N complete commands, at once and collect their N
+   replies into REPLIES, which the caller frees.  Returns the number of
+   replies read, less than N if the connection broke. */
+static int spd_send_data_pipelined(SPDConnection * connection,
+				   const char *message, int n, char **replies)
+{
+	size_t len = strlen(message);
+	size_t done = 0;
+	ssize_t ret;
+	char *reply;
+	int ok;
+	int i;
 
-static int spd_set_priority(SPDConnection * connection, SPDPriority priority)
+	if (connection->socket < 0)
+		return 0;
+
+	if (connection->mode == SPD_MODE_THREADED)
+		pthread_mutex_lock(&connection->td->mutex_reply_ready);
+
+	while (done < len) {
+		ret = write(connection->socket, message + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			SPD_DBG("Can't write to socket: %s", strerror(errno));
+			if (connection->mode == SPD_MODE_THREADED)
+				pthread_mutex_unlock(&connection->td->
+						     mutex_reply_ready);
+			return 0;
+		}
+		done += ret;
+	}
+	SPD_DBG(">> : |%s|", message);
+
+	for (i = 0; i < n; i++) {
+		if (connection->mode == SPD_MODE_THREADED) {
+			pthread_cond_wait(&connection->td->cond_reply_ready,
+					  &connection->td->mutex_reply_ready);
+			pthread_mutex_unlock(&connection->td->mutex_reply_ready);
+			pthread_mutex_lock(&connection->td->mutex_reply_ack);
+			reply = connection->reply;
+			connection->reply = NULL;
+			ok = reply != NULL && reply[0] != '\0';
+			/* Take mutex_reply_ready back before spd_events_handler
+			   is let go, so that the next reply is not signalled
+			   before we wait for it */
+			if (ok && i + 1 < n)
+				pthread_mutex_lock(&connection->td->
+						   mutex_reply_ready);
+			if (reply != NULL)
+				pthread_cond_signal(&connection->td->
+						    cond_reply_ack);
+			pthread_mutex_unlock(&connection->td->mutex_reply_ack);
+			if (!ok) {
+				SPD_DBG("Error: Can't read reply, broken socket.");
+				free(reply);
+				break;
+			}
+		} else {
+			reply = get_reply(connection);
+			if (reply == NULL)
+				break;
+		}
+		SPD_DBG("<< : |%s|\n", reply);
+		replies[i] = reply;
+	}
+
+	return i;
+}
+
+/* Asynchronous requests.  They are run in order by one thread per
+   connection through the synchronous functions above, so that SSIP
+   exchanges (notably the several steps of SPEAK) are never interleaved
+   and replies in threaded mode still come through spd_events_handler. */
+
+/* Guards the creation and removal of connection->async */
+static pthread_mutex_t spd_async_init_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void spd_async_free_request(SPDAsyncRequest * request)
 {
-	static char p_name[16];
-	static char command[64];
+	g_free(request->text);
+	g_free(request);
+}
 
+static int spd_async_run(SPDConnection * connection, SPDAsyncRequest * request)
+{
+	switch (request->op) {
+	case SPD_ASYNC_SAY:
+		return spd_say(connection, request->priority, request->text);
+	case SPD_ASYNC_STOP:
+		return spd_stop(connection);
+	case SPD_ASYNC_CANCEL:
+		return spd_cancel(connection);
+	case SPD_ASYNC_RATE:
+		return spd_set_voice_rate(connection, request->value);
+	case SPD_ASYNC_PITCH:
+		return spd_set_voice_pitch(connection, request->value);
+	case SPD_ASYNC_VOLUME:
+		return spd_set_volume(connection, request->value);
+	case SPD_ASYNC_COMMAND:
+		return spd_execute_command(connection, request->text);
+	}
+	return -1;
+}
+
+static void *spd_async_thread(void *conn)
+{
+	SPDConnection *connection = conn;
+	struct SPDConnection_asyncdata *async = connection->async;
+	SPDAsyncRequest *request;
+	int ret;
+
+	pthread_mutex_lock(&async->mutex);
+	while (1) {
+		while (!async->quit && g_queue_is_empty(&async->requests))
+			pthread_cond_wait(&async->cond, &async->mutex);
+		if (async->quit)
+			break;
+		request = g_queue_pop_head(&async->requests);
+		pthread_mutex_unlock(&async->mutex);
+
+		SPD_DBG("Running asynchronous request %d", request->id);
+		ret = spd_async_run(connection, request);
+		if (request->callback)
+			request->callback(connection, request->id, ret,
+					  request->user_data);
+		spd_async_free_request(request);
+
+		pthread_mutex_lock(&async->mutex);
+	}
+	pthread_mutex_unlock(&async->mutex);
+
+	return NULL;
+}
+
+/* Returns the async data of CONNECTION, starting its thread if needed */
+static struct SPDConnection_asyncdata *spd_async_get(SPDConnection *
+						     connection)
+{
+	struct SPDConnection_asyncdata *async;
+
+	pthread_mutex_lock(&spd_async_init_mutex);
+	async = connection->async;
+	if (async == NULL) {
+		async = g_malloc0(sizeof(*async));
+		pthread_mutex_init(&async->mutex, NULL);
+		pthread_cond_init(&async->cond, NULL);
+		g_queue_init(&async->requests);
+		connection->async = async;
+	}
+	if (!async->running) {
+		if (pthread_create(&async->thread, NULL, spd_async_thread,
+				   connection) != 0) {
+			SPD_DBG("Could not start the asynchronous thread");
+			async = NULL;
+		} else {
+			async->running = TRUE;
+		}
+	}
+	pthread_mutex_unlock(&spd_async_init_mutex);
+
+	return async;
+}
+
+/* Stops the async thread of CONNECTION.  Requests which were not sent yet
+   are dropped, and their callbacks are called with -1 so that the
+   callers can release their user data. */
+static void spd_async_stop(SPDConnection * connection)
+{
+	struct SPDConnection_asyncdata *async;
+	SPDAsyncRequest *request;
+
+	pthread_mutex_lock(&spd_async_init_mutex);
+	async = connection->async;
+	connection->async = NULL;
+	pthread_mutex_unlock(&spd_async_init_mutex);
+
+	if (async == NULL)
+		return;
+
+	pthread_mutex_lock(&async->mutex);
+	async->quit = TRUE;
+	pthread_cond_signal(&async->cond);
+	pthread_mutex_unlock(&async->mutex);
+
+	if (async->running)
+		pthread_join(async->thread, NULL);
+
+	while ((request = g_queue_pop_head(&async->requests))) {
+		if (request->callback)
+			request->callback(connection, request->id, -1,
+					  request->user_data);
+		spd_async_free_request(request);
+	}
+
+	pthread_mutex_destroy(&async->mutex);
+	pthread_cond_destroy(&async->cond);
+	g_free(async);
+}
+
+static int spd_async_queue(SPDConnection * connection, SPDAsyncOp op,
+			   SPDPriority priority, const char *text, int value,
+			   SPDAsyncCallback callback, void *user_data)
+{
+	struct SPDConnection_asyncdata *async;
+	SPDAsyncRequest *request;
+	int id;
+
+	async = spd_async_get(connection);
+	if (async == NULL)
+		return -1;
+
+	request = g_malloc0(sizeof(*request));
+	request->op = op;
+	request->priority = priority;
+	request->text = g_strdup(text);
+	request->value = value;
+	request->callback = callback;
+	request->user_data = user_data;
+
+	pthread_mutex_lock(&async->mutex);
+	/* Ids stay positive, even when wrapping */
+	if (async->last_id == G_MAXINT)
+		async->last_id = 0;
+	id = request->id = ++async->last_id;
+	g_queue_push_tail(&async->requests, request);
+	pthread_cond_signal(&async->cond);
+	pthread_mutex_unlock(&async->mutex);
+
+	return id;
+}
+
+int
+spd_say_async(SPDConnection * connection, SPDPriority priority,
+	      const char *text, SPDAsyncCallback callback, void *user_data)
+{
+	if (text == NULL)
+		return -1;
+	return spd_async_queue(connection, SPD_ASYNC_SAY, priority, text, 0,
+			       callback, user_data);
+}
+
+int
+spd_stop_async(SPDConnection * connection, SPDAsyncCallback callback,
+	       void *user_data)
+{
+	return spd_async_queue(connection, SPD_ASYNC_STOP, 0, NULL, 0,
+			       callback, user_data);
+}
+
+int
+spd_cancel_async(SPDConnection * connection, SPDAsyncCallback callback,
+		 void *user_data)
+{
+	return spd_async_queue(connection, SPD_ASYNC_CANCEL, 0, NULL, 0,
+			       callback, user_data);
+}
+
+int
+spd_set_voice_rate_async(SPDConnection * connection, signed int rate,
+			 SPDAsyncCallback callback, void *user_data)
+{
+	return spd_async_queue(connection, SPD_ASYNC_RATE, 0, NULL, rate,
+			       callback, user_data);
+}
+
+int
+spd_set_voice_pitch_async(SPDConnection * connection, signed int pitch,
+			  SPDAsyncCallback callback, void *user_data)
+{
+	return spd_async_queue(connection, SPD_ASYNC_PITCH, 0, NULL, pitch,
+			       callback, user_data);
+}
+
+int
+spd_set_volume_async(SPDConnection * connection, signed int volume,
+		     SPDAsyncCallback callback, void *user_data)
+{
+	return spd_async_queue(connection, SPD_ASYNC_VOLUME, 0, NULL, volume,
+			       callback, user_data);
+}
+
+int
+spd_execute_command_async(SPDConnection * connection, const char *command,
+			  SPDAsyncCallback callback, void *user_data)
+{
+	if (command == NULL)
+		return -1;
+	return spd_async_queue(connection, SPD_ASYNC_COMMAND, 0, command, 0,
+			       callback, user_data);
+}
+
+/* --------------------- Internal functions ------------------------- */
+
+static const char *spd_priority_name(SPDPriority priority)
+{
 	switch (priority) {
 	case SPD_IMPORTANT:
-		strcpy(p_name, "IMPORTANT");
-		break;
+		return "IMPORTANT";
 	case SPD_MESSAGE:
-		strcpy(p_name, "MESSAGE");
-		break;
+		return "MESSAGE";
 	case SPD_TEXT:
-		strcpy(p_name, "TEXT");
-		break;
+		return "TEXT";
 	case SPD_NOTIFICATION:
-		strcpy(p_name, "NOTIFICATION");
-		break;
+		return "NOTIFICATION";
 	case SPD_PROGRESS:
-		strcpy(p_name, "PROGRESS");
-		break;
-	default:
+		return "PROGRESS";
+	}
+	return NULL;
+}
+
+static int spd_set_priority(SPDConnection * connection, SPDPriority priority)
+{
+	const char *p_name;
+	char command[64];
+
+	p_name = spd_priority_name(priority);
+	if (p_name == NULL) {
 		SPD_DBG("Error: Can't set priority! Incorrect value.");
 		return -1;
 	}
@@ -1824,54 +2547,126 @@ struct get_reply_data {
 static void get_reply_cleanup(void *arg)
 {
 	struct get_reply_data *data = arg;
-	g_string_free(data->str, TRUE);
+	if (data->str)
+		g_string_free(data->str, TRUE);
 }
 
+/* Read a whole reply, up to its line without '-' after the numcode.
+   Lines are only looked for in the connection buffer, and the reply is
+   copied out of it at once, unless it does not fit in the buffer: its
+   complete lines are then moved to a string as the buffer fills up.  */
 static char *get_reply(SPDConnection * connection)
 {
-	char *reply;
-	char *line;
-	int n;
-	gboolean errors = FALSE;
+	char *reply = NULL;
+	char *line, *nl;
+	size_t scanned = 0;	/* bytes of complete lines from buf_start */
+	size_t raw = 0;		/* bytes of audio samples still to come */
+	size_t n;
 	struct get_reply_data data;
 
-	data.str = g_string_new("");
+	data.str = NULL;
 
 	pthread_cleanup_push(get_reply_cleanup, &data);
 
-	/* Wait for activity on the socket, when there is some,
-	   read all the message line by line */
-	do {
-		line = get_line(connection, &n);
-		if (line == NULL) {
+	while (1) {
+		line = connection->buf + connection->buf_start + scanned;
+		if (raw > 0) {
+			/* Samples of a 707 event, which may contain anything */
+			n = connection->buf + connection->buf_used - line;
+			if (n > raw)
+				n = raw;
+			scanned += n;
+			raw -= n;
+			if (raw == 0)
+				continue;
+		} else if ((nl = memchr(line, '\n',
+				      connection->buf + connection->buf_used
+				      - line))) {
+			n = nl + 1 - line;
+			scanned += n;
+			if (n > 8 && !strncmp(line, "707-RAW ", 8)
+			    && sscanf(line, "707-RAW %*d %*d %*d %*d %*d %zu",
+				      &raw) != 1)
+				raw = 0;
+			if (n < 4 || line[3] == ' ')
+				break;
+			continue;
+		}
+
+		if (connection->buf_used - connection->buf_start
+		    == SPD_REPLY_BUF_SIZE) {
+			if (scanned == 0) {
+				SPD_FATAL
+				    ("No newline after reading SPD_REPLY_BUF_SIZE");
+				break;
+			}
+			/* Make room, this reply is a big one */
+			if (!data.str)
+				data.str = g_string_sized_new(2 * SPD_REPLY_BUF_SIZE);
+			g_string_append_len(data.str,
+					    connection->buf + connection->buf_start,
+					    scanned);
+			connection->buf_start += scanned;
+			scanned = 0;
+		}
+
+		/* Wait for activity on the socket */
+		if (!get_more(connection)) {
 			SPD_DBG
 			    ("Error: Can't read reply, broken socket in get_reply!");
 			if (connection->socket >= 0) {
 				close(connection->socket);
 				connection->socket = -1;
 			}
-			errors = TRUE;
-		} else {
-			g_string_append_len(data.str, line, n);
+			scanned = 0;
+			break;
 		}
-		/* terminate if we reached the last line (without '-' after numcode) */
-	} while (!errors && n >= 4 && line[3] != ' ');
+	}
 
 	pthread_cleanup_pop(0);
 
-	if (errors) {
-		/* Free the GString and its character data, and return NULL. */
-		g_string_free(data.str, TRUE);
-		reply = NULL;
-	} else {
-		/* The resulting message received from the socket is stored in reply */
+	if (scanned == 0) {
+		if (data.str)
+			g_string_free(data.str, TRUE);
+	} else if (data.str) {
+		g_string_append_len(data.str,
+				    connection->buf + connection->buf_start,
+				    scanned);
 		/* Free the GString, but not its character data. */
 		reply = g_string_free(data.str, FALSE);
+	} else {
+		/* Not g_strndup(), audio samples may contain zeros */
+		reply = g_malloc(scanned + 1);
+		memcpy(reply, connection->buf + connection->buf_start, scanned);
+		reply[scanned] = '\0';
 	}
+	connection->buf_start += scanned;
 
 	return reply;
 }
 
+/* Pass the samples of a 707 event to callback_audio */
+static void spd_report_audio(SPDConnection * connection, int msg_id,
+			     int client_id, const char *reply)
+{
+	SPDAudioFrame frame;
+	const char *line;
+	size_t size;
+
+	line = strstr(reply, "\n707-RAW ");
+	if (line == NULL
+	    || sscanf(line + 1, "707-RAW %d %d %d %d %d %zu", &frame.bits,
+		      &frame.num_channels, &frame.sample_rate,
+		      &frame.num_samples, &frame.big_endian, &size) != 6) {
+		SPD_DBG("Broken audio from Speech Dispatcher: %s", reply);
+		return;
+	}
+	frame.samples = strchr(line + 1, '\n') + 1;
+	frame.bytes = size;
+
+	connection->callback_audio(msg_id, client_id, &frame);
+}
+
 static void *spd_events_handler(void *conn)
 {
 	char *reply;
@@ -1916,6 +2711,11 @@ static void *spd_events_handler(void *conn)
 				free(reply);
 				break;
 			}
+			if (reply_code == 706)
+				spd_lists_invalidate(connection);
+			if ((reply_code == 707) && (connection->callback_audio))
+				spd_report_audio(connection, msg_id, client_id,
+						 reply);
 			/*  Decide if we want to call a callback */
 			if ((reply_code == 701) && (connection->callback_begin))
 				connection->callback_begin(msg_id, client_id,
@@ -2137,56 +2937,82 @@ static int isanum(char *str)
 }
 
 /*
- * escape_dot: Replace . with .. at the start of lines.
- * @text: text to escape
- * @Returns: An allocated string, containing the escaped text.
+ * send_escaped_text: Write text to the socket with . replaced by .. at the
+ * start of lines.  The text is not copied, its slices between the dots to
+ * escape are written with writev().
+ * @text: text to send
+ * @Returns: 0 on success, -1 on a write error.
  */
-static char *escape_dot(const char *text)
+static int send_escaped_text(SPDConnection * connection, const char *text)
 {
-	size_t orig_len = 0;
-	const char *orig_end;
-	char *result = NULL;
-	char *result_ptr;
-	static const char *ESCAPED_DOTLINE = "\r\n..";
-	static const size_t ESCAPED_DOTLINELEN = 4;
-	static const size_t DOTLINELEN = 3;
+	static char dot[] = ".";
+	struct iovec iov[SPD_TEXT_IOV];
+	const char *end = text + strlen(text);
+	const char *next;
+	int n = 0;
 
-	if (text == NULL)
-		return NULL;
+	if (connection->socket < 0)
+		return -1;
 
-	orig_len = strlen(text);
-	orig_end = text + orig_len;
-	result = malloc((orig_len * 2 + 1) * sizeof(char));
+	if (text[0] == '.') {
+		iov[n].iov_base = dot;
+		iov[n++].iov_len = 1;
+	}
 
-	if (result == NULL)
-		return NULL;
+	while (text < end) {
+		next = strstr(text, "\r\n.");
+		iov[n].iov_base = (char *)text;
+		if (next != NULL) {
+			/* Up to the dot, which is then written once more */
+			next += 3;
+			iov[n++].iov_len = next - text;
+			iov[n].iov_base = dot;
+			iov[n++].iov_len = 1;
+		} else {
+			next = end;
+			iov[n++].iov_len = next - text;
+		}
+		text = next;
 
-	result_ptr = result;
+		if (n > SPD_TEXT_IOV - 2) {
+			if (writev_all(connection->socket, iov, n) < 0)
+				return -1;
+			n = 0;
+		}
+	}
 
-	/* We're over-allocating.  Even if we replaced every character
-	 * in text with "..", the length of the escaped string can be no more
-	 * than orig_len * 2.  We could tighten that upper bound with
-	 * a little more work.
-	 */
+	if (n > 0 && writev_all(connection->socket, iov, n) < 0)
+		return -1;
 
-	if ((orig_len >= 1) && (text[0] == '.')) {
-		*(result_ptr++) = '.';
-		*(result_ptr++) = '.';
-		text += 1;
-	}
+	return 0;
+}
 
-	while (text < orig_end) {
-		if ((text[0] == '\r') && (text[1] == '\n') && (text[2] == '.')) {
-			memcpy(result_ptr, ESCAPED_DOTLINE, ESCAPED_DOTLINELEN);
-			result_ptr += ESCAPED_DOTLINELEN;
-			text += DOTLINELEN;
-		} else {
-			*(result_ptr++) = *(text++);
+/* Write the N buffers of IOV, which are modified, retrying after partial
+   writes */
+static int writev_all(int fd, struct iovec *iov, int n)
+{
+	ssize_t ret;
+
+	while (n > 0) {
+		ret = writev(fd, iov, n);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			SPD_DBG("Can't write to socket: %s", strerror(errno));
+			return -1;
+		}
+		while (n > 0 && (size_t) ret >= iov->iov_len) {
+			ret -= iov->iov_len;
+			iov++;
+			n--;
+		}
+		if (n > 0) {
+			iov->iov_base = (char *)iov->iov_base + ret;
+			iov->iov_len -= ret;
 		}
 	}
 
-	*result_ptr = '\0';
-	return result;
+	return 0;
 }
 
 #ifdef LIBSPEECHD_DEBUG
@@ -74,7 +74,28 @@ typedef void (*SPDCallback) (size_t msg_id, size_t client_id,
 typedef void (*SPDCallbackIM) (size_t msg_id, size_t client_id,
 			       SPDNotificationType state, char *index_mark);
 
+/* Audio of a message, for spd_set_audio_retrieval() */
 typedef struct {
+	int bits;
+	int num_channels;
+	int sample_rate;
+	int num_samples;
+	int big_endian;
+	const void *samples;
+	size_t bytes;
+} SPDAudioFrame;
+
+typedef void (*SPDCallbackAudio) (size_t msg_id, size_t client_id,
+				  const SPDAudioFrame * frame);
+
+typedef struct SPDConnection SPDConnection;
+
+/* Completion of a request made with one of the spd_*_async() functions.
+   RESULT is what the synchronous counterpart would have returned. */
+typedef void (*SPDAsyncCallback) (SPDConnection * connection, int request_id,
+				  int result, void *user_data);
+
+struct SPDConnection {
 
 	/* PUBLIC */
 	SPDCallback callback_begin;
@@ -97,7 +118,15 @@ typedef struct {
 
 	char *reply;
 
-} SPDConnection;
+	struct SPDConnection_asyncdata *async;
+
+	int no_speak_fd;
+
+	/* PUBLIC, called with the audio of messages once
+	   spd_set_audio_retrieval() is on */
+	SPDCallbackAudio callback_audio;
+
+};
 
 /* -------------- Public functions --------------------------*/
 
@@ -120,6 +149,42 @@ int spd_sayf(SPDConnection * connection, SPDPriority priority,
 	     const char *format, ...)
 	     SPD_ATTRIBUTE_FORMAT(printf, 3, 4);
 
+/* Settings sent along with the text by spd_say_with_settings().  Only the
+   fields whose SPD_SETTING_* flag is in _set_ are sent, and like with the
+   spd_set_*() functions they stay in effect for later messages. */
+typedef enum {
+	SPD_SETTING_RATE = 1 << 0,
+	SPD_SETTING_PITCH = 1 << 1,
+	SPD_SETTING_VOLUME = 1 << 2,
+	SPD_SETTING_LANGUAGE = 1 << 3,
+	SPD_SETTING_PUNCTUATION = 1 << 4,
+	SPD_SETTING_VOICE_TYPE = 1 << 5,
+	SPD_SETTING_SYNTHESIS_VOICE = 1 << 6
+} SPDSettingFlags;
+
+typedef struct {
+	unsigned int set;
+	signed int rate;
+	signed int pitch;
+	signed int volume;
+	const char *language;
+	SPDPunctuation punctuation;
+	SPDVoiceType voice_type;
+	const char *synthesis_voice;
+} SPDSettings;
+
+int spd_say_with_settings(SPDConnection * connection, SPDPriority priority,
+			  const SPDSettings * settings, const char *text);
+
+/* Get the audio of the next messages through callback_audio instead of
+   having it played.  Only in threaded mode. */
+int spd_set_audio_retrieval(SPDConnection * connection, int enable);
+
+/* Say the first _bytes_ of the memfd _fd_, which must be sealed against
+   writing and shrinking.  Only possible over the Unix socket. */
+int spd_say_memfd(SPDConnection * connection, SPDPriority priority, int fd,
+		  size_t bytes);
+
 /* Speech flow */
 int spd_stop(SPDConnection * connection);
 int spd_stop_all(SPDConnection * connection);
@@ -240,6 +305,9 @@ SPDVoice **spd_list_synthesis_voices2(SPDConnection * connection, const char *la
 void free_spd_voices(SPDVoice ** voices);
 char **spd_execute_command_with_list_reply(SPDConnection * connection,
 					   const char *command);
+/* Keep the lists of modules and voices, until the server reports a change.
+   Only in SPD_MODE_THREADED. */
+int spd_set_list_cache(SPDConnection * connection, int enable);
 
 /* Direct SSIP communication */
 int spd_execute_command(SPDConnection * connection, const char *command);
@@ -250,6 +318,25 @@ char *spd_send_data(SPDConnection * connection, const char *message, int wfr);
 char *spd_send_data_wo_mutex(SPDConnection * connection, const char *message,
 			     int wfr);
 
+/* Asynchronous requests: these queue the request and return at once with
+   a request id (or -1 on error).  The requests are sent in order from a
+   connection thread, and CALLBACK (if not NULL) is then called from that
+   thread with the result of the request. */
+int spd_say_async(SPDConnection * connection, SPDPriority priority,
+		  const char *text, SPDAsyncCallback callback, void *user_data);
+int spd_stop_async(SPDConnection * connection, SPDAsyncCallback callback,
+		   void *user_data);
+int spd_cancel_async(SPDConnection * connection, SPDAsyncCallback callback,
+		     void *user_data);
+int spd_set_voice_rate_async(SPDConnection * connection, signed int rate,
+			     SPDAsyncCallback callback, void *user_data);
+int spd_set_voice_pitch_async(SPDConnection * connection, signed int pitch,
+			      SPDAsyncCallback callback, void *user_data);
+int spd_set_volume_async(SPDConnection * connection, signed int volume,
+			 SPDAsyncCallback callback, void *user_data);
+int spd_execute_command_async(SPDConnection * connection, const char *command,
+			      SPDAsyncCallback callback, void *user_data);
+
 
 
 /* *INDENT-OFF* */
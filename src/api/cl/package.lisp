@@ -40,6 +40,7 @@
    #:say-text
    #:say-sound
    #:say-char
+   #:with-pipelined-commands
    #:cancel
    #:stop
    #:pause
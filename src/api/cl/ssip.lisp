@@ -134,7 +134,9 @@ Useful only for diagnosing problems.")
   (transaction-state nil)
   (parameters ())
   (forced-priority nil)
-  (last-command nil))
+  (last-command nil)
+  (batch-p nil)
+  (pending-states ()))
 
 (defstruct request
   string
@@ -146,6 +148,9 @@ Useful only for diagnosing problems.")
 (defvar *connection* nil
   "Current connection.")
 
+(defvar *batch-answers* ()
+  "Answers read in the current batch, the last one first.")
+
 
 
 ;;; Utilities
@@ -319,10 +324,31 @@ Return the opened connection on success, nil otherwise."
     (let ((stream (connection-stream *connection*)))
       (when stream
 	(unwind-protect
-             (format stream "~A" string)
+             (progn
+               (format stream "~A" string)
+               ;; In a batch, everything goes at once at its end
+               (unless (connection-batch-p *connection*)
+                 (finish-output stream)))
 	  (when (not (running-p))
             (permanent-connection-failure *connection*)))))))
 
+(defun read-answer (stream)
+  "Read a command answer from STREAM.
+Return the list (SUCCESS DATA CODE ANSWER)."
+  (destructuring-bind (answer-line . data-lines)
+      (loop for line = (read-line stream)
+            for lines = (list line) then (cons line lines)
+            while (and (> (length line) 3)
+                       (char= (char line 3) #\-))
+            finally (return lines))
+    (let* ((code (subseq answer-line 0 3))
+           (answer (subseq answer-line 4))
+           (success (member (char code 0) '(#\1 #\2)))
+           (data (and success
+                      (mapcar #'(lambda (line) (subseq line 4))
+                              data-lines))))
+      (list success data code answer))))
+
 (defun process-request (request)
   (with-current-connection
     ;; Ensure proper transaction state
@@ -357,23 +383,30 @@ Return the opened connection on success, nil otherwise."
         (when (check-state t)
           (send-string (request-string request))
           ;; Read command answer
-          (unless (equal state-spec '(in-data in-data))
-            (destructuring-bind (answer-line . data-lines)
-                (loop with stream = (connection-stream *connection*)
-                      for line = (read-line stream)
-                      for lines = (list line) then (cons line lines)
-                      while (and (> (length line) 3)
-                                 (char= (char line 3) #\-))
-                      finally (return lines))
-              (let* ((code (subseq answer-line 0 3))
-                     (answer (subseq answer-line 4))
-                     (success (member (char code 0) '(#\1 #\2)))
-                     (data (and success
-                                (mapcar #'(lambda (line) (subseq line 4))
-                                        data-lines))))
-                (when success
-                  (setf (connection-transaction-state *connection*) new-state))
-                (list success data code answer)))))))))
+          (cond
+            ((equal state-spec '(in-data in-data))
+             nil)
+            ((and (connection-batch-p *connection*)
+                  (not (eq new-state (connection-transaction-state
+                                      *connection*))))
+             ;; The next commands depend on the state this one sets, e.g.
+             ;; the text must not reach the server before it accepted
+             ;; SPEAK, so the answers so far and this one are read now
+             (read-pending-answers *connection*)
+             (let ((answer (read-answer (connection-stream *connection*))))
+               (push answer *batch-answers*)
+               (when (first answer)
+                 (setf (connection-transaction-state *connection*) new-state))
+               answer))
+            ((connection-batch-p *connection*)
+             ;; The answer is read later in the batch
+             (push new-state (connection-pending-states *connection*))
+             (list t nil nil nil))
+            (t
+             (let ((answer (read-answer (connection-stream *connection*))))
+               (when (first answer)
+                 (setf (connection-transaction-state *connection*) new-state))
+               answer))))))))
 
 (defun send-request (request)
   (with-current-connection
@@ -436,6 +469,50 @@ Return the opened connection on success, nil otherwise."
   (send-command "." '(in-data nil)))
 
 
+;;; Batches
+
+
+(defun read-pending-answers (connection)
+  "Read the answers of the commands sent so far in the batch of CONNECTION.
+Each command which succeeded sets the transaction state it leads to."
+  (let ((stream (connection-stream connection))
+        (states (reverse (connection-pending-states connection))))
+    (setf (connection-pending-states connection) ())
+    (when stream
+      (finish-output stream)
+      (dolist (new-state states)
+        (let ((answer (read-answer stream)))
+          (push answer *batch-answers*)
+          (when (first answer)
+            (setf (connection-transaction-state connection) new-state)))))))
+
+(defun finish-batch (connection)
+  (unwind-protect
+       (read-pending-answers connection)
+    (setf (connection-batch-p connection) nil)))
+
+(defmacro with-pipelined-commands (&rest body)
+  "Send the SSIP commands of BODY at once, without waiting for their answers.
+This saves a round trip to the server per command, e.g. when setting several
+parameters before saying something.  The answers are read at the end, and
+returned as a list of (SUCCESS DATA CODE ANSWER) in the order of the commands.
+Within BODY, the commands are assumed to succeed, so functions which need the
+answer, such as value retrieval, should not be called there.  Only the commands
+changing the transaction state, SPEAK and the end of its text, wait for their
+answer and those before it, since the next commands depend on it."
+  (let (($connection (gensym)))
+    `(with-current-connection
+       (if (or (not *connection*) (connection-batch-p *connection*))
+           (progn ,@body nil)
+           (let ((,$connection *connection*)
+                 (*batch-answers* ()))
+             (setf (connection-batch-p ,$connection) t)
+             (unwind-protect
+                  (progn ,@body)
+               (finish-batch ,$connection))
+             (reverse *batch-answers*))))))
+
+
 ;;; Value retrieval functions
 
 
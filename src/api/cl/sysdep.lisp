@@ -44,7 +44,10 @@
      s
      (sb-bsd-sockets:host-ent-address (sb-bsd-sockets:get-host-by-name host))
      port)
-    (sb-bsd-sockets:socket-make-stream s :input t :output t :buffering :none))
+    ;; The commands are short and each one waits for its answer
+    (setf (sb-bsd-sockets:sockopt-tcp-nodelay s) t)
+    ;; Flushed by send-string, so that a command goes in one write
+    (sb-bsd-sockets:socket-make-stream s :input t :output t :buffering :full))
   )
 
 (defun close-network-stream (stream)
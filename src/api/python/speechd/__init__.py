@@ -22,6 +22,9 @@ Two main classes are provided:
 - speechd.client.SSIPClient : direct mapping of the SSIP commands and logic
 - speechd.client.Speaker : a more convenient interface.
 
+and speechd.aio.AsyncSSIPClient provides the SSIPClient commands as
+coroutines for asyncio applications.
+
 You can use
 
 pydoc3 speechd.client.SSIPClient
@@ -0,0 +1,395 @@
+# Copyright (C) 2026 Brailcom, o.p.s.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU Lesser General Public License as published by
+# the Free Software Foundation; either version 2.1 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU Lesser General Public License
+# along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+"""asyncio interface to Speech Dispatcher
+
+The 'AsyncSSIPClient' class provides the main commands of
+'speechd.client.SSIPClient' as coroutines, for applications running an
+asyncio event loop.  The server responses and events are read by a task of
+the loop, no thread is involved.  Commands issued by concurrent coroutines
+are pipelined: each is written as soon as it is issued, without waiting for
+the responses of the others.
+
+Here is a simple example:
+
+import asyncio
+from speechd import aio
+
+async def main():
+    c = await aio.AsyncSSIPClient.open("mytest")
+    await c.speak("hello, world!")
+    await c.close()
+
+asyncio.run(main())
+"""
+
+import asyncio, collections
+
+from .client import (CommunicationMethod, CallbackType, Scope, Priority,
+                     SSIPClient, SSIPCommunicationError, SSIPCommandError,
+                     SSIPDataError, _SSIP_Connection, _CallbackHandler)
+
+
+class _AsyncSSIP_Connection(object):
+    """Implementation of low level SSIP communication over asyncio streams."""
+
+    def __init__(self, reader, writer):
+        self._reader = reader
+        self._writer = writer
+        self._callback = None
+        # (future, on_response) for each command waiting for its response
+        self._pending = collections.deque()
+        # Held while a SPEAK is waiting for the go-ahead of the server, as
+        # anything written meanwhile would be taken as its data
+        self._write_lock = asyncio.Lock()
+        self._closed = False
+        self._communication_task = asyncio.ensure_future(self._communication())
+
+    @classmethod
+    async def open(cls, communication_method, socket_path, host, port):
+        """Open the connection to the server."""
+        try:
+            if communication_method == CommunicationMethod.UNIX_SOCKET:
+                reader, writer = await asyncio.open_unix_connection(socket_path)
+            elif communication_method == CommunicationMethod.INET_SOCKET:
+                assert host and port
+                reader, writer = await asyncio.open_connection(host, port)
+            else:
+                raise ValueError("Unsupported communication method")
+        except OSError as ex:
+            raise SSIPCommunicationError("Can't open socket using method "
+                                         + communication_method,
+                                         original_exception = ex)
+        return cls(reader, writer)
+
+    async def close(self):
+        """Close the server connection and stop reading from it."""
+        self._closed = True
+        self._writer.close()
+        try:
+            await self._communication_task
+        except asyncio.CancelledError:
+            pass
+
+    async def _recv_message(self):
+        """Read server response or a callback
+        and return the triplet (code, msg, data)."""
+        data = []
+        c = None
+        while True:
+            line = await self._reader.readuntil(_SSIP_Connection._NEWLINE)
+            line = line[:-len(_SSIP_Connection._NEWLINE)].decode('utf-8')
+            assert len(line) >= 4, "Malformed data received from server!"
+            code, sep, text = line[:3], line[3], line[4:]
+            assert code.isalnum() and (c is None or code == c) and \
+                   sep in ('-', ' '), "Malformed data received from server!"
+            if sep == ' ':
+                return int(code), text, tuple(data)
+            c = code
+            data.append(text)
+            size = _SSIP_Connection._raw_size(code, text)
+            if size:
+                data.append(await self._reader.readexactly(size))
+
+    async def _communication(self):
+        """Dispatch the events and hand the responses to the commands
+        waiting for them, until the connection is closed."""
+        error = None
+        while True:
+            try:
+                code, msg, data = await self._recv_message()
+            except (asyncio.IncompleteReadError, OSError) as ex:
+                error = ex
+                break
+            if code//100 != 7:
+                if not self._pending:
+                    continue
+                future, on_response = self._pending.popleft()
+                # Before anything else is read, so that events about a
+                # message can't come before its callback is registered
+                if on_response is not None and code//100 == 2:
+                    on_response(data)
+                if not future.done():
+                    future.set_result((code, msg, data))
+                continue
+            type = _SSIP_Connection._CALLBACK_TYPE_MAP.get(code)
+            if self._callback is not None and type is not None:
+                kwargs = _SSIP_Connection._event_kwargs(type, data)
+                msg_id, client_id = map(int, data[:2])
+                self._callback(msg_id, client_id, type, **kwargs)
+        while self._pending:
+            future, on_response = self._pending.popleft()
+            if not future.done():
+                future.set_exception(SSIPCommunicationError(
+                    "Speech Dispatcher connection lost.",
+                    original_exception = error))
+
+    def _write(self, data, on_response=None):
+        """Write data and return the future of its response."""
+        if self._closed or self._communication_task.done():
+            raise SSIPCommunicationError("Speech Dispatcher connection lost.")
+        future = asyncio.get_event_loop().create_future()
+        self._pending.append((future, on_response))
+        self._writer.write(data)
+        return future
+
+    async def _drain(self):
+        try:
+            await self._writer.drain()
+        except OSError as ex:
+            raise SSIPCommunicationError("Speech Dispatcher connection lost.",
+                                         original_exception = ex)
+
+    async def send_command(self, command, *args):
+        """Send SSIP command with given arguments and read server response.
+
+        See '_SSIP_Connection.send_command()'.
+
+        """
+        cmd = ' '.join((command,) + tuple(map(str, args)))
+        async with self._write_lock:
+            future = self._write(cmd.encode('utf-8') + _SSIP_Connection._NEWLINE)
+        await self._drain()
+        code, msg, data = await future
+        if code//100 != 2:
+            raise SSIPCommandError(code, msg, cmd)
+        return code, msg, data
+
+    async def send_commands(self, commands):
+        """Send several SSIP commands at once and read all their responses.
+
+        See '_SSIP_Connection.send_commands()'.
+
+        """
+        cmds = [' '.join((command[0],) + tuple(map(str, command[1:])))
+                for command in commands]
+        assert not [cmd for cmd in cmds if cmd.upper() == 'SPEAK']
+        async with self._write_lock:
+            futures = [self._write(cmd.encode('utf-8')
+                                   + _SSIP_Connection._NEWLINE)
+                       for cmd in cmds]
+        await self._drain()
+        responses = [await future for future in futures]
+        for cmd, (code, msg, data) in zip(cmds, responses):
+            if code//100 != 2:
+                raise SSIPCommandError(code, msg, cmd)
+        return responses
+
+    async def speak(self, data, on_response=None):
+        """Send the SPEAK command with multiline data and read the final
+        server response.
+
+        'on_response' is called with the response data as soon as it has
+        been received, before any further event is processed.
+
+        """
+        data = data.encode('utf-8')
+        if data.startswith(_SSIP_Connection._END_OF_DATA_MARKER):
+            l = len(_SSIP_Connection._END_OF_DATA_MARKER)
+            data = _SSIP_Connection._END_OF_DATA_MARKER_ESCAPED + data[l:]
+        data = data.replace(_SSIP_Connection._RAW_DOTLINE,
+                            _SSIP_Connection._ESCAPED_DOTLINE)
+
+        async with self._write_lock:
+            future = self._write(b'SPEAK' + _SSIP_Connection._NEWLINE)
+            await self._drain()
+            code, msg, response_data = await future
+            if code//100 != 2:
+                raise SSIPCommandError(code, msg, 'SPEAK')
+            future = self._write(data + _SSIP_Connection._END_OF_DATA,
+                                 on_response)
+        await self._drain()
+        code, msg, response_data = await future
+        if code//100 != 2:
+            raise SSIPDataError(code, msg, data)
+        return code, msg, response_data
+
+    def set_callback(self, callback):
+        """Register a callback function for handling asynchronous events.
+
+        See '_SSIP_Connection.set_callback()'.  The callback is called
+        from the event loop.
+
+        """
+        self._callback = callback
+
+
+class AsyncSSIPClient(object):
+    """Speech Dispatcher client interface for asyncio.
+
+    The methods are coroutines doing the same as those of 'SSIPClient'.
+    Instances are created with the 'open()' coroutine.  Unlike
+    'SSIPClient', the server is not spawned automatically if it is not
+    running.
+
+    """
+
+    def __init__(self, conn):
+        self._conn = conn
+
+    @classmethod
+    async def open(cls, name, component='default', user='unknown',
+                   address=None):
+        """Connect to the server and return the client.
+
+        The arguments have the same meaning as for 'SSIPClient'.
+
+        """
+        connection_args = SSIPClient._resolve_connection_arguments(address)
+        conn = await _AsyncSSIP_Connection.open(**connection_args)
+        client = cls(conn)
+        try:
+            await client._initialize_connection(user, name, component)
+        except:
+            await conn.close()
+            raise
+        return client
+
+    async def _initialize_connection(self, user, name, component):
+        full_name = '%s:%s:%s' % (user, name, component)
+        responses = await self._conn.send_commands(
+            [('SET', Scope.SELF, 'CLIENT_NAME', full_name),
+             ('HISTORY', 'GET', 'CLIENT_ID')]
+            + [('SET', Scope.SELF, 'NOTIFICATION', event, 'on')
+               for event in (CallbackType.INDEX_MARK,
+                             CallbackType.BEGIN,
+                             CallbackType.END,
+                             CallbackType.CANCEL,
+                             CallbackType.PAUSE,
+                             CallbackType.RESUME)])
+        code, msg, data = responses[1]
+        self._client_id = int(data[0])
+        self._callback_handler = _CallbackHandler(self._client_id)
+        self._conn.set_callback(self._callback_handler)
+
+    async def close(self):
+        """Close the connection to Speech Dispatcher."""
+        await self._conn.close()
+
+    async def speak(self, text, callback=None, event_types=None):
+        """Say given message, see 'SSIPClient.speak()'.
+
+        The callback is called from the event loop, it is registered before
+        any event about the message is processed.
+
+        """
+        on_response = None
+        if callback:
+            def on_response(data):
+                self._callback_handler.add_callback(int(data[0]), callback,
+                                                    event_types)
+        return await self._conn.speak(text, on_response)
+
+    async def set_priority(self, priority):
+        """Set the priority category for the following messages."""
+        assert priority in (Priority.IMPORTANT, Priority.MESSAGE,
+                            Priority.TEXT, Priority.NOTIFICATION,
+                            Priority.PROGRESS), priority
+        await self._conn.send_command('SET', Scope.SELF, 'PRIORITY', priority)
+
+    async def char(self, char):
+        """Say given character."""
+        await self._conn.send_command('CHAR', char.replace(' ', 'space'))
+
+    async def key(self, key):
+        """Say given key name."""
+        await self._conn.send_command('KEY', key)
+
+    async def sound_icon(self, sound_icon):
+        """Output given sound_icon."""
+        await self._conn.send_command('SOUND_ICON', sound_icon)
+
+    async def cancel(self, scope=Scope.SELF):
+        """Immediately stop speaking and discard messages in queues."""
+        await self._conn.send_command('CANCEL', scope)
+
+    async def stop(self, scope=Scope.SELF):
+        """Immediately stop speaking the currently spoken message."""
+        await self._conn.send_command('STOP', scope)
+
+    async def pause(self, scope=Scope.SELF):
+        """Pause speaking and postpone other messages until resume."""
+        await self._conn.send_command('PAUSE', scope)
+
+    async def resume(self, scope=Scope.SELF):
+        """Resume speaking of the currently paused messages."""
+        await self._conn.send_command('RESUME', scope)
+
+    async def list_output_modules(self):
+        """Return names of all active output modules as a tuple of strings."""
+        code, msg, data = await self._conn.send_command('LIST',
+                                                        'OUTPUT_MODULES')
+        return data
+
+    async def list_synthesis_voices(self, language=None, variant=None):
+        """Return names of all available voices for the current output module,
+        see 'SSIPClient.list_synthesis_voices()'."""
+        command = ['LIST', 'SYNTHESIS_VOICES']
+        if language:
+            command.append(language)
+            if variant:
+                command.append(variant)
+        try:
+            code, msg, data = await self._conn.send_command(*command)
+        except SSIPCommandError:
+            return ()
+        def split(item):
+            name, lang, variant = tuple(item.rsplit('\t', 3))
+            return (name, lang or None, variant or None)
+        return tuple([split(item) for item in data])
+
+    async def set_language(self, language, scope=Scope.SELF):
+        """Switch to a particular language for further speech commands."""
+        await self._conn.send_command('SET', scope, 'LANGUAGE', language)
+
+    async def set_audio_retrieval(self, value):
+        """Get the audio of the next messages instead of having it played,
+        see 'SSIPClient.set_audio_retrieval()'."""
+        await self._conn.send_command('SET', Scope.SELF, 'AUDIO_RETRIEVAL',
+                                      value and 'on' or 'off')
+
+    async def set_output_module(self, name, scope=Scope.SELF):
+        """Switch to a particular output module."""
+        await self._conn.send_command('SET', scope, 'OUTPUT_MODULE', name)
+
+    async def set_pitch(self, value, scope=Scope.SELF):
+        """Set the pitch for further speech commands, in <-100, 100>."""
+        assert isinstance(value, int) and -100 <= value <= 100, value
+        await self._conn.send_command('SET', scope, 'PITCH', value)
+
+    async def set_rate(self, value, scope=Scope.SELF):
+        """Set the speech rate for further speech commands, in <-100, 100>."""
+        assert isinstance(value, int) and -100 <= value <= 100, value
+        await self._conn.send_command('SET', scope, 'RATE', value)
+
+    async def set_volume(self, value, scope=Scope.SELF):
+        """Set the speech volume for further speech commands, in <-100, 100>."""
+        assert isinstance(value, int) and -100 <= value <= 100, value
+        await self._conn.send_command('SET', scope, 'VOLUME', value)
+
+    async def set_punctuation(self, value, scope=Scope.SELF):
+        """Set the punctuation pronounciation level, one of the
+        'PunctuationMode' constants."""
+        await self._conn.send_command('SET', scope, 'PUNCTUATION', value)
+
+    async def set_synthesis_voice(self, value, scope=Scope.SELF):
+        """Set synthesis voice by name, as returned by
+        'list_synthesis_voices()'."""
+        await self._conn.send_command('SET', scope, 'SYNTHESIS_VOICE', value)
+
+    async def send_commands(self, commands):
+        """Send several SSIP commands at once, see
+        '_SSIP_Connection.send_commands()'."""
+        return await self._conn.send_commands(commands)
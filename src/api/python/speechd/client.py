@@ -24,7 +24,7 @@ A more convenient interface is provided by the 'Speaker' class.
 
 #TODO: Blocking variants for speak, char, key, sound_icon.
 
-import socket, sys, os, subprocess, time, tempfile
+import socket, sys, os, subprocess, time, tempfile, collections
 
 try:
     import threading
@@ -55,6 +55,16 @@ class CallbackType(object):
     RESUME = 'resume'
     """The resume event is reported right after speaking of a message
     was resumed after previous pause."""
+    AUDIO = 'audio'
+    """The audio event brings a part of the synthesized sound of a message
+    when audio retrieval is on, see 'SSIPClient.set_audio_retrieval()'."""
+
+AudioFrame = collections.namedtuple('AudioFrame', ('bits', 'num_channels',
+                                                   'sample_rate', 'num_samples',
+                                                   'big_endian', 'samples'))
+"""Audio passed to AUDIO callbacks as the 'audio' keyword argument.
+
+'samples' are the raw PCM bytes, in the byte order given by 'big_endian'."""
 
 class SSIPError(Exception):
     """Common base class for exceptions during SSIP communication."""
@@ -165,8 +175,12 @@ class _SSIP_Connection(object):
                           703: CallbackType.CANCEL,
                           704: CallbackType.PAUSE,
                           705: CallbackType.RESUME,
+                          707: CallbackType.AUDIO,
                           }
 
+    # How much is read from the socket at once
+    _RECV_SIZE = 65536
+
     def __init__(self, communication_method, socket_path, host, port):
         """Init connection: open the socket to server,
         initialize buffers, launch a communication handling
@@ -191,8 +205,12 @@ class _SSIP_Connection(object):
                                          + communication_method,
                                          original_exception = ex)
 
-        self._buffer = b""
-        self._com_buffer = []
+        # Received data, parsed up to self._buffer_pos
+        self._buffer = bytearray()
+        self._buffer_pos = 0
+        self._recv_buffer = bytearray(self._RECV_SIZE)
+        self._recv_view = memoryview(self._recv_buffer)
+        self._com_buffer = collections.deque()
         self._callback = None
         self._ssip_reply_semaphore = threading.Semaphore(0)
         self._communication_thread = \
@@ -237,37 +255,76 @@ class _SSIP_Connection(object):
                 self._com_buffer.append((code, msg, data))
                 self._ssip_reply_semaphore.release()
                 continue
-            # Ignore the event if no callback function has been registered.
-            if self._callback is not None:
-                type = self._CALLBACK_TYPE_MAP[code]
-                if type == CallbackType.INDEX_MARK:
-                    kwargs = {'index_mark': data[2]}
-                else:
-                    kwargs = {}
+            # Ignore the event if no callback function has been registered,
+            # or if it is not one we know about.
+            type = self._CALLBACK_TYPE_MAP.get(code)
+            if self._callback is not None and type is not None:
+                kwargs = self._event_kwargs(type, data)
                 # Get message and client ID of the event
                 msg_id, client_id = map(int, data[:2])
                 self._callback(msg_id, client_id, type, **kwargs)
-                
-                
+
+    @staticmethod
+    def _event_kwargs(type, data):
+        """Return the keyword arguments of the callback of an event."""
+        if type == CallbackType.INDEX_MARK:
+            return {'index_mark': data[2]}
+        if type == CallbackType.AUDIO:
+            fields = [int(f) for f in data[2].split()[1:6]]
+            return {'audio': AudioFrame(*fields, samples=data[3])}
+        return {}
+
+    @staticmethod
+    def _raw_size(code, text):
+        """Return the size of the samples following a '707-RAW' line."""
+        if code == '707' and text.startswith('RAW '):
+            return int(text.split()[6])
+        return 0
+
+
     def _readline(self):
         """Read one whole line from the socket.
 
         Blocks until the line delimiter ('_NEWLINE') is read.
         
         """
-        pointer = self._buffer.find(self._NEWLINE)
+        buffer = self._buffer
+        pointer = buffer.find(self._NEWLINE, self._buffer_pos)
         while pointer == -1:
+            # Drop the lines already returned before reading more
+            if self._buffer_pos:
+                del buffer[:self._buffer_pos]
+                self._buffer_pos = 0
             try:
-                d = self._socket.recv(1024)
+                n = self._socket.recv_into(self._recv_buffer)
             except:
                 raise IOError
-            if len(d) == 0:
+            if n == 0:
                 raise IOError
-            self._buffer += d
-            pointer = self._buffer.find(self._NEWLINE)
-        line = self._buffer[:pointer]
-        self._buffer = self._buffer[pointer+len(self._NEWLINE):]
-        return line.decode('utf-8')
+            # The delimiter may have been split between two reads
+            start = max(len(buffer) - 1, 0)
+            buffer += self._recv_view[:n]
+            pointer = buffer.find(self._NEWLINE, start)
+        line = buffer[self._buffer_pos:pointer].decode('utf-8')
+        self._buffer_pos = pointer + len(self._NEWLINE)
+        return line
+
+    def _readbytes(self, size):
+        """Read exactly 'size' bytes of binary data from the socket."""
+        buffer = self._buffer
+        if self._buffer_pos:
+            del buffer[:self._buffer_pos]
+            self._buffer_pos = 0
+        while len(buffer) < size:
+            try:
+                n = self._socket.recv_into(self._recv_buffer)
+            except:
+                raise IOError
+            if n == 0:
+                raise IOError
+            buffer += self._recv_view[:n]
+        self._buffer_pos = size
+        return bytes(buffer[:size])
 
     def _recv_message(self):
         """Read server response or a callback
@@ -285,6 +342,9 @@ class _SSIP_Connection(object):
                 return int(code), msg, tuple(data)
             c = code
             data.append(text)
+            size = self._raw_size(code, text)
+            if size:
+                data.append(self._readbytes(size))
 
     def _recv_response(self):
         """Read server response from the communication thread
@@ -295,9 +355,20 @@ class _SSIP_Connection(object):
             raise SSIPCommunicationError
         self._ssip_reply_semaphore.acquire()
         # The list is sorted, read the first item
-        response = self._com_buffer[0]
-        del self._com_buffer[0]
-        return response
+        return self._com_buffer.popleft()
+
+    def _format_command(self, command, *args):
+        if __debug__:
+            if command in ('SET', 'CANCEL', 'STOP',):
+                assert args[0] in (Scope.SELF, Scope.ALL) \
+                       or isinstance(args[0], int)
+        return ' '.join((command,) + tuple(map(str, args)))
+
+    def _send(self, data):
+        try:
+            self._socket.sendall(data)
+        except socket.error:
+            raise SSIPCommunicationError("Speech Dispatcher connection lost.")
 
     def send_command(self, command, *args):
         """Send SSIP command with given arguments and read server response.
@@ -316,19 +387,43 @@ class _SSIP_Connection(object):
         'IOError' is raised when the socket was closed by the remote side.
         
         """
-        if __debug__:
-            if command in ('SET', 'CANCEL', 'STOP',):
-                assert args[0] in (Scope.SELF, Scope.ALL) \
-                       or isinstance(args[0], int)
-        cmd = ' '.join((command,) + tuple(map(str, args)))
-        try:
-            self._socket.send(cmd.encode('utf-8') + self._NEWLINE)
-        except socket.error:
-            raise SSIPCommunicationError("Speech Dispatcher connection lost.")
+        cmd = self._format_command(command, *args)
+        self._send(cmd.encode('utf-8') + self._NEWLINE)
         code, msg, data = self._recv_response()
         if code//100 != 2:
             raise SSIPCommandError(code, msg, cmd)
         return code, msg, data
+
+    def send_commands(self, commands):
+        """Send several SSIP commands at once and read all their responses.
+
+        Arguments:
+          commands -- a sequence of tuples (command, arg1, arg2, ...), each
+            as the arguments of 'send_command()'.  'SPEAK' can't be one of
+            them, as its data can only follow its response.
+
+        The commands are written to the socket in one go and the responses
+        are read afterwards, so that this costs one round trip to the server
+        instead of one per command.
+
+        Returns a list of the (code, msg, data) triplets of the responses, in
+        the order of the commands.
+
+        'SSIPCommandError' is raised for the first command with a non 2xx
+        return code, once all the responses were read.
+
+        """
+        cmds = [self._format_command(*command) for command in commands]
+        assert not [cmd for cmd in cmds if cmd.upper() == 'SPEAK']
+        if not cmds:
+            return []
+        self._send(b''.join(cmd.encode('utf-8') + self._NEWLINE
+                            for cmd in cmds))
+        responses = [self._recv_response() for cmd in cmds]
+        for cmd, (code, msg, data) in zip(cmds, responses):
+            if code//100 != 2:
+                raise SSIPCommandError(code, msg, cmd)
+        return responses
         
     def send_data(self, data):
         """Send multiline data and read server response.
@@ -354,10 +449,7 @@ class _SSIP_Connection(object):
         # when the line is not the beginning of the string.
         data = data.replace(self._RAW_DOTLINE, self._ESCAPED_DOTLINE)
 
-        try:
-            self._socket.send(data + self._END_OF_DATA)
-        except socket.error:
-            raise SSIPCommunicationError("Speech Dispatcher connection lost.")
+        self._send(data + self._END_OF_DATA)
         code, msg, response_data = self._recv_response()
         if code//100 != 2:
             raise SSIPDataError(code, msg, data)
@@ -376,7 +468,8 @@ class _SSIP_Connection(object):
 
         The callback function must accept three positional arguments
         ('message_id', 'client_id', 'event_type') and an optional keyword
-        argument 'index_mark' (when INDEX_MARK events are turned on).
+        argument 'index_mark' (when INDEX_MARK events are turned on), or
+        'audio' (an 'AudioFrame', when audio retrieval is turned on).
 
         Note, that setting the callback function doesn't turn the events on.
         The user is responsible to turn them on by sending the appropriate `SET
@@ -544,20 +637,30 @@ class SSIPClient(object):
         Dispatcher documentation.
         """
 
+        connection_args = self._resolve_connection_arguments(
+            address, host, port, method, socket_path)
+        self._connect_with_autospawn(connection_args, autospawn)
+        self._initialize_connection(user, name, component)
+
+    @classmethod
+    def _resolve_connection_arguments(cls, address=None, host=None, port=None,
+                                      method=None, socket_path=None):
+        """Return the connection arguments of _SSIP_Connection for the
+        arguments of the constructor and the environment"""
         _home = os.path.expanduser("~")
         _runtime_dir = os.environ.get('XDG_RUNTIME_DIR', os.environ.get('XDG_CACHE_HOME', os.path.join(_home, '.cache')))
-        _sock_path = os.path.join(_runtime_dir, self.DEFAULT_SOCKET_PATH)
+        _sock_path = os.path.join(_runtime_dir, cls.DEFAULT_SOCKET_PATH)
         # Resolve connection parameters:
         connection_args = {'communication_method': CommunicationMethod.UNIX_SOCKET,
                            'socket_path': _sock_path,
-                           'host': self.DEFAULT_HOST,
-                           'port': self.DEFAULT_PORT,
+                           'host': cls.DEFAULT_HOST,
+                           'port': cls.DEFAULT_PORT,
                            }
         # Respect address method argument and SPEECHD_ADDRESS environemt variable
         _address = address or os.environ.get("SPEECHD_ADDRESS")        
 
         if _address:
-            connection_args.update(self._connection_arguments_from_address(_address))
+            connection_args.update(cls._connection_arguments_from_address(_address))
         # Respect the old (deprecated) key arguments and environment variables
         # TODO: Remove this section in 0.8 release
         else:
@@ -581,8 +684,7 @@ class SSIPClient(object):
                 connection_args['socket_path'] = socket_path
             elif env_speechd_socket_path:
                 connection_args['socket_path'] = env_speechd_socket_path
-        self._connect_with_autospawn(connection_args, autospawn)
-        self._initialize_connection(user, name, component)
+        return connection_args
 
     def _connect_with_autospawn(self, connection_args, autospawn):
         """Establish new connection (and/or autospawn server)"""
@@ -610,15 +712,16 @@ class SSIPClient(object):
         self._client_id = int(data[0])
         self._callback_handler = _CallbackHandler(self._client_id)
         self._conn.set_callback(self._callback_handler)
-        for event in (CallbackType.INDEX_MARK,
-                      CallbackType.BEGIN,
-                      CallbackType.END,
-                      CallbackType.CANCEL,
-                      CallbackType.PAUSE,
-                      CallbackType.RESUME):
-            self._conn.send_command('SET', 'self', 'NOTIFICATION', event, 'on')
-
-    def _connection_arguments_from_address(self, address):
+        self._conn.send_commands([('SET', 'self', 'NOTIFICATION', event, 'on')
+                                  for event in (CallbackType.INDEX_MARK,
+                                                CallbackType.BEGIN,
+                                                CallbackType.END,
+                                                CallbackType.CANCEL,
+                                                CallbackType.PAUSE,
+                                                CallbackType.RESUME)])
+
+    @classmethod
+    def _connection_arguments_from_address(cls, address):
         """Parse a Speech Dispatcher address line and return a dictionary
         of connection arguments"""
         connection_args = {}
@@ -892,6 +995,21 @@ class SSIPClient(object):
             return data[0]
         return None
 
+    def set_audio_retrieval(self, value):
+        """Get the audio of the next messages instead of having it played.
+
+        Arguments:
+          value -- True to have the synthesized sound passed to the callbacks
+            of the messages as AUDIO events, False to have it played again.
+
+        Each AUDIO event has an 'audio' keyword argument, an 'AudioFrame'.
+        The other events come as soon as the synthesizer reaches them, which
+        is usually faster than real time.
+
+        """
+        self._conn.send_command('SET', Scope.SELF, 'AUDIO_RETRIEVAL',
+                                value and 'on' or 'off')
+
     def set_output_module(self, name, scope=Scope.SELF):
         """Switch to a particular output module.
 
@@ -39,10 +39,13 @@
 
 #ifdef USE_DLOPEN
 #define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_audio_plugin_abi
 #else
 #define SPD_AUDIO_PLUGIN_ENTRY spd_alsa_LTX_spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_alsa_LTX_spd_audio_plugin_abi
 #endif
 #include <spd_audio_plugin.h>
+#include <spd_audio_convert.h>
 
 typedef struct {
 	AudioID id;
@@ -59,6 +62,23 @@ typedef struct {
 	struct pollfd *alsa_poll_fds;	/* Descriptors to poll */
 	int alsa_opened;	/* 1 between snd_pcm_open and _close, 0 otherwise */
 	char *alsa_device_name;	/* the name of the device to open */
+
+	/* With a non-zero idle timeout, the hardware parameters are kept
+	   between tracks of the same format, and the device is left prepared.
+	   The idle thread closes it once unused for that many seconds.  */
+	int alsa_idle_timeout;
+	int alsa_configured;	/* hw_params still applied to the device */
+	snd_pcm_format_t alsa_format;	/* ... with this format */
+	int alsa_rate;
+	int alsa_channels;
+	int alsa_playing;	/* between begin and end */
+	struct timespec alsa_idle_since;
+	pthread_cond_t alsa_idle_cond;
+	pthread_t alsa_idle_thread;
+	int alsa_idle_quit;
+
+	int alsa_xruns;		/* see alsa_get_xruns() */
+	int alsa_suspends;
 } spd_alsa_id_t;
 
 static int _alsa_close(spd_alsa_id_t * id);
@@ -144,6 +164,7 @@ static int xrun(spd_alsa_id_t * id)
 		timersub(&now, &tstamp, &diff);
 		MSG(1, "underrun!!! (at least %.3f ms long)",
 		    diff.tv_sec * 1000 + diff.tv_usec / 1000.0);
+		g_atomic_int_inc(&id->alsa_xruns);
 		if ((res = snd_pcm_prepare(id->alsa_pcm)) < 0) {
 			ERR("xrun: prepare error: %s", snd_strerror(res));
 
@@ -168,6 +189,8 @@ static int suspend(spd_alsa_id_t * id)
 	if (id == NULL)
 		return -1;
 
+	g_atomic_int_inc(&id->alsa_suspends);
+
 	while ((res = snd_pcm_resume(id->alsa_pcm)) == -EAGAIN)
 		sleep(1);	/* wait until suspend flag is released */
 
@@ -232,6 +255,7 @@ static int _alsa_close(spd_alsa_id_t * id)
 	}
 
 	id->alsa_opened = 0;
+	id->alsa_configured = 0;
 
 	if ((err = snd_pcm_close(id->alsa_pcm)) < 0) {
 		MSG(2, "Cannot close ALSA device (%s)", snd_strerror(err));
@@ -249,17 +273,57 @@ static int _alsa_close(spd_alsa_id_t * id)
 	return 0;
 }
 
+/* Closes the device once it has been idle for alsa_idle_timeout seconds,
+   so that others can use it.  alsa_begin() opens it again.  */
+static void *alsa_idle_func(void *data)
+{
+	spd_alsa_id_t *id = data;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&id->alsa_pcm_mutex);
+	while (!id->alsa_idle_quit) {
+		if (!id->alsa_pcm || id->alsa_playing) {
+			pthread_cond_wait(&id->alsa_idle_cond,
+					  &id->alsa_pcm_mutex);
+			continue;
+		}
+
+		deadline = id->alsa_idle_since;
+		deadline.tv_sec += id->alsa_idle_timeout;
+		if (pthread_cond_timedwait(&id->alsa_idle_cond,
+					   &id->alsa_pcm_mutex,
+					   &deadline) != ETIMEDOUT)
+			/* Something changed, check again */
+			continue;
+
+		MSG(2, "Closing idle ALSA device");
+		if (id->alsa_configured) {
+			snd_pcm_hw_params_free(id->alsa_hw_params);
+			id->alsa_configured = 0;
+		}
+		snd_pcm_close(id->alsa_pcm);
+		snd_pcm_sw_params_free(id->alsa_sw_params);
+		id->alsa_pcm = NULL;
+	}
+	pthread_mutex_unlock(&id->alsa_pcm_mutex);
+
+	return NULL;
+}
+
 /* Open ALSA for playback.
 
   These parameters are passed in pars:
   (char*) pars[0] ... null-terminated string containing the name
                       of the device to be used for sound output
                       on ALSA
-  (void*) pars[1] ... =NULL
+  (char*) pars[6] ... seconds to keep the device configured and
+                      prepared while idle, NULL or "0" to configure
+                      it for each track
 */
 static AudioID *alsa_open(void **pars)
 {
 	spd_alsa_id_t *alsa_id;
+	pthread_condattr_t attr;
 	int ret;
 
 	if (pars[1] == NULL) {
@@ -271,8 +335,21 @@ static AudioID *alsa_open(void **pars)
 
 	pthread_mutex_init(&alsa_id->alsa_pipe_mutex, NULL);
 	pthread_cond_init(&alsa_id->alsa_pipe_cond, NULL);
+	pthread_mutex_init(&alsa_id->alsa_pcm_mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&alsa_id->alsa_idle_cond, &attr);
+	pthread_condattr_destroy(&attr);
 
 	alsa_id->alsa_opened = 0;
+	alsa_id->alsa_configured = 0;
+	alsa_id->alsa_xruns = 0;
+	alsa_id->alsa_suspends = 0;
+	alsa_id->alsa_playing = 0;
+	alsa_id->alsa_idle_quit = 0;
+	alsa_id->alsa_idle_timeout = pars[6] ? atoi(pars[6]) : 0;
+	if (alsa_id->alsa_idle_timeout < 0)
+		alsa_id->alsa_idle_timeout = 0;
 
 	MSG(1, "Opening ALSA sound output");
 
@@ -286,6 +363,13 @@ static AudioID *alsa_open(void **pars)
 		return NULL;
 	}
 
+	if (alsa_id->alsa_idle_timeout
+	    && pthread_create(&alsa_id->alsa_idle_thread, NULL,
+			      alsa_idle_func, alsa_id)) {
+		ERR("Cannot start the idle thread, configuring for each track");
+		alsa_id->alsa_idle_timeout = 0;
+	}
+
 	MSG(1, "Device '%s' initialized successfully.",
 	    alsa_id->alsa_device_name);
 
@@ -298,6 +382,23 @@ static int alsa_close(AudioID * id)
 	int err;
 	spd_alsa_id_t *alsa_id = (spd_alsa_id_t *) id;
 
+	if (alsa_id->alsa_idle_timeout) {
+		pthread_mutex_lock(&alsa_id->alsa_pcm_mutex);
+		alsa_id->alsa_idle_quit = 1;
+		pthread_cond_signal(&alsa_id->alsa_idle_cond);
+		pthread_mutex_unlock(&alsa_id->alsa_pcm_mutex);
+		pthread_join(alsa_id->alsa_idle_thread, NULL);
+		if (alsa_id->alsa_configured)
+			snd_pcm_hw_params_free(alsa_id->alsa_hw_params);
+		alsa_id->alsa_configured = 0;
+		if (!alsa_id->alsa_pcm) {
+			/* Already closed while idle */
+			g_free(alsa_id->alsa_device_name);
+			g_free(alsa_id);
+			return 0;
+		}
+	}
+
 	/* Close device */
 	if ((err = _alsa_close(alsa_id)) < 0) {
 		ERR("Cannot close audio device");
@@ -390,14 +491,92 @@ int wait_for_poll(spd_alsa_id_t * id, struct pollfd *alsa_poll_fds,
 	return -1; \
 } while (0)
 
+/* Get the ALSA sample format of the track */
+static int alsa_track_format(spd_alsa_id_t * alsa_id, AudioTrack track,
+			     snd_pcm_format_t * format)
+{
+	if (track.bits == 16) {
+		switch (alsa_id->id.format) {
+		case SPD_AUDIO_LE:
+			*format = SND_PCM_FORMAT_S16_LE;
+			break;
+		case SPD_AUDIO_BE:
+			*format = SND_PCM_FORMAT_S16_BE;
+			break;
+		default:
+			ERR("unknown audio format (%d)", alsa_id->id.format);
+			return -1;
+		}
+	} else if (track.bits == 8) {
+		*format = SND_PCM_FORMAT_S8;
+	} else {
+		ERR("Unsupported sound data format, track.bits = %d",
+		    track.bits);
+		return -1;
+	}
+	return 0;
+}
+
+/* Get a device kept configured ready for a new track: restore the wake up
+   threshold which alsa_drain_left() raised, and queue a period of silence
+   so that cards which take time to start do not eat the first samples.  */
+static int alsa_reuse(spd_alsa_id_t * alsa_id, AudioTrack track)
+{
+	snd_pcm_uframes_t period_size;
+	void *silence;
+	int err;
+
+	snd_pcm_hw_params_get_period_size(alsa_id->alsa_hw_params, &period_size,
+					  0);
+
+	if ((err = snd_pcm_sw_params_set_avail_min(alsa_id->alsa_pcm,
+						   alsa_id->alsa_sw_params,
+						   period_size)) < 0
+	    || (err = snd_pcm_sw_params(alsa_id->alsa_pcm,
+					alsa_id->alsa_sw_params)) < 0) {
+		ERR("Unable to set sw params for playback: %s\n",
+		    snd_strerror(err));
+		return -1;
+	}
+
+	if (snd_pcm_state(alsa_id->alsa_pcm) != SND_PCM_STATE_PREPARED
+	    && (err = snd_pcm_prepare(alsa_id->alsa_pcm)) < 0) {
+		ERR("Cannot prepare audio interface for playback (%s)",
+		    snd_strerror(err));
+		return -1;
+	}
+
+	silence = g_malloc0(period_size * track.num_channels * track.bits / 8);
+	err = snd_pcm_writei(alsa_id->alsa_pcm, silence, period_size);
+	if (err < 0)
+		MSG(4, "Cannot prefill silence (%s)", snd_strerror(err));
+	g_free(silence);
+
+	return 0;
+}
+
+/* Let the idle thread count from now */
+static void alsa_idle(spd_alsa_id_t * alsa_id)
+{
+	if (!alsa_id->alsa_idle_timeout)
+		return;
+
+	pthread_mutex_lock(&alsa_id->alsa_pcm_mutex);
+	alsa_id->alsa_playing = 0;
+	clock_gettime(CLOCK_MONOTONIC, &alsa_id->alsa_idle_since);
+	pthread_cond_signal(&alsa_id->alsa_idle_cond);
+	pthread_mutex_unlock(&alsa_id->alsa_pcm_mutex);
+}
+
 /* Configure ALSA playback for the given configuration of track
    But do not play anything yet */
-static int alsa_begin(AudioID * id, AudioTrack track)
+static int _alsa_begin(AudioID * id, AudioTrack track)
 {
 	snd_pcm_format_t format;
 	spd_alsa_id_t *alsa_id = (spd_alsa_id_t *) id;
 
 	int err;
+	int reuse = 0;
 
 	snd_pcm_uframes_t period_size;
 	unsigned int sr;
@@ -421,23 +600,53 @@ static int alsa_begin(AudioID * id, AudioTrack track)
 		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
 		return 0;
 	}
-	/* Allocate space for hw_params (description of the sound parameters) */
-	MSG(2, "Allocating new hw_params structure");
-	if ((err = snd_pcm_hw_params_malloc(&alsa_id->alsa_hw_params)) < 0) {
-		ERR("Cannot allocate hardware parameter structure (%s)",
-		    snd_strerror(err));
+
+	if (alsa_track_format(alsa_id, track, &format)) {
 		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
 		return -1;
 	}
 
-	/* Initialize hw_params on our pcm */
-	if ((err =
-	     snd_pcm_hw_params_any(alsa_id->alsa_pcm,
-				   alsa_id->alsa_hw_params)) < 0) {
-		ERR("Cannot initialize hardware parameter structure (%s)",
-		    snd_strerror(err));
-		pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
-		return -1;
+	if (alsa_id->alsa_idle_timeout) {
+		/* Keep the idle thread off the device */
+		pthread_mutex_lock(&alsa_id->alsa_pcm_mutex);
+		alsa_id->alsa_playing = 1;
+		pthread_mutex_unlock(&alsa_id->alsa_pcm_mutex);
+
+		if (!alsa_id->alsa_pcm && _alsa_open(alsa_id)) {
+			pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+			return -1;
+		}
+
+		if (alsa_id->alsa_configured) {
+			reuse = alsa_id->alsa_format == format
+			    && alsa_id->alsa_rate == track.sample_rate
+			    && alsa_id->alsa_channels == track.num_channels;
+			if (!reuse) {
+				snd_pcm_hw_params_free(alsa_id->alsa_hw_params);
+				alsa_id->alsa_configured = 0;
+			}
+		}
+	}
+
+	if (!reuse) {
+		/* Allocate space for hw_params (description of the sound parameters) */
+		MSG(2, "Allocating new hw_params structure");
+		if ((err = snd_pcm_hw_params_malloc(&alsa_id->alsa_hw_params)) < 0) {
+			ERR("Cannot allocate hardware parameter structure (%s)",
+			    snd_strerror(err));
+			pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+			return -1;
+		}
+
+		/* Initialize hw_params on our pcm */
+		if ((err =
+		     snd_pcm_hw_params_any(alsa_id->alsa_pcm,
+					   alsa_id->alsa_hw_params)) < 0) {
+			ERR("Cannot initialize hardware parameter structure (%s)",
+			    snd_strerror(err));
+			pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
+			return -1;
+		}
 	}
 
 	/* Create the pipe for communication about stop requests */
@@ -487,25 +696,9 @@ static int alsa_begin(AudioID * id, AudioTrack track)
 	MSG(4, "PCM state before setting audio parameters: %s",
 	    snd_pcm_state_name(state));
 
-	/* Choose the correct format */
-	if (track.bits == 16) {
-		switch (alsa_id->id.format) {
-		case SPD_AUDIO_LE:
-			format = SND_PCM_FORMAT_S16_LE;
-			break;
-		case SPD_AUDIO_BE:
-			format = SND_PCM_FORMAT_S16_BE;
-			break;
-		default:
-			ERR("unknown audio format (%d)", alsa_id->id.format);
-			return -1;
-		}
-	} else if (track.bits == 8) {
-		format = SND_PCM_FORMAT_S8;
-	} else {
-		ERR("Unsupported sound data format, track.bits = %d",
-		    track.bits);
-		return -1;
+	if (reuse) {
+		MSG(4, "Reusing the current hardware parameters");
+		return alsa_reuse(alsa_id, track);
 	}
 
 	/* Set access mode, bitrate, sample rate and channels */
@@ -597,9 +790,26 @@ static int alsa_begin(AudioID * id, AudioTrack track)
 		return -1;
 	}
 
+	if (alsa_id->alsa_idle_timeout) {
+		alsa_id->alsa_configured = 1;
+		alsa_id->alsa_format = format;
+		alsa_id->alsa_rate = track.sample_rate;
+		alsa_id->alsa_channels = track.num_channels;
+	}
+
 	return 0;
 }
 
+static int alsa_begin(AudioID * id, AudioTrack track)
+{
+	int ret = _alsa_begin(id, track);
+
+	/* Let the idle thread close the device again */
+	if (ret && id)
+		alsa_idle((spd_alsa_id_t *) id);
+	return ret;
+}
+
 /* Push audio track to ALSA playback */
 static int alsa_feed(AudioID * id, AudioTrack track)
 {
@@ -608,8 +818,6 @@ static int alsa_feed(AudioID * id, AudioTrack track)
 	spd_alsa_id_t *alsa_id = (spd_alsa_id_t *) id;
 
 	AudioTrack track_volume;
-	float real_volume;
-	int i;
 
 	signed short *output_samples;
 
@@ -631,9 +839,9 @@ static int alsa_feed(AudioID * id, AudioTrack track)
 	MSG(4, "Making copy of track and adjusting volume");
 	track_volume = track;
 	track_volume.samples = (short *)g_malloc(volume_size);
-	real_volume = ((float)alsa_id->id.volume + 100) / (float)200;
-	for (i = 0; i <= track.num_samples - 1; i++)
-		track_volume.samples[i] = track.samples[i] * real_volume;
+	spd_audio_gain_s16(track_volume.samples, track.samples,
+			   track.num_samples,
+			   spd_audio_volume_gain(alsa_id->id.volume));
 
 	/* Loop until all samples are played on the device. */
 	output_samples = track_volume.samples;
@@ -897,11 +1105,51 @@ static int alsa_feed_sync_overlap(AudioID * id, AudioTrack track)
 	return alsa_drain_overlap(id, track);
 }
 
+static void alsa_get_xruns(AudioID * id, int *xruns, int *suspends)
+{
+	spd_alsa_id_t *alsa_id = (spd_alsa_id_t *) id;
+
+	*xruns = g_atomic_int_get(&alsa_id->alsa_xruns);
+	*suspends = g_atomic_int_get(&alsa_id->alsa_suspends);
+}
+
+/* Microseconds until what was fed so far is played */
+static int alsa_get_delay(AudioID * id)
+{
+	spd_alsa_id_t *alsa_id = (spd_alsa_id_t *) id;
+	snd_pcm_sframes_t frames;
+	unsigned int rate;
+	int err;
+
+	if (!alsa_id->alsa_pcm)
+		return -1;
+
+	err = snd_pcm_delay(alsa_id->alsa_pcm, &frames);
+	if (err == -EPIPE)
+		/* Underrun, nothing left to play */
+		return 0;
+	if (err < 0) {
+		MSG(4, "snd_pcm_delay() failed: %s", snd_strerror(err));
+		return -1;
+	}
+	if (snd_pcm_hw_params_get_rate(alsa_id->alsa_hw_params, &rate, 0) < 0
+	    || rate == 0)
+		return -1;
+
+	return frames <= 0 ? 0 : (gint64) frames * 1000000 / rate;
+}
+
 static int alsa_end(AudioID * id)
 {
 	spd_alsa_id_t *alsa_id = (spd_alsa_id_t *) id;
 	int err;
 
+	if (!alsa_id->alsa_pcm) {
+		/* Closed while idle and could not be opened again */
+		alsa_idle(alsa_id);
+		return 0;
+	}
+
 	if (!alsa_id->stop_requested)
 		alsa_drain(id);
 
@@ -911,8 +1159,19 @@ static int alsa_end(AudioID * id)
 		return -1;
 	}
 
-	MSG(2, "Freeing HW parameters");
-	snd_pcm_hw_params_free(alsa_id->alsa_hw_params);
+	if (alsa_id->alsa_configured) {
+		/* Keep the hardware parameters, just get ready for the next
+		   track */
+		if ((err = snd_pcm_prepare(alsa_id->alsa_pcm)) < 0) {
+			MSG(2, "Cannot prepare device (%s), freeing HW parameters",
+			    snd_strerror(err));
+			snd_pcm_hw_params_free(alsa_id->alsa_hw_params);
+			alsa_id->alsa_configured = 0;
+		}
+	} else {
+		MSG(2, "Freeing HW parameters");
+		snd_pcm_hw_params_free(alsa_id->alsa_hw_params);
+	}
 
 	pthread_mutex_lock(&alsa_id->alsa_pipe_mutex);
 	alsa_id->alsa_opened = 0;
@@ -922,6 +1181,8 @@ static int alsa_end(AudioID * id)
 	g_free(alsa_id->alsa_poll_fds);
 	pthread_mutex_unlock(&alsa_id->alsa_pipe_mutex);
 
+	alsa_idle(alsa_id);
+
 	MSG(1, "End of playback on ALSA");
 
 	return 0;
@@ -1026,6 +1287,9 @@ static spd_audio_plugin_t alsa_functions = {
 	alsa_feed_sync,
 	alsa_feed_sync_overlap,
 	alsa_end,
+	alsa_feed,
+	alsa_get_delay,
+	alsa_get_xruns,
 };
 
 spd_audio_plugin_t *alsa_plugin_get(void)
@@ -1039,5 +1303,10 @@ spd_audio_plugin_t *
 {
 	return &alsa_functions;
 }
+
+int __attribute__ ((weak)) SPD_AUDIO_PLUGIN_ABI_ENTRY(void)
+{
+	return SPD_AUDIO_PLUGIN_ABI;
+}
 #undef MSG
 #undef ERR
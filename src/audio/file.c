@@ -0,0 +1,595 @@
+/*
+ * file.c -- The file sink backend for the spd_audio library.
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This records the audio into a WAV or FLAC file instead of playing it.
+ * Feeding only copies the samples into big buffers, which a thread of ours
+ * writes to the file in order, so that it never waits for the disk.  Unless
+ * pacing was asked for, the audio is taken as fast as it comes; with pacing,
+ * feeding takes as long as playing would.  Consecutive messages go to the
+ * same file as long as their format is the same, another format starts a
+ * new file.  Files which exist already, e.g. from a previous run, are left
+ * alone and the next numbered name is taken.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <glib.h>
+#include <sndfile.h>
+
+#ifdef USE_DLOPEN
+#define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#else
+#define SPD_AUDIO_PLUGIN_ENTRY spd_file_LTX_spd_audio_plugin_get
+#endif
+#include <spd_audio_plugin.h>
+
+/* Put a message into the logfile (stderr) */
+#define MSG(level, arg...) \
+	if(level <= file_log_level){ \
+		time_t t; \
+		struct timeval tv; \
+		char *tstr; \
+		t = time(NULL); \
+		tstr = g_strdup(ctime(&t)); \
+		tstr[strlen(tstr)-1] = 0; \
+		gettimeofday(&tv,NULL); \
+		fprintf(stderr," %s [%d]",tstr, (int) tv.tv_usec); \
+		fprintf(stderr," file:: "); \
+		fprintf(stderr,arg); \
+		fprintf(stderr,"\n"); \
+		fflush(stderr); \
+		g_free(tstr); \
+	}
+
+#define ERR(arg...) \
+	{ \
+		time_t t; \
+		struct timeval tv; \
+		char *tstr; \
+		t = time(NULL); \
+		tstr = g_strdup(ctime(&t)); \
+		tstr[strlen(tstr)-1] = 0; \
+		gettimeofday(&tv,NULL); \
+		fprintf(stderr," %s [%d]",tstr, (int) tv.tv_usec); \
+		fprintf(stderr," file ERROR: "); \
+		fprintf(stderr,arg); \
+		fprintf(stderr,"\n"); \
+		fflush(stderr); \
+		g_free(tstr); \
+	}
+
+/* Samples are handed to the writer thread by buffers of this size */
+#define FILE_BUFFER_SIZE (1024 * 1024)
+/* Feeding waits when that many buffers are still to be written */
+#define FILE_MAX_PENDING 16
+/* With pacing, feed_sync_overlap() returns that early, in us */
+#define FILE_OVERLAP_US 100000
+/* Numbered names tried when the files exist already */
+#define FILE_MAX_TRIES 1000
+
+static int file_log_level;
+
+typedef enum {
+	FILE_JOB_OPEN,
+	FILE_JOB_DATA,
+	FILE_JOB_QUIT,
+} file_job_type;
+
+typedef struct {
+	file_job_type type;
+	char *path;		/* FILE_JOB_OPEN, %n replaced */
+	SF_INFO info;		/* FILE_JOB_OPEN */
+	GByteArray *data;	/* FILE_JOB_DATA, 16bit samples */
+} file_job;
+
+typedef struct {
+	AudioID id;
+	char *path;		/* as configured, %n is the name */
+	char *name;
+	int realtime;
+	int files;		/* numbers taken so far, writer only */
+
+	/* Format of the current file, 0 when there is none yet */
+	int rate;
+	int channels;
+	int bits;
+
+	GByteArray *buffer;	/* not handed to the writer yet */
+	GAsyncQueue *jobs;
+	pthread_t writer;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;	/* on CLOCK_MONOTONIC */
+	int pending;		/* data jobs not written yet */
+	int stop_requested;
+	int opening;		/* FILE_JOB_OPEN not done yet */
+	int failed;		/* the writer has no file to write to */
+
+	/* With pacing, when the audio fed since then would have been
+	 * played from, in us of CLOCK_MONOTONIC, and how many frames */
+	gint64 start;
+	guint64 frames;
+} spd_file_id_t;
+
+static gint64 file_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* sf does not own fd, see sf_open_fd() */
+static void file_writer_close(SNDFILE ** sf, int *fd)
+{
+	if (*sf)
+		sf_close(*sf);
+	*sf = NULL;
+	if (*fd >= 0)
+		close(*fd);
+	*fd = -1;
+}
+
+/* path with a number before the extension, for all but the first one */
+static char *file_numbered_path(const char *path, int number)
+{
+	const char *dot, *base;
+
+	if (number == 1)
+		return g_strdup(path);
+
+	base = strrchr(path, '/');
+	dot = strrchr(base ? base : path, '.');
+	if (dot == NULL)
+		dot = path + strlen(path);
+	return g_strdup_printf("%.*s-%d%s", (int)(dot - path), path, number,
+			       dot);
+}
+
+/* Create the next numbered file of path which does not exist yet, e.g. left
+ * by a previous run, and return its name.  fd is -1 when it failed. */
+static char *file_writer_create(spd_file_id_t * file_id, const char *path,
+				int *fd)
+{
+	char *numbered = NULL;
+	int tries;
+
+	for (tries = 0; tries < FILE_MAX_TRIES; tries++) {
+		g_free(numbered);
+		numbered = file_numbered_path(path, ++file_id->files);
+		/* What gets spoken is only for us to hear, and the path must
+		   not lead elsewhere */
+		*fd = open(numbered, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW
+			   | O_CLOEXEC, 0600);
+		if (*fd >= 0 || errno != EEXIST)
+			break;
+	}
+	if (*fd < 0)
+		ERR("Can't create %s: %s", numbered, strerror(errno));
+	return numbered;
+}
+
+static void *file_writer(void *data)
+{
+	spd_file_id_t *file_id = data;
+	SNDFILE *sf = NULL;
+	int fd = -1;
+	file_job *job;
+	char *path;
+	int quit = 0, failed = 0;
+	sf_count_t items;
+
+	while (!quit) {
+		job = g_async_queue_pop(file_id->jobs);
+		switch (job->type) {
+		case FILE_JOB_OPEN:
+			file_writer_close(&sf, &fd);
+			path = file_writer_create(file_id, job->path, &fd);
+			if (fd >= 0) {
+				sf = sf_open_fd(fd, SFM_WRITE, &job->info,
+						SF_FALSE);
+				if (sf == NULL)
+					ERR("Can't create %s: %s", path,
+					    sf_strerror(NULL));
+			}
+			failed = sf == NULL;
+			if (!failed) {
+				MSG(3, "Recording into %s", path);
+			}
+			if (failed)
+				file_writer_close(&sf, &fd);
+			g_free(path);
+			g_free(job->path);
+
+			pthread_mutex_lock(&file_id->mutex);
+			file_id->opening = 0;
+			file_id->failed = failed;
+			pthread_cond_broadcast(&file_id->cond);
+			pthread_mutex_unlock(&file_id->mutex);
+			break;
+		case FILE_JOB_DATA:
+			items = job->data->len / 2;
+			if (sf && sf_write_short(sf, (short *)job->data->data,
+						 items) != items && !failed) {
+				ERR("Can't write the audio: %s",
+				    sf_strerror(sf));
+				failed = 1;
+			}
+			g_byte_array_free(job->data, TRUE);
+
+			pthread_mutex_lock(&file_id->mutex);
+			file_id->failed = failed;
+			file_id->pending--;
+			pthread_cond_broadcast(&file_id->cond);
+			pthread_mutex_unlock(&file_id->mutex);
+			break;
+		case FILE_JOB_QUIT:
+			file_writer_close(&sf, &fd);
+			quit = 1;
+			break;
+		}
+		g_free(job);
+	}
+
+	return NULL;
+}
+
+static void file_push(spd_file_id_t * file_id, file_job_type type)
+{
+	file_job *job = g_new0(file_job, 1);
+
+	job->type = type;
+	g_async_queue_push(file_id->jobs, job);
+}
+
+/* Hand what was fed to the writer */
+static void file_flush(spd_file_id_t * file_id)
+{
+	file_job *job;
+
+	if (file_id->buffer->len == 0)
+		return;
+
+	pthread_mutex_lock(&file_id->mutex);
+	while (file_id->pending >= FILE_MAX_PENDING)
+		pthread_cond_wait(&file_id->cond, &file_id->mutex);
+	file_id->pending++;
+	pthread_mutex_unlock(&file_id->mutex);
+
+	job = g_new0(file_job, 1);
+	job->type = FILE_JOB_DATA;
+	job->data = file_id->buffer;
+	g_async_queue_push(file_id->jobs, job);
+	file_id->buffer = g_byte_array_sized_new(FILE_BUFFER_SIZE);
+}
+
+/*
+ Open the file sink
+
+ Arguments:
+      (char*) pars[5] -- the name to replace %n of the path with
+      (char*) pars[7] -- the path of the file, FLAC when it ends with .flac,
+			 WAV otherwise
+      (char*) pars[9] -- "1" to pace the audio as if it was played
+*/
+static AudioID *file_open(void **pars)
+{
+	spd_file_id_t *file_id;
+	pthread_condattr_t attr;
+
+	if (pars[7] == NULL || ((char *)pars[7])[0] == '\0') {
+		ERR("No AudioFilePath to record into");
+		return NULL;
+	}
+
+	file_id = g_new0(spd_file_id_t, 1);
+	file_id->path = g_strdup(pars[7]);
+	file_id->name = g_strdup(pars[5] ? pars[5] : "speech-dispatcher");
+	file_id->realtime = pars[9] && atoi(pars[9]);
+	file_id->buffer = g_byte_array_sized_new(FILE_BUFFER_SIZE);
+	file_id->jobs = g_async_queue_new();
+	pthread_mutex_init(&file_id->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&file_id->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	/* The file is only created once there is audio to put in it */
+	if (pthread_create(&file_id->writer, NULL, file_writer, file_id)) {
+		ERR("Can't create the writer thread");
+		g_async_queue_unref(file_id->jobs);
+		g_byte_array_free(file_id->buffer, TRUE);
+		g_free(file_id->name);
+		g_free(file_id->path);
+		g_free(file_id);
+		return NULL;
+	}
+
+	return (AudioID *) file_id;
+}
+
+static int file_begin(AudioID * id, AudioTrack track)
+{
+	spd_file_id_t *file_id = (spd_file_id_t *) id;
+	file_job *job;
+	gchar **parts;
+	const char *ext;
+	gint64 now;
+	int failed;
+
+	if (file_id == NULL)
+		return -1;
+
+	if (track.bits != 16 && track.bits != 8) {
+		ERR("Unrecognized sound data format.");
+		return -10;
+	}
+
+	/* Another file is also tried when the last one could not be written */
+	pthread_mutex_lock(&file_id->mutex);
+	failed = file_id->failed;
+	pthread_mutex_unlock(&file_id->mutex);
+
+	if (track.sample_rate != file_id->rate
+	    || track.num_channels != file_id->channels || failed) {
+		file_flush(file_id);
+
+		parts = g_strsplit(file_id->path, "%n", -1);
+		job = g_new0(file_job, 1);
+		job->type = FILE_JOB_OPEN;
+		job->path = g_strjoinv(file_id->name, parts);
+		g_strfreev(parts);
+		ext = strrchr(job->path, '.');
+		job->info.samplerate = track.sample_rate;
+		job->info.channels = track.num_channels;
+		job->info.format = (ext && !g_ascii_strcasecmp(ext, ".flac")
+				    ? SF_FORMAT_FLAC : SF_FORMAT_WAV)
+		    | SF_FORMAT_PCM_16;
+
+		pthread_mutex_lock(&file_id->mutex);
+		file_id->opening = 1;
+		g_async_queue_push(file_id->jobs, job);
+		while (file_id->opening)
+			pthread_cond_wait(&file_id->cond, &file_id->mutex);
+		failed = file_id->failed;
+		pthread_mutex_unlock(&file_id->mutex);
+
+		if (failed) {
+			file_id->rate = 0;
+			return -1;
+		}
+
+		file_id->rate = track.sample_rate;
+		file_id->channels = track.num_channels;
+		file_id->start = 0;
+	}
+	file_id->bits = track.bits;
+
+	pthread_mutex_lock(&file_id->mutex);
+	file_id->stop_requested = 0;
+	pthread_mutex_unlock(&file_id->mutex);
+
+	/* Follow the previous message unless it was over already */
+	now = file_now();
+	if (file_id->start == 0 || file_id->start + (gint64)
+	    (file_id->frames * G_USEC_PER_SEC / file_id->rate) < now) {
+		file_id->start = now;
+		file_id->frames = 0;
+	}
+
+	return 0;
+}
+
+/* With pacing, wait until all but lead us of what was fed would have been
+ * played, returns -1 when stopped meanwhile */
+static int file_pace(spd_file_id_t * file_id, gint64 lead)
+{
+	gint64 due;
+	struct timespec ts;
+	int ret = 0;
+
+	if (!file_id->realtime || file_id->rate <= 0)
+		return 0;
+
+	due = file_id->start
+	    + (gint64) (file_id->frames * G_USEC_PER_SEC / file_id->rate)
+	    - lead;
+	ts.tv_sec = due / G_USEC_PER_SEC;
+	ts.tv_nsec = (due % G_USEC_PER_SEC) * 1000;
+
+	pthread_mutex_lock(&file_id->mutex);
+	while (!file_id->stop_requested && file_now() < due)
+		pthread_cond_timedwait(&file_id->cond, &file_id->mutex, &ts);
+	if (file_id->stop_requested)
+		ret = -1;
+	pthread_mutex_unlock(&file_id->mutex);
+
+	return ret;
+}
+
+static int file_feed(spd_file_id_t * file_id, AudioTrack track, gint64 lead)
+{
+	size_t n, i;
+	guint len;
+	int stopped, failed;
+
+	if (file_id == NULL || file_id->rate <= 0)
+		return -1;
+
+	pthread_mutex_lock(&file_id->mutex);
+	stopped = file_id->stop_requested;
+	failed = file_id->failed;
+	pthread_mutex_unlock(&file_id->mutex);
+	if (failed)
+		return -1;
+	if (stopped || track.samples == NULL || track.num_samples <= 0)
+		return 0;
+
+	n = (size_t) track.num_samples * track.num_channels;
+	len = file_id->buffer->len;
+	if (track.bits == 16) {
+		g_byte_array_append(file_id->buffer,
+				    (const guint8 *)track.samples, n * 2);
+	} else {
+		const guint8 *samples8 = (const guint8 *)track.samples;
+		gint16 *samples;
+
+		g_byte_array_set_size(file_id->buffer, len + n * 2);
+		samples = (gint16 *) (file_id->buffer->data + len);
+		for (i = 0; i < n; i++)
+			samples[i] = (samples8[i] - 128) << 8;
+	}
+	if (file_id->buffer->len >= FILE_BUFFER_SIZE)
+		file_flush(file_id);
+
+	file_id->frames += track.num_samples;
+	file_pace(file_id, lead);
+	return 0;
+}
+
+static int file_feed_sync(AudioID * id, AudioTrack track)
+{
+	return file_feed((spd_file_id_t *) id, track, 0);
+}
+
+static int file_feed_sync_overlap(AudioID * id, AudioTrack track)
+{
+	return file_feed((spd_file_id_t *) id, track, FILE_OVERLAP_US);
+}
+
+/* The file is left open for the next message */
+static int file_end(AudioID * id)
+{
+	spd_file_id_t *file_id = (spd_file_id_t *) id;
+
+	if (file_id == NULL)
+		return -1;
+
+	file_flush(file_id);
+	file_pace(file_id, 0);
+	return 0;
+}
+
+static int file_play(AudioID * id, AudioTrack track)
+{
+	int ret;
+
+	ret = file_begin(id, track);
+	if (ret)
+		return ret;
+
+	ret = file_feed_sync(id, track);
+	file_end(id);
+	return ret;
+}
+
+static int file_stop(AudioID * id)
+{
+	spd_file_id_t *file_id = (spd_file_id_t *) id;
+
+	if (file_id == NULL)
+		return -1;
+
+	pthread_mutex_lock(&file_id->mutex);
+	file_id->stop_requested = 1;
+	pthread_cond_broadcast(&file_id->cond);
+	pthread_mutex_unlock(&file_id->mutex);
+	return 0;
+}
+
+static int file_close(AudioID * id)
+{
+	spd_file_id_t *file_id = (spd_file_id_t *) id;
+
+	if (file_id == NULL)
+		return -1;
+
+	/* Write out everything before returning */
+	file_flush(file_id);
+	file_push(file_id, FILE_JOB_QUIT);
+	pthread_join(file_id->writer, NULL);
+
+	g_async_queue_unref(file_id->jobs);
+	g_byte_array_free(file_id->buffer, TRUE);
+	pthread_mutex_destroy(&file_id->mutex);
+	pthread_cond_destroy(&file_id->cond);
+	g_free(file_id->name);
+	g_free(file_id->path);
+	g_free(file_id);
+	return 0;
+}
+
+static int file_set_volume(AudioID * id, int volume)
+{
+	return 0;
+}
+
+static void file_set_loglevel(int level)
+{
+	if (level) {
+		file_log_level = level;
+	}
+}
+
+static char const *file_get_playcmd(void)
+{
+	return NULL;
+}
+
+/* Provide the file backend. */
+static spd_audio_plugin_t file_functions = {
+	"file",
+	file_open,
+	file_play,
+	file_stop,
+	file_close,
+	file_set_volume,
+	file_set_loglevel,
+	file_get_playcmd,
+	file_begin,
+	file_feed_sync,
+	file_feed_sync_overlap,
+	file_end,
+};
+
+spd_audio_plugin_t *file_plugin_get(void)
+{
+	return &file_functions;
+}
+
+spd_audio_plugin_t *
+    __attribute__ ((weak))
+    SPD_AUDIO_PLUGIN_ENTRY(void)
+{
+	return &file_functions;
+}
+#undef MSG
+#undef ERR
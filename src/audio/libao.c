@@ -125,35 +125,16 @@ static AudioID *libao_open(void **pars)
 	return id;
 }
 
-static int libao_play(AudioID * id, AudioTrack track)
+/* (Re)opens the device for tracks of this format */
+static int libao_begin(AudioID * id, AudioTrack track)
 {
-	int bytes_per_sample;
-
-	int num_bytes;
-
-	int outcnt = 0;
-
-	signed short *output_samples;
-
-	int i;
-
 	if (id == NULL)
 		return -1;
-	if (track.samples == NULL || track.num_samples <= 0)
-		return 0;
 
-	/* Choose the correct format */
-	if (track.bits == 16)
-		bytes_per_sample = 2;
-	else if (track.bits == 8)
-		bytes_per_sample = 1;
-	else {
+	if (track.bits != 16 && track.bits != 8) {
 		ERR("Audio: Unrecognized sound data format.\n");
 		return -10;
 	}
-	MSG(3, "Starting playback");
-	output_samples = track.samples;
-	num_bytes = track.num_samples * bytes_per_sample;
 
 	if ((device == NULL)
 	    || (track.num_channels != current_ao_parameters.channels)
@@ -168,12 +149,31 @@ static int libao_play(AudioID * id, AudioTrack track)
 		ERR("error opening libao dev");
 		return -2;
 	}
-	MSG(3, "bytes to play: %d, (%f secs)", num_bytes,
-	    (((float)(num_bytes) / 2) / (float)track.sample_rate));
 
 	ao_stop_playback = 0;
-	outcnt = 0;
-	i = 0;
+	MSG(3, "Starting playback");
+	return 0;
+}
+
+/* ao_play() returns once the driver took the audio, which it then still
+   has to play: without the device being closed in between, the next
+   track is given while this one plays, and they follow without a gap.
+   There is no way to know when it has played, so feed_sync and
+   feed_sync_overlap are the same. */
+static int libao_feed(AudioID * id, AudioTrack track)
+{
+	int num_bytes;
+	int outcnt = 0;
+	int i;
+
+	if (id == NULL || device == NULL)
+		return -1;
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
+
+	num_bytes = track.num_samples * track.num_channels * track.bits / 8;
+	MSG(3, "bytes to play: %d, (%f secs)", num_bytes,
+	    (float)track.num_samples / (float)track.sample_rate);
 
 	while ((outcnt < num_bytes) && !ao_stop_playback) {
 		if ((num_bytes - outcnt) > AO_SEND_BYTES)
@@ -181,7 +181,7 @@ static int libao_play(AudioID * id, AudioTrack track)
 		else
 			i = (num_bytes - outcnt);
 
-		if (!ao_play(device, (char *)output_samples + outcnt, i)) {
+		if (!ao_play(device, (char *)track.samples + outcnt, i)) {
 			libao_close_handle();
 			ERR("Audio: ao_play() - closing device - re-open it in next run\n");
 			return -1;
@@ -190,7 +190,28 @@ static int libao_play(AudioID * id, AudioTrack track)
 	}
 
 	return 0;
+}
+
+/* The device is kept open for the next message, as play() always did */
+static int libao_end(AudioID * id)
+{
+	return 0;
+}
+
+static int libao_play(AudioID * id, AudioTrack track)
+{
+	int ret;
+
+	if (id == NULL)
+		return -1;
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
+
+	ret = libao_begin(id, track);
+	if (ret)
+		return ret;
 
+	return libao_feed(id, track);
 }
 
 /* stop the libao_play() loop */
@@ -248,7 +269,11 @@ static spd_audio_plugin_t libao_functions = {
 	libao_close,
 	libao_set_volume,
 	libao_set_loglevel,
-	libao_get_playcmd
+	libao_get_playcmd,
+	libao_begin,
+	libao_feed,
+	libao_feed,
+	libao_end,
 };
 
 spd_audio_plugin_t *libao_plugin_get(void)
@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <glib.h>
 #include <audio/audiolib.h>
@@ -34,11 +35,19 @@
 
 #ifdef USE_DLOPEN
 #define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_audio_plugin_abi
 #else
 #define SPD_AUDIO_PLUGIN_ENTRY spd_nas_LTX_spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_nas_LTX_spd_audio_plugin_abi
 #endif
 #include <spd_audio_plugin.h>
 
+/* The server keeps that much audio of a stream, and asks for more once
+   half of it is played */
+#define NAS_BUFFER_MS 200
+/* How much audio may be left when feed_sync_overlap returns */
+#define NAS_OVERLAP_MS 40
+
 typedef struct {
 	AudioID id;
 	AuServer *aud;
@@ -47,6 +56,20 @@ typedef struct {
 	pthread_t nas_event_handler;
 	pthread_cond_t pt_cond;
 	pthread_mutex_t pt_mutex;
+
+	/* Between begin() and end(), the audio streams through a flow from
+	   the client to the device, fed from the event handler thread.
+	   All of this is under flow_mutex, and stream_cond signals
+	   progress. */
+	pthread_cond_t stream_cond;
+	AuFlowID stream;
+	AuEventHandlerRec *stream_handler;
+	GByteArray *pending;	/* not given to the server yet */
+	AuUint32 wanted;	/* bytes the server asked for and didn't get */
+	gboolean ending;	/* end() waits for the stream to stop */
+	gboolean stopped;	/* the stream is over */
+	int bytes_per_sec;
+	int xruns;		/* see nas_get_xruns() */
 } spd_nas_id_t;
 
 static int nas_log_level;
@@ -111,8 +134,17 @@ static AudioID *nas_open(void **pars)
 	   } */
 
 	nas_id->flow = 0;
+	nas_id->xruns = 0;
+	nas_id->stream = 0;
+	nas_id->stream_handler = NULL;
+	nas_id->pending = g_byte_array_new();
+	nas_id->wanted = 0;
+	nas_id->ending = FALSE;
+	nas_id->stopped = TRUE;
+	nas_id->bytes_per_sec = 0;
 
 	pthread_cond_init(&nas_id->pt_cond, NULL);
+	pthread_cond_init(&nas_id->stream_cond, NULL);
 	pthread_mutex_init(&nas_id->pt_mutex, NULL);
 	pthread_mutex_init(&nas_id->flow_mutex, NULL);
 
@@ -187,6 +219,217 @@ static int nas_play(AudioID * id, AudioTrack track)
 	return 0;
 }
 
+/* Called with flow_mutex held, gives the server what it asked for */
+static void _nas_stream_write(spd_nas_id_t * nas_id)
+{
+	AuUint32 bytes = MIN(nas_id->wanted, nas_id->pending->len);
+	AuBool last = nas_id->ending && bytes == nas_id->pending->len;
+
+	if (bytes == 0 && !last)
+		return;
+	AuWriteElement(nas_id->aud, nas_id->stream, 0, bytes,
+		       (AuPointer) nas_id->pending->data, last, NULL);
+	g_byte_array_remove_range(nas_id->pending, 0, bytes);
+	nas_id->wanted -= bytes;
+	if (last) {
+		/* Nothing more to ask for */
+		nas_id->wanted = 0;
+		nas_id->ending = FALSE;
+	}
+	pthread_cond_broadcast(&nas_id->stream_cond);
+}
+
+/* In the event handler thread */
+static AuBool _nas_stream_event(AuServer * aud, AuEvent * ev,
+				AuEventHandlerRec * handler)
+{
+	spd_nas_id_t *nas_id = (spd_nas_id_t *) handler->data;
+	AuElementNotifyEvent *event = (AuElementNotifyEvent *) ev;
+
+	if (ev->type != AuEventTypeElementNotify)
+		return AuTrue;
+
+	pthread_mutex_lock(&nas_id->flow_mutex);
+	switch (event->kind) {
+	case AuElementNotifyKindLowWater:
+		nas_id->wanted += event->num_bytes;
+		_nas_stream_write(nas_id);
+		break;
+	case AuElementNotifyKindState:
+		if (event->cur_state == AuStatePause) {
+			/* It ran out of audio */
+			if (event->reason == AuReasonUnderrun)
+				nas_id->xruns++;
+			nas_id->wanted += event->num_bytes;
+			_nas_stream_write(nas_id);
+		} else if (event->cur_state == AuStateStop) {
+			nas_id->stopped = TRUE;
+			pthread_cond_broadcast(&nas_id->stream_cond);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&nas_id->flow_mutex);
+
+	return AuTrue;
+}
+
+static AuDeviceID _nas_output_device(AuServer * aud, int channels)
+{
+	int i;
+
+	for (i = 0; i < AuServerNumDevices(aud); i++) {
+		AuDeviceAttributes *dev = AuServerDevice(aud, i);
+
+		if (AuDeviceKind(dev) == AuComponentKindPhysicalOutput
+		    && AuDeviceNumTracks(dev) == channels)
+			return AuDeviceIdentifier(dev);
+	}
+	return AuNone;
+}
+
+/* Sets up a flow streaming tracks of this format to the device */
+static int nas_begin(AudioID * id, AudioTrack track)
+{
+	spd_nas_id_t *nas_id = (spd_nas_id_t *) id;
+	AuElement elements[2];
+	AuDeviceID device;
+	AuUint32 buffer;
+
+	if (nas_id == NULL)
+		return -2;
+	if (track.bits != 16) {
+		fprintf(stderr, "NAS: Unsupported sample size %d\n", track.bits);
+		return -10;
+	}
+
+	device = _nas_output_device(nas_id->aud, track.num_channels);
+	if (device == AuNone) {
+		fprintf(stderr, "NAS: No output device for %d channels\n",
+			track.num_channels);
+		return -1;
+	}
+
+	buffer = track.sample_rate * NAS_BUFFER_MS / 1000;
+	AuMakeElementImportClient(&elements[0], track.sample_rate,
+#if G_BYTE_ORDER == G_BIG_ENDIAN
+				  AuFormatLinearSigned16MSB,
+#else
+				  AuFormatLinearSigned16LSB,
+#endif
+				  track.num_channels, AuTrue, buffer,
+				  buffer / 2, 0, NULL);
+	AuMakeElementExportDevice(&elements[1], 0, device, track.sample_rate,
+				  AuUnlimitedSamples, 0, NULL);
+
+	pthread_mutex_lock(&nas_id->flow_mutex);
+	nas_id->stream = AuCreateFlow(nas_id->aud, NULL);
+	if (nas_id->stream == AuNone) {
+		pthread_mutex_unlock(&nas_id->flow_mutex);
+		fprintf(stderr, "NAS: Couldn't create a flow\n");
+		return -1;
+	}
+	AuSetElements(nas_id->aud, nas_id->stream, AuTrue, 2, elements, NULL);
+
+	g_byte_array_set_size(nas_id->pending, 0);
+	nas_id->wanted = 0;
+	nas_id->ending = FALSE;
+	nas_id->stopped = FALSE;
+	nas_id->bytes_per_sec = track.sample_rate * track.num_channels * 2;
+	nas_id->stream_handler =
+	    AuRegisterEventHandler(nas_id->aud, AuEventHandlerIDMask, 0,
+				   nas_id->stream, _nas_stream_event,
+				   (AuPointer) nas_id);
+	AuStartFlow(nas_id->aud, nas_id->stream, NULL);
+	/* As for the other streams */
+	nas_id->flow = nas_id->stream;
+	pthread_mutex_unlock(&nas_id->flow_mutex);
+
+	return 0;
+}
+
+/* Queues the track, and waits until no more than LEFT bytes of what was
+   queued are still to be given to the server */
+static int _nas_feed(spd_nas_id_t * nas_id, AudioTrack track, guint left)
+{
+	guint bytes;
+
+	if (nas_id == NULL || nas_id->stream == 0)
+		return -1;
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
+
+	bytes = track.num_samples * track.num_channels * 2;
+	pthread_mutex_lock(&nas_id->flow_mutex);
+	if (!nas_id->stopped) {
+		g_byte_array_append(nas_id->pending, (guint8 *) track.samples,
+				    bytes);
+		/* It may be waiting for it */
+		_nas_stream_write(nas_id);
+		AuFlush(nas_id->aud);
+	}
+	while (!nas_id->stopped && nas_id->pending->len > left)
+		pthread_cond_wait(&nas_id->stream_cond, &nas_id->flow_mutex);
+	pthread_mutex_unlock(&nas_id->flow_mutex);
+
+	return 0;
+}
+
+/* The server is given the audio half a buffer at a time, what it has but
+   didn't play yet thus overlaps with what comes next */
+static int nas_feed_sync_overlap(AudioID * id, AudioTrack track)
+{
+	spd_nas_id_t *nas_id = (spd_nas_id_t *) id;
+
+	return _nas_feed(nas_id, track,
+			 nas_id ? nas_id->bytes_per_sec * NAS_OVERLAP_MS / 1000
+			 : 0);
+}
+
+static int nas_feed_sync(AudioID * id, AudioTrack track)
+{
+	return _nas_feed((spd_nas_id_t *) id, track, 0);
+}
+
+/* Lets the server play what it still has, and tears the flow down */
+static int nas_end(AudioID * id)
+{
+	spd_nas_id_t *nas_id = (spd_nas_id_t *) id;
+	struct timeval now;
+	struct timespec timeout;
+
+	if (nas_id == NULL || nas_id->stream == 0)
+		return 0;
+
+	pthread_mutex_lock(&nas_id->flow_mutex);
+	if (!nas_id->stopped) {
+		nas_id->ending = TRUE;
+		_nas_stream_write(nas_id);
+		AuFlush(nas_id->aud);
+	}
+	/* Don't hang on a server which doesn't tell */
+	gettimeofday(&now, NULL);
+	timeout.tv_sec = now.tv_sec + 1 + (nas_id->bytes_per_sec ?
+				     nas_id->pending->len
+				     / nas_id->bytes_per_sec : 0);
+	timeout.tv_nsec = now.tv_usec * 1000;
+	while (!nas_id->stopped)
+		if (pthread_cond_timedwait(&nas_id->stream_cond,
+					   &nas_id->flow_mutex, &timeout))
+			break;
+
+	if (nas_id->stream_handler)
+		AuUnregisterEventHandler(nas_id->aud, nas_id->stream_handler);
+	nas_id->stream_handler = NULL;
+	AuDestroyFlow(nas_id->aud, nas_id->stream, NULL);
+	nas_id->stream = 0;
+	nas_id->flow = 0;
+	nas_id->stopped = TRUE;
+	g_byte_array_set_size(nas_id->pending, 0);
+	pthread_mutex_unlock(&nas_id->flow_mutex);
+
+	return 0;
+}
+
 static int nas_stop(AudioID * id)
 {
 	spd_nas_id_t *nas_id = (spd_nas_id_t *) id;
@@ -197,7 +440,13 @@ static int nas_stop(AudioID * id)
 	pthread_mutex_lock(&nas_id->flow_mutex);
 	if (nas_id->flow != 0)
 		AuStopFlow(nas_id->aud, nas_id->flow, NULL);
-	nas_id->flow = 0;
+	if (nas_id->stream != 0) {
+		/* The stream is torn down by end() */
+		nas_id->stopped = TRUE;
+		g_byte_array_set_size(nas_id->pending, 0);
+		pthread_cond_broadcast(&nas_id->stream_cond);
+	} else
+		nas_id->flow = 0;
 	pthread_mutex_unlock(&nas_id->flow_mutex);
 
 	pthread_mutex_lock(&nas_id->pt_mutex);
@@ -219,6 +468,8 @@ static int nas_close(AudioID * id)
 
 	pthread_mutex_destroy(&nas_id->pt_mutex);
 	pthread_mutex_destroy(&nas_id->flow_mutex);
+	pthread_cond_destroy(&nas_id->stream_cond);
+	g_byte_array_free(nas_id->pending, TRUE);
 
 	AuCloseServer(nas_id->aud);
 
@@ -245,6 +496,15 @@ static char const *nas_get_playcmd(void)
 	return NULL;
 }
 
+static void nas_get_xruns(AudioID * id, int *xruns, int *suspends)
+{
+	spd_nas_id_t *nas_id = (spd_nas_id_t *) id;
+
+	pthread_mutex_lock(&nas_id->flow_mutex);
+	*xruns = nas_id->xruns;
+	pthread_mutex_unlock(&nas_id->flow_mutex);
+}
+
 /* Provide the NAS backend */
 static spd_audio_plugin_t nas_functions = {
 	"nas",
@@ -254,7 +514,14 @@ static spd_audio_plugin_t nas_functions = {
 	nas_close,
 	nas_set_volume,
 	nas_set_loglevel,
-	nas_get_playcmd
+	nas_get_playcmd,
+	nas_begin,
+	nas_feed_sync,
+	nas_feed_sync_overlap,
+	nas_end,
+	NULL,
+	NULL,
+	nas_get_xruns,
 };
 
 spd_audio_plugin_t *nas_plugin_get(void)
@@ -268,3 +535,8 @@ spd_audio_plugin_t *
 {
 	return &nas_functions;
 }
+
+int __attribute__ ((weak)) SPD_AUDIO_PLUGIN_ABI_ENTRY(void)
+{
+	return SPD_AUDIO_PLUGIN_ABI;
+}
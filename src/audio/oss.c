@@ -34,6 +34,7 @@
 #include <errno.h>
 #include <unistd.h>		/* for open, close */
 #include <sys/ioctl.h>
+#include <poll.h>
 #include <pthread.h>
 #include <glib.h>
 
@@ -41,23 +42,39 @@
 
 #ifdef USE_DLOPEN
 #define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_audio_plugin_abi
 #else
 #define SPD_AUDIO_PLUGIN_ENTRY spd_oss_LTX_spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_oss_LTX_spd_audio_plugin_abi
 #endif
 #include <spd_audio_plugin.h>
+#include <spd_audio_convert.h>
+
+/* Fragments are asked to hold about OSS_FRAGMENT_MS of audio, and the
+   device to buffer OSS_FRAGMENTS of them, so that a stop is heard soon
+   and writes are small enough to be interleaved with stop checks */
+#define OSS_FRAGMENT_MS 10
+#define OSS_FRAGMENTS 8
+
+/* How much audio may be left when feed_sync_overlap returns */
+#define OSS_OVERLAP_USEC 20000
+/* Longest wait between two checks of the playback progress */
+#define OSS_POLL_USEC 10000
 
 typedef struct {
 	AudioID id;
 	int fd;
 	char *device_name;
 	pthread_mutex_t fd_mutex;
-	pthread_cond_t pt_cond;
-	pthread_mutex_t pt_mutex;
+	int stop_pipe[2];	/* woken up by oss_stop */
+	int stop_requested;
+
+	int rate;		/* as set on the device */
+	int stride;		/* bytes per frame */
 } spd_oss_id_t;
 
 static int _oss_open(spd_oss_id_t * id);
 static int _oss_close(spd_oss_id_t * id);
-static int _oss_sync(spd_oss_id_t * id);
 
 /* Put a message into the logfile (stderr) */
 #define MSG(level, arg...) \
@@ -102,7 +119,9 @@ static int _oss_open(spd_oss_id_t * id)
 	MSG(1, "_oss_open()")
 	    pthread_mutex_lock(&id->fd_mutex);
 
-	id->fd = open(id->device_name, O_WRONLY, 0);
+	/* Non-blocking, both for open() when the device is busy and for
+	   write() when its buffer is full */
+	id->fd = open(id->device_name, O_WRONLY | O_NONBLOCK, 0);
 	if (id->fd < 0) {
 		perror(id->device_name);
 		pthread_mutex_unlock(&id->fd_mutex);
@@ -144,24 +163,29 @@ static AudioID *oss_open(void **pars)
 	if (pars[0] == NULL)
 		return NULL;
 
-	oss_id = (spd_oss_id_t *) g_malloc(sizeof(spd_oss_id_t));
+	oss_id = (spd_oss_id_t *) g_malloc0(sizeof(spd_oss_id_t));
 
 	oss_id->device_name = g_strdup((char *)pars[0]);
+	oss_id->fd = -1;
 
 	pthread_mutex_init(&oss_id->fd_mutex, NULL);
 
-	pthread_cond_init(&oss_id->pt_cond, NULL);
-	pthread_mutex_init(&oss_id->pt_mutex, NULL);
-
-	/* Test if it's possible to access the device */
-	ret = _oss_open(oss_id);
-	if (ret) {
+	if (pipe(oss_id->stop_pipe)) {
+		ERR("Can't create the stop pipe: %s", strerror(errno));
 		g_free(oss_id->device_name);
 		g_free(oss_id);
 		return NULL;
 	}
-	ret = _oss_close(oss_id);
+	fcntl(oss_id->stop_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(oss_id->stop_pipe[1], F_SETFL, O_NONBLOCK);
+
+	/* Test if it's possible to access the device */
+	ret = _oss_open(oss_id);
+	if (!ret)
+		ret = _oss_close(oss_id);
 	if (ret) {
+		close(oss_id->stop_pipe[0]);
+		close(oss_id->stop_pipe[1]);
 		g_free(oss_id->device_name);
 		g_free(oss_id);
 		return NULL;
@@ -170,40 +194,45 @@ static AudioID *oss_open(void **pars)
 	return (AudioID *) oss_id;
 }
 
-/* Internal function. */
-static int _oss_sync(spd_oss_id_t * id)
+/* Waits until the device has room for more samples, for at most TIMEOUT
+   milliseconds (-1 for no limit).  Returns 1 if a stop was requested, 0
+   otherwise and -1 on errors.  */
+static int oss_wait(spd_oss_id_t * id, short events, int timeout)
 {
-	int ret;
+	struct pollfd fds[2];
+	char buf[16];
+	int n = 0, ret;
+
+	fds[n].fd = id->stop_pipe[0];
+	fds[n++].events = POLLIN;
+	if (events) {
+		fds[n].fd = id->fd;
+		fds[n++].events = events;
+	}
 
-	ret = ioctl(id->fd, SNDCTL_DSP_POST, 0);
-	if (ret == -1) {
-		perror("reset");
+	do
+		ret = poll(fds, n, timeout);
+	while (ret < 0 && errno == EINTR);
+	if (ret < 0) {
+		ERR("poll() failed: %s", strerror(errno));
 		return -1;
 	}
-	return 0;
+
+	if (fds[0].revents & POLLIN) {
+		while (read(id->stop_pipe[0], buf, sizeof(buf)) > 0) ;
+		return 1;
+	}
+	return id->stop_requested;
 }
 
-static int oss_play(AudioID * id, AudioTrack track)
+/* Sets the device up for tracks of this format */
+static int oss_begin(AudioID * id, AudioTrack track)
 {
-	int ret, ret2;
-	struct timeval now;
-	struct timespec timeout;
-	float length;
-	int r = 0;
-	int format, oformat, channels, speed;
-	int bytes_per_sample;
-	int num_bytes;
-	signed short *output_samples;
-	float delay = 0;
-	float DELAY = 0.1;	/* in seconds */
-	audio_buf_info info;
-	int bytes;
-	float real_volume;
-	int i;
-	int re;
 	spd_oss_id_t *oss_id = (spd_oss_id_t *) id;
-
-	AudioTrack track_volume;
+	int ret;
+	int format, oformat, channels, speed;
+	int frag_bytes, frag_shift, fragment;
+	char buf[16];
 
 	if (oss_id == NULL)
 		return -1;
@@ -215,26 +244,30 @@ static int oss_play(AudioID * id, AudioTrack track)
 	if (ret)
 		return -2;
 
-	/* Create a copy of track with the adjusted volume */
-	track_volume = track;
-	track_volume.samples =
-	    (short *)g_malloc(sizeof(short) * track.num_samples);
-	real_volume = ((float)id->volume + 100) / (float)200;
-	for (i = 0; i <= track.num_samples - 1; i++)
-		track_volume.samples[i] = track.samples[i] * real_volume;
+	oss_id->stop_requested = 0;
+	while (read(oss_id->stop_pipe[0], buf, sizeof(buf)) > 0) ;
 
 	/* Choose the correct format */
 	if (track.bits == 16) {
 		format = AFMT_S16_NE;
-		bytes_per_sample = 2;
 	} else if (track.bits == 8) {
-		bytes_per_sample = 1;
 		format = AFMT_S8;
 	} else {
 		ERR("Audio: Unrecognized sound data format.\n");
 		_oss_close(oss_id);
 		return -10;
 	}
+	oss_id->stride = track.bits / 8 * track.num_channels;
+
+	/* This has to come before the format is set.  The low 16 bits are
+	   the log2 of the fragment size, the high ones their count.  The
+	   device may not honour it, we only ever look at what it reports. */
+	frag_bytes = OSS_FRAGMENT_MS * track.sample_rate / 1000 * oss_id->stride;
+	for (frag_shift = 4; frag_shift < 16 && (1 << frag_shift) < frag_bytes;
+	     frag_shift++) ;
+	fragment = (OSS_FRAGMENTS << 16) | frag_shift;
+	if (ioctl(oss_id->fd, SNDCTL_DSP_SETFRAGMENT, &fragment) == -1)
+		MSG(2, "Can't set the fragment size: %s", strerror(errno));
 
 	oformat = format;
 	ret = ioctl(oss_id->fd, SNDCTL_DSP_SETFMT, &format);
@@ -276,156 +309,147 @@ static int oss_play(AudioID * id, AudioTrack track)
 		ERR("Device doesn't support bitrate %d, using %d instead.\n",
 		    track.sample_rate, speed);
 	}
+	oss_id->rate = speed;
 
-	/* Is it not an empty track? */
-	if (track.samples == NULL) {
-		_oss_close(oss_id);
-		return 0;
-	}
-
-	/* Loop until all samples are played on the device.
-	   In the meantime, wait in pthread_cond_timedwait for more data
-	   or for interruption. */
 	MSG(4, "Starting playback");
-	output_samples = track_volume.samples;
-	num_bytes = track.num_samples * bytes_per_sample;
-	MSG(4, "bytes to play: %d, (%f secs)", num_bytes,
-	    (((float)(num_bytes) / 2) / (float)track.sample_rate));
-	while (num_bytes > 0) {
-
-		/* OSS doesn't support non-blocking write, so lets check how much data
-		   can we write so that write() returns immediately */
-		re = ioctl(oss_id->fd, SNDCTL_DSP_GETOSPACE, &info);
-		if (re == -1) {
-			perror("OSS ERROR: GETOSPACE");
-			_oss_close(oss_id);
-			return -5;
-		}
-
-		/* If there is not enough space for a single fragment, try later.
-		   (This shouldn't happen, it has very bad effect on synchronization!) */
-		if (info.fragments == 0) {
-			MSG(4,
-			    "WARNING: There is not enough space for a single fragment, looping");
-			usleep(100);
-			continue;
-		}
-
-		MSG(4,
-		    "There is space for %d more fragments, fragment size is %d bytes",
-		    info.fragments, info.fragsize);
-
-		bytes = info.fragments * info.fragsize;
-		ret =
-		    write(oss_id->fd, output_samples,
-			  num_bytes > bytes ? bytes : num_bytes);
+	return 0;
+}
 
-		/* Handle write() errors */
-		if (ret <= 0) {
-			perror("audio");
-			_oss_close(oss_id);
-			return -6;
-		}
+/* Microseconds until what was written so far is played */
+static int oss_get_delay(AudioID * id)
+{
+	spd_oss_id_t *oss_id = (spd_oss_id_t *) id;
+	int bytes;
+#ifndef SNDCTL_DSP_GETODELAY
+	audio_buf_info info;
+#endif
 
-		num_bytes -= ret;
-		output_samples += ret / 2;
+	if (oss_id->fd < 0 || oss_id->rate <= 0 || oss_id->stride <= 0)
+		return -1;
 
-		MSG(4, "%d bytes written to OSS, %d remaining", ret, num_bytes);
+#ifdef SNDCTL_DSP_GETODELAY
+	if (ioctl(oss_id->fd, SNDCTL_DSP_GETODELAY, &bytes) == -1)
+		return -1;
+#else
+	if (ioctl(oss_id->fd, SNDCTL_DSP_GETOSPACE, &info) == -1)
+		return -1;
+	bytes = info.fragstotal * info.fragsize - info.bytes;
+#endif
+	if (bytes <= 0)
+		return 0;
+	return (gint64) bytes / oss_id->stride * 1000000 / oss_id->rate;
+}
 
-		/* If there is some more data that is less than a
-		   full fragment, we need to write it immediately so
-		   that it doesn't cause buffer underruns later. */
-		if ((num_bytes > 0)
-		    && (num_bytes < info.fragsize)
-		    && (bytes + num_bytes < info.bytes)) {
+/* Writes the track to the device, only waiting while its buffer is full */
+static int oss_feed(AudioID * id, AudioTrack track)
+{
+	spd_oss_id_t *oss_id = (spd_oss_id_t *) id;
+	const char *output_samples;
+	size_t num_bytes;
+	void *samples;
+	ssize_t ret;
+	int r;
 
-			MSG(4,
-			    "Writing the rest of the data (%d bytes) to OSS, not a full fragment",
-			    num_bytes);
+	if (oss_id == NULL || oss_id->fd < 0)
+		return -1;
 
-			ret2 = write(oss_id->fd, output_samples, num_bytes);
-			num_bytes -= ret2;
-			output_samples += ret2 / 2;
-			ret += ret2;
-		}
+	/* Is it not an empty track? */
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
 
-		/* Handle write() errors */
-		if (ret <= 0) {
+	/* Create a copy of track with the adjusted volume */
+	num_bytes = (size_t) track.num_samples * oss_id->stride;
+	samples = g_malloc(num_bytes);
+	if (track.bits == 16)
+		spd_audio_gain_s16(samples, track.samples,
+				   track.num_samples * track.num_channels,
+				   spd_audio_volume_gain(id->volume));
+	else
+		memcpy(samples, track.samples, num_bytes);
+
+	MSG(4, "bytes to play: %zu, (%f secs)", num_bytes,
+	    (float)track.num_samples / (float)oss_id->rate);
+	output_samples = samples;
+	while (num_bytes > 0 && !oss_id->stop_requested) {
+		ret = write(oss_id->fd, output_samples, num_bytes);
+		if (ret < 0 && errno != EAGAIN && errno != EINTR) {
 			perror("audio");
-			_oss_close(oss_id);
+			g_free(samples);
 			return -6;
 		}
+		if (ret > 0) {
+			num_bytes -= ret;
+			output_samples += ret;
+			MSG(5, "%zd bytes written to OSS, %zu remaining", ret,
+			    num_bytes);
+			continue;
+		}
 
-		/* Some timing magic...
-		   We need to wait for the time computed from the number of
-		   samples written. But this wait needs to be interruptible
-		   by oss_stop(). Furthermore, there need to be no buffer
-		   underrruns, so we actually wait a bit (DELAY) less
-		   in the first pass through the while() loop. Then our timer
-		   will be DELAY nsecs backwards.
-		 */
-		MSG(4, "Now we will try to wait");
-		pthread_mutex_lock(&oss_id->pt_mutex);
-		length = (((float)(ret) / 2) / (float)track.sample_rate);
-		if (!delay) {
-			delay = length > DELAY ? DELAY : length;
-			length -= delay;
+		/* The buffer is full, wait for a fragment to be played */
+		r = oss_wait(oss_id, POLLOUT, -1);
+		if (r < 0) {
+			g_free(samples);
+			return -1;
 		}
-		MSG(4, "Wait for %f secs (begin: %f, delay: %f)", length,
-		    length + delay, delay)
-		    gettimeofday(&now, NULL);
-		timeout.tv_sec = now.tv_sec + (int)length;
-		timeout.tv_nsec =
-		    now.tv_usec * 1000 + (length - (int)length) * 1000000000;
-		//MSG("5, waiting till %d:%d (%d:%d | %d:%d)", timeout.tv_sec, timeout.tv_nsec,
-		//    now.tv_sec, now.tv_usec*1000, timeout.tv_sec - now.tv_sec, timeout.tv_nsec-now.tv_usec*1000);
-
-		timeout.tv_sec += timeout.tv_nsec / 1000000000;
-		timeout.tv_nsec = timeout.tv_nsec % 1000000000;
-		//      MSG("6, waiting till %d:%d (%d:%d | %d:%d)", timeout.tv_sec, timeout.tv_nsec,
-		//  now.tv_sec, now.tv_usec*1000, timeout.tv_sec - now.tv_sec, timeout.tv_nsec-now.tv_usec*1000);
-		r = pthread_cond_timedwait(&oss_id->pt_cond, &oss_id->pt_mutex,
-					   &timeout);
-		pthread_mutex_unlock(&oss_id->pt_mutex);
-		MSG(4, "End of wait");
-
-		/* The pthread_cond_timedwait was interrupted by change in the
-		   condition variable? if so, terminate. */
-		if (r != ETIMEDOUT) {
-			MSG(4, "Playback stopped, %d", r);
+		if (r == 1)
 			break;
-		}
 	}
 
-	/* ...one more excersise in timing magic.
-	   Wait for the resting delay secs. */
-
-	/* Ugly hack: correct for the time we spend outside timing segments */
-	delay -= 0.05;
-
-	MSG(4, "Wait for the resting delay = %f secs", delay)
-	    if ((delay > 0) && (r == ETIMEDOUT)) {
-		pthread_mutex_lock(&oss_id->pt_mutex);
-		gettimeofday(&now, NULL);
-		timeout.tv_sec = now.tv_sec;
-		timeout.tv_nsec = now.tv_usec * 1000 + delay * 1000000000;
-		// MSG("6, waiting till %d:%d (%d:%d | %d:%d)", timeout.tv_sec, timeout.tv_nsec,
-		//          now.tv_sec, now.tv_usec*1000, timeout.tv_sec - now.tv_sec, timeout.tv_nsec-now.tv_usec*1000);
-		timeout.tv_sec += timeout.tv_nsec / 1000000000;
-		timeout.tv_nsec = timeout.tv_nsec % 1000000000;
-		// MSG("6, waiting till %d:%d (%d:%d | %d:%d)", timeout.tv_sec, timeout.tv_nsec,
-		//          now.tv_sec, now.tv_usec*1000, timeout.tv_sec - now.tv_sec, timeout.tv_nsec-now.tv_usec*1000);
-		r = pthread_cond_timedwait(&oss_id->pt_cond, &oss_id->pt_mutex,
-					   &timeout);
-		pthread_mutex_unlock(&oss_id->pt_mutex);
+	g_free(samples);
+	return 0;
+}
+
+/* Waits until only LEFT microseconds of audio remain to be played */
+static int oss_drain_left(spd_oss_id_t * id, int left)
+{
+	int delay, r;
+
+	while (!id->stop_requested) {
+		delay = oss_get_delay((AudioID *) id);
+		if (delay <= left)
+			break;
+		/* There is no event for that, check every now and then */
+		r = oss_wait(id, 0, (MIN(delay - left, OSS_POLL_USEC) + 999)
+			     / 1000);
+		if (r < 0)
+			return -1;
+		if (r == 1)
+			break;
 	}
-	MSG(4, "End of wait");
+	return 0;
+}
 
-	if (track_volume.samples != NULL)
-		g_free(track_volume.samples);
+static int oss_feed_sync(AudioID * id, AudioTrack track)
+{
+	int ret;
+
+	ret = oss_feed(id, track);
+	if (ret)
+		return ret;
 
-	/* Flush all the buffers */
-	_oss_sync(oss_id);
+	return oss_drain_left((spd_oss_id_t *) id, 0);
+}
+
+static int oss_feed_sync_overlap(AudioID * id, AudioTrack track)
+{
+	int ret;
+
+	ret = oss_feed(id, track);
+	if (ret)
+		return ret;
+
+	return oss_drain_left((spd_oss_id_t *) id, OSS_OVERLAP_USEC);
+}
+
+static int oss_end(AudioID * id)
+{
+	spd_oss_id_t *oss_id = (spd_oss_id_t *) id;
+
+	if (oss_id == NULL || oss_id->fd < 0)
+		return 0;
+
+	if (!oss_id->stop_requested)
+		oss_drain_left(oss_id, 0);
 
 	/* Close the device so that we don't block other apps trying to
 	   access the device. */
@@ -436,31 +460,47 @@ static int oss_play(AudioID * id, AudioTrack track)
 	return 0;
 }
 
-/* Stop the playback on the device and interrupt oss_play */
+static int oss_play(AudioID * id, AudioTrack track)
+{
+	int ret;
+
+	ret = oss_begin(id, track);
+	if (ret)
+		return ret;
+
+	ret = oss_feed_sync(id, track);
+	oss_end(id);
+	return ret;
+}
+
+/* Stop the playback on the device and interrupt the waits */
 static int oss_stop(AudioID * id)
 {
 	int ret = 0;
 	spd_oss_id_t *oss_id = (spd_oss_id_t *) id;
+	char c = 42;
 
 	if (oss_id == NULL)
 		return 0;
 
 	MSG(4, "stop() called");
 
+	oss_id->stop_requested = 1;
+
 	/* Stop the playback on /dev/dsp */
 	pthread_mutex_lock(&oss_id->fd_mutex);
 	if (oss_id->fd >= 0)
 		ret = ioctl(oss_id->fd, SNDCTL_DSP_RESET, 0);
 	pthread_mutex_unlock(&oss_id->fd_mutex);
+
+	/* Interrupt the waits of the playing thread */
+	if (write(oss_id->stop_pipe[1], &c, 1) < 0 && errno != EAGAIN)
+		ERR("Can't write to the stop pipe: %s", strerror(errno));
+
 	if (ret == -1) {
 		perror("reset");
 		return -1;
 	}
-
-	/* Interrupt oss_play by setting the condition variable */
-	pthread_mutex_lock(&oss_id->pt_mutex);
-	pthread_cond_signal(&oss_id->pt_cond);
-	pthread_mutex_unlock(&oss_id->pt_mutex);
 	return 0;
 }
 
@@ -469,9 +509,11 @@ static int oss_close(AudioID * id)
 {
 	spd_oss_id_t *oss_id = (spd_oss_id_t *) id;
 
-	/* Does nothing because the device is being automatically opened and
-	   closed in oss_play before and after playing each sample. */
+	/* The device itself is opened and closed around each playback, in
+	   oss_begin and oss_end. */
 
+	close(oss_id->stop_pipe[0]);
+	close(oss_id->stop_pipe[1]);
 	g_free(oss_id->device_name);
 	g_free(oss_id);
 	id = NULL;
@@ -483,7 +525,7 @@ static int oss_close(AudioID * id)
 
 Comments:
   /dev/dsp can't set volume. We just multiply the track samples by
-  a constant in oss_play (see oss_play() for more information).
+  a constant in oss_feed (see oss_feed() for more information).
 */
 static int oss_set_volume(AudioID * id, int volume)
 {
@@ -511,7 +553,13 @@ static spd_audio_plugin_t oss_functions = {
 	oss_close,
 	oss_set_volume,
 	oss_set_loglevel,
-	oss_get_playcmd
+	oss_get_playcmd,
+	oss_begin,
+	oss_feed_sync,
+	oss_feed_sync_overlap,
+	oss_end,
+	oss_feed,
+	oss_get_delay,
 };
 
 spd_audio_plugin_t *oss_plugin_get(void)
@@ -525,5 +573,10 @@ spd_audio_plugin_t *
 {
 	return &oss_functions;
 }
+
+int __attribute__ ((weak)) SPD_AUDIO_PLUGIN_ABI_ENTRY(void)
+{
+	return SPD_AUDIO_PLUGIN_ABI;
+}
 #undef MSG
 #undef ERR
@@ -0,0 +1,611 @@
+
+/*
+ * pipewire.c -- The native PipeWire backend for the spd_audio library.
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * The stream runs on a pw_thread_loop.  Its process callback takes the
+ * samples from a ring buffer which pipewire_feed() fills, and plays silence
+ * when it is empty.  All the state is guarded by the thread loop lock,
+ * which is held while callbacks run, and the callbacks signal the loop
+ * whenever there is something to wake up for: room in the ring, a state
+ * change, the end of a drain.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+#include <string.h>
+#include <glib.h>
+
+#include <pipewire/pipewire.h>
+#include <spa/param/audio/format-utils.h>
+#include <spa/utils/ringbuffer.h>
+
+#ifdef USE_DLOPEN
+#define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_audio_plugin_abi
+#else
+#define SPD_AUDIO_PLUGIN_ENTRY spd_pipewire_LTX_spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_pipewire_LTX_spd_audio_plugin_abi
+#endif
+#include <spd_audio_plugin.h>
+
+/* Bytes of samples buffered ahead of the stream, a power of two */
+#define PW_RING_SIZE (1 << 16)
+
+/* How much audio may be left when feed_sync_overlap returns, so that the
+   next piece is written before the ring runs dry */
+#define PW_OVERLAP_MS 20
+
+/* Default latency asked to the graph */
+#define DEFAULT_PW_LATENCY 10
+
+typedef struct {
+	AudioID id;
+	struct pw_thread_loop *loop;
+	struct pw_stream *stream;
+	enum pw_stream_state state;
+	char *name;
+	int latency;		/* ms */
+
+	int rate;		/* format of the current stream */
+	int bits;
+	int channels;
+	int stride;		/* bytes per frame */
+
+	struct spa_ringbuffer ring;
+	char ring_data[PW_RING_SIZE];
+
+	int stop_requested;
+	int draining;		/* 1 until the ring is empty, 2 until drained */
+
+	int xruns;		/* see pipewire_get_xruns() */
+} spd_pipewire_id_t;
+
+static int pipewire_log_level;
+static char const *pipewire_play_cmd = "pw-play";
+
+#define MSG(level, arg...) \
+	if(level <= pipewire_log_level){ \
+		time_t t; \
+		struct timeval tv; \
+		char *tstr; \
+		t = time(NULL); \
+		tstr = g_strdup(ctime(&t)); \
+		tstr[strlen(tstr)-1] = 0; \
+		gettimeofday(&tv,NULL); \
+		fprintf(stderr," %s [%d]",tstr, (int) tv.tv_usec); \
+		fprintf(stderr," PipeWire: "); \
+		fprintf(stderr,arg); \
+		fprintf(stderr,"\n"); \
+		fflush(stderr); \
+		g_free(tstr); \
+	}
+
+#define ERR(arg...) \
+	{ \
+		time_t t; \
+		struct timeval tv; \
+		char *tstr; \
+		t = time(NULL); \
+		tstr = g_strdup(ctime(&t)); \
+		tstr[strlen(tstr)-1] = 0; \
+		gettimeofday(&tv,NULL); \
+		fprintf(stderr," %s [%d]",tstr, (int) tv.tv_usec); \
+		fprintf(stderr," PipeWire ERROR: "); \
+		fprintf(stderr,arg); \
+		fprintf(stderr,"\n"); \
+		fflush(stderr); \
+		g_free(tstr); \
+	}
+
+/* Bytes waiting in the ring */
+static uint32_t pipewire_ring_filled(spd_pipewire_id_t * id)
+{
+	uint32_t index;
+	int32_t filled = spa_ringbuffer_get_read_index(&id->ring, &index);
+
+	return filled > 0 ? filled : 0;
+}
+
+static void pipewire_on_process(void *data)
+{
+	spd_pipewire_id_t *id = data;
+	struct pw_buffer *b;
+	struct spa_data *d;
+	uint32_t index, n_bytes, avail;
+
+	if ((b = pw_stream_dequeue_buffer(id->stream)) == NULL)
+		return;
+
+	d = &b->buffer->datas[0];
+	if (d->data == NULL) {
+		pw_stream_queue_buffer(id->stream, b);
+		return;
+	}
+
+	n_bytes = d->maxsize / id->stride * id->stride;
+	if (b->requested)
+		n_bytes = SPA_MIN(n_bytes, b->requested * id->stride);
+
+	avail = pipewire_ring_filled(id);
+	spa_ringbuffer_get_read_index(&id->ring, &index);
+	avail = SPA_MIN(avail, n_bytes);
+	spa_ringbuffer_read_data(&id->ring, id->ring_data, PW_RING_SIZE,
+				 index & (PW_RING_SIZE - 1), d->data, avail);
+	spa_ringbuffer_read_update(&id->ring, index + avail);
+
+	if (avail < n_bytes) {
+		if (id->draining == 1 && avail == 0 && !id->stop_requested) {
+			/* Everything was given, let the graph play it out */
+			d->chunk->size = 0;
+			pw_stream_queue_buffer(id->stream, b);
+			pw_stream_flush(id->stream, true);
+			id->draining = 2;
+			return;
+		}
+		/* Underrun or idle: the ring ran dry in the middle of audio */
+		if (avail > 0 && !id->draining)
+			g_atomic_int_inc(&id->xruns);
+		memset((char *)d->data + avail, 0, n_bytes - avail);
+	}
+
+	d->chunk->offset = 0;
+	d->chunk->stride = id->stride;
+	d->chunk->size = n_bytes;
+	pw_stream_queue_buffer(id->stream, b);
+
+	pw_thread_loop_signal(id->loop, false);
+}
+
+static void pipewire_on_drained(void *data)
+{
+	spd_pipewire_id_t *id = data;
+
+	id->draining = 0;
+	pw_thread_loop_signal(id->loop, false);
+}
+
+static void pipewire_on_state_changed(void *data, enum pw_stream_state old,
+				      enum pw_stream_state state,
+				      const char *error)
+{
+	spd_pipewire_id_t *id = data;
+
+	MSG(4, "Stream state %s", pw_stream_state_as_string(state));
+	if (state == PW_STREAM_STATE_ERROR)
+		ERR("Stream error: %s", error ? error : "unknown");
+	id->state = state;
+	pw_thread_loop_signal(id->loop, false);
+}
+
+static const struct pw_stream_events pipewire_stream_events = {
+	PW_VERSION_STREAM_EVENTS,
+	.state_changed = pipewire_on_state_changed,
+	.process = pipewire_on_process,
+	.drained = pipewire_on_drained,
+};
+
+/* Whether the stream is connected, it may still be getting to streaming */
+static int pipewire_stream_alive(spd_pipewire_id_t * id)
+{
+	return id->stream && (id->state == PW_STREAM_STATE_PAUSED
+			      || id->state == PW_STREAM_STATE_STREAMING);
+}
+
+/* Drop the stream, with the loop locked */
+static void pipewire_stream_close(spd_pipewire_id_t * id)
+{
+	if (id->stream) {
+		pw_stream_destroy(id->stream);
+		id->stream = NULL;
+	}
+	id->rate = -1;
+	id->bits = -1;
+	id->channels = -1;
+}
+
+/* Open a stream for the track format, with the loop locked */
+static int pipewire_stream_open(spd_pipewire_id_t * id, AudioTrack track)
+{
+	uint8_t buffer[1024];
+	struct spa_pod_builder builder = SPA_POD_BUILDER_INIT(buffer, sizeof(buffer));
+	struct spa_audio_info_raw info;
+	const struct spa_pod *params[1];
+	struct pw_properties *props;
+	char *app_name;
+
+	memset(&info, 0, sizeof(info));
+	if (track.bits == 16)
+		info.format = id->id.format == SPD_AUDIO_BE
+		    ? SPA_AUDIO_FORMAT_S16_BE : SPA_AUDIO_FORMAT_S16_LE;
+	else if (track.bits == 8)
+		info.format = SPA_AUDIO_FORMAT_S8;
+	else {
+		ERR("Unsupported sound data format, track.bits = %d",
+		    track.bits);
+		return -1;
+	}
+	if (track.num_channels == 1) {
+		info.position[0] = SPA_AUDIO_CHANNEL_MONO;
+	} else if (track.num_channels == 2) {
+		info.position[0] = SPA_AUDIO_CHANNEL_FL;
+		info.position[1] = SPA_AUDIO_CHANNEL_FR;
+	} else {
+		ERR("Unsupported number of channels %d", track.num_channels);
+		return -1;
+	}
+	info.channels = track.num_channels;
+	info.rate = track.sample_rate;
+	params[0] = spa_format_audio_raw_build(&builder, SPA_PARAM_EnumFormat,
+					       &info);
+
+	app_name = g_strdup_printf("speech-dispatcher%s%s",
+				   id->name ? "-" : "",
+				   id->name ? id->name : "");
+	props = pw_properties_new(PW_KEY_MEDIA_TYPE, "Audio",
+				  PW_KEY_MEDIA_CATEGORY, "Playback",
+				  PW_KEY_MEDIA_ROLE, "Accessibility",
+				  PW_KEY_APP_NAME, app_name, NULL);
+	g_free(app_name);
+	/* Ask for a small quantum, so that data is requested, and stops take
+	   effect, within the latency */
+	pw_properties_setf(props, PW_KEY_NODE_LATENCY, "%u/%u",
+			   MAX(id->latency * track.sample_rate / 1000, 1),
+			   track.sample_rate);
+
+	id->stream = pw_stream_new_simple(pw_thread_loop_get_loop(id->loop),
+					  "playback", props,
+					  &pipewire_stream_events, id);
+	if (!id->stream) {
+		ERR("Cannot create stream");
+		return -1;
+	}
+	id->state = PW_STREAM_STATE_CONNECTING;
+	if (pw_stream_connect(id->stream, PW_DIRECTION_OUTPUT, PW_ID_ANY,
+			      PW_STREAM_FLAG_AUTOCONNECT
+			      | PW_STREAM_FLAG_MAP_BUFFERS, params, 1) < 0) {
+		ERR("Cannot connect stream");
+		pipewire_stream_close(id);
+		return -1;
+	}
+	while (id->state == PW_STREAM_STATE_CONNECTING)
+		pw_thread_loop_wait(id->loop);
+	if (id->state == PW_STREAM_STATE_ERROR
+	    || id->state == PW_STREAM_STATE_UNCONNECTED) {
+		pipewire_stream_close(id);
+		return -1;
+	}
+
+	id->rate = track.sample_rate;
+	id->bits = track.bits;
+	id->channels = track.num_channels;
+	id->stride = track.num_channels * track.bits / 8;
+	return 0;
+}
+
+static AudioID *pipewire_open(void **pars)
+{
+	spd_pipewire_id_t *id;
+
+	pw_init(NULL, NULL);
+
+	id = g_malloc0(sizeof(*id));
+#if defined(BYTE_ORDER) && (BYTE_ORDER == BIG_ENDIAN)
+	id->id.format = SPD_AUDIO_BE;
+#else
+	id->id.format = SPD_AUDIO_LE;
+#endif
+	id->name = pars[5] ? g_strdup(pars[5]) : NULL;
+	id->latency = DEFAULT_PW_LATENCY;
+	if (pars[4] != NULL && atoi(pars[4]) > 0)
+		id->latency = atoi(pars[4]);
+	id->rate = id->bits = id->channels = -1;
+	spa_ringbuffer_init(&id->ring);
+
+	id->loop = pw_thread_loop_new("speechd-pipewire", NULL);
+	if (!id->loop || pw_thread_loop_start(id->loop) < 0) {
+		ERR("Cannot start the PipeWire loop");
+		if (id->loop)
+			pw_thread_loop_destroy(id->loop);
+		g_free(id->name);
+		g_free(id);
+		pw_deinit();
+		return NULL;
+	}
+
+	return (AudioID *) id;
+}
+
+/* Get a stream suitable for the track, and get it running */
+static int pipewire_begin(AudioID * aid, AudioTrack track)
+{
+	spd_pipewire_id_t *id = (spd_pipewire_id_t *) aid;
+	int ret = 0;
+
+	if (id == NULL)
+		return -1;
+
+	pw_thread_loop_lock(id->loop);
+	id->stop_requested = 0;
+	id->draining = 0;
+
+	if (!pipewire_stream_alive(id) || id->rate != track.sample_rate
+	    || id->bits != track.bits || id->channels != track.num_channels) {
+		MSG(4, "Opening stream for sample_rate:%d bps:%d channels:%d",
+		    track.sample_rate, track.bits, track.num_channels);
+		pipewire_stream_close(id);
+		spa_ringbuffer_init(&id->ring);
+		ret = pipewire_stream_open(id, track);
+	}
+	if (!ret)
+		pw_stream_set_active(id->stream, true);
+	pw_thread_loop_unlock(id->loop);
+
+	return ret;
+}
+
+/* Put the track in the ring as room is made */
+static int pipewire_feed(spd_pipewire_id_t * id, AudioTrack track)
+{
+	const char *samples = (const char *)track.samples;
+	size_t num_bytes, done = 0;
+	uint32_t index, n;
+	int ret = 0;
+
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
+	num_bytes = (size_t) track.num_samples * track.num_channels
+	    * (track.bits / 8);
+
+	pw_thread_loop_lock(id->loop);
+	while (done < num_bytes && !id->stop_requested) {
+		if (!pipewire_stream_alive(id)) {
+			ERR("Stream lost, reopening it on next track");
+			pipewire_stream_close(id);
+			ret = -1;
+			break;
+		}
+		n = PW_RING_SIZE - pipewire_ring_filled(id);
+		if (n == 0) {
+			pw_thread_loop_wait(id->loop);
+			continue;
+		}
+		n = MIN(n, num_bytes - done);
+		spa_ringbuffer_get_write_index(&id->ring, &index);
+		spa_ringbuffer_write_data(&id->ring, id->ring_data, PW_RING_SIZE,
+					  index & (PW_RING_SIZE - 1),
+					  samples + done, n);
+		spa_ringbuffer_write_update(&id->ring, index + n);
+		done += n;
+	}
+	pw_thread_loop_unlock(id->loop);
+
+	return ret;
+}
+
+/* Wait until the ring got played, and the graph played it out */
+static int pipewire_drain(spd_pipewire_id_t * id)
+{
+	pw_thread_loop_lock(id->loop);
+	if (pipewire_stream_alive(id)) {
+		id->draining = 1;
+		while (id->draining && !id->stop_requested
+		       && pipewire_stream_alive(id))
+			pw_thread_loop_wait(id->loop);
+		id->draining = 0;
+	}
+	pw_thread_loop_unlock(id->loop);
+
+	return 0;
+}
+
+static int pipewire_feed_sync(AudioID * aid, AudioTrack track)
+{
+	spd_pipewire_id_t *id = (spd_pipewire_id_t *) aid;
+	int ret;
+
+	ret = pipewire_feed(id, track);
+	if (ret)
+		return ret;
+
+	return pipewire_drain(id);
+}
+
+/* Return once only PW_OVERLAP_MS are left in the ring */
+static int pipewire_feed_sync_overlap(AudioID * aid, AudioTrack track)
+{
+	spd_pipewire_id_t *id = (spd_pipewire_id_t *) aid;
+	uint32_t overlap;
+	int ret;
+
+	ret = pipewire_feed(id, track);
+	if (ret)
+		return ret;
+
+	pw_thread_loop_lock(id->loop);
+	overlap = (uint32_t) PW_OVERLAP_MS * track.sample_rate / 1000
+	    * track.num_channels * (track.bits / 8);
+	while (pipewire_ring_filled(id) > overlap && !id->stop_requested
+	       && pipewire_stream_alive(id))
+		pw_thread_loop_wait(id->loop);
+	pw_thread_loop_unlock(id->loop);
+
+	return 0;
+}
+
+static int pipewire_feed_async(AudioID * aid, AudioTrack track)
+{
+	return pipewire_feed((spd_pipewire_id_t *) aid, track);
+}
+
+static void pipewire_get_xruns(AudioID * aid, int *xruns, int *suspends)
+{
+	spd_pipewire_id_t *id = (spd_pipewire_id_t *) aid;
+
+	*xruns = g_atomic_int_get(&id->xruns);
+}
+
+/* What is left in the ring, plus the quantum the graph is playing */
+static int pipewire_get_delay(AudioID * aid)
+{
+	spd_pipewire_id_t *id = (spd_pipewire_id_t *) aid;
+	int64_t delay = 0;
+
+	pw_thread_loop_lock(id->loop);
+	if (!id->stop_requested && pipewire_stream_alive(id) && id->rate)
+		delay = (int64_t) pipewire_ring_filled(id) / id->stride
+		    * 1000000 / id->rate + id->latency * 1000;
+	pw_thread_loop_unlock(id->loop);
+
+	return delay;
+}
+
+/* Drain, and pause the stream so that the graph does not keep running us */
+static int pipewire_end(AudioID * aid)
+{
+	spd_pipewire_id_t *id = (spd_pipewire_id_t *) aid;
+
+	pipewire_drain(id);
+
+	pw_thread_loop_lock(id->loop);
+	if (id->stream)
+		pw_stream_set_active(id->stream, false);
+	pw_thread_loop_unlock(id->loop);
+
+	return 0;
+}
+
+static int pipewire_play(AudioID * aid, AudioTrack track)
+{
+	int ret;
+
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
+
+	ret = pipewire_begin(aid, track);
+	if (ret)
+		return ret;
+
+	ret = pipewire_feed_sync(aid, track);
+	if (ret)
+		return ret;
+
+	return pipewire_end(aid);
+}
+
+/* Drop what is buffered, in the ring and in the graph, and wake up the
+   feeding thread */
+static int pipewire_stop(AudioID * aid)
+{
+	spd_pipewire_id_t *id = (spd_pipewire_id_t *) aid;
+	uint32_t index;
+
+	if (id == NULL)
+		return 0;
+
+	pw_thread_loop_lock(id->loop);
+	id->stop_requested = 1;
+	spa_ringbuffer_get_write_index(&id->ring, &index);
+	spa_ringbuffer_read_update(&id->ring, index);
+	if (id->stream)
+		pw_stream_flush(id->stream, false);
+	pw_thread_loop_signal(id->loop, false);
+	pw_thread_loop_unlock(id->loop);
+
+	return 0;
+}
+
+static int pipewire_close(AudioID * aid)
+{
+	spd_pipewire_id_t *id = (spd_pipewire_id_t *) aid;
+
+	pw_thread_loop_lock(id->loop);
+	pipewire_stream_close(id);
+	pw_thread_loop_unlock(id->loop);
+	pw_thread_loop_stop(id->loop);
+	pw_thread_loop_destroy(id->loop);
+	g_free(id->name);
+	g_free(id);
+	pw_deinit();
+
+	return 0;
+}
+
+static int pipewire_set_volume(AudioID * id, int volume)
+{
+	return 0;
+}
+
+static void pipewire_set_loglevel(int level)
+{
+	if (level) {
+		pipewire_log_level = level;
+	}
+}
+
+static char const *pipewire_get_playcmd(void)
+{
+	return pipewire_play_cmd;
+}
+
+/* Provide the PipeWire backend. */
+static spd_audio_plugin_t pipewire_functions = {
+	"pipewire",
+	pipewire_open,
+	pipewire_play,
+	pipewire_stop,
+	pipewire_close,
+	pipewire_set_volume,
+	pipewire_set_loglevel,
+	pipewire_get_playcmd,
+	pipewire_begin,
+	pipewire_feed_sync,
+	pipewire_feed_sync_overlap,
+	pipewire_end,
+	pipewire_feed_async,
+	pipewire_get_delay,
+	pipewire_get_xruns,
+};
+
+spd_audio_plugin_t *pipewire_plugin_get(void)
+{
+	return &pipewire_functions;
+}
+
+spd_audio_plugin_t *
+    __attribute__ ((weak))
+    SPD_AUDIO_PLUGIN_ENTRY(void)
+{
+	return &pipewire_functions;
+}
+
+int __attribute__ ((weak)) SPD_AUDIO_PLUGIN_ABI_ENTRY(void)
+{
+	return SPD_AUDIO_PLUGIN_ABI;
+}
+
+#undef MSG
+#undef ERR
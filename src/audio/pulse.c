@@ -1,6 +1,6 @@
 
 /*
- * pulse.c -- The simple pulseaudio backend for the spd_audio library.
+ * pulse.c -- The pulseaudio backend for the spd_audio library.
  *
  * Copyright 2007-2009 Gilles Casse <gcasse@oralux.org>
  * Copyright 2008-2010 Brailcom, o.p.s
@@ -44,34 +44,36 @@
 #include <time.h>
 #include <string.h>
 #include <stdarg.h>
+#include <unistd.h>
 #include <glib.h>
 
-#include <pulse/simple.h>
-#include <pulse/error.h>
+#include <pulse/pulseaudio.h>
 
 #ifdef USE_DLOPEN
 #define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_audio_plugin_abi
 #else
 #define SPD_AUDIO_PLUGIN_ENTRY spd_pulse_LTX_spd_audio_plugin_get
+#define SPD_AUDIO_PLUGIN_ABI_ENTRY spd_pulse_LTX_spd_audio_plugin_abi
 #endif
 #include <spd_audio_plugin.h>
 
 typedef struct {
 	AudioID id;
-	pa_simple *pa_simple;
+	pa_threaded_mainloop *pa_mainloop;
+	pa_context *pa_context;
+	pa_stream *pa_stream;
 	char *pa_server;
 	char *pa_device;
 	char *pa_name;
 	int pa_min_audio_length;	// in ms
 	volatile int pa_stop_playback;
+	int pa_corked;		// Corked by pulse_stop()
 	int pa_current_rate;	// Sample rate for currently PA connection
 	int pa_current_bps;	// Bits per sample rate for currently PA connection
 	int pa_current_channels;	// Number of channels for currently PA connection
 } spd_pulse_id_t;
 
-/* send a packet of XXX bytes to the sound device */
-#define PULSE_SEND_BYTES 256
-
 /* Initial values, most often what synths will requests */
 #define DEF_RATE 44100
 #define DEF_CHANNELS 1
@@ -82,6 +84,12 @@ typedef struct {
 /* Default to 10 ms of latency */
 #define DEFAULT_PA_MIN_AUDIO_LENGTH 10
 
+/* How much audio may be left playing when feed_sync_overlap returns, so
+   that the next piece is written before the buffer runs dry */
+#define PULSE_OVERLAP_USEC 20000
+/* How often feed_sync_overlap checks the latency */
+#define PULSE_OVERLAP_POLL_USEC 5000
+
 static int pulse_log_level;
 static char const *pulse_play_cmd = "paplay -n speech-dispatcher-generic";
 
@@ -119,13 +127,131 @@ static char const *pulse_play_cmd = "paplay -n speech-dispatcher-generic";
 		g_free(tstr); \
 	}
 
+/* The callbacks run in the mainloop thread and just wake up whoever is
+   waiting in pa_threaded_mainloop_wait() for the state to change */
+static void pulse_context_state_cb(pa_context * c, void *data)
+{
+	spd_pulse_id_t *id = data;
+
+	pa_threaded_mainloop_signal(id->pa_mainloop, 0);
+}
+
+static void pulse_stream_state_cb(pa_stream * s, void *data)
+{
+	spd_pulse_id_t *id = data;
+
+	pa_threaded_mainloop_signal(id->pa_mainloop, 0);
+}
+
+static void pulse_stream_request_cb(pa_stream * s, size_t length, void *data)
+{
+	spd_pulse_id_t *id = data;
+
+	pa_threaded_mainloop_signal(id->pa_mainloop, 0);
+}
+
+static void pulse_success_cb(pa_stream * s, int success, void *data)
+{
+	spd_pulse_id_t *id = data;
+
+	pa_threaded_mainloop_signal(id->pa_mainloop, 0);
+}
+
+/* Waits for the operation to complete or pulse_stop(), with the mainloop
+   locked.  Returns 1 if stopped.  */
+static int pulse_wait_operation(spd_pulse_id_t * id, pa_operation * op)
+{
+	int stopped = 0;
+
+	if (!op)
+		return 0;
+	while (pa_operation_get_state(op) == PA_OPERATION_RUNNING) {
+		if (id->pa_stop_playback) {
+			pa_operation_cancel(op);
+			stopped = 1;
+			break;
+		}
+		pa_threaded_mainloop_wait(id->pa_mainloop);
+	}
+	pa_operation_unref(op);
+	return stopped;
+}
+
+/* Connects to the server, with the mainloop locked */
+static int pulse_context_connect(spd_pulse_id_t * id)
+{
+	pa_context_state_t state;
+	char *client_name;
+
+	if (!id->pa_name ||
+	    asprintf(&client_name, "speech-dispatcher-%s", id->pa_name) < 0)
+		client_name = strdup("speech-dispatcher");
+
+	id->pa_context =
+	    pa_context_new(pa_threaded_mainloop_get_api(id->pa_mainloop),
+			   client_name);
+	free(client_name);
+	if (!id->pa_context) {
+		ERR("pa_context_new() failed");
+		return 1;
+	}
+	pa_context_set_state_callback(id->pa_context, pulse_context_state_cb,
+				      id);
+
+	if (pa_context_connect(id->pa_context, id->pa_server,
+			       PA_CONTEXT_NOFLAGS, NULL) < 0) {
+		ERR("pa_context_connect() failed: %s",
+		    pa_strerror(pa_context_errno(id->pa_context)));
+		goto fail;
+	}
+	while ((state = pa_context_get_state(id->pa_context))
+	       != PA_CONTEXT_READY) {
+		if (!PA_CONTEXT_IS_GOOD(state)) {
+			ERR("Connection to the server failed: %s",
+			    pa_strerror(pa_context_errno(id->pa_context)));
+			goto fail;
+		}
+		pa_threaded_mainloop_wait(id->pa_mainloop);
+	}
+	return 0;
+
+fail:
+	pa_context_disconnect(id->pa_context);
+	pa_context_unref(id->pa_context);
+	id->pa_context = NULL;
+	return 1;
+}
+
+/* Close the stream, and the connection to the server if it is broken.
+   Does not free the AudioID struct.  Usable in pulse_begin, which closes
+   connections on failure or changes in audio parameters.  Called with
+   the mainloop locked.  */
+static void pulse_connection_close(spd_pulse_id_t * pulse_id)
+{
+	if (pulse_id->pa_stream != NULL) {
+		pa_stream_disconnect(pulse_id->pa_stream);
+		pa_stream_unref(pulse_id->pa_stream);
+		pulse_id->pa_stream = NULL;
+	}
+	if (pulse_id->pa_context != NULL
+	    && !PA_CONTEXT_IS_GOOD(pa_context_get_state(pulse_id->pa_context))) {
+		pa_context_disconnect(pulse_id->pa_context);
+		pa_context_unref(pulse_id->pa_context);
+		pulse_id->pa_context = NULL;
+	}
+	pulse_id->pa_current_rate = -1;
+	pulse_id->pa_current_bps = -1;
+	pulse_id->pa_current_channels = -1;
+}
+
+/* Opens a stream, with the mainloop locked */
 static int _pulse_open(spd_pulse_id_t * id, int sample_rate,
 		       int num_channels, int bytes_per_sample)
 {
 	pa_buffer_attr buffAttr;
 	pa_sample_spec ss;
-	int error;
-	char *client_name;
+	pa_stream_state_t state;
+	uint32_t frame;
 
 	ss.rate = sample_rate;
 	ss.channels = num_channels;
@@ -142,42 +268,53 @@ static int _pulse_open(spd_pulse_id_t * id, int sample_rate,
 		ss.format = PA_SAMPLE_U8;
 	}
 
-	/* Set prebuf to one sample so that keys are spoken as soon as typed rather than delayed until the next key pressed */
+	if (!id->pa_context && pulse_context_connect(id))
+		return 1;
+
+	/* Ask for the configured latency, and to be asked for more data
+	   every quarter of it.  Set prebuf to one frame so that keys are
+	   spoken as soon as typed rather than delayed until the buffer is
+	   full.  The defaults would buffer about two seconds.  */
+	frame = num_channels * bytes_per_sample;
 	buffAttr.maxlength = (uint32_t) - 1;
-	//buffAttr.tlength = (uint32_t)-1; - this is the default, which causes key echo to not work properly.
-	buffAttr.tlength = id->pa_min_audio_length * sample_rate * num_channels * bytes_per_sample / 1000;
-	buffAttr.prebuf = (uint32_t) - 1;
-	buffAttr.minreq = (uint32_t) - 1;
+	buffAttr.tlength = id->pa_min_audio_length * sample_rate / 1000 * frame;
+	buffAttr.prebuf = frame;
+	buffAttr.minreq = MAX(buffAttr.tlength / 4 / frame, 1) * frame;
 	buffAttr.fragsize = (uint32_t) - 1;
 
-	if (!id->pa_name ||
-	    asprintf(&client_name, "speech-dispatcher-%s", id->pa_name) < 0)
-		client_name = strdup("speech-dispatcher");
-
-	/* Open new connection */
-	if (!
-	    (id->pa_simple =
-	     pa_simple_new(id->pa_server, client_name,
-			   PA_STREAM_PLAYBACK, id->pa_device, "playback",
-			   &ss, NULL, &buffAttr, &error))) {
-		fprintf(stderr, __FILE__ ": pa_simple_new() failed: %s\n",
-			pa_strerror(error));
-		free(client_name);
+	id->pa_stream = pa_stream_new(id->pa_context, "playback", &ss, NULL);
+	if (!id->pa_stream) {
+		ERR("pa_stream_new() failed: %s",
+		    pa_strerror(pa_context_errno(id->pa_context)));
 		return 1;
 	}
-	free(client_name);
-	return 0;
-}
-
-/* Close the connection to the server.  Does not free the AudioID struct. */
-/* Usable in pulse_play, which closes connections on failure or */
-/* changes in audio parameters. */
-static void pulse_connection_close(spd_pulse_id_t * pulse_id)
-{
-	if (pulse_id->pa_simple != NULL) {
-		pa_simple_free(pulse_id->pa_simple);
-		pulse_id->pa_simple = NULL;
+	pa_stream_set_state_callback(id->pa_stream, pulse_stream_state_cb, id);
+	pa_stream_set_write_callback(id->pa_stream, pulse_stream_request_cb,
+				     id);
+
+	if (pa_stream_connect_playback(id->pa_stream, id->pa_device, &buffAttr,
+				       PA_STREAM_ADJUST_LATENCY
+				       | PA_STREAM_INTERPOLATE_TIMING
+				       | PA_STREAM_AUTO_TIMING_UPDATE,
+				       NULL, NULL) < 0) {
+		ERR("pa_stream_connect_playback() failed: %s",
+		    pa_strerror(pa_context_errno(id->pa_context)));
+		pulse_connection_close(id);
+		return 1;
 	}
+	while ((state = pa_stream_get_state(id->pa_stream))
+	       != PA_STREAM_READY) {
+		if (!PA_STREAM_IS_GOOD(state)) {
+			ERR("Stream connection failed: %s",
+			    pa_strerror(pa_context_errno(id->pa_context)));
+			pulse_connection_close(id);
+			return 1;
+		}
+		pa_threaded_mainloop_wait(id->pa_mainloop);
+	}
+	id->pa_corked = 0;
+
+	return 0;
 }
 
 static AudioID *pulse_open(void **pars)
@@ -198,7 +335,8 @@ static AudioID *pulse_open(void **pars)
 #else
 	pulse_id->id.format = SPD_AUDIO_LE;
 #endif
-	pulse_id->pa_simple = NULL;
+	pulse_id->pa_context = NULL;
+	pulse_id->pa_stream = NULL;
 	pulse_id->pa_server = NULL;
 	pulse_id->pa_device = (char *)pars[3];
 	pulse_id->pa_name = (char *)pars[5];
@@ -216,9 +354,33 @@ static AudioID *pulse_open(void **pars)
 		pulse_id->pa_min_audio_length = atoi(pars[4]);
 
 	pulse_id->pa_stop_playback = 0;
+	pulse_id->pa_corked = 0;
+
+	pulse_id->pa_mainloop = pa_threaded_mainloop_new();
+	if (!pulse_id->pa_mainloop
+	    || pa_threaded_mainloop_start(pulse_id->pa_mainloop) < 0) {
+		ERR("Cannot start the pulse mainloop");
+		if (pulse_id->pa_mainloop)
+			pa_threaded_mainloop_free(pulse_id->pa_mainloop);
+		g_free(pulse_id);
+		return NULL;
+	}
 
+	pa_threaded_mainloop_lock(pulse_id->pa_mainloop);
 	ret = _pulse_open(pulse_id, DEF_RATE, DEF_CHANNELS, DEF_BYTES_PER_SAMPLE);
+	if (!ret) {
+		pulse_id->pa_current_rate = DEF_RATE;
+		pulse_id->pa_current_bps = DEF_BYTES_PER_SAMPLE * 8;
+		pulse_id->pa_current_channels = DEF_CHANNELS;
+	}
+	pa_threaded_mainloop_unlock(pulse_id->pa_mainloop);
 	if (ret) {
+		pa_threaded_mainloop_stop(pulse_id->pa_mainloop);
+		if (pulse_id->pa_context) {
+			pa_context_disconnect(pulse_id->pa_context);
+			pa_context_unref(pulse_id->pa_context);
+		}
+		pa_threaded_mainloop_free(pulse_id->pa_mainloop);
 		g_free(pulse_id);
 		pulse_id = NULL;
 	}
@@ -226,23 +388,16 @@ static AudioID *pulse_open(void **pars)
 	return (AudioID *) pulse_id;
 }
 
-static int pulse_play(AudioID * id, AudioTrack track)
+/* Get a stream suitable for the track */
+static int pulse_begin(AudioID * id, AudioTrack track)
 {
 	int bytes_per_sample;
-	int num_bytes;
-	int outcnt = 0;
-	signed short *output_samples;
-	int i;
-	int error;
+	int error = 0;
 	spd_pulse_id_t *pulse_id = (spd_pulse_id_t *) id;
 
 	if (id == NULL) {
 		return -1;
 	}
-	if (track.samples == NULL || track.num_samples <= 0) {
-		return 0;
-	}
-	MSG(4, "Starting playback\n");
 	/* Choose the correct format */
 	if (track.bits == 16) {
 		bytes_per_sample = 2;
@@ -253,11 +408,14 @@ static int pulse_play(AudioID * id, AudioTrack track)
 		    track.bits);
 		return -1;
 	}
-	output_samples = track.samples;
-	num_bytes = track.num_samples * bytes_per_sample;
+
+	pa_threaded_mainloop_lock(pulse_id->pa_mainloop);
+	pulse_id->pa_stop_playback = 0;
 
 	/* Check if the current connection has suitable parameters for this track */
-	if (pulse_id->pa_current_rate != track.sample_rate
+	if (!pulse_id->pa_stream
+	    || !PA_STREAM_IS_GOOD(pa_stream_get_state(pulse_id->pa_stream))
+	    || pulse_id->pa_current_rate != track.sample_rate
 	    || pulse_id->pa_current_bps != track.bits
 	    || pulse_id->pa_current_channels != track.num_channels) {
 		MSG(4, "Reopening connection due to change in track parameters sample_rate:%d bps:%d channels:%d\n", track.sample_rate, track.bits, track.num_channels);
@@ -266,56 +424,198 @@ static int pulse_play(AudioID * id, AudioTrack track)
 		/* Open a new connection */
 		error = _pulse_open(pulse_id, track.sample_rate, track.num_channels,
 			    bytes_per_sample);
-		if (error) {
-			pulse_id->pa_current_rate = -1;
-			pulse_id->pa_current_bps = -1;
-			pulse_id->pa_current_channels = -1;
-			return -1;
+		if (!error) {
+			/* Keep track of current connection parameters */
+			pulse_id->pa_current_rate = track.sample_rate;
+			pulse_id->pa_current_bps = track.bits;
+			pulse_id->pa_current_channels = track.num_channels;
 		}
-		/* Keep track of current connection parameters */
-		pulse_id->pa_current_rate = track.sample_rate;
-		pulse_id->pa_current_bps = track.bits;
-		pulse_id->pa_current_channels = track.num_channels;
+	} else if (pulse_id->pa_corked) {
+		/* Stopped last time, the flushed stream can play again */
+		pa_operation *op = pa_stream_cork(pulse_id->pa_stream, 0,
+						  NULL, NULL);
+		if (op)
+			pa_operation_unref(op);
+		pulse_id->pa_corked = 0;
 	}
-	MSG(4, "bytes to play: %d, (%f secs)\n", num_bytes,
-	    (((float)(num_bytes) / 2) / (float)track.sample_rate));
-	pulse_id->pa_stop_playback = 0;
-	outcnt = 0;
-	i = 0;
-	while ((outcnt < num_bytes) && !pulse_id->pa_stop_playback) {
-		if ((num_bytes - outcnt) > PULSE_SEND_BYTES) {
-			i = PULSE_SEND_BYTES;
-		} else {
-			i = (num_bytes - outcnt);
+	pa_threaded_mainloop_unlock(pulse_id->pa_mainloop);
+
+	return error ? -1 : 0;
+}
+
+/* Write the track to the stream as the server asks for data */
+static int pulse_feed(AudioID * id, AudioTrack track)
+{
+	spd_pulse_id_t *pulse_id = (spd_pulse_id_t *) id;
+	const char *output_samples = (const char *)track.samples;
+	size_t num_bytes, outcnt = 0, n;
+	int ret = 0;
+
+	if (track.samples == NULL || track.num_samples <= 0) {
+		return 0;
+	}
+	num_bytes = (size_t) track.num_samples * track.num_channels
+	    * (track.bits / 8);
+	MSG(4, "bytes to play: %zu, (%f secs)\n", num_bytes,
+	    (float)track.num_samples / (float)track.sample_rate);
+
+	pa_threaded_mainloop_lock(pulse_id->pa_mainloop);
+	while (outcnt < num_bytes && !pulse_id->pa_stop_playback) {
+		if (!pulse_id->pa_stream
+		    || !PA_STREAM_IS_GOOD(pa_stream_get_state(pulse_id->pa_stream))) {
+			MSG(4, "ERROR: Audio: pulse_feed(): stream lost - closing device - re-open it in next run\n");
+			pulse_connection_close(pulse_id);
+			ret = -1;
+			break;
+		}
+		n = pa_stream_writable_size(pulse_id->pa_stream);
+		if (n == 0) {
+			pa_threaded_mainloop_wait(pulse_id->pa_mainloop);
+			continue;
 		}
-		if (pa_simple_write
-		    (pulse_id->pa_simple, ((char *)output_samples) + outcnt, i,
-		     &error) < 0) {
-			pa_simple_drain(pulse_id->pa_simple, NULL);
+		n = MIN(n, num_bytes - outcnt);
+		if (pa_stream_write(pulse_id->pa_stream, output_samples + outcnt,
+				    n, NULL, 0, PA_SEEK_RELATIVE) < 0) {
+			MSG(4, "ERROR: Audio: pulse_feed(): %s - closing device - re-open it in next run\n",
+			    pa_strerror(pa_context_errno(pulse_id->pa_context)));
 			pulse_connection_close(pulse_id);
-			MSG(4, "ERROR: Audio: pulse_play(): %s - closing device - re-open it in next run\n", pa_strerror(error));
+			ret = -1;
 			break;
-		} else {
-			MSG(5, "Pulse: wrote %u bytes\n", i);
 		}
-		outcnt += i;
+		MSG(5, "Pulse: wrote %zu bytes\n", n);
+		outcnt += n;
 	}
+	pa_threaded_mainloop_unlock(pulse_id->pa_mainloop);
+
+	return ret;
+}
+
+/* Wait until everything written was played */
+static int pulse_drain(spd_pulse_id_t * pulse_id)
+{
+	pa_threaded_mainloop_lock(pulse_id->pa_mainloop);
+	if (pulse_id->pa_stream && !pulse_id->pa_stop_playback)
+		pulse_wait_operation(pulse_id,
+				     pa_stream_drain(pulse_id->pa_stream,
+						     pulse_success_cb,
+						     pulse_id));
+	pa_threaded_mainloop_unlock(pulse_id->pa_mainloop);
+
 	return 0;
 }
 
-/* stop the pulse_play() loop */
+static int pulse_feed_sync(AudioID * id, AudioTrack track)
+{
+	int ret;
+
+	ret = pulse_feed(id, track);
+	if (ret)
+		return ret;
+
+	return pulse_drain((spd_pulse_id_t *) id);
+}
+
+/* Microseconds until what was written so far is heard */
+static int pulse_get_delay(AudioID * id)
+{
+	spd_pulse_id_t *pulse_id = (spd_pulse_id_t *) id;
+	pa_usec_t latency;
+	int negative;
+
+	pa_threaded_mainloop_lock(pulse_id->pa_mainloop);
+	if (pulse_id->pa_stop_playback || !pulse_id->pa_stream
+	    || pa_stream_get_latency(pulse_id->pa_stream, &latency,
+				     &negative) < 0)
+		latency = 0;
+	else if (negative)
+		latency = 0;
+	pa_threaded_mainloop_unlock(pulse_id->pa_mainloop);
+
+	return MIN(latency, G_MAXINT);
+}
+
+/* Return once only PULSE_OVERLAP_USEC are left to play, so that the caller
+   has time to write more, and whatever it does when this returns matches
+   what is heard.  */
+static int pulse_feed_sync_overlap(AudioID * id, AudioTrack track)
+{
+	int delay, ret;
+
+	ret = pulse_feed(id, track);
+	if (ret)
+		return ret;
+
+	while ((delay = pulse_get_delay(id)) > PULSE_OVERLAP_USEC)
+		usleep(MIN(delay - PULSE_OVERLAP_USEC,
+			   PULSE_OVERLAP_POLL_USEC));
+
+	return 0;
+}
+
+static int pulse_end(AudioID * id)
+{
+	return pulse_drain((spd_pulse_id_t *) id);
+}
+
+static int pulse_play(AudioID * id, AudioTrack track)
+{
+	int ret;
+
+	if (track.samples == NULL || track.num_samples <= 0) {
+		return 0;
+	}
+	MSG(4, "Starting playback\n");
+
+	ret = pulse_begin(id, track);
+	if (ret)
+		return ret;
+
+	ret = pulse_feed_sync(id, track);
+	if (ret)
+		return ret;
+
+	return pulse_end(id);
+}
+
+/* Make the pulse_feed() loop and the drains return, and silence what was
+   already written: cork the stream and flush it, which the server does at
+   once, instead of letting the buffer play out.  */
 static int pulse_stop(AudioID * id)
 {
 	spd_pulse_id_t *pulse_id = (spd_pulse_id_t *) id;
+	pa_operation *op;
 
+	pa_threaded_mainloop_lock(pulse_id->pa_mainloop);
 	pulse_id->pa_stop_playback = 1;
+	if (pulse_id->pa_stream
+	    && pa_stream_get_state(pulse_id->pa_stream) == PA_STREAM_READY) {
+		op = pa_stream_cork(pulse_id->pa_stream, 1, NULL, NULL);
+		if (op)
+			pa_operation_unref(op);
+		op = pa_stream_flush(pulse_id->pa_stream, NULL, NULL);
+		if (op)
+			pa_operation_unref(op);
+		pulse_id->pa_corked = 1;
+	}
+	pa_threaded_mainloop_signal(pulse_id->pa_mainloop, 0);
+	pa_threaded_mainloop_unlock(pulse_id->pa_mainloop);
 	return 0;
 }
 
 static int pulse_close(AudioID * id)
 {
 	spd_pulse_id_t *pulse_id = (spd_pulse_id_t *) id;
+
+	pa_threaded_mainloop_lock(pulse_id->pa_mainloop);
 	pulse_connection_close(pulse_id);
+	if (pulse_id->pa_context) {
+		pa_context_disconnect(pulse_id->pa_context);
+		pa_context_unref(pulse_id->pa_context);
+		pulse_id->pa_context = NULL;
+	}
+	pa_threaded_mainloop_unlock(pulse_id->pa_mainloop);
+	pa_threaded_mainloop_stop(pulse_id->pa_mainloop);
+	pa_threaded_mainloop_free(pulse_id->pa_mainloop);
 	g_free(pulse_id);
 	id = NULL;
 
@@ -348,7 +648,13 @@ static spd_audio_plugin_t pulse_functions = {
 	pulse_close,
 	pulse_set_volume,
 	pulse_set_loglevel,
-	pulse_get_playcmd
+	pulse_get_playcmd,
+	pulse_begin,
+	pulse_feed_sync,
+	pulse_feed_sync_overlap,
+	pulse_end,
+	pulse_feed,
+	pulse_get_delay,
 };
 
 spd_audio_plugin_t *pulse_plugin_get(void)
@@ -363,5 +669,10 @@ spd_audio_plugin_t *
 	return &pulse_functions;
 }
 
+int __attribute__ ((weak)) SPD_AUDIO_PLUGIN_ABI_ENTRY(void)
+{
+	return SPD_AUDIO_PLUGIN_ABI;
+}
+
 #undef MSG
 #undef ERR
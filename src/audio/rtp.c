@@ -0,0 +1,545 @@
+/*
+ * rtp.c -- The RTP sink backend for the spd_audio library.
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This streams the audio as RTP over UDP (RFC 3550) instead of playing it,
+ * as 16bit linear PCM (L16 of RFC 3551), in packets of 20ms.  44100Hz audio
+ * gets the static payload types 10 and 11, the other rates the dynamic 96,
+ * which the receiver has to be told about, e.g. with
+ *
+ *   a=rtpmap:96 L16/22050/1
+ *
+ * in its SDP file.  The socket does not block, many packets are given to
+ * the kernel at once, and the sending buffer is large.  Without pacing, the
+ * audio is sent as fast as the network takes it, which only receivers that
+ * record it can cope with; with pacing, packets are sent when they are due,
+ * a bit ahead, and feeding takes as long as playing would.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <glib.h>
+
+#ifdef USE_DLOPEN
+#define SPD_AUDIO_PLUGIN_ENTRY spd_audio_plugin_get
+#else
+#define SPD_AUDIO_PLUGIN_ENTRY spd_rtp_LTX_spd_audio_plugin_get
+#endif
+#include <spd_audio_plugin.h>
+
+/* Put a message into the logfile (stderr) */
+#define MSG(level, arg...) \
+	if(level <= rtp_log_level){ \
+		time_t t; \
+		struct timeval tv; \
+		char *tstr; \
+		t = time(NULL); \
+		tstr = g_strdup(ctime(&t)); \
+		tstr[strlen(tstr)-1] = 0; \
+		gettimeofday(&tv,NULL); \
+		fprintf(stderr," %s [%d]",tstr, (int) tv.tv_usec); \
+		fprintf(stderr," rtp:: "); \
+		fprintf(stderr,arg); \
+		fprintf(stderr,"\n"); \
+		fflush(stderr); \
+		g_free(tstr); \
+	}
+
+#define ERR(arg...) \
+	{ \
+		time_t t; \
+		struct timeval tv; \
+		char *tstr; \
+		t = time(NULL); \
+		tstr = g_strdup(ctime(&t)); \
+		tstr[strlen(tstr)-1] = 0; \
+		gettimeofday(&tv,NULL); \
+		fprintf(stderr," %s [%d]",tstr, (int) tv.tv_usec); \
+		fprintf(stderr," rtp ERROR: "); \
+		fprintf(stderr,arg); \
+		fprintf(stderr,"\n"); \
+		fflush(stderr); \
+		g_free(tstr); \
+	}
+
+#define RTP_DEFAULT_PORT "5004"
+#define RTP_HEADER 12
+/* Audio per packet, and at most this much payload to stay below the MTU */
+#define RTP_PACKET_MS 20
+#define RTP_MAX_PAYLOAD 1280
+/* Packets handed to the kernel at once */
+#define RTP_BATCH 32
+#define RTP_SNDBUF (1024 * 1024)
+/* With pacing, packets are sent that early, in us */
+#define RTP_LEAD_US 40000
+/* and feed_sync_overlap() returns that early */
+#define RTP_OVERLAP_US 100000
+
+#define RTP_PT_L16_STEREO 10
+#define RTP_PT_L16_MONO 11
+#define RTP_PT_DYNAMIC 96
+
+static int rtp_log_level;
+
+typedef struct {
+	AudioID id;
+	int fd;
+	int realtime;
+
+	guint16 seq;
+	guint32 timestamp;
+	guint32 ssrc;
+	int marker;		/* the next packet starts a talkspurt */
+
+	int rate;
+	int channels;
+	int payload_type;
+	int packet_frames;	/* frames per packet */
+
+	/* Packets waiting to be sent */
+	guint8 *packets;
+	struct iovec iov[RTP_BATCH];
+	int n_packets;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;	/* on CLOCK_MONOTONIC */
+	int stop_requested;
+
+	/* When the audio fed since then would have been played from, in us
+	 * of CLOCK_MONOTONIC, and how many frames */
+	gint64 start;
+	guint64 frames;
+} spd_rtp_id_t;
+
+static gint64 rtp_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+static int rtp_stopped(spd_rtp_id_t * rtp_id)
+{
+	int ret;
+
+	pthread_mutex_lock(&rtp_id->mutex);
+	ret = rtp_id->stop_requested;
+	pthread_mutex_unlock(&rtp_id->mutex);
+	return ret;
+}
+
+/* Wait until all but lead us of the audio fed so far would have been
+ * played, returns -1 when stopped meanwhile */
+static int rtp_wait(spd_rtp_id_t * rtp_id, gint64 lead)
+{
+	gint64 due;
+	struct timespec ts;
+	int ret = 0;
+
+	due = rtp_id->start
+	    + (gint64) (rtp_id->frames * G_USEC_PER_SEC / rtp_id->rate) - lead;
+	ts.tv_sec = due / G_USEC_PER_SEC;
+	ts.tv_nsec = (due % G_USEC_PER_SEC) * 1000;
+
+	pthread_mutex_lock(&rtp_id->mutex);
+	while (!rtp_id->stop_requested && rtp_now() < due)
+		pthread_cond_timedwait(&rtp_id->cond, &rtp_id->mutex, &ts);
+	if (rtp_id->stop_requested)
+		ret = -1;
+	pthread_mutex_unlock(&rtp_id->mutex);
+
+	return ret;
+}
+
+/* Send the waiting packets, waiting for room in the socket buffer */
+static int rtp_send(spd_rtp_id_t * rtp_id)
+{
+	struct pollfd pfd = {.fd = rtp_id->fd,.events = POLLOUT };
+	int sent = 0, ret;
+
+	while (sent < rtp_id->n_packets) {
+#ifdef HAVE_SENDMMSG
+		struct mmsghdr msgs[RTP_BATCH];
+		int i;
+
+		memset(msgs, 0, sizeof(msgs));
+		for (i = sent; i < rtp_id->n_packets; i++) {
+			msgs[i - sent].msg_hdr.msg_iov = &rtp_id->iov[i];
+			msgs[i - sent].msg_hdr.msg_iovlen = 1;
+		}
+		ret = sendmmsg(rtp_id->fd, msgs, rtp_id->n_packets - sent, 0);
+#else
+		ret = send(rtp_id->fd, rtp_id->iov[sent].iov_base,
+			   rtp_id->iov[sent].iov_len, 0) < 0 ? -1 : 1;
+#endif
+		if (ret > 0) {
+			sent += ret;
+			continue;
+		}
+
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			if (rtp_stopped(rtp_id))
+				break;
+			poll(&pfd, 1, RTP_PACKET_MS);
+		} else if (errno == ECONNREFUSED) {
+			/* Nobody listens right now, drop it */
+			break;
+		} else if (errno != EINTR) {
+			ERR("Can't send: %s", strerror(errno));
+			rtp_id->n_packets = 0;
+			return -1;
+		}
+	}
+
+	rtp_id->n_packets = 0;
+	return 0;
+}
+
+/* Make a packet of the frames, in the byte order of the network */
+static void rtp_packetize(spd_rtp_id_t * rtp_id, const AudioTrack * track,
+			  int first, int n)
+{
+	int i = rtp_id->n_packets;
+	guint8 *packet = rtp_id->packets
+	    + (size_t) i * (RTP_HEADER + RTP_MAX_PAYLOAD);
+	guint16 *payload = (guint16 *) (packet + RTP_HEADER);
+	size_t count = (size_t) n * track->num_channels, j;
+	size_t offset = (size_t) first * track->num_channels;
+
+	packet[0] = 0x80;	/* version 2 */
+	packet[1] = rtp_id->payload_type | (rtp_id->marker ? 0x80 : 0);
+	packet[2] = rtp_id->seq >> 8;
+	packet[3] = rtp_id->seq & 0xff;
+	packet[4] = rtp_id->timestamp >> 24;
+	packet[5] = (rtp_id->timestamp >> 16) & 0xff;
+	packet[6] = (rtp_id->timestamp >> 8) & 0xff;
+	packet[7] = rtp_id->timestamp & 0xff;
+	packet[8] = rtp_id->ssrc >> 24;
+	packet[9] = (rtp_id->ssrc >> 16) & 0xff;
+	packet[10] = (rtp_id->ssrc >> 8) & 0xff;
+	packet[11] = rtp_id->ssrc & 0xff;
+
+	if (track->bits == 16) {
+		const guint16 *samples = (const guint16 *)track->samples;
+
+		for (j = 0; j < count; j++)
+			payload[j] = GUINT16_TO_BE(samples[offset + j]);
+	} else {
+		const guint8 *samples = (const guint8 *)track->samples;
+
+		for (j = 0; j < count; j++)
+			payload[j] = GUINT16_TO_BE((guint16)
+						   ((samples[offset + j] - 128)
+						    << 8));
+	}
+
+	rtp_id->iov[i].iov_base = packet;
+	rtp_id->iov[i].iov_len = RTP_HEADER + count * 2;
+	rtp_id->n_packets++;
+
+	rtp_id->seq++;
+	rtp_id->timestamp += n;
+	rtp_id->marker = 0;
+}
+
+/*
+ Open the RTP sink
+
+ Arguments:
+      (char*) pars[8] -- where to send, as host:port, [host]:port for IPv6
+			 addresses, the port is 5004 when omitted
+      (char*) pars[9] -- "1" to send the audio as it would be played
+*/
+static AudioID *rtp_open(void **pars)
+{
+	spd_rtp_id_t *rtp_id;
+	pthread_condattr_t attr;
+	struct addrinfo hints, *res, *ai;
+	gchar *host, *port, *colon;
+	int fd = -1, size = RTP_SNDBUF, ret;
+
+	host = g_strdup(pars[8] ? (char *)pars[8] : "localhost");
+	if (host[0] == '[' && (colon = strchr(host, ']')) != NULL) {
+		*colon = '\0';
+		port = colon[1] == ':' ? colon + 2 : RTP_DEFAULT_PORT;
+		memmove(host, host + 1, strlen(host));
+	} else if ((colon = strrchr(host, ':')) != NULL
+		   && strchr(host, ':') == colon) {
+		*colon = '\0';
+		port = colon + 1;
+	} else
+		port = RTP_DEFAULT_PORT;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	ret = getaddrinfo(host, port, &hints, &res);
+	if (ret != 0) {
+		ERR("Can't resolve %s: %s", (char *)pars[8], gai_strerror(ret));
+		g_free(host);
+		return NULL;
+	}
+
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0) {
+		ERR("Can't send to %s:%s: %s", host, port, strerror(errno));
+		g_free(host);
+		return NULL;
+	}
+	g_free(host);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+	rtp_id = g_new0(spd_rtp_id_t, 1);
+	rtp_id->fd = fd;
+	rtp_id->realtime = pars[9] && atoi(pars[9]);
+	rtp_id->seq = g_random_int();
+	rtp_id->timestamp = g_random_int();
+	rtp_id->ssrc = g_random_int();
+	rtp_id->packets = g_malloc(RTP_BATCH * (RTP_HEADER + RTP_MAX_PAYLOAD));
+	pthread_mutex_init(&rtp_id->mutex, NULL);
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&rtp_id->cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	return (AudioID *) rtp_id;
+}
+
+static int rtp_begin(AudioID * id, AudioTrack track)
+{
+	spd_rtp_id_t *rtp_id = (spd_rtp_id_t *) id;
+	gint64 now, end;
+
+	if (rtp_id == NULL)
+		return -1;
+
+	if ((track.bits != 16 && track.bits != 8) || track.sample_rate <= 0
+	    || track.num_channels < 1) {
+		ERR("Unrecognized sound data format.");
+		return -10;
+	}
+
+	if (track.sample_rate != rtp_id->rate
+	    || track.num_channels != rtp_id->channels) {
+		rtp_id->rate = track.sample_rate;
+		rtp_id->channels = track.num_channels;
+		if (track.sample_rate == 44100 && track.num_channels <= 2)
+			rtp_id->payload_type = track.num_channels == 1
+			    ? RTP_PT_L16_MONO : RTP_PT_L16_STEREO;
+		else {
+			rtp_id->payload_type = RTP_PT_DYNAMIC;
+			MSG(2, "Streaming as a=rtpmap:%d L16/%d/%d",
+			    RTP_PT_DYNAMIC, track.sample_rate,
+			    track.num_channels);
+		}
+		rtp_id->packet_frames =
+		    MIN(track.sample_rate * RTP_PACKET_MS / 1000,
+			RTP_MAX_PAYLOAD / (2 * track.num_channels));
+		if (rtp_id->packet_frames < 1)
+			rtp_id->packet_frames = 1;
+		rtp_id->start = 0;
+	}
+
+	pthread_mutex_lock(&rtp_id->mutex);
+	rtp_id->stop_requested = 0;
+	pthread_mutex_unlock(&rtp_id->mutex);
+
+	/* Follow the previous message unless it was over already, the gap
+	 * is then accounted in the timestamps */
+	now = rtp_now();
+	end = rtp_id->start
+	    + (gint64) (rtp_id->frames * G_USEC_PER_SEC / rtp_id->rate);
+	if (rtp_id->start == 0 || end < now) {
+		if (rtp_id->start != 0)
+			rtp_id->timestamp += (now - end) * rtp_id->rate
+			    / G_USEC_PER_SEC;
+		rtp_id->start = now;
+		rtp_id->frames = 0;
+		rtp_id->marker = 1;
+	}
+
+	return 0;
+}
+
+static int rtp_feed(spd_rtp_id_t * rtp_id, AudioTrack track, gint64 lead)
+{
+	int done = 0, n;
+
+	if (rtp_id == NULL || rtp_id->rate <= 0)
+		return -1;
+	if (track.samples == NULL || track.num_samples <= 0)
+		return 0;
+
+	while (done < track.num_samples && !rtp_stopped(rtp_id)) {
+		n = MIN(rtp_id->packet_frames, track.num_samples - done);
+		if (rtp_id->realtime && rtp_wait(rtp_id, RTP_LEAD_US) < 0)
+			break;
+		rtp_packetize(rtp_id, &track, done, n);
+		done += n;
+		rtp_id->frames += n;
+		if ((rtp_id->realtime || rtp_id->n_packets == RTP_BATCH)
+		    && rtp_send(rtp_id) < 0)
+			return -1;
+	}
+
+	if (rtp_id->n_packets && rtp_send(rtp_id) < 0)
+		return -1;
+	if (rtp_id->realtime)
+		rtp_wait(rtp_id, lead);
+	return 0;
+}
+
+static int rtp_feed_sync(AudioID * id, AudioTrack track)
+{
+	return rtp_feed((spd_rtp_id_t *) id, track, 0);
+}
+
+static int rtp_feed_sync_overlap(AudioID * id, AudioTrack track)
+{
+	return rtp_feed((spd_rtp_id_t *) id, track, RTP_OVERLAP_US);
+}
+
+static int rtp_end(AudioID * id)
+{
+	spd_rtp_id_t *rtp_id = (spd_rtp_id_t *) id;
+
+	if (rtp_id == NULL)
+		return -1;
+
+	if (rtp_id->realtime && rtp_id->rate > 0)
+		rtp_wait(rtp_id, 0);
+	return 0;
+}
+
+static int rtp_play(AudioID * id, AudioTrack track)
+{
+	int ret;
+
+	ret = rtp_begin(id, track);
+	if (ret)
+		return ret;
+
+	ret = rtp_feed_sync(id, track);
+	rtp_end(id);
+	return ret;
+}
+
+static int rtp_stop(AudioID * id)
+{
+	spd_rtp_id_t *rtp_id = (spd_rtp_id_t *) id;
+
+	if (rtp_id == NULL)
+		return -1;
+
+	pthread_mutex_lock(&rtp_id->mutex);
+	rtp_id->stop_requested = 1;
+	pthread_cond_broadcast(&rtp_id->cond);
+	pthread_mutex_unlock(&rtp_id->mutex);
+	return 0;
+}
+
+static int rtp_close(AudioID * id)
+{
+	spd_rtp_id_t *rtp_id = (spd_rtp_id_t *) id;
+
+	if (rtp_id == NULL)
+		return -1;
+
+	close(rtp_id->fd);
+	pthread_mutex_destroy(&rtp_id->mutex);
+	pthread_cond_destroy(&rtp_id->cond);
+	g_free(rtp_id->packets);
+	g_free(rtp_id);
+	return 0;
+}
+
+static int rtp_set_volume(AudioID * id, int volume)
+{
+	return 0;
+}
+
+static void rtp_set_loglevel(int level)
+{
+	if (level) {
+		rtp_log_level = level;
+	}
+}
+
+static char const *rtp_get_playcmd(void)
+{
+	return NULL;
+}
+
+/* Provide the rtp backend. */
+static spd_audio_plugin_t rtp_functions = {
+	"rtp",
+	rtp_open,
+	rtp_play,
+	rtp_stop,
+	rtp_close,
+	rtp_set_volume,
+	rtp_set_loglevel,
+	rtp_get_playcmd,
+	rtp_begin,
+	rtp_feed_sync,
+	rtp_feed_sync_overlap,
+	rtp_end,
+};
+
+spd_audio_plugin_t *rtp_plugin_get(void)
+{
+	return &rtp_functions;
+}
+
+spd_audio_plugin_t *
+    __attribute__ ((weak))
+    SPD_AUDIO_PLUGIN_ENTRY(void)
+{
+	return &rtp_functions;
+}
+#undef MSG
+#undef ERR
@@ -46,6 +46,7 @@ char *voice_type;
 char *punctuation_mode;
 char *priority;
 int pipe_mode;
+int stream_mode;
 int character;
 int key;
 SPDDataMode ssml_mode;
@@ -132,6 +133,11 @@ void options_print_help(char *argv[])
 	printf(_("Read text to be spoken on stdin, write it on stdout unchanged, and the\n"));
 	printf(_("corresponding speech through Speech Dispatcher.\n"));
 
+	printf("  -E, --stream[=line|paragraph]   ");
+	printf(_("Speak the lines or paragraphs read on stdin as they come,\n"));
+	printf("                                  ");
+	printf(_("on one connection (default: line)\n"));
+
 	printf("  -P, --priority                  ");
 	printf(_("Set priority of the message "));
 	printf("(important, message,\n"
@@ -272,6 +278,17 @@ int options_parse(int argc, char *argv[])
 		case 'e':
 			pipe_mode = 1;
 			break;
+		case 'E':
+			if (optarg == NULL || !strcmp(optarg, "line")) {
+				stream_mode = STREAM_LINES;
+			} else if (!strcmp(optarg, "paragraph")) {
+				stream_mode = STREAM_PARAGRAPHS;
+			} else {
+				printf(_("Syntax error or bad parameter!\n"));
+				options_print_help(argv);
+				exit(1);
+			}
+			break;
 		case 'P':
 			OPT_SET_STR(priority);
 			break;
@@ -35,6 +35,9 @@ extern char *voice_type;
 extern char *punctuation_mode;
 extern char *priority;
 extern int pipe_mode;
+extern int stream_mode;	/* 0 or one of: */
+#define STREAM_LINES 1
+#define STREAM_PARAGRAPHS 2
 extern int character;
 extern int key;
 extern SPDDataMode ssml_mode;
@@ -66,6 +69,7 @@ static struct option long_options[] = {
 	{"spelling", 0, 0, 's'},
 	{"ssml", 0, 0, 'x'},
 	{"pipe-mode", 0, 0, 'e'},
+	{"stream", optional_argument, 0, 'E'},
 	{"priority", 1, 0, 'P'},
 	{"application-name", 1, 0, 'N'},
 	{"connection-name", 1, 0, 'n'},
@@ -77,7 +81,7 @@ static struct option long_options[] = {
 	{0, 0, 0, 0}
 };
 
-static char *short_options = "r:p:R:i:l:o:OI:t:Ly:ckm:sxeP:N:n:wSCvh";
+static char *short_options = "r:p:R:i:l:o:OI:t:Ly:ckm:sxeE::P:N:n:wSCvh";
 
 int options_parse(int argc, char *argv[]);
 void options_print_version(void);
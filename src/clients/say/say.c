@@ -63,6 +63,63 @@ void index_mark(size_t msg_id, size_t client_id, SPDNotificationType type, char
 		fprintf(stderr, "reached mark '%s'\n", index_mark);
 }
 
+/* Say TEXT unless it is blank, returns 1 if a message was sent */
+static int say_text(SPDConnection *conn, SPDPriority spd_priority,
+		    const char *text)
+{
+	if (text[strspn(text, " \t\r\n")] == '\0')
+		return 0;
+	if (spd_say(conn, spd_priority, text) == -1) {
+		fprintf(stderr, "Speech Dispatcher failed to say message\n");
+		return 0;
+	}
+	return 1;
+}
+
+/* Say the lines or paragraphs of stdin as soon as they are read,
+   returns the number of messages sent */
+static int say_stream(SPDConnection *conn, SPDPriority spd_priority)
+{
+	char *line = NULL;
+	size_t line_size = 0;
+	char *paragraph = NULL;
+	size_t paragraph_len = 0;
+	size_t paragraph_size = 0;
+	ssize_t len;
+	int sent = 0;
+
+	while ((len = getline(&line, &line_size, stdin)) != -1) {
+		if (stream_mode == STREAM_LINES) {
+			sent += say_text(conn, spd_priority, line);
+			continue;
+		}
+
+		/* A blank line ends the paragraph */
+		if (line[strspn(line, " \t\r\n")] == '\0') {
+			if (paragraph_len > 0)
+				sent += say_text(conn, spd_priority, paragraph);
+			paragraph_len = 0;
+			continue;
+		}
+		if (paragraph_len + len + 1 > paragraph_size) {
+			paragraph_size = 2 * (paragraph_len + len + 1);
+			paragraph = realloc(paragraph, paragraph_size);
+			if (paragraph == NULL) {
+				fprintf(stderr, "Out of memory\n");
+				exit(1);
+			}
+		}
+		memcpy(paragraph + paragraph_len, line, len + 1);
+		paragraph_len += len;
+	}
+	if (paragraph_len > 0)
+		sent += say_text(conn, spd_priority, paragraph);
+
+	free(paragraph);
+	free(line);
+	return sent;
+}
+
 int main(int argc, char **argv)
 {
 	SPDConnection *conn;
@@ -93,6 +150,7 @@ int main(int argc, char **argv)
 	list_output_modules = 0;
 	synthesis_voice = NULL;
 	pipe_mode = 0;
+	stream_mode = 0;
 	priority = NULL;
 	application_name = NULL;
 	connection_name = NULL;
@@ -100,7 +158,8 @@ int main(int argc, char **argv)
 	option_ret = options_parse(argc, argv);
 
 	/* Check if the text to say or options are specified in the argument */
-	msg_arg_required = (pipe_mode != 1) && (stop_previous != 1)
+	msg_arg_required = (pipe_mode != 1) && (stream_mode == 0)
+	    && (stop_previous != 1)
 	    && (cancel_previous != 1) && (list_synthesis_voices != 1)
 	    && (list_output_modules != 1) && (sound_icon == NULL);
 	if ((optind >= argc) && msg_arg_required) {
@@ -353,6 +412,15 @@ int main(int argc, char **argv)
 		}
 		free(line);
 
+	} else if (stream_mode) {
+		/* Keep reading while the messages are queued and spoken, and
+		   only wait for all of them at the end */
+		int sent = say_stream(conn, spd_priority);
+
+		if (wait_till_end)
+			while (sent-- > 0)
+				sem_wait(semaphore);
+
 	} else {
 		/* Say the message with priority "text" */
 		/* Or do nothing in case of -C or -S with no message. */
@@ -26,35 +26,24 @@
 
 #include "spdsend.h"
 
-#ifndef USE_THREADS
-#define USE_THREADS 1
-#endif
-
 #include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
-#if USE_THREADS
-#include <pthread.h>
-#endif
 #include <pwd.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/un.h>
 #include <unistd.h>
 
-#ifndef HAVE_GETLINE
-/*
- * Added by Willie Walker - getline was a GNU libc extension, later adopted
- * in the POSIX.1-2008 standard, but not yet found on all systems.
- */
-ssize_t getline(char **lineptr, size_t * n, FILE * f);
-#endif
-
 /* Utilities */
 
 static void system_error(const char *message)
@@ -63,121 +52,226 @@ static void system_error(const char *message)
 	exit(1);
 }
 
-/* Connection management */
+/* Buffers */
 
-Stream *connections;
-#if USE_THREADS
-pthread_mutex_t connections_mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
+/* All the sockets are non-blocking, data which can't be written right away
+   wait in a buffer until the socket becomes writable again. */
 
-static Stream get_connection(Connection_Id id)
+struct buffer {
+	char *data;
+	size_t size;
+	size_t start;
+	size_t end;
+};
+
+static size_t buffer_length(const struct buffer *b)
 {
-	if (id < CONNECTION_ID_MIN || id >= CONNECTION_ID_MAX)
-		return NONE;
-	return connections[id];
+	return b->end - b->start;
 }
 
-static void set_connection(Connection_Id id, Stream s)
+/* Makes room for N more bytes at the end of the buffer */
+static char *buffer_reserve(struct buffer *b, size_t n)
 {
-#if USE_THREADS
-	pthread_mutex_lock(&connections_mutex);
-#endif
-	connections[id] = s;
-#if USE_THREADS
-	pthread_mutex_unlock(&connections_mutex);
-#endif
+	if (b->start > 0 && b->end + n > b->size) {
+		memmove(b->data, b->data + b->start, b->end - b->start);
+		b->end -= b->start;
+		b->start = 0;
+	}
+	if (b->end + n > b->size) {
+		size_t size = b->size ? b->size : 256;
+		while (size < b->end + n)
+			size *= 2;
+		b->data = realloc(b->data, size);
+		if (b->data == NULL)
+			system_error("memory allocation");
+		b->size = size;
+	}
+	return b->data + b->end;
 }
 
-static Connection_Id new_connection(Stream s)
+static void buffer_append(struct buffer *b, const void *data, size_t n)
 {
-#if USE_THREADS
-	pthread_mutex_lock(&connections_mutex);
-#endif
-	int id;
-	for (id = CONNECTION_ID_MIN;
-	     id < CONNECTION_ID_MAX && connections[id] != NONE; id++) ;
-	if (id >= CONNECTION_ID_MAX)
-	{
-#if USE_THREADS
-		pthread_mutex_unlock(&connections_mutex);
-#endif
-		return NONE;
-	}
-	connections[id] = s;
-#if USE_THREADS
-	pthread_mutex_unlock(&connections_mutex);
-#endif
-	return id;
+	memcpy(buffer_reserve(b, n), data, n);
+	b->end += n;
 }
 
-static Connection_Id do_open_connection(const char *host, int port)
+static void buffer_consume(struct buffer *b, size_t n)
 {
-	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	b->start += n;
+	if (b->start == b->end)
+		b->start = b->end = 0;
+}
 
-	if (sock < 0)
-		return NONE;
+static void buffer_free(struct buffer *b)
+{
+	free(b->data);
+	memset(b, 0, sizeof(*b));
+}
 
-	{
-		struct sockaddr_in name;
-		name.sin_family = AF_INET;
-		name.sin_port = htons(port);
-		{
-			struct hostent *hostinfo;
-			hostinfo = gethostbyname(host);
-			if (hostinfo == NULL) {
-				close(sock);
-				return NONE;
-			}
-			name.sin_addr = *(struct in_addr *)hostinfo->h_addr;
-		}
-		if (connect(sock, (struct sockaddr *)&name, sizeof(name)) < 0) {
-			close(sock);
-			return NONE;
-		}
-		{
-			int arg = 1;
-			setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &arg,
-				   sizeof(int));
+/* Reads what is available on S into B.  Returns the number of bytes read, 0
+   at end of file and NONE on error, with errno set to EAGAIN when there is
+   just nothing more to read now. */
+static ssize_t buffer_fill(struct buffer *b, Stream s)
+{
+	const size_t chunk = 4096;
+	ssize_t n;
+
+	do
+		n = read(s, buffer_reserve(b, chunk), chunk);
+	while (n < 0 && errno == EINTR);
+	if (n > 0)
+		b->end += n;
+	return n;
+}
+
+/* Writes as much of B to S as S accepts without blocking */
+static Success buffer_flush(struct buffer *b, Stream s)
+{
+	while (buffer_length(b) > 0) {
+		ssize_t n = send(s, b->data + b->start, buffer_length(b),
+				 MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return OK;
+			return ERROR;
 		}
+		buffer_consume(b, n);
 	}
+	return OK;
+}
 
-	{
-		Connection_Id id = new_connection(sock);
-		if (id == NONE)
-			close(sock);
-		return id;
-	}
+static void set_nonblocking(Stream s)
+{
+	int flags = fcntl(s, F_GETFL);
+	if (flags < 0 || fcntl(s, F_SETFL, flags | O_NONBLOCK) < 0)
+		system_error("fcntl");
 }
 
-static Success do_close_connection(Connection_Id id)
+/* Event loop */
+
+/* Everything runs in a single thread around epoll.  Each socket registered
+   there starts with struct endpoint; endpoints closed while processing a
+   batch of events are only freed after the batch, as later events of the
+   same batch may still point to them. */
+
+typedef enum { E_LISTENER, E_REQUEST, E_UPSTREAM } Endpoint_Type;
+
+struct endpoint {
+	Endpoint_Type type;
+	Stream fd;
+	uint32_t events;
+	bool dead;
+	struct endpoint *next_dead;
+};
+
+static int epoll_fd;
+static struct endpoint *dead_endpoints;
+
+static void endpoint_watch(struct endpoint *e, uint32_t events)
 {
-	Stream c = get_connection(id);
-	if (c == NONE)
-		return ERROR;
-	close(c);
-	set_connection(id, NONE);
-	return OK;
+	struct epoll_event ev;
+
+	if (e->fd == NONE || e->events == events)
+		return;
+	ev.events = events;
+	ev.data.ptr = e;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, e->fd, &ev) < 0)
+		system_error("epoll_ctl");
+	e->events = events;
 }
 
-static Success do_send_data(Connection_Id id, Stream from, Stream to,
-			    Success(*forwarder) (Stream, Stream, bool))
+static void endpoint_add(struct endpoint *e, Endpoint_Type type, Stream fd,
+			 uint32_t events)
 {
-	int sock = get_connection(id);
-	if (sock == NONE)
-		return ERROR;
-	if (from == NONE)
-		from = sock;
-	else if (to == NONE)
-		to = sock;
-	{
-		Success result = ((*forwarder) (from, to, FALSE));
-		if (result != OK)
-			do_close_connection(id);
-		return result;
+	struct epoll_event ev;
+
+	e->type = type;
+	e->fd = fd;
+	e->events = events;
+	ev.events = events;
+	ev.data.ptr = e;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		system_error("epoll_ctl");
+}
+
+/* Closes the socket of E; closing removes it from epoll as well */
+static void endpoint_close(struct endpoint *e)
+{
+	if (e->fd == NONE)
+		return;
+	close(e->fd);
+	e->fd = NONE;
+}
+
+static void endpoint_bury(struct endpoint *e)
+{
+	endpoint_close(e);
+	e->dead = TRUE;
+	e->next_dead = dead_endpoints;
+	dead_endpoints = e;
+}
+
+static void free_dead_endpoints(void)
+{
+	while (dead_endpoints != NULL) {
+		struct endpoint *e = dead_endpoints;
+		dead_endpoints = e->next_dead;
+		free(e);
 	}
 }
 
-/* Processing requests */
+/* Connection management */
+
+/* A request is one spdsend client invocation, an upstream is an open SSIP
+   connection to Speech Dispatcher.  The SSIP commands of a request are only
+   passed upstream once the client has sent all of them, so that commands of
+   concurrent requests never interleave; the request then waits in the
+   upstream's queue for its replies, which arrive in the same order. */
+
+typedef enum { R_HEADER, R_DATA, R_CONNECTING, R_REPLYING, R_CLOSING }
+    Request_State;
+
+struct request {
+	struct endpoint e;
+	Request_State state;
+	struct buffer in;
+	struct buffer out;
+	Connection_Id id;
+	int replies;
+	struct request *next;
+};
+
+struct upstream {
+	struct endpoint e;
+	Connection_Id id;
+	struct buffer in;
+	struct buffer out;
+	struct request *opener;
+	struct request *queue;
+	struct request *queue_tail;
+};
+
+struct upstream **connections;
+
+static struct upstream *get_connection(Connection_Id id)
+{
+	if (id < CONNECTION_ID_MIN || id >= CONNECTION_ID_MAX)
+		return NULL;
+	return connections[id];
+}
+
+static Connection_Id new_connection(struct upstream *u)
+{
+	int id;
+	for (id = CONNECTION_ID_MIN;
+	     id < CONNECTION_ID_MAX && connections[id] != NULL; id++) ;
+	if (id >= CONNECTION_ID_MAX)
+		return NONE;
+	connections[id] = u;
+	return id;
+}
 
 /* Protocol:
 
@@ -195,140 +289,463 @@ static Success do_send_data(Connection_Id id, Stream from, Stream to,
      Additionally, if Action is A_DATA, SSIP reply follows.
 */
 
-static Success report(Stream s, Result code)
+static void report_ok(struct request *r, Connection_Id id)
 {
-	return write_data(s, &code, sizeof(Result));
+	Result code = OK_CODE;
+	buffer_append(&r->out, &code, sizeof(Result));
+	buffer_append(&r->out, &id, sizeof(Connection_Id));
 }
 
-static Success report_ok(Stream s, Connection_Id id)
+static void report_error(struct request *r)
 {
-	if (report(s, OK_CODE) == OK &&
-	    write_data(s, &id, sizeof(Connection_Id)) == OK)
-		return OK;
-	else
-		return ERROR;
+	Result code = ER_CODE;
+	buffer_append(&r->out, &code, sizeof(Result));
 }
 
-static Success report_error(Stream s)
+/* Returns the number of SSIP replies the commands in DATA produce: one per
+   command line and one more for the data following SPEAK, which end with a
+   line containing just a dot.  DATA is all the client sends, so an
+   unterminated last line counts too, process_commands() terminates it. */
+static int count_ssip_replies(const char *data, size_t len)
 {
-	return report(s, ER_CODE);
+	const char *end = data + len;
+	bool in_data = FALSE;
+	int replies = 0;
+
+	while (data < end) {
+		const char *eol = memchr(data, '\n', end - data);
+		size_t n;
+
+		if (eol == NULL)
+			eol = end;
+		n = eol - data;
+		if (n > 0 && data[n - 1] == '\r')
+			n--;
+		if (in_data) {
+			if (n == 1 && data[0] == '.') {
+				in_data = FALSE;
+				replies++;
+			}
+		} else if (n > 0) {
+			replies++;
+			if (n == 5 && !strncasecmp(data, "SPEAK", 5))
+				in_data = TRUE;
+		}
+		data = eol + 1;
+	}
+
+	return replies;
 }
 
-static Connection_Id read_id(Stream s)
+static void request_free(struct request *r)
 {
-	Connection_Id id;
-	if (read_data(s, &id, sizeof(Connection_Id)) == ERROR)
-		return NONE;
-	return id;
+	buffer_free(&r->in);
+	buffer_free(&r->out);
+	endpoint_bury(&r->e);
+}
+
+/* Writes out what can be written to the client and watches for what the
+   request waits for next */
+static void request_output(struct request *r)
+{
+	uint32_t events = 0;
+
+	if (r->e.fd == NONE) {
+		/* The client is gone, only the upstream queue still knows
+		   about the request */
+		if (r->state == R_CLOSING)
+			request_free(r);
+		return;
+	}
+
+	if (buffer_flush(&r->out, r->e.fd) == ERROR) {
+		buffer_consume(&r->out, buffer_length(&r->out));
+		if (r->state == R_REPLYING || r->state == R_CONNECTING)
+			endpoint_close(&r->e);
+		else
+			request_free(r);
+		return;
+	}
+
+	if (buffer_length(&r->out) > 0)
+		events |= EPOLLOUT;
+	else if (r->state == R_CLOSING) {
+		request_free(r);
+		return;
+	}
+	if (r->state == R_HEADER || r->state == R_DATA)
+		events |= EPOLLIN;
+	endpoint_watch(&r->e, events);
+}
+
+static void request_finish(struct request *r)
+{
+	r->state = R_CLOSING;
+	request_output(r);
+}
+
+/* The client is gone; a request waiting for an upstream stays there until
+   the upstream is done with it */
+static void request_drop(struct request *r)
+{
+	if (r->state == R_REPLYING || r->state == R_CONNECTING) {
+		buffer_free(&r->in);
+		buffer_free(&r->out);
+		endpoint_close(&r->e);
+	} else
+		request_free(r);
+}
+
+static void upstream_free(struct upstream *u)
+{
+	buffer_free(&u->in);
+	buffer_free(&u->out);
+	endpoint_bury(&u->e);
+}
+
+/* Closes the SSIP connection; requests still waiting for their replies get
+   what has arrived so far */
+static void upstream_close(struct upstream *u)
+{
+	if (u->id != NONE)
+		connections[u->id] = NULL;
+	while (u->queue != NULL) {
+		struct request *r = u->queue;
+		u->queue = r->next;
+		request_finish(r);
+	}
+	upstream_free(u);
 }
 
-static Success forward_ssip_answer(Stream from, Stream to, bool _closep)
+static void upstream_connected(struct upstream *u)
 {
-	int result = OK;
-	FILE *f = fdopen(from, "r");
-	size_t line_size = 256;
-	char *line = malloc(line_size);
-	if (line == NULL)
+	struct request *r = u->opener;
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	u->opener = NULL;
+	if (getsockopt(u->e.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+		error = errno;
+	if (error == 0 && r->e.fd != NONE)
+		u->id = new_connection(u);
+
+	if (u->id == NONE) {
+		report_error(r);
+		request_finish(r);
+		upstream_free(u);
+		return;
+	}
+
+	{
+		int arg = 1;
+		setsockopt(u->e.fd, IPPROTO_TCP, TCP_NODELAY, &arg,
+			   sizeof(int));
+	}
+	report_ok(r, u->id);
+	request_finish(r);
+	endpoint_watch(&u->e, EPOLLIN);
+}
+
+static void upstream_open(struct request *r, const char *host, int port)
+{
+	struct sockaddr_in name;
+	struct hostent *hostinfo;
+	struct upstream *u;
+	int sock;
+
+	/* Name resolution still blocks, it is usually just a local lookup */
+	hostinfo = gethostbyname(host);
+	if (hostinfo == NULL) {
+		report_error(r);
+		request_finish(r);
+		return;
+	}
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		report_error(r);
+		request_finish(r);
+		return;
+	}
+	set_nonblocking(sock);
+
+	name.sin_family = AF_INET;
+	name.sin_port = htons(port);
+	name.sin_addr = *(struct in_addr *)hostinfo->h_addr;
+	if (connect(sock, (struct sockaddr *)&name, sizeof(name)) < 0
+	    && errno != EINPROGRESS) {
+		close(sock);
+		report_error(r);
+		request_finish(r);
+		return;
+	}
+
+	u = calloc(1, sizeof(struct upstream));
+	if (u == NULL)
 		system_error("memory allocation");
+	u->id = NONE;
+	u->opener = r;
+	r->state = R_CONNECTING;
+	endpoint_add(&u->e, E_UPSTREAM, sock, EPOLLOUT);
+	request_output(r);
+}
 
-	while (1) {
-		int n = getline(&line, &line_size, f);
-		if (n < 0 || write_data(to, line, n) == ERROR) {
-			result = ERROR;
-			break;
+/* Passes the complete SSIP reply lines to the requests waiting for them */
+static void upstream_dispatch(struct upstream *u)
+{
+	char *eol;
+
+	while ((eol = memchr(u->in.data + u->in.start, '\n',
+			     buffer_length(&u->in))) != NULL) {
+		char *line = u->in.data + u->in.start;
+		size_t n = eol + 1 - line;
+		struct request *r = u->queue;
+
+		/* Events are not replies to anything spdsend sent */
+		if (line[0] != '7' && r != NULL) {
+			if (r->e.fd != NONE)
+				buffer_append(&r->out, line, n);
+			if (n > 3 && line[3] == ' ' && --r->replies == 0) {
+				u->queue = r->next;
+				r->state = R_CLOSING;
+			}
+			request_output(r);
 		}
-		if (n > 3 && line[3] == ' ')
-			break;
+		buffer_consume(&u->in, n);
 	}
+}
 
-	free(line);
-	return result;
+static void upstream_input(struct upstream *u)
+{
+	while (1) {
+		ssize_t n = buffer_fill(&u->in, u->e.fd);
+		if (n > 0)
+			continue;
+		upstream_dispatch(u);
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		upstream_close(u);
+		return;
+	}
 }
 
-static void process_open(Stream s)
+static void upstream_output(struct upstream *u)
+{
+	if (buffer_flush(&u->out, u->e.fd) == ERROR) {
+		upstream_close(u);
+		return;
+	}
+	endpoint_watch(&u->e, EPOLLIN
+		       | (buffer_length(&u->out) > 0 ? EPOLLOUT : 0));
+}
+
+/* Processing requests */
+
+static void process_open(struct request *r, const char *header)
 {
-	Connection_Id id;
 	int port;
 	int hostlen;
+	char *host;
 
-	if (read_data(s, &port, sizeof(int)) != sizeof(int)) {
-		report_error(s);
+	memcpy(&port, header, sizeof(int));
+	memcpy(&hostlen, header + sizeof(int), sizeof(int));
+	if (hostlen < 0 || hostlen > NI_MAXHOST) {
+		report_error(r);
+		request_finish(r);
 		return;
 	}
-	if (read_data(s, &hostlen, sizeof(int)) != sizeof(int)) {
-		report_error(s);
+	if (buffer_length(&r->in) < sizeof(Action) + 2 * sizeof(int) + hostlen)
 		return;
+
+	host = malloc(hostlen + 1);
+	if (host == NULL)
+		system_error("memory allocation");
+	memcpy(host, header + 2 * sizeof(int), hostlen);
+	host[hostlen] = '\0';
+	buffer_free(&r->in);
+	upstream_open(r, host, port);
+	free(host);
+}
+
+static void process_close(struct request *r, Connection_Id id)
+{
+	struct upstream *u = get_connection(id);
+
+	buffer_free(&r->in);
+	if (u == NULL)
+		report_error(r);
+	else {
+		upstream_close(u);
+		report_ok(r, id);
 	}
-	{
-		char *host = malloc(hostlen + 1);
-		if (host == NULL)
-			system_error("memory allocation");
-		if (read_data(s, host, hostlen) != hostlen) {
-			free(host);
-			report_error(s);
-			return;
-		}
-		host[hostlen] = '\0';
-		id = do_open_connection(host, port);
-		free(host);
-	}
+	request_finish(r);
+}
 
-	if (id == NONE)
-		report_error(s);
-	else
-		report_ok(s, id);
+static void process_data(struct request *r, Connection_Id id)
+{
+	buffer_consume(&r->in, sizeof(Action) + sizeof(Connection_Id));
+	if (get_connection(id) == NULL) {
+		buffer_free(&r->in);
+		report_error(r);
+		request_finish(r);
+		return;
+	}
+	r->id = id;
+	r->state = R_DATA;
+	report_ok(r, id);
 }
 
-static void process_close(Stream s)
+/* Handles the request header once it has arrived completely */
+static void process_header(struct request *r)
 {
-	Connection_Id id = read_id(s);
-	if (id != NONE && do_close_connection(id) == OK)
-		report_ok(s, id);
+	const char *data = r->in.data + r->in.start;
+	size_t len = buffer_length(&r->in);
+	Action action;
+	Connection_Id id;
+
+	if (len < sizeof(Action))
+		return;
+	memcpy(&action, data, sizeof(Action));
+
+	if (action == A_OPEN) {
+		if (len >= sizeof(Action) + 2 * sizeof(int))
+			process_open(r, data + sizeof(Action));
+		return;
+	}
+	if (action != A_CLOSE && action != A_DATA) {
+		buffer_free(&r->in);
+		report_error(r);
+		request_finish(r);
+		return;
+	}
+
+	if (len < sizeof(Action) + sizeof(Connection_Id))
+		return;
+	memcpy(&id, data + sizeof(Action), sizeof(Connection_Id));
+	if (action == A_CLOSE)
+		process_close(r, id);
 	else
-		report_error(s);
+		process_data(r, id);
 }
 
-static void process_data(Stream s)
+/* The client has sent all its SSIP commands, pass them on */
+static void process_commands(struct request *r)
 {
-	Connection_Id id = read_id(s);
-	if (id != NONE)
-		report_ok(s, id);
-	else
-		report_error(s);
+	struct upstream *u = get_connection(r->id);
+	size_t len;
 
-	if (do_send_data(id, s, NONE, forward_data) == OK)
-		do_send_data(id, NONE, s, forward_ssip_answer);
+	if (u == NULL) {
+		buffer_free(&r->in);
+		request_finish(r);
+		return;
+	}
+
+	len = buffer_length(&r->in);
+	r->replies = count_ssip_replies(r->in.data + r->in.start, len);
+	buffer_append(&u->out, r->in.data + r->in.start, len);
+	/* Otherwise it would be taken with what comes next on the connection */
+	if (len > 0 && r->in.data[r->in.start + len - 1] != '\n')
+		buffer_append(&u->out, "\r\n", 2);
+	buffer_free(&r->in);
+
+	if (r->replies == 0)
+		r->state = R_CLOSING;
+	else {
+		r->state = R_REPLYING;
+		r->next = NULL;
+		if (u->queue == NULL)
+			u->queue = r;
+		else
+			u->queue_tail->next = r;
+		u->queue_tail = r;
+	}
+	upstream_output(u);
+	request_output(r);
 }
 
-static void process_request(Stream s)
+static void request_input(struct request *r)
 {
-	Action action;
+	while (r->state == R_HEADER || r->state == R_DATA) {
+		ssize_t n = buffer_fill(&r->in, r->e.fd);
 
-	if (read_data(s, &action, sizeof(Action)) == NONE)
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (r->state == R_HEADER)
+				process_header(r);
+			break;
+		}
+		if (n > 0) {
+			if (r->state == R_HEADER)
+				process_header(r);
+			continue;
+		}
+		if (n == 0 && r->state == R_DATA) {
+			process_commands(r);
+			return;
+		}
+		request_drop(r);
 		return;
+	}
+	if (!r->e.dead)
+		request_output(r);
+}
 
-	if (action == A_OPEN)
-		process_open(s);
-	else if (action == A_CLOSE)
-		process_close(s);
-	else if (action == A_DATA)
-		process_data(s);
-	else
-		report_error(s);
+static void request_new(Stream s)
+{
+	struct request *r = calloc(1, sizeof(struct request));
+	if (r == NULL)
+		system_error("memory allocation");
+	r->state = R_HEADER;
+	r->id = NONE;
+	set_nonblocking(s);
+	endpoint_add(&r->e, E_REQUEST, s, EPOLLIN);
+}
 
-	close(s);
+static void accept_requests(Stream sock)
+{
+	while (1) {
+		struct sockaddr_un client_address;
+		socklen_t client_address_len = sizeof(client_address);
+		Stream s = accept(sock, (struct sockaddr *)&client_address,
+				  &client_address_len);
+		if (s < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			return;
+		}
+		request_new(s);
+	}
 }
 
-#if USE_THREADS
-static void *process_request_thread(void *s)
+static void handle_event(struct endpoint *e, uint32_t events)
 {
-	Stream s_deref = *((Stream *) s);
-	free(s);
-	pthread_detach(pthread_self());
-	process_request(s_deref);
-	return NULL;
+	if (e->dead)
+		return;
+
+	if (e->type == E_LISTENER)
+		accept_requests(e->fd);
+
+	else if (e->type == E_REQUEST) {
+		struct request *r = (struct request *)e;
+		if (events & EPOLLERR)
+			request_drop(r);
+		else if (events & (EPOLLIN | EPOLLHUP)) {
+			if (r->state == R_HEADER || r->state == R_DATA)
+				request_input(r);
+			else
+				request_drop(r);
+		} else if (events & EPOLLOUT)
+			request_output(r);
+
+	} else {
+		struct upstream *u = (struct upstream *)e;
+		if (u->opener != NULL)
+			upstream_connected(u);
+		else if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			upstream_input(u);
+		if (!u->e.dead && (events & EPOLLOUT))
+			upstream_output(u);
+	}
 }
-#endif
 
 /* Starting the server */
 
@@ -345,9 +762,14 @@ static const char *server_socket_name()
 	return name;
 }
 
+#ifndef EPOLL_EVENTS
+#define EPOLL_EVENTS 64
+#endif
+
 static void serve()
 {
 	struct sockaddr_un name;
+	struct endpoint listener;
 	int sock;
 	size_t size;
 	const char *filename = server_socket_name();
@@ -365,30 +787,29 @@ static void serve()
 		system_error("bind");
 	if (listen(sock, LISTEN_QUEUE_LENGTH) < 0)
 		system_error("listen");
+	set_nonblocking(sock);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0)
+		system_error("epoll_create1");
+	memset(&listener, 0, sizeof(listener));
+	endpoint_add(&listener, E_LISTENER, sock, EPOLLIN);
 
 	while (1) {
-		struct sockaddr_un client_address;
-		socklen_t client_address_len = sizeof(client_address);
-		Stream *s = malloc(sizeof(Stream));
-		if (s == NULL)
-			system_error("memory allocation");
-		*s = accept(sock, (struct sockaddr *)&client_address,
-			    &client_address_len);
-		if (*s < 0) {
-			free(s);
+		struct epoll_event events[EPOLL_EVENTS];
+		int i, n;
+
+		n = epoll_wait(epoll_fd, events, EPOLL_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
 			break;
 		}
-		{
-#if USE_THREADS
-			pthread_t tid;
-			if (pthread_create(&tid, NULL, &process_request_thread, s))
-#endif
-			{
-				process_request(*s);
-				free(s);
-			}
-		}
+		for (i = 0; i < n; i++)
+			handle_event(events[i].data.ptr, events[i].events);
+		free_dead_endpoints();
 	}
+	close(epoll_fd);
 	close(sock);
 }
 
@@ -402,8 +823,10 @@ static void daemonize()
 	if (fork() != 0)
 		exit(0);
 	if ((ret = chdir("/")) != 0)
+	{
 		fputs("server.c:daemonize: could not chdir", stderr);
-	exit(1);
+		exit(1);
+	}
 	umask(0);
 	{
 		int i;
@@ -414,14 +837,9 @@ static void daemonize()
 
 static void init_connections()
 {
-	connections = malloc(CONNECTION_ID_MAX * sizeof(Connection_Id));
+	connections = calloc(CONNECTION_ID_MAX, sizeof(struct upstream *));
 	if (connections == NULL)
 		system_error("memory allocation");
-	{
-		int i;
-		for (i = CONNECTION_ID_MIN; i < CONNECTION_ID_MAX; i++)
-			connections[i] = NONE;
-	}
 }
 
 static void start_server()
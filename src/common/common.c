@@ -16,8 +16,28 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <sched.h>
 #include <signal.h>
 #include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include <glib.h>
+
+#ifdef HAVE_SD_BUS
+#include <systemd/sd-bus.h>
+#endif
 
 #include "common.h"
 
@@ -47,6 +67,312 @@ int spd_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
 	return ret;
 }
 
+/* Short-lived tasks, run by a pool of detached threads which stay around for
+ * a while once idle, so that the paths run for each message don't have to
+ * create one each time.  The threads are created with spd_pthread_create(),
+ * so they block all signals.  A task never waits for another one to finish
+ * its work: if no thread is idle, a new one is created. */
+
+/* s before an idle thread exits */
+#define SPD_TASK_IDLE_TIMEOUT 60
+
+typedef struct {
+	void *(*start_routine) (void *);
+	void *arg;
+} SPDTask;
+
+static pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t task_cond = PTHREAD_COND_INITIALIZER;
+static GQueue task_queue = G_QUEUE_INIT;
+static int task_idle;
+
+static void *spd_task_thread(void *data)
+{
+	SPDTask *task = data;
+	struct timespec deadline;
+
+	for (;;) {
+		task->start_routine(task->arg);
+		g_free(task);
+
+		pthread_mutex_lock(&task_mutex);
+		task_idle++;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += SPD_TASK_IDLE_TIMEOUT;
+		while (g_queue_is_empty(&task_queue))
+			if (pthread_cond_timedwait(&task_cond, &task_mutex,
+						   &deadline) != 0
+			    && g_queue_is_empty(&task_queue))
+				break;
+		task_idle--;
+		task = g_queue_pop_head(&task_queue);
+		pthread_mutex_unlock(&task_mutex);
+
+		if (task == NULL)
+			return NULL;
+	}
+}
+
+int spd_task_run(void *(*start_routine) (void *), void *arg)
+{
+	SPDTask *task = g_new(SPDTask, 1);
+	pthread_attr_t attr;
+	pthread_t thread;
+	int ret;
+
+	task->start_routine = start_routine;
+	task->arg = arg;
+
+	pthread_mutex_lock(&task_mutex);
+	if (task_idle > task_queue.length) {
+		g_queue_push_tail(&task_queue, task);
+		pthread_cond_signal(&task_cond);
+		pthread_mutex_unlock(&task_mutex);
+		return 0;
+	}
+	pthread_mutex_unlock(&task_mutex);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	ret = spd_pthread_create(&thread, &attr, spd_task_thread, task);
+	pthread_attr_destroy(&attr);
+	if (ret != 0)
+		g_free(task);
+
+	return ret;
+}
+
+#ifdef __linux__
+/* Parse a list of CPUs like "0,2-3" */
+static int spd_thread_parse_cpus(const char *cpus, cpu_set_t *set)
+{
+	const char *p = cpus;
+	char *end;
+	long first, last, i;
+
+	CPU_ZERO(set);
+	while (*p) {
+		first = strtol(p, &end, 10);
+		if (end == p || first < 0 || first >= CPU_SETSIZE)
+			return -1;
+		last = first;
+		p = end;
+		if (*p == '-') {
+			last = strtol(p + 1, &end, 10);
+			if (end == p + 1 || last < first || last >= CPU_SETSIZE)
+				return -1;
+			p = end;
+		}
+		for (i = first; i <= last; i++)
+			CPU_SET(i, set);
+		if (*p == ',')
+			p++;
+		else if (*p)
+			return -1;
+	}
+	return CPU_COUNT(set) ? 0 : -1;
+}
+#endif
+
+#ifdef HAVE_SD_BUS
+/* Ask rtkit, which gives real-time and high priorities to the threads of
+ * desktop users who can't get them themselves */
+static int spd_thread_rtkit(const char *method, const char *types,
+			    uint64_t tid, int value)
+{
+	sd_bus *bus = NULL;
+	sd_bus_error error = SD_BUS_ERROR_NULL;
+	int ret;
+
+	ret = sd_bus_open_system(&bus);
+	if (ret >= 0)
+		ret = sd_bus_call_method(bus, "org.freedesktop.RealtimeKit1",
+					 "/org/freedesktop/RealtimeKit1",
+					 "org.freedesktop.RealtimeKit1", method,
+					 &error, NULL, types, tid, value);
+	if (ret < 0)
+		MSG(3, "rtkit refused %s: %s", method,
+		    error.message ? error.message : strerror(-ret));
+	sd_bus_error_free(&error);
+	sd_bus_unref(bus);
+
+	return ret < 0 ? -1 : 0;
+}
+#endif
+
+int spd_thread_schedule(const SPDThreadSchedule *sched)
+{
+	int ret = 0;
+#ifdef __linux__
+	pid_t tid = syscall(SYS_gettid);
+	cpu_set_t set;
+	int err;
+
+	if (sched->cpus) {
+		if (spd_thread_parse_cpus(sched->cpus, &set) != 0) {
+			MSG(2, "Invalid list of CPUs %s", sched->cpus);
+			ret = -1;
+		} else if (pthread_setaffinity_np(pthread_self(), sizeof(set),
+						  &set) != 0) {
+			MSG(2, "Can't run on CPUs %s", sched->cpus);
+			ret = -1;
+		}
+	}
+
+	if (sched->realtime_priority > 0) {
+		struct sched_param param = {
+			.sched_priority = sched->realtime_priority,
+		};
+		struct rlimit rl;
+
+		err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+		if (err == 0)
+			return ret;
+#ifdef HAVE_SD_BUS
+		/* rtkit wants a bound on the CPU time we may use without
+		 * sleeping, past which the kernel kills us */
+		if (getrlimit(RLIMIT_RTTIME, &rl) == 0
+		    && rl.rlim_max == RLIM_INFINITY) {
+			rl.rlim_cur = rl.rlim_max = 200000;
+			setrlimit(RLIMIT_RTTIME, &rl);
+		}
+		if (spd_thread_rtkit("MakeThreadRealtime", "tu", tid,
+				     sched->realtime_priority) == 0)
+			return ret;
+#else
+		(void)rl;
+#endif
+		MSG(2, "Can't get the real-time priority %d: %s",
+		    sched->realtime_priority, strerror(err));
+		ret = -1;
+	} else {
+		/* Back from a previous real-time priority */
+		struct sched_param param = { .sched_priority = 0 };
+
+		pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+	}
+
+	if (sched->nice != 0) {
+		if (setpriority(PRIO_PROCESS, tid, sched->nice) == 0)
+			return ret;
+		err = errno;
+#ifdef HAVE_SD_BUS
+		if (spd_thread_rtkit("MakeThreadHighPriority", "ti", tid,
+				     sched->nice) == 0)
+			return ret;
+#endif
+		MSG(2, "Can't get the nice level %d: %s", sched->nice,
+		    strerror(err));
+		ret = -1;
+	}
+#else
+	if (sched->cpus || sched->realtime_priority > 0 || sched->nice != 0) {
+		MSG(2, "Thread scheduling is only supported on Linux");
+		ret = -1;
+	}
+#endif
+
+	return ret;
+}
+
+/* A count above 0 is what can be taken without waiting, below 0 minus the
+ * number of waiters, which the posters hand wakeups to.  Only the waits
+ * and the posts which have to wake a waiter take the mutex. */
+void spd_semaphore_init(SPDSemaphore *sem, int value)
+{
+	sem->count = value;
+	sem->wakeups = 0;
+	pthread_mutex_init(&sem->mutex, NULL);
+	pthread_cond_init(&sem->cond, NULL);
+}
+
+void spd_semaphore_destroy(SPDSemaphore *sem)
+{
+	pthread_mutex_destroy(&sem->mutex);
+	pthread_cond_destroy(&sem->cond);
+}
+
+void spd_semaphore_post(SPDSemaphore *sem)
+{
+	if (g_atomic_int_add(&sem->count, 1) >= 0)
+		return;
+
+	pthread_mutex_lock(&sem->mutex);
+	sem->wakeups++;
+	pthread_cond_signal(&sem->cond);
+	pthread_mutex_unlock(&sem->mutex);
+}
+
+static void spd_semaphore_unlock(void *data)
+{
+	pthread_mutex_unlock(data);
+}
+
+void spd_semaphore_wait(SPDSemaphore *sem)
+{
+	if (g_atomic_int_add(&sem->count, -1) > 0)
+		return;
+
+	pthread_mutex_lock(&sem->mutex);
+	/* The speaking threads of the modules get cancelled while waiting */
+	pthread_cleanup_push(spd_semaphore_unlock, &sem->mutex);
+	while (sem->wakeups == 0)
+		pthread_cond_wait(&sem->cond, &sem->mutex);
+	sem->wakeups--;
+	pthread_cleanup_pop(1);
+}
+
+int spd_semaphore_trywait(SPDSemaphore *sem)
+{
+	int count;
+
+	do {
+		count = g_atomic_int_get(&sem->count);
+		if (count <= 0)
+			return -1;
+	} while (!g_atomic_int_compare_and_exchange(&sem->count, count,
+						    count - 1));
+
+	return 0;
+}
+
+/* How the threads playing audio are to be scheduled */
+static pthread_mutex_t playback_schedule_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int playback_realtime_priority;
+static char *playback_cpus;
+static unsigned playback_generation;
+
+void spd_playback_schedule_set(int realtime_priority, const char *cpus)
+{
+	pthread_mutex_lock(&playback_schedule_mutex);
+	playback_realtime_priority = realtime_priority;
+	g_free(playback_cpus);
+	playback_cpus = g_strdup(cpus);
+	playback_generation++;
+	pthread_mutex_unlock(&playback_schedule_mutex);
+}
+
+void spd_playback_schedule_apply(unsigned *generation)
+{
+	SPDThreadSchedule sched = { 0 };
+	char *cpus;
+
+	pthread_mutex_lock(&playback_schedule_mutex);
+	if (*generation == playback_generation) {
+		pthread_mutex_unlock(&playback_schedule_mutex);
+		return;
+	}
+	*generation = playback_generation;
+	sched.realtime_priority = playback_realtime_priority;
+	sched.cpus = cpus = g_strdup(playback_cpus);
+	pthread_mutex_unlock(&playback_schedule_mutex);
+
+	if (spd_thread_schedule(&sched) == 0 && sched.realtime_priority)
+		MSG(4, "Playing audio with the real-time priority %d",
+		    sched.realtime_priority);
+	g_free(cpus);
+}
+
 void set_speaking_thread_parameters(void)
 {
 	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
@@ -33,6 +33,44 @@ void MSG2(int level, const char *kind, const char *format, ...) __attribute__((f
 int spd_pthread_create(pthread_t *thread, const pthread_attr_t *attr,
                           void *(*start_routine) (void *), void *arg);
 
+/* Run start_routine(arg) in a thread of a pool, as a detached thread would,
+ * returns 0 on success or the error of pthread_create */
+int spd_task_run(void *(*start_routine) (void *), void *arg);
+
+/* A counting semaphore between the threads of a process, which does not
+ * enter the kernel when it does not have to wait or wake a thread.  Unlike
+ * sem_init(), it also works on Mac OS X. */
+typedef struct {
+	int count;
+	int wakeups;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+} SPDSemaphore;
+
+void spd_semaphore_init(SPDSemaphore *sem, int value);
+void spd_semaphore_destroy(SPDSemaphore *sem);
+void spd_semaphore_post(SPDSemaphore *sem);
+void spd_semaphore_wait(SPDSemaphore *sem);
+/* Returns 0 if it could be taken without waiting, -1 otherwise */
+int spd_semaphore_trywait(SPDSemaphore *sem);
+
+/* How a thread playing or synthesizing audio gets scheduled */
+typedef struct {
+	int realtime_priority;	/* SCHED_FIFO priority, 0 not to */
+	int nice;		/* otherwise, 0 to keep it */
+	const char *cpus;	/* to run on, like "0,2-3", NULL for any */
+} SPDThreadSchedule;
+
+/* Apply sched to the calling thread, asking rtkit for what we can't get
+ * ourselves, returns -1 if some of it could not be applied */
+int spd_thread_schedule(const SPDThreadSchedule *sched);
+
+/* Set how the threads playing audio are to be scheduled, which they apply
+ * with spd_playback_schedule_apply() before each message, generation
+ * starting at 0 */
+void spd_playback_schedule_set(int realtime_priority, const char *cpus);
+void spd_playback_schedule_apply(unsigned *generation);
+
 void set_speaking_thread_parameters(void);
 
 /* This should be called when reaching a mark */
@@ -34,6 +34,7 @@
 #endif
 
 #include "spd_audio.h"
+#include "spd_audio_convert.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -43,6 +44,7 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <math.h>
 
 #include <pthread.h>
 
@@ -54,11 +56,21 @@
 #endif
 
 static int spd_audio_log_level;
-#ifdef USE_DLOPEN
-static void *dlhandle;
-#else
-static lt_dlhandle lt_h;
 
+typedef struct {
+	spd_audio_plugin_t const *functions;
+	int abi;		/* SPD_AUDIO_PLUGIN_ABI, 0 for older plugins */
+} SPDAudioPlugin;
+
+static void spd_audio_device_add(AudioID * id, int abi);
+
+/* Plugins are loaded once and kept, so that opening audio again, or from
+   several threads, does not go through the dynamic loader.  This maps
+   plugin names to their SPDAudioPlugin.  */
+static pthread_mutex_t spd_audio_plugins_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *spd_audio_plugins;
+
+#ifndef USE_DLOPEN
 /* Dynamically load a library with RTLD_GLOBAL set.
 
    This is needed when a dynamically-loaded library has its own plugins
@@ -81,37 +93,35 @@ static lt_dlhandle my_dlopenextglobal(const char *filename)
 }
 #endif
 
-/* Open the audio device.
-
-   Arguments:
-   type -- The requested device. Currently AudioOSS or AudioNAS.
-   pars -- and array of pointers to parameters to pass to
-           the device backend, terminated by a NULL pointer.
-           See the source/documentation of each specific backend.
-   error -- a pointer to the string where error description is
-           stored in case of failure (returned AudioID == NULL).
-           Otherwise will contain NULL.
-
-   Return value:
-   Newly allocated AudioID structure that can be passed to
-   all other spd_audio functions, or NULL in case of failure.
-
-*/
-AudioID *spd_audio_open(const char *name, void **pars, char **error)
+/* Load the plugin NAME, or get it from the cache.  Called with
+   spd_audio_plugins_mutex held.  */
+static SPDAudioPlugin const *spd_audio_load(const char *name, char **error)
 {
-	AudioID *id;
-	spd_audio_plugin_t const *p;
+	SPDAudioPlugin *p;
 	spd_audio_plugin_t *(*fn) (void);
+	int (*abi_fn) (void);
 	gchar *libname;
 	char *plugin_dir;
-#ifndef USE_DLOPEN
+#ifdef USE_DLOPEN
+	void *dlhandle;
+#else
+	lt_dlhandle lt_h;
 	int ret;
+#endif
 
+	if (!spd_audio_plugins)
+		spd_audio_plugins = g_hash_table_new_full(g_str_hash, g_str_equal,
+							  g_free, g_free);
+	p = g_hash_table_lookup(spd_audio_plugins, name);
+	if (p)
+		return p;
+
+#ifndef USE_DLOPEN
 	/* now check whether dynamic plugin is available */
 	ret = lt_dlinit();
 	if (ret != 0) {
 		*error = (char *)g_strdup_printf("lt_dlinit() failed");
-		return (AudioID *) NULL;
+		return NULL;
 	}
 #endif
 
@@ -128,15 +138,17 @@ AudioID *spd_audio_open(const char *name, void **pars, char **error)
 		*error =
 			(char *)g_strdup_printf("Cannot open plugin %s. error: %s",
 						name, dlerror());
-		return (AudioID *) NULL;
+		return NULL;
 	}
 
 	fn = dlsym(dlhandle, SPD_AUDIO_PLUGIN_ENTRY_STR);
+	abi_fn = dlsym(dlhandle, SPD_AUDIO_PLUGIN_ABI_STR);
 #else
 	ret = lt_dlsetsearchpath(plugin_dir);
 	if (ret != 0) {
 		*error = (char *)g_strdup_printf("lt_dlsetsearchpath() failed");
-		return (AudioID *) NULL;
+		lt_dlexit();
+		return NULL;
 	}
 
 	libname = g_strdup_printf(SPD_AUDIO_LIB_PREFIX "%s", name);
@@ -146,42 +158,452 @@ AudioID *spd_audio_open(const char *name, void **pars, char **error)
 		*error =
 		    (char *)g_strdup_printf("Cannot open plugin %s. error: %s",
 					    name, lt_dlerror());
-		return (AudioID *) NULL;
+		lt_dlexit();
+		return NULL;
 	}
 
 	fn = lt_dlsym(lt_h, SPD_AUDIO_PLUGIN_ENTRY_STR);
+	abi_fn = lt_dlsym(lt_h, SPD_AUDIO_PLUGIN_ABI_STR);
 #endif
 	if (NULL == fn) {
 		*error = (char *)g_strdup_printf("Cannot find symbol %s",
 						 SPD_AUDIO_PLUGIN_ENTRY_STR);
-		return (AudioID *) NULL;
+		goto unload;
 	}
 
-	p = fn();
-	if (p == NULL || p->name == NULL) {
+	p = g_new(SPDAudioPlugin, 1);
+	p->functions = fn();
+	if (p->functions == NULL || p->functions->name == NULL) {
 		*error = (char *)g_strdup_printf("plugin %s not found", name);
-		return (AudioID *) NULL;
+		g_free(p);
+		goto unload;
 	}
+	/* A newer plugin has all the entries we know of */
+	p->abi = abi_fn ? MIN(abi_fn(), SPD_AUDIO_PLUGIN_ABI) : 0;
+
+	g_hash_table_insert(spd_audio_plugins, g_strdup(name), (gpointer) p);
+	return p;
+
+unload:
+#ifdef USE_DLOPEN
+	dlclose(dlhandle);
+#else
+	lt_dlclose(lt_h);
+	lt_dlexit();
+#endif
+	return NULL;
+}
+
+/* Open the audio device.
+
+   Arguments:
+   type -- The requested device. Currently AudioOSS or AudioNAS.
+   pars -- and array of pointers to parameters to pass to
+           the device backend, terminated by a NULL pointer.
+           See the source/documentation of each specific backend.
+   error -- a pointer to the string where error description is
+           stored in case of failure (returned AudioID == NULL).
+           Otherwise will contain NULL.
 
-	id = p->open(pars);
+   Return value:
+   Newly allocated AudioID structure that can be passed to
+   all other spd_audio functions, or NULL in case of failure.
+
+*/
+AudioID *spd_audio_open(const char *name, void **pars, char **error)
+{
+	AudioID *id;
+	SPDAudioPlugin const *p;
+
+	pthread_mutex_lock(&spd_audio_plugins_mutex);
+	p = spd_audio_load(name, error);
+	pthread_mutex_unlock(&spd_audio_plugins_mutex);
+	if (!p)
+		return (AudioID *) NULL;
+
+	id = p->functions->open(pars);
 	if (id == NULL) {
 		*error =
 		    (char *)g_strdup_printf("Couldn't open %s plugin", name);
 		return (AudioID *) NULL;
 	}
 
-	id->function = p;
+	id->function = p->functions;
 #if defined(BYTE_ORDER) && (BYTE_ORDER == BIG_ENDIAN)
 	id->format = SPD_AUDIO_BE;
 #else
 	id->format = SPD_AUDIO_LE;
 #endif
+	spd_audio_device_add(id, p->abi);
 
 	*error = NULL;
 
 	return id;
 }
 
+/* Resampling to a fixed device rate, see spd_audio_set_rate().
+
+   This is a polyphase windowed sinc filter: the input is conceptually
+   upsampled by UP, low-pass filtered and downsampled by DOWN, where
+   UP/DOWN is the rate ratio in lowest terms.  Only the UP phases of the
+   filter that can actually be hit are stored, each of SPD_RESAMPLE_TAPS
+   16bit coefficients, so every output sample is one dot product over the
+   last SPD_RESAMPLE_TAPS input samples.  The input is kept planar so that
+   this is over contiguous memory.  */
+
+#define SPD_RESAMPLE_TAPS 32		/* multiple of 8 for spd_audio_dot_s16 */
+#define SPD_RESAMPLE_MAX_UP 4096	/* 256KB of coefficients */
+#define SPD_RESAMPLE_MAX_CHANNELS 2
+
+typedef struct {
+	int rate;		/* rate of the device, 0 not to resample */
+	gboolean active;	/* resampling the current track */
+
+	int in_rate;		/* what the filter is built for */
+	int channels;
+	int up, down;
+	int16_t *coefs;		/* up phases of SPD_RESAMPLE_TAPS */
+
+	int16_t *planes[SPD_RESAMPLE_MAX_CHANNELS];
+	int n_planes;		/* allocated, all of cap frames */
+	size_t len;		/* frames in the planes */
+	size_t cap;
+	size_t pos;		/* last frame of the window of the next output */
+	int phase;		/* phase of the next output */
+
+	int16_t *out;
+	size_t out_cap;		/* in samples */
+} SPDResampler;
+
+static void spd_audio_resampler_free(SPDResampler * r)
+{
+	int c;
+
+	if (!r)
+		return;
+	for (c = 0; c < SPD_RESAMPLE_MAX_CHANNELS; c++)
+		g_free(r->planes[c]);
+	g_free(r->coefs);
+	g_free(r->out);
+	g_free(r);
+}
+
+static int spd_audio_gcd(int a, int b)
+{
+	while (b) {
+		int t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Makes room for cap frames in the planes of the given channels */
+static void spd_audio_resampler_reserve(SPDResampler * r, size_t cap,
+					int channels)
+{
+	int c;
+
+	if (cap > r->cap) {
+		for (c = 0; c < r->n_planes; c++)
+			r->planes[c] = g_realloc(r->planes[c],
+						 sizeof(int16_t) * cap);
+		r->cap = cap;
+	}
+	/* A track may have more channels than the previous ones */
+	for (c = r->n_planes; c < channels; c++)
+		r->planes[c] = g_malloc(sizeof(int16_t) * r->cap);
+	r->n_planes = MAX(r->n_planes, channels);
+}
+
+/* Builds the filter for the given input, returns -1 if it can not */
+static int spd_audio_resampler_setup(SPDResampler * r, int in_rate,
+				     int channels)
+{
+	int g, up, down, p, t;
+	double fc;
+
+	if (in_rate <= 0 || channels < 1 || channels > SPD_RESAMPLE_MAX_CHANNELS)
+		return -1;
+
+	if (in_rate != r->in_rate) {
+		g = spd_audio_gcd(in_rate, r->rate);
+		up = r->rate / g;
+		down = in_rate / g;
+		if (up > SPD_RESAMPLE_MAX_UP) {
+			fprintf(stderr, "Can not resample from %d to %d Hz\n",
+				in_rate, r->rate);
+			return -1;
+		}
+
+		/* Cut below the lowest Nyquist frequency, relatively to the
+		   upsampled rate, leaving some room for the transition.  */
+		fc = 0.45 * MIN(1.0, (double)up / down) / up;
+
+		g_free(r->coefs);
+		r->coefs = g_malloc(sizeof(*r->coefs) * up * SPD_RESAMPLE_TAPS);
+		for (p = 0; p < up; p++) {
+			double h[SPD_RESAMPLE_TAPS], sum = 0;
+			int16_t *coefs = r->coefs + p * SPD_RESAMPLE_TAPS;
+
+			for (t = 0; t < SPD_RESAMPLE_TAPS; t++) {
+				/* Input t of the window is SPD_RESAMPLE_TAPS-1-t
+				   input samples before the output */
+				int m = p + (SPD_RESAMPLE_TAPS - 1 - t) * up;
+				double n = SPD_RESAMPLE_TAPS * up - 1;
+				double x = m - n / 2;
+				double sinc = x == 0 ? 1 :
+				    sin(2 * M_PI * fc * x) / (2 * M_PI * fc * x);
+				double blackman = 0.42
+				    - 0.5 * cos(2 * M_PI * m / n)
+				    + 0.08 * cos(4 * M_PI * m / n);
+
+				h[t] = sinc * blackman;
+				sum += h[t];
+			}
+			/* Unity gain for every phase */
+			for (t = 0; t < SPD_RESAMPLE_TAPS; t++) {
+				long v = lround(h[t] / sum * 32768);
+				coefs[t] = CLAMP(v, INT16_MIN, INT16_MAX);
+			}
+		}
+		r->in_rate = in_rate;
+		r->up = up;
+		r->down = down;
+	}
+
+	r->channels = channels;
+	/* Start with a window of silence */
+	r->len = SPD_RESAMPLE_TAPS - 1;
+	spd_audio_resampler_reserve(r, r->len, channels);
+	for (t = 0; t < channels; t++)
+		memset(r->planes[t], 0, sizeof(int16_t) * r->len);
+	r->pos = r->len;
+	r->phase = 0;
+	return 0;
+}
+
+/* Resamples the samples of the track, or silence if they are NULL.  The
+   returned track points into the resampler.  This gets inlined with a
+   constant number of channels, so that the loops over them unroll.  */
+static inline __attribute__ ((always_inline)) AudioTrack
+spd_audio_resample_channels(SPDResampler * r, AudioTrack track,
+			    const int channels)
+{
+	AudioTrack out = track;
+	size_t frames = track.num_samples, n = 0, drop, f;
+	int c;
+
+	if (r->len + frames > r->cap)
+		spd_audio_resampler_reserve(r, MAX(r->len + frames, r->cap * 2),
+					    channels);
+	if (track.samples && channels == 2) {
+		/* Split both planes in one pass */
+		int16_t *left = r->planes[0] + r->len;
+		int16_t *right = r->planes[1] + r->len;
+
+		for (f = 0; f < frames; f++) {
+			left[f] = track.samples[2 * f];
+			right[f] = track.samples[2 * f + 1];
+		}
+	} else
+		for (c = 0; c < channels; c++) {
+			int16_t *plane = r->planes[c] + r->len;
+
+			if (!track.samples)
+				memset(plane, 0, sizeof(int16_t) * frames);
+			else if (channels == 1)
+				memcpy(plane, track.samples,
+				       sizeof(int16_t) * frames);
+			else
+				for (f = 0; f < frames; f++)
+					plane[f] =
+					    track.samples[f * channels + c];
+		}
+	r->len += frames;
+
+	f = (frames + SPD_RESAMPLE_TAPS) * r->up / r->down + 2;
+	if (f * channels > r->out_cap) {
+		r->out_cap = f * channels;
+		r->out = g_realloc(r->out, sizeof(int16_t) * r->out_cap);
+	}
+
+	while (r->pos < r->len) {
+		const int16_t *coefs = r->coefs + r->phase * SPD_RESAMPLE_TAPS;
+
+		for (c = 0; c < channels; c++) {
+			const int16_t *window = r->planes[c] + r->pos
+			    - (SPD_RESAMPLE_TAPS - 1);
+			int32_t v = (spd_audio_dot_s16(window, coefs,
+						       SPD_RESAMPLE_TAPS)
+				     + (1 << 14)) >> 15;
+
+			r->out[n * channels + c] = CLAMP(v, INT16_MIN,
+							    INT16_MAX);
+		}
+		n++;
+		r->phase += r->down;
+		r->pos += r->phase / r->up;
+		r->phase %= r->up;
+	}
+
+	/* Keep what the next windows need */
+	drop = MIN(r->pos - (SPD_RESAMPLE_TAPS - 1), r->len);
+	for (c = 0; c < channels; c++)
+		memmove(r->planes[c], r->planes[c] + drop,
+			sizeof(int16_t) * (r->len - drop));
+	r->len -= drop;
+	r->pos -= drop;
+
+	out.sample_rate = r->rate;
+	out.num_samples = n;
+	out.samples = r->out;
+	return out;
+}
+
+static AudioTrack spd_audio_resample_mono(SPDResampler * r, AudioTrack track)
+{
+	return spd_audio_resample_channels(r, track, 1);
+}
+
+static AudioTrack spd_audio_resample_stereo(SPDResampler * r, AudioTrack track)
+{
+	return spd_audio_resample_channels(r, track, 2);
+}
+
+/* How tracks of the format given to spd_audio_begin() get fed.  All that
+   depends on the format is chosen there, once, so that feeding a chunk only
+   runs the chosen kernels and calls the chosen plugin function.  */
+struct spd_audio_path {
+	AudioFormat format;	/* the byte order convert is for */
+	void (*convert) (AudioTrack * track);	/* NULL if none is needed */
+	SPDResampler *resampler;	/* NULL if not resampling */
+	AudioTrack (*resample) (SPDResampler * r, AudioTrack track);
+	int (*feed_sync) (AudioID * id, AudioTrack track);
+	int (*feed_sync_overlap) (AudioID * id, AudioTrack track);
+	int (*feed_async) (AudioID * id, AudioTrack track);
+};
+
+/* What we keep about an open device.  It is not in the AudioID, which the
+   plugins allocate with the size of the header they were built with.  */
+typedef struct {
+	int abi;		/* of its plugin, see SPD_AUDIO_PLUGIN_ABI */
+	SPDResampler *resampler;	/* see spd_audio_set_rate() */
+	struct spd_audio_path path;
+} SPDAudioDevice;
+
+static pthread_mutex_t spd_audio_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *spd_audio_devices;	/* AudioID * -> SPDAudioDevice * */
+
+static SPDAudioDevice *spd_audio_device(AudioID * id)
+{
+	SPDAudioDevice *dev = NULL;
+
+	pthread_mutex_lock(&spd_audio_devices_mutex);
+	if (spd_audio_devices)
+		dev = g_hash_table_lookup(spd_audio_devices, id);
+	pthread_mutex_unlock(&spd_audio_devices_mutex);
+	return dev;
+}
+
+static void spd_audio_device_free(gpointer data)
+{
+	SPDAudioDevice *dev = data;
+
+	spd_audio_resampler_free(dev->resampler);
+	g_free(dev);
+}
+
+static void spd_audio_convert_swap16(AudioTrack * track)
+{
+	spd_audio_swap16(track->samples,
+			 (size_t) track->num_samples * track->num_channels);
+}
+
+/* Whether the plugin of the device has the entries of this ABI */
+static inline gboolean spd_audio_device_has(SPDAudioDevice * dev, int abi)
+{
+	return dev && dev->abi >= abi;
+}
+
+static gboolean spd_audio_device_can_feed_async(AudioID * id,
+						SPDAudioDevice * dev)
+{
+	return spd_audio_device_has(dev, 1)
+	    && id->function->feed_async && id->function->get_delay;
+}
+
+/* Chooses how to feed tracks like this one, given in this byte order */
+static void spd_audio_path_setup(AudioID * id, SPDAudioDevice * dev,
+				 AudioTrack track, AudioFormat format,
+				 SPDResampler * r)
+{
+	struct spd_audio_path *p = &dev->path;
+	spd_audio_plugin_t const *f = id->function;
+
+	p->format = format;
+	p->convert = format != id->format && track.bits == 16
+	    ? spd_audio_convert_swap16 : NULL;
+
+	p->resampler = r;
+	p->resample = r && r->channels == 1
+	    ? spd_audio_resample_mono : spd_audio_resample_stereo;
+
+	p->feed_sync = f->feed_sync ? f->feed_sync : f->play;
+	p->feed_sync_overlap = f->feed_sync_overlap
+	    ? f->feed_sync_overlap : p->feed_sync;
+	p->feed_async = spd_audio_device_can_feed_async(id, dev)
+	    ? f->feed_async : p->feed_sync_overlap;
+}
+
+static void spd_audio_device_add(AudioID * id, int abi)
+{
+	AudioTrack native = {.bits = 16 };
+	SPDAudioDevice *dev = g_new0(SPDAudioDevice, 1);
+
+	dev->abi = abi;
+	spd_audio_path_setup(id, dev, native, id->format, NULL);
+
+	pthread_mutex_lock(&spd_audio_devices_mutex);
+	if (!spd_audio_devices)
+		spd_audio_devices =
+		    g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+					  spd_audio_device_free);
+	g_hash_table_replace(spd_audio_devices, id, dev);
+	pthread_mutex_unlock(&spd_audio_devices_mutex);
+}
+
+/* Make the device get all tracks at the given rate, whatever their own
+   rate, so that it does not have to be reconfigured between e.g. voices
+   of different rates.  0 plays tracks at their own rate again.  Only
+   16bit mono and stereo tracks are resampled.
+
+   Arguments:
+   id -- the AudioID* of the device returned by spd_audio_open
+   rate -- the rate in Hz
+
+   Return value:
+   0 if everything is ok, -1 otherwise.
+*/
+int spd_audio_set_rate(AudioID * id, int rate)
+{
+	SPDAudioDevice *dev = id ? spd_audio_device(id) : NULL;
+
+	if (dev == NULL || rate < 0) {
+		fprintf(stderr, "Invalid rate for spd_audio_set_rate\n");
+		return -1;
+	}
+
+	dev->path.resampler = NULL;
+	spd_audio_resampler_free(dev->resampler);
+	dev->resampler = NULL;
+	if (rate) {
+		dev->resampler = g_new0(SPDResampler, 1);
+		dev->resampler->rate = rate;
+	}
+	return 0;
+}
+
 /* Initialize for playing a track on the audio device.
 
    Arguments:
@@ -195,11 +617,24 @@ AudioID *spd_audio_open(const char *name, void **pars, char **error)
 */
 int spd_audio_begin(AudioID * id, AudioTrack track, AudioFormat format)
 {
-	if (!id) {
+	SPDAudioDevice *dev = id ? spd_audio_device(id) : NULL;
+	SPDResampler *r;
+
+	if (!dev) {
 		fprintf(stderr, "No audio open\n");
 		return -1;
 	}
 
+	r = dev->resampler;
+	if (r) {
+		r->active = track.bits == 16 && track.sample_rate != r->rate
+		    && !spd_audio_resampler_setup(r, track.sample_rate,
+						  track.num_channels);
+		if (r->active)
+			track.sample_rate = r->rate;
+	}
+	spd_audio_path_setup(id, dev, track, format, r && r->active ? r : NULL);
+
 	if (!id->function->begin) {
 		/* Too bad */
 		return 0;
@@ -213,19 +648,30 @@ static void spd_audio_convert(AudioID * id, AudioTrack track, AudioFormat format
 {
 	/* Only perform byte swapping if the driver in use has given us audio in
 	   an endian format other than what the running CPU supports. */
-	if (format != id->format && track.bits == 16) {
-		unsigned char *out_ptr, *out_end, c;
-		out_ptr = (unsigned char *)track.samples;
-		out_end =
-		    out_ptr +
-		    track.num_samples * 2 * track.num_channels;
-		while (out_ptr < out_end) {
-			c = out_ptr[0];
-			out_ptr[0] = out_ptr[1];
-			out_ptr[1] = c;
-			out_ptr += 2;
-		}
+	if (format != id->format && track.bits == 16)
+		spd_audio_swap16(track.samples,
+				 (size_t) track.num_samples * track.num_channels);
+}
+
+/* Converts and resamples the track the way spd_audio_begin() chose,
+   returns FALSE if nothing is left to feed yet */
+static inline gboolean spd_audio_path_prepare(AudioID * id,
+					      struct spd_audio_path *p,
+					      AudioTrack * track,
+					      AudioFormat format)
+{
+	if (G_UNLIKELY(format != p->format))
+		/* Not the byte order given to spd_audio_begin() */
+		spd_audio_convert(id, *track, format);
+	else if (p->convert)
+		p->convert(track);
+
+	if (p->resampler) {
+		*track = p->resample(p->resampler, *track);
+		if (!track->num_samples)
+			return FALSE;
 	}
+	return TRUE;
 }
 
 /* Feed a track to the audio device (blocking).
@@ -252,23 +698,22 @@ static void spd_audio_convert(AudioID * id, AudioTrack track, AudioFormat format
 */
 int spd_audio_feed_sync(AudioID * id, AudioTrack track, AudioFormat format)
 {
-	if (!id) {
+	SPDAudioDevice *dev = id ? spd_audio_device(id) : NULL;
+
+	if (!dev) {
 		fprintf(stderr, "No audio open\n");
 		return -1;
 	}
 
-	spd_audio_convert(id, track, format);
-
-	if (id->function->feed_sync) {
-		return id->function->feed_sync(id, track);
+	if (!dev->path.feed_sync) {
+		fprintf(stderr,"Play not supported on this device\n");
+		return -1;
 	}
 
-	if (id->function->play) {
-		return id->function->play(id, track);
-	}
+	if (!spd_audio_path_prepare(id, &dev->path, &track, format))
+		return 0;
 
-	fprintf(stderr,"Play not supported on this device\n");
-	return -1;
+	return dev->path.feed_sync(id, track);
 }
 
 /* Feed a track to the audio device (blocking, with overlapping).
@@ -295,27 +740,104 @@ int spd_audio_feed_sync(AudioID * id, AudioTrack track, AudioFormat format)
 */
 int spd_audio_feed_sync_overlap(AudioID * id, AudioTrack track, AudioFormat format)
 {
-	if (!id) {
+	SPDAudioDevice *dev = id ? spd_audio_device(id) : NULL;
+
+	if (!dev) {
 		fprintf(stderr, "No audio open\n");
 		return -1;
 	}
 
-	spd_audio_convert(id, track, format);
-
-	if (id->function->feed_sync_overlap) {
-		return id->function->feed_sync_overlap(id, track);
+	if (!dev->path.feed_sync_overlap) {
+		fprintf(stderr,"Play not supported on this device\n");
+		return -1;
 	}
 
-	if (id->function->feed_sync) {
-		return id->function->feed_sync(id, track);
+	if (!spd_audio_path_prepare(id, &dev->path, &track, format))
+		return 0;
+
+	return dev->path.feed_sync_overlap(id, track);
+}
+
+/* Feed a track to the audio device (non-blocking).
+
+   Like spd_audio_feed_sync_overlap(), but returns as soon as the track is
+   queued in the audio buffers; it only blocks while they are full.  The
+   caller paces itself with spd_audio_get_delay().  Devices which can not
+   do this get the track through spd_audio_feed_sync_overlap(), see
+   spd_audio_can_feed_async().
+
+   Arguments:
+   id -- the AudioID* of the device returned by spd_audio_open
+   track -- a track to play (see spd_audio.h)
+
+   Return value:
+   0 if everything is ok, a non-zero value in case of failure.
+*/
+int spd_audio_feed_async(AudioID * id, AudioTrack track, AudioFormat format)
+{
+	SPDAudioDevice *dev = id ? spd_audio_device(id) : NULL;
+
+	if (!dev) {
+		fprintf(stderr, "No audio open\n");
+		return -1;
 	}
 
-	if (id->function->play) {
-		return id->function->play(id, track);
+	if (!dev->path.feed_async) {
+		fprintf(stderr,"Play not supported on this device\n");
+		return -1;
 	}
 
-	fprintf(stderr,"Play not supported on this device\n");
-	return -1;
+	if (!spd_audio_path_prepare(id, &dev->path, &track, format))
+		return 0;
+
+	return dev->path.feed_async(id, track);
+}
+
+/* Whether the device implements spd_audio_feed_async() and
+   spd_audio_get_delay() */
+int spd_audio_can_feed_async(AudioID * id)
+{
+	return id && spd_audio_device_can_feed_async(id, spd_audio_device(id));
+}
+
+/* Get how long the audio already fed to the device will still play.
+
+   Arguments:
+   id -- the AudioID* of the device returned by spd_audio_open
+
+   Return value:
+   The delay in microseconds, or -1 if the device can not tell.
+*/
+int spd_audio_get_delay(AudioID * id)
+{
+	int delay;
+
+	if (!spd_audio_can_feed_async(id))
+		return -1;
+
+	delay = id->function->get_delay(id);
+	return delay < 0 ? -1 : delay;
+}
+
+/* Get how many times the device ran out of audio, and got suspended,
+   since it was opened.
+
+   Arguments:
+   id -- the AudioID* of the device returned by spd_audio_open
+   xruns, suspends -- where to store the counts
+
+   Return value:
+   0 if everything is ok, -1 if the device does not count them.
+*/
+int spd_audio_get_xruns(AudioID * id, int *xruns, int *suspends)
+{
+	if (!id || !spd_audio_device_has(spd_audio_device(id), 1)
+	    || !id->function->get_xruns)
+		return -1;
+
+	*xruns = *suspends = 0;
+	id->function->get_xruns(id, xruns, suspends);
+	return 0;
 }
 
 /* Finish playing a track on the audio device.
@@ -330,11 +852,32 @@ int spd_audio_feed_sync_overlap(AudioID * id, AudioTrack track, AudioFormat form
 */
 int spd_audio_end(AudioID * id)
 {
-	if (!id) {
+	SPDAudioDevice *dev = id ? spd_audio_device(id) : NULL;
+	SPDResampler *r;
+
+	if (!dev) {
 		fprintf(stderr, "No audio open\n");
 		return -1;
 	}
 
+	r = dev->path.resampler;
+	if (r) {
+		/* Push the end of the input out of the filter window */
+		AudioTrack track = {
+			.bits = 16,
+			.num_channels = r->channels,
+			.sample_rate = r->in_rate,
+			.num_samples = SPD_RESAMPLE_TAPS / 2,
+			.samples = NULL,
+		};
+
+		track = dev->path.resample(r, track);
+		if (track.num_samples && id->function->feed_sync)
+			id->function->feed_sync(id, track);
+		r->active = FALSE;
+		dev->path.resampler = NULL;
+	}
+
 	if (!id->function->end) {
 		/* Too bad */
 		return 0;
@@ -430,22 +973,17 @@ Comments:
 int spd_audio_close(AudioID * id)
 {
 	int ret = 0;
+
+	pthread_mutex_lock(&spd_audio_devices_mutex);
+	if (spd_audio_devices)
+		g_hash_table_remove(spd_audio_devices, id);
+	pthread_mutex_unlock(&spd_audio_devices_mutex);
+
 	if (id && id->function->close) {
 		ret = (id->function->close(id));
 	}
 
-#ifdef USE_DLOPEN
-	if (NULL != dlhandle) {
-		dlclose(dlhandle);
-		dlhandle = NULL;
-	}
-#else
-	if (NULL != lt_h) {
-		lt_dlclose(lt_h);
-		lt_h = NULL;
-		lt_dlexit();
-	}
-#endif
+	/* The plugin stays loaded for the next spd_audio_open() */
 
 	return ret;
 }
@@ -39,6 +39,10 @@ int spd_audio_play(AudioID * id, AudioTrack track, AudioFormat format);
 int spd_audio_begin(AudioID * id, AudioTrack track, AudioFormat format);
 int spd_audio_feed_sync(AudioID * id, AudioTrack track, AudioFormat format);
 int spd_audio_feed_sync_overlap(AudioID * id, AudioTrack track, AudioFormat format);
+int spd_audio_feed_async(AudioID * id, AudioTrack track, AudioFormat format);
+int spd_audio_can_feed_async(AudioID * id);
+int spd_audio_get_delay(AudioID * id);
+int spd_audio_get_xruns(AudioID * id, int *xruns, int *suspends);
 int spd_audio_end(AudioID * id);
 
 int spd_audio_stop(AudioID * id);
@@ -47,6 +51,8 @@ int spd_audio_close(AudioID * id);
 
 int spd_audio_set_volume(AudioID * id, int volume);
 
+int spd_audio_set_rate(AudioID * id, int rate);
+
 void spd_audio_set_loglevel(AudioID * id, int level);
 
 char const *spd_audio_get_playcmd(AudioID * id);
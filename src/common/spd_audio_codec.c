@@ -0,0 +1,281 @@
+/*
+ * spd_audio_codec.c - Compression of the audio sent by modules
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef HAVE_OPUS
+#include <opus.h>
+#endif
+
+#include "spd_audio_codec.h"
+
+#if G_BYTE_ORDER == G_LITTLE_ENDIAN
+#define HOST_FORMAT SPD_AUDIO_LE
+#else
+#define HOST_FORMAT SPD_AUDIO_BE
+#endif
+
+/* Ten minutes at 48kHz, more is bogus */
+#define MAX_SAMPLES (48000 * 600)
+
+/* What opus_encode() may produce at most for a frame */
+#define MAX_PACKET 1276
+
+struct SPDAudioCodec {
+#ifdef HAVE_OPUS
+	OpusEncoder *encoder;
+	int encoder_rate;
+	int encoder_channels;
+
+	OpusDecoder *decoder;
+	int decoder_rate;
+	int decoder_channels;
+#else
+	int unused;
+#endif
+};
+
+gboolean spd_audio_codec_available(const char *name)
+{
+#ifdef HAVE_OPUS
+	return !strcmp(name, SPD_AUDIO_CODEC_OPUS);
+#else
+	return FALSE;
+#endif
+}
+
+SPDAudioCodec *spd_audio_codec_new(const char *name)
+{
+	if (!spd_audio_codec_available(name))
+		return NULL;
+	return g_new0(SPDAudioCodec, 1);
+}
+
+void spd_audio_codec_free(SPDAudioCodec * codec)
+{
+	if (codec == NULL)
+		return;
+#ifdef HAVE_OPUS
+	if (codec->encoder)
+		opus_encoder_destroy(codec->encoder);
+	if (codec->decoder)
+		opus_decoder_destroy(codec->decoder);
+#endif
+	g_free(codec);
+}
+
+#ifdef HAVE_OPUS
+/* The sample rate we encode a track of sample_rate at */
+static int opus_rate(int sample_rate)
+{
+	static const int rates[] = { 8000, 12000, 16000, 24000 };
+	int i;
+
+	for (i = 0; i < G_N_ELEMENTS(rates); i++)
+		if (sample_rate <= rates[i])
+			return rates[i];
+	return 48000;
+}
+
+static int encoder_setup(SPDAudioCodec * codec, int rate, int channels)
+{
+	int err;
+
+	if (codec->encoder && codec->encoder_rate == rate
+	    && codec->encoder_channels == channels)
+		return 0;
+
+	if (codec->encoder)
+		opus_encoder_destroy(codec->encoder);
+	codec->encoder = opus_encoder_create(rate, channels,
+					     OPUS_APPLICATION_VOIP, &err);
+	if (codec->encoder == NULL)
+		return -1;
+	opus_encoder_ctl(codec->encoder,
+			 OPUS_SET_BITRATE(SPD_AUDIO_OPUS_BITRATE * channels));
+	opus_encoder_ctl(codec->encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+	codec->encoder_rate = rate;
+	codec->encoder_channels = channels;
+
+	return 0;
+}
+
+static int decoder_setup(SPDAudioCodec * codec, int rate, int channels)
+{
+	int err;
+
+	if (codec->decoder && codec->decoder_rate == rate
+	    && codec->decoder_channels == channels)
+		return 0;
+
+	if (codec->decoder)
+		opus_decoder_destroy(codec->decoder);
+	codec->decoder = opus_decoder_create(rate, channels, &err);
+	if (codec->decoder == NULL)
+		return -1;
+	codec->decoder_rate = rate;
+	codec->decoder_channels = channels;
+
+	return 0;
+}
+
+static opus_int16 track_sample(const AudioTrack * track, AudioFormat format,
+			       int i, int channel)
+{
+	guint16 sample = track->samples[i * track->num_channels + channel];
+
+	if (format != HOST_FORMAT)
+		sample = GUINT16_SWAP_LE_BE(sample);
+	return (opus_int16) sample;
+}
+
+/* Get the samples of the track at rate, linearly interpolated when it is
+ * another one, which is good enough for the codec */
+static void track_resample(const AudioTrack * track, AudioFormat format,
+			   int rate, opus_int16 * pcm, int n)
+{
+	int i, j, c;
+
+	for (i = 0; i < n; i++) {
+		gint64 pos = (gint64) i * track->sample_rate;
+		int frac = pos % rate;
+
+		j = pos / rate;
+		for (c = 0; c < track->num_channels; c++) {
+			int s0 = track_sample(track, format, j, c);
+			int s1 = j + 1 < track->num_samples
+			    ? track_sample(track, format, j + 1, c) : s0;
+
+			pcm[i * track->num_channels + c] =
+			    s0 + (gint64) (s1 - s0) * frac / rate;
+		}
+	}
+}
+#endif
+
+char *spd_audio_codec_encode(SPDAudioCodec * codec, const AudioTrack * track,
+			     AudioFormat format, GByteArray * out)
+{
+#ifdef HAVE_OPUS
+	int channels = track->num_channels;
+	int rate, n, frame, skip = 0, total, i, len;
+	opus_int16 *pcm;
+	unsigned char packet[2 + MAX_PACKET];
+	guint start = out->len;
+
+	if (track->bits != 16 || channels < 1 || channels > 2
+	    || track->sample_rate <= 0 || track->num_samples <= 0
+	    || track->num_samples > MAX_SAMPLES)
+		return NULL;
+
+	rate = opus_rate(track->sample_rate);
+	if (encoder_setup(codec, rate, channels) != 0)
+		return NULL;
+	opus_encoder_ctl(codec->encoder, OPUS_RESET_STATE);
+	opus_encoder_ctl(codec->encoder, OPUS_GET_LOOKAHEAD(&skip));
+
+	/* Pad with silence for the delay of the codec and the last frame */
+	n = (gint64) track->num_samples * rate / track->sample_rate;
+	frame = rate * SPD_AUDIO_OPUS_FRAME / 1000;
+	total = (n + skip + frame - 1) / frame * frame;
+	pcm = g_new0(opus_int16, (gsize) total * channels);
+	track_resample(track, format, rate, pcm, n);
+
+	for (i = 0; i < total; i += frame) {
+		len = opus_encode(codec->encoder, pcm + i * channels, frame,
+				  packet + 2, MAX_PACKET);
+		if (len < 0) {
+			g_byte_array_set_size(out, start);
+			g_free(pcm);
+			return NULL;
+		}
+		packet[0] = len >> 8;
+		packet[1] = len & 0xff;
+		g_byte_array_append(out, packet, 2 + len);
+	}
+	g_free(pcm);
+
+	return g_strdup_printf("705-OPUS %d %d %d %d %u", channels, rate, n,
+			       skip, out->len - start);
+#else
+	return NULL;
+#endif
+}
+
+int spd_audio_codec_decode(SPDAudioCodec * codec, const char *header,
+			   const char *data, size_t size, AudioTrack * track,
+			   AudioFormat * format)
+{
+#ifdef HAVE_OPUS
+	const unsigned char *p = (const unsigned char *)data;
+	const unsigned char *end = p + size;
+	int channels, rate, n, skip, max, got, filled = 0;
+	size_t header_size, len;
+	opus_int16 *pcm;
+
+	if (sscanf(header, "705-OPUS %d %d %d %d %zu", &channels, &rate, &n,
+		   &skip, &header_size) != 5
+	    || header_size != size || channels < 1 || channels > 2
+	    || n < 0 || n > MAX_SAMPLES || skip < 0 || skip > rate)
+		return -1;
+
+	if (decoder_setup(codec, rate, channels) != 0)
+		return -1;
+	opus_decoder_ctl(codec->decoder, OPUS_RESET_STATE);
+
+	/* The longest opus packet is 120ms */
+	max = rate * 120 / 1000;
+	pcm = g_new(opus_int16, (gsize) (n + skip + max) * channels);
+
+	while (filled < n + skip && end - p >= 2) {
+		len = p[0] << 8 | p[1];
+		p += 2;
+		if (len > end - p)
+			break;
+		got = opus_decode(codec->decoder, p, len,
+				  pcm + (gsize) filled * channels, max, 0);
+		if (got < 0)
+			break;
+		filled += got;
+		p += len;
+	}
+	if (filled < n + skip) {
+		g_free(pcm);
+		return -1;
+	}
+
+	memmove(pcm, pcm + (gsize) skip * channels,
+		(gsize) n * channels * sizeof(*pcm));
+	track->bits = 16;
+	track->num_channels = channels;
+	track->sample_rate = rate;
+	track->num_samples = n;
+	track->samples = pcm;
+	*format = HOST_FORMAT;
+
+	return 0;
+#else
+	return -1;
+#endif
+}
@@ -0,0 +1,67 @@
+/*
+ * spd_audio_codec.h - Compression of the audio sent by modules
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With audio_codec=opus, a module sends its tracks as
+ *
+ *   705-OPUS <num_channels> <sample_rate> <num_samples> <skip> <size>
+ *   <size bytes: opus packets, each after its length on 2 bytes, big endian>
+ *   705 AUDIO
+ *
+ * Each track is encoded on its own, so that the server may drop any of
+ * them, e.g. after a stop.  The decoded track has num_samples 16 bit
+ * samples after the first skip ones, which are the delay of the codec.
+ * Opus only takes some sample rates, the others are resampled to the next
+ * one above.
+ */
+
+#ifndef SPD_AUDIO_CODEC_H
+#define SPD_AUDIO_CODEC_H
+
+#include <glib.h>
+#include <spd_audio_plugin.h>
+
+#define SPD_AUDIO_CODEC_OPUS "opus"
+
+/* Enough for speech */
+#define SPD_AUDIO_OPUS_BITRATE 24000
+/* In ms, short enough not to delay the first audio */
+#define SPD_AUDIO_OPUS_FRAME 20
+
+typedef struct SPDAudioCodec SPDAudioCodec;
+
+/* Whether we were built with the codec */
+gboolean spd_audio_codec_available(const char *name);
+
+SPDAudioCodec *spd_audio_codec_new(const char *name);
+void spd_audio_codec_free(SPDAudioCodec * codec);
+
+/* Append the packets of track to out, and return the 705-OPUS header line,
+ * to be freed, or NULL when the track can't be encoded and is to be sent
+ * raw */
+char *spd_audio_codec_encode(SPDAudioCodec * codec, const AudioTrack * track,
+			     AudioFormat format, GByteArray * out);
+
+/* Decode what follows a 705-OPUS header into track, whose samples are
+ * to be freed with g_free(), in the byte order of the machine */
+int spd_audio_codec_decode(SPDAudioCodec * codec, const char *header,
+			   const char *data, size_t size, AudioTrack * track,
+			   AudioFormat * format);
+
+#endif /* not ifndef SPD_AUDIO_CODEC_H */
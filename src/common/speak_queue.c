@@ -23,11 +23,17 @@
  * Based on ibmtts.c.
  */
 
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <sndfile.h>
 
 #include "speak_queue.h"
 #include "common.h"
 #include "spd_audio.h"
+#include "spd_audio_convert.h"
 
 #define DBG_MODNAME "speak_queue"
 
@@ -50,6 +56,8 @@ static pthread_mutex_t speak_queue_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static speak_queue_state_t speak_queue_state = IDLE;
 static gboolean speak_queue_configured = FALSE; /* Whether we have configured audio */
+static gboolean speak_queue_first_write = FALSE; /* No samples of the message were played yet */
+static void (*speak_queue_first_write_callback) (void);
 
 static pthread_t speak_queue_play_thread;
 static pthread_t speak_queue_stop_or_pause_thread;
@@ -65,6 +73,14 @@ static pthread_cond_t speak_queue_play_cond = PTHREAD_COND_INITIALIZER;
 static pthread_cond_t speak_queue_play_sleeping_cond = PTHREAD_COND_INITIALIZER;
 static int speak_queue_play_sleeping;
 
+static pthread_t speak_queue_marks_thread;
+/* Protects the pending index marks, the mark thread waits on the condition
+ * for new marks, the playback thread for them to be reported */
+static pthread_mutex_t speak_queue_marks_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t speak_queue_marks_cond;
+static gboolean speak_queue_marks_quit;
+static gboolean speak_queue_marks_reporting;	/* one was popped, not reported */
+
 static gboolean speak_queue_close_requested = FALSE;
 static speak_queue_pause_state_t speak_queue_pause_state = SPEAK_QUEUE_PAUSE_OFF;
 static gboolean speak_queue_stop_requested = FALSE;
@@ -72,18 +88,61 @@ static gboolean speak_queue_flush_requested = FALSE;
 
 static void module_speak_queue_reset(void);
 
-/* The playback queue. */
+/* The playback queue.
+ *
+ * This is a ring of entries with a single producer, the synth callback, and
+ * a single consumer, the playback thread, neither of which takes
+ * speak_queue_mutex to go through it.  The producer only writes head, the
+ * consumer only writes tail, both are free running counters.  Should several
+ * threads push, they are serialized by playback_queue_push_mutex, which the
+ * consumer never takes.  */
 
 static int speak_queue_maxsize;
 
-static GSList *playback_queue = NULL;
-static int playback_queue_size = 0;	/* Number of audio frames currently in queue */
+#define PLAYBACK_QUEUE_LEN 4096	/* Power of two */
+static speak_queue_entry *playback_queue[PLAYBACK_QUEUE_LEN];
+static guint playback_queue_head;
+static guint playback_queue_tail;
+static gint playback_queue_size = 0;	/* Number of audio frames currently in queue */
+static gint playback_queue_duration = 0;	/* Microseconds of audio currently in queue */
+static gboolean playback_queue_last_audio;	/* The last entry popped was audio */
+
+/* When set, the queue is bounded by duration instead of speak_queue_maxsize:
+ * pushing waits once above the high watermark, until back to the low one.  */
+static gint speak_queue_low_us, speak_queue_high_us;
 
-/* Use to wait for queue room availability. Theoretically several threads might
- * be wanting to push, so use broadcast. */
+static pthread_mutex_t playback_queue_push_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Posted when room is made while the producer waits for it, and on stop */
+static SPDSemaphore playback_queue_room_sem;
+static gint playback_queue_room_waiting;
+/* Posted when data is pushed, and on stop */
+static SPDSemaphore playback_queue_data_sem;
+
+/* Signaled under speak_queue_mutex once pushers were told to give up */
 static pthread_cond_t playback_queue_room_condition = PTHREAD_COND_INITIALIZER;
-/* Use to wait for queue data availability */
-static pthread_cond_t playback_queue_data_condition = PTHREAD_COND_INITIALIZER;
+
+/* Pools of free entries and sample buffers, refilled after playback so that
+ * steady speech does not go through malloc for every chunk.  Sample buffers
+ * come in power of two size classes.  Free elements are chained through
+ * their first bytes.  */
+#define SPEAK_QUEUE_POOL_MIN_SHIFT 12	/* 4KiB */
+#define SPEAK_QUEUE_POOL_CLASSES 7	/* up to 256KiB */
+#define SPEAK_QUEUE_POOL_MAX_FREE 32	/* free elements kept per pool */
+
+typedef struct speak_queue_pool_elem {
+	struct speak_queue_pool_elem *next;
+} speak_queue_pool_elem;
+
+typedef struct {
+	speak_queue_pool_elem *first;
+	int count;
+} speak_queue_pool;
+
+static pthread_mutex_t speak_queue_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static speak_queue_pool speak_queue_entry_pool;
+static speak_queue_pool speak_queue_samples_pool[SPEAK_QUEUE_POOL_CLASSES];
+static guint speak_queue_pool_hits, speak_queue_pool_misses;
 
 /* Internal function prototypes for playback thread. */
 static gboolean speak_queue_add_flag_to_playback_queue(speak_queue_entry_type type);
@@ -94,17 +153,25 @@ static gboolean speak_queue_send_to_audio(speak_queue_entry *
 
 /* Miscellaneous internal function prototypes. */
 static void speak_queue_clear_playback_queue();
+static void speak_queue_mix_clear(void);
 
 /* The playback thread start routine. */
 static void *speak_queue_play(void *);
+static gint64 speak_queue_now(void);
 /* The stop_or_pause start routine. */
 static void *speak_queue_stop_or_pause(void *);
 
+/* Index mark thread. */
+static void *speak_queue_marks(void *);
+
 int module_speak_queue_init(int maxsize, char **status_info)
 {
+	pthread_condattr_t attr;
 	int ret;
 
 	speak_queue_maxsize = maxsize;
+	spd_semaphore_init(&playback_queue_room_sem, 0);
+	spd_semaphore_init(&playback_queue_data_sem, 0);
 
 	/* Reset global state */
 	module_speak_queue_reset();
@@ -122,6 +189,21 @@ int module_speak_queue_init(int maxsize, char **status_info)
 		return -1;
 	}
 
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&speak_queue_marks_cond, &attr);
+	pthread_condattr_destroy(&attr);
+	speak_queue_marks_quit = FALSE;
+
+	DBG(DBG_MODNAME " Creating new thread for index marks.");
+	ret = spd_pthread_create(&speak_queue_marks_thread, NULL,
+				 speak_queue_marks, NULL);
+	if (ret != 0) {
+		DBG("Failed to create index mark thread.");
+		*status_info = g_strdup("Failed to create index mark thread.");
+		return -1;
+	}
+
 	speak_queue_play_sleeping = 0;
 
 	DBG(DBG_MODNAME " Creating new thread for playback.");
@@ -165,111 +247,483 @@ int module_speak_queue_before_play(void)
 	if (speak_queue_state == BEFORE_SYNTH) {
 		ret = 1;
 		speak_queue_state = BEFORE_PLAY;
-		speak_queue_add_flag_to_playback_queue(SPEAK_QUEUE_QET_BEGIN);
 		/* Wake up playback thread */
 		pthread_cond_signal(&speak_queue_play_cond);
 	}
 	pthread_mutex_unlock(&speak_queue_mutex);
+	/* Pushed without the mutex, the playback thread may need it to make room */
+	if (ret)
+		speak_queue_add_flag_to_playback_queue(SPEAK_QUEUE_QET_BEGIN);
 	return ret;
 }
 
 gboolean module_speak_queue_add_end(void)
 {
-	pthread_mutex_lock(&speak_queue_mutex);
-	gboolean ret = speak_queue_add_flag_to_playback_queue(SPEAK_QUEUE_QET_END);
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return ret;
+	return speak_queue_add_flag_to_playback_queue(SPEAK_QUEUE_QET_END);
 }
 
-static speak_queue_entry *playback_queue_pop()
+/* Microseconds of audio in an entry */
+static gint playback_queue_entry_duration(const speak_queue_entry * entry)
 {
-	speak_queue_entry *result = NULL;
-	pthread_mutex_lock(&speak_queue_mutex);
-	while (!speak_queue_stop_requested && playback_queue == NULL) {
-		pthread_cond_wait(&playback_queue_data_condition,
-				  &speak_queue_mutex);
+	const AudioTrack *track = &entry->data.audio.track;
+
+	if (track->sample_rate <= 0)
+		return 0;
+	return (gint64) track->num_samples * 1000000 / track->sample_rate;
+}
+
+/* Wake the producer if it waits for room */
+static void playback_queue_wake_room(void)
+{
+	if (g_atomic_int_compare_and_exchange(&playback_queue_room_waiting, 1, 0))
+		spd_semaphore_post(&playback_queue_room_sem);
+}
+
+/* Consumer side: takes the oldest entry, if any */
+static speak_queue_entry *playback_queue_take(void)
+{
+	guint tail = playback_queue_tail;
+	speak_queue_entry *result;
+
+	if (tail == (guint) g_atomic_int_get(&playback_queue_head))
+		return NULL;
+
+	result = playback_queue[tail % PLAYBACK_QUEUE_LEN];
+	g_atomic_int_set(&playback_queue_tail, tail + 1);
+	if (result->type == SPEAK_QUEUE_QET_AUDIO) {
+		g_atomic_int_add(&playback_queue_size,
+				 -result->data.audio.track.num_samples);
+		g_atomic_int_add(&playback_queue_duration,
+				 -playback_queue_entry_duration(result));
+	}
+	playback_queue_wake_room();
+	return result;
+}
+
+/* Diagnostics of the playback.  Everything is accounted in the global stats,
+ * and in those of the module of the message being played if any.  The times
+ * are only taken by the playback thread, the events are also logged with a
+ * "speak_queue diag:" prefix for following them in the debug output.  */
+typedef enum {
+	SPEAK_QUEUE_STAT_MESSAGE,
+	SPEAK_QUEUE_STAT_UNDERRUN,
+	SPEAK_QUEUE_STAT_FIRST_AUDIO,
+	SPEAK_QUEUE_STAT_XRUNS,
+	SPEAK_QUEUE_STAT_SUSPENDS,
+} speak_queue_stat_t;
+
+static pthread_mutex_t speak_queue_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static SPDSpeakQueueStats speak_queue_stats;
+static SPDSpeakQueueStats *speak_queue_next_stats;	/* for the next messages */
+static SPDSpeakQueueStats *speak_queue_message_stats;	/* for the one played */
+static gint64 speak_queue_begin_time;	/* of the message, 0 once audio came */
+static const AudioID *speak_queue_device;	/* whose counters we last saw */
+static int speak_queue_device_xruns, speak_queue_device_suspends;
+
+static void speak_queue_stats_add(SPDSpeakQueueStats *stats,
+				  speak_queue_stat_t stat, guint64 value)
+{
+	guint max = MIN(value, G_MAXUINT);
+
+	switch (stat) {
+	case SPEAK_QUEUE_STAT_MESSAGE:
+		stats->messages++;
+		break;
+	case SPEAK_QUEUE_STAT_UNDERRUN:
+		stats->underruns++;
+		stats->underrun_us += value;
+		stats->underrun_max_us = MAX(stats->underrun_max_us, max);
+		break;
+	case SPEAK_QUEUE_STAT_FIRST_AUDIO:
+		stats->first_audio_us += value;
+		stats->first_audio_max_us = MAX(stats->first_audio_max_us, max);
+		break;
+	case SPEAK_QUEUE_STAT_XRUNS:
+		stats->xruns += value;
+		break;
+	case SPEAK_QUEUE_STAT_SUSPENDS:
+		stats->suspends += value;
+		break;
+	}
+}
+
+static void speak_queue_stats_record(speak_queue_stat_t stat, guint64 value)
+{
+	pthread_mutex_lock(&speak_queue_stats_mutex);
+	speak_queue_stats_add(&speak_queue_stats, stat, value);
+	if (speak_queue_message_stats)
+		speak_queue_stats_add(speak_queue_message_stats, stat, value);
+	pthread_mutex_unlock(&speak_queue_stats_mutex);
+}
+
+/* A message begins being played */
+static void speak_queue_stats_begin(void)
+{
+	pthread_mutex_lock(&speak_queue_stats_mutex);
+	speak_queue_message_stats = speak_queue_next_stats;
+	pthread_mutex_unlock(&speak_queue_stats_mutex);
+	speak_queue_stats_record(SPEAK_QUEUE_STAT_MESSAGE, 1);
+	speak_queue_begin_time = speak_queue_now();
+}
+
+/* The first samples of the message are being given to the device */
+static void speak_queue_stats_first_audio(void)
+{
+	gint64 gap = speak_queue_now() - speak_queue_begin_time;
+
+	DBG(DBG_MODNAME " diag: first audio %" G_GINT64_FORMAT
+	    " us after begin", gap);
+	speak_queue_stats_record(SPEAK_QUEUE_STAT_FIRST_AUDIO, gap);
+	speak_queue_begin_time = 0;
+}
+
+/* Account what the audio plugin counted since we last looked */
+static void speak_queue_stats_device(void)
+{
+	AudioID *id = module_audio_id;
+	int xruns, suspends;
+
+	if (!id || spd_audio_get_xruns(id, &xruns, &suspends))
+		return;
+	if (id != speak_queue_device || xruns < speak_queue_device_xruns
+	    || suspends < speak_queue_device_suspends) {
+		/* Another device, its counters start from 0 */
+		speak_queue_device = id;
+		speak_queue_device_xruns = 0;
+		speak_queue_device_suspends = 0;
+	}
+
+	if (xruns != speak_queue_device_xruns) {
+		DBG(DBG_MODNAME " diag: %d device xruns",
+		    xruns - speak_queue_device_xruns);
+		speak_queue_stats_record(SPEAK_QUEUE_STAT_XRUNS,
+					 xruns - speak_queue_device_xruns);
+		speak_queue_device_xruns = xruns;
 	}
-	if (!speak_queue_stop_requested) {
-		result = (speak_queue_entry *) playback_queue->data;
-		playback_queue =
-		    g_slist_remove(playback_queue, playback_queue->data);
-		if (result->type == SPEAK_QUEUE_QET_AUDIO) {
-			playback_queue_size -= result->data.audio.track.num_samples;
-			pthread_cond_broadcast(&playback_queue_room_condition);
+	if (suspends != speak_queue_device_suspends) {
+		DBG(DBG_MODNAME " diag: %d device suspends",
+		    suspends - speak_queue_device_suspends);
+		speak_queue_stats_record(SPEAK_QUEUE_STAT_SUSPENDS,
+					 suspends - speak_queue_device_suspends);
+		speak_queue_device_suspends = suspends;
+	}
+}
+
+void module_speak_queue_set_stats(SPDSpeakQueueStats *stats)
+{
+	pthread_mutex_lock(&speak_queue_stats_mutex);
+	speak_queue_next_stats = stats;
+	pthread_mutex_unlock(&speak_queue_stats_mutex);
+}
+
+void module_speak_queue_unset_stats(SPDSpeakQueueStats *stats)
+{
+	pthread_mutex_lock(&speak_queue_stats_mutex);
+	if (speak_queue_next_stats == stats)
+		speak_queue_next_stats = NULL;
+	if (speak_queue_message_stats == stats)
+		speak_queue_message_stats = NULL;
+	pthread_mutex_unlock(&speak_queue_stats_mutex);
+}
+
+void module_speak_queue_get_stats(const SPDSpeakQueueStats *stats,
+				  SPDSpeakQueueStats *copy)
+{
+	pthread_mutex_lock(&speak_queue_stats_mutex);
+	*copy = stats ? *stats : speak_queue_stats;
+	pthread_mutex_unlock(&speak_queue_stats_mutex);
+}
+
+guint module_speak_queue_underruns(void)
+{
+	SPDSpeakQueueStats stats;
+
+	module_speak_queue_get_stats(NULL, &stats);
+	return stats.underruns;
+}
+
+static speak_queue_entry *playback_queue_pop()
+{
+	speak_queue_entry *result;
+
+	/* There is one post per entry, plus wakeups on stop, and entries
+	 * dropped by speak_queue_clear_playback_queue() leave theirs behind */
+	while (!g_atomic_int_get(&speak_queue_stop_requested)) {
+		if (spd_semaphore_trywait(&playback_queue_data_sem) != 0) {
+			gint64 start = speak_queue_now(), gap;
+
+			spd_semaphore_wait(&playback_queue_data_sem);
+			gap = speak_queue_now() - start;
+			/* Audio is expected next but was not produced in
+			 * time, unless we were woken to stop */
+			if (playback_queue_last_audio
+			    && !g_atomic_int_get(&speak_queue_stop_requested)) {
+				DBG(DBG_MODNAME " diag: underrun of %"
+				    G_GINT64_FORMAT " us", gap);
+				speak_queue_stats_record
+				    (SPEAK_QUEUE_STAT_UNDERRUN, gap);
+			}
+		}
+		if (g_atomic_int_get(&speak_queue_stop_requested))
+			break;
+		result = playback_queue_take();
+		if (result) {
+			playback_queue_last_audio =
+			    result->type == SPEAK_QUEUE_QET_AUDIO;
+			return result;
 		}
 	}
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return result;
+	playback_queue_last_audio = FALSE;
+	return NULL;
+}
+
+/* Whether there is too much audio in the queue to push more, WAITING tells
+ * whether the producer is already waiting for the queue to drain */
+static gboolean playback_queue_over_budget(gboolean waiting)
+{
+	gint high = g_atomic_int_get(&speak_queue_high_us);
+
+	if (high)
+		return g_atomic_int_get(&playback_queue_duration)
+			> (waiting ? g_atomic_int_get(&speak_queue_low_us) : high);
+	return g_atomic_int_get(&playback_queue_size) > speak_queue_maxsize;
+}
+
+static gboolean playback_queue_full(gboolean audio, gboolean waiting)
+{
+	guint used = (guint) g_atomic_int_get(&playback_queue_head)
+		- (guint) g_atomic_int_get(&playback_queue_tail);
+
+	return used >= PLAYBACK_QUEUE_LEN
+		|| (audio && playback_queue_over_budget(waiting));
+}
+
+/* Whether audio pushed now would be dropped anyway */
+static gboolean playback_queue_discarding(void)
+{
+	return g_atomic_int_get((gint *) &speak_queue_state) == IDLE
+		|| g_atomic_int_get(&speak_queue_stop_requested)
+		|| g_atomic_int_get(&speak_queue_flush_requested);
+}
+
+/* Producer side, with playback_queue_push_mutex held: waits until the entry
+ * can be pushed, returns FALSE if we are stopping meanwhile.  */
+static gboolean playback_queue_wait_room(gboolean audio)
+{
+	gboolean waiting = FALSE;
+
+	while (playback_queue_full(audio, waiting)) {
+		if (audio ? playback_queue_discarding()
+			  : g_atomic_int_get(&speak_queue_stop_requested))
+			return FALSE;
+		waiting = TRUE;
+		g_atomic_int_set(&playback_queue_room_waiting, 1);
+		/* The consumer may have made room before seeing the flag */
+		if (playback_queue_full(audio, waiting))
+			spd_semaphore_wait(&playback_queue_room_sem);
+	}
+	return TRUE;
 }
 
 static gboolean playback_queue_push(speak_queue_entry * entry)
 {
-	playback_queue = g_slist_append(playback_queue, entry);
-	if (entry->type == SPEAK_QUEUE_QET_AUDIO) {
-		playback_queue_size += entry->data.audio.track.num_samples;
+	gboolean audio = entry->type == SPEAK_QUEUE_QET_AUDIO;
+	guint head;
+
+	pthread_mutex_lock(&playback_queue_push_mutex);
+	if (!playback_queue_wait_room(audio)
+	    || (audio && playback_queue_discarding())) {
+		pthread_mutex_unlock(&playback_queue_push_mutex);
+		speak_queue_delete_playback_queue_entry(entry);
+		return FALSE;
+	}
+
+	head = playback_queue_head;
+	playback_queue[head % PLAYBACK_QUEUE_LEN] = entry;
+	if (audio) {
+		g_atomic_int_add(&playback_queue_size,
+				 entry->data.audio.track.num_samples);
+		g_atomic_int_add(&playback_queue_duration,
+				 playback_queue_entry_duration(entry));
 	}
-	pthread_cond_signal(&playback_queue_data_condition);
+	g_atomic_int_set(&playback_queue_head, head + 1);
+	pthread_mutex_unlock(&playback_queue_push_mutex);
+
+	spd_semaphore_post(&playback_queue_data_sem);
 	return TRUE;
 }
 
+static void *speak_queue_pool_get(speak_queue_pool * pool)
+{
+	speak_queue_pool_elem *elem;
+
+	pthread_mutex_lock(&speak_queue_pool_mutex);
+	elem = pool->first;
+	if (elem) {
+		pool->first = elem->next;
+		pool->count--;
+		speak_queue_pool_hits++;
+	} else {
+		speak_queue_pool_misses++;
+	}
+	pthread_mutex_unlock(&speak_queue_pool_mutex);
+	return elem;
+}
+
+/* Returns FALSE when the pool is full and ELEM should rather be freed */
+static gboolean speak_queue_pool_put(speak_queue_pool * pool, void *elem)
+{
+	speak_queue_pool_elem *pool_elem = elem;
+	gboolean ret = FALSE;
+
+	pthread_mutex_lock(&speak_queue_pool_mutex);
+	if (pool->count < SPEAK_QUEUE_POOL_MAX_FREE) {
+		pool_elem->next = pool->first;
+		pool->first = pool_elem;
+		pool->count++;
+		ret = TRUE;
+	}
+	pthread_mutex_unlock(&speak_queue_pool_mutex);
+	return ret;
+}
+
+static void speak_queue_pool_clear(speak_queue_pool * pool)
+{
+	speak_queue_pool_elem *elem;
+
+	pthread_mutex_lock(&speak_queue_pool_mutex);
+	while ((elem = pool->first) != NULL) {
+		pool->first = elem->next;
+		g_free(elem);
+	}
+	pool->count = 0;
+	pthread_mutex_unlock(&speak_queue_pool_mutex);
+}
+
+static speak_queue_entry *speak_queue_entry_new(void)
+{
+	speak_queue_entry *entry = speak_queue_pool_get(&speak_queue_entry_pool);
+
+	if (!entry)
+		entry = g_new(speak_queue_entry, 1);
+	return entry;
+}
+
+static void speak_queue_entry_free(speak_queue_entry * entry)
+{
+	if (!speak_queue_pool_put(&speak_queue_entry_pool, entry))
+		g_free(entry);
+}
+
+/* Size class of a sample buffer, -1 if too big to be pooled */
+static int speak_queue_samples_class(size_t nbytes)
+{
+	int class = 0;
+
+	while (((size_t) 1 << (class + SPEAK_QUEUE_POOL_MIN_SHIFT)) < nbytes)
+		if (++class == SPEAK_QUEUE_POOL_CLASSES)
+			return -1;
+	return class;
+}
+
+static size_t speak_queue_track_bytes(const AudioTrack *track)
+{
+	return (size_t) track->num_channels * track->bits / 8 * track->num_samples;
+}
+
+/* Gain of the audio being added, see module_speak_queue_set_gain() */
+static gint speak_queue_gain = 256;
+
+#define SPEAK_QUEUE_NATIVE (G_BYTE_ORDER == G_BIG_ENDIAN ? SPD_AUDIO_BE \
+			    : SPD_AUDIO_LE)
+
+void module_speak_queue_set_gain(int gain)
+{
+	g_atomic_int_set(&speak_queue_gain, CLAMP(gain, 0, 256));
+}
+
+/* Copies the samples into the queue, in the native byte order */
+static void *speak_queue_samples_dup(const AudioTrack *track, AudioFormat format)
+{
+	size_t nbytes = speak_queue_track_bytes(track);
+	size_t n = (size_t) track->num_samples * track->num_channels;
+	int class = speak_queue_samples_class(nbytes);
+	void *samples = NULL;
+	int gain;
+
+	if (class >= 0) {
+		samples = speak_queue_pool_get(&speak_queue_samples_pool[class]);
+		if (!samples)
+			samples = g_malloc((size_t) 1
+					   << (class + SPEAK_QUEUE_POOL_MIN_SHIFT));
+	} else {
+		samples = g_malloc(nbytes);
+	}
+	gain = g_atomic_int_get(&speak_queue_gain);
+	if (track->bits != 16)
+		memcpy(samples, track->samples, nbytes);
+	else if (format != SPEAK_QUEUE_NATIVE) {
+		/* Swap while copying, so that playing does not have to */
+		spd_audio_swap16_copy(samples, track->samples, n);
+		if (gain < 256)
+			spd_audio_gain_s16(samples, samples, n, gain);
+	} else
+		/* Scale while copying, rather than in another pass */
+		spd_audio_gain_s16(samples, track->samples, n, gain);
+	return samples;
+}
+
+static void speak_queue_samples_free(AudioTrack *track)
+{
+	int class = speak_queue_samples_class(speak_queue_track_bytes(track));
+
+	if (class < 0
+	    || !speak_queue_pool_put(&speak_queue_samples_pool[class],
+				     track->samples))
+		g_free(track->samples);
+}
+
+void module_speak_queue_pool_stats(guint *hits, guint *misses)
+{
+	pthread_mutex_lock(&speak_queue_pool_mutex);
+	*hits = speak_queue_pool_hits;
+	*misses = speak_queue_pool_misses;
+	pthread_mutex_unlock(&speak_queue_pool_mutex);
+}
+
 /* Adds a chunk of pcm audio to the audio playback queue.
    Waits until there is enough space in the queue. */
 gboolean
 module_speak_queue_add_audio(const AudioTrack *track, AudioFormat format)
 {
-	pthread_mutex_lock(&speak_queue_mutex);
-	while (playback_queue_size > speak_queue_maxsize) {
-		if (speak_queue_state == IDLE
-			|| speak_queue_stop_requested
-			|| speak_queue_flush_requested) {
-			pthread_mutex_unlock(&speak_queue_mutex);
-			return FALSE;
-		}
-		pthread_cond_wait(&playback_queue_room_condition,
-				  &speak_queue_mutex);
-	}
-	if (speak_queue_state == IDLE || speak_queue_stop_requested || speak_queue_flush_requested) {
-		pthread_mutex_unlock(&speak_queue_mutex);
+	if (playback_queue_discarding())
 		return FALSE;
-	}
 
-	speak_queue_entry *playback_queue_entry =
-	    g_new(speak_queue_entry, 1);
+	speak_queue_entry *playback_queue_entry = speak_queue_entry_new();
 
 	playback_queue_entry->type = SPEAK_QUEUE_QET_AUDIO;
 	playback_queue_entry->data.audio.track = *track;
-	gint nbytes = track->bits / 8 * track->num_samples;
-#if G_ENCODE_VERSION(GLIB_MAJOR_VERSION, GLIB_MINOR_VERSION) >= G_ENCODE_VERSION(2, 68)
-	playback_queue_entry->data.audio.track.samples = g_memdup2(track->samples, nbytes);
-#else
-	playback_queue_entry->data.audio.track.samples = g_memdup(track->samples, nbytes);
-#endif
-	playback_queue_entry->data.audio.format = format;
-
-	playback_queue_push(playback_queue_entry);
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return TRUE;
+	playback_queue_entry->data.audio.track.samples =
+	    speak_queue_samples_dup(track, format);
+	playback_queue_entry->data.audio.format = SPEAK_QUEUE_NATIVE;
+
+	return playback_queue_push(playback_queue_entry);
 }
 
 /* Adds an Index Mark to the audio playback queue. */
 gboolean module_speak_queue_add_mark(const char *markId)
 {
-	speak_queue_entry *playback_queue_entry =
-	    (speak_queue_entry *) g_malloc(sizeof(speak_queue_entry));
+	speak_queue_entry *playback_queue_entry = speak_queue_entry_new();
 
 	playback_queue_entry->type = SPEAK_QUEUE_QET_INDEX_MARK;
 	playback_queue_entry->data.markId = g_strdup(markId);
-	pthread_mutex_lock(&speak_queue_mutex);
-	gboolean ret = playback_queue_push(playback_queue_entry);
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return ret;
+	return playback_queue_push(playback_queue_entry);
 }
 
 /* Adds a begin or end flag to the playback queue. */
 static gboolean speak_queue_add_flag_to_playback_queue(speak_queue_entry_type type)
 {
-	speak_queue_entry *playback_queue_entry =
-	    (speak_queue_entry *) g_malloc(sizeof(speak_queue_entry));
+	speak_queue_entry *playback_queue_entry = speak_queue_entry_new();
 
 	playback_queue_entry->type = type;
 	return playback_queue_push(playback_queue_entry);
@@ -278,15 +732,11 @@ static gboolean speak_queue_add_flag_to_playback_queue(speak_queue_entry_type ty
 /* Add a sound icon to the playback queue. */
 gboolean module_speak_queue_add_sound_icon(const char *filename)
 {
-	speak_queue_entry *playback_queue_entry =
-	    (speak_queue_entry *) g_malloc(sizeof(speak_queue_entry));
+	speak_queue_entry *playback_queue_entry = speak_queue_entry_new();
 
 	playback_queue_entry->type = SPEAK_QUEUE_QET_SOUND_ICON;
 	playback_queue_entry->data.sound_icon_filename = g_strdup(filename);
-	pthread_mutex_lock(&speak_queue_mutex);
-	gboolean ret = playback_queue_push(playback_queue_entry);
-	pthread_mutex_unlock(&speak_queue_mutex);
-	return ret;
+	return playback_queue_push(playback_queue_entry);
 }
 
 /* Deletes an entry from the playback audio queue, freeing memory. */
@@ -295,7 +745,7 @@ speak_queue_delete_playback_queue_entry(speak_queue_entry * playback_queue_entry
 {
 	switch (playback_queue_entry->type) {
 	case SPEAK_QUEUE_QET_AUDIO:
-		g_free(playback_queue_entry->data.audio.track.samples);
+		speak_queue_samples_free(&playback_queue_entry->data.audio.track);
 		break;
 	case SPEAK_QUEUE_QET_INDEX_MARK:
 		g_free(playback_queue_entry->data.markId);
@@ -306,73 +756,157 @@ speak_queue_delete_playback_queue_entry(speak_queue_entry * playback_queue_entry
 	default:
 		break;
 	}
-	g_free(playback_queue_entry);
+	speak_queue_entry_free(playback_queue_entry);
 }
 
 /* Erases the entire playback queue, freeing memory. */
 static void speak_queue_clear_playback_queue()
 {
-	pthread_mutex_lock(&speak_queue_mutex);
+	speak_queue_entry *playback_queue_entry;
 
-	while (NULL != playback_queue) {
-		speak_queue_entry *playback_queue_entry =
-		    playback_queue->data;
+	/* The playback thread is asleep, we can act as consumer */
+	pthread_mutex_lock(&playback_queue_push_mutex);
+	while ((playback_queue_entry = playback_queue_take()) != NULL)
 		speak_queue_delete_playback_queue_entry(playback_queue_entry);
-		playback_queue =
-		    g_slist_remove(playback_queue, playback_queue->data);
-	}
-	playback_queue = NULL;
-	playback_queue_size = 0;
+	pthread_mutex_unlock(&playback_queue_push_mutex);
+	spd_semaphore_post(&playback_queue_room_sem);
+	speak_queue_mix_clear();
+
+	pthread_mutex_lock(&speak_queue_mutex);
 	pthread_cond_broadcast(&playback_queue_room_condition);
 	pthread_mutex_unlock(&speak_queue_mutex);
 }
 
-/* Sends a chunk of audio to the audio player and waits for completion or error. */
+/* Sends a chunk of audio to the audio player and waits for completion or
+   error, or only until it is queued if the player can report its delay. */
 static gboolean speak_queue_send_track_to_audio(AudioTrack *track, AudioFormat format)
 {
+	/* Chosen with the format, when configuring audio */
+	static int (*feed) (AudioID * id, AudioTrack track, AudioFormat format);
 	int ret = 0;
 	DBG(DBG_MODNAME " Sending %i samples to audio.",
 	    track->num_samples);
 	if (!speak_queue_configured)
 	{
 		spd_audio_begin(module_audio_id, *track, format);
+		feed = spd_audio_can_feed_async(module_audio_id)
+		    ? spd_audio_feed_async : spd_audio_feed_sync_overlap;
 		speak_queue_configured = TRUE;
 	}
-	ret = spd_audio_feed_sync_overlap(module_audio_id, *track, format);
+	if (speak_queue_begin_time)
+		speak_queue_stats_first_audio();
+	ret = feed(module_audio_id, *track, format);
+	speak_queue_stats_device();
 	if (ret < 0) {
 		DBG("ERROR: Can't play track for unknown reason.");
 		return FALSE;
 	}
 	DBG(DBG_MODNAME " Sent to audio.");
+	if (speak_queue_first_write) {
+		speak_queue_first_write = FALSE;
+		if (speak_queue_first_write_callback)
+			speak_queue_first_write_callback();
+	}
 	return TRUE;
 }
 
-/* Plays the specified audio file. */
-static gboolean speak_queue_send_file_to_audio(const char *filename)
+/* Cache of decoded sound icons, most recently played first.  Icons keep a
+ * reference count so that they can be evicted while being played.  */
+typedef struct {
+	char *path;
+	time_t mtime;
+	AudioTrack track;
+	size_t bytes;
+	gboolean mapped;	/* samples are an anonymous mapping */
+	int refs;
+	GList *link;		/* in speak_queue_icon_lru, NULL once evicted */
+} speak_queue_icon;
+
+/* Icons at least this big are mmap'ed, to return their memory on eviction */
+#define SPEAK_QUEUE_ICON_MMAP_MIN (64 * 1024)
+
+static pthread_mutex_t speak_queue_icon_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GHashTable *speak_queue_icon_cache;	/* path -> speak_queue_icon */
+static GQueue speak_queue_icon_lru = G_QUEUE_INIT;
+static size_t speak_queue_icon_bytes;
+static size_t speak_queue_icon_max_bytes = 2 * 1024 * 1024;
+static guint speak_queue_icon_evictions;
+
+static void *speak_queue_icon_alloc(size_t bytes, gboolean *mapped)
+{
+	void *samples;
+
+	*mapped = FALSE;
+	if (bytes >= SPEAK_QUEUE_ICON_MMAP_MIN) {
+		samples = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (samples != MAP_FAILED) {
+			*mapped = TRUE;
+			return samples;
+		}
+	}
+	return g_malloc(bytes);
+}
+
+static void speak_queue_icon_free(speak_queue_icon * icon)
+{
+	if (icon->mapped)
+		munmap(icon->track.samples, icon->bytes);
+	else
+		g_free(icon->track.samples);
+	g_free(icon->path);
+	g_free(icon);
+}
+
+/* Called with speak_queue_icon_mutex held */
+static void speak_queue_icon_unref_locked(speak_queue_icon * icon)
 {
-	gboolean result = 0;
+	if (--icon->refs == 0)
+		speak_queue_icon_free(icon);
+}
+
+static void speak_queue_icon_unref(speak_queue_icon * icon)
+{
+	pthread_mutex_lock(&speak_queue_icon_mutex);
+	speak_queue_icon_unref_locked(icon);
+	pthread_mutex_unlock(&speak_queue_icon_mutex);
+}
+
+/* Called with speak_queue_icon_mutex held */
+static void speak_queue_icon_evict(speak_queue_icon * icon)
+{
+	g_hash_table_remove(speak_queue_icon_cache, icon->path);
+	g_queue_delete_link(&speak_queue_icon_lru, icon->link);
+	icon->link = NULL;
+	speak_queue_icon_bytes -= icon->bytes;
+	speak_queue_icon_evictions++;
+	speak_queue_icon_unref_locked(icon);
+}
+
+/* Decodes the specified audio file into 16bit samples. */
+static speak_queue_icon *speak_queue_icon_load(const char *filename)
+{
+	speak_queue_icon *icon = NULL;
 	int subformat;
 	sf_count_t items;
 	sf_count_t readcount;
 	SNDFILE *sf;
 	SF_INFO sfinfo;
 
-	DBG("Playing |%s|", filename);
+	DBG("Decoding |%s|", filename);
 	memset(&sfinfo, 0, sizeof(sfinfo));
 	sf = sf_open(filename, SFM_READ, &sfinfo);
 	if (NULL == sf) {
 		DBG("%s", sf_strerror(NULL));
-		return -1;
+		return NULL;
 	}
 	if (sfinfo.channels < 1 || sfinfo.channels > 2) {
 		DBG("ERROR: channels = %d.\n", sfinfo.channels);
-		result = FALSE;
-		goto cleanup1;
+		goto cleanup;
 	}
 	if (sfinfo.frames > 0x7FFFFFFF || sfinfo.frames == 0) {
 		DBG("ERROR: Unknown number of frames.");
-		result = FALSE;
-		goto cleanup1;
+		goto cleanup;
 	}
 
 	subformat = sfinfo.format & SF_FORMAT_SUBMASK;
@@ -389,44 +923,521 @@ static gboolean speak_queue_send_file_to_audio(const char *filename)
 		/* Set scaling for float to integer conversion. */
 		sf_command(sf, SFC_SET_SCALE_FLOAT_INT_READ, NULL, SF_TRUE);
 	}
-	AudioTrack track;
-	track.num_samples = sfinfo.frames;
-	track.num_channels = sfinfo.channels;
-	track.sample_rate = sfinfo.samplerate;
-	track.bits = 16;
-	track.samples = g_malloc(items * sizeof(short));
-	readcount = sf_read_short(sf, (short *)track.samples, items);
-	DBG("Read %lld items from audio file.", (long long)readcount);
 
-	if (readcount > 0) {
-		track.num_samples = readcount / sfinfo.channels;
-		DBG("Sending %i samples to audio.", track.num_samples);
-		int ret = speak_queue_send_track_to_audio(&track, SPD_AUDIO_LE);
-		if (ret < 0) {
-			DBG("ERROR: Can't play track for unknown reason.");
-			result = -1;
-			goto cleanup2;
-		}
-		DBG("Sent to audio.");
+	icon = g_new0(speak_queue_icon, 1);
+	icon->refs = 1;
+	icon->bytes = items * sizeof(short);
+	icon->track.num_channels = sfinfo.channels;
+	icon->track.sample_rate = sfinfo.samplerate;
+	icon->track.bits = 16;
+	icon->track.samples = speak_queue_icon_alloc(icon->bytes, &icon->mapped);
+	readcount = sf_read_short(sf, (short *)icon->track.samples, items);
+	DBG("Read %lld items from audio file.", (long long)readcount);
+	if (readcount <= 0) {
+		icon->path = NULL;
+		speak_queue_icon_free(icon);
+		icon = NULL;
+		goto cleanup;
 	}
-cleanup2:
-	g_free(track.samples);
-cleanup1:
+	icon->track.num_samples = readcount / sfinfo.channels;
+
+cleanup:
 	sf_close(sf);
+	return icon;
+}
+
+/* Returns a reference on the decoded icon, from the cache if it is still
+ * up to date. */
+static speak_queue_icon *speak_queue_icon_get(const char *filename)
+{
+	speak_queue_icon *icon;
+	struct stat st;
+
+	if (stat(filename, &st) != 0) {
+		DBG("Can not find sound icon %s", filename);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&speak_queue_icon_mutex);
+	if (!speak_queue_icon_cache)
+		speak_queue_icon_cache = g_hash_table_new(g_str_hash, g_str_equal);
+	icon = g_hash_table_lookup(speak_queue_icon_cache, filename);
+	if (icon && icon->mtime == st.st_mtime) {
+		g_queue_unlink(&speak_queue_icon_lru, icon->link);
+		g_queue_push_head_link(&speak_queue_icon_lru, icon->link);
+		icon->refs++;
+		pthread_mutex_unlock(&speak_queue_icon_mutex);
+		return icon;
+	}
+	if (icon)
+		/* Changed on disk */
+		speak_queue_icon_evict(icon);
+	pthread_mutex_unlock(&speak_queue_icon_mutex);
+
+	icon = speak_queue_icon_load(filename);
+	if (!icon)
+		return NULL;
+	icon->path = g_strdup(filename);
+	icon->mtime = st.st_mtime;
+
+	if (icon->bytes > speak_queue_icon_max_bytes)
+		return icon;
+
+	pthread_mutex_lock(&speak_queue_icon_mutex);
+	if (g_hash_table_lookup(speak_queue_icon_cache, filename)) {
+		/* Somebody else loaded it meanwhile */
+		pthread_mutex_unlock(&speak_queue_icon_mutex);
+		return icon;
+	}
+	while (speak_queue_icon_bytes + icon->bytes > speak_queue_icon_max_bytes)
+		speak_queue_icon_evict(g_queue_peek_tail(&speak_queue_icon_lru));
+	icon->refs++;
+	g_hash_table_insert(speak_queue_icon_cache, icon->path, icon);
+	g_queue_push_head(&speak_queue_icon_lru, icon);
+	icon->link = speak_queue_icon_lru.head;
+	speak_queue_icon_bytes += icon->bytes;
+	pthread_mutex_unlock(&speak_queue_icon_mutex);
+
+	return icon;
+}
+
+void module_speak_queue_set_sound_icon_cache(size_t max_bytes)
+{
+	pthread_mutex_lock(&speak_queue_icon_mutex);
+	speak_queue_icon_max_bytes = max_bytes;
+	while (speak_queue_icon_bytes > speak_queue_icon_max_bytes)
+		speak_queue_icon_evict(g_queue_peek_tail(&speak_queue_icon_lru));
+	pthread_mutex_unlock(&speak_queue_icon_mutex);
+}
+
+void module_speak_queue_preload_sound_icons(const char *dirname)
+{
+	const gchar *name;
+	guint evictions;
+	GDir *dir;
+
+	dir = g_dir_open(dirname, 0, NULL);
+	if (!dir) {
+		DBG("Can not open sound icon folder %s", dirname);
+		return;
+	}
+
+	evictions = speak_queue_icon_evictions;
+	while ((name = g_dir_read_name(dir)) != NULL) {
+		gchar *path = g_build_filename(dirname, name, NULL);
+		speak_queue_icon *icon;
+
+		if (g_file_test(path, G_FILE_TEST_IS_REGULAR)
+		    && (icon = speak_queue_icon_get(path)) != NULL)
+			speak_queue_icon_unref(icon);
+		g_free(path);
+
+		if (speak_queue_icon_evictions != evictions)
+			/* The budget is exhausted, do not churn */
+			break;
+	}
+	g_dir_close(dir);
+	DBG(DBG_MODNAME " %zu bytes of sound icons preloaded from %s",
+	    speak_queue_icon_bytes, dirname);
+}
+
+/* Plays the specified audio file. */
+static gboolean speak_queue_send_file_to_audio(const char *filename)
+{
+	speak_queue_icon *icon;
+	gboolean result;
+
+	icon = speak_queue_icon_get(filename);
+	if (!icon)
+		return FALSE;
+	DBG("Sending %i samples to audio.", icon->track.num_samples);
+	result = speak_queue_send_track_to_audio(&icon->track,
+						 SPEAK_QUEUE_NATIVE);
+	if (!result)
+		DBG("ERROR: Can't play track for unknown reason.");
+	else
+		DBG("Sent to audio.");
+	speak_queue_icon_unref(icon);
 	return result;
 }
 
+/* Sound icons being mixed into the speech, see
+ * module_speak_queue_mix_sound_icon().  */
+typedef struct {
+	speak_queue_icon *icon;
+	size_t pos;		/* frames already mixed, at the speech rate */
+	int rate;		/* the speech rate, 0 until mixed */
+} speak_queue_mix;
+
+static pthread_mutex_t speak_queue_mix_mutex = PTHREAD_MUTEX_INITIALIZER;
+static GQueue speak_queue_mixes = G_QUEUE_INIT;
+/* Gains in 1/256th, speech is ducked while an icon plays over it */
+static gint speak_queue_mix_speech_gain = 256 * 70 / 100;
+static gint speak_queue_mix_icon_gain = 256;
+
+/* Mixes N samples of SRC into DST.  Kept plain so that compilers can
+ * vectorize it.  */
+static void speak_queue_mix_s16(int16_t *restrict dst,
+				const int16_t *restrict src, size_t n,
+				int dst_gain, int src_gain)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		int32_t v = (dst[i] * dst_gain + src[i] * src_gain) >> 8;
+		dst[i] = v > INT16_MAX ? INT16_MAX : v < INT16_MIN ? INT16_MIN : v;
+	}
+}
+
+/* Length of the icon in frames at the given rate */
+static size_t speak_queue_mix_frames(const speak_queue_mix *mix, int rate)
+{
+	const AudioTrack *icon = &mix->icon->track;
+
+	return (size_t) icon->num_samples * rate / icon->sample_rate;
+}
+
+/* Mixes the next part of the icon into the track, returns FALSE once the
+ * icon is over */
+static gboolean speak_queue_mix_icon(AudioTrack *track, speak_queue_mix *mix,
+				     int speech_gain, int icon_gain)
+{
+	const AudioTrack *icon = &mix->icon->track;
+	const int16_t *src = icon->samples;
+	int16_t *dst = track->samples;
+	size_t total = speak_queue_mix_frames(mix, track->sample_rate);
+	size_t frames = MIN((size_t) track->num_samples, total - mix->pos);
+	size_t frame;
+	int c;
+
+	mix->rate = track->sample_rate;
+	if (icon->sample_rate == track->sample_rate
+	    && icon->num_channels == track->num_channels) {
+		speak_queue_mix_s16(dst, src + mix->pos * icon->num_channels,
+				    frames * track->num_channels,
+				    speech_gain, icon_gain);
+	} else {
+		/* Nearest neighbour conversion, icons rarely need it */
+		for (frame = 0; frame < frames; frame++) {
+			size_t src_frame = (mix->pos + frame)
+				* icon->sample_rate / track->sample_rate;
+
+			for (c = 0; c < track->num_channels; c++) {
+				int16_t s = src[src_frame * icon->num_channels
+						+ MIN(c, icon->num_channels - 1)];
+				speak_queue_mix_s16(&dst[frame * track->num_channels + c],
+						    &s, 1, speech_gain, icon_gain);
+			}
+		}
+	}
+	mix->pos += frames;
+	return mix->pos < total;
+}
+
+/* Mixes the pending icons into the speech about to be played */
+static void speak_queue_mix_into(AudioTrack *track, AudioFormat *format)
+{
+	int speech_gain = g_atomic_int_get(&speak_queue_mix_speech_gain);
+	int icon_gain = g_atomic_int_get(&speak_queue_mix_icon_gain);
+	GList *cur, *next;
+
+	if (track->bits != 16 || track->sample_rate <= 0)
+		return;
+
+	pthread_mutex_lock(&speak_queue_mix_mutex);
+	if (speak_queue_mixes.head && *format != SPEAK_QUEUE_NATIVE) {
+		/* Icons are decoded as native 16bit, bring the speech there */
+		spd_audio_swap16(track->samples,
+				 (size_t) track->num_samples * track->num_channels);
+		*format = SPEAK_QUEUE_NATIVE;
+	}
+	for (cur = speak_queue_mixes.head; cur; cur = next) {
+		speak_queue_mix *mix = cur->data;
+
+		next = cur->next;
+		if (!speak_queue_mix_icon(track, mix, speech_gain, icon_gain)) {
+			g_queue_delete_link(&speak_queue_mixes, cur);
+			speak_queue_icon_unref(mix->icon);
+			g_free(mix);
+		}
+	}
+	pthread_mutex_unlock(&speak_queue_mix_mutex);
+}
+
+/* Plays what remains of the icons once the speech is over */
+static void speak_queue_mix_drain(void)
+{
+	speak_queue_mix *mix;
+
+	for (;;) {
+		pthread_mutex_lock(&speak_queue_mix_mutex);
+		mix = g_queue_pop_head(&speak_queue_mixes);
+		pthread_mutex_unlock(&speak_queue_mix_mutex);
+		if (!mix)
+			break;
+
+		speak_queue_icon *icon = mix->icon;
+		size_t done = mix->rate ? mix->pos * icon->track.sample_rate
+			/ mix->rate : 0;
+
+		if (done < (size_t) icon->track.num_samples) {
+			AudioTrack track = icon->track;
+
+			track.num_samples -= done;
+			track.samples = (short *) icon->track.samples
+				+ done * track.num_channels;
+			if (speak_queue_configured) {
+				spd_audio_end(module_audio_id);
+				speak_queue_configured = FALSE;
+			}
+			speak_queue_send_track_to_audio(&track, SPEAK_QUEUE_NATIVE);
+			spd_audio_end(module_audio_id);
+			speak_queue_configured = FALSE;
+		}
+		speak_queue_icon_unref(icon);
+		g_free(mix);
+	}
+}
+
+static void speak_queue_mix_clear(void)
+{
+	speak_queue_mix *mix;
+
+	pthread_mutex_lock(&speak_queue_mix_mutex);
+	while ((mix = g_queue_pop_head(&speak_queue_mixes)) != NULL) {
+		speak_queue_icon_unref(mix->icon);
+		g_free(mix);
+	}
+	pthread_mutex_unlock(&speak_queue_mix_mutex);
+}
+
+gboolean module_speak_queue_mix_sound_icon(const char *filename)
+{
+	speak_queue_mix *mix;
+	speak_queue_icon *icon;
+
+	if (g_atomic_int_get((gint *) &speak_queue_state) != SPEAKING
+	    || g_atomic_int_get(&speak_queue_stop_requested))
+		return FALSE;
+
+	icon = speak_queue_icon_get(filename);
+	if (!icon)
+		return FALSE;
+	if (icon->track.sample_rate <= 0) {
+		speak_queue_icon_unref(icon);
+		return FALSE;
+	}
+
+	mix = g_new(speak_queue_mix, 1);
+	mix->icon = icon;
+	mix->pos = 0;
+	mix->rate = 0;
+	pthread_mutex_lock(&speak_queue_mix_mutex);
+	g_queue_push_tail(&speak_queue_mixes, mix);
+	pthread_mutex_unlock(&speak_queue_mix_mutex);
+	return TRUE;
+}
+
+void module_speak_queue_set_first_write_callback(void (*callback) (void))
+{
+	speak_queue_first_write_callback = callback;
+}
+
+void module_speak_queue_set_mix_gain(int speech_percent, int icon_percent)
+{
+	g_atomic_int_set(&speak_queue_mix_speech_gain, speech_percent * 256 / 100);
+	g_atomic_int_set(&speak_queue_mix_icon_gain, icon_percent * 256 / 100);
+}
+
 static gboolean speak_queue_send_to_audio(speak_queue_entry * playback_queue_entry)
 {
+	speak_queue_mix_into(&playback_queue_entry->data.audio.track,
+			     &playback_queue_entry->data.audio.format);
 	return speak_queue_send_track_to_audio(&playback_queue_entry->data.audio.track,
 					        playback_queue_entry->data.audio.format);
 }
 
+/* With players which report their delay, audio is fed without waiting for
+ * it to be played, keeping SPEAK_QUEUE_AHEAD_US ahead.  Index marks are
+ * then given the time at which the audio before them is heard, and the mark
+ * thread reports them at that time, whatever the playback thread is
+ * blocked on.  */
+#define SPEAK_QUEUE_AHEAD_US 100000
+/* Longest sleep of the playback thread, so that stops are noticed */
+#define SPEAK_QUEUE_POLL_US 10000
+
+typedef struct {
+	char *markId;
+	gint64 time;		/* speak_queue_now() at which it is heard */
+} speak_queue_pending_mark;
+
+static GQueue speak_queue_pending_marks = G_QUEUE_INIT;
+
+/* Microseconds of CLOCK_MONOTONIC, which speak_queue_marks_cond uses */
+static gint64 speak_queue_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* Reports an index mark, returns TRUE if we pause there */
+static gboolean speak_queue_report_mark(const char *markId)
+{
+	gboolean finished = FALSE;
+
+	DBG(DBG_MODNAME " reporting index mark |%s|.", markId);
+	module_report_index_mark(markId);
+	DBG(DBG_MODNAME " index mark reported.");
+	pthread_mutex_lock(&speak_queue_mutex);
+	if (speak_queue_state == SPEAKING
+	    && speak_queue_pause_state == SPEAK_QUEUE_PAUSE_REQUESTED
+	    && speak_queue_stop_or_pause_sleeping
+	    && g_str_has_prefix(markId, "__spd_")) {
+		DBG(DBG_MODNAME " Pause requested in playback thread.  Stopping.");
+		speak_queue_stop_requested = TRUE;
+		speak_queue_pause_state = SPEAK_QUEUE_PAUSE_MARK_REPORTED;
+		pthread_cond_signal(&speak_queue_stop_or_pause_cond);
+		finished = TRUE;
+	}
+	pthread_mutex_unlock(&speak_queue_mutex);
+	return finished;
+}
+
+static void speak_queue_pending_mark_free(speak_queue_pending_mark * mark)
+{
+	g_free(mark->markId);
+	g_free(mark);
+}
+
+/* Takes the mark over, returns TRUE if it was reported and we pause there */
+static gboolean speak_queue_queue_mark(char *markId)
+{
+	speak_queue_pending_mark *mark, *last;
+	int delay = -1;
+	gboolean finished;
+
+	if (speak_queue_configured)
+		delay = spd_audio_get_delay(module_audio_id);
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	if (delay <= 0 && g_queue_is_empty(&speak_queue_pending_marks)
+	    && !speak_queue_marks_reporting) {
+		pthread_mutex_unlock(&speak_queue_marks_mutex);
+		finished = speak_queue_report_mark(markId);
+		g_free(markId);
+		return finished;
+	}
+
+	mark = g_new(speak_queue_pending_mark, 1);
+	mark->markId = markId;
+	mark->time = speak_queue_now() + MAX(delay, 0);
+	last = g_queue_peek_tail(&speak_queue_pending_marks);
+	if (last && last->time > mark->time)
+		mark->time = last->time;
+	g_queue_push_tail(&speak_queue_pending_marks, mark);
+	pthread_cond_broadcast(&speak_queue_marks_cond);
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+	return FALSE;
+}
+
+/* Mark thread: reports the marks when they are heard.  After a pause mark,
+ * stop is requested and the rest are left for speak_queue_drop_marks().  */
+static void *speak_queue_marks(void *nothing)
+{
+	speak_queue_pending_mark *mark;
+	struct timespec ts;
+
+	DBG(DBG_MODNAME " Mark thread starting.......");
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	while (!speak_queue_marks_quit) {
+		mark = g_queue_peek_head(&speak_queue_pending_marks);
+		if (!mark || g_atomic_int_get(&speak_queue_stop_requested)) {
+			pthread_cond_wait(&speak_queue_marks_cond,
+					  &speak_queue_marks_mutex);
+			continue;
+		}
+		if (mark->time > speak_queue_now()) {
+			ts.tv_sec = mark->time / G_USEC_PER_SEC;
+			ts.tv_nsec = mark->time % G_USEC_PER_SEC * 1000;
+			pthread_cond_timedwait(&speak_queue_marks_cond,
+					       &speak_queue_marks_mutex, &ts);
+			continue;
+		}
+
+		g_queue_pop_head(&speak_queue_pending_marks);
+		speak_queue_marks_reporting = TRUE;
+		pthread_mutex_unlock(&speak_queue_marks_mutex);
+		speak_queue_report_mark(mark->markId);
+		speak_queue_pending_mark_free(mark);
+		pthread_mutex_lock(&speak_queue_marks_mutex);
+		speak_queue_marks_reporting = FALSE;
+		/* The playback thread may wait for all of them */
+		pthread_cond_broadcast(&speak_queue_marks_cond);
+	}
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+
+	DBG(DBG_MODNAME " Mark thread ended.......");
+	return NULL;
+}
+
+static void speak_queue_drop_marks(void)
+{
+	speak_queue_pending_mark *mark;
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	while ((mark = g_queue_pop_head(&speak_queue_pending_marks)) != NULL)
+		speak_queue_pending_mark_free(mark);
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+}
+
+/* Waits until the remaining marks are reported, before ending playback.  On
+ * stop, the pending marks are left for speak_queue_drop_marks(), but the one
+ * being reported has to be out before the end gets reported. */
+static void speak_queue_wait_marks(void)
+{
+	struct timespec ts;
+	gint64 until;
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	while (speak_queue_marks_reporting
+	       || (!g_queue_is_empty(&speak_queue_pending_marks)
+		   && !g_atomic_int_get(&speak_queue_stop_requested))) {
+		/* Stops do not signal us */
+		until = speak_queue_now() + SPEAK_QUEUE_POLL_US;
+		ts.tv_sec = until / G_USEC_PER_SEC;
+		ts.tv_nsec = until % G_USEC_PER_SEC * 1000;
+		pthread_cond_timedwait(&speak_queue_marks_cond,
+				       &speak_queue_marks_mutex, &ts);
+	}
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+}
+
+/* Sleeps until the player is only SPEAK_QUEUE_AHEAD_US ahead */
+static void speak_queue_pace(void)
+{
+	int delay;
+
+	if (!speak_queue_configured
+	    || !spd_audio_can_feed_async(module_audio_id))
+		return;
+
+	while (!g_atomic_int_get(&speak_queue_stop_requested)) {
+		delay = spd_audio_get_delay(module_audio_id);
+		if (delay <= SPEAK_QUEUE_AHEAD_US)
+			break;
+		g_usleep(MIN(delay - SPEAK_QUEUE_AHEAD_US, SPEAK_QUEUE_POLL_US));
+	}
+}
+
 /* Playback thread. */
 static void *speak_queue_play(void *nothing)
 {
 	char *markId;
 	speak_queue_entry *playback_queue_entry = NULL;
+	unsigned schedule_generation = 0;
 
 	DBG(DBG_MODNAME " Playback thread starting.......");
 
@@ -443,6 +1454,7 @@ static void *speak_queue_play(void *nothing)
 		if (speak_queue_close_requested)
 			break;
 		pthread_mutex_unlock(&speak_queue_mutex);
+		spd_playback_schedule_apply(&schedule_generation);
 
 		while (1) {
 			gboolean finished = FALSE;
@@ -455,30 +1467,15 @@ static void *speak_queue_play(void *nothing)
 			switch (playback_queue_entry->type) {
 			case SPEAK_QUEUE_QET_AUDIO:
 				speak_queue_send_to_audio(playback_queue_entry);
+				speak_queue_pace();
 				break;
 			case SPEAK_QUEUE_QET_INDEX_MARK:
 				markId = playback_queue_entry->data.markId;
-				DBG(DBG_MODNAME " reporting index mark |%s|.",
-				    markId);
-				module_report_index_mark(markId);
-				DBG(DBG_MODNAME " index mark reported.");
-				pthread_mutex_lock(&speak_queue_mutex);
-				if (speak_queue_state == SPEAKING
-				    && speak_queue_pause_state ==
-				    SPEAK_QUEUE_PAUSE_REQUESTED
-				    && speak_queue_stop_or_pause_sleeping
-				    && g_str_has_prefix(markId, "__spd_")) {
-					DBG(DBG_MODNAME " Pause requested in playback thread.  Stopping.");
-					speak_queue_stop_requested = TRUE;
-					speak_queue_pause_state =
-					    SPEAK_QUEUE_PAUSE_MARK_REPORTED;
-					pthread_cond_signal
-					    (&speak_queue_stop_or_pause_cond);
-					finished = TRUE;
-				}
-				pthread_mutex_unlock(&speak_queue_mutex);
+				playback_queue_entry->data.markId = NULL;
+				finished = speak_queue_queue_mark(markId);
 				break;
 			case SPEAK_QUEUE_QET_SOUND_ICON:
+				speak_queue_wait_marks();
 				if (speak_queue_configured) {
 					spd_audio_end(module_audio_id);
 					speak_queue_configured = FALSE;
@@ -493,13 +1490,17 @@ static void *speak_queue_play(void *nothing)
 						speak_queue_state = SPEAKING;
 						report_begin = TRUE;
 					}
+					speak_queue_first_write = TRUE;
 					pthread_mutex_unlock
 					    (&speak_queue_mutex);
+					speak_queue_stats_begin();
 					if (report_begin)
 						module_report_event_begin();
 					break;
 				}
 			case SPEAK_QUEUE_QET_END:
+				speak_queue_wait_marks();
+				speak_queue_mix_drain();
 				if (speak_queue_configured) {
 					spd_audio_end(module_audio_id);
 					speak_queue_configured = FALSE;
@@ -535,6 +1536,8 @@ static void *speak_queue_play(void *nothing)
 			if (finished)
 				break;
 		}
+		speak_queue_wait_marks();
+		speak_queue_drop_marks();
 		if (speak_queue_configured) {
 			spd_audio_end(module_audio_id);
 			speak_queue_configured = FALSE;
@@ -547,6 +1550,25 @@ static void *speak_queue_play(void *nothing)
 	return 0;
 }
 
+void module_speak_queue_set_watermarks(int low_ms, int high_ms)
+{
+	if (high_ms < 0)
+		high_ms = 0;
+	if (low_ms < 0 || low_ms > high_ms)
+		low_ms = high_ms;
+	DBG(DBG_MODNAME " Buffering between %d and %d ms of audio.",
+	    low_ms, high_ms);
+	g_atomic_int_set(&speak_queue_low_us, low_ms * 1000);
+	g_atomic_int_set(&speak_queue_high_us, high_ms * 1000);
+	/* The producer may now have room */
+	spd_semaphore_post(&playback_queue_room_sem);
+}
+
+int module_speak_queue_depth_ms(void)
+{
+	return g_atomic_int_get(&playback_queue_duration) / 1000;
+}
+
 int module_speak_queue_stop_requested(void)
 {
 	return speak_queue_stop_requested;
@@ -558,6 +1580,7 @@ void module_speak_queue_flush(void)
 	speak_queue_flush_requested = TRUE;
 	pthread_cond_signal(&playback_queue_room_condition);
 	pthread_mutex_unlock(&speak_queue_mutex);
+	spd_semaphore_post(&playback_queue_room_sem);
 }
 
 void module_speak_queue_stop(void)
@@ -595,22 +1618,40 @@ void module_speak_queue_terminate(void)
 	speak_queue_close_requested = TRUE;
 
 	pthread_cond_broadcast(&playback_queue_room_condition);
-	pthread_cond_signal(&playback_queue_data_condition);
 
 	pthread_cond_signal(&speak_queue_play_cond);
 	pthread_cond_signal(&speak_queue_stop_or_pause_cond);
 	pthread_mutex_unlock(&speak_queue_mutex);
+	spd_semaphore_post(&playback_queue_room_sem);
+	spd_semaphore_post(&playback_queue_data_sem);
 
 	DBG(DBG_MODNAME " Joining play thread.");
 	pthread_join(speak_queue_play_thread, NULL);
 	DBG(DBG_MODNAME " Joining stop thread.");
 	pthread_join(speak_queue_stop_or_pause_thread, NULL);
+
+	pthread_mutex_lock(&speak_queue_marks_mutex);
+	speak_queue_marks_quit = TRUE;
+	pthread_cond_broadcast(&speak_queue_marks_cond);
+	pthread_mutex_unlock(&speak_queue_marks_mutex);
+	DBG(DBG_MODNAME " Joining mark thread.");
+	pthread_join(speak_queue_marks_thread, NULL);
 }
 
 void module_speak_queue_free(void)
 {
+	guint hits, misses;
+	int i;
+
 	DBG(DBG_MODNAME " Freeing resources.");
 	speak_queue_clear_playback_queue();
+
+	module_speak_queue_pool_stats(&hits, &misses);
+	DBG(DBG_MODNAME " %u allocations out of %u came from the pools.",
+	    hits, hits + misses);
+	speak_queue_pool_clear(&speak_queue_entry_pool);
+	for (i = 0; i < SPEAK_QUEUE_POOL_CLASSES; i++)
+		speak_queue_pool_clear(&speak_queue_samples_pool[i]);
 }
 
 /* Stop or Pause thread. */
@@ -631,9 +1672,10 @@ static void *speak_queue_stop_or_pause(void *nothing)
 		if (speak_queue_close_requested)
 			break;
 
-		pthread_cond_signal(&playback_queue_data_condition);
 		pthread_cond_broadcast(&playback_queue_room_condition);
 		pthread_mutex_unlock(&speak_queue_mutex);
+		spd_semaphore_post(&playback_queue_data_sem);
+		spd_semaphore_post(&playback_queue_room_sem);
 
 		if (module_audio_id) {
 			pthread_mutex_lock(&speak_queue_mutex);
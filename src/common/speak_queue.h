@@ -164,6 +164,71 @@ typedef struct {
  * threads.  */
 int module_speak_queue_init(int maxsize, char **status_info);
 
+/* Bound the queue by milliseconds of buffered audio instead of the maxsize
+ * samples given to module_speak_queue_init().  Adding audio waits when
+ * there is more than high_ms, until there is no more than low_ms.  A high_ms
+ * of 0 goes back to counting samples.  */
+void module_speak_queue_set_watermarks(int low_ms, int high_ms);
+
+/* Milliseconds of audio currently waiting in the queue.  */
+int module_speak_queue_depth_ms(void);
+
+/* How many entry and sample buffer allocations were served by the pools
+ * of the queue, and how many had to be malloc'ed.  */
+void module_speak_queue_pool_stats(guint *hits, guint *misses);
+
+/* Decoded sound icons are kept in a cache of at most max_bytes of samples,
+ * and reloaded when the file is modified.  */
+void module_speak_queue_set_sound_icon_cache(size_t max_bytes);
+
+/* Decode the icons of the given folder into the cache, as long as they fit.  */
+void module_speak_queue_preload_sound_icons(const char *dirname);
+
+/* Play the sound icon over the speech being played, returns FALSE when
+ * nothing is being played, the icon then has to be queued as usual.  */
+gboolean module_speak_queue_mix_sound_icon(const char *filename);
+
+/* Gains in percent applied to the speech and to the icons while mixing.  */
+void module_speak_queue_set_mix_gain(int speech_percent, int icon_percent);
+
+/* Have callback called from the playback thread once the first samples of
+ * each message were given to the audio output.  */
+void module_speak_queue_set_first_write_callback(void (*callback) (void));
+
+/* Number of times the playback thread had to wait for more audio in the
+ * middle of a message.  */
+guint module_speak_queue_underruns(void);
+
+/* What the playback thread saw of the audio: the underruns are the waits for
+ * more audio in the middle of a message, first_audio the time from the
+ * beginning of a message to the first samples given to the device, xruns and
+ * suspends what the audio plugin reported.  Times are in microseconds.  */
+typedef struct {
+	guint messages;
+	guint underruns;
+	guint64 underrun_us;
+	guint underrun_max_us;
+	guint64 first_audio_us;
+	guint first_audio_max_us;
+	guint xruns;
+	guint suspends;
+} SPDSpeakQueueStats;
+
+/* Also account the next messages in stats, until another one is set, NULL
+ * only accounting them in the global stats.  */
+void module_speak_queue_set_stats(SPDSpeakQueueStats *stats);
+
+/* Stop accounting anything in stats, to be called before freeing it.  */
+void module_speak_queue_unset_stats(SPDSpeakQueueStats *stats);
+
+/* Copy stats, or the global stats if NULL, as they are consistent.  */
+void module_speak_queue_get_stats(const SPDSpeakQueueStats *stats,
+				  SPDSpeakQueueStats *copy);
+
+/* Gain in 1/256th, at most 256, applied to the 16bit audio added from now
+ * on, see spd_audio_volume_gain().  */
+void module_speak_queue_set_gain(int gain);
+
 
 /* To be called from module_speak before synthesizing the voice.  */
 int module_speak_queue_before_synth(void);
@@ -172,7 +237,9 @@ int module_speak_queue_before_synth(void);
 /* To be called from the synth callback before looking through its events.  */
 int module_speak_queue_before_play(void);
 
-/* To be called from the synth callback to push different types of events.  */
+/* To be called from the synth callback to push different types of events.
+ * These do not wait for the playback thread, except when the queue is full.
+ * Pushing from several threads works but serializes them.  */
 gboolean module_speak_queue_add_audio(const AudioTrack *track, AudioFormat format);
 gboolean module_speak_queue_add_mark(const char *markId);
 gboolean module_speak_queue_add_sound_icon(const char *filename);
@@ -41,6 +41,12 @@
  *     lot less useful, as speech attributes like volume, pitch and rate would
  *     have to be set again.
  *
+ *   Long texts are split at sentence ends into chunks of about
+ *   BaratinooChunkSize bytes, each sent in its own buffer after the previous
+ *   one is spoken, so that the engine does not have to process the whole text
+ *   before speech starts.  Only the places where no voice change, emphasis or
+ *   say-as is pending are split.
+ *
  * - The output uses the signal buffer instead of callback.
  * The output callback sends sound to the output module phonem by
  * phonem, which cause noise parasits with ALSA due to a reset of
@@ -229,13 +235,14 @@ static void baratinoo_set_synthesis_voice(char *synthesis_voice);
 static void baratinoo_trace_cb(BaratinooTraceLevel level, int engine_num, const char *source, const void *data, const char *format, va_list args);
 static int baratinoo_output_signal(void *privateData, const void *address, int length);
 /* SSML conversion functions */
-static void append_ssml_as_proprietary(const Engine *engine, GString *buf, const char *data, gsize size);
+static void append_ssml_as_proprietary(const Engine *engine, GString *buf, GArray *breaks, const char *data, gsize size);
 
 /* Module configuration options */
 MOD_OPTION_1_STR(BaratinooConfigPath);
 MOD_OPTION_1_INT(BaratinooSampleRate);
 MOD_OPTION_1_INT(BaratinooResponsiveness);
 MOD_OPTION_1_INT(BaratinooQueueSize);
+MOD_OPTION_1_INT(BaratinooChunkSize);
 MOD_OPTION_1_INT(BaratinooMinRate);
 MOD_OPTION_1_INT(BaratinooNormalRate);
 MOD_OPTION_1_INT(BaratinooMaxRate);
@@ -275,6 +282,9 @@ int module_load(void)
 	/* Default to 20s queuing */
 	MOD_OPTION_1_INT_REG(BaratinooQueueSize, 20*BaratinooSampleRate);
 
+	/* Split texts at the first sentence end after that many bytes */
+	MOD_OPTION_1_INT_REG(BaratinooChunkSize, 256);
+
 	/* Speech rate */
 	MOD_OPTION_1_INT_REG(BaratinooMinRate, -100);
 	MOD_OPTION_1_INT_REG(BaratinooNormalRate, 0);
@@ -392,10 +402,82 @@ SPDVoice **module_list_voices(void)
 	return engine->voice_list;
 }
 
+/* Give a chunk of text to the engine, returns 0 on success */
+static int baratinoo_set_input(Engine *engine, const char *text)
+{
+	DBG(DBG_MODNAME "Sending buffer: %s", text);
+
+	engine->buffer = BCinputTextBufferNew(BARATINOO_PROPRIETARY_PARSING,
+					      BARATINOO_UTF8, engine->voice, 0);
+	if (!engine->buffer) {
+		DBG(DBG_MODNAME "Failed to allocate input buffer");
+		return -1;
+	}
+
+	if (!BCinputTextBufferInit(engine->buffer, text)) {
+		DBG(DBG_MODNAME "Failed to initialize input buffer");
+		goto err;
+	}
+
+	if (BCinputTextBufferSetInEngine(engine->buffer, engine->engine) != BARATINOO_READY) {
+		DBG(DBG_MODNAME "Failed to set input buffer");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	BCinputTextBufferDelete(engine->buffer);
+	engine->buffer = NULL;
+	return -1;
+}
+
+/* Speak the input which was set, returns whether we were stopped */
+static gboolean baratinoo_process(Engine *engine)
+{
+	BARATINOOC_STATE state;
+
+	do {
+		if (engine->stop_requested || (engine->pause_requested && engine->pause_index_sent)) {
+			BCpurge(engine->engine);
+			engine->buffer = NULL;
+			return TRUE;
+		}
+
+		/* Process server events in case we were told to stop in between */
+		module_process(STDIN_FILENO, 0);
+
+		state = BCprocessLoop(engine->engine, BaratinooResponsiveness);
+		if (state == BARATINOO_EVENT) {
+			BaratinooEvent event = BCgetEvent(engine->engine);
+			if (event.type == BARATINOO_MARKER_EVENT) {
+				DBG(DBG_MODNAME "Reached mark '%s' at sample %lu", event.data.marker.name, event.sampleStamp);
+				module_report_index_mark(event.data.marker.name);
+				if (engine->pause_requested &&
+					!strncmp(event.data.marker.name,
+						INDEX_MARK_BODY,
+						INDEX_MARK_BODY_LEN)) {
+					engine->pause_index_sent = 1;
+				}
+			}
+		}
+	} while (state == BARATINOO_RUNNING || state == BARATINOO_EVENT);
+
+	BCinputTextBufferDelete(engine->buffer);
+	engine->buffer = NULL;
+
+	return FALSE;
+}
+
 void module_speak_sync(const gchar *data, size_t bytes, SPDMessageType msgtype)
 {
 	Engine *engine = &baratinoo_engine;
 	GString *buffer = NULL;
+	GString *chunk = NULL;
+	/* Where buffer can be split, after the speech parameters */
+	GArray *breaks;
+	gsize start;
+	guint i;
 	int rate;
 
 	DBG(DBG_MODNAME "Speech requested");
@@ -418,15 +500,8 @@ void module_speak_sync(const gchar *data, size_t bytes, SPDMessageType msgtype)
 	UPDATE_PARAMETER(voice_type, baratinoo_set_voice_type);
 	UPDATE_STRING_PARAMETER(voice.name, baratinoo_set_synthesis_voice);
 
-	engine->buffer = BCinputTextBufferNew(BARATINOO_PROPRIETARY_PARSING,
-					      BARATINOO_UTF8, engine->voice, 0);
-	if (!engine->buffer) {
-		DBG(DBG_MODNAME "Failed to allocate input buffer");
-		module_speak_error();
-		goto err;
-	}
-
 	buffer = g_string_new(NULL);
+	breaks = g_array_new(FALSE, FALSE, sizeof(gsize));
 
 	/* Apply speech parameters */
 	if (msg_settings.rate < 0)
@@ -446,6 +521,9 @@ void module_speak_sync(const gchar *data, size_t bytes, SPDMessageType msgtype)
 		g_string_append_printf(buffer, "\\volume{%+d%%}",
 				       msg_settings.volume);
 	}
+	/* Each chunk starts with them */
+	start = buffer->len;
+	chunk = g_string_new_len(buffer->str, start);
 
 	switch (msgtype) {
 	case SPD_MSGTYPE_SPELL:	/* FIXME: use \spell when Voxygen actuall implements it */
@@ -470,64 +548,44 @@ void module_speak_sync(const gchar *data, size_t bytes, SPDMessageType msgtype)
 		break;
 	default: /* FIXME: */
 	case SPD_MSGTYPE_TEXT:
-		append_ssml_as_proprietary(engine, buffer, data, bytes);
+		append_ssml_as_proprietary(engine, buffer, breaks, data, bytes);
 		break;
 	}
 
 	DBG(DBG_MODNAME "SSML input: %s", data);
-	DBG(DBG_MODNAME "Sending buffer: %s", buffer->str);
-	if (!BCinputTextBufferInit(engine->buffer, buffer->str)) {
-		DBG(DBG_MODNAME "Failed to initialize input buffer");
-		module_speak_error();
-		goto err;
-	}
-
-	g_string_free(buffer, TRUE);
-	buffer = NULL;
+	DBG(DBG_MODNAME "Split in %u chunks", breaks->len + 1);
 
 	engine->stop_requested = FALSE;
 	engine->pause_requested = FALSE;
 	engine->pause_index_sent = FALSE;
 
-	BARATINOOC_STATE state = BARATINOO_READY;
+	for (i = 0; i <= breaks->len; i++) {
+		gsize end = i < breaks->len ? g_array_index(breaks, gsize, i)
+					    : buffer->len;
 
-	state = BCinputTextBufferSetInEngine(engine->buffer, engine->engine);
-	if (state != BARATINOO_READY) {
-		DBG(DBG_MODNAME "Failed to set input buffer");
-		module_speak_error();
-		goto out;
-	}
-
-	module_speak_ok();
+		if (i > 0)
+			/* The speech parameters, and the next part */
+			g_string_truncate(chunk, start);
+		g_string_append_len(chunk, buffer->str + start, end - start);
+		start = end;
 
-	module_report_event_begin();
-	do {
-		if (engine->stop_requested || (engine->pause_requested && engine->pause_index_sent)) {
-			BCpurge(engine->engine);
-			engine->buffer = NULL;
+		if (baratinoo_set_input(engine, chunk->str) != 0) {
+			if (i == 0) {
+				module_speak_error();
+				goto out;
+			}
 			break;
 		}
 
-		/* Process server events in case we were told to stop in between */
-		module_process(STDIN_FILENO, 0);
-
-		state = BCprocessLoop(engine->engine, BaratinooResponsiveness);
-		if (state == BARATINOO_EVENT) {
-			BaratinooEvent event = BCgetEvent(engine->engine);
-			if (event.type == BARATINOO_MARKER_EVENT) {
-				DBG(DBG_MODNAME "Reached mark '%s' at sample %lu", event.data.marker.name, event.sampleStamp);
-				module_report_index_mark(event.data.marker.name);
-				if (engine->pause_requested &&
-					!strncmp(event.data.marker.name,
-						INDEX_MARK_BODY,
-						INDEX_MARK_BODY_LEN)) {
-					engine->pause_index_sent = 1;
-				}
-			}
+		if (i == 0) {
+			module_speak_ok();
+			module_report_event_begin();
 		}
-	} while (state == BARATINOO_RUNNING || state == BARATINOO_EVENT);
 
-out:
+		if (baratinoo_process(engine))
+			break;
+	}
+
 	if (engine->pause_requested)
 		module_report_event_pause();
 	else if (engine->stop_requested)
@@ -535,21 +593,12 @@ out:
 	else
 		module_report_event_end();
 
-	BCinputTextBufferDelete(engine->buffer);
-	engine->buffer = NULL;
-
 	DBG(DBG_MODNAME "leaving module_speak_sync() normally");
-	return;
-
-err:
-	if (buffer)
-		g_string_free(buffer, TRUE);
-	if (engine->buffer) {
-		BCinputTextBufferDelete(engine->buffer);
-		engine->buffer = NULL;
-	}
 
-	return;
+out:
+	g_string_free(buffer, TRUE);
+	g_string_free(chunk, TRUE);
+	g_array_free(breaks, TRUE);
 }
 
 int module_stop(void)
@@ -978,8 +1027,26 @@ typedef struct {
 	/* Voice ID stack for the current element */
 	int voice_stack[32];
 	unsigned int voice_stack_len;
+	/* Offsets in buffer where it can be split into chunks */
+	GArray *breaks;
+	gsize last_break;
+	/* Number of \emph and \sayas not closed yet */
+	unsigned int open;
+	/* The last character ended a sentence */
+	gboolean sentence_end;
 } SsmlPraserState;
 
+/* Whether the buffer can be split here, the state of the engine being then
+   what it is at the start of a buffer */
+static gboolean ssml2baratinoo_can_break(const SsmlPraserState *state)
+{
+	return state->breaks != NULL && BaratinooChunkSize > 0
+	    && state->open == 0
+	    && (state->voice_stack_len == 0
+		|| state->voice_stack[state->voice_stack_len - 1] == state->engine->voice)
+	    && state->buffer->len - state->last_break >= (gsize) BaratinooChunkSize;
+}
+
 /* Adds a language change command for @p lang if appropriate */
 static void ssml2baratinoo_push_lang(SsmlPraserState *state, const char *lang)
 {
@@ -1059,6 +1126,7 @@ static void ssml2baratinoo_start_element(GMarkupParseContext *ctx,
 		int i = attribute_index(attribute_names, "level");
 		g_string_append_printf(state->buffer, "\\emph<{%s}",
 				       i < 0 ? "" : attribute_values[i]);
+		state->open++;
 	} else if (strcmp(element, "say-as") == 0) {
 		int i_as = attribute_index(attribute_names, "interpret-as");
 		int i_fmt = attribute_index(attribute_names, "format");
@@ -1077,6 +1145,7 @@ static void ssml2baratinoo_start_element(GMarkupParseContext *ctx,
 				       i_as < 0 ? "" : attribute_values[i_as],
 				       i_fmt < 0 ? "" : attribute_values[i_fmt],
 				       i_detail < 0 ? "" : attribute_values[i_detail]);
+		state->open++;
 	} else {
 		/* ignore other elements */
 		/* TODO: handle more elements */
@@ -1092,8 +1161,10 @@ static void ssml2baratinoo_end_element(GMarkupParseContext *ctx,
 
 	if (strcmp(element, "emphasis") == 0) {
 		g_string_append(state->buffer, "\\emph>{}");
+		state->open--;
 	} else if (strcmp(element, "say-as") == 0) {
 		g_string_append(state->buffer, "\\sayas>{}");
+		state->open--;
 	}
 
 	ssml2baratinoo_pop_lang(state);
@@ -1179,6 +1250,15 @@ static void ssml2baratinoo_text(GMarkupParseContext *ctx,
 			do_not_say = ((msg_settings.punctuation_mode == SPD_PUNCT_NONE &&
 					g_utf8_strchr(BaratinooNoIntonationList, -1, ch)));
 
+			if (g_unichar_isspace(ch) && state->sentence_end
+			    && ssml2baratinoo_can_break(state)) {
+				/* Start the next chunk with this space */
+				state->last_break = state->buffer->len;
+				g_array_append_val(state->breaks, state->last_break);
+			}
+			state->sentence_end = ch == '.' || ch == '!' || ch == '?'
+			    || ch == 0x2026 /* … */;
+
 			if (say_as_char)
 				g_string_append(state->buffer, "\\sayas<{characters}");
 			if (!do_not_say)
@@ -1214,13 +1294,15 @@ static void ssml2baratinoo_text(GMarkupParseContext *ctx,
 /**
  * @brief Converts SSML data to Baratinoo's proprietary format.
  * @param buf A buffer to write to.
+ * @param breaks Where to add the offsets in @p buf where it can be split,
+ *               or NULL.
  * @param data SSML data to convert.
  * @param size Length of @p data
  *
  * @warning Only a subset of the input SSML is currently translated, the rest
  *          being discarded.
  */
-static void append_ssml_as_proprietary(const Engine *engine, GString *buf, const char *data, gsize size)
+static void append_ssml_as_proprietary(const Engine *engine, GString *buf, GArray *breaks, const char *data, gsize size)
 {
 	/* FIXME: we could possibly use SSML mode, but the Baratinoo parser is
 	 * very strict and *requires* "xmlns", "version" and "lang" attributes
@@ -1237,6 +1319,10 @@ static void append_ssml_as_proprietary(const Engine *engine, GString *buf, const
 		.engine = engine,
 		.buffer = buf,
 		.voice_stack_len = 0,
+		.breaks = breaks,
+		.last_break = buf->len,
+		.open = 0,
+		.sentence_end = FALSE,
 	};
 	GMarkupParseContext *ctx;
 	GError *err = NULL;
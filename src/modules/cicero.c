@@ -30,7 +30,6 @@
 #include <fcntl.h>
 #include <langinfo.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 
 #include "module_utils.h"
 
@@ -46,7 +45,7 @@ static int initialized = 0;
 static int cicero_speaking = 0;
 
 static pthread_t cicero_speaking_thread;
-static sem_t *cicero_semaphore;
+static SPDSemaphore cicero_semaphore;
 
 static char *cicero_message;
 static SPDMessageType cicero_message_type;
@@ -75,6 +74,12 @@ MOD_OPTION_1_STR(CiceroExecutable)
 */
 static int fd1[2], fd2[2];
 
+/*
+** Pipe through which module_stop() wakes up the speaking thread while it
+** waits for the indexes of cicero
+*/
+static int wake_fd[2] = { -1, -1 };
+
 /*
 ** Some internal functions
 */
@@ -113,7 +118,13 @@ static void mywrite(int fd, const void *buf, int len)
 	hasTimedOut(0);
 	do {
 		if ((w = write(fd, pos, len)) < 0) {
-			if (errno == EINTR || errno == EAGAIN)
+			if (errno == EAGAIN) {
+				/* Wait for cicero to read instead of spinning */
+				struct pollfd ufds = { fd, POLLOUT, 0 };
+				poll(&ufds, 1, 100);
+				continue;
+			}
+			if (errno == EINTR)
 				continue;
 			else if (errno == EPIPE) {
 				DBG("Broken pipe\n");
@@ -128,6 +139,14 @@ static void mywrite(int fd, const void *buf, int len)
 		fprintf(stderr, "Pipe write timed out");
 }
 
+/* Throw away what is pending on the non-blocking fd */
+static void drain(int fd)
+{
+	char buf[256];
+
+	while (read(fd, buf, sizeof(buf)) > 0) ;
+}
+
 /* Public functions */
 
 int module_load(void)
@@ -156,7 +175,7 @@ int module_init(char **status_info)
 	(void)signal(SIGPIPE, SIG_IGN);
 
 	DBG("call the pipe system call\n");
-	if (pipe(fd1) < 0 || pipe(fd2) < 0) {
+	if (pipe(fd1) < 0 || pipe(fd2) < 0 || pipe(wake_fd) < 0) {
 		*status_info = g_strdup("Could not create pipe");
 		DBG("Error pipe()\n");
 		return -1;
@@ -206,7 +225,9 @@ int module_init(char **status_info)
 			close(fd1[1]);
 			close(fd2[0]);
 			if (fcntl(fd2[1], F_SETFL, O_NDELAY) < 0
-			    || fcntl(fd1[0], F_SETFL, O_NDELAY) < 0) {
+			    || fcntl(fd1[0], F_SETFL, O_NDELAY) < 0
+			    || fcntl(wake_fd[0], F_SETFL, O_NDELAY) < 0
+			    || fcntl(wake_fd[1], F_SETFL, O_NDELAY) < 0) {
 				DBG("Error fcntl()\n");
 				return -1;
 			}
@@ -215,10 +236,7 @@ int module_init(char **status_info)
 
 	cicero_message = NULL;
 
-	char name[64];
-	snprintf(name, sizeof(name), "/speechd-modules-cicero-%d", getpid());
-	cicero_semaphore = sem_open(name, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, 0);
-	sem_unlink(name);
+	spd_semaphore_init(&cicero_semaphore, 0);
 
 	DBG("Cicero: creating new thread for cicero_tracking\n");
 	cicero_speaking = 0;
@@ -278,7 +296,7 @@ int module_speak(gchar * data, size_t bytes, SPDMessageType msgtype)
 
 	/* Send semaphore signal to the speaking thread */
 	cicero_speaking = 1;
-	sem_post(cicero_semaphore);
+	spd_semaphore_post(&cicero_semaphore);
 
 	DBG("Cicero: leaving module_speak() normally\n\r");
 	return bytes;
@@ -291,6 +309,10 @@ int module_stop(void)
 	DBG("cicero: stop()\n");
 	cicero_stop = 1;
 	mywrite(fd2[1], &c, 1);
+	/* Do not let the speaking thread notice only at its next index */
+	if (write(wake_fd[1], &c, 1) < 0 && errno != EAGAIN)
+		DBG("Could not wake up the speaking thread: %s\n",
+		    strerror(errno));
 	return 0;
 }
 
@@ -320,7 +342,7 @@ int module_close(void)
 	if (module_terminate_thread(cicero_speaking_thread) != 0)
 		return -1;
 
-	sem_close(cicero_semaphore);
+	spd_semaphore_destroy(&cicero_semaphore);
 
 	initialized = 0;
 	return 0;
@@ -330,25 +352,34 @@ int module_close(void)
 
 void *_cicero_speak(void *nothing)
 {
-	char stop_code = 1;
 	unsigned int pos = 0, inx = 0, len = 0;
 	int flag = 0;
 	int bytes;
-	int ret;
-	char buf[CiceroMaxChunkLength], l[5], b[2];
-	struct pollfd ufds = { fd1[0], POLLIN | POLLPRI, 0 };
+	int ret, n, i, got;
+	/* Stop code, say command and text go in a single write */
+	char buf[6 + CiceroMaxChunkLength];
+	unsigned char in[64], b[2];
+	struct pollfd ufds[2] = {
+		{ fd1[0], POLLIN | POLLPRI, 0 },
+		{ wake_fd[0], POLLIN, 0 },
+	};
 
 	DBG("cicero: speaking thread starting.......\n");
 	/* Make interruptible */
 	set_speaking_thread_parameters();
 	while (1) {
-		sem_wait(cicero_semaphore);
+		spd_semaphore_wait(&cicero_semaphore);
 		DBG("Semaphore on\n");
 		len = strlen(cicero_message);
 		cicero_stop = 0;
 		cicero_speaking = 1;
 		cicero_position = 0;
 		pos = 0;
+		/* Forget the wake-ups and the indexes of the previous
+		 * message, which was maybe stopped while cicero still had
+		 * some to send */
+		drain(wake_fd[0]);
+		drain(fd1[0]);
 		module_report_event_begin();
 		while (1) {
 			flag = 0;
@@ -367,7 +398,7 @@ void *_cicero_speak(void *nothing)
 			DBG("Call get_parts: pos=%d, msg=\"%s\" \n", pos,
 			    cicero_message);
 			bytes =
-			    module_get_message_part(cicero_message, buf, &pos,
+			    module_get_message_part(cicero_message, buf + 6, &pos,
 						    CiceroMaxChunkLength,
 						    ".;?!");
 			DBG("Returned %d bytes from get_part\n", bytes);
@@ -377,24 +408,26 @@ void *_cicero_speak(void *nothing)
 				module_report_event_stop();
 				break;
 			}
-			buf[bytes] = 0;
-			DBG("Text to synthesize is '%s'\n", buf);
+			buf[6 + bytes] = 0;
+			DBG("Text to synthesize is '%s'\n", buf + 6);
 
 			if (bytes > 0) {
 				DBG("Speaking ...");
 				DBG("Trying to synthesize text");
-				l[0] = 4;	/* say code for UTF-8 data */
-				l[1] = bytes >> 8;
-				l[2] = bytes & 0xFF;
-				l[3] = 0, l[4] = 0;
-				mywrite(fd2[1], &stop_code, 1);
-				mywrite(fd2[1], l, 5);
-				mywrite(fd2[1], buf, bytes);
+				buf[0] = 1;	/* stop code */
+				buf[1] = 4;	/* say code for UTF-8 data */
+				buf[2] = bytes >> 8;
+				buf[3] = bytes & 0xFF;
+				buf[4] = 0, buf[5] = 0;
+				mywrite(fd2[1], buf, 6 + bytes);
 				cicero_position = 0;
+				got = 0;
 				while (1) {
-					ret = poll(&ufds, 1, 60);
-					if (ret)
-						DBG("poll() system call returned %d, events=%d\n", ret, ufds.events);
+					/* Indexes come as 2 bytes each, but
+					 * may be split between reads */
+					ret = poll(ufds, 2, -1);
+					if (ret < 0 && errno == EINTR)
+						continue;
 					if (ret < 0) {
 						perror("poll");
 						module_report_event_stop();
@@ -402,26 +435,44 @@ void *_cicero_speak(void *nothing)
 						cicero_speaking = 0;
 						break;
 					}
-					if (ret > 0)
-						safe_read(fd1[0], b, 2);
 					if (cicero_stop) {
 						cicero_speaking = 0;
 						module_report_event_stop();
 						flag = 1;
 						break;
 					}
-					if (ret == 0)
+					if (ufds[1].revents)
+						drain(wake_fd[0]);
+					if (!ufds[0].revents)
 						continue;
-					inx = (b[0] << 8 | b[1]);
-					DBG("Tracking: index=%u, bytes=%d\n",
-					    inx, bytes);
-					if (inx == bytes) {
+					n = read(fd1[0], in, sizeof(in));
+					if (n < 0 && (errno == EINTR
+						      || errno == EAGAIN))
+						continue;
+					if (n <= 0) {
+						DBG("cicero closed its output\n");
+						module_report_event_stop();
+						flag = 1;
 						cicero_speaking = 0;
 						break;
-					} else {
-						if (inx)
+					}
+					for (i = 0; i < n && !flag; i++) {
+						b[got++] = in[i];
+						if (got < 2)
+							continue;
+						got = 0;
+						inx = (b[0] << 8 | b[1]);
+						DBG("Tracking: index=%u, bytes=%d\n",
+						    inx, bytes);
+						if (inx == bytes)
+							flag = 1;
+						else if (inx)
 							cicero_position = inx;
 					}
+					if (flag) {
+						flag = 0;
+						break;
+					}
 				}
 			} else {
 				cicero_speaking = 0;
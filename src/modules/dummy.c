@@ -30,7 +30,6 @@
 #include <glib.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 
 #include <speechd_types.h>
 
@@ -46,7 +45,7 @@ static int dummy_speaking = 0;
 
 static pthread_t dummy_speak_thread;
 static pid_t dummy_pid;
-static sem_t *dummy_semaphore;
+static SPDSemaphore dummy_semaphore;
 static gboolean initialized = FALSE;
 
 /* Internal functions prototypes */
@@ -72,10 +71,7 @@ int module_init(char **status_info)
 
 	*status_info = NULL;
 
-	char name[64];
-	snprintf(name, sizeof(name), "/speechd-modules-dummy-%d", getpid());
-	dummy_semaphore = sem_open(name, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, 0);
-	sem_unlink(name);
+	spd_semaphore_init(&dummy_semaphore, 0);
 
 	DBG("Dummy: creating new thread for dummy_speak\n");
 	dummy_speaking = 0;
@@ -121,7 +117,7 @@ int module_speak(gchar * data, size_t bytes, SPDMessageType msgtype)
 
 	/* Send semaphore signal to the speaking thread */
 	dummy_speaking = 1;
-	sem_post(dummy_semaphore);
+	spd_semaphore_post(&dummy_semaphore);
 
 	DBG("Dummy: leaving write() normally\n\r");
 	return bytes;
@@ -170,7 +166,7 @@ int module_close(void)
 	if (module_terminate_thread(dummy_speak_thread) != 0)
 		return -1;
 
-	sem_close(dummy_semaphore);
+	spd_semaphore_destroy(&dummy_semaphore);
 
 	initialized = FALSE;
 	return 0;
@@ -188,7 +184,7 @@ void *_dummy_speak(void *nothing)
 	set_speaking_thread_parameters();
 
 	while (1) {
-		sem_wait(dummy_semaphore);
+		spd_semaphore_wait(&dummy_semaphore);
 		DBG("Semaphore on\n");
 		module_report_event_begin();
 
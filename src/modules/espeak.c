@@ -101,6 +101,14 @@ static int pause_requested = 0;
 static int pause_index_sent = 0;
 static int began = 0;
 
+/* Pieces of audio shorter than this are gathered before being sent */
+#define ESPEAK_COALESCE_MS 100
+
+/* Audio gathered while no event came in between, and whether some audio
+ * was already sent for the current message */
+static GString *espeak_pending = NULL;
+static int espeak_audio_sent = 0;
+
 static gboolean initialized = FALSE;
 
 /* <Function prototypes*/
@@ -112,6 +120,7 @@ static void espeak_free_voice_list();
 /* Callbacks */
 static int synth_callback(short *wav, int numsamples, espeak_EVENT * events);
 static int uri_callback(int type, const char *uri, const char *base);
+static void espeak_flush_audio(void);
 
 /* Internal function prototypes for main thread. */
 
@@ -280,6 +289,9 @@ void module_speak_sync(const gchar * data, size_t bytes, SPDMessageType msgtype)
 	stop_requested = 0;
 	pause_requested = 0;
 	pause_index_sent = 0;
+	espeak_audio_sent = 0;
+	if (espeak_pending != NULL)
+		g_string_truncate(espeak_pending, 0);
 
 	module_speak_ok();
 
@@ -353,6 +365,9 @@ void module_speak_sync(const gchar * data, size_t bytes, SPDMessageType msgtype)
 		DBG(DBG_MODNAME " Synth error %d", result);
 	}
 
+	if (!stop_requested)
+		espeak_flush_audio();
+
 	if (pause_requested) {
 		DBG(DBG_MODNAME " Synth paused");
 		module_report_event_pause();
@@ -397,6 +412,11 @@ int module_close(void)
 
 	espeak_free_voice_list();
 
+	if (espeak_pending != NULL) {
+		g_string_free(espeak_pending, TRUE);
+		espeak_pending = NULL;
+	}
+
 	initialized = FALSE;
 
 	return 0;
@@ -669,28 +689,66 @@ static void espeak_set_synthesis_voice(char *synthesis_voice)
 
 /* Callbacks */
 
-static gboolean espeak_send_audio_upto(short *wav, int *sent, int upto)
+static int espeak_get_sample_rate(void)
 {
-	assert(*sent >= 0);
-	assert(upto >= 0);
-	int numsamples = upto - (*sent);
-	if (wav == NULL || numsamples == 0) {
-		return TRUE;
-	}
 #ifdef ESPEAK_NG_INCLUDE
-	int rate = espeak_ng_GetSampleRate();
+	return espeak_ng_GetSampleRate();
 #else
-	int rate = espeak_sample_rate;
+	return espeak_sample_rate;
 #endif
+}
+
+static void espeak_send_audio(short *wav, int numsamples)
+{
 	AudioTrack track = {
 		.bits = 16,
 		.num_channels = 1,
-		.sample_rate = rate,
+		.sample_rate = espeak_get_sample_rate(),
 		.num_samples = numsamples,
-		.samples = wav + (*sent),
+		.samples = wav,
 	};
 	DBG(DBG_MODNAME " pushing %d samples", numsamples);
 	module_tts_output_server(&track, SPD_AUDIO_LE);
+	espeak_audio_sent = 1;
+}
+
+/* Send what was gathered, before reporting an event or the end */
+static void espeak_flush_audio(void)
+{
+	if (espeak_pending == NULL || espeak_pending->len == 0)
+		return;
+	espeak_send_audio((short *)espeak_pending->str,
+			  espeak_pending->len / sizeof(short));
+	g_string_truncate(espeak_pending, 0);
+}
+
+static gboolean espeak_send_audio_upto(short *wav, int *sent, int upto)
+{
+	assert(*sent >= 0);
+	assert(upto >= 0);
+	int numsamples = upto - (*sent);
+	size_t min_bytes;
+	if (wav == NULL || numsamples == 0) {
+		return TRUE;
+	}
+
+	if (espeak_pending == NULL)
+		espeak_pending = g_string_sized_new(4096);
+
+	/* Big pieces are sent from espeak's buffer as they are, like the
+	 * first one so that speech starts right away, small ones are
+	 * gathered until no mark can separate them */
+	min_bytes = espeak_get_sample_rate() * sizeof(short)
+	    * ESPEAK_COALESCE_MS / 1000;
+	if (espeak_pending->len == 0
+	    && (!espeak_audio_sent || numsamples * sizeof(short) >= min_bytes)) {
+		espeak_send_audio(wav + (*sent), numsamples);
+	} else {
+		g_string_append_len(espeak_pending, (const gchar *)(wav + (*sent)),
+				    numsamples * sizeof(short));
+		if (espeak_pending->len >= min_bytes)
+			espeak_flush_audio();
+	}
 	*sent = upto;
 	return 0;
 }
@@ -703,7 +761,7 @@ static int synth_callback(short *wav, int numsamples, espeak_EVENT * events)
 	int numsamples_sent = 0;
 
 	/* Process server events in case we were told to stop in between */
-	module_process(STDIN_FILENO, 0);
+	module_process(module_in, 0);
 
 	if (stop_requested)
 		return 1;
@@ -745,6 +803,7 @@ static int synth_callback(short *wav, int numsamples, espeak_EVENT * events)
 		switch (events->type) {
 		case espeakEVENT_MARK:
 			if (EspeakIndexing) {
+				espeak_flush_audio();
 				DBG(DBG_MODNAME " Reporting mark %s", events->id.name);
 				module_report_index_mark(events->id.name);
 				if (pause_requested &&
@@ -757,6 +816,7 @@ static int synth_callback(short *wav, int numsamples, espeak_EVENT * events)
 			}
 			break;
 		case espeakEVENT_PLAY:
+			espeak_flush_audio();
 			module_report_icon(events->id.name);
 			break;
 		case espeakEVENT_MSG_TERMINATED:
@@ -163,32 +163,14 @@ MOD_OPTION_1_INT(FestivalComunicationType)
     MOD_OPTION_1_INT(FestivalCacheDistinguishPitch)
 
     MOD_OPTION_1_INT(FestivalReopenSocket)
+    MOD_OPTION_1_INT(FestivalSpareConnections)
 
-typedef struct {
-	size_t size;
-	GHashTable *caches;
-	GList *cache_counter;
-} TCache;
-
-typedef struct {
-	time_t start;
-	int count;
-	size_t size;
-	GHashTable *p_caches;
-	char *key;
-} TCounterEntry;
-
-typedef struct {
-	TCounterEntry *p_counter_entry;
-	FT_Wave *fwave;
-} TCacheEntry;
-
-TCache FestivalCache;
+static SPDAudioCache *festival_cache;
 
 int cache_init();
-int cache_reset();
-int cache_insert(char *key, SPDMessageType msgtype, FT_Wave * value);
-FT_Wave *cache_lookup(const char *key, SPDMessageType msgtype, int add_counter);
+int cache_destroy();
+int cache_insert(const char *key, SPDMessageType msgtype, FT_Wave * value);
+int cache_lookup(const char *key, SPDMessageType msgtype, FT_Wave * value);
 
 /* Public functions */
 
@@ -218,6 +200,8 @@ int module_load(void)
 	   in Festival is fixed */
 	MOD_OPTION_1_INT_REG(FestivalReopenSocket, 0);
 
+	MOD_OPTION_1_INT_REG(FestivalSpareConnections, 1);
+
 	return 0;
 }
 
@@ -346,6 +330,8 @@ int module_close(void)
 		festival_info = NULL;
 	}
 
+	cache_destroy();
+
 	/* TODO: Solve this */
 	//    DBG("Removing junk files in tmp/");
 	//    system("rm -f /tmp/est* 2> /dev/null");
@@ -435,7 +421,7 @@ static SPDVoice **festivalGetVoices(FT_Info * info)
 	return result;
 }
 
-int festival_send_to_audio(FT_Wave * fwave, int first)
+int festival_send_to_audio(FT_Wave * fwave, int *first)
 {
 	AudioTrack track;
 #if defined(BYTE_ORDER) && (BYTE_ORDER == BIG_ENDIAN)
@@ -453,8 +439,9 @@ int festival_send_to_audio(FT_Wave * fwave, int first)
 	track.bits = 16;
 	track.samples = fwave->samples;
 
-	if (first)
-		module_strip_head_silence(&track);
+	/* Until some audio comes, the silence is still at the head */
+	if (*first)
+		*first = !module_strip_head_silence(&track);
 
 	DBG("Sending to audio");
 
@@ -469,6 +456,7 @@ void module_speak_sync(const char *festival_message, size_t bytes, SPDMessageTyp
 	int ret;
 	int wave_cached;
 	FT_Wave *fwave;
+	FT_Wave cached_wave;
 	int debug_count = 0;
 	int r;
 	int terminate = 0;
@@ -499,6 +487,13 @@ void module_speak_sync(const char *festival_message, size_t bytes, SPDMessageTyp
 	/* If the connection crashed or language or voice
 	   change, we will need to set all the parameters again */
 	if (COM_SOCKET) {
+		/* The previous message may have been stopped while the next
+		 * piece of it was requested */
+		if (!festival_connection_crashed
+		    && festivalFlush(festival_info) == 1) {
+			DBG("Using a fresh connection");
+			CLEAN_OLD_SETTINGS_TABLE();
+		}
 		if (festival_connection_crashed) {
 			DBG("Recovering after a connection loss");
 			CLEAN_OLD_SETTINGS_TABLE();
@@ -567,10 +562,10 @@ void module_speak_sync(const char *festival_message, size_t bytes, SPDMessageTyp
 	if (bytes > 0) {
 		if (!is_text(festival_message_type)) {	/* it is a raw text */
 			DBG("Cache mechanisms...");
-			fwave =
-			    cache_lookup(festival_message,
-					 festival_message_type, 1);
-			if (fwave != NULL) {
+			if (cache_lookup(festival_message,
+					 festival_message_type,
+					 &cached_wave) == 0) {
+				fwave = &cached_wave;
 				wave_cached = 1;
 				if (fwave->num_samples != 0) {
 					if (FestivalDebugSaveOutput) {
@@ -583,7 +578,8 @@ void module_speak_sync(const char *festival_message, size_t bytes, SPDMessageTyp
 								 filename_debug);
 					}
 
-					festival_send_to_audio(fwave, 1);
+					first = 1;
+					festival_send_to_audio(fwave, &first);
 
 					if (!festival_stop) {
 						CLEAN_UP(0,
@@ -700,11 +696,9 @@ void module_speak_sync(const char *festival_message, size_t bytes, SPDMessageTyp
 		    SPD_MSGTYPE_SOUND_ICON) {
 			DBG("Storing record for %s in cache\n",
 			    festival_message);
-			/* cache_insert takes care of not inserting the same
-			   message again */
-			cache_insert(g_strdup(festival_message),
+			/* The cache keeps its own copy */
+			cache_insert(festival_message,
 				     festival_message_type, fwave);
-			wave_cached = 1;
 		}
 
 		if (festival_stop) {
@@ -726,8 +720,7 @@ void module_speak_sync(const char *festival_message, size_t bytes, SPDMessageTyp
 			}
 
 			DBG("Playing sound samples");
-			festival_send_to_audio(fwave, first);
-			first = 0;
+			festival_send_to_audio(fwave, &first);
 
 			if (!wave_cached)
 				delete_FT_Wave(fwave);
@@ -816,265 +809,92 @@ void festival_set_cap_let_recogn(SPDCapitalLetters recogn)
 
 /* --- Cache related functions --- */
 
-void cache_destroy_entry(gpointer data)
-{
-	TCacheEntry *entry = data;
-	g_free(entry->fwave);
-	g_free(entry);
-}
-
-void cache_destroy_table_entry(gpointer data)
-{
-	g_hash_table_destroy(data);
-}
-
-void cache_free_counter_entry(gpointer data, gpointer user_data)
-{
-	g_free(((TCounterEntry *) data)->key);
-	g_free(data);
-}
-
 int cache_init()
 {
 
 	if (FestivalCacheOn == 0)
 		return 0;
 
-	FestivalCache.size = 0;
-	FestivalCache.caches =
-	    g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
-				  cache_destroy_table_entry);
-	FestivalCache.cache_counter = NULL;
+	festival_cache = module_audio_cache_new(FestivalCacheMaxKBytes * 1024);
 	DBG("Cache: initialized");
 	return 0;
 }
 
 int cache_destroy()
 {
-	g_hash_table_destroy(FestivalCache.caches);
-	g_list_foreach(FestivalCache.cache_counter, cache_free_counter_entry,
-		       NULL);
-	g_list_free(FestivalCache.cache_counter);
-	return 0;
-}
-
-int cache_reset()
-{
-	/* TODO: it could free everything in the cache and go from start,
-	   but currently it isn't called by anybody */
-	return 0;
-}
-
-/* Compare two cache entries according to their score (how many
-   times the entry was requested divided by the time it exists
-   in the database) */
-gint cache_counter_comp(gconstpointer a, gconstpointer b)
-{
-	const TCounterEntry *A = a;
-	const TCounterEntry *B = b;
-	time_t t;
-	float ret;
-
-	t = time(NULL);
-	ret = (((float)A->count / (float)(t - A->start))
-	       - ((float)B->count / (float)(t - B->start)));
-
-	if (ret > 0)
-		return -1;
-	if (ret == 0)
-		return 0;
-	if (ret < 0)
-		return 1;
-
-	return 0;
-}
-
-/* List scores of all entries in the cache*/
-void cache_debug_foreach_list_score(gpointer a, gpointer user)
-{
-	const TCounterEntry *A = a;
-
-	DBG("key: %s      -> score %f (count: %d, dtime: %d)", A->key,
-	    ((float)A->count / (float)(time(NULL) - A->start)), (int)A->count,
-	    (int)(time(NULL) - A->start));
-}
-
-/* Remove 1/3 of the least used (according to cache_counter_comp) entries
-   (measured by size) */
-int cache_clean(size_t new_element_size)
-{
-	size_t req_size;
-	GList *gl;
-	TCounterEntry *centry;
-
-	DBG("Cache: cleaning, cache size %lu kbytes (>max %d).",
-	    (unsigned long)(FestivalCache.size / 1024), FestivalCacheMaxKBytes);
-
-	req_size = 2 * FestivalCache.size / 3;
-
-	FestivalCache.cache_counter =
-	    g_list_sort(FestivalCache.cache_counter, cache_counter_comp);
-	g_list_foreach(FestivalCache.cache_counter,
-		       cache_debug_foreach_list_score, NULL);
-
-	while ((FestivalCache.size + new_element_size) > req_size) {
-		gl = g_list_last(FestivalCache.cache_counter);
-		if (gl == NULL)
-			break;
-		if (gl->data == NULL) {
-			DBG("Error: Cache: gl->data in cache_clean is NULL, but shouldn't be.");
-			return -1;
-		}
-		centry = gl->data;
-		DBG("Cache: Removing element with key '%s'", centry->key);
-		if (FestivalCache.size < centry->size) {
-			DBG("Error: Cache: FestivalCache.size < centry->size, this shouldn't be.");
-			return -1;
-		}
-		FestivalCache.size -= centry->size;
-		/* Remove the data itself from the hash table */
-		g_hash_table_remove(centry->p_caches, centry->key);
-		/* Remove the associated entry in the counter list */
-		cache_free_counter_entry(centry, NULL);
-		FestivalCache.cache_counter =
-		    g_list_delete_link(FestivalCache.cache_counter, gl);
-	}
-
+	module_audio_cache_free(festival_cache);
+	festival_cache = NULL;
 	return 0;
 }
 
-/* Generate a key for searching between the different hash tables */
-char *cache_gen_key(SPDMessageType type)
+/* The settings which distinguish the cached waves */
+static int cache_settings(SPDMsgSettings * settings)
 {
-	char *key;
-	char ktype;
-	int kpitch = 0, krate = 0, kvoice = 0;
-
 	if (msg_settings.voice.language == NULL)
-		return NULL;
+		return -1;
 
 	DBG("v, p, r = %d %d %d", FestivalCacheDistinguishVoices,
 	    FestivalCacheDistinguishPitch, FestivalCacheDistinguishRate);
 
+	memset(settings, 0, sizeof(*settings));
+	settings->voice.language = msg_settings.voice.language;
 	if (FestivalCacheDistinguishVoices)
-		kvoice = msg_settings.voice_type;
+		settings->voice_type = msg_settings.voice_type;
 	if (FestivalCacheDistinguishPitch)
-		kpitch = msg_settings.pitch;
+		settings->pitch = msg_settings.pitch;
 	if (FestivalCacheDistinguishRate)
-		krate = msg_settings.rate;
-
-	if (type == SPD_MSGTYPE_CHAR)
-		ktype = 'c';
-	else if (type == SPD_MSGTYPE_KEY)
-		ktype = 'k';
-	else if (type == SPD_MSGTYPE_SOUND_ICON)
-		ktype = 's';
-	else {
-		DBG("Invalid message type for cache_gen_key()");
-		return NULL;
-	}
-
-	key =
-	    g_strdup_printf("%c_%s_%d_%d_%d", ktype,
-			    msg_settings.voice.language, kvoice, krate, kpitch);
+		settings->rate = msg_settings.rate;
 
-	return key;
+	return 0;
 }
 
-/* Insert one entry into the cache */
-int cache_insert(char *key, SPDMessageType msgtype, FT_Wave * fwave)
+/* Insert a copy of the wave into the cache */
+int cache_insert(const char *key, SPDMessageType msgtype, FT_Wave * fwave)
 {
-	GHashTable *cache;
-	TCacheEntry *entry;
-	TCounterEntry *centry;
-	char *key_table;
+	SPDMsgSettings settings;
+	AudioTrack track;
 
-	if (FestivalCacheOn == 0)
+	if (festival_cache == NULL)
 		return 0;
 
 	if (key == NULL)
 		return -1;
 	if (fwave == NULL)
 		return -1;
+	if (cache_settings(&settings) != 0)
+		return -1;
 
-	/* Check if the entry isn't present already */
-	if (cache_lookup(key, msgtype, 0) != NULL)
-		return 0;
-
-	/* Clean less used cache entries if the size would exceed max. size */
-	if ((FestivalCache.size + fwave->num_samples * sizeof(short))
-	    > (FestivalCacheMaxKBytes * 1024))
-		if (cache_clean(fwave->num_samples * sizeof(short)) != 0)
-			return -1;
-
-	key_table = cache_gen_key(msgtype);
-
-	DBG("Cache: Inserting wave with key:'%s' into table '%s'", key,
-	    key_table);
-
-	/* Select the right table according to language, voice, etc. or create a new one */
-	cache = g_hash_table_lookup(FestivalCache.caches, key_table);
-	if (cache == NULL) {
-		cache = g_hash_table_new(g_str_hash, g_str_equal);
-		g_hash_table_insert(FestivalCache.caches, key_table, cache);
-	} else {
-		g_free(key_table);
-	}
-
-	/* Fill the CounterEntry structure that will later allow us to remove
-	   the less used entries from cache */
-	centry = (TCounterEntry *) g_malloc(sizeof(TCounterEntry));
-	centry->start = time(NULL);
-	centry->count = 1;
-	centry->size = fwave->num_samples * sizeof(short);
-	centry->p_caches = cache;
-	centry->key = g_strdup(key);
-	FestivalCache.cache_counter =
-	    g_list_append(FestivalCache.cache_counter, centry);
-
-	entry = (TCacheEntry *) g_malloc(sizeof(TCacheEntry));
-	entry->p_counter_entry = centry;
-	entry->fwave = fwave;
-
-	FestivalCache.size += centry->size;
-	g_hash_table_insert(cache, g_strdup(key), entry);
+	track.bits = 16;
+	track.num_channels = 1;
+	track.sample_rate = fwave->sample_rate;
+	track.num_samples = fwave->num_samples;
+	track.samples = fwave->samples;
 
-	return 0;
+	return module_audio_cache_insert(festival_cache, msgtype, key,
+					 &settings, &track, NULL);
 }
 
-/* Retrieve wave from the cache */
-FT_Wave *cache_lookup(const char *key, SPDMessageType msgtype, int add_counter)
+/* Make fwave point to the cached samples, valid until the next insertion */
+int cache_lookup(const char *key, SPDMessageType msgtype, FT_Wave * fwave)
 {
-	GHashTable *cache;
-	TCacheEntry *entry;
-	char *key_table;
+	SPDMsgSettings settings;
+	AudioTrack track;
 
-	if (FestivalCacheOn == 0)
-		return NULL;
+	if (festival_cache == NULL)
+		return -1;
 	if (key == NULL)
-		return NULL;
-
-	key_table = cache_gen_key(msgtype);
-
-	if (add_counter)
-		DBG("Cache: looking up a wave with key '%s' in '%s'", key,
-		    key_table);
-
-	if (key_table == NULL)
-		return NULL;
-	cache = g_hash_table_lookup(FestivalCache.caches, key_table);
-	g_free(key_table);
-	if (cache == NULL)
-		return NULL;
-
-	entry = g_hash_table_lookup(cache, key);
-	if (entry == NULL)
-		return NULL;
-	entry->p_counter_entry->count++;
+		return -1;
+	if (cache_settings(&settings) != 0)
+		return -1;
 
-	DBG("Cache: corresponding wave found: %s", key);
+	if (!module_audio_cache_lookup(festival_cache, msgtype, key, &settings,
+				       &track, NULL))
+		return -1;
 
-	return entry->fwave;
+	fwave->num_samples = track.num_samples;
+	fwave->sample_rate = track.sample_rate;
+	fwave->samples = track.samples;
+	return 0;
 }
 
 int init_festival_standalone()
@@ -1135,6 +955,8 @@ int init_festival_socket()
 	festival_info = festivalDefaultInfo();
 	festival_info->server_host = FestivalServerHost;
 	festival_info->server_port = FestivalServerPort;
+	festival_info->max_spare = CLAMP(FestivalSpareConnections, 0,
+					 FESTIVAL_MAX_SPARE);
 
 	festival_info = festivalOpen(festival_info);
 	if (festival_info == NULL)
@@ -77,7 +77,9 @@ int fapi_endian_loc = 1;
 
 int festival_connection_crashed;
 
-static char *socket_receive_file_to_buff(int fd, int *size);
+#define NIST_HEADER_SIZE 1024
+
+static char *socket_receive_file_to_buff(FT_Info * info, int *size, int nist);
 
 /* --- MANAGING FT STRUCTURES --- */
 
@@ -153,8 +155,13 @@ int save_FT_Wave_snd(FT_Wave * wave, const char *filename)
 
 void delete_FT_Info(FT_Info * info)
 {
-	if (info != 0)
+	int i;
+
+	if (info != 0) {
+		for (i = 0; i < info->num_spare; i++)
+			close(info->spare_fd[i]);
 		g_free(info);
+	}
 }
 
 /* --- FESTIVAL REPLY PARSING --- */
@@ -226,31 +233,111 @@ static int festival_socket_open(const char *host, int port)
 	return fd;
 }
 
+/* Send a command to a connection which is not the current one */
+static int festival_send_fd(int fd, const char *cmd)
+{
+	size_t len = strlen(cmd);
+	ssize_t n;
+
+	DBG("-> Festival: |%s|", cmd);
+	while (len > 0) {
+		n = write(fd, cmd, len);
+		if (n <= 0)
+			return -1;
+		cmd += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Read one byte of the reply, refilling the input buffer as needed */
+static int festival_getc(FT_Info * info, char *c)
+{
+	int n;
+
+	if (info->input_pos == info->input_len) {
+		n = read(info->server_fd, info->input, sizeof(info->input));
+		if (n <= 0)
+			return n;
+		info->input_pos = 0;
+		info->input_len = n;
+	}
+	*c = info->input[info->input_pos++];
+	return 1;
+}
+
+static void festival_connection_lost(FT_Info * info)
+{
+	close(info->server_fd);
+	info->server_fd = -1;
+	info->input_pos = info->input_len = 0;
+	info->pending = 0;
+	festival_connection_crashed = 1;
+}
+
 /* Receive file (probably a waveform file) from socket using   */
 /* Festival key stuff technique, but long winded I know, sorry */
 /* but will receive any file without closing the stream or     */
 /* using OOB data                                              */
-static char *socket_receive_file_to_buff(int fd, int *size)
+/* For a NIST waveform, the buffer is sized from the header    */
+static char *socket_receive_file_to_buff(FT_Info * info, int *size, int nist)
 {
 	static char *file_stuff_key = "ft_StUfF_key";	/* must == Festival's key */
+	int key_len = strlen(file_stuff_key);
 	char *buff;
 	int bufflen;
 	int n, k, i;
+	int num_samples, want;
 	char c;
+	char *start, *p;
 
-	if (fd < 0)
+	if (info->server_fd < 0)
 		return NULL;
 
-	bufflen = 1024;
+	bufflen = nist ? NIST_HEADER_SIZE + key_len + 2 : 1024;
 	buff = (char *)g_malloc(bufflen);
 	*size = 0;
 
 	for (k = 0; file_stuff_key[k] != '\0';) {
-		n = read(fd, &c, 1);
+		if (nist == 1 && *size >= NIST_HEADER_SIZE) {
+			/* Make room for all the samples at once */
+			nist = 2;
+			buff[*size] = '\0';
+			num_samples = nist_get_param_int(buff, "sample_count", 0);
+			if (num_samples > 0 && num_samples < (1 << 28)) {
+				want = NIST_HEADER_SIZE + num_samples * sizeof(short)
+				    + key_len + 2;
+				if (want > bufflen) {
+					bufflen = want;
+					buff = (char *)g_realloc(buff, bufflen);
+				}
+			}
+		}
+
+		if (k == 0 && info->input_pos < info->input_len) {
+			/* Copy everything up to a possible key at once */
+			start = info->input + info->input_pos;
+			n = info->input_len - info->input_pos;
+			p = memchr(start, file_stuff_key[0], n);
+			if (p != NULL)
+				n = p - start;
+			if (n > 0) {
+				if (*size + n + 1 >= bufflen) {
+					bufflen = MAX(bufflen + bufflen / 4,
+						      *size + n + 2);
+					buff = (char *)g_realloc(buff, bufflen);
+				}
+				memcpy(buff + *size, start, n);
+				*size += n;
+				info->input_pos += n;
+				continue;
+			}
+		}
+
+		n = festival_getc(info, &c);
 		if (n <= 0) {
 			DBG("ERROR: FESTIVAL CLOSED CONNECTION (1)");
-			close(fd);
-			festival_connection_crashed = 1;
+			festival_connection_lost(info);
 			g_free(buff);
 			return NULL;	/* hit stream eof before end of file */
 		}
@@ -281,58 +368,62 @@ static char *socket_receive_file_to_buff(int fd, int *size)
 	return buff;
 }
 
-static char *client_accept_s_expr(int fd)
+static char *client_accept_s_expr(FT_Info * info)
 {
 	/* Read s-expression from server, as a char * */
 	char *expr;
 	int filesize;
 
-	if (fd < 0)
+	if (info->server_fd < 0)
 		return NULL;
 
-	expr = socket_receive_file_to_buff(fd, &filesize);
+	expr = socket_receive_file_to_buff(info, &filesize, 0);
+	if (expr == NULL)
+		return NULL;
 	expr[filesize] = '\0';
 	return expr;
 }
 
-static FT_Wave *client_accept_waveform(int fd, int *stop_flag,
+static FT_Wave *client_accept_waveform(FT_Info * info, int *stop_flag,
 				       int stop_by_close)
 {
 	/* Read waveform from server */
 	char *wavefile;
 	int filesize;
-	int num_samples, sample_rate, i;
+	int num_samples, sample_rate, swap, i;
 	FT_Wave *wave;
 
-	if (fd < 0)
+	if (info->server_fd < 0)
 		return NULL;
 
-	wavefile = socket_receive_file_to_buff(fd, &filesize);
+	wavefile = socket_receive_file_to_buff(info, &filesize, 1);
 	if (wavefile == NULL)
 		return NULL;
 
 	wave = NULL;
 
 	/* I know this is NIST file and its an error if it isn't */
-	if (filesize >= 1024) {
+	if (filesize >= NIST_HEADER_SIZE) {
 		/* If this doesn't work, probably you forgot to set
 		   the output file type to NIST ! by Parameter.set */
 		num_samples = nist_get_param_int(wavefile, "sample_count", 1);
 		sample_rate =
 		    nist_get_param_int(wavefile, "sample_rate", 16000);
 
-		if ((num_samples * sizeof(short)) + 1024 == filesize) {
+		if ((num_samples * sizeof(short)) + NIST_HEADER_SIZE == filesize) {
 			wave = (FT_Wave *) g_malloc(sizeof(FT_Wave));
 			DBG("Number of samples from festival: %d", num_samples);
 			wave->num_samples = num_samples;
 			wave->sample_rate = sample_rate;
 			if (num_samples != 0) {
-				wave->samples =
-				    (short *)g_malloc(num_samples *
-						      sizeof(short));
-				memmove(wave->samples, wavefile + 1024,
+				/* Reuse the buffer, it was sized for the
+				 * samples */
+				swap = nist_require_swap(wavefile);
+				memmove(wavefile, wavefile + NIST_HEADER_SIZE,
 					num_samples * sizeof(short));
-				if (nist_require_swap(wavefile))
+				wave->samples = (short *)wavefile;
+				wavefile = NULL;
+				if (swap)
 					for (i = 0; i < num_samples; i++)
 						wave->samples[i] =
 						    SWAPSHORT(wave->samples[i]);
@@ -358,14 +449,13 @@ int festival_get_ack(FT_Info ** info, char *ack)
 		return -1;
 
 	for (n = 0; n < 3;) {
-		read_bytes = read((*info)->server_fd, ack + n, 3 - n);
+		read_bytes = festival_getc(*info, ack + n);
 		if (read_bytes <= 0) {
 			/* WARNING: This is a very strange situation
 			   but it happens often, I don't really know
 			   why??? */
 			DBG("ERROR: FESTIVAL CLOSED CONNECTION (2)");
-			close((*info)->server_fd);
-			festival_connection_crashed = 1;
+			festival_connection_lost(*info);
 			return -1;
 		}
 		n += read_bytes;
@@ -396,7 +486,7 @@ int festival_read_response(FT_Info * info, char **expr)
 		return 1;
 	}
 
-	r = client_accept_s_expr(info->server_fd);
+	r = client_accept_s_expr(info);
 	if (expr != NULL) {
 		*expr = r;
 	} else if (r != NULL) {
@@ -425,9 +515,9 @@ int festival_accept_any_response(FT_Info * info)
 			return r;
 		DBG("<- Festival: |%s|", ack);
 		if (strcmp(ack, "WV\n") == 0) {	/* receive a waveform */
-			client_accept_waveform(info->server_fd, NULL, 0);
+			client_accept_waveform(info, NULL, 0);
 		} else if (strcmp(ack, "LP\n") == 0) {	/* receive an s-expr */
-			expr = client_accept_s_expr(info->server_fd);
+			expr = client_accept_s_expr(info);
 			if (expr != NULL)
 				g_free(expr);
 		} else if (strcmp(ack, "ER\n") == 0) {	/* server got an error */
@@ -456,12 +546,69 @@ int festival_check_info(FT_Info * info, const char *fnname)
 /* Public Functions to this API                                        */
 /***********************************************************************/
 
+/* Both are sent at once, see festival_setup_check() for the replies */
+#define FESTIVAL_SETUP_COMMANDS \
+	"(require 'speech-dispatcher)\n" \
+	"(Parameter.set 'Wavefiletype 'nist)\n"
+
+static int festival_setup_check(FT_Info * info)
+{
+	char *resp;
+	int ret;
+
+	ret = festival_read_response(info, &resp);
+	if (ret || resp == NULL || strcmp(resp, "t\n")) {
+		DBG("ERROR: Can't load speech-dispatcher module into Festival."
+		    "Reason: %s", resp);
+		if (!ret && resp)
+			g_free(resp);
+		return -1;
+	}
+	g_free(resp);
+	resp = NULL;
+
+	ret = festival_read_response(info, &resp);
+	if (ret || resp == NULL || strcmp(resp, "nist\n")) {
+		DBG("ERROR: Can't set Wavefiletype to nist in Festival. Reason: %s", resp);
+		if (!ret && resp)
+			g_free(resp);
+		return -1;
+	}
+	g_free(resp);
+
+	return 0;
+}
+
+/* Connect the spare connections, their setup is only checked when they
+ * get used, so that this does not wait for the server */
+static void festival_open_spares(FT_Info * info)
+{
+	int fd;
+
+	while (info->num_spare < info->max_spare) {
+		fd = festival_socket_open(info->server_host, info->server_port);
+		if (fd == -1)
+			return;
+		if (festival_send_fd(fd, FESTIVAL_SETUP_COMMANDS)) {
+			close(fd);
+			return;
+		}
+		info->spare_fd[info->num_spare++] = fd;
+	}
+}
+
+static void festival_use_fd(FT_Info * info, int fd)
+{
+	info->server_fd = fd;
+	info->input_pos = info->input_len = 0;
+	info->pending = 0;
+}
+
 /* Opens a connection to Festival server (which must be running)
  * and returns it's identification in new FT_Info */
 FT_Info *festivalOpen(FT_Info * info)
 {
-	char *resp;
-	int ret;
+	int fd;
 
 	DBG("Opening socket fo Festival server");
 
@@ -470,8 +617,17 @@ FT_Info *festivalOpen(FT_Info * info)
 	if (info == 0)
 		info = festivalDefaultInfo();
 
-	info->server_fd =
-	    festival_socket_open(info->server_host, info->server_port);
+	if (info->num_spare > 0) {
+		fd = info->spare_fd[--info->num_spare];
+	} else {
+		fd = festival_socket_open(info->server_host,
+					  info->server_port);
+		if (fd != -1 && festival_send_fd(fd, FESTIVAL_SETUP_COMMANDS)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	festival_use_fd(info, fd);
 
 	if (info->server_fd == -1) {
 		delete_FT_Info(info);
@@ -479,33 +635,49 @@ FT_Info *festivalOpen(FT_Info * info)
 		return NULL;
 	}
 
-	FEST_SEND_CMD("(require 'speech-dispatcher)");
-	ret = festival_read_response(info, &resp);
-	if (ret || resp == NULL || strcmp(resp, "t\n")) {
-		DBG("ERROR: Can't load speech-dispatcher module into Festival."
-		    "Reason: %s", resp);
+	if (festival_setup_check(info)) {
 		delete_FT_Info(info);
-		if (!ret && resp)
-			g_free(resp);
 		return NULL;
 	}
-	g_free(resp);
-	resp = NULL;
 
-	FEST_SEND_CMD("(Parameter.set 'Wavefiletype 'nist)\n");
-	ret = festival_read_response(info, &resp);
-	if (ret || resp == NULL || strcmp(resp, "nist\n")) {
-		DBG("ERROR: Can't set Wavefiletype to nist in Festival. Reason: %s", resp);
-		delete_FT_Info(info);
-		if (!ret && resp)
-			g_free(resp);
-		return NULL;
-	}
-	g_free(resp);
+	festival_open_spares(info);
 
 	return info;
 }
 
+/* Makes sure the replies to requests sent in advance by
+ * festivalGetDataMulti() are not in the way of the next command. If
+ * there are spare connections, the busy one is just dropped and the
+ * server doesn't have to finish synthesizing.
+ * Returns 1 if the connection was replaced, its settings then need to
+ * be sent again, 0 if not and -1 on error. */
+int festivalFlush(FT_Info * info)
+{
+	if (festival_check_info(info, "festivalFlush") == -1)
+		return -1;
+	if (info->pending == 0)
+		return 0;
+
+	if (info->num_spare > 0) {
+		DBG("Festival connection busy, switching to a spare one");
+		close(info->server_fd);
+		festival_use_fd(info, info->spare_fd[--info->num_spare]);
+		if (festival_setup_check(info)) {
+			festival_connection_lost(info);
+			return -1;
+		}
+		festival_open_spares(info);
+		return 1;
+	}
+
+	while (info->pending > 0) {
+		info->pending--;
+		if (festival_accept_any_response(info))
+			return -1;
+	}
+	return 0;
+}
+
 int
 festival_speak_command(FT_Info * info, char *command, const char *text,
 		       int symbol, int resp)
@@ -600,9 +772,9 @@ FT_Wave *festivalStringToWaveGetData(FT_Info * info)
 			return NULL;
 		DBG("<- Festival: %s", ack);
 		if (strcmp(ack, "WV\n") == 0) {
-			wave = client_accept_waveform(info->server_fd, NULL, 0);
+			wave = client_accept_waveform(info, NULL, 0);
 		} else if (strcmp(ack, "LP\n") == 0) {
-			expr = client_accept_s_expr(info->server_fd);
+			expr = client_accept_s_expr(info);
 			if (expr != NULL)
 				g_free(expr);
 		} else if (strcmp(ack, "ER\n") == 0) {
@@ -620,7 +792,6 @@ FT_Wave *festivalGetDataMulti(FT_Info * info, char **callback, int *stop_flag,
 	FT_Wave *wave = NULL;
 	char ack[5];
 	char *resp = NULL;
-	FILE *fd;
 
 	if (festival_check_info(info, "festival_speak_command") == -1) {
 		return NULL;
@@ -634,11 +805,12 @@ FT_Wave *festivalGetDataMulti(FT_Info * info, char **callback, int *stop_flag,
 
 	DBG("Stop by close mode : %d", stop_by_close);
 
-	DBG("-> Festival: (speechd-next)");
-	fd = fdopen(dup(info->server_fd), "wb");
-	fprintf(fd, "(speechd-next)\n");
-	fflush(fd);
-	fclose(fd);
+	if (info->pending == 0) {
+		if (festival_send_fd(info->server_fd, "(speechd-next)\n"))
+			return NULL;
+		info->pending++;
+	}
+	info->pending--;
 
 	do {
 		if (festival_get_ack(&info, ack)) {
@@ -650,11 +822,11 @@ FT_Wave *festivalGetDataMulti(FT_Info * info, char **callback, int *stop_flag,
 
 		if (strcmp(ack, "WV\n") == 0) {
 			wave =
-			    client_accept_waveform(info->server_fd, stop_flag,
+			    client_accept_waveform(info, stop_flag,
 						   stop_by_close);
 		} else if (strcmp(ack, "LP\n") == 0) {
 			g_free(resp);
-			resp = client_accept_s_expr(info->server_fd);
+			resp = client_accept_s_expr(info);
 			if (resp == NULL) {
 				DBG("ERROR: Something wrong in communication with Festival, s_expr = NULL");
 				return NULL;
@@ -682,6 +854,13 @@ FT_Wave *festivalGetDataMulti(FT_Info * info, char **callback, int *stop_flag,
 			g_free(resp);
 	}
 
+	/* Let the server synthesize the next piece while the caller deals
+	 * with this one */
+	if (wave != NULL || *callback != NULL) {
+		if (festival_send_fd(info->server_fd, "(speechd-next)\n") == 0)
+			info->pending++;
+	}
+
 	return wave;
 }
 
@@ -761,6 +940,10 @@ FT_Info *festivalDefaultInfo()
 	info->text_mode = FESTIVAL_DEFAULT_TEXT_MODE;
 
 	info->server_fd = -1;
+	info->input_pos = info->input_len = 0;
+	info->pending = 0;
+	info->max_spare = 0;
+	info->num_spare = 0;
 
 	return info;
 }
@@ -43,6 +43,7 @@
 #define FESTIVAL_DEFAULT_SERVER_HOST "localhost"
 #define FESTIVAL_DEFAULT_SERVER_PORT 1314
 #define FESTIVAL_DEFAULT_TEXT_MODE "fundamental"
+#define FESTIVAL_MAX_SPARE 4
 
 extern int festival_connection_crashed;
 
@@ -53,6 +54,19 @@ typedef struct FT_Info {
 	char *text_mode;
 
 	int server_fd;
+
+	/* Data read from server_fd but not parsed yet */
+	char input[4096];
+	int input_pos, input_len;
+
+	/* Number of (speechd-next) sent before their reply was needed */
+	int pending;
+
+	/* Connections kept open to replace one that is still busy, the
+	 * replies to their setup commands are not read yet */
+	int max_spare;
+	int num_spare;
+	int spare_fd[FESTIVAL_MAX_SPARE];
 } FT_Info;
 
 typedef struct FT_Wave {
@@ -130,6 +144,7 @@ FT_Wave *festivalStringToWaveGetData(FT_Info * info);
 
 FT_Info *festivalDefaultInfo(void);
 void festivalEmptySocket(FT_Info * info);
+int festivalFlush(FT_Info * info);
 int save_FT_Wave_snd(FT_Wave * wave, const char *filename);
 FT_Wave *festivalGetDataMulti(FT_Info * info, char **callback, int *stop_flag,
 			      int stop_by_close);
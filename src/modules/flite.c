@@ -206,10 +206,9 @@ void module_speak_sync(const gchar * data, size_t len, SPDMessageType msgtype)
 		track.bits = 16;
 		track.samples = wav->samples;
 
-		if (first) {
-			module_strip_head_silence(&track);
-			first = 0;
-		}
+		/* Until some audio comes, the silence is still at the head */
+		if (first)
+			first = !module_strip_head_silence(&track);
 		if (flite_message[pos] == 0)
 			module_strip_tail_silence(&track);
 
@@ -26,8 +26,9 @@
 
 #include <glib.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
 #include <sys/stat.h>
-#include <semaphore.h>
 
 #include <speechd_types.h>
 
@@ -43,7 +44,7 @@ static int generic_speaking = 0;
 
 static pthread_t generic_speak_thread;
 static pid_t generic_pid;
-static sem_t *generic_semaphore;
+static SPDSemaphore generic_semaphore;
 
 static char *generic_message;
 static SPDMessageType generic_message_type;
@@ -54,6 +55,29 @@ static int generic_pause_requested = 0;
 static char *execute_synth_str1;
 static char *execute_synth_str2;
 
+/* Server mode: GenericServerCommand is started once and fed each piece of
+   text as one line on its standard input, followed by GenericServerDelimiter
+   if set.  It writes the audio as raw samples on its standard output, which
+   we pass to the server.  The audio of a piece is over when the command
+   stays quiet for GenericServerTimeout ms. */
+static int generic_server_mode = 0;
+static pid_t generic_server_pid = 0;
+static int generic_server_in = -1;
+static int generic_server_out = -1;
+static char *generic_server_cmd = NULL;	/* what it was started with */
+static int generic_stop_requested = 0;
+
+/* Capture mode: GenericExecuteSynth is still run for each piece of text, but
+   writes the audio on its standard output instead of playing it, raw as
+   above or as a WAV file, and we pass it to the server as it comes. */
+enum {
+	GENERIC_AUDIO_PLAY,
+	GENERIC_AUDIO_RAW,
+	GENERIC_AUDIO_WAV,
+};
+static int generic_audio_output = GENERIC_AUDIO_PLAY;
+static pthread_mutex_t generic_pid_mutex = PTHREAD_MUTEX_INITIALIZER;
+
 static gboolean initialized = FALSE;
 
 /* Internal functions prototypes */
@@ -61,6 +85,12 @@ static void *get_ht_option(GHashTable * hash_table, const char *key);
 static void *_generic_speak(void *);
 static void _generic_child(TModuleDoublePipe dpipe, const size_t maxlen);
 static void generic_child_close(TModuleDoublePipe dpipe);
+static char *generic_expand_command(const char *command,
+				    const char *play_command);
+static int generic_server_say(char *text);
+static int generic_capture_say(char *text);
+static void generic_speak_pieces(int (*say) (char *text));
+static void generic_server_close(void);
 
 void generic_set_rate(signed int rate);
 void generic_set_pitch(signed int pitch);
@@ -87,6 +117,14 @@ MOD_OPTION_1_STR(GenericExecuteSynth)
     MOD_OPTION_1_STR(GenericStripPunctChars)
     MOD_OPTION_1_STR(GenericRecodeFallback)
 
+    MOD_OPTION_1_STR(GenericServerCommand)
+    MOD_OPTION_1_STR(GenericServerDelimiter)
+    MOD_OPTION_1_INT(GenericServerStartTimeout)
+    MOD_OPTION_1_INT(GenericServerTimeout)
+    MOD_OPTION_1_INT(GenericAudioSampleRate)
+    MOD_OPTION_1_INT(GenericAudioChannels)
+    MOD_OPTION_1_STR(GenericAudioOutput)
+
     MOD_OPTION_1_INT(GenericRateAdd)
     MOD_OPTION_1_FLOAT(GenericRateMultiply)
     MOD_OPTION_1_INT(GenericRateForceInteger)
@@ -127,6 +165,14 @@ int module_load(void)
 	MOD_OPTION_1_STR_REG(GenericStripPunctChars, "");
 	MOD_OPTION_1_STR_REG(GenericRecodeFallback, "?");
 
+	MOD_OPTION_1_STR_REG(GenericServerCommand, "");
+	MOD_OPTION_1_STR_REG(GenericServerDelimiter, "");
+	MOD_OPTION_1_INT_REG(GenericServerStartTimeout, 3000);
+	MOD_OPTION_1_INT_REG(GenericServerTimeout, 200);
+	MOD_OPTION_1_INT_REG(GenericAudioSampleRate, 22050);
+	MOD_OPTION_1_INT_REG(GenericAudioChannels, 1);
+	MOD_OPTION_1_STR_REG(GenericAudioOutput, "play");
+
 	MOD_OPTION_1_INT_REG(GenericRateAdd, 0);
 	MOD_OPTION_1_FLOAT_REG(GenericRateMultiply, 1);
 	MOD_OPTION_1_INT_REG(GenericRateForceInteger, 0);
@@ -174,6 +220,36 @@ int module_init(char **status_info)
 	DBG("GenericExecuteSynth = %s\n", GenericExecuteSynth);
 	DBG("GenericCmdDependency = %s\n", GenericCmdDependency);
 	DBG("GenericPortDependency = %u\n", GenericPortDependency);
+	DBG("GenericServerCommand = %s\n", GenericServerCommand);
+	DBG("GenericAudioOutput = %s\n", GenericAudioOutput);
+
+	if (!strcmp(GenericAudioOutput, "play"))
+		generic_audio_output = GENERIC_AUDIO_PLAY;
+	else if (!strcmp(GenericAudioOutput, "raw"))
+		generic_audio_output = GENERIC_AUDIO_RAW;
+	else if (!strcmp(GenericAudioOutput, "wav"))
+		generic_audio_output = GENERIC_AUDIO_WAV;
+	else {
+		*status_info = g_strdup_printf("Unknown GenericAudioOutput %s, "
+					       "use play, raw or wav",
+					       GenericAudioOutput);
+		return -1;
+	}
+
+	if (GenericServerCommand[0] != '\0')
+		generic_server_mode = 1;
+
+	if (generic_server_mode || generic_audio_output != GENERIC_AUDIO_PLAY) {
+		if (GenericAudioSampleRate <= 0 || GenericAudioChannels <= 0) {
+			*status_info = g_strdup("GenericAudioSampleRate and "
+						"GenericAudioChannels must be "
+						"positive");
+			return -1;
+		}
+		/* The audio comes back to us, let the server play it */
+		module_audio_set_server();
+		(void)signal(SIGPIPE, SIG_IGN);
+	}
 
 	generic_msg_language =
 	    (TGenericLanguage *) g_malloc(sizeof(TGenericLanguage));
@@ -183,10 +259,7 @@ int module_init(char **status_info)
 
 	generic_message = NULL;
 
-	char name[64];
-	snprintf(name, sizeof(name), "/speechd-modules-generic-%d", getpid());
-	generic_semaphore = sem_open(name, O_CREAT | O_EXCL, S_IRUSR | S_IWUSR, 0);
-	sem_unlink(name);
+	spd_semaphore_init(&generic_semaphore, 0);
 
 	DBG("Generic: creating new thread for generic_speak\n");
 	generic_speaking = 0;
@@ -234,19 +307,13 @@ int module_speak(gchar * data, size_t bytes, SPDMessageType msgtype)
 	if (generic_msg_language->charset != NULL) {
 		DBG("Recoding from UTF-8 to %s...",
 		    generic_msg_language->charset);
-		tmp =
-		    (char *)g_convert_with_fallback(data, bytes,
-						    generic_msg_language->charset,
-						    "UTF-8",
-						    GenericRecodeFallback, NULL,
-						    NULL, NULL);
+		tmp = module_recode(data, bytes,
+				    generic_msg_language->charset,
+				    GenericRecodeFallback);
 	} else {
 		DBG("Warning: Preferred charset not specified, recoding to iso-8859-1");
-		tmp =
-		    (char *)g_convert_with_fallback(data, bytes, "iso-8859-1",
-						    "UTF-8",
-						    GenericRecodeFallback, NULL,
-						    NULL, NULL);
+		tmp = module_recode(data, bytes, "iso-8859-1",
+				    GenericRecodeFallback);
 	}
 
 	if (tmp == NULL)
@@ -266,8 +333,9 @@ int module_speak(gchar * data, size_t bytes, SPDMessageType msgtype)
 	DBG("Requested data (%d): |%s|\n", msgtype, data);
 
 	/* Send semaphore signal to the speaking thread */
+	generic_stop_requested = 0;
 	generic_speaking = 1;
-	sem_post(generic_semaphore);
+	spd_semaphore_post(&generic_semaphore);
 
 	DBG("Generic: leaving write() normally\n\r");
 	return bytes;
@@ -277,7 +345,20 @@ int module_stop(void)
 {
 	DBG("generic: stop()\n");
 
-	if (generic_speaking && generic_pid != 0) {
+	if (generic_speaking && generic_server_mode) {
+		/* Keep the server, the speaking thread drops its audio */
+		generic_stop_requested = 1;
+	} else if (generic_speaking
+		   && generic_audio_output != GENERIC_AUDIO_PLAY) {
+		generic_stop_requested = 1;
+		pthread_mutex_lock(&generic_pid_mutex);
+		if (generic_pid > 0) {
+			DBG("generic: stopping process group pid %d\n",
+			    generic_pid);
+			kill(-generic_pid, SIGKILL);
+		}
+		pthread_mutex_unlock(&generic_pid_mutex);
+	} else if (generic_speaking && generic_pid != 0) {
 		DBG("generic: stopping process group pid %d\n", generic_pid);
 		kill(-generic_pid, SIGKILL);
 	}
@@ -317,7 +398,9 @@ int module_close(void)
 	if (module_terminate_thread(generic_speak_thread) != 0)
 		return -1;
 
-	sem_close(generic_semaphore);
+	spd_semaphore_destroy(&generic_semaphore);
+
+	generic_server_close();
 
 	initialized = FALSE;
 
@@ -368,6 +451,481 @@ char *string_replace(char *string, const char *token, const char *data)
 
 }
 
+/* Replace token in string, which is freed */
+static char *generic_expand(char *string, const char *token, const char *data)
+{
+	char *new;
+
+	new = string_replace(string, token, data);
+	g_free(string);
+	return new;
+}
+
+/* Substitute the current parameters in the command, except $DATA */
+static char *generic_expand_command(const char *command,
+				    const char *play_command)
+{
+	char *e_string;
+	const char *helper;
+
+	e_string = g_strdup(command);
+
+	if (play_command != NULL)
+		e_string = generic_expand(e_string, "$PLAY_COMMAND",
+					  play_command);
+
+	helper = getenv("TMPDIR");
+	e_string = generic_expand(e_string, "$TMPDIR", helper ? helper : "/tmp");
+	helper = g_get_home_dir();
+	e_string = generic_expand(e_string, "$HOMEDIR",
+				  helper ? helper : "UNKNOWN_HOME_DIRECTORY");
+
+	e_string = generic_expand(e_string, "$PITCH", generic_msg_pitch_str);
+	e_string = generic_expand(e_string, "$PITCH_RANGE",
+				  generic_msg_pitch_range_str);
+	e_string = generic_expand(e_string, "$RATE", generic_msg_rate_str);
+	e_string = generic_expand(e_string, "$VOLUME", generic_msg_volume_str);
+	e_string = generic_expand(e_string, "$LANGUAGE",
+				  generic_msg_language->name);
+	e_string = generic_expand(e_string, "$PUNCT",
+				  generic_msg_punct_str ? generic_msg_punct_str : "");
+	if (generic_msg_voice_str != NULL)
+		e_string = generic_expand(e_string, "$VOICE",
+					  generic_msg_voice_str);
+	else {
+		char *default_voice = module_getdefaultvoice();
+		if (!default_voice)
+			default_voice = "no_voice";
+		e_string = generic_expand(e_string, "$VOICE", default_voice);
+	}
+
+	return e_string;
+}
+
+static void generic_server_close(void)
+{
+	if (generic_server_pid == 0)
+		return;
+
+	DBG("generic: stopping server process group %d\n", generic_server_pid);
+	close(generic_server_in);
+	close(generic_server_out);
+	generic_server_in = -1;
+	generic_server_out = -1;
+	kill(-generic_server_pid, SIGKILL);
+	waitpid(generic_server_pid, NULL, 0);
+	generic_server_pid = 0;
+	g_free(generic_server_cmd);
+	generic_server_cmd = NULL;
+}
+
+/* Run command in a process group of its own, reading from *input if not NULL,
+   and writing to *output */
+static pid_t generic_spawn(const char *command, int *input, int *output)
+{
+	int in[2] = { -1, -1 }, out[2];
+	sigset_t all_signals;
+	pid_t pid;
+	int null;
+
+	if (input != NULL && pipe(in) != 0) {
+		DBG("Can't create the input pipe\n");
+		return -1;
+	}
+	if (pipe(out) != 0) {
+		DBG("Can't create the output pipe\n");
+		if (input != NULL) {
+			close(in[0]);
+			close(in[1]);
+		}
+		return -1;
+	}
+
+	pid = fork();
+	switch (pid) {
+	case -1:
+		DBG("Can't run the command. fork() failed!\n");
+		if (input != NULL) {
+			close(in[0]);
+			close(in[1]);
+		}
+		close(out[0]);
+		close(out[1]);
+		return -1;
+
+	case 0:
+		/* Only async-signal-safe calls until exec, we are threaded */
+		setpgid(0, 0);
+		signal(SIGPIPE, SIG_DFL);
+		sigemptyset(&all_signals);
+		sigprocmask(SIG_SETMASK, &all_signals, NULL);
+		if (input != NULL) {
+			dup2(in[0], STDIN_FILENO);
+			close(in[0]);
+			close(in[1]);
+		} else {
+			/* Keep it off our connection with the server */
+			null = open("/dev/null", O_RDONLY);
+			if (null >= 0) {
+				dup2(null, STDIN_FILENO);
+				close(null);
+			}
+		}
+		dup2(out[1], STDOUT_FILENO);
+		close(out[0]);
+		close(out[1]);
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(1);
+	}
+
+	if (input != NULL) {
+		close(in[0]);
+		fcntl(in[1], F_SETFD, FD_CLOEXEC);
+		*input = in[1];
+	}
+	close(out[1]);
+	fcntl(out[0], F_SETFD, FD_CLOEXEC);
+	*output = out[0];
+
+	return pid;
+}
+
+/* Start the server command, which then owns command */
+static int generic_server_open(char *command)
+{
+	pid_t pid;
+
+	pid = generic_spawn(command, &generic_server_in, &generic_server_out);
+	if (pid <= 0)
+		return -1;
+
+	generic_server_pid = pid;
+	generic_server_cmd = command;
+
+	DBG("generic: started server %d: |%s|\n", generic_server_pid, command);
+	return 0;
+}
+
+/* Make sure the server runs with the current parameters, it may only be
+   able to take them from its command line */
+static int generic_server_update(void)
+{
+	char *command;
+
+	command = generic_expand_command(GenericServerCommand, NULL);
+
+	if (generic_server_pid != 0) {
+		if (waitpid(generic_server_pid, NULL, WNOHANG) == generic_server_pid) {
+			/* Already reaped, only the rest of its group is left */
+			DBG("generic: server %d exited\n", generic_server_pid);
+			generic_server_close();
+		} else if (!strcmp(command, generic_server_cmd)) {
+			g_free(command);
+			return 0;
+		} else {
+			DBG("generic: parameters changed, restarting the server\n");
+			generic_server_close();
+		}
+	}
+
+	if (generic_server_open(command) != 0) {
+		g_free(command);
+		return -1;
+	}
+	return 0;
+}
+
+static int generic_server_write(const char *data, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(generic_server_in, data, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			DBG("generic: can't write to the server: %s\n",
+			    strerror(errno));
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Send a piece of text as one line */
+static int generic_server_send(char *text)
+{
+	char *p;
+
+	for (p = text; *p; p++)
+		if (*p == '\n' || *p == '\r')
+			*p = ' ';
+
+	DBG("generic: sending to server |%s|\n", text);
+	if (generic_server_write(text, strlen(text))
+	    || generic_server_write("\n", 1))
+		return -1;
+	if (GenericServerDelimiter[0] != '\0'
+	    && (generic_server_write(GenericServerDelimiter,
+				     strlen(GenericServerDelimiter))
+		|| generic_server_write("\n", 1)))
+		return -1;
+	return 0;
+}
+
+/* Pass the audio read from fd to the server.  Return 0 when nothing came
+   for timeout ms (start_timeout before the first bytes, -1 waits forever), 1
+   at the end of the file and -1 on errors.  After stop or pause the rest is
+   still read, but dropped. */
+static int generic_pass_audio(int fd, const AudioTrack * format,
+			      int start_timeout, int timeout)
+{
+	int16_t samples[4096];
+	char *buf = (char *)samples;
+	size_t sample_size = format->num_channels * sizeof(int16_t);
+	size_t filled = 0, used;
+	struct pollfd pfd = {.fd = fd,.events = POLLIN };
+	AudioTrack track = *format;
+	ssize_t bytes;
+	int ret;
+
+	track.samples = samples;
+	while (1) {
+		ret = poll(&pfd, 1, start_timeout);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			DBG("generic: can't poll the audio: %s\n",
+			    strerror(errno));
+			return -1;
+		}
+		if (ret == 0)
+			return 0;
+
+		bytes = read(fd, buf + filled, sizeof(samples) - filled);
+		if (bytes < 0) {
+			if (errno == EINTR)
+				continue;
+			DBG("generic: can't read the audio: %s\n",
+			    strerror(errno));
+			return -1;
+		}
+		if (bytes == 0)
+			return 1;
+		filled += bytes;
+		start_timeout = timeout;
+
+		track.num_samples = filled / sample_size;
+		used = track.num_samples * sample_size;
+		if (track.num_samples > 0 && !generic_stop_requested
+		    && !generic_pause_requested)
+			module_tts_output_server(&track, SPD_AUDIO_LE);
+		filled -= used;
+		memmove(buf, buf + used, filled);
+	}
+}
+
+static int generic_read_full(int fd, void *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = read(fd, buf, len);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf = (char *)buf + ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+#define GENERIC_LE16(p) ((p)[0] | (p)[1] << 8)
+#define GENERIC_LE32(p) ((uint32_t) GENERIC_LE16(p) | (uint32_t) GENERIC_LE16((p) + 2) << 16)
+
+/* Read a WAV header up to the samples.  Streaming synthesizers do not know
+   the size of the data in advance, so it is ignored and the samples are
+   read until the end of the file. */
+static int generic_read_wav_header(int fd, AudioTrack * format)
+{
+	unsigned char header[16], skip[256];
+	uint32_t size;
+	int got_format = 0;
+	size_t len;
+
+	if (generic_read_full(fd, header, 12) != 0
+	    || memcmp(header, "RIFF", 4) || memcmp(header + 8, "WAVE", 4)) {
+		DBG("generic: the command did not write a WAV file\n");
+		return -1;
+	}
+
+	while (1) {
+		if (generic_read_full(fd, header, 8) != 0) {
+			DBG("generic: truncated WAV header\n");
+			return -1;
+		}
+		size = GENERIC_LE32(header + 4);
+		if (!memcmp(header, "data", 4))
+			break;
+
+		if (!memcmp(header, "fmt ", 4) && size >= 16) {
+			if (generic_read_full(fd, header, 16) != 0)
+				return -1;
+			format->num_channels = GENERIC_LE16(header + 2);
+			format->sample_rate = GENERIC_LE32(header + 4);
+			format->bits = GENERIC_LE16(header + 14);
+			got_format = 1;
+			size -= 16;
+		}
+		/* Chunks are padded to even sizes */
+		size += size & 1;
+		while (size > 0) {
+			len = size < sizeof(skip) ? size : sizeof(skip);
+			if (generic_read_full(fd, skip, len) != 0)
+				return -1;
+			size -= len;
+		}
+	}
+
+	if (!got_format || format->bits != 16 || format->num_channels <= 0
+	    || format->sample_rate <= 0) {
+		DBG("generic: unsupported WAV format, only 16 bit PCM\n");
+		return -1;
+	}
+	return 0;
+}
+
+static int generic_server_say(char *text)
+{
+	AudioTrack format = {
+		.bits = 16,
+		.num_channels = GenericAudioChannels,
+		.sample_rate = GenericAudioSampleRate,
+	};
+
+	if (generic_server_update() != 0)
+		return -1;
+
+	if (generic_server_send(text) != 0
+	    || generic_pass_audio(generic_server_out, &format,
+				  GenericServerStartTimeout,
+				  GenericServerTimeout) != 0) {
+		/* Start it again for the next piece */
+		generic_server_close();
+		return -1;
+	}
+	return 0;
+}
+
+/* The command for a piece of text in capture mode */
+static char *generic_capture_command(const char *text)
+{
+	char *e_string, *command;
+	const char *p;
+	GString *message;
+
+	message = g_string_new("");
+	for (p = text; *p; p++) {
+		if (*p == '\'')
+			g_string_append(message, "'\\''");
+		else
+			g_string_append_c(message, *p);
+	}
+
+	e_string = generic_expand_command(GenericExecuteSynth, NULL);
+	command = string_replace(e_string, "$DATA", message->str);
+	g_free(e_string);
+	g_string_free(message, TRUE);
+
+	return command;
+}
+
+static int generic_capture_say(char *text)
+{
+	AudioTrack format = {
+		.bits = 16,
+		.num_channels = GenericAudioChannels,
+		.sample_rate = GenericAudioSampleRate,
+	};
+	char *command;
+	pid_t pid;
+	int fd, ret, status;
+
+	command = generic_capture_command(text);
+	DBG("generic: synth command = |%s|\n", command);
+
+	pthread_mutex_lock(&generic_pid_mutex);
+	if (generic_stop_requested)
+		pid = 0;
+	else
+		pid = generic_spawn(command, NULL, &fd);
+	if (pid > 0)
+		generic_pid = pid;
+	pthread_mutex_unlock(&generic_pid_mutex);
+	g_free(command);
+	if (pid <= 0)
+		return pid;
+
+	if (generic_audio_output == GENERIC_AUDIO_WAV
+	    && generic_read_wav_header(fd, &format) != 0)
+		ret = -1;
+	else
+		ret = generic_pass_audio(fd, &format, -1, -1);
+	close(fd);
+
+	/* It stays a zombie until waited for, so stop can't kill another one */
+	if (ret < 0)
+		kill(-pid, SIGKILL);
+	waitpid(pid, &status, 0);
+	pthread_mutex_lock(&generic_pid_mutex);
+	generic_pid = 0;
+	pthread_mutex_unlock(&generic_pid_mutex);
+
+	DBG("generic: command terminated, status %d\n", status);
+	if (generic_stop_requested)
+		return 0;
+	return ret < 0 ? -1 : 0;
+}
+
+/* Say the message piece by piece with the server or capture mode */
+static void generic_speak_pieces(int (*say) (char *text))
+{
+	char *buf;
+	unsigned int pos = 0;
+	int bytes = 0, failed = 0;
+
+	buf = g_malloc(GenericMaxChunkLength + 1);
+	module_report_event_begin();
+
+	while (!failed && !generic_stop_requested && !generic_pause_requested) {
+		bytes = module_get_message_part(generic_message, buf, &pos,
+						GenericMaxChunkLength,
+						GenericDelimiters);
+		if (bytes <= 0)
+			break;
+		buf[bytes] = 0;
+
+		if (buf[strspn(buf, " \t\r\n")] == '\0')
+			continue;
+
+		if (say(buf) != 0)
+			failed = 1;
+	}
+	g_free(buf);
+	generic_position = pos;
+
+	if (failed || generic_stop_requested)
+		module_report_event_stop();
+	else if (bytes > 0 && generic_pause_requested)
+		module_report_event_pause();
+	else
+		module_report_event_end();
+	generic_pause_requested = 0;
+}
+
 void *_generic_speak(void *nothing)
 {
 	TModuleDoublePipe module_pipe;
@@ -380,9 +938,28 @@ void *_generic_speak(void *nothing)
 	set_speaking_thread_parameters();
 
 	while (1) {
-		sem_wait(generic_semaphore);
+		spd_semaphore_wait(&generic_semaphore);
 		DBG("Semaphore on\n");
 
+		if (generic_server_mode
+		    || generic_audio_output != GENERIC_AUDIO_PLAY) {
+			if (generic_message_type == SPD_MSGTYPE_SOUND_ICON) {
+				/* The server plays it with the rest */
+				char *icon = g_build_filename(GenericSoundIconFolder,
+							      generic_message,
+							      NULL);
+				module_report_event_begin();
+				module_report_icon(icon);
+				module_report_event_end();
+				g_free(icon);
+			} else if (generic_server_mode)
+				generic_speak_pieces(generic_server_say);
+			else
+				generic_speak_pieces(generic_capture_say);
+			generic_speaking = 0;
+			continue;
+		}
+
 		const char *play_command = NULL;
 		play_command = spd_audio_get_playcmd(module_audio_id);
 
@@ -443,69 +1020,15 @@ void *_generic_speak(void *nothing)
 		case 0:{
 				char *e_string;
 				char *p;
-				char *tmpdir, *homedir;
-				const char *helper;
-
-				helper = getenv("TMPDIR");
-				if (helper)
-					tmpdir = g_strdup(helper);
-				else
-					tmpdir = g_strdup("/tmp");
-
-				helper = g_get_home_dir();
-				if (helper)
-					homedir = g_strdup(helper);
-				else
-					homedir =
-					    g_strdup("UNKNOWN_HOME_DIRECTORY");
 
 				/* Set this process as a process group leader (so that SIGKILL
 				   is also delivered to the child processes created by system()) */
 				if (setpgid(0, 0) == -1)
 					DBG("Can't set myself as project group leader!");
 
-				e_string = g_strdup(GenericExecuteSynth);
-
-				e_string =
-				    string_replace(e_string, "$PLAY_COMMAND",
-						   play_command);
-				e_string =
-				    string_replace(e_string, "$TMPDIR", tmpdir);
-				g_free(tmpdir);
-				e_string =
-				    string_replace(e_string, "$HOMEDIR",
-						   homedir);
-				g_free(homedir);
-				e_string =
-				    string_replace(e_string, "$PITCH",
-						   generic_msg_pitch_str);
-				e_string =
-				    string_replace(e_string, "$PITCH_RANGE",
-						   generic_msg_pitch_range_str);
-				e_string =
-				    string_replace(e_string, "$RATE",
-						   generic_msg_rate_str);
-				e_string =
-				    string_replace(e_string, "$VOLUME",
-						   generic_msg_volume_str);
-				e_string =
-				    string_replace(e_string, "$LANGUAGE",
-						   generic_msg_language->name);
 				e_string =
-				    string_replace(e_string, "$PUNCT",
-						   generic_msg_punct_str);
-				if (generic_msg_voice_str != NULL)
-					e_string =
-					    string_replace(e_string, "$VOICE",
-							   generic_msg_voice_str);
-				else {
-					char *default_voice = module_getdefaultvoice();
-					if (!default_voice)
-						default_voice = "no_voice";
-					e_string =
-					    string_replace(e_string, "$VOICE",
-							    default_voice);
-				}
+				    generic_expand_command(GenericExecuteSynth,
+							   play_command);
 
 				/* Cut it into two strings */
 				p = strstr(e_string, "$DATA");
@@ -157,15 +157,10 @@ static gboolean pause_index_sent = FALSE;
 
 static gboolean initialized = FALSE;
 
-/* ECI */
-static ECIHand eciHandle = NULL_ECI_HAND;
-static int eci_sample_rate = 0;
-
-/* ECI sends audio back in chunks to this buffer.
+/* ECI sends audio back in chunks to a buffer of each engine.
    The smaller the buffer, the higher the overhead, but the better
    the index mark resolution. */
 typedef signed short int TEciAudioSamples;
-static TEciAudioSamples *audio_chunk;
 
 /* For some reason, these were left out of eci.h. */
 typedef enum {
@@ -179,19 +174,42 @@ typedef enum {
 static GHashTable *index_mark_ht = NULL;
 #define MSG_END_MARK 0
 
-/* When a voice is set, this is the baseline pitch of the voice.
-   SSIP PITCH commands then adjust relative to this. */
-static int voice_pitch_baseline;
-/* When a voice is set, this the default speed of the voice.
-   SSIP RATE commands then adjust relative to this. */
-static int voice_speed;
+/* An ECI instance with the voice it was set to. Several of them are kept
+   so that switching between voices does not have to set up the language
+   again, see select_engine(). */
+typedef struct {
+	ECIHand hEngine;
+	int sample_rate;
+	TEciAudioSamples *audio_chunk;
 
-/* Expected input encoding for current language dialect. */
-#ifdef VOXIN
-static char *input_encoding = "utf-8";
-#else
-static char *input_encoding = "cp1252";
-#endif
+	/* When a voice is set, this is the baseline pitch of the voice.
+	   SSIP PITCH commands then adjust relative to this. */
+	int voice_pitch_baseline;
+	/* When a voice is set, this the default speed of the voice.
+	   SSIP RATE commands then adjust relative to this. */
+	int voice_speed;
+
+	/* Expected input encoding for its language dialect. */
+	char *input_encoding;
+
+	/* Index of the voices or eciLocales array and voice type it was
+	   set to, -1 before that */
+	int locale_index;
+	SPDVoiceType voice_type;
+
+	/* Index of the language of the user dictionary loaded */
+	guint dict_index;
+
+	unsigned last_use;
+} TIbmttsEngine;
+
+#define IBMTTS_MAX_ENGINES 8
+static TIbmttsEngine engines[IBMTTS_MAX_ENGINES];
+static int num_engines = 0;
+static unsigned engine_clock = 0;
+
+/* The engine of the current voice */
+static TIbmttsEngine *engine = NULL;
 
 /* list of speechd voices */
 static SPDVoice **speechd_voice = NULL;
@@ -203,6 +221,8 @@ static int *speechd_voice_index = NULL;
 #endif
 
 /* Internal function prototypes. */
+static TIbmttsEngine *new_engine(void);
+static void delete_engine(TIbmttsEngine * e);
 static void update_sample_rate();
 static void set_language(char *lang);
 static void set_voice_type(SPDVoiceType voice_type);
@@ -233,9 +253,8 @@ static enum ECICallbackReturn eciCallback(ECIHand hEngine,
 					  long lparam, void *data);
 
 /* Internal function prototypes. */
-static gboolean add_audio_to_playback_queue(TEciAudioSamples *
-						      audio_chunk,
-						      long num_samples);
+static gboolean add_audio_to_playback_queue(TIbmttsEngine * e,
+					    long num_samples);
 static void add_mark_to_playback_queue(long markId);
 
 /* Miscellaneous internal function prototypes. */
@@ -254,6 +273,7 @@ MOD_OPTION_1_INT(IbmttsUseAbbreviation);
 MOD_OPTION_1_STR(IbmttsDictionaryFolder);
 MOD_OPTION_1_INT(IbmttsAudioChunkSize);
 MOD_OPTION_1_STR(IbmttsSoundIconFolder);
+MOD_OPTION_1_INT(IbmttsEngines);
 MOD_OPTION_6_INT_HT(IbmttsVoiceParameters,
 		    gender, breathiness, head_size, pitch_baseline,
 		    pitch_fluctuation, roughness, speed);
@@ -344,6 +364,7 @@ int module_load(void)
 			     "/var/opt/IBM/ibmtts/dict");
 
 	MOD_OPTION_1_INT_REG(IbmttsAudioChunkSize, 20000);
+	MOD_OPTION_1_INT_REG(IbmttsEngines, 2);
 	MOD_OPTION_1_STR_REG(IbmttsSoundIconFolder,
 			     "/usr/share/sounds/sound-icons/");
 
@@ -377,46 +398,13 @@ int module_init(char **status_info)
 	 */
 
 	/* Setup TTS engine. */
-	DBG(DBG_MODNAME "Creating an engine instance.");
-	eciHandle = eciNew();
-	if (NULL_ECI_HAND == eciHandle) {
-		DBG(DBG_MODNAME "Could not create an engine instance.\n");
+	engine = new_engine();
+	if (NULL == engine) {
 		*status_info = g_strdup("Could not create an engine instance. "
 					"Is the TTS engine installed?");
 		return MODULE_FATAL_ERROR;
 	}
 
-	update_sample_rate();
-
-	/* Allocate a chunk for ECI to return audio. */
-	audio_chunk =
-	    (TEciAudioSamples *) g_malloc((IbmttsAudioChunkSize) *
-					  sizeof(TEciAudioSamples));
-
-	DBG(DBG_MODNAME "Registering ECI callback.");
-	eciRegisterCallback(eciHandle, eciCallback, NULL);
-
-	DBG(DBG_MODNAME "Registering an ECI audio buffer.");
-	if (!eciSetOutputBuffer(eciHandle, IbmttsAudioChunkSize, audio_chunk)) {
-		DBG(DBG_MODNAME "Error registering ECI audio buffer.");
-		log_eci_error();
-	}
-
-	eciSetParam(eciHandle, eciDictionary, !IbmttsUseAbbreviation);
-
-	/* enable annotations */
-	eciSetParam(eciHandle, eciInputType, 1);
-
-	/* load possibly the ssml filter */
-	if (IbmttsUseSSML)
-		eciAddText(eciHandle, " `gfa1 ");
-
-	/* load possibly the punctuation filter */
-	if (IbmttsUsePunctuation)
-		eciAddText(eciHandle, " `gfa2 ");
-
-	set_punctuation_mode(msg_settings.punctuation_mode);
-
 	initialized = TRUE;
 
 	if (!alloc_voice_list()) {
@@ -487,10 +475,7 @@ void module_speak_sync(const gchar * data, size_t bytes, SPDMessageType msgtype)
 		message = module_strip_ssml(message);
 		g_free(tmp);
 		/* Convert input to suitable encoding for current language dialect */
-		tmp =
-		    g_convert_with_fallback(message, -1,
-					    input_encoding, "utf-8", "?",
-					    NULL, NULL, NULL);
+		tmp = module_recode(message, -1, engine->input_encoding, "?");
 		if (tmp != NULL) {
 			g_free(message);
 			message = tmp;
@@ -550,15 +535,9 @@ int module_close(void)
 	DBG(DBG_MODNAME "Stopping speech");
 	module_stop();
 
-	DBG(DBG_MODNAME "De-registering ECI callback.");
-	eciRegisterCallback(eciHandle, NULL, NULL);
-
-	DBG(DBG_MODNAME "Destroying ECI instance.");
-	eciDelete(eciHandle);
-	eciHandle = NULL_ECI_HAND;
-
-	/* Free buffer for ECI audio. */
-	g_free(audio_chunk);
+	while (num_engines > 0)
+		delete_engine(&engines[num_engines - 1]);
+	engine = NULL;
 
 	/* Free index mark lookup table. */
 	if (index_mark_ht) {
@@ -575,27 +554,148 @@ int module_close(void)
 
 /* Internal functions */
 
+/* Create an engine instance and add it to the engines */
+static TIbmttsEngine *new_engine(void)
+{
+	TIbmttsEngine *e, *previous;
+
+	if (num_engines >= IBMTTS_MAX_ENGINES)
+		return NULL;
+	e = &engines[num_engines];
+	memset(e, 0, sizeof(*e));
+
+	DBG(DBG_MODNAME "Creating an engine instance.");
+	e->hEngine = eciNew();
+	if (NULL_ECI_HAND == e->hEngine) {
+		DBG(DBG_MODNAME "Could not create an engine instance.\n");
+		return NULL;
+	}
+	num_engines++;
+
+#ifdef VOXIN
+	e->input_encoding = "utf-8";
+#else
+	e->input_encoding = "cp1252";
+#endif
+	e->locale_index = -1;
+	e->dict_index = G_MAXUINT;
+
+	/* The settings below apply to the current engine */
+	previous = engine;
+	engine = e;
+
+	update_sample_rate();
+
+	/* Allocate a chunk for ECI to return audio. */
+	e->audio_chunk =
+	    (TEciAudioSamples *) g_malloc((IbmttsAudioChunkSize) *
+					  sizeof(TEciAudioSamples));
+
+	DBG(DBG_MODNAME "Registering ECI callback.");
+	eciRegisterCallback(e->hEngine, eciCallback, e);
+
+	DBG(DBG_MODNAME "Registering an ECI audio buffer.");
+	if (!eciSetOutputBuffer(e->hEngine, IbmttsAudioChunkSize, e->audio_chunk)) {
+		DBG(DBG_MODNAME "Error registering ECI audio buffer.");
+		log_eci_error();
+	}
+
+	eciSetParam(e->hEngine, eciDictionary, !IbmttsUseAbbreviation);
+
+	/* enable annotations */
+	eciSetParam(e->hEngine, eciInputType, 1);
+
+	/* load possibly the ssml filter */
+	if (IbmttsUseSSML)
+		eciAddText(e->hEngine, " `gfa1 ");
+
+	/* load possibly the punctuation filter */
+	if (IbmttsUsePunctuation)
+		eciAddText(e->hEngine, " `gfa2 ");
+
+	set_punctuation_mode(msg_settings.punctuation_mode);
+
+	engine = previous ? previous : e;
+	return e;
+}
+
+/* Only the last engine gets deleted, so that the others keep their place */
+static void delete_engine(TIbmttsEngine * e)
+{
+	assert(e == &engines[num_engines - 1]);
+
+	DBG(DBG_MODNAME "De-registering ECI callback.");
+	eciRegisterCallback(e->hEngine, NULL, NULL);
+
+	DBG(DBG_MODNAME "Destroying ECI instance.");
+	eciDelete(e->hEngine);
+	e->hEngine = NULL_ECI_HAND;
+
+	/* Free buffer for ECI audio. */
+	g_free(e->audio_chunk);
+	e->audio_chunk = NULL;
+
+	num_engines--;
+}
+
+/* Make current an engine for the voice, preferably one already set to it,
+   then one not set yet, a new one while there may be more, or else the
+   least recently used one, which then needs to be set to the voice.
+   Returns whether it is already set to it. */
+static gboolean select_engine(int locale_index, SPDVoiceType voice_type)
+{
+	TIbmttsEngine *e, *lru = NULL, *unset = NULL;
+	int i;
+
+	for (i = 0; i < num_engines; i++) {
+		e = &engines[i];
+		if (e->locale_index == locale_index
+		    && e->voice_type == voice_type) {
+			DBG(DBG_MODNAME "Reusing engine %d", i);
+			engine = e;
+			e->last_use = ++engine_clock;
+			return TRUE;
+		}
+		if (e->locale_index == -1 && unset == NULL)
+			unset = e;
+		if (lru == NULL || e->last_use < lru->last_use)
+			lru = e;
+	}
+
+	e = unset;
+	if (e == NULL
+	    && num_engines < CLAMP(IbmttsEngines, 1, IBMTTS_MAX_ENGINES))
+		e = new_engine();
+	if (e == NULL)
+		e = lru;
+	DBG(DBG_MODNAME "Setting engine %d to a new voice",
+	    (int) (e - engines));
+	engine = e;
+	e->last_use = ++engine_clock;
+	return FALSE;
+}
+
 static void update_sample_rate()
 {
 	//	DBG(DBG_MODNAME "ENTER %s", __func__);
 	int sample_rate;
 	/* Get ECI audio sample rate. */
-	sample_rate = eciGetParam(eciHandle, eciSampleRate);
+	sample_rate = eciGetParam(engine->hEngine, eciSampleRate);
 	switch (sample_rate) {
 	case 0:
-		eci_sample_rate = 8000;
+		engine->sample_rate = 8000;
 		break;
 	case 1:
-		eci_sample_rate = 11025;
+		engine->sample_rate = 11025;
 		break;
 	case 2:
-		eci_sample_rate = 22050;
+		engine->sample_rate = 22050;
 		break;
 	default:
 		DBG(DBG_MODNAME "Invalid audio sample rate returned by ECI = %i",
 		    sample_rate);
 	}
-	DBG(DBG_MODNAME "LEAVE %s, eci_sample_rate=%d",  __FUNCTION__, eci_sample_rate);  
+	DBG(DBG_MODNAME "LEAVE %s, engine->sample_rate=%d",  __FUNCTION__, engine->sample_rate);  
 }
 
 /* Given a string containing an index mark in the form
@@ -664,7 +764,7 @@ static int process_text_mark(char *part, int part_len, char *mark_name)
 		int *markId = (int *)g_malloc(sizeof(int));
 		*markId = 1 + g_hash_table_size(index_mark_ht);
 		g_hash_table_insert(index_mark_ht, markId, mark_name);
-		if (!eciInsertIndex(eciHandle, *markId)) {
+		if (!eciInsertIndex(engine->hEngine, *markId)) {
 			DBG(DBG_MODNAME "Error sending index mark to synthesizer.");
 			log_eci_error();
 			/* Try to keep going. */
@@ -678,7 +778,7 @@ static int process_text_mark(char *part, int part_len, char *mark_name)
 		DBG(DBG_MODNAME "Returned %d bytes from get_part.", part_len);
 		DBG(DBG_MODNAME "Text to synthesize is |%s|", part);
 		DBG(DBG_MODNAME "Sending text to synthesizer.");
-		if (!eciAddText(eciHandle, part)) {
+		if (!eciAddText(engine->hEngine, part)) {
 			DBG(DBG_MODNAME "Error sending text.");
 			log_eci_error();
 			return 2;
@@ -692,9 +792,9 @@ static int process_text_mark(char *part, int part_len, char *mark_name)
 	   Add index mark for end of message.
 	   This also makes sure the callback gets called at least once
 	 */
-	eciInsertIndex(eciHandle, MSG_END_MARK);
+	eciInsertIndex(engine->hEngine, MSG_END_MARK);
 	DBG(DBG_MODNAME "Trying to synthesize text.");
-	if (!eciSynthesize(eciHandle)) {
+	if (!eciSynthesize(engine->hEngine)) {
 		DBG(DBG_MODNAME "Error synthesizing.");
 		log_eci_error();
 		return 2;;
@@ -702,7 +802,7 @@ static int process_text_mark(char *part, int part_len, char *mark_name)
 
 	/* Audio and index marks are returned in eciCallback(). */
 	DBG(DBG_MODNAME "Waiting for synthesis to complete.");
-	if (!eciSynchronize(eciHandle)) {
+	if (!eciSynchronize(engine->hEngine)) {
 		DBG(DBG_MODNAME "Error waiting for synthesis to complete.");
 		log_eci_error();
 		return 2;
@@ -735,7 +835,7 @@ static void _synth(char *message, SPDMessageType message_type)
 
 	switch (message_type) {
 	case SPD_MSGTYPE_TEXT:
-		eciSetParam(eciHandle, eciTextMode, eciTextModeDefault);
+		eciSetParam(engine->hEngine, eciTextMode, eciTextModeDefault);
 		break;
 	case SPD_MSGTYPE_SOUND_ICON:
 		/* IBM TTS does not support sound icons.
@@ -746,11 +846,11 @@ static void _synth(char *message, SPDMessageType message_type)
 			add_sound_icon_to_playback_queue(part);
 			return;
 		} else
-			eciSetParam(eciHandle, eciTextMode,
+			eciSetParam(engine->hEngine, eciTextMode,
 				    eciTextModeDefault);
 		break;
 	case SPD_MSGTYPE_CHAR:
-		eciSetParam(eciHandle, eciTextMode,
+		eciSetParam(engine->hEngine, eciTextMode,
 			    eciTextModeAllSpell);
 		break;
 	case SPD_MSGTYPE_KEY:
@@ -761,14 +861,14 @@ static void _synth(char *message, SPDMessageType message_type)
 		DBG(DBG_MODNAME "Key to speak: |%s|", pos);
 		g_free(message);
 		message = pos;
-		eciSetParam(eciHandle, eciTextMode, eciTextModeDefault);
+		eciSetParam(engine->hEngine, eciTextMode, eciTextModeDefault);
 		break;
 	case SPD_MSGTYPE_SPELL:
 		if (SPD_PUNCT_NONE != msg_settings.punctuation_mode)
-			eciSetParam(eciHandle, eciTextMode,
+			eciSetParam(engine->hEngine, eciTextMode,
 				    eciTextModeAllSpell);
 		else
-			eciSetParam(eciHandle, eciTextMode,
+			eciSetParam(engine->hEngine, eciTextMode,
 				    eciTextModeAlphaSpell);
 		break;
 	}
@@ -847,15 +947,15 @@ static void set_rate(signed int rate)
 	/* Possible ECI range is 0 to 250. */
 	/* Map rate -100 to 100 onto speed 0 to 140. */
 	if (rate < 0)
-		/* Map -100 to 0 onto 0 to voice_speed */
-		speed = ((float)(rate + 100) * voice_speed) / (float)100;
+		/* Map -100 to 0 onto 0 to engine->voice_speed */
+		speed = ((float)(rate + 100) * engine->voice_speed) / (float)100;
 	else
-		/* Map 0 to 100 onto voice_speed to 140 */
+		/* Map 0 to 100 onto engine->voice_speed to 140 */
 		speed =
-		    (((float)rate * (140 - voice_speed)) / (float)100)
-		    + voice_speed;
+		    (((float)rate * (140 - engine->voice_speed)) / (float)100)
+		    + engine->voice_speed;
 	assert(speed >= 0 && speed <= 140);
-	int ret = eciSetVoiceParam(eciHandle, 0, eciSpeed, speed);
+	int ret = eciSetVoiceParam(engine->hEngine, 0, eciSpeed, speed);
 	if (-1 == ret) {
 		DBG(DBG_MODNAME "Error setting rate %i.", speed);
 		log_eci_error();
@@ -880,7 +980,7 @@ static void set_volume(signed int volume)
 		/* Map 0 to 100 onto 90 to 100 */
 		vol = ((float)(volume * 10) / (float)100) + 90;
 	assert(vol >= 0 && vol <= 100);
-	int ret = eciSetVoiceParam(eciHandle, 0, eciVolume, vol);
+	int ret = eciSetVoiceParam(engine->hEngine, 0, eciVolume, vol);
 	if (-1 == ret) {
 		DBG(DBG_MODNAME "Error setting volume %i.", vol);
 		log_eci_error();
@@ -898,19 +998,19 @@ static void set_pitch(signed int pitch)
 	int pitchBaseline;
 	/* Possible range 0 to 100. */
 	if (pitch < 0)
-		/* Map -100 to 0 onto 0 to voice_pitch_baseline */
+		/* Map -100 to 0 onto 0 to engine->voice_pitch_baseline */
 		pitchBaseline =
-		    ((float)(pitch + 100) * voice_pitch_baseline) /
+		    ((float)(pitch + 100) * engine->voice_pitch_baseline) /
 		    (float)100;
 	else
-		/* Map 0 to 100 onto voice_pitch_baseline to 100 */
+		/* Map 0 to 100 onto engine->voice_pitch_baseline to 100 */
 		pitchBaseline =
-		    (((float)pitch * (100 - voice_pitch_baseline)) /
+		    (((float)pitch * (100 - engine->voice_pitch_baseline)) /
 		     (float)100)
-		    + voice_pitch_baseline;
+		    + engine->voice_pitch_baseline;
 	assert(pitchBaseline >= 0 && pitchBaseline <= 100);
 	int ret =
-	    eciSetVoiceParam(eciHandle, 0, eciPitchBaseline, pitchBaseline);
+	    eciSetVoiceParam(engine->hEngine, 0, eciPitchBaseline, pitchBaseline);
 	if (-1 == ret) {
 		DBG(DBG_MODNAME "Error setting pitch %i.", pitchBaseline);
 		log_eci_error();
@@ -945,7 +1045,7 @@ static void set_punctuation_mode(SPDPunctuation punct_mode)
 	}
 
 	msg = g_strdup_printf(fmt, real_punct_mode, IbmttsPunctuationList);
-	eciAddText(eciHandle, msg);
+	eciAddText(engine->hEngine, msg);
 	g_free(msg);
 }
 
@@ -967,7 +1067,7 @@ static void set_capital_mode(SPDCapitalLetters cap_mode)
 		break;
 	}
 
-	voxSetParam(eciHandle, VOX_CAPITALS, mode);
+	voxSetParam(engine->hEngine, VOX_CAPITALS, mode);
 }
 #else
 static void set_capital_mode(SPDCapitalLetters cap_mode){}
@@ -1048,37 +1148,37 @@ static void set_voice_parameters(SPDVoiceType voice_type)
 			eciVoice = 1;
 			break;	/* Adult Male 1 */
 		}
-		ret = eciCopyVoice(eciHandle, eciVoice, 0);
+		ret = eciCopyVoice(engine->hEngine, eciVoice, 0);
 		if (-1 == ret)
 			DBG(DBG_MODNAME "ERROR: Setting default voice parameters (voice %i).", eciVoice);
 	} else {
 		DBG(DBG_MODNAME "Setting custom VoiceParameters for voice %s", voicename);
 
-		ret = eciSetVoiceParam(eciHandle, 0, eciGender, params->gender);
+		ret = eciSetVoiceParam(engine->hEngine, 0, eciGender, params->gender);
 		if (-1 == ret)
 			DBG(DBG_MODNAME "ERROR: Setting gender %i", params->gender);
 
-		ret = eciSetVoiceParam(eciHandle, 0, eciBreathiness, params->breathiness);
+		ret = eciSetVoiceParam(engine->hEngine, 0, eciBreathiness, params->breathiness);
 		if (-1 == ret)
 			DBG(DBG_MODNAME "ERROR: Setting breathiness %i", params->breathiness);
 
-		ret = eciSetVoiceParam(eciHandle, 0, eciHeadSize, params->head_size);
+		ret = eciSetVoiceParam(engine->hEngine, 0, eciHeadSize, params->head_size);
 		if (-1 == ret)
 			DBG(DBG_MODNAME "ERROR: Setting head size %i", params->head_size);
 
-		ret = eciSetVoiceParam(eciHandle, 0, eciPitchBaseline, params->pitch_baseline);
+		ret = eciSetVoiceParam(engine->hEngine, 0, eciPitchBaseline, params->pitch_baseline);
 		if (-1 == ret)
 			DBG(DBG_MODNAME "ERROR: Setting pitch baseline %i", params->pitch_baseline);
 
-		ret = eciSetVoiceParam(eciHandle, 0, eciPitchFluctuation, params->pitch_fluctuation);
+		ret = eciSetVoiceParam(engine->hEngine, 0, eciPitchFluctuation, params->pitch_fluctuation);
 		if (-1 == ret)
 			DBG(DBG_MODNAME "ERROR: Setting pitch fluctuation %i", params->pitch_fluctuation);
 
-		ret = eciSetVoiceParam(eciHandle, 0, eciRoughness, params->roughness);
+		ret = eciSetVoiceParam(engine->hEngine, 0, eciRoughness, params->roughness);
 		if (-1 == ret)
 			DBG(DBG_MODNAME "ERROR: Setting roughness %i", params->roughness);
 
-		ret = eciSetVoiceParam(eciHandle, 0, eciSpeed, params->speed);
+		ret = eciSetVoiceParam(engine->hEngine, 0, eciSpeed, params->speed);
 		if (-1 == ret)
 			DBG(DBG_MODNAME "ERROR: Setting speed %i", params->speed);
 	}
@@ -1175,10 +1275,16 @@ static void set_language_and_voice(char *lang, SPDVoiceType voice_type, char *na
 		index = 0;
 	}
 
+	if (select_engine(index, voice_type)) {
+		g_atomic_int_set(&locale_index_atomic, index);
+		return;
+	}
+	engine->locale_index = -1;
+
 #ifdef VOXIN
-	ret = eciSetParam(eciHandle, eciLanguageDialect, voices[index].id);
+	ret = eciSetParam(engine->hEngine, eciLanguageDialect, voices[index].id);
 #else
-	ret = eciSetParam(eciHandle, eciLanguageDialect, eciLocales[index].langID);
+	ret = eciSetParam(engine->hEngine, eciLanguageDialect, eciLocales[index].langID);
 #endif
 	if (ret == -1) {
 		DBG(DBG_MODNAME "Unable to set language");
@@ -1190,25 +1296,27 @@ static void set_language_and_voice(char *lang, SPDVoiceType voice_type, char *na
 	DBG(DBG_MODNAME "select speechd_voice[%d]: id=0x%x, name=%s (ret=%d)",
 	    index, voices[index].id, voices[index].name, ret);
 
-	input_encoding = voices[index].charset;
+	engine->input_encoding = voices[index].charset;
 #else
 	DBG(DBG_MODNAME "set langID=0x%x (ret=%d)",
 	    eciLocales[index].langID, ret);
 
-	input_encoding = eciLocales[index].charset;
+	engine->input_encoding = eciLocales[index].charset;
 #endif
 	update_sample_rate();		  	
 	g_atomic_int_set(&locale_index_atomic, index);
 
 	set_voice_parameters(voice_type);
+	engine->locale_index = index;
+	engine->voice_type = voice_type;
 
 	/* Retrieve the baseline pitch and speed of the voice. */
-	voice_pitch_baseline = eciGetVoiceParam(eciHandle, 0, eciPitchBaseline);
-	if (-1 == voice_pitch_baseline)
+	engine->voice_pitch_baseline = eciGetVoiceParam(engine->hEngine, 0, eciPitchBaseline);
+	if (-1 == engine->voice_pitch_baseline)
 		DBG(DBG_MODNAME "Cannot get pitch baseline of voice.");
 
-	voice_speed = eciGetVoiceParam(eciHandle, 0, eciSpeed);
-	if (-1 == voice_speed)
+	engine->voice_speed = eciGetVoiceParam(engine->hEngine, 0, eciSpeed);
+	if (-1 == engine->voice_speed)
 		DBG(DBG_MODNAME "Cannot get speed of voice.");
 }
 
@@ -1247,7 +1355,7 @@ static void log_eci_error()
 	DBG(DBG_MODNAME "ENTER %s", __func__);
 	/* TODO: This routine is not working.  Not sure why. */
 	char buf[100];
-	eciErrorMessage(eciHandle, buf);
+	eciErrorMessage(engine->hEngine, buf);
 	DBG(DBG_MODNAME "ECI Error Message: %s", buf);
 }
 
@@ -1269,7 +1377,7 @@ static enum ECICallbackReturn eciCallback(ECIHand hEngine,
 	case eciWaveformBuffer:
 		DBG(DBG_MODNAME "%ld audio samples returned from TTS.", lparam);
 		/* Add audio to output queue. */
-		add_audio_to_playback_queue(audio_chunk, lparam);
+		add_audio_to_playback_queue(data, lparam);
 		return eciDataProcessed;
 
 	case eciIndexReply:
@@ -1286,15 +1394,15 @@ static enum ECICallbackReturn eciCallback(ECIHand hEngine,
 }
 
 /* Adds a chunk of pcm audio to the audio playback queue. */
-static gboolean add_audio_to_playback_queue(TEciAudioSamples * audio_chunk, long num_samples)
+static gboolean add_audio_to_playback_queue(TIbmttsEngine * e, long num_samples)
 {
 	DBG(DBG_MODNAME "ENTER %s", __func__);
 	AudioTrack track = {
 		.bits = 16,
 		.num_channels = 1,
-		.sample_rate = eci_sample_rate,
+		.sample_rate = e->sample_rate,
 		.num_samples = num_samples,
-		.samples = audio_chunk,
+		.samples = e->audio_chunk,
 	};
 #if defined(BYTE_ORDER) && (BYTE_ORDER == BIG_ENDIAN)
 	AudioFormat format = SPD_AUDIO_BE;
@@ -1609,7 +1717,6 @@ static void load_user_dictionary()
 	GString *filename = NULL;
 	int i = 0;
 	int dictionary_is_present = 0;
-	static guint old_index = G_MAXUINT;
 	guint new_index;
 	char *language = NULL;
 #ifdef VOXIN
@@ -1617,7 +1724,7 @@ static void load_user_dictionary()
 #else
 	char *dash;
 #endif
-	ECIDictHand eciDict = eciGetDict(eciHandle);
+	ECIDictHand eciDict = eciGetDict(engine->hEngine);
 
 	new_index = g_atomic_int_get(&locale_index_atomic);
 	if (new_index >= MAX_NB_OF_LANGUAGES) {
@@ -1626,7 +1733,7 @@ static void load_user_dictionary()
 		return;
 	}
 
-	if (old_index == new_index) {
+	if (engine->dict_index == new_index) {
 		DBG(DBG_MODNAME "LEAVE %s, no change", __FUNCTION__);
 		return;
 	}
@@ -1643,13 +1750,13 @@ static void load_user_dictionary()
 
 	if (eciDict) {
 		DBG(DBG_MODNAME "delete old dictionary");
-		eciDeleteDict(eciHandle, eciDict);
+		eciDeleteDict(engine->hEngine, eciDict);
 	}
-	eciDict = eciNewDict(eciHandle);
+	eciDict = eciNewDict(engine->hEngine);
 	if (eciDict) {
-		old_index = new_index;
+		engine->dict_index = new_index;
 	} else {
-		old_index = MAX_NB_OF_LANGUAGES;
+		engine->dict_index = MAX_NB_OF_LANGUAGES;
 		DBG(DBG_MODNAME "can't create new dictionary");
 		g_free(language);
 		return;
@@ -1692,7 +1799,7 @@ static void load_user_dictionary()
 				dictionary_filenames[i]);
 		if (g_file_test(filename->str, G_FILE_TEST_EXISTS)) {
 			enum ECIDictError error =
-			    eciLoadDict(eciHandle, eciDict, i, filename->str);
+			    eciLoadDict(engine->hEngine, eciDict, i, filename->str);
 			if (!error) {
 				dictionary_is_present = 1;
 				DBG(DBG_MODNAME "%s dictionary loaded",
@@ -1710,7 +1817,7 @@ static void load_user_dictionary()
 	g_string_free(dirname, TRUE);
 
 	if (dictionary_is_present) {
-		eciSetDict(eciHandle, eciDict);
+		eciSetDict(engine->hEngine, eciDict);
 	}
 }
 /* local variables: */
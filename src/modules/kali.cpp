@@ -55,6 +55,25 @@ static SPDVoice **kali_get_voices();
 
 static int kali_stop = 0;
 
+/* What was last set in the engine, so that each message only calls into it
+ * for what changed */
+static struct {
+	int rate;
+	int volume;
+	int pitch;
+	int mode;
+	int voice;		/* 0 for none yet */
+} kali_state;
+
+/* Record val as the current one, returns whether it changed */
+static bool kali_state_changed(int *cur, int val)
+{
+	if (*cur == val)
+		return false;
+	*cur = val;
+	return true;
+}
+
 MOD_OPTION_1_INT(KaliMaxChunkLength);
 MOD_OPTION_1_STR(KaliDelimiters);
 MOD_OPTION_1_INT(KaliNormalRate);
@@ -99,6 +118,11 @@ int module_init(char **status_info)
 	SetDebitKali(KaliNormalRate);
 	SetVolumeKali(KaliNormalVolume);
 	SetHauteurKali(KaliNormalPitch);
+	kali_state.rate = KaliNormalRate;
+	kali_state.volume = KaliNormalVolume;
+	kali_state.pitch = KaliNormalPitch;
+	kali_state.mode = -1;
+	kali_state.voice = 0;
 	kali_voice_list = kali_get_voices();
 	if (!kali_voice_list) {
 		*status_info = g_strdup("Kali has no voice installed");
@@ -278,7 +302,8 @@ static void kali_set_rate(signed int rate)
 	  speed = GetDebitDefautKaliStd() - rate * (GetDebitMinKaliStd() - GetDebitDefautKaliStd()) / 100;
 	else
 	  speed = GetDebitDefautKaliStd() + rate * (GetDebitMaxKaliStd() - GetDebitDefautKaliStd()) / 100;
-	SetDebitKali(speed);
+	if (kali_state_changed(&kali_state.rate, speed))
+		SetDebitKali(speed);
 }
 
 static void kali_set_volume(signed int volume)
@@ -290,7 +315,8 @@ static void kali_set_volume(signed int volume)
 	  vol = GetVolumeDefautKaliStd() - volume * (GetVolumeMinKaliStd() - GetVolumeDefautKaliStd()) / 100;
 	else
 	  vol = GetVolumeDefautKaliStd() + volume * (GetVolumeMaxKaliStd() - GetVolumeDefautKaliStd()) / 100;
-	SetVolumeKali(vol);
+	if (kali_state_changed(&kali_state.volume, vol))
+		SetVolumeKali(vol);
 }
 
 static void kali_set_pitch(signed int pitch)
@@ -302,31 +328,36 @@ static void kali_set_pitch(signed int pitch)
 	  ptch = GetHauteurDefautKaliStd() - pitch * (GetHauteurMinKaliStd() - GetHauteurDefautKaliStd()) / 100;
 	else
 	  ptch = GetHauteurDefautKaliStd() + pitch * (GetHauteurMaxKaliStd() - GetHauteurDefautKaliStd()) / 100;
-	SetHauteurKali(ptch);
+	if (kali_state_changed(&kali_state.pitch, ptch))
+		SetHauteurKali(ptch);
 }
 
 void kali_set_punctuation_mode(SPDPunctuation punct)
 {
+	int mode;
+
 	switch (punct) {
 	case SPD_PUNCT_NONE:
 		if (KaliExpandAbbreviations)
-			SetModeLectureKali(0);
+			mode = 0;
 		else
-			SetModeLectureKali(1);
+			mode = 1;
 		break;
 	case SPD_PUNCT_SOME:
-		SetModeLectureKali(2);
+		mode = 2;
 		break;
 	case SPD_PUNCT_MOST:
 		/* XXX approximation */
-		SetModeLectureKali(2);
+		mode = 2;
 		break;
 	case SPD_PUNCT_ALL:
-		SetModeLectureKali(3);
+		mode = 3;
 		break;
 	default:
-		break;
+		return;
 	}
+	if (kali_state_changed(&kali_state.mode, mode))
+		SetModeLectureKali(mode);
 }
 
 static void kali_set_voice(char *voice)
@@ -337,8 +368,14 @@ static void kali_set_voice(char *voice)
 	if (v == NULL)
 		v = KaliVoiceParameters;
 
+	/* Called for each message, usually with the same voice */
+	if (kali_state.voice > 0
+	    && strcasecmp(kali_voice_list[kali_state.voice - 1]->name, v) == 0)
+		return;
+
 	for (i = 0; kali_voice_list[i] != NULL; i++) {
 		if (strcasecmp(kali_voice_list[i]->name, v) == 0) {
+			kali_state.voice = i + 1;
 			nlang = GetNLangueVoixKaliStd(i + 1);
 			SetLangueKali(nlang);
 			SetVoixKali(i + 1);
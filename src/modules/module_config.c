@@ -20,6 +20,7 @@
  */
 
 #include "config.h"
+#include <sys/stat.h>
 #include <dotconf.h>
 #ifndef USE_DLOPEN
 #include <ltdl.h>
@@ -28,11 +29,92 @@
 #include "module_main.h"
 #include "module_utils.h"
 
+static int ServerAudioMinChunk, ServerAudioMaxChunk;
+static int AudioCacheMaxKBytes = 512, AudioCacheMaxLength = 20;
+static char *AudioCacheDir;
+static int SilenceThreshold = 10, SilenceKeptMs;
+static char *WarmUpText, *WarmUpLanguage;
+
+static DOTCONF_CB(ServerAudioMinChunk_cb)
+{
+	ServerAudioMinChunk = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(ServerAudioMaxChunk_cb)
+{
+	ServerAudioMaxChunk = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(AudioCacheMaxKBytes_cb)
+{
+	AudioCacheMaxKBytes = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(AudioCacheMaxLength_cb)
+{
+	AudioCacheMaxLength = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(SilenceThreshold_cb)
+{
+	SilenceThreshold = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(SilenceKeptMs_cb)
+{
+	SilenceKeptMs = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(AudioCacheDir_cb)
+{
+	g_free(AudioCacheDir);
+	AudioCacheDir = g_strdup(cmd->data.str);
+	return NULL;
+}
+
+static DOTCONF_CB(WarmUpText_cb)
+{
+	g_free(WarmUpText);
+	WarmUpText = g_strdup(cmd->data.str);
+	return NULL;
+}
+
+static DOTCONF_CB(WarmUpLanguage_cb)
+{
+	g_free(WarmUpLanguage);
+	WarmUpLanguage = g_strdup(cmd->data.str);
+	return NULL;
+}
+
+static void module_config_cache(const char *configfilename)
+{
+	struct stat st;
+	char *salt;
+
+	/* Audio cached on disk is not valid any more once the configuration
+	 * has changed */
+	if (configfilename != NULL && stat(configfilename, &st) == 0)
+		salt = g_strdup_printf("%s %ld", module_name,
+				       (long) st.st_mtime);
+	else
+		salt = g_strdup(module_name);
+	module_speech_cache_configure(AudioCacheMaxKBytes, AudioCacheMaxLength,
+				      AudioCacheDir, salt);
+	g_free(salt);
+}
+
 int module_config(const char *configfilename) {
 	int ret;
 
-#ifndef USE_DLOPEN
-	/* Initialize ltdl's list of preloaded audio backends. */
+#if !defined(USE_DLOPEN) && !defined(SPD_MODULE_LIBRARY)
+	/* Initialize ltdl's list of preloaded audio backends, a module library
+	 * has none since it plays through the server. */
 	LTDL_SET_PRELOADED_SYMBOLS();
 #endif
 
@@ -45,9 +127,47 @@ int module_config(const char *configfilename) {
 
 	if (configfilename == NULL) {
 		DBG("No config file specified, using defaults...\n");
+		module_config_cache(NULL);
 		return 0;
 	}
 
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "ServerAudioMinChunk", ARG_INT,
+						     ServerAudioMinChunk_cb, NULL, 0);
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "ServerAudioMaxChunk", ARG_INT,
+						     ServerAudioMaxChunk_cb, NULL, 0);
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "AudioCacheMaxKBytes", ARG_INT,
+						     AudioCacheMaxKBytes_cb, NULL, 0);
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "AudioCacheMaxLength", ARG_INT,
+						     AudioCacheMaxLength_cb, NULL, 0);
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "AudioCacheDir", ARG_STR,
+						     AudioCacheDir_cb, NULL, 0);
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "SilenceThreshold", ARG_INT,
+						     SilenceThreshold_cb, NULL, 0);
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "SilenceKeptMs", ARG_INT,
+						     SilenceKeptMs_cb, NULL, 0);
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "WarmUpText", ARG_STR,
+						     WarmUpText_cb, NULL, 0);
+	module_dc_options = module_add_config_option(module_dc_options,
+						     &module_num_dc_options,
+						     "WarmUpLanguage", ARG_STR,
+						     WarmUpLanguage_cb, NULL, 0);
+
 	/* Add the LAST option */
 	module_dc_options = module_add_config_option(module_dc_options,
 						     &module_num_dc_options,
@@ -60,6 +180,7 @@ int module_config(const char *configfilename) {
 
 	if (!configfile) {
 		DBG("Can't read specified config file! Using defaults...\n");
+		module_config_cache(NULL);
 		return 0;
 	}
 
@@ -68,6 +189,10 @@ int module_config(const char *configfilename) {
 		return -1;
 	}
 	dotconf_cleanup(configfile);
+	module_tts_output_set_chunk_size(ServerAudioMinChunk, ServerAudioMaxChunk);
+	module_set_silence(SilenceThreshold, SilenceKeptMs);
+	module_set_warm_up(WarmUpText, WarmUpLanguage);
+	module_config_cache(configfilename);
 	DBG("Configuration (pre) has been read from \"%s\"\n",
 	    configfilename);
 
@@ -0,0 +1,351 @@
+/*
+ * module_host.c - Run output modules for Speech Dispatcher servers of other
+ * machines
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This listens for the connections of sd_remote, and starts the requested
+ * module for each of them, with the connection as its stdin and stdout, so
+ * that any number of servers share the synthesizers of this machine, each
+ * one with their own module processes.  Connections have to prove that
+ * they know the secret of the --secret file by answering a challenge, but
+ * nothing is encrypted: only listen on a trusted network, or go through an
+ * ssh tunnel.  The modules only get to write debugging logs into --logs.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <glib.h>
+
+#include "module_host.h"
+
+static const char *host_address = "127.0.0.1";
+static const char *host_module_dir = MODULEBINDIR;
+static const char *host_config_dir = SYS_CONF "/modules";
+static int host_port = SPD_MODULE_HOST_PORT;
+static const char *host_log_dir = "";
+static char *host_secret;
+
+static void usage(const char *name)
+{
+	printf("Usage: %s -s secret_file [-a address] [-p port] [-m module_dir]\n"
+	       "       [-c config_dir] [-l log_dir]\n"
+	       "\n"
+	       "Run Speech Dispatcher output modules for the sd_remote module of\n"
+	       "other machines.\n"
+	       "\n"
+	       "  -s, --secret   file with the secret shared with sd_remote\n"
+	       "  -a, --address  address to listen on, default %s\n"
+	       "  -p, --port     port to listen on, default %d\n"
+	       "  -m, --modules  directory of the module programs, default %s\n"
+	       "  -c, --config   directory of their configuration, default %s\n"
+	       "  -l, --logs     directory the modules may write debugging logs\n"
+	       "                 into, by default they may not\n"
+	       "  -h, --help     print this help\n",
+	       name, host_address, host_port, host_module_dir, host_config_dir);
+}
+
+static int host_listen(void)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+		.ai_flags = AI_PASSIVE,
+	};
+	struct addrinfo *addrs, *addr;
+	char port[16];
+	int sock = -1, one = 1, ret;
+
+	snprintf(port, sizeof(port), "%d", host_port);
+	ret = getaddrinfo(host_address, port, &hints, &addrs);
+	if (ret != 0) {
+		fprintf(stderr, "Can't resolve %s: %s\n", host_address,
+			gai_strerror(ret));
+		return -1;
+	}
+
+	for (addr = addrs; addr; addr = addr->ai_next) {
+		sock = socket(addr->ai_family, addr->ai_socktype,
+			      addr->ai_protocol);
+		if (sock < 0)
+			continue;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(sock, addr->ai_addr, addr->ai_addrlen) == 0
+		    && listen(sock, 16) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+	if (sock < 0)
+		perror("Can't listen");
+
+	return sock;
+}
+
+static void host_refuse(int sock, const char *format, ...)
+{
+	GString *reply = g_string_new("399-");
+	va_list ap;
+
+	va_start(ap, format);
+	g_string_append_vprintf(reply, format, ap);
+	va_end(ap);
+	fprintf(stderr, "%s\n", reply->str + 4);
+
+	/* This is what the server reads after INIT */
+	g_string_append(reply, "\n399 ERR CANT INIT MODULE\n");
+	if (write(sock, reply->str, reply->len) < 0)
+		perror("write");
+	g_string_free(reply, TRUE);
+}
+
+/* Read the request line byte by byte, what follows is for the module */
+static char *host_read_request(int sock)
+{
+	char line[SPD_MODULE_HOST_REQUEST_MAX];
+	size_t len = 0;
+	ssize_t ret;
+
+	while (len < sizeof(line) - 1) {
+		ret = read(sock, line + len, 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return NULL;
+		if (line[len] == '\n') {
+			line[len] = '\0';
+			return g_strdup(line);
+		}
+		len++;
+	}
+	return NULL;
+}
+
+/* Challenge the connection to prove it knows the secret */
+static int host_authenticate(int sock)
+{
+	unsigned char nonce[SPD_MODULE_HOST_CHALLENGE_BYTES];
+	char *challenge, *line, *expected;
+	const char *answer;
+	size_t i, len;
+	int fd, ok = 0;
+	unsigned char diff = 0;
+
+	fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || read(fd, nonce, sizeof(nonce)) != sizeof(nonce)) {
+		perror("Can't get a random challenge");
+		if (fd >= 0)
+			close(fd);
+		return 0;
+	}
+	close(fd);
+
+	challenge = g_strnfill(2 * sizeof(nonce), '0');
+	for (i = 0; i < sizeof(nonce); i++)
+		snprintf(challenge + 2 * i, 3, "%02x", nonce[i]);
+	line = g_strdup_printf(SPD_MODULE_HOST_CHALLENGE "%s\n", challenge);
+	len = strlen(line);
+	if (write(sock, line, len) != (ssize_t) len) {
+		g_free(line);
+		g_free(challenge);
+		return 0;
+	}
+	g_free(line);
+
+	expected = spd_module_host_answer(host_secret, challenge);
+	g_free(challenge);
+	line = host_read_request(sock);
+	if (line && g_str_has_prefix(line, SPD_MODULE_HOST_AUTH)) {
+		answer = line + strlen(SPD_MODULE_HOST_AUTH);
+		len = strlen(expected);
+		if (strlen(answer) == len) {
+			/* Whatever the answer, take the same time */
+			for (i = 0; i < len; i++)
+				diff |= answer[i] ^ expected[i];
+			ok = diff == 0;
+		}
+	}
+	g_free(line);
+	g_free(expected);
+
+	return ok;
+}
+
+static int host_valid_name(const char *name)
+{
+	const char *c;
+
+	if (!name[0] || name[0] == '.')
+		return 0;
+	for (c = name; *c; c++)
+		if (!g_ascii_isalnum(*c) && *c != '-' && *c != '_' && *c != '.')
+			return 0;
+	return 1;
+}
+
+/* In the child process of a connection, never returns */
+static void host_run_module(int sock)
+{
+	char *request, *name, *argv[3] = { 0, 0, 0 };
+	int one = 1;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+	if (!host_authenticate(sock)) {
+		host_refuse(sock, "Authentication to the module host failed");
+		_exit(1);
+	}
+
+	request = host_read_request(sock);
+	if (!request || !g_str_has_prefix(request, SPD_MODULE_HOST_REQUEST)) {
+		host_refuse(sock, "Bad request to the module host");
+		_exit(1);
+	}
+	name = request + strlen(SPD_MODULE_HOST_REQUEST);
+	if (!host_valid_name(name)) {
+		host_refuse(sock, "Bad module name %s", name);
+		_exit(1);
+	}
+
+	argv[0] = g_strdup_printf("%s/sd_%s", host_module_dir, name);
+	argv[1] = g_strdup_printf("%s/%s.conf", host_config_dir, name);
+	if (access(argv[1], R_OK) != 0) {
+		g_free(argv[1]);
+		argv[1] = NULL;
+	}
+
+	fprintf(stderr, "Running %s for a connection\n", argv[0]);
+	if (dup2(sock, STDIN_FILENO) < 0 || dup2(sock, STDOUT_FILENO) < 0) {
+		host_refuse(sock, "Can't redirect the module: %s",
+			    strerror(errno));
+		_exit(1);
+	}
+	close(sock);
+	g_setenv(SPD_MODULE_DEBUG_DIR_ENV, host_log_dir, TRUE);
+	signal(SIGCHLD, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+
+	execv(argv[0], argv);
+	host_refuse(STDOUT_FILENO, "Can't run module %s: %s", name,
+		    strerror(errno));
+	_exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	static const struct option long_options[] = {
+		{"address", required_argument, 0, 'a'},
+		{"port", required_argument, 0, 'p'},
+		{"modules", required_argument, 0, 'm'},
+		{"config", required_argument, 0, 'c'},
+		{"secret", required_argument, 0, 's'},
+		{"logs", required_argument, 0, 'l'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+	const char *secret_file = NULL, *error;
+	int lsock, sock, c;
+	pid_t pid;
+
+	while ((c = getopt_long(argc, argv, "a:p:m:c:s:l:h", long_options,
+				NULL)) != -1) {
+		switch (c) {
+		case 'a':
+			host_address = optarg;
+			break;
+		case 'p':
+			host_port = atoi(optarg);
+			break;
+		case 'm':
+			host_module_dir = optarg;
+			break;
+		case 'c':
+			host_config_dir = optarg;
+			break;
+		case 's':
+			secret_file = optarg;
+			break;
+		case 'l':
+			host_log_dir = optarg;
+			break;
+		case 'h':
+			usage(argv[0]);
+			return 0;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!secret_file) {
+		usage(argv[0]);
+		return 1;
+	}
+	host_secret = spd_module_host_read_secret(secret_file, &error);
+	if (!host_secret) {
+		fprintf(stderr, "%s: %s\n", secret_file, error);
+		return 1;
+	}
+
+	/* The modules are not waited for */
+	signal(SIGCHLD, SIG_IGN);
+	signal(SIGPIPE, SIG_IGN);
+
+	lsock = host_listen();
+	if (lsock < 0)
+		return 1;
+	fprintf(stderr, "Running modules of %s for connections on %s port %d\n",
+		host_module_dir, host_address, host_port);
+
+	while (1) {
+		sock = accept(lsock, NULL, NULL);
+		if (sock < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			perror("accept");
+			return 1;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			close(lsock);
+			host_run_module(sock);
+		}
+		if (pid < 0)
+			host_refuse(sock, "Can't fork: %s", strerror(errno));
+		close(sock);
+	}
+}
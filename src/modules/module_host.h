@@ -0,0 +1,88 @@
+/*
+ * module_host.h - Protocol between sd_remote and spd-module-host
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SPEECHD_MODULE_HOST_H
+#define _SPEECHD_MODULE_HOST_H
+
+#include <string.h>
+#include <sys/stat.h>
+#include <glib.h>
+
+/* Default TCP port of spd-module-host, next to the one of the server */
+#define SPD_MODULE_HOST_PORT 6561
+
+/* First line sent on a connection, followed by the name of the module to
+ * run, e.g. "MODULE espeak-ng\n".  Anything after it is the protocol of the
+ * module itself. */
+#define SPD_MODULE_HOST_REQUEST "MODULE "
+
+/* Longest such line */
+#define SPD_MODULE_HOST_REQUEST_MAX 256
+
+/* Before the request, the host sends this followed by a random challenge in
+ * hex, and the connection has to answer with SPD_MODULE_HOST_AUTH followed
+ * by the HMAC-SHA256 of the challenge keyed with the secret they share, see
+ * spd_module_host_answer(). */
+#define SPD_MODULE_HOST_CHALLENGE "CHALLENGE "
+#define SPD_MODULE_HOST_AUTH "AUTH "
+#define SPD_MODULE_HOST_CHALLENGE_BYTES 32
+
+/* Environment variable through which the host gives the modules the only
+ * directory DEBUG may log into, empty to refuse DEBUG */
+#define SPD_MODULE_DEBUG_DIR_ENV "SPEECHD_MODULE_DEBUG_DIR"
+
+/* Reads the shared secret from the first line of path, which others must
+ * not be able to read, returns NULL with *error set otherwise */
+static inline char *spd_module_host_read_secret(const char *path,
+					       const char **error)
+{
+	struct stat st;
+	char *secret;
+
+	if (stat(path, &st) != 0) {
+		*error = "can't stat the secret file";
+		return NULL;
+	}
+	if (st.st_mode & (S_IRWXG | S_IRWXO)) {
+		*error = "the secret file is accessible by others";
+		return NULL;
+	}
+	if (!g_file_get_contents(path, &secret, NULL, NULL)) {
+		*error = "can't read the secret file";
+		return NULL;
+	}
+	secret[strcspn(secret, "\r\n")] = '\0';
+	if (!secret[0]) {
+		g_free(secret);
+		*error = "the secret file is empty";
+		return NULL;
+	}
+	return secret;
+}
+
+/* The answer to challenge, to be g_free()d */
+static inline char *spd_module_host_answer(const char *secret,
+					   const char *challenge)
+{
+	return g_compute_hmac_for_string(G_CHECKSUM_SHA256,
+					 (const guchar *)secret, strlen(secret),
+					 challenge, -1);
+}
+
+#endif
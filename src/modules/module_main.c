@@ -30,6 +30,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "module_main.h"
 
@@ -37,57 +38,120 @@
  * This provides the main startup structure for modules.
  */
 
-int main(int argc, char *argv[])
+int module_main(const char *configfile)
 {
-	char *configfile = NULL;
 	char *line, *msg = NULL;
 	int ret;
 
-	if (argc >= 2)
-		configfile = argv[1];
+	module_output_init();
 
 	/* Read configuration */
 	ret = module_config(configfile);
 	if (ret) {
 		module_close();
-		exit(1);
+		return 1;
 	}
 
 	/* Wait for server init */
-	line = module_readline(STDIN_FILENO, 1);
-	if (strcmp(line, "INIT\n") != 0) {
+	line = module_readline(module_in, 1);
+	if (line == NULL || strcmp(line, "INIT\n") != 0) {
 		fprintf(stderr, "ERROR: Server did not start with INIT\n");
+		free(line);
 		module_close();
-		exit(3);
+		return 3;
 	}
+	free(line);
 
 	/* Initialize module */
 	ret = module_init(&msg);
 	if (ret) {
 		if (msg == NULL)
 			msg = strdup("Unspecified initialization error\n");
-		printf("399-%s\n", msg);
-		printf("399 ERR CANT INIT MODULE\n");
+		fprintf(module_out, "399-%s\n", msg);
+		fprintf(module_out, "399 ERR CANT INIT MODULE\n");
+		fflush(module_out);
 		free(msg);
 		module_close();
-		exit(1);
+		return 1;
 	}
 
+	/* Before the server sends us the first message */
+	module_warm_up();
+
 	if (msg == NULL)
 		msg = strdup("Unspecified initialization success\n");
-	printf("299-%s\n", msg);
-	printf("299 OK LOADED SUCCESSFULLY\n");
-	fflush(stdout);
+	fprintf(module_out, "299-%s\n", msg);
+	fprintf(module_out, "299 OK LOADED SUCCESSFULLY\n");
+	fflush(module_out);
 	free(msg);
 
 	/* Run module */
 	ret = module_loop();
 	if (ret) {
-		printf("399 ERR MODULE CLOSED\n");
-		fflush(stdout);
+		fprintf(module_out, "399 ERR MODULE CLOSED\n");
+		fflush(module_out);
 		module_close();
 	}
 
+	return ret;
+}
+
+/*
+ * When built as a shared library, the server runs us in one of its threads,
+ * over a pair of pipes just like a module process.  Nothing here may exit()
+ * then, and the debugging output goes to the stderr of the server.
+ */
+static pthread_t module_run_thread;
+
+int spd_module_run(int in_fd, int out_fd, const char *configfile)
+{
+	int ret;
+
+	module_run_thread = pthread_self();
+	module_out = fdopen(out_fd, "w");
+	if (!module_out) {
+		close(in_fd);
+		close(out_fd);
+		return 1;
+	}
+	module_in = in_fd;
+
+	ret = module_main(configfile);
+
+	/* This is what tells the server we are gone */
+	fclose(module_out);
+	module_out = NULL;
+	close(in_fd);
+	module_in = STDIN_FILENO;
+
+	return ret;
+}
+
+void module_fatal_exit(void)
+{
+#ifdef SPD_MODULE_LIBRARY
+	/* Only end our thread, the server sees our output close as a crash */
+	pthread_mutex_lock(&module_stdout_mutex);
+	if (module_out) {
+		fprintf(module_out, "399 ERR MODULE CLOSED\n");
+		fclose(module_out);
+		module_out = NULL;
+	}
+	pthread_mutex_unlock(&module_stdout_mutex);
+	if (pthread_equal(pthread_self(), module_run_thread)) {
+		close(module_in);
+		module_in = STDIN_FILENO;
+	}
+	pthread_exit(NULL);
+#else
+	exit(EXIT_FAILURE);
+#endif
+}
+
+#ifndef SPD_MODULE_LIBRARY
+int main(int argc, char *argv[])
+{
 	/* Module termination */
-	exit(ret);
+	exit(module_main(argc >= 2 ? argv[1] : NULL));
 }
+#endif
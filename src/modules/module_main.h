@@ -33,6 +33,7 @@
 #include <spd_audio.h>
 
 #include <pthread.h>
+#include <stdio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -123,6 +124,53 @@ void module_audio_set_server(void);
  */
 void module_tts_output_server(const AudioTrack *track, AudioFormat format);
 
+/*
+ * Bound the size in bytes of the pieces module_tts_output_server() sends,
+ * 0 keeps the default.
+ */
+void module_tts_output_set_chunk_size(int min, int max);
+
+/*
+ * Have module_warm_up() synthesize text, with language if not NULL, and
+ * drop the result, NULL or "" not to.
+ */
+void module_set_warm_up(const char *text, const char *language);
+
+/*
+ * Called once the module is initialized, so that the first message does
+ * not wait for the synthesizer to load its voice data.
+ */
+void module_warm_up(void);
+
+/*
+ * Cache of the audio of short messages, provided by module_utils_cache.c.
+ * When the module links it and sends its audio to the server, the module
+ * basis records what the module sends for each message, and replays it the
+ * next time the same message is to be said with the same settings.
+ */
+typedef struct {
+	AudioTrack track;
+	unsigned num_marks;
+	unsigned *mark_samples;
+	char **mark_names;
+} SPDCachedAudio;
+
+/* Messages longer than max_length bytes are not cached, max_kbytes 0
+ * disables the cache, dir if set keeps it across restarts */
+void module_speech_cache_configure(int max_kbytes, int max_length,
+				   const char *dir, const char *salt);
+/* Return 0 and a copy of the audio if the message is cached */
+int module_speech_cache_get(SPDMessageType type, const char *text,
+			    SPDCachedAudio *audio);
+void module_speech_cache_free_audio(SPDCachedAudio *audio);
+void module_speech_cache_record_start(SPDMessageType type, const char *text);
+void module_speech_cache_record_audio(const AudioTrack *track,
+				      AudioFormat format);
+void module_speech_cache_record_mark(const char *mark);
+/* Store what was recorded if keep is set, typically when the message ended
+ * normally */
+void module_speech_cache_record_finish(int keep);
+
 /* Return one line of input from the given file, to be freed with free().
  *
  * Since this function implements its own buffering, it must always be called
@@ -135,6 +183,28 @@ void module_tts_output_server(const AudioTrack *track, AudioFormat format);
  */
 char *module_readline(int fd, int block);
 
+/* Sets up the buffering of module_out, before anything is printed on it */
+void module_output_init(void);
+
+/* What the server sends us is read from module_in, and what we send it is
+ * printed on module_out.  These are stdin and stdout, unless the module runs
+ * inside the server, see spd_module_run(). */
+extern int module_in;
+extern FILE *module_out;
+
+/* Run the module with the given configuration file until the server sends
+ * QUIT or closes module_in, returns the exit status of the process. */
+int module_main(const char *configfile);
+
+/* Entry point of modules built as a shared library, which the server may
+ * load with ModuleInProcess and run in one of its threads.  This takes
+ * ownership of the two descriptors. */
+int spd_module_run(int in_fd, int out_fd, const char *configfile);
+
+/* What FATAL() ends with: exit() for a process, only the calling thread
+ * when running inside the server. */
+void module_fatal_exit(void) __attribute__ ((noreturn));
+
 /* This protects multi-line answers against asynchronous event reporting */
 extern pthread_mutex_t module_stdout_mutex;
 
@@ -31,37 +31,223 @@
 #include <string.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <time.h>
+#include <fcntl.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <spd_audio.h>
+#include <spd_audio_ring.h>
+#include <spd_audio_codec.h>
 #include "module_main.h"
 
 pthread_mutex_t module_stdout_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+int module_in = STDIN_FILENO;
+FILE *module_out;
+
 static int module_should_stop;
+static int module_should_pause;
+
+/* Whether we are replaying cached audio instead of the module speaking */
+static int module_replaying;
+
+/* Only modules linking module_utils_cache.c have the audio cache */
+#pragma weak module_speech_cache_get
+#pragma weak module_speech_cache_free_audio
+#pragma weak module_speech_cache_record_start
+#pragma weak module_speech_cache_record_audio
+#pragma weak module_speech_cache_record_mark
+#pragma weak module_speech_cache_record_finish
+
+/* Room for the biggest audio chunk with its header, so that what we send
+ * between two flushes goes in one write.  */
+#define MODULE_STDOUT_BUFFER (2 * 65536 + 256)
+
+/* While warming up, what the module says is not for the server */
+static int module_warming_up;
 
 /* This sends some text to the server, taking the mutex to avoid intermixing
  * between multi-line answers and asynchronous sends.  */
+static void module_vsend(int flush, const char *format, va_list ap)
+{
+	if (module_warming_up)
+		return;
+
+	pthread_mutex_lock(&module_stdout_mutex);
+	vfprintf(module_out, format, ap);
+	pthread_mutex_unlock(&module_stdout_mutex);
+	if (flush)
+		fflush(module_out);
+}
+
 void module_send(const char *format, ...)
 {
 	va_list ap;
 	va_start(ap, format);
-	pthread_mutex_lock(&module_stdout_mutex);
-	vprintf(format, ap);
-	pthread_mutex_unlock(&module_stdout_mutex);
+	module_vsend(1, format, ap);
+	va_end(ap);
+}
+
+/* Same, but leaves it in the buffer for the next flush */
+static void module_send_buffered(const char *format, ...)
+{
+	va_list ap;
+	va_start(ap, format);
+	module_vsend(0, format, ap);
 	va_end(ap);
-	fflush(stdout);
+}
+
+void module_output_init(void)
+{
+	static char buffer[MODULE_STDOUT_BUFFER];
+
+	if (!module_out)
+		module_out = stdout;
+	setvbuf(module_out, buffer, _IOFBF, sizeof(buffer));
 }
 
 /* Whether we will send the audio to the server */
 static int audio_server;
 
+/* Whether the server accepted raw audio frames instead of escaped ones */
+static int audio_binary;
+
+/* Codec the server asked to compress the binary frames with, if any */
+static SPDAudioCodec *audio_codec;
+
+/* Whether the server tags its messages with ids, it then sends the next one
+ * while we are still synthesizing */
+static int message_ids;
+
+/* Appended to the events of the message being spoken when tagging */
+static char module_event_tag[16];
+
+/* Shared-memory ring set up by the server, if any */
+static SPDAudioRing *audio_ring;
+static size_t audio_ring_len;
+
+/* Map the ring the server created, or just take its address when we run in
+ * the server process */
+static int module_audio_ring_open(const char *name)
+{
+	SPDAudioRing *ring;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (name[0] == '@') {
+		if (module_out == stdout || sscanf(name + 1, "%p", &map) != 1)
+			return -1;
+		ring = map;
+		if (ring->magic != SPD_AUDIO_RING_MAGIC
+		    || ring->size & (ring->size - 1))
+			return -1;
+		if (audio_ring && audio_ring_len)
+			munmap(audio_ring, audio_ring_len);
+		audio_ring = ring;
+		/* Not ours to unmap */
+		audio_ring_len = 0;
+		return 0;
+	}
+
+	fd = shm_open(name, O_RDWR, 0);
+	if (fd < 0)
+		return -1;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(*ring)) {
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+
+	ring = map;
+	if (ring->magic != SPD_AUDIO_RING_MAGIC
+	    || ring->size > st.st_size - sizeof(*ring)
+	    || ring->size & (ring->size - 1)) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+
+	if (audio_ring && audio_ring_len)
+		munmap(audio_ring, audio_ring_len);
+	audio_ring = ring;
+	audio_ring_len = st.st_size;
+	return 0;
+}
+
+/* Copy the samples into the ring, returns -1 when there is no room and
+ * the samples have to go through the pipe.  */
+static int module_audio_ring_put(const void *samples, size_t size, uint32_t *start)
+{
+	uint32_t head = audio_ring->head;
+	uint32_t tail = spd_audio_ring_get(&audio_ring->tail);
+	uint32_t pos = head & (audio_ring->size - 1);
+
+	if (size > audio_ring->size)
+		return -1;
+
+	if (pos + size > audio_ring->size) {
+		/* Does not fit before the end, skip to the beginning */
+		head += audio_ring->size - pos;
+		pos = 0;
+	}
+	if (head + size - tail > audio_ring->size)
+		return -1;
+
+	memcpy(SPD_AUDIO_RING_DATA(audio_ring) + pos, samples, size);
+	spd_audio_ring_set(&audio_ring->head, head + size);
+	*start = head;
+	return 0;
+}
+
 void module_audio_set_server(void)
 {
 	audio_server = 1;
 }
 
+#pragma weak module_speak_sync
 static int module_audio_set_through_server(const char *cur_item, const char *cur_value) {
+	if (!strcmp(cur_item, "message_ids")) {
+		/* Only the synchronous modules speak from our loop, which
+		 * can queue the messages */
+		if (!module_speak_sync)
+			return -1;
+		message_ids = atoi(cur_value) != 0;
+		if (!message_ids)
+			module_event_tag[0] = 0;
+		return 0;
+	}
+
+	if (!strcmp(cur_item, "audio_framing")) {
+		if (!strcmp(cur_value, "binary"))
+			audio_binary = 1;
+		else if (!strcmp(cur_value, "text"))
+			audio_binary = 0;
+		else
+			return -1;
+		return 0;
+	}
+
+	if (!strcmp(cur_item, "audio_codec")) {
+		if (!strcmp(cur_value, "none")) {
+			spd_audio_codec_free(audio_codec);
+			audio_codec = NULL;
+			return 0;
+		}
+		if (!audio_binary || !spd_audio_codec_available(cur_value))
+			return -1;
+		spd_audio_codec_free(audio_codec);
+		audio_codec = spd_audio_codec_new(cur_value);
+		return 0;
+	}
+
+	if (!strcmp(cur_item, "audio_ring"))
+		return module_audio_ring_open(cur_value);
+
 	if (strcmp(cur_item, "audio_output_method") != 0)
 		/* We only support the audio output method parameter */
 		return -1;
@@ -79,14 +265,65 @@ static void module_tts_output_send_server(const AudioTrack *track, AudioFormat f
 	size_t size = track->num_channels * track->num_samples * track->bits / 8;
 
 	pthread_mutex_lock(&module_stdout_mutex);
-	printf("705-bits=%d\n", track->bits);
-	printf("705-num_channels=%d\n", track->num_channels);
-	printf("705-sample_rate=%d\n", track->sample_rate);
-	printf("705-num_samples=%d\n", track->num_samples);
-	printf("705-big_endian=%d\n", format);
+	if (audio_ring) {
+		uint32_t start;
+
+		if (module_audio_ring_put(track->samples, size, &start) == 0) {
+			/* Only tell where the samples are */
+			fprintf(module_out, "705-SHM %d %d %d %d %d %u %zu\n",
+				track->bits, track->num_channels,
+				track->sample_rate, track->num_samples,
+				format, start, size);
+			fprintf(module_out, "705 AUDIO%s\n", module_event_tag);
+
+			pthread_mutex_unlock(&module_stdout_mutex);
+			fflush(module_out);
+			return;
+		}
+	}
+
+	if (audio_codec && !audio_ring) {
+		GByteArray *packets = g_byte_array_new();
+		char *header;
+
+		header = spd_audio_codec_encode(audio_codec, track, format,
+						packets);
+		if (header) {
+			fprintf(module_out, "%s\n", header);
+			fwrite(packets->data, 1, packets->len, module_out);
+			fprintf(module_out, "705 AUDIO%s\n", module_event_tag);
+
+			pthread_mutex_unlock(&module_stdout_mutex);
+			fflush(module_out);
+			g_free(header);
+			g_byte_array_free(packets, TRUE);
+			return;
+		}
+		/* Not a track the codec takes, send it raw */
+		g_byte_array_free(packets, TRUE);
+	}
+
+	if (audio_binary) {
+		/* Fixed header, then the samples as they are */
+		fprintf(module_out, "705-RAW %d %d %d %d %d %zu\n",
+			track->bits, track->num_channels, track->sample_rate,
+			track->num_samples, format, size);
+		fwrite(track->samples, 1, size, module_out);
+		fprintf(module_out, "705 AUDIO%s\n", module_event_tag);
 
-	printf("705-AUDIO");
-	putc(0, stdout);
+		pthread_mutex_unlock(&module_stdout_mutex);
+		fflush(module_out);
+		return;
+	}
+
+	fprintf(module_out, "705-bits=%d\n", track->bits);
+	fprintf(module_out, "705-num_channels=%d\n", track->num_channels);
+	fprintf(module_out, "705-sample_rate=%d\n", track->sample_rate);
+	fprintf(module_out, "705-num_samples=%d\n", track->num_samples);
+	fprintf(module_out, "705-big_endian=%d\n", format);
+
+	fprintf(module_out, "705-AUDIO");
+	putc(0, module_out);
 
 	p = (const char *) track->samples;
 	end = p + size;
@@ -110,39 +347,87 @@ static void module_tts_output_send_server(const AudioTrack *track, AudioFormat f
 			next = stop = end;
 		}
 
-		fwrite(p, 1, stop - p, stdout);
+		fwrite(p, 1, stop - p, module_out);
 
 		/* Escape NL or escape */
 		if (stop < end) {
-			putc(escape, stdout);
-			putc((*stop) ^ invert, stdout);
+			putc(escape, module_out);
+			putc((*stop) ^ invert, module_out);
 		}
 
 		p = next;
 	}
-	putc('\n', stdout);
-	printf("705 AUDIO\n");
+	putc('\n', module_out);
+	fprintf(module_out, "705 AUDIO%s\n", module_event_tag);
 
 	pthread_mutex_unlock(&module_stdout_mutex);
-	fflush(stdout);
+	fflush(module_out);
 }
 
-/* Arbitrary chunk size in bytes, large enough to get efficient transfer
- * but small enough to be reactive. */
-#define MAX_CHUNK 10000
+/* Bounds of the chunk size in bytes, the first chunk of a message is the
+ * smallest to get audio started quickly, the next ones grow as long as the
+ * server keeps up, up to what keeps us reactive to stop requests.  */
+static size_t chunk_min = 1024;
+static size_t chunk_max = 65536;
+/* Longest chunk in ms of audio, we only check for stop between chunks */
+#define CHUNK_MAX_MS 100
+/* Size of the next chunk, 0 at the start of a message */
+static size_t chunk_next;
+
+void module_tts_output_set_chunk_size(int min, int max)
+{
+	if (min > 0)
+		chunk_min = min;
+	if (max > 0)
+		chunk_max = max;
+	if (chunk_max < chunk_min)
+		chunk_max = chunk_min;
+}
+
+static double module_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000.
+		+ (now.tv_nsec - start->tv_nsec) / 1000000.;
+}
+
+#pragma weak module_speak_sync
 void module_tts_output_server(const AudioTrack *track, AudioFormat format)
 {
 	AudioTrack mytrack = *track;
 	size_t sample_size = track->num_channels * track->bits / 8;
+	size_t bytes_per_ms = track->sample_rate * sample_size / 1000;
+	size_t max = chunk_max, size;
+	struct timespec start;
+	double chunk_ms;
 	int samplepos = 0;
 	int num_samples;
 
+	if (!sample_size || module_warming_up)
+		return;
+
+	if (module_speech_cache_record_audio && !module_replaying)
+		module_speech_cache_record_audio(track, format);
+
+	if (bytes_per_ms && max > bytes_per_ms * CHUNK_MAX_MS)
+		max = bytes_per_ms * CHUNK_MAX_MS;
+	if (max < chunk_min)
+		max = chunk_min;
+
 	while (samplepos < track->num_samples) {
 		if (module_should_stop)
 			/* We are requested to stop, ignore the rest of audio */
 			break;
 
-		num_samples = MAX_CHUNK / sample_size;
+		if (!chunk_next)
+			chunk_next = chunk_min;
+		size = chunk_next < max ? chunk_next : max;
+
+		num_samples = size / sample_size;
+		if (num_samples < 1)
+			num_samples = 1;
 		if (num_samples > track->num_samples - samplepos)
 			num_samples = track->num_samples - samplepos;
 
@@ -150,12 +435,57 @@ void module_tts_output_server(const AudioTrack *track, AudioFormat format)
 		mytrack.samples = (void*) track->samples + samplepos * sample_size;
 		samplepos += num_samples;
 
+		clock_gettime(CLOCK_MONOTONIC, &start);
 		module_tts_output_send_server(&mytrack, format);
 
-		module_process(STDIN_FILENO, 0);
+		/* When the pipe made us wait for a good part of what the chunk
+		 * plays, the server is behind, and bigger chunks would only
+		 * delay stopping: shrink.  Otherwise grow for throughput.  */
+		chunk_ms = bytes_per_ms ? (double) size / bytes_per_ms : 0;
+		if (module_elapsed_ms(&start) * 4 > chunk_ms) {
+			if (size / 2 >= chunk_min)
+				chunk_next = size / 2;
+		} else if (size * 2 <= max)
+			chunk_next = size * 2;
+		else
+			chunk_next = max;
+
+		/* Asynchronous modules already process the server requests
+		 * in their main loop, unless we are replaying in it */
+		if (module_speak_sync || module_replaying)
+			module_process(module_in, 0);
 	}
 }
 
+static char *warm_up_text;
+static char *warm_up_language;
+
+void module_set_warm_up(const char *text, const char *language)
+{
+	free(warm_up_text);
+	warm_up_text = text && *text ? strdup(text) : NULL;
+	free(warm_up_language);
+	warm_up_language = language && *language ? strdup(language) : NULL;
+}
+
+void module_warm_up(void)
+{
+	/* Asynchronous modules would still be speaking once it returns, and
+	 * the others play themselves, with no audio opened yet */
+	if (!warm_up_text || !module_speak_sync || !audio_server)
+		return;
+
+	if (warm_up_language)
+		module_set("language", warm_up_language);
+	module_should_stop = 0;
+	module_should_pause = 0;
+	chunk_next = 0;
+	module_warming_up = 1;
+	module_speak_sync(warm_up_text, strlen(warm_up_text),
+			  SPD_MSGTYPE_TEXT);
+	module_warming_up = 0;
+}
+
 /*
  * This only parses the SSIP protocol from the server, and calls the
  * corresponding functions provided by the module or by module_utils.c
@@ -174,18 +504,154 @@ void module_tts_output_server(const AudioTrack *track, AudioFormat format)
 #define bad_internal() print("401 ERROR INTERNAL")
 #define bad_memory() print("402 ERROR OUT OF MEMORY")
 
+/* Say the cached audio of a message, with its marks */
+static void module_speak_cached(const SPDCachedAudio *audio)
+{
+	AudioTrack track = audio->track;
+	size_t sample_size = track.num_channels * track.bits / 8;
+	unsigned done = 0, end, i;
+
+	module_speak_ok();
+	module_report_event_begin();
+
+	module_replaying = 1;
+	for (i = 0; i <= audio->num_marks && !module_should_stop; i++) {
+		end = i < audio->num_marks ? audio->mark_samples[i]
+		    : (unsigned) audio->track.num_samples;
+		if (end > done) {
+			track.samples = (void *) audio->track.samples
+			    + done * sample_size;
+			track.num_samples = end - done;
+			module_tts_output_server(&track, SPD_AUDIO_LE);
+			done = end;
+		}
+		if (i < audio->num_marks && !module_should_stop)
+			module_report_index_mark(audio->mark_names[i]);
+	}
+	module_replaying = 0;
+
+	if (module_should_pause)
+		module_report_event_pause();
+	else if (module_should_stop)
+		module_report_event_stop();
+	else
+		module_report_event_end();
+}
+
+/* Messages the server sent ahead while we were synthesizing, with
+ * message_ids.  It sends one at a time, more are refused past the bound. */
+#define MESSAGE_QUEUE_MAX 4
+
+typedef struct {
+	unsigned id;
+	SPDMessageType msgtype;
+	char *text;
+	size_t len;
+} module_queued_message;
+
+static module_queued_message message_queue[MESSAGE_QUEUE_MAX];
+static int message_queue_len;
+
+/* Set while speaking messages, those which come meanwhile get queued */
+static int module_speaking;
+/* The id of the message being spoken, 0 if none or untagged */
+static unsigned module_message_id;
+/* The message was acknowledged when it got queued */
+static int module_acknowledged;
+
+static void module_queue_message(unsigned id, SPDMessageType msgtype,
+				 char *text, size_t len)
+{
+	module_queued_message *queued;
+
+	if (message_queue_len == MESSAGE_QUEUE_MAX) {
+		free(text);
+		print("301 ERROR CANT SPEAK");
+		return;
+	}
+
+	queued = &message_queue[message_queue_len++];
+	queued->id = id;
+	queued->msgtype = msgtype;
+	queued->text = text;
+	queued->len = len;
+	print("200 OK SPEAKING");
+}
+
+/* Drop the queued message with id, or all of them if id is 0 */
+static void module_drop_queued(unsigned id)
+{
+	int i, n = 0;
+
+	for (i = 0; i < message_queue_len; i++) {
+		if (id && message_queue[i].id != id) {
+			message_queue[n++] = message_queue[i];
+			continue;
+		}
+		free(message_queue[i].text);
+		print("703 STOP %u", message_queue[i].id);
+	}
+	message_queue_len = n;
+}
+
+/* Speak text, which gets freed */
+static void module_speak_message(unsigned id, SPDMessageType msgtype,
+				 char *text, size_t text_len)
+{
+	int ret;
+
+	if (message_ids)
+		snprintf(module_event_tag, sizeof(module_event_tag), " %u", id);
+	module_message_id = message_ids ? id : 0;
+	module_should_stop = 0;
+	module_should_pause = 0;
+	chunk_next = 0;
+
+	if (audio_server && module_speech_cache_get) {
+		SPDCachedAudio cached;
+
+		if (module_speech_cache_get(msgtype, text, &cached) == 0) {
+			module_speak_cached(&cached);
+			module_speech_cache_free_audio(&cached);
+			goto out;
+		}
+		module_speech_cache_record_start(msgtype, text);
+	}
+
+#pragma weak module_speak_sync
+#pragma weak module_speak
+	if (module_speak_sync) {
+		module_speak_sync(text, text_len, msgtype);
+	} else {
+		pthread_mutex_lock(&module_stdout_mutex);
+		ret = module_speak(text, text_len, msgtype);
+		if (ret > 0)
+			fprintf(module_out, "200 OK SPEAKING\n");
+		else
+			fprintf(module_out, "301 ERROR CANT SPEAK\n");
+		if (ret <= 0 && module_speech_cache_record_finish)
+			module_speech_cache_record_finish(0);
+		fflush(module_out);
+		pthread_mutex_unlock(&module_stdout_mutex);
+	}
+
+out:
+	module_message_id = 0;
+	free(text);
+}
+
 /* some text
  * at will
  * .
  */
-static void cmd_speak(int fd, SPDMessageType msgtype)
+static void cmd_speak(int fd, SPDMessageType msgtype, unsigned id)
 {
 	size_t text_allocated = 128, new_allocated;
 	char  *text = malloc(text_allocated), *new_text;
 	size_t text_len = 0;
 	size_t len;
-	int ret;
 	int nlines = 0;
+	module_queued_message next;
 
 	print("202 OK RECEIVING MESSAGE");
 
@@ -255,64 +721,89 @@ static void cmd_speak(int fd, SPDMessageType msgtype)
 		}
 	}
 
-	module_should_stop = 0;
+	if (module_speaking && message_ids) {
+		/* The server sent it ahead, we are processing its requests
+		 * from the synthesis of the previous one */
+		module_queue_message(id, msgtype, text, text_len);
+		return;
+	}
 
-#pragma weak module_speak_sync
-#pragma weak module_speak
-	if (module_speak_sync) {
-		module_speak_sync(text, text_len, msgtype);
-	} else {
-		pthread_mutex_lock(&module_stdout_mutex);
-		ret = module_speak(text, text_len, msgtype);
-		if (ret > 0)
-			printf("200 OK SPEAKING\n");
-		else
-			printf("301 ERROR CANT SPEAK\n");
-		fflush(stdout);
-		pthread_mutex_unlock(&module_stdout_mutex);
+	module_speaking = 1;
+	module_speak_message(id, msgtype, text, text_len);
+
+	/* Then those which came meanwhile */
+	while (message_queue_len) {
+		/* Unless they get stopped first */
+		module_process(module_in, 0);
+		if (!message_queue_len)
+			break;
+		next = message_queue[0];
+		message_queue_len--;
+		memmove(message_queue, message_queue + 1,
+			message_queue_len * sizeof(*message_queue));
+
+		module_acknowledged = 1;
+		module_speak_message(next.id, next.msgtype, next.text,
+				     next.len);
+		module_acknowledged = 0;
 	}
-	free(text);
+	module_speaking = 0;
 }
 
-static void cmd_speak_text(int fd)
+static void cmd_speak_text(int fd, unsigned id)
 {
-	return cmd_speak(fd, SPD_MSGTYPE_TEXT);
+	return cmd_speak(fd, SPD_MSGTYPE_TEXT, id);
 }
 
-static void cmd_speak_sound_icon(int fd)
+static void cmd_speak_sound_icon(int fd, unsigned id)
 {
-	return cmd_speak(fd, SPD_MSGTYPE_SOUND_ICON);
+	return cmd_speak(fd, SPD_MSGTYPE_SOUND_ICON, id);
 }
 
-static void cmd_speak_char(int fd)
+static void cmd_speak_char(int fd, unsigned id)
 {
-	return cmd_speak(fd, SPD_MSGTYPE_CHAR);
+	return cmd_speak(fd, SPD_MSGTYPE_CHAR, id);
 }
 
-static void cmd_speak_key(int fd)
+static void cmd_speak_key(int fd, unsigned id)
 {
-	return cmd_speak(fd, SPD_MSGTYPE_KEY);
+	return cmd_speak(fd, SPD_MSGTYPE_KEY, id);
 }
 
 void module_speak_ok(void)
 {
-	print("200 OK SPEAKING");
+	/* Queued messages were acknowledged when they came */
+	if (!module_acknowledged)
+		print("200 OK SPEAKING");
 }
 
 void module_speak_error(void)
 {
-	print("301 ERROR CANT SPEAK");
+	if (module_acknowledged)
+		/* Too late to refuse it, the server waits for its end */
+		print("703 STOP%s", module_event_tag);
+	else
+		print("301 ERROR CANT SPEAK");
 }
 
-static void cmd_stop(void)
+static void cmd_stop(unsigned id)
 {
+	if (id && id != module_message_id) {
+		/* One sent ahead, or which is already over */
+		module_drop_queued(id);
+		return;
+	}
+
+	module_drop_queued(0);
 	module_should_stop = 1;
 	module_stop();
 }
 
 static void cmd_pause(void)
 {
+	module_drop_queued(0);
 	module_should_stop = 1;
+	module_should_pause = 1;
 	module_pause();
 }
 
@@ -380,14 +871,14 @@ static void cmd_list_voices(char *line)
 
 		one = 1;
 
-		printf("200-%s\t%s\t%s\n", name, language, variant);
+		fprintf(module_out, "200-%s\t%s\t%s\n", name, language, variant);
 	}
 	if (one)
-		printf("200 OK VOICE LIST SENT\n");
+		fprintf(module_out, "200 OK VOICE LIST SENT\n");
 	else
-		printf("304 CANT LIST VOICES\n");
+		fprintf(module_out, "304 CANT LIST VOICES\n");
 	pthread_mutex_unlock(&module_stdout_mutex);
-	fflush(stdout);
+	fflush(module_out);
 }
 
 /* FOO1=bar1
@@ -528,27 +1019,46 @@ static void cmd_quit(void)
 	print("210 OK QUIT");
 }
 
+/* Whether line is cmd, possibly followed by the id of a message */
+static int is_cmd(const char *line, const char *cmd, unsigned *id)
+{
+	size_t len = strlen(cmd);
+	char *end;
+
+	if (strncmp(line, cmd, len) != 0)
+		return 0;
+	*id = 0;
+	if (!strcmp(line + len, "\n"))
+		return 1;
+	if (line[len] != ' ')
+		return 0;
+	*id = strtoul(line + len + 1, &end, 10);
+	return !strcmp(end, "\n");
+}
+
 int module_process(int fd, int block)
 {
+	unsigned id;
+
 	while (1) {
 		char *line = module_readline(fd, block);
 		if (line == NULL)
 			return -1;
 
-		if (!strcmp(line, "SPEAK\n"))
-			cmd_speak_text(fd);
+		if (is_cmd(line, "SPEAK", &id))
+			cmd_speak_text(fd, id);
 
-		else if (!strcmp(line, "SOUND_ICON\n"))
-			cmd_speak_sound_icon(fd);
+		else if (is_cmd(line, "SOUND_ICON", &id))
+			cmd_speak_sound_icon(fd, id);
 
-		else if (!strcmp(line, "CHAR\n"))
-			cmd_speak_char(fd);
+		else if (is_cmd(line, "CHAR", &id))
+			cmd_speak_char(fd, id);
 
-		else if (!strcmp(line, "KEY\n"))
-			cmd_speak_key(fd);
+		else if (is_cmd(line, "KEY", &id))
+			cmd_speak_key(fd, id);
 
-		else if (!strcmp(line, "STOP\n"))
-			cmd_stop();
+		else if (is_cmd(line, "STOP", &id))
+			cmd_stop(id);
 
 		else if (!strcmp(line, "PAUSE\n"))
 			cmd_pause();
@@ -571,7 +1081,7 @@ int module_process(int fd, int block)
 		else if (!strcmp(line, "QUIT\n")) {
 			free(line);
 			cmd_quit();
-			fflush(stdout);
+			fflush(module_out);
 			return 0;
 		}
 
@@ -579,7 +1089,7 @@ int module_process(int fd, int block)
 			print("300 ERR UNKNOWN COMMAND");
 
 		free(line);
-		fflush(stdout);
+		fflush(module_out);
 	}
 }
 
@@ -589,31 +1099,44 @@ void module_report_index_mark(const char *mark)
 	if (!mark)
 		return;
 
-	print("700-%s\n700 INDEX MARK", mark);
+	if (module_speech_cache_record_mark)
+		module_speech_cache_record_mark(mark);
+	if (audio_server)
+		/* It applies to the audio which follows, it can go along */
+		module_send_buffered("700-%s\n700 INDEX MARK%s\n", mark,
+				     module_event_tag);
+	else
+		print("700-%s\n700 INDEX MARK%s", mark, module_event_tag);
 }
 
 /* Report speak start */
 void module_report_event_begin(void)
 {
-	print("701 BEGIN");
+	print("701 BEGIN%s", module_event_tag);
 }
 
 /* Report speak end */
 void module_report_event_end(void)
 {
-	print("702 END");
+	if (module_speech_cache_record_finish)
+		module_speech_cache_record_finish(1);
+	print("702 END%s", module_event_tag);
 }
 
 /* Report speak stop */
 void module_report_event_stop(void)
 {
-	print("703 STOP");
+	if (module_speech_cache_record_finish)
+		module_speech_cache_record_finish(0);
+	print("703 STOP%s", module_event_tag);
 }
 
 /* Report speak pause */
 void module_report_event_pause(void)
 {
-	print("704 PAUSE");
+	if (module_speech_cache_record_finish)
+		module_speech_cache_record_finish(0);
+	print("704 PAUSE%s", module_event_tag);
 }
 
 /* Report sound icon */
@@ -621,5 +1144,8 @@ void module_report_icon(const char *icon)
 {
 	if (!icon)
 		return;
-	print("706-%s\n706 ICON", icon);
+	/* The server plays it along, we could not replay it */
+	if (module_speech_cache_record_finish)
+		module_speech_cache_record_finish(0);
+	print("706-%s\n706 ICON%s", icon, module_event_tag);
 }
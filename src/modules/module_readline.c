@@ -39,7 +39,8 @@
  * This provides simple input buffering for modules.
  */
 
-#define INIT_DATA_ALLOCATED 2
+/* Enough for a whole SPEAK of usual length to come in one read */
+#define INIT_DATA_ALLOCATED 4096
 
 /* Already-received data */
 static char *data = NULL;
@@ -77,7 +78,7 @@ char *module_readline(int fd, int block)
 					data_used -= len;
 					if (!data_used)
 						/* Emptied the buffer, just start over */
-						data_ptr = 0;
+						data_ptr = data_no_lf = 0;
 					else
 						data_ptr += len;
 					return str;
@@ -85,10 +86,14 @@ char *module_readline(int fd, int block)
 			}
 		}
 
-		/* No \n, we should try to read more */
+		/* No \n, we should try to read more, when blocking read()
+		 * will wait by itself */
+		if (block)
+			goto read;
+
 		FD_ZERO(&set);
 		FD_SET(fd, &set);
-		ret = select(fd + 1, &set, NULL, NULL, block ? NULL : &zero_tv);
+		ret = select(fd + 1, &set, NULL, NULL, &zero_tv);
 
 		if (ret == -1) {
 			if (errno == EINTR
@@ -103,13 +108,11 @@ char *module_readline(int fd, int block)
 			perror("select on stdin");
 			return NULL;
 		}
-		if (!FD_ISSET(fd, &set)) {
+		if (!FD_ISSET(fd, &set))
 			/* Nothing incoming */
-			if (!block)
-				return NULL;
-			continue;
-		}
+			return NULL;
 
+read:
 		/* We have data to read, make sure we have room */
 		if (data_ptr + data_used == data_allocated) {
 			/* No room at the end */
@@ -170,8 +173,7 @@ char *module_readline(int fd, int block)
 			return NULL;
 		}
 
-		/* Some more data */
+		/* Some more data, what we already looked at still has no \n */
 		data_used += ret;
-		data_no_lf = 0;
 	}
 }
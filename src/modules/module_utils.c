@@ -23,11 +23,13 @@
 #include <config.h>
 #endif
 
+#include <fcntl.h>
 #include <fdsetconv.h>
 #include "module_utils.h"
 #include "module_main.h"
+#include "module_host.h"
 
-static char *module_audio_pars[10];
+static char *module_audio_pars[12];
 
 int log_level;
 
@@ -102,6 +104,50 @@ void MSG(int level, const char *format, ...) {
 		else return -1; \
 	}
 
+/* How the server wants our threads scheduled: the playback ones, and this
+ * one, which handles the commands and synthesizes in most modules */
+static int audio_realtime_priority;
+static char *audio_cpus;
+static int synthesis_nice;
+static char *synthesis_cpus;
+
+static int module_schedule_set(const char *cur_item, const char *cur_value)
+{
+	SPDThreadSchedule sched = { 0 };
+	char *tptr;
+	long number;
+
+	if (!strcmp(cur_item, "audio_cpus")) {
+		g_free(audio_cpus);
+		audio_cpus = strcmp(cur_value, "NULL") ? g_strdup(cur_value) : NULL;
+		spd_playback_schedule_set(audio_realtime_priority, audio_cpus);
+		return 0;
+	} else if (!strcmp(cur_item, "synthesis_cpus")) {
+		g_free(synthesis_cpus);
+		synthesis_cpus =
+		    strcmp(cur_value, "NULL") ? g_strdup(cur_value) : NULL;
+	} else if (!strcmp(cur_item, "audio_realtime_priority")) {
+		number = strtol(cur_value, &tptr, 10);
+		if (tptr == cur_value || number < 0 || number > 99)
+			return -1;
+		audio_realtime_priority = number;
+		spd_playback_schedule_set(audio_realtime_priority, audio_cpus);
+		return 0;
+	} else if (!strcmp(cur_item, "synthesis_nice")) {
+		number = strtol(cur_value, &tptr, 10);
+		if (tptr == cur_value || number < -20 || number > 19)
+			return -1;
+		synthesis_nice = number;
+	} else
+		return -1;	/* Unknown parameter */
+
+	sched.nice = synthesis_nice;
+	sched.cpus = synthesis_cpus;
+	spd_thread_schedule(&sched);
+
+	return 0;
+}
+
 int module_set(const char *cur_item, const char *cur_value)
 {
 	SET_PARAM_NUM(rate,
@@ -152,7 +198,7 @@ int module_set(const char *cur_item, const char *cur_value)
 			msg_settings.voice.language =
 			    g_strdup(cur_value);
 	} else
-		return -1;	/* Unknown parameter */
+		return module_schedule_set(cur_item, cur_value);
 
 	return 0;
 }
@@ -181,7 +227,16 @@ int module_audio_set(const char *cur_item, const char *cur_value) {
 	    else
 	SET_AUDIO_STR(audio_pulse_min_length, 5)
 	    else
-	/* 6 reserved for speech-dispatcher module name */
+	/* 6 reserved for speech-dispatcher module name, 7 for the ALSA
+	 * idle timeout */
+	SET_AUDIO_STR(audio_file_path, 8)
+	    else
+	SET_AUDIO_STR(audio_rtp_destination, 9)
+	    else
+	if (!strcmp(cur_item, "audio_sink_real_time")) {
+		g_free(module_audio_pars[10]);
+		module_audio_pars[10] = atoi(cur_value) ? g_strdup("1") : NULL;
+	} else
 		return -1;	/* Unknown parameter */
 	return 0;
 }
@@ -205,12 +260,51 @@ int module_loglevel_set(const char *cur_item, const char *cur_value)
 	return 0;
 }
 
+/* Opens the custom debug file.  When spd-module-host runs us for another
+ * machine, whose server can not be trusted with our files, only files of
+ * the directory the host allows are created, and not through symlinks. */
+static FILE *module_debug_open(const char *filename)
+{
+	const char *dir = getenv(SPD_MODULE_DEBUG_DIR_ENV);
+	char *base, *path;
+	FILE *f = NULL;
+	int fd;
+
+	if (!dir)
+		return fopen(filename, "w+");
+
+	if (!dir[0]) {
+		DBG("ERROR: Debugging into files is not allowed here");
+		errno = EPERM;
+		return NULL;
+	}
+
+	base = g_path_get_basename(filename);
+	if (!strcmp(base, ".") || !strcmp(base, "..")
+	    || !strcmp(base, "/")) {
+		g_free(base);
+		errno = EINVAL;
+		return NULL;
+	}
+	path = g_build_filename(dir, base, NULL);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+		  0600);
+	if (fd >= 0) {
+		f = fdopen(fd, "w+");
+		if (!f)
+			close(fd);
+	}
+	g_free(path);
+	g_free(base);
+	return f;
+}
+
 int module_debug(int enable, const char *filename)
 {
 	if (enable) {
 		DBG("Additional logging into specific path %s requested",
 		    filename);
-		FILE *new_CustomDebugFile = fopen(filename, "w+");
+		FILE *new_CustomDebugFile = module_debug_open(filename);
 		if (new_CustomDebugFile == NULL) {
 			DBG("ERROR: Can't open custom debug file for logging: %d (%s)", errno, strerror(errno));
 			return -1;
@@ -244,7 +338,7 @@ int module_debug(int enable, const char *filename)
 
 int module_loop(void)
 {
-	int ret = module_process(STDIN_FILENO, 1);
+	int ret = module_process(module_in, 1);
 
 	if (ret != 0)
 		DBG("Broken pipe, exiting...\n");
@@ -330,6 +424,105 @@ module_get_message_part(const char *message, char *part, unsigned int *pos,
 	return i;
 }
 
+/* Parse <mark name="..."/> at tag, returning the name and the end of the
+ * tag, or NULL if it is not a well formed mark */
+static char *module_parse_mark(const char *tag, const char **end)
+{
+	const char *name, *name_end, *close;
+	char quote;
+
+	name = strstr(tag, "name=");
+	close = strchr(tag, '>');
+	if (name == NULL || close == NULL || name > close)
+		return NULL;
+	name += strlen("name=");
+	quote = *name++;
+	if (quote != '"' && quote != '\'')
+		return NULL;
+	name_end = strchr(name, quote);
+	if (name_end == NULL || name_end > close)
+		return NULL;
+	*end = close + 1;
+	return g_strndup(name, name_end - name);
+}
+
+static void module_add_sentence(GArray *sentences, char *text, char *mark)
+{
+	ModuleSentence sentence = { text, mark };
+
+	g_array_append_val(sentences, sentence);
+}
+
+ModuleSentence *module_split_sentences(const char *message, size_t maxlen,
+				       const char *dividers)
+{
+	GArray *sentences;
+	ModuleSentence *last;
+	const char *p, *tag, *end;
+	char *segment, *plain, *buf, *mark;
+	unsigned int pos;
+	int bytes;
+
+	assert(message != NULL);
+	assert(maxlen > 1);
+
+	sentences = g_array_new(TRUE, TRUE, sizeof(ModuleSentence));
+	buf = g_malloc(maxlen + 1);
+
+	for (p = message; *p != '\0'; p = end) {
+		tag = strstr(p, "<mark");
+		mark = NULL;
+		end = tag;
+		while (tag != NULL && (mark = module_parse_mark(tag, &end)) == NULL) {
+			DBG("Ignoring malformed index mark");
+			tag = strstr(tag + 1, "<mark");
+			end = tag;
+		}
+		if (tag == NULL)
+			end = tag = p + strlen(p);
+
+		segment = g_strndup(p, tag - p);
+		plain = module_strip_ssml(segment);
+		g_free(segment);
+
+		pos = 0;
+		while ((bytes = module_get_message_part(plain, buf, &pos,
+							maxlen, dividers)) >= 0) {
+			if (bytes > 0 && strspn(buf, " \t\r\n") < bytes)
+				module_add_sentence(sentences, g_strdup(buf),
+						    NULL);
+		}
+		g_free(plain);
+
+		if (mark != NULL) {
+			last = sentences->len > 0 ? &g_array_index(sentences,
+					ModuleSentence, sentences->len - 1)
+			    : NULL;
+			if (last != NULL && last->mark == NULL)
+				last->mark = mark;
+			else
+				module_add_sentence(sentences, g_strdup(""),
+						    mark);
+		}
+	}
+
+	g_free(buf);
+	return (ModuleSentence *) g_array_free(sentences, FALSE);
+}
+
+void module_free_sentences(ModuleSentence * sentences)
+{
+	ModuleSentence *s;
+
+	if (sentences == NULL)
+		return;
+	for (s = sentences; s->text != NULL; s++) {
+		g_free(s->text);
+		g_free(s->mark);
+	}
+	g_free(sentences);
+}
+
 void module_strip_punctuation_some(char *message, char *punct_chars)
 {
 	int len;
@@ -610,6 +803,181 @@ int module_terminate_thread(pthread_t thread)
 	return 0;
 }
 
+/* --- RECODING --- */
+
+/* A converter from UTF-8, kept open for all the messages */
+typedef struct {
+	GIConv cd;
+	gboolean ascii;		/* ASCII text stays the same in the charset */
+} ModuleConverter;
+
+/* By charset, protected by module_converters_mutex which is also held while
+   using them since they have a state */
+static GHashTable *module_converters;
+static pthread_mutex_t module_converters_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static ModuleConverter *module_converter_get(const char *charset)
+{
+	ModuleConverter *conv;
+	gchar *ascii;
+
+	if (module_converters == NULL)
+		module_converters = g_hash_table_new(g_str_hash, g_str_equal);
+
+	conv = g_hash_table_lookup(module_converters, charset);
+	if (conv != NULL)
+		return conv->cd == (GIConv) -1 ? NULL : conv;
+
+	conv = g_malloc(sizeof(*conv));
+	conv->cd = g_iconv_open(charset, "UTF-8");
+	/* Also remember failures, not to try again for each message */
+	g_hash_table_insert(module_converters, g_strdup(charset), conv);
+	if (conv->cd == (GIConv) -1) {
+		DBG("Can't recode from UTF-8 to %s\n", charset);
+		return NULL;
+	}
+
+	ascii = g_convert("Az~", -1, charset, "UTF-8", NULL, NULL, NULL);
+	conv->ascii = ascii != NULL && !strcmp(ascii, "Az~");
+	g_free(ascii);
+
+	return conv;
+}
+
+static gboolean module_is_ascii(const char *data, gsize bytes)
+{
+	gsize i;
+
+	for (i = 0; i < bytes; i++)
+		if (data[i] & 0x80)
+			return FALSE;
+	return TRUE;
+}
+
+/* Convert valid UTF-8 and append it, characters which are not in the
+   charset are replaced with fallback, or with \uxxxx escapes when it is
+   NULL, the same as g_convert_with_fallback() does.  With strict set,
+   they are an error.  */
+static int module_recode_valid(ModuleConverter * conv, GString * out,
+			       const char *data, gsize bytes,
+			       const char *fallback, gboolean strict)
+{
+	gchar *in = (gchar *) data;
+	gsize inleft = bytes;
+	char buf[1024];
+
+	if (conv->ascii && module_is_ascii(data, bytes)) {
+		g_string_append_len(out, data, bytes);
+		return 0;
+	}
+
+	while (inleft) {
+		gchar *outp = buf;
+		gsize outleft = sizeof(buf);
+		gsize ret;
+
+		ret = g_iconv(conv->cd, &in, &inleft, &outp, &outleft);
+		g_string_append_len(out, buf, outp - buf);
+		if (ret != (gsize) -1 || errno == E2BIG)
+			continue;
+		if (errno != EILSEQ || strict)
+			return -1;
+
+		/* Not in the charset */
+		if (fallback != NULL) {
+			if (module_recode_valid(conv, out, fallback,
+						strlen(fallback), NULL,
+						TRUE) != 0)
+				return -1;
+		} else {
+			gunichar c = g_utf8_get_char(in);
+			char escape[11];
+
+			if (c < 0x10000)
+				snprintf(escape, sizeof(escape), "\\u%04x", c);
+			else
+				snprintf(escape, sizeof(escape), "\\U%08x", c);
+			if (module_recode_valid(conv, out, escape,
+						strlen(escape), NULL,
+						TRUE) != 0)
+				return -1;
+		}
+		inleft -= g_utf8_next_char(in) - in;
+		in = g_utf8_next_char(in);
+	}
+
+	return 0;
+}
+
+/* Start over from the initial state, and flush its shift sequence */
+static void module_recode_reset(ModuleConverter * conv, GString * out)
+{
+	char buf[16];
+	gchar *outp = buf;
+	gsize outleft = sizeof(buf);
+
+	g_iconv(conv->cd, NULL, NULL, &outp, &outleft);
+	g_string_append_len(out, buf, outp - buf);
+}
+
+char *module_recode(const char *data, gssize bytes, const char *charset,
+		    const char *fallback)
+{
+	ModuleConverter *conv;
+	GString *out;
+	int ret;
+
+	if (bytes < 0)
+		bytes = strlen(data);
+	if (!g_utf8_validate(data, bytes, NULL))
+		return NULL;
+
+	pthread_mutex_lock(&module_converters_mutex);
+	conv = module_converter_get(charset);
+	if (conv == NULL) {
+		pthread_mutex_unlock(&module_converters_mutex);
+		return NULL;
+	}
+
+	out = g_string_sized_new(bytes);
+	ret = module_recode_valid(conv, out, data, bytes, fallback, FALSE);
+	module_recode_reset(conv, out);
+	pthread_mutex_unlock(&module_converters_mutex);
+
+	if (ret != 0) {
+		g_string_free(out, TRUE);
+		return NULL;
+	}
+	return g_string_free(out, FALSE);
+}
+
+gssize module_recode_append(GString * out, const char *data, gsize bytes,
+			    const char *charset, const char *fallback)
+{
+	ModuleConverter *conv;
+	const gchar *end;
+	int ret;
+
+	if (!g_utf8_validate(data, bytes, &end)
+	    && g_utf8_get_char_validated(end, data + bytes - end)
+	    != (gunichar) -2)
+		/* Invalid, not just cut in the middle of a character */
+		return -1;
+
+	pthread_mutex_lock(&module_converters_mutex);
+	conv = module_converter_get(charset);
+	if (conv == NULL) {
+		pthread_mutex_unlock(&module_converters_mutex);
+		return -1;
+	}
+
+	ret = module_recode_valid(conv, out, data, end - data, fallback, FALSE);
+	module_recode_reset(conv, out);
+	pthread_mutex_unlock(&module_converters_mutex);
+
+	return ret != 0 ? -1 : end - data;
+}
+
 char *module_recode_to_iso(const char *data, int bytes, const char *language,
 			   const char *fallback)
 {
@@ -618,15 +986,9 @@ char *module_recode_to_iso(const char *data, int bytes, const char *language,
 	if (language == NULL)
 		recoded = g_strdup(data);
 	else if (!strcmp(language, "cs") || !strcmp(language, "cs-CZ"))
-		recoded =
-		    (char *)g_convert_with_fallback(data, bytes, "ISO8859-2",
-						    "UTF-8", fallback, NULL,
-						    NULL, NULL);
+		recoded = module_recode(data, bytes, "ISO8859-2", fallback);
 	else
-		recoded =
-		    (char *)g_convert_with_fallback(data, bytes, "ISO8859-1",
-						    "UTF-8", fallback, NULL,
-						    NULL, NULL);
+		recoded = module_recode(data, bytes, "ISO8859-1", fallback);
 
 	if (recoded == NULL)
 		DBG("festival: Conversion to ISO coding failed\n");
@@ -671,7 +1033,8 @@ int module_audio_init(char **status_info)
 		*status_info =
 		    g_strdup
 		    ("Sound output method specified in configuration not supported. "
-		     "Please choose 'oss', 'alsa', 'nas', 'libao' or 'pulse'.");
+		     "Please choose 'oss', 'alsa', 'nas', 'libao', 'pulse', 'pipewire', "
+		     "'file' or 'rtp'.");
 		return -1;
 	}
 
@@ -775,42 +1138,122 @@ int module_marks_clear(SPDMarks *marks)
 	return 0;
 }
 
-/* Strip silence at head of audio track */
-void module_strip_head_silence(AudioTrack * track)
+/*
+ * Silence is what stays below module_silence_threshold thousandths of the
+ * full scale.  The scans are done by blocks which compilers vectorize, and
+ * only refined sample by sample in the first block which is not silent.
+ */
+#define SILENCE_BLOCK 64
+
+static int module_silence_threshold = 10;
+static int module_silence_kept_ms;
+
+void module_set_silence(int threshold, int kept_ms)
+{
+	module_silence_threshold = threshold;
+	module_silence_kept_ms = kept_ms;
+}
+
+/* Whether all n samples are silent */
+static int module_silent(const short *samples, unsigned n, int limit)
 {
-	assert(track->bits == 16);
 	unsigned i;
-	float silence_limit = 0.01;
+	int loud = 0;
+
+	for (i = 0; i < n; i++)
+		loud |= (samples[i] >= limit) | (samples[i] <= -limit);
+	return !loud;
+}
 
-	while (track->num_samples >= track->num_channels) {
-		for (i = 0; i < track->num_channels; i++)
-			if (abs(track->samples[i])
-			    >= silence_limit * (1L<<(track->bits-1)))
-				return;
-		track->samples += track->num_channels;
-		track->num_samples -= track->num_channels;
+/* Number of silent samples at the head of the track, in whole frames */
+static unsigned module_head_silence(const AudioTrack *track, int limit)
+{
+	unsigned block = SILENCE_BLOCK * track->num_channels;
+	unsigned n = track->num_samples, i = 0;
+
+	while (i + block <= n && module_silent(track->samples + i, block, limit))
+		i += block;
+	while (i + track->num_channels <= n
+	       && module_silent(track->samples + i, track->num_channels, limit))
+		i += track->num_channels;
+	return i;
+}
+
+/* Number of silent samples at the tail of the track, in whole frames */
+static unsigned module_tail_silence(const AudioTrack *track, int limit)
+{
+	unsigned block = SILENCE_BLOCK * track->num_channels;
+	unsigned n = track->num_samples, i = 0;
+
+	/* Do not count a partial frame at the end */
+	n -= n % track->num_channels;
+	while (i + block <= n
+	       && module_silent(track->samples + n - i - block, block, limit))
+		i += block;
+	while (i + track->num_channels <= n
+	       && module_silent(track->samples + n - i - track->num_channels,
+				track->num_channels, limit))
+		i += track->num_channels;
+	return i + (track->num_samples - n);
+}
+
+static int module_silence_limit(const AudioTrack *track)
+{
+	assert(track->bits == 16);
+	return MAX(1, module_silence_threshold * (1 << (track->bits - 1)) / 1000);
+}
+
+/* Number of samples of silence to keep */
+static unsigned module_silence_kept(const AudioTrack *track)
+{
+	return (unsigned)module_silence_kept_ms * track->sample_rate / 1000
+	    * track->num_channels;
+}
+
+/* Strip silence at head of audio track, returns whether some audio is left,
+ * so that when streaming, the following tracks are stripped until then */
+int module_strip_head_silence(AudioTrack * track)
+{
+	unsigned silence, kept;
+
+	if (track->num_channels < 1 || track->num_samples <= 0)
+		return 0;
+
+	silence = module_head_silence(track, module_silence_limit(track));
+	if (silence == track->num_samples) {
+		track->num_samples = 0;
+		return 0;
 	}
+
+	kept = module_silence_kept(track);
+	if (silence > kept)
+		silence -= kept;
+	else
+		silence = 0;
+	silence -= silence % track->num_channels;
+	track->samples += silence;
+	track->num_samples -= silence;
+	return 1;
 }
+
 /* Strip silence at tail of audio track */
 void module_strip_tail_silence(AudioTrack * track)
 {
-	assert(track->bits == 16);
-	unsigned i;
-	float silence_limit = 0.01;
+	unsigned silence, kept;
 
-	while (track->num_samples >= track->num_channels) {
-		for (i = 0; i < track->num_channels; i++)
-			if (abs(track->samples[track->num_samples - i - 1])
-			    >= silence_limit * (1L<<(track->bits-1)))
-				return;
-		track->num_samples -= track->num_channels;
-	}
+	if (track->num_channels < 1 || track->num_samples <= 0)
+		return;
+
+	silence = module_tail_silence(track, module_silence_limit(track));
+	kept = module_silence_kept(track);
+	if (silence > kept)
+		track->num_samples -= silence - kept;
 }
 
 void module_strip_silence(AudioTrack * track)
 {
-	module_strip_head_silence(track);
-	module_strip_tail_silence(track);
+	if (module_strip_head_silence(track))
+		module_strip_tail_silence(track);
 }
 
 int module_tts_output_marks(AudioTrack track, AudioFormat format, SPDMarks *marks)
@@ -36,8 +36,6 @@
 #include <errno.h>
 #include <dotconf.h>
 
-#include <sys/ipc.h>
-
 #include <speechd_types.h>
 #include "common.h"
 #include "spd_audio.h"
@@ -104,13 +102,16 @@ extern const char *module_name;
 		if (Debug > 1) \
 			fprintf(CustomDebugFile, "FATAL ERROR in output module [%s:%d]:\n   " msg,	\
 			        __FILE__, __LINE__, ## __VA_ARGS__); \
-		exit(EXIT_FAILURE); \
+		module_fatal_exit(); \
 } while (0)
 
 int module_load(void);
 SPDVoice **module_get_voices(void);
+/* Silence is below threshold thousandths of the full scale, and kept_ms of
+   it are left before and after the audio */
+void module_set_silence(int threshold, int kept_ms);
 void module_strip_silence(AudioTrack * track);
-void module_strip_head_silence(AudioTrack * track);
+int module_strip_head_silence(AudioTrack * track);
 void module_strip_tail_silence(AudioTrack * track);
 int module_tts_output(AudioTrack track, AudioFormat format);
 int module_marks_init(SPDMarks *marks);
@@ -118,6 +119,37 @@ int module_marks_add(SPDMarks *marks, unsigned sample, const char *name);
 int module_tts_output_marks(AudioTrack track, AudioFormat format, SPDMarks *marks);
 int module_marks_stop(SPDMarks *marks);
 int module_marks_clear(SPDMarks *marks);
+
+/* Cache of synthesized audio, bounded to max_size bytes */
+typedef struct SPDAudioCache SPDAudioCache;
+SPDAudioCache *module_audio_cache_new(size_t max_size);
+void module_audio_cache_free(SPDAudioCache *cache);
+/* Also keep the entries in dir, salt being what else they depend on */
+void module_audio_cache_set_dir(SPDAudioCache *cache, const char *dir,
+				const char *salt);
+/* The track and marks found stay valid until the cache is modified, marks
+   may be NULL */
+gboolean module_audio_cache_lookup(SPDAudioCache *cache, SPDMessageType type,
+				   const char *text,
+				   const SPDMsgSettings *settings,
+				   AudioTrack *track, const SPDMarks **marks);
+/* The samples and marks are copied, marks may be NULL */
+int module_audio_cache_insert(SPDAudioCache *cache, SPDMessageType type,
+			      const char *text,
+			      const SPDMsgSettings *settings,
+			      const AudioTrack *track, const SPDMarks *marks);
+
+/* Streaming of audio from the thread of the synthesizer to the server, see
+   module_utils_stream.c.  All but module_stream_begin() and
+   module_stream_stop() return non-zero once the message of id is stopped */
+unsigned module_stream_begin(void);
+/* The samples of the marks are from the start of the track, increasing */
+int module_stream_audio(unsigned id, const AudioTrack *track,
+			AudioFormat format, const SPDMarks *marks);
+int module_stream_mark(unsigned id, const char *name);
+int module_stream_end(unsigned id);
+void module_stream_stop(gboolean pause);
+
 char *module_is_speaking(void);
 SPDVoice **module_list_registered_voices(void);
 
@@ -157,6 +189,20 @@ int module_get_message_part(const char *message, char *part,
 			    unsigned int *pos, size_t maxlen,
 			    const char *dividers);
 
+/* A piece of plain text to synthesize at once and the index mark to report
+ * once its audio was sent, if any */
+typedef struct {
+	char *text;
+	char *mark;
+} ModuleSentence;
+
+/* Split an SSML message into sentences of at most maxlen bytes, see
+ * module_get_message_part(), and at index marks. The array ends with a
+ * NULL text. */
+ModuleSentence *module_split_sentences(const char *message, size_t maxlen,
+				       const char *dividers);
+void module_free_sentences(ModuleSentence * sentences);
+
 void set_speaking_thread_parameters(void);
 
 void module_parent_dp_init(TModuleDoublePipe dpipe);
@@ -202,6 +248,16 @@ int module_parent_wait_continue(TModuleDoublePipe dpipe);
 
 void set_speaking_thread_parameters(void);
 int module_terminate_thread(pthread_t thread);
+/* Convert UTF-8 text to charset like g_convert_with_fallback(), keeping the
+   converter open for the next messages.  Returns NULL if the text is not
+   valid UTF-8 or the charset is not known.  */
+char *module_recode(const char *data, gssize bytes, const char *charset,
+		    const char *fallback);
+/* The same for text coming by chunks: appends the recoding of the chunk to
+   out, and returns how many bytes of it were used.  A character cut at the
+   end of the chunk is left for the next one.  */
+gssize module_recode_append(GString * out, const char *data, gsize bytes,
+			    const char *charset, const char *fallback);
 char *module_recode_to_iso(const char *data, int bytes, const char *language,
 			   const char *fallback);
 void module_signal_end(void);
@@ -33,12 +33,13 @@
 
 GHashTable *module_voice_table = NULL;
 
-static int nbvoices=0;
 static int nbpaths=0;
-static SPDVoice *generic_voices;
-static SPDVoice **generic_voices_list;
+/* The voices, NULL-terminated once there is one */
+static GPtrArray *generic_voices;
 static char *default_voice;
 static char **dependency_paths;
+/* Replaces $VOICE in dependency_paths */
+static GRegex *dependency_regex;
 typedef struct {
 	char *male1;
 	char *male2;
@@ -61,15 +62,14 @@ DOTCONF_CB(VoiceFileDependency_cb)
 DOTCONF_CB(AddVoice_cb)
 {
 	int i=0;
-	GRegex *regex;
 	SPDVoiceDef *voices;
-	char *language = cmd->data.list[0];
+	const char *language;
 	char *symbolic;
 	char *voicename = cmd->data.list[2];
-	char *key;
 	SPDVoiceDef *value;
+	SPDVoice *voice;
 
-	if (language == NULL) {
+	if (cmd->data.list[0] == NULL) {
 		DBG("Missing language.\n");
 		return NULL;
 	}
@@ -89,12 +89,14 @@ DOTCONF_CB(AddVoice_cb)
 		return NULL;
 	}
 
+	/* There are few languages and variants for many voices, keep them
+	   only once */
+	language = g_intern_string(cmd->data.list[0]);
 	symbolic =
 	    (char *)g_ascii_strup(cmd->data.list[1], strlen(cmd->data.list[1]));
 
 	voices = g_hash_table_lookup(module_voice_table, language);
 	if (voices == NULL) {
-		key = (char *)g_strdup(language);
 		value = (SPDVoiceDef *) g_malloc(sizeof(SPDVoiceDef));
 
 		value->male1 = NULL;
@@ -106,23 +108,23 @@ DOTCONF_CB(AddVoice_cb)
 		value->child_male = NULL;
 		value->child_female = NULL;
 
-		g_hash_table_insert(module_voice_table, key, value);
+		g_hash_table_insert(module_voice_table, (char *)language, value);
 		voices = value;
 	}
 
-	regex = g_regex_new("[$]VOICE", 0, 0, NULL);
+	if (nbpaths && !dependency_regex)
+		dependency_regex = g_regex_new("[$]VOICE", 0, 0, NULL);
 	for (i = 0; i < nbpaths; i++)
 	{
-		char *new_dependency_path = g_regex_replace_literal(regex, dependency_paths[i], -1, 0, cmd->data.list[2], 0, NULL);
+		char *new_dependency_path = g_regex_replace_literal(dependency_regex, dependency_paths[i], -1, 0, cmd->data.list[2], 0, NULL);
 		if (! g_file_test(new_dependency_path, G_FILE_TEST_EXISTS)) {
 			DBG("Missing dependency %s\n", new_dependency_path);
 			g_free(new_dependency_path);
-			g_regex_unref(regex);
+			g_free(symbolic);
 			return NULL;
 		}
 		g_free(new_dependency_path);
 	}
-	g_regex_unref(regex);
 
 	if (!strcmp(symbolic, "MALE1"))
 		voices->male1 = g_strdup(voicename);
@@ -142,19 +144,24 @@ DOTCONF_CB(AddVoice_cb)
 		voices->child_female = g_strdup(voicename);
 	else {
 		DBG("Unrecognized voice name in configuration\n");
+		g_free(symbolic);
 		return NULL;
 	}
-
-	generic_voices = (SPDVoice *)g_realloc(generic_voices, (nbvoices+1) * sizeof(SPDVoice));
-	generic_voices_list = (SPDVoice **)g_realloc(generic_voices_list, (nbvoices+2) * sizeof(SPDVoice *));
-	generic_voices[nbvoices].name = g_strdup(cmd->data.list[2]);
-	generic_voices[nbvoices].language = g_strdup(cmd->data.list[0]);
-	generic_voices[nbvoices].variant = g_strdup(cmd->data.list[1]);;
-	for (i = 0; i < nbvoices+1; i++)
-		generic_voices_list[i] = &generic_voices[i];
-	generic_voices_list[nbvoices+1] = NULL;
-	DBG("Added voice %s\n", generic_voices[nbvoices].name);
-	++nbvoices;
+	g_free(symbolic);
+
+	if (generic_voices == NULL)
+		generic_voices = g_ptr_array_new();
+	else
+		/* Drop the terminating NULL */
+		g_ptr_array_set_size(generic_voices, generic_voices->len - 1);
+
+	voice = g_new(SPDVoice, 1);
+	voice->name = g_strdup(cmd->data.list[2]);
+	voice->language = (char *)language;
+	voice->variant = (char *)g_intern_string(cmd->data.list[1]);
+	g_ptr_array_add(generic_voices, voice);
+	g_ptr_array_add(generic_voices, NULL);
+	DBG("Added voice %s\n", voice->name);
 	return NULL;
 }
 
@@ -196,18 +203,21 @@ void module_register_settings_voices(void)
 
 gboolean module_existsvoice(const char *voicename)
 {
-	int i;
-	if (!nbvoices)
+	SPDVoice **voice;
+
+	if (generic_voices == NULL)
 		return FALSE;
-	for (i = 0; generic_voices_list[i] != NULL; i++) {
-	if (strcasecmp(generic_voices[i].name, voicename) == 0)
-		return TRUE;
+	for (voice = (SPDVoice **)generic_voices->pdata; *voice; voice++) {
+		if (strcasecmp((*voice)->name, voicename) == 0)
+			return TRUE;
 	}
 	return FALSE;
 }
 
 SPDVoice **module_list_registered_voices(void) {
-	return (SPDVoice **)generic_voices_list;
+	if (generic_voices == NULL)
+		return NULL;
+	return (SPDVoice **)generic_voices->pdata;
 }
 
 char *module_getvoice(const char *language, SPDVoiceType voice)
@@ -0,0 +1,653 @@
+/*
+ * module_utils_cache.c - Cache of synthesized audio for output modules
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Entries are found through a hash of the text, the message type and the
+ * voice settings, and kept in least recently used order in a queue whose
+ * links are embedded in the entries, so that lookups, insertions and
+ * evictions never walk the cache.
+ *
+ * When a directory is set, entries are also written there, one file per
+ * entry named after a checksum of the key, and looked up there when they are
+ * not in memory, so that they survive restarts of the module.
+ *
+ * The module basis uses one such cache to replay short messages without
+ * asking the module, see module_speech_cache_get() below.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <sys/stat.h>
+
+#include "module_utils.h"
+
+#define CACHE_FILE_MAGIC "SPDAUDC1"
+
+typedef struct {
+	SPDMessageType type;
+	char *text;
+	SPDMsgSettings settings;
+	AudioTrack track;
+	SPDMarks marks;
+	size_t size;		/* all the memory this entry holds */
+	GList link;		/* in lru, its data is the entry */
+} SPDAudioCacheEntry;
+
+struct SPDAudioCache {
+	GHashTable *entries;	/* entry -> entry */
+	GQueue lru;		/* most recently used first */
+	size_t size;
+	size_t max_size;
+	char *dir;		/* on-disk tier, if any */
+	char *salt;		/* what else the audio depends on */
+};
+
+static guint cache_str_hash(const char *str)
+{
+	return str ? g_str_hash(str) : 0;
+}
+
+static guint cache_entry_hash(gconstpointer data)
+{
+	const SPDAudioCacheEntry *entry = data;
+	const SPDMsgSettings *set = &entry->settings;
+	guint hash;
+
+	hash = cache_str_hash(entry->text);
+	hash = hash * 31 + entry->type;
+	hash = hash * 31 + set->rate;
+	hash = hash * 31 + set->pitch;
+	hash = hash * 31 + set->pitch_range;
+	hash = hash * 31 + set->volume;
+	hash = hash * 31 + set->punctuation_mode;
+	hash = hash * 31 + set->spelling_mode;
+	hash = hash * 31 + set->cap_let_recogn;
+	hash = hash * 31 + set->voice_type;
+	hash = hash * 31 + cache_str_hash(set->voice.name);
+	hash = hash * 31 + cache_str_hash(set->voice.language);
+	hash = hash * 31 + cache_str_hash(set->voice.variant);
+
+	return hash;
+}
+
+static gboolean cache_entry_equal(gconstpointer a, gconstpointer b)
+{
+	const SPDAudioCacheEntry *A = a, *B = b;
+	const SPDMsgSettings *sa = &A->settings, *sb = &B->settings;
+
+	return A->type == B->type
+	    && !strcmp(A->text, B->text)
+	    && sa->rate == sb->rate
+	    && sa->pitch == sb->pitch
+	    && sa->pitch_range == sb->pitch_range
+	    && sa->volume == sb->volume
+	    && sa->punctuation_mode == sb->punctuation_mode
+	    && sa->spelling_mode == sb->spelling_mode
+	    && sa->cap_let_recogn == sb->cap_let_recogn
+	    && sa->voice_type == sb->voice_type
+	    && !g_strcmp0(sa->voice.name, sb->voice.name)
+	    && !g_strcmp0(sa->voice.language, sb->voice.language)
+	    && !g_strcmp0(sa->voice.variant, sb->voice.variant);
+}
+
+/* An entry made of the caller's data, only for looking up */
+static void cache_entry_probe(SPDAudioCacheEntry * probe, SPDMessageType type,
+			      const char *text, const SPDMsgSettings * settings)
+{
+	probe->type = type;
+	probe->text = (char *)text;
+	probe->settings = *settings;
+}
+
+static void cache_entry_free(SPDAudioCacheEntry * entry)
+{
+	g_free(entry->text);
+	g_free(entry->settings.voice.name);
+	g_free(entry->settings.voice.language);
+	g_free(entry->settings.voice.variant);
+	g_free(entry->track.samples);
+	module_marks_clear(&entry->marks);
+	g_free(entry);
+}
+
+static size_t cache_track_bytes(const AudioTrack * track)
+{
+	return (size_t)track->num_samples * track->num_channels
+	    * track->bits / 8;
+}
+
+static void cache_remove(SPDAudioCache * cache, SPDAudioCacheEntry * entry)
+{
+	g_hash_table_remove(cache->entries, entry);
+	g_queue_unlink(&cache->lru, &entry->link);
+	cache->size -= entry->size;
+	cache_entry_free(entry);
+}
+
+SPDAudioCache *module_audio_cache_new(size_t max_size)
+{
+	SPDAudioCache *cache;
+
+	cache = g_malloc0(sizeof(*cache));
+	cache->entries = g_hash_table_new(cache_entry_hash, cache_entry_equal);
+	g_queue_init(&cache->lru);
+	cache->max_size = max_size;
+
+	return cache;
+}
+
+void module_audio_cache_free(SPDAudioCache * cache)
+{
+	if (cache == NULL)
+		return;
+
+	while (!g_queue_is_empty(&cache->lru))
+		cache_remove(cache, g_queue_peek_head(&cache->lru));
+	g_hash_table_destroy(cache->entries);
+	g_free(cache->dir);
+	g_free(cache->salt);
+	g_free(cache);
+}
+
+void module_audio_cache_set_dir(SPDAudioCache * cache, const char *dir,
+				const char *salt)
+{
+	g_free(cache->dir);
+	g_free(cache->salt);
+	cache->dir = NULL;
+	cache->salt = NULL;
+
+	if (dir == NULL)
+		return;
+	if (g_mkdir_with_parents(dir, S_IRWXU) != 0) {
+		DBG("Audio cache: can't create %s: %s", dir, strerror(errno));
+		return;
+	}
+	cache->dir = g_strdup(dir);
+	cache->salt = g_strdup(salt ? salt : "");
+}
+
+/* The whole key as a string, stored in the files to rule out collisions */
+static char *cache_key_string(const SPDAudioCacheEntry * key)
+{
+	const SPDMsgSettings *set = &key->settings;
+
+	return g_strdup_printf("%d %d %d %d %d %d %d %d %d\n%s\n%s\n%s\n%s",
+			       key->type, set->rate, set->pitch,
+			       set->pitch_range, set->volume,
+			       set->punctuation_mode, set->spelling_mode,
+			       set->cap_let_recogn, set->voice_type,
+			       set->voice.name ? set->voice.name : "",
+			       set->voice.language ? set->voice.language : "",
+			       set->voice.variant ? set->voice.variant : "",
+			       key->text);
+}
+
+static char *cache_file_path(const SPDAudioCache * cache, const char *key)
+{
+	char *salted, *sum, *path;
+
+	salted = g_strconcat(cache->salt, "\n", key, NULL);
+	sum = g_compute_checksum_for_string(G_CHECKSUM_SHA1, salted, -1);
+	path = g_build_filename(cache->dir, sum, NULL);
+	g_free(sum);
+	g_free(salted);
+
+	return path;
+}
+
+static void cache_append_u32(GString * str, guint32 val)
+{
+	g_string_append_len(str, (const char *)&val, sizeof(val));
+}
+
+static void cache_file_save(const SPDAudioCache * cache,
+			    const SPDAudioCacheEntry * entry)
+{
+	char *key, *path;
+	GString *contents;
+	GError *error = NULL;
+	unsigned i;
+
+	key = cache_key_string(entry);
+	path = cache_file_path(cache, key);
+
+	contents = g_string_new(CACHE_FILE_MAGIC);
+	cache_append_u32(contents, strlen(key));
+	g_string_append(contents, key);
+	cache_append_u32(contents, entry->track.bits);
+	cache_append_u32(contents, entry->track.num_channels);
+	cache_append_u32(contents, entry->track.sample_rate);
+	cache_append_u32(contents, entry->track.num_samples);
+	cache_append_u32(contents, entry->marks.num);
+	for (i = 0; i < entry->marks.num; i++) {
+		cache_append_u32(contents, entry->marks.samples[i]);
+		cache_append_u32(contents, strlen(entry->marks.names[i]));
+		g_string_append(contents, entry->marks.names[i]);
+	}
+	g_string_append_len(contents, (const char *)entry->track.samples,
+			    cache_track_bytes(&entry->track));
+
+	if (!g_file_set_contents(path, contents->str, contents->len, &error)) {
+		DBG("Audio cache: can't write %s: %s", path, error->message);
+		g_error_free(error);
+	}
+
+	g_string_free(contents, TRUE);
+	g_free(path);
+	g_free(key);
+}
+
+/* Read len bytes from the file contents */
+static const char *cache_file_take(const char **p, const char *end, size_t len)
+{
+	const char *ret = *p;
+
+	if ((size_t)(end - *p) < len)
+		return NULL;
+	*p += len;
+	return ret;
+}
+
+static int cache_file_u32(const char **p, const char *end, guint32 * val)
+{
+	const char *data = cache_file_take(p, end, sizeof(*val));
+
+	if (data == NULL)
+		return -1;
+	memcpy(val, data, sizeof(*val));
+	return 0;
+}
+
+/* Load the entry for probe from the directory into track and marks */
+static int cache_file_load(const SPDAudioCache * cache,
+			   const SPDAudioCacheEntry * probe,
+			   AudioTrack * track, SPDMarks * marks)
+{
+	char *key, *path, *contents = NULL, *name;
+	const char *p, *end, *data;
+	gsize length;
+	guint32 len, val[4], nmarks, sample, i;
+	int ret = -1;
+
+	key = cache_key_string(probe);
+	path = cache_file_path(cache, key);
+	module_marks_init(marks);
+
+	if (!g_file_get_contents(path, &contents, &length, NULL))
+		goto out;
+	p = contents;
+	end = contents + length;
+
+	data = cache_file_take(&p, end, strlen(CACHE_FILE_MAGIC));
+	if (data == NULL || memcmp(data, CACHE_FILE_MAGIC,
+				   strlen(CACHE_FILE_MAGIC)))
+		goto out;
+	if (cache_file_u32(&p, end, &len) != 0 || len != strlen(key)
+	    || (data = cache_file_take(&p, end, len)) == NULL
+	    || memcmp(data, key, len))
+		goto out;
+
+	for (i = 0; i < 4; i++)
+		if (cache_file_u32(&p, end, &val[i]) != 0)
+			goto out;
+	track->bits = val[0];
+	track->num_channels = val[1];
+	track->sample_rate = val[2];
+	track->num_samples = val[3];
+
+	if (cache_file_u32(&p, end, &nmarks) != 0)
+		goto out;
+	for (i = 0; i < nmarks; i++) {
+		if (cache_file_u32(&p, end, &sample) != 0
+		    || cache_file_u32(&p, end, &len) != 0
+		    || (data = cache_file_take(&p, end, len)) == NULL)
+			goto out;
+		name = g_strndup(data, len);
+		module_marks_add(marks, sample, name);
+		g_free(name);
+	}
+
+	if ((size_t)(end - p) != cache_track_bytes(track))
+		goto out;
+	track->samples = g_malloc(end - p);
+	memcpy(track->samples, p, end - p);
+
+	DBG("Audio cache: loaded %s", path);
+	ret = 0;
+out:
+	if (ret != 0)
+		module_marks_clear(marks);
+	g_free(contents);
+	g_free(path);
+	g_free(key);
+	return ret;
+}
+
+static SPDAudioCacheEntry *cache_add(SPDAudioCache * cache,
+				      SPDMessageType type, const char *text,
+				      const SPDMsgSettings * settings,
+				      const AudioTrack * track,
+				      const SPDMarks * marks);
+
+gboolean module_audio_cache_lookup(SPDAudioCache * cache, SPDMessageType type,
+				   const char *text,
+				   const SPDMsgSettings * settings,
+				   AudioTrack * track, const SPDMarks ** marks)
+{
+	SPDAudioCacheEntry probe, *entry;
+	AudioTrack disk_track;
+	SPDMarks disk_marks;
+
+	if (cache == NULL || text == NULL)
+		return FALSE;
+
+	cache_entry_probe(&probe, type, text, settings);
+	entry = g_hash_table_lookup(cache->entries, &probe);
+	if (entry == NULL && cache->dir != NULL
+	    && cache_file_load(cache, &probe, &disk_track, &disk_marks) == 0) {
+		entry = cache_add(cache, type, text, settings, &disk_track,
+				  &disk_marks);
+		g_free(disk_track.samples);
+		module_marks_clear(&disk_marks);
+	}
+	if (entry == NULL)
+		return FALSE;
+
+	/* Most recently used */
+	g_queue_unlink(&cache->lru, &entry->link);
+	g_queue_push_head_link(&cache->lru, &entry->link);
+
+	DBG("Audio cache: found %d samples for '%s'", entry->track.num_samples,
+	    text);
+	*track = entry->track;
+	if (marks != NULL)
+		*marks = &entry->marks;
+	return TRUE;
+}
+
+/* Insert a copy into memory only */
+static SPDAudioCacheEntry *cache_add(SPDAudioCache * cache,
+				      SPDMessageType type, const char *text,
+				      const SPDMsgSettings * settings,
+				      const AudioTrack * track,
+				      const SPDMarks * marks)
+{
+	SPDAudioCacheEntry probe, *entry;
+	size_t bytes, size;
+	unsigned i;
+
+	bytes = cache_track_bytes(track);
+	size = sizeof(*entry) + bytes + strlen(text) + 1;
+	if (marks != NULL) {
+		size += marks->num * (sizeof(marks->samples[0])
+				      + sizeof(marks->names[0]));
+		for (i = 0; i < marks->num; i++)
+			size += strlen(marks->names[i]) + 1;
+	}
+	if (settings->voice.name)
+		size += strlen(settings->voice.name) + 1;
+	if (settings->voice.language)
+		size += strlen(settings->voice.language) + 1;
+	if (settings->voice.variant)
+		size += strlen(settings->voice.variant) + 1;
+	if (size > cache->max_size)
+		return NULL;
+
+	cache_entry_probe(&probe, type, text, settings);
+	entry = g_hash_table_lookup(cache->entries, &probe);
+	if (entry != NULL)
+		cache_remove(cache, entry);
+
+	/* Make room by dropping the least recently used entries */
+	while (cache->size + size > cache->max_size) {
+		entry = g_queue_peek_tail(&cache->lru);
+		DBG("Audio cache: dropping '%s'", entry->text);
+		cache_remove(cache, entry);
+	}
+
+	entry = g_malloc(sizeof(*entry));
+	entry->type = type;
+	entry->text = g_strdup(text);
+	entry->settings = *settings;
+	entry->settings.voice.name = g_strdup(settings->voice.name);
+	entry->settings.voice.language = g_strdup(settings->voice.language);
+	entry->settings.voice.variant = g_strdup(settings->voice.variant);
+	entry->track = *track;
+	entry->track.samples = g_malloc(bytes);
+	memcpy(entry->track.samples, track->samples, bytes);
+	module_marks_init(&entry->marks);
+	if (marks != NULL)
+		for (i = 0; i < marks->num; i++)
+			module_marks_add(&entry->marks, marks->samples[i],
+					 marks->names[i]);
+	entry->size = size;
+	entry->link.data = entry;
+	entry->link.prev = entry->link.next = NULL;
+
+	g_hash_table_insert(cache->entries, entry, entry);
+	g_queue_push_head_link(&cache->lru, &entry->link);
+	cache->size += size;
+
+	DBG("Audio cache: stored %d samples for '%s', %zu bytes used",
+	    track->num_samples, text, cache->size);
+	return entry;
+}
+
+int module_audio_cache_insert(SPDAudioCache * cache, SPDMessageType type,
+			      const char *text,
+			      const SPDMsgSettings * settings,
+			      const AudioTrack * track, const SPDMarks * marks)
+{
+	SPDAudioCacheEntry *entry;
+
+	if (cache == NULL || text == NULL || track->samples == NULL)
+		return -1;
+
+	entry = cache_add(cache, type, text, settings, track, marks);
+	if (entry == NULL)
+		return -1;
+
+	if (cache->dir != NULL)
+		cache_file_save(cache, entry);
+	return 0;
+}
+
+/*
+ * The cache of the module basis, for short messages
+ */
+
+static SPDAudioCache *speech_cache;
+static size_t speech_cache_max_length;
+static pthread_mutex_t speech_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The message being synthesized by the module, to be stored at its end */
+static struct {
+	gboolean active;
+	SPDMessageType type;
+	char *text;
+	SPDMsgSettings settings;
+	AudioTrack format;
+	GString *samples;
+	SPDMarks marks;
+} speech_record;
+
+void module_speech_cache_configure(int max_kbytes, int max_length,
+				   const char *dir, const char *salt)
+{
+	pthread_mutex_lock(&speech_cache_mutex);
+	module_audio_cache_free(speech_cache);
+	speech_cache = NULL;
+	if (max_kbytes > 0 && max_length > 0) {
+		speech_cache = module_audio_cache_new(max_kbytes * 1024);
+		if (dir != NULL && dir[0] != '\0')
+			module_audio_cache_set_dir(speech_cache, dir, salt);
+		DBG("Audio cache: %d kbytes for messages up to %d bytes",
+		    max_kbytes, max_length);
+	}
+	speech_cache_max_length = max_length;
+	pthread_mutex_unlock(&speech_cache_mutex);
+}
+
+static gboolean speech_cache_wanted(SPDMessageType type, const char *text)
+{
+	/* Icons are played by the server anyway */
+	return speech_cache != NULL && type != SPD_MSGTYPE_SOUND_ICON
+	    && strlen(text) <= speech_cache_max_length;
+}
+
+int module_speech_cache_get(SPDMessageType type, const char *text,
+			    SPDCachedAudio * audio)
+{
+	const SPDMarks *marks;
+	short *samples;
+	size_t bytes;
+	unsigned i;
+	int ret = -1;
+
+	pthread_mutex_lock(&speech_cache_mutex);
+	if (speech_cache_wanted(type, text)
+	    && module_audio_cache_lookup(speech_cache, type, text,
+					 &msg_settings, &audio->track,
+					 &marks)) {
+		/* Copy it all, the cache may change while it is played */
+		bytes = cache_track_bytes(&audio->track);
+		samples = g_malloc(bytes);
+		memcpy(samples, audio->track.samples, bytes);
+		audio->track.samples = samples;
+		audio->num_marks = marks->num;
+		audio->mark_samples = g_new(unsigned, marks->num);
+		audio->mark_names = g_new(char *, marks->num);
+		for (i = 0; i < marks->num; i++) {
+			audio->mark_samples[i] = marks->samples[i];
+			audio->mark_names[i] = g_strdup(marks->names[i]);
+		}
+		ret = 0;
+	}
+	pthread_mutex_unlock(&speech_cache_mutex);
+
+	return ret;
+}
+
+void module_speech_cache_free_audio(SPDCachedAudio * audio)
+{
+	unsigned i;
+
+	g_free(audio->track.samples);
+	for (i = 0; i < audio->num_marks; i++)
+		g_free(audio->mark_names[i]);
+	g_free(audio->mark_samples);
+	g_free(audio->mark_names);
+}
+
+static void speech_record_clear(void)
+{
+	speech_record.active = FALSE;
+	g_free(speech_record.text);
+	speech_record.text = NULL;
+	g_free(speech_record.settings.voice.name);
+	g_free(speech_record.settings.voice.language);
+	g_free(speech_record.settings.voice.variant);
+	memset(&speech_record.settings, 0, sizeof(speech_record.settings));
+	if (speech_record.samples != NULL)
+		g_string_free(speech_record.samples, TRUE);
+	speech_record.samples = NULL;
+	module_marks_clear(&speech_record.marks);
+}
+
+void module_speech_cache_record_start(SPDMessageType type, const char *text)
+{
+	pthread_mutex_lock(&speech_cache_mutex);
+	speech_record_clear();
+	if (speech_cache_wanted(type, text)) {
+		speech_record.active = TRUE;
+		speech_record.type = type;
+		speech_record.text = g_strdup(text);
+		speech_record.settings = msg_settings;
+		speech_record.settings.voice.name =
+		    g_strdup(msg_settings.voice.name);
+		speech_record.settings.voice.language =
+		    g_strdup(msg_settings.voice.language);
+		speech_record.settings.voice.variant =
+		    g_strdup(msg_settings.voice.variant);
+		speech_record.format.num_channels = 0;
+		speech_record.samples = g_string_new(NULL);
+		module_marks_init(&speech_record.marks);
+	}
+	pthread_mutex_unlock(&speech_cache_mutex);
+}
+
+void module_speech_cache_record_audio(const AudioTrack * track,
+				      AudioFormat format)
+{
+	AudioTrack *rec = &speech_record.format;
+
+	pthread_mutex_lock(&speech_cache_mutex);
+	if (!speech_record.active)
+		goto out;
+
+	if (rec->num_channels == 0) {
+		*rec = *track;
+		rec->num_samples = 0;
+	}
+	/* Replays are little-endian, and in one format.  Don't bother with
+	   what would not fit anyway. */
+	if (format != SPD_AUDIO_LE || track->bits != rec->bits
+	    || track->num_channels != rec->num_channels
+	    || track->sample_rate != rec->sample_rate
+	    || speech_record.samples->len > speech_cache->max_size) {
+		speech_record_clear();
+		goto out;
+	}
+
+	g_string_append_len(speech_record.samples,
+			    (const char *)track->samples,
+			    cache_track_bytes(track));
+	rec->num_samples += track->num_samples;
+out:
+	pthread_mutex_unlock(&speech_cache_mutex);
+}
+
+void module_speech_cache_record_mark(const char *mark)
+{
+	pthread_mutex_lock(&speech_cache_mutex);
+	if (speech_record.active)
+		module_marks_add(&speech_record.marks,
+				 speech_record.format.num_samples, mark);
+	pthread_mutex_unlock(&speech_cache_mutex);
+}
+
+void module_speech_cache_record_finish(int keep)
+{
+	AudioTrack track;
+
+	pthread_mutex_lock(&speech_cache_mutex);
+	if (speech_record.active && keep && speech_record.samples->len > 0) {
+		track = speech_record.format;
+		track.samples = (short *)speech_record.samples->str;
+		module_audio_cache_insert(speech_cache, speech_record.type,
+					  speech_record.text,
+					  &speech_record.settings, &track,
+					  &speech_record.marks);
+	}
+	speech_record_clear();
+	pthread_mutex_unlock(&speech_cache_mutex);
+}
@@ -0,0 +1,156 @@
+/*
+ * module_utils_stream.c - Streaming of synthesized audio for output modules
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU Lesser General Public License as published by the Free
+ * Software Foundation; either version 2.1, or (at your option) any later
+ * version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is for modules whose synthesizer calls them back from its own thread
+ * with pieces of audio, as they get synthesized.  module_speak() gets a
+ * stream id from module_stream_begin() and hands it to the synthesizer along
+ * the text, the callback passes it back to module_stream_audio() with the
+ * audio and the marks which fall in it, and to module_stream_end() once the
+ * text is over.  They return non-zero when the message was stopped, for the
+ * callback to tell the synthesizer to abort.
+ *
+ * module_stop() and module_pause() call module_stream_stop(), which reports
+ * the event right away: the server does not wait for the synthesizer to
+ * notice, and what it still produces for the stopped message, e.g. because
+ * it synthesizes ahead, is dropped since it comes with a stale id.
+ *
+ * The audio goes to the server, and through the module basis to the audio
+ * cache, so that a message spoken again is replayed without synthesizing it.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "module_utils.h"
+
+static pthread_mutex_t stream_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Id of the current message, 0 when there is none */
+static unsigned stream_id;
+static unsigned stream_last_id;
+static gboolean stream_began;
+
+/* Called with stream_mutex held, whether the id is the current message */
+static gboolean stream_current(unsigned id)
+{
+	if (id && id == stream_id) {
+		if (!stream_began) {
+			stream_began = TRUE;
+			module_report_event_begin();
+		}
+		return TRUE;
+	}
+	return FALSE;
+}
+
+unsigned module_stream_begin(void)
+{
+	unsigned id;
+
+	pthread_mutex_lock(&stream_mutex);
+	if (!++stream_last_id)
+		stream_last_id++;
+	id = stream_id = stream_last_id;
+	stream_began = FALSE;
+	pthread_mutex_unlock(&stream_mutex);
+
+	return id;
+}
+
+int module_stream_audio(unsigned id, const AudioTrack *track,
+			AudioFormat format, const SPDMarks *marks)
+{
+	AudioTrack cur = *track;
+	size_t sample_size = track->num_channels * track->bits / 8;
+	unsigned done = 0, end, i;
+
+	pthread_mutex_lock(&stream_mutex);
+	if (!stream_current(id)) {
+		pthread_mutex_unlock(&stream_mutex);
+		return 1;
+	}
+
+	/* The mutex is kept while sending, so that a stop can not get
+	 * reported in between; the module basis itself drops the rest of the
+	 * audio as soon as it is requested to stop */
+	for (i = 0; marks && i < marks->num; i++) {
+		end = MIN(marks->samples[i], (unsigned)track->num_samples);
+		if (end > done) {
+			cur.samples = (short *)((char *)track->samples
+						+ done * sample_size);
+			cur.num_samples = end - done;
+			module_tts_output_server(&cur, format);
+			done = end;
+		}
+		module_report_index_mark(marks->names[i]);
+	}
+	if (done < track->num_samples) {
+		cur.samples = (short *)((char *)track->samples
+					+ done * sample_size);
+		cur.num_samples = track->num_samples - done;
+		module_tts_output_server(&cur, format);
+	}
+	pthread_mutex_unlock(&stream_mutex);
+
+	return 0;
+}
+
+int module_stream_mark(unsigned id, const char *name)
+{
+	pthread_mutex_lock(&stream_mutex);
+	if (!stream_current(id)) {
+		pthread_mutex_unlock(&stream_mutex);
+		return 1;
+	}
+	module_report_index_mark(name);
+	pthread_mutex_unlock(&stream_mutex);
+
+	return 0;
+}
+
+int module_stream_end(unsigned id)
+{
+	pthread_mutex_lock(&stream_mutex);
+	if (!stream_current(id)) {
+		pthread_mutex_unlock(&stream_mutex);
+		return 1;
+	}
+	stream_id = 0;
+	module_report_event_end();
+	pthread_mutex_unlock(&stream_mutex);
+
+	return 0;
+}
+
+void module_stream_stop(gboolean pause)
+{
+	pthread_mutex_lock(&stream_mutex);
+	if (stream_id) {
+		stream_id = 0;
+		/* The server expects BEGIN before the stop */
+		if (!stream_began)
+			module_report_event_begin();
+		if (pause)
+			module_report_event_pause();
+		else
+			module_report_event_stop();
+	}
+	pthread_mutex_unlock(&stream_mutex);
+}
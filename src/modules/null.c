@@ -0,0 +1,306 @@
+/*
+ * null.c - Speech Dispatcher module which synthesizes a plain tone
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This module is for measuring the server, the speak queue and the audio
+ * output without the cost of a real synthesizer, see spd_benchmark in
+ * src/tests.  Each word is a tone of NullCharDuration ms per character,
+ * followed by the silence of one character, scaled by (100 - rate) / 100:
+ * at rate 100 messages produce no audio at all.  The audio is made no
+ * faster than NullRealTimeFactor (in hundredths) times its duration, 0
+ * making it as fast as the server takes it.  The marks of the text are
+ * reported where they are, and with NullWordMarks at every word too.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <poll.h>
+#include <time.h>
+
+#include <speechd_types.h>
+
+#include "module_utils.h"
+
+#define MODULE_NAME     "null"
+#define MODULE_VERSION  "0.1"
+
+#define DEBUG_MODULE 1
+DECLARE_DEBUG();
+
+/* Longest piece of audio made at once, in ms */
+#define NULL_PIECE_MS 50
+/* Frequency of the tone, in Hz */
+#define NULL_TONE 220
+
+MOD_OPTION_1_INT(NullSampleRate);
+MOD_OPTION_1_INT(NullCharDuration);
+MOD_OPTION_1_FLOAT(NullRealTimeFactor);
+MOD_OPTION_1_INT(NullWordMarks);
+
+static int null_stop;
+static int null_pause;
+static int null_rate;
+
+static short *null_buf;
+static unsigned null_buf_samples;
+static unsigned null_phase;
+
+static const char *const null_languages[] = {
+	"en", "cs", "de", "es", "fr", "it", "pl", "ru", NULL
+};
+
+int module_load(void)
+{
+	INIT_SETTINGS_TABLES();
+
+	REGISTER_DEBUG();
+
+	MOD_OPTION_1_INT_REG(NullSampleRate, 16000);
+	MOD_OPTION_1_INT_REG(NullCharDuration, 60);
+	MOD_OPTION_1_FLOAT_REG(NullRealTimeFactor, 0);
+	MOD_OPTION_1_INT_REG(NullWordMarks, 0);
+
+	return 0;
+}
+
+int module_init(char **status_info)
+{
+	DBG("Module init");
+
+	module_audio_set_server();
+
+	if (NullSampleRate < 1000)
+		NullSampleRate = 1000;
+	null_buf_samples = NullSampleRate * NULL_PIECE_MS / 1000;
+	null_buf = g_malloc(null_buf_samples * sizeof(*null_buf));
+
+	*status_info = g_strdup("Null module initialized successfully.");
+
+	return 0;
+}
+
+SPDVoice **module_list_voices(void)
+{
+	SPDVoice **ret;
+	int i, n = G_N_ELEMENTS(null_languages) - 1;
+
+	ret = g_malloc((n + 1) * sizeof(*ret));
+	for (i = 0; i < n; i++) {
+		ret[i] = g_malloc(sizeof(*(ret[i])));
+		ret[i]->name = g_strdup_printf("null-%s", null_languages[i]);
+		ret[i]->language = g_strdup(null_languages[i]);
+		ret[i]->variant = NULL;
+	}
+	ret[n] = NULL;
+
+	return ret;
+}
+
+static void null_set_rate(signed int rate)
+{
+	null_rate = rate;
+}
+
+static gint64 null_now(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * G_GINT64_CONSTANT(1000000) + now.tv_nsec / 1000;
+}
+
+/* Keep processing the server requests until the time at, to get stopped in
+ * between */
+static void null_wait_until(gint64 at)
+{
+	struct pollfd pfd = {.fd = STDIN_FILENO,.events = POLLIN };
+	gint64 left;
+
+	while (!null_stop && (left = at - null_now()) > 0)
+		if (poll(&pfd, 1, (left + 999) / 1000) > 0)
+			module_process(STDIN_FILENO, 0);
+}
+
+/* Send samples of the tone, or of silence */
+static void null_output(unsigned samples, gboolean tone)
+{
+	AudioTrack track = {
+		.bits = 16,
+		.num_channels = 1,
+		.sample_rate = NullSampleRate,
+		.samples = null_buf,
+	};
+	int period = NullSampleRate / NULL_TONE;
+	gint64 start = null_now();
+	unsigned done = 0, i;
+
+	while (done < samples && !null_stop) {
+		track.num_samples = MIN(samples - done, null_buf_samples);
+
+		/* A triangle wave, to avoid depending on libm */
+		for (i = 0; i < track.num_samples; i++) {
+			int pos = null_phase++ % period;
+
+			if (!tone)
+				null_buf[i] = 0;
+			else if (pos < period / 2)
+				null_buf[i] = pos * 16000 / period - 4000;
+			else
+				null_buf[i] = (period - pos) * 16000 / period - 4000;
+		}
+		done += track.num_samples;
+
+		if (NullRealTimeFactor > 0)
+			null_wait_until(start + (gint64) (done * NullRealTimeFactor
+							  * 1000000 /
+							  NullSampleRate));
+		if (null_stop)
+			break;
+		module_tts_output_server(&track, SPD_AUDIO_LE);
+	}
+}
+
+/* Speak a word of chars characters, and the pause after it */
+static void null_say_word(unsigned chars)
+{
+	unsigned char_samples = (gint64) NullSampleRate * NullCharDuration
+	    * (100 - null_rate) / 100 / 1000;
+
+	if (!char_samples)
+		return;
+	null_output(chars * char_samples, TRUE);
+	null_output(char_samples, FALSE);
+}
+
+/* Report the mark of the <mark name="..."/> tag at tag */
+static void null_report_mark(const char *tag, const char *tag_end)
+{
+	const char *name = strstr(tag, "name=");
+	const char *name_end;
+	char *mark;
+
+	if (!name || name > tag_end)
+		return;
+	name += 5;
+	if (*name != '"' && *name != '\'')
+		return;
+	name_end = memchr(name + 1, *name, tag_end - name - 1);
+	if (!name_end)
+		return;
+
+	mark = g_strndup(name + 1, name_end - name - 1);
+	module_report_index_mark(mark);
+	g_free(mark);
+}
+
+void module_speak_sync(const char *data, size_t bytes, SPDMessageType msgtype)
+{
+	const char *p = data;
+	unsigned word = 0;
+
+	null_stop = 0;
+	null_pause = 0;
+
+	module_speak_ok();
+
+	UPDATE_PARAMETER(rate, null_set_rate);
+
+	module_report_event_begin();
+
+	while (*p && !null_stop) {
+		unsigned chars = 0;
+
+		if (*p == '<' && msgtype == SPD_MSGTYPE_TEXT) {
+			const char *tag_end = strchr(p, '>');
+
+			if (!tag_end)
+				break;
+			if (!strncmp(p, "<mark", 5))
+				null_report_mark(p, tag_end);
+			p = tag_end + 1;
+			continue;
+		}
+		if (g_ascii_isspace(*p)) {
+			p++;
+			continue;
+		}
+
+		if (NullWordMarks) {
+			char mark[32];
+
+			snprintf(mark, sizeof(mark), "null_word_%u", word);
+			module_report_index_mark(mark);
+		}
+		word++;
+
+		while (*p && !g_ascii_isspace(*p)
+		       && !(*p == '<' && msgtype == SPD_MSGTYPE_TEXT)) {
+			const char *q = p + 1;
+
+			/* An entity or a multibyte character is one character */
+			if (*p == '&' && msgtype == SPD_MSGTYPE_TEXT) {
+				while (g_ascii_isalnum(*q) || *q == '#')
+					q++;
+				if (*q == ';')
+					p = q;
+			}
+			p = g_utf8_next_char(p);
+			chars++;
+		}
+		null_say_word(chars);
+	}
+
+	if (null_pause)
+		module_report_event_pause();
+	else if (null_stop)
+		module_report_event_stop();
+	else
+		module_report_event_end();
+}
+
+int module_stop(void)
+{
+	DBG("null: stop()\n");
+
+	null_stop = 1;
+
+	return 0;
+}
+
+size_t module_pause(void)
+{
+	DBG("null: pause()\n");
+
+	null_pause = 1;
+	null_stop = 1;
+
+	return 0;
+}
+
+int module_close(void)
+{
+	DBG("null: close()\n");
+
+	g_free(null_buf);
+	null_buf = NULL;
+
+	return 0;
+}
@@ -34,7 +34,9 @@
 #include <unistd.h>
 #include <string.h>
 #include <assert.h>
+#include <fcntl.h>
 #include <linux/limits.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #include "module_main.h"
@@ -66,6 +68,94 @@ char *openjtalk_msg_voice_str = NULL;
 char *openjtalk_msg_language = NULL;
 char *openjtalk_htsvoice_path = NULL;
 
+/* A file kept mapped read-only */
+typedef struct {
+	void *data;
+	size_t size;
+} OpenjtalkMap;
+
+/* The open_jtalk command loads the voice and the dictionary again for each
+ * message. Keeping them mapped here makes their pages stay in the page
+ * cache, which is shared by all the modules of all sessions and the
+ * commands they run, instead of being read from disk again. */
+static const char *openjtalk_dictionary_files[] = {
+	"sys.dic", "matrix.bin", "char.bin", "unk.dic", "left-id.def",
+	"right-id.def", "pos-id.def", "rewrite.def",
+};
+#define OPENJTALK_NUM_DICTIONARY_FILES \
+	(sizeof(openjtalk_dictionary_files) / sizeof(*openjtalk_dictionary_files))
+static OpenjtalkMap openjtalk_dictionary_maps[OPENJTALK_NUM_DICTIONARY_FILES];
+static OpenjtalkMap openjtalk_htsvoice_map;
+
+#ifndef MAP_POPULATE
+/* Touch a byte of each page */
+static void openjtalk_prefault(void *data, size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	volatile const char *p = data;
+	size_t off;
+
+	madvise(data, size, MADV_WILLNEED);
+	for (off = 0; off < size; off += page)
+		(void) p[off];
+}
+#endif
+
+static int openjtalk_map_file(const char *path, OpenjtalkMap *map)
+{
+	struct stat st;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, &st) == -1 || st.st_size == 0) {
+		close(fd);
+		return -1;
+	}
+	/* Get it read now rather than when open_jtalk needs it: MADV_WILLNEED
+	   only starts readahead, the pages have to be faulted in */
+#ifdef MAP_POPULATE
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED | MAP_POPULATE,
+		    fd, 0);
+#else
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+#endif
+	close(fd);
+	if (data == MAP_FAILED)
+		return -1;
+#ifndef MAP_POPULATE
+	openjtalk_prefault(data, st.st_size);
+#endif
+	map->data = data;
+	map->size = st.st_size;
+	return 0;
+}
+
+static void openjtalk_unmap_file(OpenjtalkMap *map)
+{
+	if (map->data == NULL)
+		return;
+	munmap(map->data, map->size);
+	map->data = NULL;
+	map->size = 0;
+}
+
+static void openjtalk_map_dictionary(void)
+{
+	char *path;
+	int i;
+
+	for (i = 0; i < OPENJTALK_NUM_DICTIONARY_FILES; i++) {
+		path = g_build_filename(OpenjtalkDictionaryDirectory,
+					openjtalk_dictionary_files[i], NULL);
+		if (openjtalk_map_file(path, &openjtalk_dictionary_maps[i]) == 0)
+			DBG("mapped %s", path);
+		g_free(path);
+	}
+}
+
 int module_init(char **msg)
 {
 	fprintf(stderr, "initializing\n");
@@ -78,6 +168,8 @@ int module_init(char **msg)
 		return -1;
 	}
 
+	openjtalk_map_dictionary();
+
 	*msg = strdup("ok!");
 
 	return 0;
@@ -122,6 +214,7 @@ static void update_htsvoice_path()
 		free(openjtalk_htsvoice_path);
 		openjtalk_htsvoice_path = NULL;
 	}
+	openjtalk_unmap_file(&openjtalk_htsvoice_map);
 
 	if (openjtalk_msg_voice_str == NULL) {
 		DBG("update_htsvoice_path: openjtalk_msg_voice_str is NULL");
@@ -137,6 +230,9 @@ static void update_htsvoice_path()
 		if (g_file_test(htsvoice_path->str, G_FILE_TEST_EXISTS)) {
 			openjtalk_htsvoice_path = htsvoice_path->str;
 			g_string_free(htsvoice_path, 0);
+			if (openjtalk_map_file(openjtalk_htsvoice_path,
+					       &openjtalk_htsvoice_map) == 0)
+				DBG("mapped %s", openjtalk_htsvoice_path);
 			return;
 		}
 		g_string_free(htsvoice_path, 1);
@@ -289,24 +385,24 @@ void module_speak_sync(const char *data, size_t bytes, SPDMessageType msgtype)
 	    track.bits, track.num_channels, track.sample_rate,
 	    track.num_samples);
 
-	fseek(audio_fp, WAV_START_SAMPLES, SEEK_SET);
-	track.samples =
-	    malloc(track.num_samples * track.num_channels * track.bits / 8);
-	ret =
-	    fread(track.samples, track.bits / 8,
-		  track.num_samples * track.num_channels, audio_fp);
-	if (ret != track.num_samples * track.num_channels) {
+	/* Send the samples right from the file */
+	OpenjtalkMap wav_map = { NULL, 0 };
+	size_t samples_size =
+	    (size_t) track.num_samples * track.num_channels * track.bits / 8;
+	if (openjtalk_map_file(template, &wav_map) == -1
+	    || wav_map.size < WAV_START_SAMPLES + samples_size) {
 		DBG("failed to read track.samples");
-		free(track.samples);
+		openjtalk_unmap_file(&wav_map);
 		goto FP_FINISH;
 	}
+	track.samples = (short *) ((char *) wav_map.data + WAV_START_SAMPLES);
 	DBG("read track.samples");
 
 	module_tts_output_server(&track, format);
 
 	DBG("output finished");
 
-	free(track.samples);
+	openjtalk_unmap_file(&wav_map);
 
 FP_FINISH:
 	fclose(audio_fp);
@@ -339,7 +435,13 @@ int module_stop(void)
 
 int module_close(void)
 {
+	int i;
+
 	DBG("closing");
 
+	for (i = 0; i < OPENJTALK_NUM_DICTIONARY_FILES; i++)
+		openjtalk_unmap_file(&openjtalk_dictionary_maps[i]);
+	openjtalk_unmap_file(&openjtalk_htsvoice_map);
+
 	return 0;
 }
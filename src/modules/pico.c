@@ -62,7 +62,6 @@ static pico_System picoSystem;
 static pico_Resource picoTaResource;
 static pico_Resource picoSgResource;
 static pico_Engine picoEngine;
-static pico_Char *picoInp;
 
 static const char *PICO_LINGWARE_PATH = "/usr/share/pico/lang/";
 static const int PICO_SAMPLE_RATE = 16000;
@@ -103,11 +102,23 @@ static const SPDVoice *pico_voices_list[] = {
 	NULL
 };
 
+#define PICO_NUM_VOICES (sizeof(pico_voices) / sizeof(SPDVoice))
+
+/* Engines are kept for the voices used recently, so that switching back
+ * to one is cheap, last_use orders them */
+static pico_Engine pico_engines[PICO_NUM_VOICES];
+static unsigned pico_engine_last_use[PICO_NUM_VOICES];
+static unsigned pico_engine_clock;
+
 enum states { STATE_IDLE, STATE_PLAY, STATE_PAUSE, STATE_STOP, STATE_CLOSE };
 static enum states pico_state;
 
 /* Module configuration options */
 MOD_OPTION_1_STR(PicoLingwarePath)
+MOD_OPTION_1_INT(PicoMaxChunkLength)
+MOD_OPTION_1_STR(PicoDelimiters)
+MOD_OPTION_1_INT(PicoMaxEngines)
+MOD_OPTION_1_STR(PicoPreloadVoices)
 
 static int pico_set_rate(signed int value)
 {
@@ -152,7 +163,7 @@ static int pico_set_pitch(signed int value)
 	return pitch;
 }
 
-static int pico_process_tts(void)
+static int pico_process_tts(const char *text)
 {
 	pico_Int16 bytes_sent, bytes_recv, text_remaining, out_data_type;
 	pico_Int16 bytes_stored;
@@ -165,16 +176,17 @@ static int pico_process_tts(void)
 #else
 	AudioFormat format = SPD_AUDIO_LE;
 #endif
-	pico_Char *buf = picoInp;
+	const pico_Char *buf = (const pico_Char *)text;
 
-	text_remaining = strlen((const char *)buf) + 1;
+	/* The final NUL makes the engine flush this sentence */
+	text_remaining = strlen(text) + 1;
 
-	DBG(MODULE_NAME ": Text: %s\n", picoInp);
+	DBG(MODULE_NAME ": Text: %s\n", text);
 
 	/* synthesis loop   */
 	while (text_remaining) {
 		/* Process server events in case we were told to stop in between */
-		module_process(STDIN_FILENO, 0);
+		module_process(module_in, 0);
 
 		/* Feed the text into the engine.   */
 		if ((ret = pico_putTextUtf8(picoEngine, buf, text_remaining,
@@ -232,8 +244,6 @@ static int pico_process_tts(void)
 		} while (PICO_STEP_BUSY == getstatus);
 	}
 
-	g_free(picoInp);
-	picoInp = NULL;
 	return 0;
 }
 
@@ -244,6 +254,10 @@ int module_load(void)
 
 	MOD_OPTION_1_INT_REG(Debug, 0);
 	MOD_OPTION_1_STR_REG(PicoLingwarePath, PICO_LINGWARE_PATH);
+	MOD_OPTION_1_INT_REG(PicoMaxChunkLength, 300);
+	MOD_OPTION_1_STR_REG(PicoDelimiters, ".?!;:");
+	MOD_OPTION_1_INT_REG(PicoMaxEngines, 3);
+	MOD_OPTION_1_STR_REG(PicoPreloadVoices, "");
 
 	return 0;
 }
@@ -345,11 +359,89 @@ int pico_init_voice(int voice_index)
 	return 0;
 }
 
+static int pico_find_voice(const char *name)
+{
+	int i;
+
+	for (i = 0; i < PICO_NUM_VOICES; i++)
+		if (!strcmp(pico_voices[i].name, name))
+			return i;
+	return -1;
+}
+
+static void pico_dispose_engine(int index)
+{
+	int ret;
+	pico_Retstring outMessage;
+
+	if ((ret = pico_disposeEngine(picoSystem, &pico_engines[index]))) {
+		pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+		DBG(MODULE_NAME
+		    ": Cannot dispose pico engine (%i): %s\n", ret, outMessage);
+	}
+	pico_engines[index] = NULL;
+}
+
+/* Dispose the least recently used engine but the one of index */
+static int pico_dispose_lru_engine(int index)
+{
+	int i, lru = -1;
+
+	for (i = 0; i < PICO_NUM_VOICES; i++) {
+		if (i == index || pico_engines[i] == NULL)
+			continue;
+		if (lru < 0 || pico_engine_last_use[i] < pico_engine_last_use[lru])
+			lru = i;
+	}
+	if (lru < 0)
+		return -1;
+
+	DBG(MODULE_NAME ": dropping the engine of %s", pico_voices[lru].name);
+	if (pico_engines[lru] == picoEngine)
+		picoEngine = NULL;
+	pico_dispose_engine(lru);
+	return 0;
+}
+
+/* Return the engine of the voice, creating it if needed, at the expense of
+ * the least recently used ones when there are too many or memory lacks */
+static pico_Engine pico_get_engine(int index)
+{
+	int ret, i, num = 0;
+	pico_Retstring outMessage;
+
+	pico_engine_last_use[index] = ++pico_engine_clock;
+	if (pico_engines[index] != NULL)
+		return pico_engines[index];
+
+	for (i = 0; i < PICO_NUM_VOICES; i++)
+		if (pico_engines[i] != NULL)
+			num++;
+	for (; num >= MAX(PicoMaxEngines, 1); num--)
+		pico_dispose_lru_engine(index);
+
+	while ((ret = pico_newEngine(picoSystem, (const pico_Char *)
+				     pico_voices[index].name,
+				     &pico_engines[index]))) {
+		pico_engines[index] = NULL;
+		if (pico_dispose_lru_engine(index) == 0)
+			continue;
+		pico_getSystemStatusMessage(picoSystem, ret, outMessage);
+		DBG(MODULE_NAME
+		    ": Cannot create a new pico engine (%i): %s\n", ret,
+		    outMessage);
+		return NULL;
+	}
+
+	return pico_engines[index];
+}
+
 int module_init(char **status_info)
 {
-	int ret, i;
+	int ret, i, index;
 	pico_Retstring outMessage;
 	void *pmem;
+	char **voices;
 
 	module_audio_set_server();
 
@@ -374,14 +466,27 @@ int module_init(char **status_info)
 		}
 	}
 
-	/* Create a new Pico engine, english default */
-	if ((ret = pico_newEngine(picoSystem,
-				  (const pico_Char *)pico_voices[0].name,
-				  &picoEngine))) {
-		pico_getSystemStatusMessage(picoSystem, ret, outMessage);
-		*status_info = g_strdup_printf(MODULE_NAME
-					       ": Cannot create a new pico engine (%i): %s\n",
-					       ret, outMessage);
+	/* Create the engines of the voices we will probably need */
+	if (PicoPreloadVoices != NULL) {
+		voices = g_strsplit(PicoPreloadVoices, " ", 0);
+		for (i = 0; voices[i] != NULL; i++) {
+			index = pico_find_voice(voices[i]);
+			if (index < 0) {
+				if (voices[i][0] != '\0')
+					DBG(MODULE_NAME ": Unknown voice %s",
+					    voices[i]);
+				continue;
+			}
+			pico_get_engine(index);
+		}
+		g_strfreev(voices);
+	}
+
+	/* english default */
+	picoEngine = pico_get_engine(0);
+	if (picoEngine == NULL) {
+		*status_info = g_strdup(MODULE_NAME
+					": Cannot create a new pico engine\n");
 		return -1;
 	}
 
@@ -398,27 +503,21 @@ SPDVoice **module_list_voices(void)
 
 int pico_set_synthesis_voice(char *voice_name)
 {
-	int ret;
-	pico_Retstring outMessage;
+	pico_Engine engine;
+	int index;
 
 	DBG(MODULE_NAME ": setting voice %s", voice_name);
 
-	if (picoEngine && (ret = pico_disposeEngine(picoSystem, &picoEngine))) {
-		pico_getSystemStatusMessage(picoSystem, ret, outMessage);
-		DBG(MODULE_NAME
-		    ": Cannot dispose pico engine (%i): %s\n", ret, outMessage);
+	index = pico_find_voice(voice_name);
+	if (index < 0) {
+		DBG(MODULE_NAME ": Unknown voice %s", voice_name);
 		return 0;
 	}
 
-	/* Create a new Pico engine */
-	if ((ret = pico_newEngine(picoSystem, (const pico_Char *)voice_name,
-				  &picoEngine))) {
-		pico_getSystemStatusMessage(picoSystem, ret, outMessage);
-		DBG(MODULE_NAME
-		    ": Cannot create a new pico engine (%i): %s\n", ret,
-		    outMessage);
+	engine = pico_get_engine(index);
+	if (engine == NULL)
 		return 0;
-	}
+	picoEngine = engine;
 
 	return 1;
 }
@@ -457,8 +556,10 @@ void pico_set_synthesis_voice_fallback(char *voice_name)
 
 void module_speak_sync(const char *data, size_t bytes, SPDMessageType msgtype)
 {
-	int value;
-	static pico_Char *tmp;
+	int value, ret;
+	ModuleSentence *sentences, *s;
+	GString *head, *tail;
+	char *text, *tag;
 
 	if (pico_state != STATE_IDLE) {
 		DBG(MODULE_NAME
@@ -475,31 +576,41 @@ void module_speak_sync(const char *data, size_t bytes, SPDMessageType msgtype)
 	UPDATE_STRING_PARAMETER(voice.name, pico_set_synthesis_voice_fallback);
 	/*      UPDATE_PARAMETER(voice_type, pico_set_voice); */
 
-	picoInp = (pico_Char *) module_strip_ssml(data);
+	if (picoEngine == NULL) {
+		DBG(MODULE_NAME ": no engine for this voice");
+		module_speak_error();
+		return;
+	}
+
+	sentences = module_split_sentences(data, MAX(PicoMaxChunkLength, 2),
+					   PicoDelimiters);
+
+	/* Every sentence gets the prosody tags */
+	head = g_string_new("");
+	tail = g_string_new("");
 
 	value = pico_set_rate(msg_settings.rate);
 	if (PICO_VOICE_SPEED_DEFAULT != value) {
-		tmp = picoInp;
-		picoInp = (pico_Char *)
-		    g_strdup_printf("<speed level='%d'>%s</speed>", value, tmp);
-		g_free(tmp);
+		tag = g_strdup_printf("<speed level='%d'>", value);
+		g_string_prepend(head, tag);
+		g_string_append(tail, "</speed>");
+		g_free(tag);
 	}
 
 	value = pico_set_volume(msg_settings.volume);
 	if (PICO_VOICE_VOLUME_DEFAULT != value) {
-		tmp = picoInp;
-		picoInp = (pico_Char *)
-		    g_strdup_printf("<volume level='%d'>%s</volume>", value,
-				    tmp);
-		g_free(tmp);
+		tag = g_strdup_printf("<volume level='%d'>", value);
+		g_string_prepend(head, tag);
+		g_string_append(tail, "</volume>");
+		g_free(tag);
 	}
 
 	value = pico_set_pitch(msg_settings.pitch);
 	if (PICO_VOICE_PITCH_DEFAULT != value) {
-		tmp = picoInp;
-		picoInp = (pico_Char *)
-		    g_strdup_printf("<pitch level='%d'>%s</pitch>", value, tmp);
-		g_free(tmp);
+		tag = g_strdup_printf("<pitch level='%d'>", value);
+		g_string_prepend(head, tag);
+		g_string_append(tail, "</pitch>");
+		g_free(tag);
 	}
 
 	/* TODO: use a generic engine for SPELL, CHAR, KEY */
@@ -521,11 +632,32 @@ void module_speak_sync(const char *data, size_t bytes, SPDMessageType msgtype)
 	DBG(MODULE_NAME ": Sending to TTS engine");
 	module_report_event_begin();
 
-	if (0 != pico_process_tts()) {
-		DBG(MODULE_NAME ": ERROR in TTS");
+	/* Synthesize sentence by sentence, so that the first one can be
+	 * played while the next ones are synthesized */
+	for (s = sentences; s->text != NULL && pico_state == STATE_PLAY; s++) {
+		if (s->text[0] != '\0') {
+			text = g_strconcat(head->str, s->text, tail->str,
+					   NULL);
+			ret = pico_process_tts(text);
+			g_free(text);
+			if (ret != 0) {
+				DBG(MODULE_NAME ": ERROR in TTS");
+				break;
+			}
+		}
+		if (s->mark != NULL && pico_state == STATE_PLAY)
+			module_report_index_mark(s->mark);
 	}
-
-	module_report_event_end();
+	module_free_sentences(sentences);
+	g_string_free(head, TRUE);
+	g_string_free(tail, TRUE);
+
+	if (pico_state == STATE_PAUSE)
+		module_report_event_pause();
+	else if (pico_state == STATE_STOP)
+		module_report_event_stop();
+	else
+		module_report_event_end();
 
 	pico_state = STATE_IDLE;
 }
@@ -0,0 +1,555 @@
+/*
+ * piper.c - Speech Dispatcher module for Piper neural voices
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Neural voices are costly to load and to run, so unlike with the generic
+ * module, a piper process is kept running with the model of the current
+ * voice loaded, and gets the text one piece per line.  It writes the audio
+ * of each piece to a WAV file in our temporary directory, whose path it
+ * prints.
+ *
+ * The message is split into sentences, the first one being cut further at
+ * PiperFirstDelimiters to get the first audio out quickly.  Up to
+ * PiperLookAhead pieces are given to piper in advance, so that it
+ * synthesizes the next ones while the audio of the current one is sent to
+ * the server, and never waits for us.  When the message is stopped, what
+ * piper still synthesizes for it is dropped as it comes, rather than
+ * reloading the model.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include <speechd_types.h>
+
+#include "module_main.h"
+#include "module_utils.h"
+
+#define MODULE_NAME     "piper"
+#define MODULE_VERSION  "0.1"
+
+#define DEBUG_MODULE 1
+DECLARE_DEBUG();
+
+MOD_OPTION_1_STR(PiperExecutable);
+MOD_OPTION_1_STR(PiperModelDir);
+MOD_OPTION_1_STR(PiperExtraArguments);
+MOD_OPTION_1_INT(PiperMaxChunkLength);
+MOD_OPTION_1_STR(PiperDelimiters);
+MOD_OPTION_1_INT(PiperFirstChunkLength);
+MOD_OPTION_1_STR(PiperFirstDelimiters);
+MOD_OPTION_1_INT(PiperLookAhead);
+
+enum states { STATE_IDLE, STATE_PLAY, STATE_PAUSE, STATE_STOP };
+static enum states piper_state;
+
+/* The running piper, and what it was started with */
+static GPid piper_pid;
+static int piper_in = -1;
+static int piper_out = -1;
+static char *piper_model;
+static char *piper_length_scale;
+static char *piper_dir;
+
+/* What piper printed after the last complete line */
+static GString *piper_output;
+/* Text lines given to piper for stopped messages, whose audio is yet to be
+ * dropped */
+static unsigned piper_stale;
+
+/* A line of text for piper, and the index mark to report once its audio was
+ * sent */
+typedef struct {
+	char *text;
+	const char *mark;
+} PiperPiece;
+
+int module_load(void)
+{
+	INIT_SETTINGS_TABLES();
+
+	REGISTER_DEBUG();
+
+	MOD_OPTION_1_STR_REG(PiperExecutable, "piper");
+	MOD_OPTION_1_STR_REG(PiperModelDir, "/usr/share/piper-voices");
+	MOD_OPTION_1_STR_REG(PiperExtraArguments, "");
+	MOD_OPTION_1_INT_REG(PiperMaxChunkLength, 300);
+	MOD_OPTION_1_STR_REG(PiperDelimiters, ".?!;:");
+	MOD_OPTION_1_INT_REG(PiperFirstChunkLength, 60);
+	MOD_OPTION_1_STR_REG(PiperFirstDelimiters, ",;:");
+	MOD_OPTION_1_INT_REG(PiperLookAhead, 2);
+
+	module_register_settings_voices();
+
+	return 0;
+}
+
+int module_init(char **status_info)
+{
+	char *path;
+
+	DBG("Module init");
+
+	module_audio_set_server();
+
+	if (module_list_registered_voices() == NULL) {
+		*status_info = g_strdup("The module does not have any voice "
+					"configured, please add them with "
+					"AddVoice in the configuration file");
+		return -1;
+	}
+
+	path = g_find_program_in_path(PiperExecutable);
+	if (path == NULL) {
+		*status_info = g_strdup_printf("Can't find %s", PiperExecutable);
+		return -1;
+	}
+	g_free(path);
+
+	piper_dir = g_dir_make_tmp("speechd-piper-XXXXXX", NULL);
+	if (piper_dir == NULL) {
+		*status_info = g_strdup("Can't create a temporary directory");
+		return -1;
+	}
+	piper_output = g_string_new("");
+
+	*status_info = g_strdup("Piper module initialized successfully.");
+
+	return 0;
+}
+
+SPDVoice **module_list_voices(void)
+{
+	return module_list_registered_voices();
+}
+
+static void piper_stop_process(void)
+{
+	if (piper_pid == 0)
+		return;
+
+	DBG("Stopping piper for %s", piper_model);
+	close(piper_in);
+	close(piper_out);
+	piper_in = piper_out = -1;
+	kill(piper_pid, SIGTERM);
+	waitpid(piper_pid, NULL, 0);
+	g_spawn_close_pid(piper_pid);
+	piper_pid = 0;
+	piper_stale = 0;
+	g_string_truncate(piper_output, 0);
+}
+
+/* Start piper with the model and length scale, unless it already runs
+ * with them, since loading the model is what takes time */
+static int piper_start_process(const char *model, const char *length_scale)
+{
+	GPtrArray *argv;
+	char **extra = NULL;
+	GError *error = NULL;
+	int i, ret;
+
+	if (piper_pid && !strcmp(model, piper_model)
+	    && !strcmp(length_scale, piper_length_scale))
+		return 0;
+	piper_stop_process();
+
+	if (PiperExtraArguments[0]
+	    && !g_shell_parse_argv(PiperExtraArguments, NULL, &extra, &error)) {
+		DBG("Bad PiperExtraArguments: %s", error->message);
+		g_clear_error(&error);
+	}
+
+	argv = g_ptr_array_new();
+	g_ptr_array_add(argv, PiperExecutable);
+	g_ptr_array_add(argv, "--model");
+	g_ptr_array_add(argv, (char *)model);
+	g_ptr_array_add(argv, "--output_dir");
+	g_ptr_array_add(argv, piper_dir);
+	g_ptr_array_add(argv, "--length_scale");
+	g_ptr_array_add(argv, (char *)length_scale);
+	for (i = 0; extra && extra[i]; i++)
+		g_ptr_array_add(argv, extra[i]);
+	g_ptr_array_add(argv, NULL);
+
+	DBG("Starting %s for %s", PiperExecutable, model);
+	ret = g_spawn_async_with_pipes(NULL, (char **)argv->pdata, NULL,
+				       G_SPAWN_SEARCH_PATH
+				       | G_SPAWN_DO_NOT_REAP_CHILD,
+				       NULL, NULL, &piper_pid, &piper_in,
+				       &piper_out, NULL, &error);
+	g_ptr_array_free(argv, TRUE);
+	g_strfreev(extra);
+	if (!ret) {
+		DBG("Can't start %s: %s", PiperExecutable, error->message);
+		g_clear_error(&error);
+		piper_pid = 0;
+		return -1;
+	}
+
+	g_free(piper_model);
+	piper_model = g_strdup(model);
+	g_free(piper_length_scale);
+	piper_length_scale = g_strdup(length_scale);
+
+	return 0;
+}
+
+/* The model file of the voice of the message */
+static char *piper_choose_model(void)
+{
+	const char *voice = NULL;
+	const char *language = msg_settings.voice.language;
+
+	if (msg_settings.voice.name
+	    && module_existsvoice(msg_settings.voice.name))
+		voice = msg_settings.voice.name;
+	if (voice == NULL && language) {
+		voice = module_getvoice(language, msg_settings.voice_type);
+		if (voice == NULL && strchr(language, '-')) {
+			char *lang = g_strndup(language,
+					       strchr(language, '-') - language);
+
+			voice = module_getvoice(lang, msg_settings.voice_type);
+			g_free(lang);
+		}
+	}
+	if (voice == NULL)
+		voice = module_getdefaultvoice();
+	if (voice == NULL) {
+		SPDVoice **voices = module_list_registered_voices();
+
+		voice = voices[0]->name;
+	}
+
+	if (g_path_is_absolute(voice))
+		return g_strdup(voice);
+	return g_strdup_printf("%s/%s.onnx", PiperModelDir, voice);
+}
+
+/* Piper takes the duration of the phonemes, 2 is half the speed */
+static char *piper_choose_length_scale(void)
+{
+	double scale;
+
+	if (msg_settings.rate < 0)
+		scale = 1 - msg_settings.rate / 100.;
+	else
+		scale = 1 / (1 + msg_settings.rate / 100.);
+
+	return g_strdup_printf("%.2f", scale);
+}
+
+/* Cut the beginning of a long first sentence at a delimiter, or at least
+ * at a space, so that it gets synthesized and played quickly */
+static void piper_add_first(GArray *pieces, const char *text, const char *mark)
+{
+	size_t len = strlen(text), max = PiperFirstChunkLength;
+	const char *cut = NULL, *p;
+	PiperPiece piece;
+
+	if (max > 0 && len > max * 3 / 2) {
+		for (p = text + max; p > text && !cut; p--)
+			if (strchr(PiperFirstDelimiters, *p) && g_ascii_isspace(p[1]))
+				cut = p + 1;
+		for (p = text + max; p > text && !cut; p--)
+			if (g_ascii_isspace(*p))
+				cut = p;
+	}
+
+	if (cut) {
+		piece.text = g_strndup(text, cut - text);
+		piece.mark = NULL;
+		g_array_append_val(pieces, piece);
+		text = cut;
+	}
+	piece.text = g_strdup(text);
+	piece.mark = mark;
+	g_array_append_val(pieces, piece);
+}
+
+/* Read the samples of a WAV file, which piper writes as 16 bit PCM */
+static int piper_send_wav(const char *path)
+{
+	AudioTrack track = { 0 };
+	char *data, *p, *end;
+	gsize size;
+	int ret = -1;
+
+	if (!g_file_get_contents(path, &data, &size, NULL)) {
+		DBG("Can't read %s", path);
+		return -1;
+	}
+
+	end = data + size;
+	if (size < 12 || memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4))
+		goto out;
+
+	for (p = data + 12; p + 8 <= end;) {
+		guint32 len = GUINT32_FROM_LE(*(guint32 *) (p + 4));
+
+		if (len > end - p - 8)
+			len = end - p - 8;
+		if (!memcmp(p, "fmt ", 4) && len >= 16) {
+			track.num_channels = GUINT16_FROM_LE(*(guint16 *) (p + 10));
+			track.sample_rate = GUINT32_FROM_LE(*(guint32 *) (p + 12));
+			track.bits = GUINT16_FROM_LE(*(guint16 *) (p + 22));
+		} else if (!memcmp(p, "data", 4) && track.bits == 16
+			   && track.num_channels > 0) {
+			track.samples = (short *)(p + 8);
+			track.num_samples = len / 2 / track.num_channels;
+			module_tts_output_server(&track, SPD_AUDIO_LE);
+			ret = 0;
+			break;
+		}
+		p += 8 + len + (len & 1);
+	}
+
+out:
+	if (ret)
+		DBG("Bad WAV file %s", path);
+	g_free(data);
+	return ret;
+}
+
+/* Wait for what piper prints next, processing the server requests
+ * meanwhile since they may stop us.  Returns the path of a WAV file to be
+ * freed, or NULL when stopped or when piper went away. */
+static char *piper_next_result(void)
+{
+	struct pollfd fds[2] = {
+		{.fd = piper_out,.events = POLLIN },
+		{.fd = module_in,.events = POLLIN },
+	};
+	char buf[1024], *nl, *line;
+	ssize_t len;
+
+	while (1) {
+		nl = strchr(piper_output->str, '\n');
+		if (nl) {
+			line = g_strndup(piper_output->str,
+					 nl - piper_output->str);
+			g_string_erase(piper_output, 0,
+				       nl + 1 - piper_output->str);
+			g_strstrip(line);
+			if (line[0])
+				return line;
+			g_free(line);
+			continue;
+		}
+
+		if (piper_state != STATE_PLAY)
+			return NULL;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			return NULL;
+		}
+		if (fds[1].revents) {
+			module_process(module_in, 0);
+			continue;
+		}
+		len = read(piper_out, buf, sizeof(buf));
+		if (len < 0 && errno == EINTR)
+			continue;
+		if (len <= 0) {
+			DBG("piper went away");
+			piper_stop_process();
+			return NULL;
+		}
+		g_string_append_len(piper_output, buf, len);
+	}
+}
+
+static int piper_write_piece(const PiperPiece *piece)
+{
+	char *line = g_strdup_printf("%s\n", piece->text);
+	size_t len = strlen(line), done = 0;
+	char *c;
+	ssize_t ret;
+
+	/* One line per piece */
+	for (c = line; c < line + len - 1; c++)
+		if (*c == '\n' || *c == '\r')
+			*c = ' ';
+
+	while (done < len) {
+		ret = write(piper_in, line + done, len - done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0) {
+			DBG("Can't write to piper: %s", strerror(errno));
+			g_free(line);
+			return -1;
+		}
+		done += ret;
+	}
+	g_free(line);
+	return 0;
+}
+
+void module_speak_sync(const char *data, size_t bytes, SPDMessageType msgtype)
+{
+	ModuleSentence *sentences = NULL, *s;
+	GArray *pieces;
+	PiperPiece *piece;
+	char *model, *length_scale, *path;
+	unsigned sent = 0, done = 0, i;
+	int ret;
+
+	if (piper_state != STATE_IDLE) {
+		DBG("module still speaking state = %d", piper_state);
+		module_speak_error();
+		return;
+	}
+
+	model = piper_choose_model();
+	length_scale = piper_choose_length_scale();
+	ret = piper_start_process(model, length_scale);
+	g_free(model);
+	g_free(length_scale);
+	if (ret != 0) {
+		module_speak_error();
+		return;
+	}
+
+	pieces = g_array_new(FALSE, FALSE, sizeof(PiperPiece));
+	if (msgtype == SPD_MSGTYPE_TEXT) {
+		sentences = module_split_sentences(data,
+						   MAX(PiperMaxChunkLength, 2),
+						   PiperDelimiters);
+		for (s = sentences; s->text != NULL; s++)
+			if (pieces->len == 0 && s->text[0])
+				piper_add_first(pieces, s->text, s->mark);
+			else {
+				PiperPiece p = { g_strdup(s->text), s->mark };
+
+				g_array_append_val(pieces, p);
+			}
+	} else {
+		PiperPiece p = { g_strdup(data), NULL };
+
+		if (msgtype == SPD_MSGTYPE_KEY)
+			g_strdelimit(p.text, "_", ' ');
+		g_array_append_val(pieces, p);
+	}
+
+	piper_state = STATE_PLAY;
+	module_speak_ok();
+	module_report_event_begin();
+
+	while (done < pieces->len && piper_state == STATE_PLAY) {
+		/* Keep piper busy with the next pieces */
+		while (sent < pieces->len
+		       && sent - done < MAX(PiperLookAhead, 0) + 1) {
+			piece = &g_array_index(pieces, PiperPiece, sent);
+			if (piece->text[0] && piper_write_piece(piece) != 0)
+				break;
+			sent++;
+		}
+
+		piece = &g_array_index(pieces, PiperPiece, done);
+		if (piece->text[0]) {
+			if (done == sent)
+				/* Could not give it to piper */
+				break;
+			path = piper_next_result();
+			if (path == NULL)
+				break;
+			if (piper_stale) {
+				/* Still for a stopped message */
+				piper_stale--;
+				g_unlink(path);
+				g_free(path);
+				continue;
+			}
+			piper_send_wav(path);
+			g_unlink(path);
+			g_free(path);
+		}
+		if (piece->mark && piper_state == STATE_PLAY)
+			module_report_index_mark(piece->mark);
+		done++;
+	}
+
+	/* The pieces given to piper but not played */
+	if (piper_pid)
+		for (i = done; i < sent; i++)
+			if (g_array_index(pieces, PiperPiece, i).text[0])
+				piper_stale++;
+
+	for (i = 0; i < pieces->len; i++)
+		g_free(g_array_index(pieces, PiperPiece, i).text);
+	g_array_free(pieces, TRUE);
+	if (sentences)
+		module_free_sentences(sentences);
+
+	if (piper_state == STATE_PAUSE)
+		module_report_event_pause();
+	else if (piper_state == STATE_STOP)
+		module_report_event_stop();
+	else
+		module_report_event_end();
+
+	piper_state = STATE_IDLE;
+}
+
+int module_stop(void)
+{
+	DBG("stop()");
+
+	if (piper_state == STATE_PLAY)
+		piper_state = STATE_STOP;
+
+	return 0;
+}
+
+size_t module_pause(void)
+{
+	DBG("pause()");
+
+	if (piper_state == STATE_PLAY)
+		piper_state = STATE_PAUSE;
+
+	return 0;
+}
+
+int module_close(void)
+{
+	DBG("close()");
+
+	piper_stop_process();
+	if (piper_dir) {
+		g_rmdir(piper_dir);
+		g_free(piper_dir);
+		piper_dir = NULL;
+	}
+
+	return 0;
+}
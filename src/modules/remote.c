@@ -0,0 +1,359 @@
+/*
+ * remote.c - Speech Dispatcher module running a module on another machine
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is not a module by itself: it connects to spd-module-host on
+ * RemoteHost, which starts RemoteModule there for us, and then passes what
+ * the server and the module send each other through the connection as it
+ * is.  The server thus talks to the remote module like to a local one,
+ * except that it can not share memory with it, so the audio comes as 705
+ * events on the connection, with binary framing as negotiated end to end.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <glib.h>
+#include <dotconf.h>
+
+#include "module_host.h"
+
+static char *remote_host;
+static char *remote_module;
+static char *remote_secret_file;
+static int remote_port = SPD_MODULE_HOST_PORT;
+
+static DOTCONF_CB(RemoteHost_cb)
+{
+	g_free(remote_host);
+	remote_host = g_strdup(cmd->data.str);
+	return NULL;
+}
+
+static DOTCONF_CB(RemotePort_cb)
+{
+	remote_port = cmd->data.value;
+	return NULL;
+}
+
+static DOTCONF_CB(RemoteModule_cb)
+{
+	g_free(remote_module);
+	remote_module = g_strdup(cmd->data.str);
+	return NULL;
+}
+
+static DOTCONF_CB(RemoteSecretFile_cb)
+{
+	g_free(remote_secret_file);
+	remote_secret_file = g_strdup(cmd->data.str);
+	return NULL;
+}
+
+static FUNC_ERRORHANDLER(ignore_errors)
+{
+	return 0;
+}
+
+static int remote_config(const char *configfilename)
+{
+	static const configoption_t options[] = {
+		{
+			.name = "RemoteHost",
+			.type = ARG_STR,
+			.callback = RemoteHost_cb,
+			.info = NULL,
+			.context = 0,
+		},
+		{
+			.name = "RemotePort",
+			.type = ARG_INT,
+			.callback = RemotePort_cb,
+			.info = NULL,
+			.context = 0,
+		},
+		{
+			.name = "RemoteModule",
+			.type = ARG_STR,
+			.callback = RemoteModule_cb,
+			.info = NULL,
+			.context = 0,
+		},
+		{
+			.name = "RemoteSecretFile",
+			.type = ARG_STR,
+			.callback = RemoteSecretFile_cb,
+			.info = NULL,
+			.context = 0,
+		},
+		{
+			.name = "",
+			.type = 0,
+			.callback = NULL,
+			.info = NULL,
+			.context = 0,
+		}
+	};
+	configfile_t *configfile;
+
+	configfile = dotconf_create((char *)configfilename, options, NULL,
+				    CASE_INSENSITIVE);
+	if (!configfile)
+		return -1;
+	/* Leave the options of the remote module alone */
+	configfile->errorhandler = (dotconf_errorhandler_t) ignore_errors;
+	if (dotconf_command_loop(configfile) == 0) {
+		dotconf_cleanup(configfile);
+		return -1;
+	}
+	dotconf_cleanup(configfile);
+
+	return 0;
+}
+
+/* Answer the INIT of the server with a failure; it only reads it once it
+ * sent INIT, the pipe keeps it meanwhile */
+static int remote_fail(const char *format, ...)
+{
+	va_list ap;
+
+	va_start(ap, format);
+	printf("399-");
+	vprintf(format, ap);
+	printf("\n399 ERR CANT INIT MODULE\n");
+	va_end(ap);
+
+	va_start(ap, format);
+	vfprintf(stderr, format, ap);
+	fprintf(stderr, "\n");
+	va_end(ap);
+
+	fflush(stdout);
+	return 1;
+}
+
+static int remote_connect(void)
+{
+	struct addrinfo hints = {
+		.ai_family = AF_UNSPEC,
+		.ai_socktype = SOCK_STREAM,
+	};
+	struct addrinfo *addrs, *addr;
+	char port[16];
+	int sock = -1, one = 1, ret;
+
+	snprintf(port, sizeof(port), "%d", remote_port);
+	ret = getaddrinfo(remote_host, port, &hints, &addrs);
+	if (ret != 0) {
+		errno = 0;
+		fprintf(stderr, "Can't resolve %s: %s\n", remote_host,
+			gai_strerror(ret));
+		return -1;
+	}
+
+	for (addr = addrs; addr; addr = addr->ai_next) {
+		sock = socket(addr->ai_family, addr->ai_socktype,
+			      addr->ai_protocol);
+		if (sock < 0)
+			continue;
+		if (connect(sock, addr->ai_addr, addr->ai_addrlen) == 0)
+			break;
+		close(sock);
+		sock = -1;
+	}
+	freeaddrinfo(addrs);
+	if (sock < 0)
+		return -1;
+
+	/* Commands and events are small and each one is waited for */
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, &one, sizeof(one));
+
+	return sock;
+}
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = write(fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* Read a line of the host byte by byte, what follows is for the server */
+static char *remote_read_line(int sock)
+{
+	char line[SPD_MODULE_HOST_REQUEST_MAX];
+	size_t len = 0;
+	ssize_t ret;
+
+	while (len < sizeof(line) - 1) {
+		ret = read(sock, line + len, 1);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return NULL;
+		if (line[len] == '\n') {
+			line[len] = '\0';
+			return g_strdup(line);
+		}
+		len++;
+	}
+	errno = 0;
+	return NULL;
+}
+
+/* Answer the challenge of the host with the secret */
+static int remote_authenticate(int sock, const char *secret)
+{
+	char *challenge, *answer, *line;
+	int ret;
+
+	challenge = remote_read_line(sock);
+	if (!challenge || !g_str_has_prefix(challenge, SPD_MODULE_HOST_CHALLENGE)) {
+		g_free(challenge);
+		errno = EPROTO;
+		return -1;
+	}
+
+	answer = spd_module_host_answer(secret, challenge
+					+ strlen(SPD_MODULE_HOST_CHALLENGE));
+	line = g_strdup_printf(SPD_MODULE_HOST_AUTH "%s\n", answer);
+	ret = write_all(sock, line, strlen(line));
+	g_free(line);
+	g_free(answer);
+	g_free(challenge);
+	return ret;
+}
+
+/* Pass the data from the server to the module and back, until the module
+ * side closes: when the server closes first, the module still has its
+ * answer to QUIT to send */
+static int remote_relay(int sock)
+{
+	struct pollfd fds[2] = {
+		{ .fd = STDIN_FILENO, .events = POLLIN },
+		{ .fd = sock, .events = POLLIN },
+	};
+	static char buf[65536];
+	ssize_t len;
+
+	while (1) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		if (fds[0].revents) {
+			len = read(STDIN_FILENO, buf, sizeof(buf));
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len <= 0) {
+				shutdown(sock, SHUT_WR);
+				fds[0].fd = -1;
+			} else if (write_all(sock, buf, len) != 0) {
+				perror("write to the remote module");
+				return 1;
+			}
+		}
+
+		if (fds[1].revents) {
+			len = read(sock, buf, sizeof(buf));
+			if (len < 0 && errno == EINTR)
+				continue;
+			if (len < 0) {
+				perror("read from the remote module");
+				return 1;
+			}
+			if (len == 0)
+				return 0;
+			if (write_all(STDOUT_FILENO, buf, len) != 0)
+				/* The server is gone */
+				return 1;
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	char *request, *secret;
+	const char *error;
+	int sock, ret;
+
+	/* Have write() fail instead */
+	signal(SIGPIPE, SIG_IGN);
+
+	if (argc < 2 || remote_config(argv[1]) != 0)
+		return remote_fail("Can't read the configuration of the remote module");
+	if (!remote_host || !remote_module || !remote_secret_file)
+		return remote_fail("RemoteHost, RemoteModule and RemoteSecretFile "
+				   "must be set in %s", argv[1]);
+	secret = spd_module_host_read_secret(remote_secret_file, &error);
+	if (!secret)
+		return remote_fail("%s: %s", remote_secret_file, error);
+
+	sock = remote_connect();
+	if (sock < 0)
+		return remote_fail("Can't connect to %s port %d: %s",
+				   remote_host, remote_port,
+				   errno ? strerror(errno) : "no address");
+
+	ret = remote_authenticate(sock, secret);
+	g_free(secret);
+	if (ret != 0)
+		return remote_fail("Can't authenticate to %s: %s", remote_host,
+				   errno ? strerror(errno) : "bad challenge");
+
+	request = g_strdup_printf(SPD_MODULE_HOST_REQUEST "%s\n", remote_module);
+	ret = write_all(sock, request, strlen(request));
+	g_free(request);
+	if (ret != 0)
+		return remote_fail("Can't talk to %s: %s", remote_host,
+				   strerror(errno));
+
+	fprintf(stderr, "Running module %s on %s port %d\n", remote_module,
+		remote_host, remote_port);
+
+	return remote_relay(sock);
+}
@@ -0,0 +1,267 @@
+/*
+ * skeleton_espeak-ng-stream.c - Streaming module example
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHORS AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE REGENTS OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * This module is based on skeleton0_espeak-ng-async-server and
+ * skeleton_config, and shows how to get the best of the speechd-provided
+ * helpers:
+ *
+ * - the audio is streamed to the server piece by piece with
+ *   module_stream_audio(), along with the marks which fall in each piece, so
+ *   that it starts playing as soon as the first piece is synthesized;
+ * - a stop is reported right away by module_stream_stop(), and whatever the
+ *   synthesizer still produces for the stopped message is dropped;
+ * - messages up to AudioCacheMaxLength characters get cached by the module
+ *   basis (see AudioCacheMaxKBytes in the configuration file), and get
+ *   replayed without calling module_speak() at all.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <espeak-ng/espeak_ng.h>
+#include <espeak-ng/speak_lib.h>
+
+#define MODULE_NAME	"skeleton_espeak-ng-stream"
+#define MODULE_VERSION	"0.1"
+
+#include "module_main.h"
+#include "module_utils.h"
+
+#define DEBUG_MODULE 1
+DECLARE_DEBUG();
+
+/* How much audio espeak-ng synthesizes before calling us back, in ms.  The
+ * smaller, the sooner the first piece gets played. */
+MOD_OPTION_1_INT(SkeletonStreamBufferMs);
+
+static int sample_rate;
+
+/* Message being synthesized, and how many of its samples were given */
+static unsigned synth_id;
+static int64_t synth_samples;
+
+int module_load(void)
+{
+	INIT_SETTINGS_TABLES();
+
+	REGISTER_DEBUG();
+
+	MOD_OPTION_1_INT_REG(SkeletonStreamBufferMs, 60);
+
+	return 0;
+}
+
+static int callback(short *, int, espeak_EVENT *);
+
+int module_init(char **msg)
+{
+	espeak_ng_ERROR_CONTEXT context = NULL;
+	espeak_ng_STATUS result;
+
+	DBG("initializing");
+
+	/* Audio only goes through the server */
+	module_audio_set_server();
+
+	espeak_ng_InitializePath(NULL);
+	result = espeak_ng_Initialize(&context);
+
+	/* Retrieval mode: espeak-ng synthesizes in its own thread and gives
+	 * us the audio through the callback */
+	if (result == ENS_OK)
+		result = espeak_ng_InitializeOutput(0, SkeletonStreamBufferMs,
+						    NULL);
+
+	if (result != ENS_OK) {
+		char buf[128];
+		espeak_ng_GetStatusCodeMessage(result, buf, sizeof(buf));
+		DBG("espeak-ng initialization failed: '%s'", buf);
+		*msg = g_strdup(buf);
+		return -1;
+	}
+
+	espeak_SetSynthCallback(callback);
+	sample_rate = espeak_ng_GetSampleRate();
+
+	*msg = g_strdup("ok!");
+
+	return 0;
+}
+
+SPDVoice **module_list_voices(void)
+{
+	/* TODO: Return list of voices */
+	SPDVoice **ret = g_malloc(3 * sizeof(*ret));
+
+	ret[0] = g_malloc(sizeof(*(ret[0])));
+	ret[0]->name = g_strdup("English (America)");
+	ret[0]->language = g_strdup("en");
+	ret[0]->variant = NULL;
+
+	ret[1] = g_malloc(sizeof(*(ret[0])));
+	ret[1]->name = g_strdup("French (France)");
+	ret[1]->language = g_strdup("fr");
+	ret[1]->variant = NULL;
+
+	ret[2] = NULL;
+
+	return ret;
+}
+
+static void skeleton_set_language(char *language)
+{
+	espeak_VOICE voice_select;
+
+	memset(&voice_select, 0, sizeof(voice_select));
+	voice_select.languages = language;
+	espeak_ng_SetVoiceByProperties(&voice_select);
+}
+
+static void skeleton_set_rate(signed int rate)
+{
+	/* convert from [-100, 100] to [80, 450] words per minute */
+	if (rate < 0)
+		rate = 175 + (175 - 80) * rate / 100;
+	else
+		rate = 175 + (450 - 175) * rate / 100;
+	espeak_SetParameter(espeakRATE, rate, 0);
+}
+
+static void skeleton_set_pitch(signed int pitch)
+{
+	/* convert from [-100, 100] to [0, 100] */
+	espeak_SetParameter(espeakPITCH, (pitch + 100) / 2, 0);
+}
+
+/* Asynchronous version: espeak-ng synthesizes in its own thread */
+int module_speak(char *data, size_t bytes, SPDMessageType msgtype)
+{
+	unsigned id;
+
+	UPDATE_STRING_PARAMETER(voice.language, skeleton_set_language);
+	UPDATE_PARAMETER(rate, skeleton_set_rate);
+	UPDATE_PARAMETER(pitch, skeleton_set_pitch);
+
+	DBG("speaking '%s'", data);
+
+	/* The id of the stream comes back with each callback, so that the
+	 * audio of a stopped message is recognized */
+	id = module_stream_begin();
+	if (espeak_Synth(data, bytes + 1, 0, POS_CHARACTER, 0,
+			 espeakCHARS_UTF8 | espeakENDPAUSE | espeakSSML,
+			 NULL, GUINT_TO_POINTER(id)) != EE_OK) {
+		module_stream_stop(FALSE);
+		return 0;
+	}
+
+	return 1;
+}
+
+/* This is getting called in the espeak-ng thread with each piece of audio,
+ * and the events which happened in it */
+static int callback(short *wav, int numsamples, espeak_EVENT *events)
+{
+	espeak_EVENT *cur;
+	unsigned id = GPOINTER_TO_UINT(events->user_data);
+	AudioTrack track = {
+		.bits = 16,
+		.num_channels = 1,
+		.sample_rate = sample_rate,
+		.num_samples = numsamples,
+		.samples = wav,
+	};
+	SPDMarks marks;
+	int stopped = 0;
+
+	if (id != synth_id) {
+		synth_id = id;
+		synth_samples = 0;
+	}
+
+	module_marks_init(&marks);
+	for (cur = events; cur->type != espeakEVENT_LIST_TERMINATED; cur++) {
+		if (cur->type == espeakEVENT_MARK) {
+			/* audio_position is in ms from the start of the
+			 * message, make it a sample of this piece */
+			int64_t sample = (int64_t) cur->audio_position
+			    * sample_rate / 1000 - synth_samples;
+
+			module_marks_add(&marks, CLAMP(sample, 0, numsamples),
+					 cur->id.name);
+		}
+	}
+
+	if (numsamples > 0 || marks.num)
+		stopped = module_stream_audio(id, &track, SPD_AUDIO_LE, &marks);
+	module_marks_clear(&marks);
+	synth_samples += numsamples;
+
+	for (cur = events; !stopped && cur->type != espeakEVENT_LIST_TERMINATED;
+	     cur++)
+		if (cur->type == espeakEVENT_MSG_TERMINATED)
+			stopped = module_stream_end(id);
+
+	/* Tell espeak-ng not to synthesize the rest of a stopped message */
+	return stopped;
+}
+
+size_t module_pause(void)
+{
+	DBG("pausing");
+
+	/* Only supports stopping */
+	module_stream_stop(TRUE);
+	espeak_Cancel();
+
+	return 0;
+}
+
+int module_stop(void)
+{
+	DBG("stopping");
+
+	/* Report the stop first: espeak_Cancel() waits for the synthesis
+	 * thread */
+	module_stream_stop(FALSE);
+	espeak_Cancel();
+
+	return 0;
+}
+
+int module_close(void)
+{
+	DBG("closing");
+
+	espeak_ng_Terminate();
+
+	return 0;
+}
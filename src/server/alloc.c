@@ -22,12 +22,186 @@
 #endif
 
 #include "alloc.h"
+#include "index_marking.h"
+#include "msg.h"
+
+/* What each subsystem holds, as told with mem_account() where its memory is
+   allocated and freed.  This is about the big users only, to tell which one
+   grows, not to add up to the size of the process. */
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static gssize mem_bytes[MEM_SUBSYSTEMS];
+static gint mem_objects[MEM_SUBSYSTEMS];
+
+static const char *const mem_subsystem_names[MEM_SUBSYSTEMS] = {
+	"messages", "history", "symbols", "symbols_cache", "voices",
+	"audio_rings"
+};
+
+void mem_account(TMemSubsystem subsystem, gssize bytes, gint objects)
+{
+	pthread_mutex_lock(&mem_mutex);
+	mem_bytes[subsystem] += bytes;
+	mem_objects[subsystem] += objects;
+	pthread_mutex_unlock(&mem_mutex);
+}
+
+void mem_account_message(TSpeechDMessage * msg, TMemSubsystem subsystem)
+{
+	if (msg->mem_bytes)
+		mem_account(msg->mem_subsystem, -(gssize) msg->mem_bytes, -1);
+	msg->mem_subsystem = subsystem;
+	msg->mem_bytes = sizeof(*msg) + MAX(msg->bytes, 0) + 1
+	    + mem_strsize(msg->settings.index_mark);
+	mem_account(subsystem, msg->mem_bytes, 1);
+}
+
+gsize mem_strsize(const char *s)
+{
+	return s ? strlen(s) + 1 : 0;
+}
+
+void mem_usage(TMemSubsystem subsystem, gsize * bytes, guint * objects)
+{
+	pthread_mutex_lock(&mem_mutex);
+	*bytes = MAX(mem_bytes[subsystem], 0);
+	*objects = MAX(mem_objects[subsystem], 0);
+	pthread_mutex_unlock(&mem_mutex);
+}
+
+const char *mem_subsystem_name(TMemSubsystem subsystem)
+{
+	return mem_subsystem_names[subsystem];
+}
+
+char *mem_usage_report(void)
+{
+	GString *result = g_string_new("");
+	gsize bytes, total_bytes = 0;
+	guint objects, total_objects = 0;
+	int i;
+
+	for (i = 0; i < MEM_SUBSYSTEMS; i++) {
+		mem_usage(i, &bytes, &objects);
+		g_string_append_printf(result, C_OK_GET "-%s objects=%u "
+				       "bytes=%zu" NEWLINE,
+				       mem_subsystem_names[i], objects, bytes);
+		total_bytes += bytes;
+		total_objects += objects;
+	}
+	g_string_append_printf(result, C_OK_GET "-total objects=%u bytes=%zu"
+			       NEWLINE OK_GET, total_objects, total_bytes);
+	return g_string_free(result, FALSE);
+}
+
+void mem_usage_log(void)
+{
+	gsize bytes;
+	guint objects;
+	int i;
+
+	MSG(3, "Memory usage:");
+	for (i = 0; i < MEM_SUBSYSTEMS; i++) {
+		mem_usage(i, &bytes, &objects);
+		MSG(3, "  %s: %u objects, %zu bytes", mem_subsystem_names[i],
+		    objects, bytes);
+	}
+}
+
+/* Immutable copy of the string settings of a client, shared by all
+   the messages queued while these settings don't change */
+struct TFDSetStrings {
+	gint ref_count;
+	char *client_name;
+	char *output_module;
+	char *language;
+	char *voice_name;
+	char *audio_output_method;
+	char *audio_oss_device;
+	char *audio_alsa_device;
+	char *audio_nas_server;
+	char *audio_pulse_server;
+	char *audio_pulse_device;
+};
+
+static TFDSetStrings *spd_fdset_strings_new(TFDSetElement * set)
+{
+	TFDSetStrings *strings;
+
+	strings = g_malloc(sizeof(TFDSetStrings));
+	strings->ref_count = 1;
+	strings->client_name = g_strdup(set->client_name);
+	strings->output_module = g_strdup(set->output_module);
+	strings->language = g_strdup(set->msg_settings.voice.language);
+	strings->voice_name = g_strdup(set->msg_settings.voice.name);
+	strings->audio_output_method = g_strdup(set->audio_output_method);
+	strings->audio_oss_device = g_strdup(set->audio_oss_device);
+	strings->audio_alsa_device = g_strdup(set->audio_alsa_device);
+	strings->audio_nas_server = g_strdup(set->audio_nas_server);
+	strings->audio_pulse_server = g_strdup(set->audio_pulse_server);
+	strings->audio_pulse_device = g_strdup(set->audio_pulse_device);
+
+	return strings;
+}
+
+static void spd_fdset_strings_unref(TFDSetStrings * strings)
+{
+	if (!g_atomic_int_dec_and_test(&strings->ref_count))
+		return;
+
+	g_free(strings->client_name);
+	g_free(strings->output_module);
+	g_free(strings->language);
+	g_free(strings->voice_name);
+	g_free(strings->audio_output_method);
+	g_free(strings->audio_oss_device);
+	g_free(strings->audio_alsa_device);
+	g_free(strings->audio_nas_server);
+	g_free(strings->audio_pulse_server);
+	g_free(strings->audio_pulse_device);
+	g_free(strings);
+}
+
+void spd_fdset_share_strings(TFDSetElement * msg_set, TFDSetElement * client)
+{
+	TFDSetStrings *strings;
+
+	if (client->strings == NULL)
+		client->strings = spd_fdset_strings_new(client);
+	strings = client->strings;
+	g_atomic_int_inc(&strings->ref_count);
+
+	msg_set->strings = strings;
+	msg_set->client_name = strings->client_name;
+	msg_set->output_module = strings->output_module;
+	msg_set->msg_settings.voice.language = strings->language;
+	msg_set->msg_settings.voice.name = strings->voice_name;
+	msg_set->audio_output_method = strings->audio_output_method;
+	msg_set->audio_oss_device = strings->audio_oss_device;
+	msg_set->audio_alsa_device = strings->audio_alsa_device;
+	msg_set->audio_nas_server = strings->audio_nas_server;
+	msg_set->audio_pulse_server = strings->audio_pulse_server;
+	msg_set->audio_pulse_device = strings->audio_pulse_device;
+}
+
+void spd_fdset_strings_changed(TFDSetElement * client)
+{
+	if (client->strings == NULL)
+		return;
+	spd_fdset_strings_unref(client->strings);
+	client->strings = NULL;
+}
 
 TFDSetElement spd_fdset_copy(TFDSetElement *old)
 {
 	TFDSetElement new;
 
 	new = *old;
+	if (old->strings != NULL) {
+		/* Strings shared with the original message */
+		g_atomic_int_inc(&old->strings->ref_count);
+		new.index_mark = g_strdup(old->index_mark);
+		return new;
+	}
 	new.msg_settings.voice.language =
 	    g_strdup(old->msg_settings.voice.language);
 	new.msg_settings.voice.name = g_strdup(old->msg_settings.voice.name);
@@ -59,6 +233,15 @@ TSpeechDMessage *spd_message_copy(TSpeechDMessage * old)
 	memcpy(new->buf, old->buf, old->bytes);
 	new->buf[new->bytes] = 0;
 	new->settings = spd_fdset_copy(&old->settings);
+	new->queue = NULL;
+	new->link = NULL;
+	new->uid_link = NULL;
+	new->index_marks = NULL;
+	/* Only the original is traced, a copy would count it twice */
+	memset(&new->latency, 0, sizeof(new->latency));
+	new->mem_bytes = 0;
+	mem_account_message(new, old->mem_bytes ? old->mem_subsystem
+			    : MEM_MESSAGES);
 
 	return new;
 }
@@ -78,13 +261,24 @@ void mem_free_fdset(TFDSetElement * fdset)
 	g_free(fdset->audio_nas_server);
 	g_free(fdset->audio_pulse_server);
 	g_free(fdset->audio_pulse_device);
+	if (fdset->strings != NULL)
+		spd_fdset_strings_unref(fdset->strings);
 }
 
 void mem_free_message(TSpeechDMessage * msg)
 {
 	if (msg == NULL)
 		return;
+	if (msg->mem_bytes)
+		mem_account(msg->mem_subsystem, -(gssize) msg->mem_bytes, -1);
 	g_free(msg->buf);
-	mem_free_fdset(&(msg->settings));
+	forget_index_marks(msg);
+	if (msg->settings.strings != NULL) {
+		/* Only index_mark is owned by the message itself */
+		g_free(msg->settings.index_mark);
+		spd_fdset_strings_unref(msg->settings.strings);
+	} else {
+		mem_free_fdset(&(msg->settings));
+	}
 	g_free(msg);
 }
@@ -31,4 +31,33 @@ void mem_free_message(TSpeechDMessage * msg);
 /* Free a settings element */
 void mem_free_fdset(TFDSetElement * set);
 
+/* Point the string settings of a message at a shared copy of
+   the current string settings of client */
+void spd_fdset_share_strings(TFDSetElement * msg_set, TFDSetElement * client);
+
+/* Must be called whenever a string setting of client changes */
+void spd_fdset_strings_changed(TFDSetElement * client);
+
+/* Add bytes and objects, which may be negative, to what subsystem is
+   accounted for.  Callers have to subtract exactly what they added. */
+void mem_account(TMemSubsystem subsystem, gssize bytes, gint objects);
+
+/* Account msg in subsystem, moving it there if it was accounted elsewhere */
+void mem_account_message(TSpeechDMessage * msg, TMemSubsystem subsystem);
+
+/* Bytes taken by a copy of s, 0 for NULL */
+gsize mem_strsize(const char *s);
+
+/* Get what subsystem is accounted for */
+void mem_usage(TMemSubsystem subsystem, gsize * bytes, guint * objects);
+
+/* Name of subsystem in the reports */
+const char *mem_subsystem_name(TMemSubsystem subsystem);
+
+/* SSIP reply of GET MEMORY, one line per subsystem */
+char *mem_usage_report(void);
+
+/* Write the same to the log, on SIGUSR2 */
+void mem_usage_log(void);
+
 #endif
@@ -0,0 +1,131 @@
+/*
+ * capture.c - Recording of the SSIP sessions of the clients
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * With ProtocolCaptureFile, the connections of the clients and the lines
+ * they send are written there as they come, with their time, in the format
+ * of capture.h.  spd_replay can then send them again to a server with the
+ * same timing, to reproduce a performance problem or compare versions.
+ * Everything happens in the main thread, so the file is only buffered, and
+ * flushed when a client goes away.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "speechd.h"
+#include "capture.h"
+
+static FILE *capture_file;
+static char *capture_path;
+static gint64 capture_start_time;
+
+static void capture_write(int fd, ECaptureType type, const char *data,
+			  size_t bytes)
+{
+	TCaptureRecord record = {
+		.time = GUINT64_TO_LE(g_get_monotonic_time() -
+				      capture_start_time),
+		.connection = GUINT32_TO_LE(fd),
+		.type = GUINT16_TO_LE(type),
+		.length = GUINT32_TO_LE(bytes),
+	};
+
+	if (capture_file == NULL)
+		return;
+
+	if (fwrite(&record, sizeof(record), 1, capture_file) != 1
+	    || (bytes && fwrite(data, bytes, 1, capture_file) != 1)) {
+		MSG(2, "Can't write to the capture file %s: %s",
+		    capture_path, strerror(errno));
+		capture_stop();
+	}
+}
+
+void capture_start(void)
+{
+	const char *path = SpeechdOptions.protocol_capture_file;
+	int fd;
+
+	/* Keep recording to the same file across reloads */
+	if (capture_path && !g_strcmp0(path, capture_path))
+		return;
+	capture_stop();
+	if (path == NULL || *path == 0)
+		return;
+
+	/* It holds all that the clients say, don't let anybody else read it
+	   or make us write it elsewhere */
+	fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+		  0600);
+	if (fd >= 0) {
+		capture_file = fdopen(fd, "wb");
+		if (capture_file == NULL)
+			close(fd);
+	}
+	if (capture_file == NULL) {
+		MSG(1, "Can't create the capture file %s: %s", path,
+		    strerror(errno));
+		return;
+	}
+	setvbuf(capture_file, NULL, _IOFBF, 64 * 1024);
+	capture_path = g_strdup(path);
+	capture_start_time = g_get_monotonic_time();
+
+	if (fwrite(CAPTURE_MAGIC, CAPTURE_MAGIC_LEN, 1, capture_file) != 1) {
+		MSG(1, "Can't write to the capture file %s: %s", path,
+		    strerror(errno));
+		capture_stop();
+		return;
+	}
+	MSG(3, "Recording the SSIP sessions to %s", path);
+}
+
+void capture_stop(void)
+{
+	if (capture_file) {
+		if (fclose(capture_file))
+			MSG(2, "Can't write to the capture file %s: %s",
+			    capture_path, strerror(errno));
+		capture_file = NULL;
+	}
+	g_free(capture_path);
+	capture_path = NULL;
+}
+
+void capture_connect(int fd)
+{
+	capture_write(fd, CAPTURE_CONNECT, NULL, 0);
+}
+
+void capture_line(int fd, const char *line, size_t bytes)
+{
+	capture_write(fd, CAPTURE_LINE, line, bytes);
+}
+
+void capture_disconnect(int fd)
+{
+	capture_write(fd, CAPTURE_DISCONNECT, NULL, 0);
+	if (capture_file)
+		fflush(capture_file);
+}
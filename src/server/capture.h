@@ -0,0 +1,61 @@
+/*
+ * capture.h - Recording of the SSIP sessions of the clients
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <glib.h>
+
+/* A capture file is made of the CAPTURE_MAGIC bytes, then of records, each a
+ * TCaptureRecord followed by length bytes of data.  The fields are little
+ * endian, so that captures can be replayed on other machines, see
+ * spd_replay in src/tests.  This header is included there too, so it only
+ * depends on GLib.  */
+
+#define CAPTURE_MAGIC "SPDCAP1\n"
+#define CAPTURE_MAGIC_LEN 8
+
+typedef enum {
+	CAPTURE_CONNECT,	/* a client connected */
+	CAPTURE_LINE,		/* an SSIP line it sent, with its \r\n */
+	CAPTURE_DISCONNECT,	/* it went away */
+} ECaptureType;
+
+typedef struct {
+	guint64 time;		/* us since the capture started */
+	guint32 connection;	/* fd of the client, reused once it is gone */
+	guint16 type;		/* ECaptureType */
+	guint16 reserved;
+	guint32 length;		/* of the data which follows */
+	guint32 reserved2;
+} TCaptureRecord;
+
+/* Record to ProtocolCaptureFile, or stop to if it is not set, according to
+ * the configuration just read */
+void capture_start(void);
+
+/* Close the capture file */
+void capture_stop(void);
+
+/* Record the events of the client on fd, from the main thread */
+void capture_connect(int fd);
+void capture_line(int fd, const char *line, size_t bytes);
+void capture_disconnect(int fd);
+
+#endif /* CAPTURE_H */
@@ -183,6 +183,8 @@ GLOBAL_FDSET_OPTION_CB_STR(DefaultModule, output_module)
     GLOBAL_FDSET_OPTION_CB_STR(AudioOutputMethod, audio_output_method)
     GLOBAL_FDSET_OPTION_CB_STR(AudioOSSDevice, audio_oss_device)
     GLOBAL_FDSET_OPTION_CB_STR(AudioALSADevice, audio_alsa_device)
+    GLOBAL_FDSET_OPTION_CB_INT(AudioALSAIdleTimeout, audio_alsa_idle_timeout,
+			       val >= 0, "Invalid ALSA idle timeout!")
     GLOBAL_FDSET_OPTION_CB_STR(AudioNASServer, audio_nas_server)
     GLOBAL_FDSET_OPTION_CB_STR(AudioPulseServer, audio_pulse_server)
     GLOBAL_FDSET_OPTION_CB_STR(AudioPulseDevice, audio_pulse_device)
@@ -200,6 +202,10 @@ GLOBAL_FDSET_OPTION_CB_STR(DefaultModule, output_module)
     GLOBAL_FDSET_OPTION_CB_INT(DefaultSpelling, msg_settings.spelling_mode, 1,
 			   "Invalid spelling mode")
     GLOBAL_FDSET_OPTION_CB_INT(DefaultPauseContext, pause_context, 1, "")
+    GLOBAL_FDSET_OPTION_CB_INT(DefaultCoalescing, coalescing,
+			       val == 0 || val == 1, "Invalid coalescing mode")
+    GLOBAL_FDSET_OPTION_CB_INT(DefaultIndexMarkInterval, index_mark_interval,
+			       val >= 0, "Invalid index mark interval")
 
     GLOBAL_FDSET_OPTION_CB_SPECIAL(DefaultPriority, priority, SPDPriority,
 			       str2intpriority)
@@ -219,13 +225,75 @@ GLOBAL_FDSET_OPTION_CB_STR(DefaultModule, output_module)
     SPEECHD_OPTION_CB_INT_M(Port, port, val >= 0, "Invalid port number!")
     SPEECHD_OPTION_CB_INT_M(LocalhostAccessOnly, localhost_access_only, val >= 0,
 			"Invalid access control mode!")
+    SPEECHD_OPTION_CB_INT(TcpNoDelay, tcp_nodelay, val == 0 || val == 1,
+		      "Invalid TCP no delay mode!")
+    SPEECHD_OPTION_CB_INT(TcpKeepAlive, tcp_keepalive, val >= 0,
+		      "Invalid TCP keepalive time!")
+    SPEECHD_OPTION_CB_INT(TcpSendBuffer, tcp_send_buffer, val >= 0,
+		      "Invalid TCP send buffer size!")
     GLOBAL_SET_LOGLEVEL(LogLevel, log_level, (val >= 0)
 			&& (val <= 5), "Invalid log (verbosity) level!")
     SPEECHD_OPTION_CB_INT(MaxHistoryMessages, max_history_messages, val >= 0,
 		      "Invalid parameter!")
     SPEECHD_OPTION_CB_INT(MaxQueueSize, max_queue_size, val >= 0,
 		      "Invalid parameter!")
+    SPEECHD_OPTION_CB_INT(AudioSharedMemorySize, audio_ring_size, val >= 0,
+		      "Invalid shared memory size!")
+    SPEECHD_OPTION_CB_INT(AudioQueueLowWatermark, audio_queue_low_ms, val >= 0,
+		      "Invalid audio queue watermark!")
+    SPEECHD_OPTION_CB_INT(AudioQueueHighWatermark, audio_queue_high_ms, val >= 0,
+		      "Invalid audio queue watermark!")
+    SPEECHD_OPTION_CB_INT(AudioLookAhead, audio_look_ahead, val == 0 || val == 1,
+		      "Invalid audio look-ahead mode!")
+    SPEECHD_OPTION_CB_INT(SpeakSegmentLength, speak_segment_length,
+		      val == 0 || val >= 16, "Invalid segment length!")
+    SPEECHD_OPTION_CB_INT(AudioRealtimePriority, audio_realtime_priority,
+		      val >= 0 && val <= 99, "Invalid real-time priority!")
+    SPEECHD_OPTION_CB_STR(AudioCPUs, audio_cpus)
+    SPEECHD_OPTION_CB_INT(SynthesisNice, synthesis_nice,
+		      val >= -20 && val <= 19, "Invalid nice level!")
+    SPEECHD_OPTION_CB_STR(SynthesisCPUs, synthesis_cpus)
+    SPEECHD_OPTION_CB_INT(AudioSampleRate, audio_sample_rate,
+		      val == 0 || (val >= 8000 && val <= 192000),
+		      "Invalid audio sample rate!")
+    SPEECHD_OPTION_CB_INT(AudioServerVolume, audio_server_volume,
+		      val == 0 || val == 1, "Invalid audio server volume mode!")
+    SPEECHD_OPTION_CB_STR(AudioFilePath, audio_file_path)
+    SPEECHD_OPTION_CB_STR(AudioRTPDestination, audio_rtp_destination)
+    SPEECHD_OPTION_CB_INT(AudioSinkRealTime, audio_sink_real_time,
+		      val == 0 || val == 1, "Invalid audio sink pacing mode!")
+    SPEECHD_OPTION_CB_INT(ModuleLazyLoad, module_lazy_load, val == 0 || val == 1,
+		      "Invalid module lazy loading mode!")
+    SPEECHD_OPTION_CB_INT(ModuleIdleTimeout, module_idle_timeout, val >= 0,
+		      "Invalid module idle timeout!")
+    SPEECHD_OPTION_CB_INT(ModuleDeferredStart, module_deferred_start,
+		      val == 0 || val == 1, "Invalid module deferred start mode!")
+    SPEECHD_OPTION_CB_INT(SymbolsPreprocPreload, symbols_preload, val == 0 || val == 1,
+		      "Invalid symbols preload mode!")
+    SPEECHD_OPTION_CB_INT(SoundIconCacheSize, sound_icon_cache_size, val >= 0,
+		      "Invalid sound icon cache size!")
+    SPEECHD_OPTION_CB_STR(SoundIconPreloadFolder, sound_icon_preload_folder)
+    SPEECHD_OPTION_CB_INT(SoundIconMixSpeechGain, sound_icon_mix_speech_gain,
+		      val >= 0 && val <= 400, "Invalid sound icon mixing gain!")
+    SPEECHD_OPTION_CB_INT(SoundIconMixGain, sound_icon_mix_gain,
+		      val >= 0 && val <= 400, "Invalid sound icon mixing gain!")
     SPEECHD_OPTION_CB_INT_M(Timeout, server_timeout, val >= 0, "Invalid timeout value!")
+    SPEECHD_OPTION_CB_INT(ClientOutputLimit, client_output_limit, val >= 0,
+		      "Invalid client output limit!")
+    SPEECHD_OPTION_CB_INT(ClientMessageRate, client_message_rate, val >= 0,
+		      "Invalid client message rate!")
+    SPEECHD_OPTION_CB_INT(ClientMessageBurst, client_message_burst, val >= 1,
+		      "Invalid client message burst!")
+    SPEECHD_OPTION_CB_INT(ClientQueueMessages, client_queue_messages, val >= 0,
+		      "Invalid client queue limit!")
+    SPEECHD_OPTION_CB_INT(ClientQueueSize, client_queue_size, val >= 0,
+		      "Invalid client queue size!")
+    SPEECHD_OPTION_CB_INT(NotificationExpiry, notification_expiry, val >= 0,
+		      "Invalid notification expiry!")
+    SPEECHD_OPTION_CB_INT(MetricsInterval, metrics_interval, val >= 0,
+		      "Invalid metrics interval!")
+    SPEECHD_OPTION_CB_STR(ProtocolCaptureFile, protocol_capture_file)
+    SPEECHD_OPTION_CB_STR(HistoryFile, history_file)
 
     DOTCONF_CB(cb_LanguageDefaultModule)
 {
@@ -337,6 +405,36 @@ DOTCONF_CB(cb_AddModule)
 	return NULL;
 }
 
+DOTCONF_CB(cb_ModuleStandby)
+{
+	int i;
+
+	for (i = 0; i < cmd->arg_count; i++)
+		module_add_standby_request(cmd->data.list[i]);
+
+	return NULL;
+}
+
+DOTCONF_CB(cb_ModuleInProcess)
+{
+	int i;
+
+	for (i = 0; i < cmd->arg_count; i++)
+		module_add_inprocess_request(cmd->data.list[i]);
+
+	return NULL;
+}
+
+DOTCONF_CB(cb_ModuleCompressAudio)
+{
+	int i;
+
+	for (i = 0; i < cmd->arg_count; i++)
+		module_add_compression_request(cmd->data.list[i]);
+
+	return NULL;
+}
+
 /* == CLIENT SPECIFIC CONFIGURATION == */
 
 #define SET_PAR(name, value) cl_spec->val.name = value;
@@ -372,6 +470,8 @@ DOTCONF_CB(cb_BeginClient)
 	    SET_PAR(pause_context, -1);
 	SET_PAR(ssml_mode, -1);
 	SET_PAR(symbols_preprocessing, -1);
+	SET_PAR(coalescing, -1);
+	SET_PAR(index_mark_interval, -1);
 	SET_PAR_STR(msg_settings.voice.language)
 	    SET_PAR_STR(output_module)
 
@@ -431,6 +531,9 @@ configoption_t *load_config_options(int *num_options)
 	ADD_CONFIG_OPTION(Port, ARG_INT);
 	ADD_CONFIG_OPTION(DisableAutoSpawn, ARG_NONE);
 	ADD_CONFIG_OPTION(LocalhostAccessOnly, ARG_INT);
+	ADD_CONFIG_OPTION(TcpNoDelay, ARG_INT);
+	ADD_CONFIG_OPTION(TcpKeepAlive, ARG_INT);
+	ADD_CONFIG_OPTION(TcpSendBuffer, ARG_INT);
 	ADD_CONFIG_OPTION(LogFile, ARG_STR);
 	ADD_CONFIG_OPTION(LogDir, ARG_STR);
 	ADD_CONFIG_OPTION(CustomLogFile, ARG_LIST);
@@ -448,21 +551,58 @@ configoption_t *load_config_options(int *num_options)
 	ADD_CONFIG_OPTION(DefaultPunctuationMode, ARG_STR);
 	ADD_CONFIG_OPTION(SymbolsPreproc, ARG_STR);
 	ADD_CONFIG_OPTION(SymbolsPreprocFile, ARG_STR);
+	ADD_CONFIG_OPTION(SymbolsPreprocPreload, ARG_INT);
 	ADD_CONFIG_OPTION(DefaultClientName, ARG_STR);
 	ADD_CONFIG_OPTION(DefaultVoiceType, ARG_STR);
 	ADD_CONFIG_OPTION(DefaultSpelling, ARG_TOGGLE);
 	ADD_CONFIG_OPTION(DefaultCapLetRecognition, ARG_STR);
 	ADD_CONFIG_OPTION(DefaultPauseContext, ARG_INT);
+	ADD_CONFIG_OPTION(DefaultCoalescing, ARG_INT);
+	ADD_CONFIG_OPTION(DefaultIndexMarkInterval, ARG_INT);
 	ADD_CONFIG_OPTION(Timeout, ARG_INT);
 	ADD_CONFIG_OPTION(AddModule, ARG_LIST);
 
 	ADD_CONFIG_OPTION(AudioOutputMethod, ARG_STR);
 	ADD_CONFIG_OPTION(AudioOSSDevice, ARG_STR);
 	ADD_CONFIG_OPTION(AudioALSADevice, ARG_STR);
+	ADD_CONFIG_OPTION(AudioALSAIdleTimeout, ARG_INT);
 	ADD_CONFIG_OPTION(AudioNASServer, ARG_STR);
 	ADD_CONFIG_OPTION(AudioPulseServer, ARG_STR);
 	ADD_CONFIG_OPTION(AudioPulseDevice, ARG_STR);
 	ADD_CONFIG_OPTION(AudioPulseMinLength, ARG_INT);
+	ADD_CONFIG_OPTION(AudioSharedMemorySize, ARG_INT);
+	ADD_CONFIG_OPTION(AudioQueueLowWatermark, ARG_INT);
+	ADD_CONFIG_OPTION(AudioQueueHighWatermark, ARG_INT);
+	ADD_CONFIG_OPTION(AudioLookAhead, ARG_INT);
+	ADD_CONFIG_OPTION(SpeakSegmentLength, ARG_INT);
+	ADD_CONFIG_OPTION(AudioRealtimePriority, ARG_INT);
+	ADD_CONFIG_OPTION(AudioCPUs, ARG_STR);
+	ADD_CONFIG_OPTION(SynthesisNice, ARG_INT);
+	ADD_CONFIG_OPTION(SynthesisCPUs, ARG_STR);
+	ADD_CONFIG_OPTION(AudioSampleRate, ARG_INT);
+	ADD_CONFIG_OPTION(AudioServerVolume, ARG_INT);
+	ADD_CONFIG_OPTION(AudioFilePath, ARG_STR);
+	ADD_CONFIG_OPTION(AudioRTPDestination, ARG_STR);
+	ADD_CONFIG_OPTION(AudioSinkRealTime, ARG_INT);
+	ADD_CONFIG_OPTION(ModuleLazyLoad, ARG_INT);
+	ADD_CONFIG_OPTION(ModuleIdleTimeout, ARG_INT);
+	ADD_CONFIG_OPTION(ModuleDeferredStart, ARG_INT);
+	ADD_CONFIG_OPTION(ModuleStandby, ARG_LIST);
+	ADD_CONFIG_OPTION(ModuleInProcess, ARG_LIST);
+	ADD_CONFIG_OPTION(ModuleCompressAudio, ARG_LIST);
+	ADD_CONFIG_OPTION(SoundIconCacheSize, ARG_INT);
+	ADD_CONFIG_OPTION(SoundIconPreloadFolder, ARG_STR);
+	ADD_CONFIG_OPTION(SoundIconMixSpeechGain, ARG_INT);
+	ADD_CONFIG_OPTION(SoundIconMixGain, ARG_INT);
+	ADD_CONFIG_OPTION(ClientOutputLimit, ARG_INT);
+	ADD_CONFIG_OPTION(ClientMessageRate, ARG_INT);
+	ADD_CONFIG_OPTION(ClientMessageBurst, ARG_INT);
+	ADD_CONFIG_OPTION(ClientQueueMessages, ARG_INT);
+	ADD_CONFIG_OPTION(ClientQueueSize, ARG_INT);
+	ADD_CONFIG_OPTION(NotificationExpiry, ARG_INT);
+	ADD_CONFIG_OPTION(MetricsInterval, ARG_INT);
+	ADD_CONFIG_OPTION(ProtocolCaptureFile, ARG_STR);
+	ADD_CONFIG_OPTION(HistoryFile, ARG_STR);
 
 	ADD_CONFIG_OPTION(BeginClient, ARG_STR);
 	ADD_CONFIG_OPTION(EndClient, ARG_NONE);
@@ -489,19 +629,68 @@ void load_default_global_set_options()
 	GlobalFDSet.msg_settings.cap_let_recogn = SPD_CAP_NONE;
 	GlobalFDSet.min_delay_progress = 2000;
 	GlobalFDSet.pause_context = 0;
+	GlobalFDSet.sound_icon_mixing = 0;
+	GlobalFDSet.audio_retrieval = 0;
+	GlobalFDSet.coalescing = 0;
+	GlobalFDSet.index_mark_interval = 0;
 	GlobalFDSet.ssml_mode = SPD_DATA_TEXT;
 	GlobalFDSet.notification = 0;
 
 	GlobalFDSet.audio_output_method = g_strdup(DEFAULT_AUDIO_METHOD);
 	GlobalFDSet.audio_oss_device = g_strdup("/dev/dsp");
 	GlobalFDSet.audio_alsa_device = g_strdup("default");
+	GlobalFDSet.audio_alsa_idle_timeout = 0;
 	GlobalFDSet.audio_nas_server = g_strdup("tcp/localhost:5450");
 	GlobalFDSet.audio_pulse_server = g_strdup("default");
 	GlobalFDSet.audio_pulse_device = g_strdup("default");
 	GlobalFDSet.audio_pulse_min_length = 10;
 
+	SpeechdOptions.tcp_nodelay = 1;
+	SpeechdOptions.tcp_keepalive = 0;
+	SpeechdOptions.tcp_send_buffer = 0;
+
 	SpeechdOptions.max_history_messages = 10000;
 	SpeechdOptions.max_queue_size = 10000;
+	SpeechdOptions.audio_ring_size = 0;
+	SpeechdOptions.audio_queue_low_ms = 0;
+	SpeechdOptions.audio_queue_high_ms = 0;
+	SpeechdOptions.audio_look_ahead = 0;
+	SpeechdOptions.speak_segment_length = 0;
+	SpeechdOptions.audio_realtime_priority = 0;
+	g_free(SpeechdOptions.audio_cpus);
+	SpeechdOptions.audio_cpus = NULL;
+	SpeechdOptions.synthesis_nice = 0;
+	g_free(SpeechdOptions.synthesis_cpus);
+	SpeechdOptions.synthesis_cpus = NULL;
+	SpeechdOptions.audio_sample_rate = 0;
+	SpeechdOptions.audio_server_volume = 0;
+	g_free(SpeechdOptions.audio_file_path);
+	SpeechdOptions.audio_file_path = NULL;
+	g_free(SpeechdOptions.audio_rtp_destination);
+	SpeechdOptions.audio_rtp_destination = g_strdup("localhost:5004");
+	SpeechdOptions.audio_sink_real_time = 0;
+	SpeechdOptions.symbols_preload = 0;
+	SpeechdOptions.module_lazy_load = 0;
+	SpeechdOptions.module_idle_timeout = 0;
+	/* When socket-activated, a client is already waiting for us */
+	SpeechdOptions.module_deferred_start = getenv("LISTEN_FDS") != NULL;
+	SpeechdOptions.multi_user = 0;
+	SpeechdOptions.sound_icon_cache_size = 2048;
+	g_free(SpeechdOptions.sound_icon_preload_folder);
+	SpeechdOptions.sound_icon_preload_folder = NULL;
+	SpeechdOptions.sound_icon_mix_speech_gain = 70;
+	SpeechdOptions.sound_icon_mix_gain = 100;
+	SpeechdOptions.client_output_limit = 256;
+	SpeechdOptions.client_message_rate = 0;
+	SpeechdOptions.client_message_burst = 100;
+	SpeechdOptions.client_queue_messages = 0;
+	SpeechdOptions.client_queue_size = 0;
+	SpeechdOptions.notification_expiry = 0;
+	SpeechdOptions.metrics_interval = 0;
+	g_free(SpeechdOptions.protocol_capture_file);
+	SpeechdOptions.protocol_capture_file = NULL;
+	g_free(SpeechdOptions.history_file);
+	SpeechdOptions.history_file = NULL;
 
 	/* Options which are accessible from command line must be handled
 	   specially to make sure we don't overwrite them */
@@ -30,9 +30,320 @@
 #include "server.h"
 
 #include "history.h"
+#include "history_file.h"
+
+/* A message in history, whose text is in the history file */
+typedef struct {
+	guint id;
+	int uid;		/* of its client */
+	int owner;		/* system user of its client, see client_same_owner() */
+	gsize offset;		/* of its text record */
+	GArray *parts;		/* offsets of the records of its next parts */
+} THistoryEntry;
+
+/* Messages in history, kept in a ring buffer of history_size
+   entries, the oldest one at history_first */
+static THistoryEntry **message_history;
+static guint history_size;
+static guint history_first;
+static guint history_count;
+
+/* Message id -> entry in history */
+static GHashTable *history_by_id;
+
+/* Client uid -> THistoryClient */
+static GHashTable *history_by_client;
+
+/* Messages of a client in history, oldest first.  Expired messages
+   are dropped from the front by advancing first. */
+typedef struct {
+	GPtrArray *msgs;
+	guint first;
+	int owner;		/* its system user, -1 if unknown */
+} THistoryClient;
+
+static void history_client_free(THistoryClient * client)
+{
+	g_ptr_array_free(client->msgs, TRUE);
+	g_free(client);
+}
+
+static void history_entry_free(THistoryEntry * entry)
+{
+	if (entry->parts) {
+		mem_account(MEM_HISTORY, -(gssize) (entry->parts->len *
+						    sizeof(gsize)), 0);
+		g_array_free(entry->parts, TRUE);
+	}
+	mem_account(MEM_HISTORY, -(gssize) sizeof(*entry), -1);
+	g_free(entry);
+}
+
+static THistoryClient *history_get_client(int uid)
+{
+	if (history_by_client == NULL)
+		return NULL;
+	return g_hash_table_lookup(history_by_client, GINT_TO_POINTER(uid));
+}
+
+/* Number of messages of client uid in history */
+static int history_client_count(int uid)
+{
+	THistoryClient *client = history_get_client(uid);
+
+	if (client == NULL)
+		return 0;
+	return client->msgs->len - client->first;
+}
+
+/* The n-th oldest message of client uid in history or NULL */
+static THistoryEntry *history_client_nth(int uid, int n)
+{
+	THistoryClient *client = history_get_client(uid);
 
-/* List of messages in history */
-static GList *message_history;
+	if (client == NULL || n < 0 || n >= client->msgs->len - client->first)
+		return NULL;
+	return g_ptr_array_index(client->msgs, client->first + n);
+}
+
+/* Whether the client of fd may read the history of client uid: its own, and
+ * in MultiUser mode that of the other clients of its system user */
+static gboolean history_may_read(int fd, int uid)
+{
+	TFDSetElement *settings = get_client_settings_by_fd(fd);
+	THistoryClient *client;
+
+	if (settings == NULL)
+		return FALSE;
+	if (settings->uid == uid)
+		return TRUE;
+	if (!SpeechdOptions.multi_user || settings->owner < 0)
+		return FALSE;
+	client = history_get_client(uid);
+	return client != NULL && client->owner == settings->owner;
+}
+
+/* Remove the oldest message from history */
+static void history_expire_first(void)
+{
+	THistoryEntry *entry;
+	THistoryClient *client;
+
+	assert(history_count > 0);
+	entry = message_history[history_first];
+	message_history[history_first] = NULL;
+	history_first = (history_first + 1) % history_size;
+	history_count--;
+
+	g_hash_table_remove(history_by_id, GUINT_TO_POINTER(entry->id));
+
+	/* The oldest message in history is also the oldest one of its client */
+	client = history_get_client(entry->uid);
+	assert(client != NULL);
+	assert(g_ptr_array_index(client->msgs, client->first) == entry);
+	client->first++;
+	if (client->first == client->msgs->len) {
+		g_hash_table_remove(history_by_client,
+				    GINT_TO_POINTER(entry->uid));
+	} else if (client->first >= client->msgs->len / 2) {
+		g_ptr_array_remove_range(client->msgs, 0, client->first);
+		client->first = 0;
+	}
+
+	history_entry_free(entry);
+}
+
+/* Make room in the ring buffer for size messages, expiring the oldest
+   messages that don't fit */
+static void history_resize(guint size)
+{
+	THistoryEntry **ring;
+	guint i;
+
+	while (history_count > size)
+		history_expire_first();
+
+	ring = g_malloc0(size * sizeof(THistoryEntry *));
+	for (i = 0; i < history_count; i++)
+		ring[i] = message_history[(history_first + i) % history_size];
+	g_free(message_history);
+	message_history = ring;
+	history_size = size;
+	history_first = 0;
+}
+
+/* Drop the whole history */
+static void history_clear(void)
+{
+	while (history_count > 0)
+		history_expire_first();
+	g_free(message_history);
+	message_history = NULL;
+	history_size = 0;
+	history_first = 0;
+}
+
+/* Rewrite the history file with only what is still in history, once it
+   holds twice as many texts */
+static void history_compact(void)
+{
+	static guint failed_at;
+	GPtrArray *offsets;
+	THistoryEntry *entry;
+	guint i, j;
+
+	if (history_file_texts() <= 2 * history_size + 1000
+	    || (failed_at && history_file_texts() < failed_at + 1000))
+		return;
+
+	offsets = g_ptr_array_new();
+	for (i = 0; i < history_count; i++) {
+		entry = message_history[(history_first + i) % history_size];
+		g_ptr_array_add(offsets, &entry->offset);
+		for (j = 0; entry->parts && j < entry->parts->len; j++)
+			g_ptr_array_add(offsets,
+					&g_array_index(entry->parts, gsize, j));
+	}
+	if (history_file_compact((gsize **) offsets->pdata, offsets->len) != 0)
+		failed_at = history_file_texts();
+	else
+		failed_at = 0;
+	g_ptr_array_free(offsets, TRUE);
+}
+
+/* Put a message into history, expiring the oldest one if it is full */
+static void history_add_entry(guint id, int uid, int owner, gsize offset)
+{
+	THistoryEntry *entry;
+	THistoryClient *client;
+
+	if (history_by_id == NULL) {
+		history_by_id = g_hash_table_new(g_direct_hash, g_direct_equal);
+		history_by_client =
+		    g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL,
+					  (GDestroyNotify) history_client_free);
+	}
+
+	/* Like before, always keep at least the latest message */
+	if (history_size != MAX(SpeechdOptions.max_history_messages, 1))
+		history_resize(MAX(SpeechdOptions.max_history_messages, 1));
+
+	/* Do the necessary expiration of old messages */
+	if (history_count >= history_size) {
+		MSG(5, "Discarding older history message, limit reached");
+		history_expire_first();
+	}
+
+	entry = g_new(THistoryEntry, 1);
+	entry->id = id;
+	entry->uid = uid;
+	entry->owner = owner;
+	entry->offset = offset;
+	entry->parts = NULL;
+	mem_account(MEM_HISTORY, sizeof(*entry), 1);
+
+	/* Save the message into history */
+	message_history[(history_first + history_count) % history_size] = entry;
+	history_count++;
+	g_hash_table_insert(history_by_id, GUINT_TO_POINTER(id), entry);
+
+	client = history_get_client(uid);
+	if (client == NULL) {
+		client = g_malloc(sizeof(THistoryClient));
+		client->msgs = g_ptr_array_new();
+		client->first = 0;
+		client->owner = owner;
+		g_hash_table_insert(history_by_client, GINT_TO_POINTER(uid),
+				    client);
+	}
+	g_ptr_array_add(client->msgs, entry);
+}
+
+/* Attach the next part of a split message to its entry */
+static void history_add_part(guint id, gsize offset)
+{
+	THistoryEntry *entry = NULL;
+
+	if (history_by_id)
+		entry = g_hash_table_lookup(history_by_id, GUINT_TO_POINTER(id));
+	/* Its beginning was already expired */
+	if (entry == NULL)
+		return;
+
+	if (entry->parts == NULL)
+		entry->parts = g_array_new(FALSE, FALSE, sizeof(gsize));
+	g_array_append_val(entry->parts, offset);
+	mem_account(MEM_HISTORY, sizeof(gsize), 0);
+}
+
+/* The whole text of the message of entry, to be freed */
+static char *history_entry_text(THistoryEntry * entry)
+{
+	GString *text;
+	char *part;
+	guint i;
+
+	part = history_file_get_text(entry->offset);
+	if (part == NULL)
+		return NULL;
+	text = g_string_new(part);
+	g_free(part);
+	for (i = 0; entry->parts && i < entry->parts->len; i++) {
+		part = history_file_get_text(g_array_index(entry->parts, gsize,
+							   i));
+		if (part == NULL) {
+			g_string_free(text, TRUE);
+			return NULL;
+		}
+		g_string_append(text, part);
+		g_free(part);
+	}
+
+	return g_string_free(text, FALSE);
+}
+
+static void history_load(guint id, int uid, gboolean part, gsize offset)
+{
+	if (part) {
+		history_add_part(id, offset);
+		return;
+	}
+	/* Whose they were is not recorded, they stay for their own client */
+	history_add_entry(id, uid, -1, offset);
+
+	/* Don't give the same ids again */
+	if (id > last_message_id)
+		last_message_id = id;
+	if (uid > SpeechdStatus.max_uid)
+		SpeechdStatus.max_uid = uid;
+}
+
+void history_start(void)
+{
+	const char *path = SpeechdOptions.history_file;
+	const char *current = history_file_path();
+
+	/* Keep the file over reloads of the configuration */
+	if (path && current && !strcmp(path, current))
+		return;
+
+	history_clear();
+	history_file_close();
+	if (path == NULL)
+		return;
+
+	if (history_file_open(path, history_load) != 0)
+		history_clear();
+	else
+		MSG(4, "Keeping history in %s, %u messages loaded", path,
+		    history_count);
+}
+
+void history_stop(void)
+{
+	history_clear();
+	history_file_close();
+}
 
 /* Compares TSpeechDMessage data structure elements
    with given ID */
@@ -45,18 +356,24 @@ gint message_compare_id(gconstpointer element, gconstpointer value)
 
 gint(*p_msg_comp_id) () = message_compare_id;
 
+static gint client_compare_uid(gconstpointer a, gconstpointer b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
 char *history_get_client_list()
 {
 	TFDSetElement *client;
 	GString *clist;
-	int i;
+	GList *uids, *gl;
 
 	clist = g_string_new("");
 
-	for (i = 1; i <= SpeechdStatus.max_uid; i++) {
-		MSG(4, "Getting settings for client %d of %d", i,
-		    SpeechdStatus.max_uid - 1);
-		client = get_client_settings_by_uid(i);
+	/* Only the clients which still have settings, in the order of their
+	   uids */
+	uids = g_list_sort(g_hash_table_get_keys(fd_settings), client_compare_uid);
+	for (gl = uids; gl != NULL; gl = gl->next) {
+		client = get_client_settings_by_uid(*(int *)gl->data);
 		assert(client != NULL);
 		g_string_append_printf(clist, C_OK_CLIENTS "-");
 		g_string_append_printf(clist, "%d ", client->uid);
@@ -64,6 +381,7 @@ char *history_get_client_list()
 		g_string_append_printf(clist, " %d", client->active);
 		g_string_append(clist, "\r\n");
 	}
+	g_list_free(uids);
 	g_string_append_printf(clist, OK_CLIENT_LIST_SENT);
 
 	return g_string_free(clist, FALSE);
@@ -85,87 +403,72 @@ char *history_get_client_id(int fd)
 	return g_string_free(cid, FALSE);
 }
 
-char *history_get_message(int uid)
+char *history_get_message(int fd, int id)
 {
-	/* TODO: Rework. */
-#if 0
+	THistoryEntry *entry = NULL;
 	GString *mtext;
-	GList *gl;
-	TSpeechDMessage *msg;
-	int i, pos;
-	char c;
-	char helper[1024];
-
-	mtext = g_string_new("");
+	char *text, **lines;
+	int i;
 
-	gl = g_list_find_custom(message_history, &uid, compare_message_uid);
-	if (gl == NULL)
+	if (history_by_id)
+		entry = g_hash_table_lookup(history_by_id,
+					    GUINT_TO_POINTER(id));
+	/* The messages of others are as good as gone */
+	if (entry == NULL || !history_may_read(fd, entry->uid))
 		return g_strdup(ERR_ID_NOT_EXIST);
-	if (gl->data == NULL)
+	text = history_entry_text(entry);
+	if (text == NULL)
 		return g_strdup(ERR_INTERNAL);
-	msg = (TSpeechDMessage *) gl->data;
-
-	i = 0;
-	pos = 0;
-	while (c = msg->buf[i]) {
-		helper[pos] = msg->buf[i];
-		pos++;
-		i++;
-		if (c == '\n') {
-			helper[pos - 2] = 0;
-			g_string_append_printf(mtext, C_OK_MSG_TEXT "-%s\r\n",
-					       helper);
-			pos = 0;
-		}
+
+	/* One reply line for each line of the text */
+	mtext = g_string_new("");
+	lines = g_strsplit(text, "\n", -1);
+	for (i = 0; lines[i] != NULL; i++) {
+		g_strchomp(lines[i]);
+		g_string_append_printf(mtext, C_OK_MSG_TEXT "-%s\r\n",
+				       lines[i]);
 	}
-	helper[pos] = 0;
-	g_string_append_printf(mtext, C_OK_MSG_TEXT "-%s\r\n", helper);
+	g_strfreev(lines);
+	g_free(text);
 	g_string_append_printf(mtext, OK_MSG_TEXT_SENT);
 
-#endif
-
-	return g_strdup(ERR_NOT_IMPLEMENTED);
+	return g_string_free(mtext, FALSE);
 }
 
 char *history_get_message_list(guint client_id, int from, int num)
 {
-	TSpeechDMessage *message;
+	THistoryEntry *message;
 	GString *mlist;
-	GList *gl;
 	TFDSetElement *client_settings;
-	GList *client_msgs;
+	char *client_name = NULL;
 	int i;
 
 	MSG(4, "message_list: from %d num %d, client %d\n", from, num,
 	    client_id);
 
+	/* Clients which are gone still have their history */
 	client_settings = get_client_settings_by_uid(client_id);
-	if (client_settings == NULL)
+	if (client_settings != NULL)
+		client_name = g_strdup(client_settings->client_name);
+	else if (history_client_count(client_id) > 0)
+		client_name =
+		    history_file_get_client_name(history_client_nth
+						 (client_id, 0)->offset);
+	else
 		return g_strdup(ERR_NO_SUCH_CLIENT);
 
 	mlist = g_string_new("");
 
-	client_msgs = get_messages_by_client(client_id);
-
 	for (i = from; i <= from + num - 1; i++) {
-		gl = g_list_nth(client_msgs, i);
-		if (gl == NULL) {
-			g_string_append_printf(mlist, OK_MSGS_LIST_SENT);
-			return g_string_free(mlist, FALSE);
-		}
-		message = gl->data;
-
-		if (message == NULL) {
-			if (SPEECHD_DEBUG)
-				FATAL("Internal error.\n");
-			g_string_free(mlist, TRUE);
-			return g_strdup(ERR_INTERNAL);
-		}
+		message = history_client_nth(client_id, i);
+		if (message == NULL)
+			break;
 
 		g_string_append_printf(mlist, C_OK_MSGS "-");
 		g_string_append_printf(mlist, "%d %s\r\n", message->id,
-				       client_settings->client_name);
+				       client_name ? client_name : "unknown");
 	}
+	g_free(client_name);
 
 	g_string_append_printf(mlist, OK_MSGS_LIST_SENT);
 
@@ -174,14 +477,13 @@ char *history_get_message_list(guint client_id, int from, int num)
 
 char *history_get_last(int fd)
 {
-	TSpeechDMessage *message;
+	THistoryEntry *message;
 	GString *lastm;
-	GList *gl;
 
-	gl = g_list_last(message_history);
-	if (gl == NULL)
+	if (history_count == 0)
 		return g_strdup(ERR_NO_MESSAGE);
-	message = gl->data;
+	message = message_history[(history_first + history_count - 1) %
+				  history_size];
 
 	lastm = g_string_new("");
 	g_string_append_printf(lastm, C_OK_LAST_MSG "-%d\r\n", message->id);
@@ -192,15 +494,16 @@ char *history_get_last(int fd)
 
 char *history_cursor_set_last(int fd, guint client_id)
 {
-	GList *client_msgs;
 	TFDSetElement *settings;
 
+	if (!history_may_read(fd, client_id))
+		return g_strdup(ERR_NO_SUCH_CLIENT);
+
 	settings = get_client_settings_by_fd(fd);
 	if (settings == NULL)
 		FATAL("Couldn't find settings for active client");
 
-	client_msgs = get_messages_by_client(client_id);
-	settings->hist_cur_pos = g_list_length(client_msgs) - 1;
+	settings->hist_cur_pos = history_client_count(client_id) - 1;
 	settings->hist_cur_uid = client_id;
 
 	return g_strdup(OK_CUR_SET_LAST);
@@ -210,6 +513,9 @@ char *history_cursor_set_first(int fd, guint client_id)
 {
 	TFDSetElement *settings;
 
+	if (!history_may_read(fd, client_id))
+		return g_strdup(ERR_NO_SUCH_CLIENT);
+
 	settings = get_client_settings_by_fd(fd);
 	if (settings == NULL)
 		FATAL("Couldn't find settings for active client");
@@ -222,13 +528,14 @@ char *history_cursor_set_first(int fd, guint client_id)
 char *history_cursor_set_pos(int fd, guint client_id, int pos)
 {
 	TFDSetElement *settings;
-	GList *client_msgs;
+
+	if (!history_may_read(fd, client_id))
+		return g_strdup(ERR_NO_SUCH_CLIENT);
 
 	if (pos < 0)
 		return g_strdup(ERR_POS_LOW);
 
-	client_msgs = get_messages_by_client(client_id);
-	if (pos > g_list_length(client_msgs) - 1)
+	if (pos > history_client_count(client_id) - 1)
 		return g_strdup(ERR_POS_HIGH);
 
 	settings = get_client_settings_by_fd(fd);
@@ -244,14 +551,13 @@ char *history_cursor_set_pos(int fd, guint client_id, int pos)
 char *history_cursor_forward(int fd)
 {
 	TFDSetElement *settings;
-	GList *client_msgs;
 
 	settings = get_client_settings_by_fd(fd);
 	if (settings == NULL)
 		FATAL("Couldn't find settings for active client");
 
-	client_msgs = get_messages_by_client(settings->hist_cur_uid);
-	if ((settings->hist_cur_pos + 1) > g_list_length(client_msgs) - 1)
+	if ((settings->hist_cur_pos + 1) >
+	    history_client_count(settings->hist_cur_uid) - 1)
 		return g_strdup(ERR_POS_HIGH);
 	settings->hist_cur_pos++;
 
@@ -276,19 +582,17 @@ char *history_cursor_backward(int fd)
 char *history_cursor_get(int fd)
 {
 	TFDSetElement *settings;
-	TSpeechDMessage *new;
+	THistoryEntry *new;
 	GString *reply;
-	GList *gl, *client_msgs;
 
 	settings = get_client_settings_by_fd(fd);
 	if (settings == NULL)
 		FATAL("Couldn't find settings for active client");
 
-	client_msgs = get_messages_by_client(settings->hist_cur_uid);
-	gl = g_list_nth(client_msgs, (int)settings->hist_cur_pos);
-	if (gl == NULL)
+	new = history_client_nth(settings->hist_cur_uid,
+				 (int)settings->hist_cur_pos);
+	if (new == NULL)
 		return g_strdup(ERR_NO_MESSAGE);
-	new = gl->data;
 
 	reply = g_string_new("");
 	g_string_printf(reply, C_OK_CUR_POS "-%d\r\n" OK_CUR_POS_RET, new->id);
@@ -298,15 +602,13 @@ char *history_cursor_get(int fd)
 
 char *history_say_id(int fd, int id)
 {
-	TSpeechDMessage *msg;
-	GList *gl;
+	THistoryEntry *msg;
 
-	gl = g_list_find_custom(message_history, &id, p_msg_comp_id);
-	if (gl == NULL)
+	if (history_by_id == NULL)
+		return g_strdup(ERR_ID_NOT_EXIST);
+	msg = g_hash_table_lookup(history_by_id, GUINT_TO_POINTER(id));
+	if (msg == NULL || !history_may_read(fd, msg->uid))
 		return g_strdup(ERR_ID_NOT_EXIST);
-	msg = gl->data;
-	if (msg == NULL)
-		return g_strdup(ERR_INTERNAL);
 
 	MSG(4, "putting history message into queue\n");
 	// new = (TSpeechDMessage *) spd_message_copy(msg);
@@ -315,53 +617,29 @@ char *history_say_id(int fd, int id)
 	return g_strdup(OK_MESSAGE_QUEUED);
 }
 
-int history_add_message(TSpeechDMessage * msg)
+/* Number of messages in history, element_free_mutex is held */
+guint history_get_count(void)
 {
-	TSpeechDMessage *hist_msg;
+	return history_count;
+}
 
-	/* We will make an exact copy of the message for inclusion into history. */
-	hist_msg = (TSpeechDMessage *) spd_message_copy(msg);
+int history_add_message(TSpeechDMessage * msg)
+{
+	gssize offset;
 
-	if (hist_msg == NULL) {
-		if (SPEECHD_DEBUG)
-			FATAL("Can't include message into history\n");
+	offset = history_file_add(msg);
+	if (offset < 0)
 		return -1;
-	}
 
-	/* Do the necessary expiration of old messages */
-	if (g_list_length(message_history) >=
-	    SpeechdOptions.max_history_messages) {
-		GList *gl;
-		MSG(5, "Discarding older history message, limit reached");
-		gl = g_list_first(message_history);
-		if (gl != NULL) {
-			message_history =
-			    g_list_remove_link(message_history, gl);
-			if (gl->data != NULL)
-				mem_free_message(gl->data);
-		}
+	/* The next parts of a split message share its id */
+	if (msg->segment & SEGMENT_CONT) {
+		history_add_part(msg->id, offset);
+		return 0;
 	}
-	/* Save the message into history */
-	message_history = g_list_append(message_history, hist_msg);
-	return 0;
-}
 
-GList *get_messages_by_client(int uid)
-{
-	GList *list = NULL;
-	GList *gl;
-	TSpeechDMessage *msg;
-	guint i;
-	guint history_length = g_list_length(message_history);
-
-	for (i = 0; i < history_length; i++) {
-		gl = g_list_nth(message_history, i);
-		assert(gl != NULL);
-		msg = gl->data;
-		if (msg->settings.uid == uid) {
-			list = g_list_append(list, msg);
-		}
-	}
+	history_add_entry(msg->id, msg->settings.uid, msg->settings.owner,
+			  offset);
+	history_compact();
 
-	return list;
+	return 0;
 }
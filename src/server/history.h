@@ -38,11 +38,14 @@ char *history_cursor_forward(int fd);
 char *history_cursor_backward(int fd);
 char *history_say_id(int fd, int id);
 char *history_get_client_id(int fd);
-char *history_get_message(int uid);
+char *history_get_message(int fd, int id);
 int history_add_message(TSpeechDMessage * msg);
+guint history_get_count(void);
+/* Open SpeechdOptions.history_file, element_free_mutex is held */
+void history_start(void);
+void history_stop(void);
 
 /* Internal functions */
-GList *get_messages_by_client(int uid);
 gint message_compare_id(gconstpointer element, gconstpointer value);
 
 #endif /* HISTORY_H */
@@ -0,0 +1,581 @@
+/*
+ * history_file.c - Persistent history of the messages
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include "speechd.h"
+#include "history_file.h"
+
+/* Records are aligned on 8 bytes */
+#define RECORD_SIZE(length) \
+	(((gsize) sizeof(THistoryRecord) + (length) + 7) & ~(gsize) 7)
+
+/* Shorter texts are not worth compressing */
+#define COMPRESS_MIN 64
+
+/* No settings record of that number */
+#define NO_OFFSET G_MAXSIZE
+
+static char *file_path;
+static int file_fd = -1;
+static gsize file_len;
+static char *file_map;
+static gsize file_map_len;
+static guint file_texts;
+
+/* Offsets of the settings records, by their number */
+static GArray *settings_offsets;
+
+/* Client uid -> the data of the settings record last written for it */
+static GHashTable *client_settings;
+
+typedef struct {
+	guint32 settings;
+	GString *data;
+} THistoryClientSettings;
+
+static void client_settings_free(THistoryClientSettings * cs)
+{
+	g_string_free(cs->data, TRUE);
+	g_free(cs);
+}
+
+/* Map the whole file, as it was extended since the last time */
+static int history_file_map(void)
+{
+	void *map;
+
+	if (file_map_len == file_len)
+		return 0;
+	if (file_map)
+		munmap(file_map, file_map_len);
+	file_map = NULL;
+	file_map_len = 0;
+
+	map = mmap(NULL, file_len, PROT_READ, MAP_SHARED, file_fd, 0);
+	if (map == MAP_FAILED) {
+		MSG(2, "Can't map the history file %s: %s", file_path,
+		    strerror(errno));
+		return -1;
+	}
+	file_map = map;
+	file_map_len = file_len;
+
+	return 0;
+}
+
+/* The data of the record of type at offset, or NULL if there is none */
+static const char *history_file_record(gsize offset, guint32 type,
+				       guint32 * length)
+{
+	THistoryRecord record;
+
+	if (history_file_map() != 0
+	    || offset < HISTORY_FILE_MAGIC_LEN
+	    || offset + sizeof(record) > file_map_len)
+		return NULL;
+	memcpy(&record, file_map + offset, sizeof(record));
+	*length = GUINT32_FROM_LE(record.length);
+	if (GUINT32_FROM_LE(record.type) != type
+	    || RECORD_SIZE(*length) > file_map_len - offset)
+		return NULL;
+
+	return file_map + offset + sizeof(record);
+}
+
+static int write_at(int fd, const char *buf, gsize len, gsize offset)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = pwrite(fd, buf, len, offset);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return -1;
+		buf += ret;
+		len -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+/* Append a record made of head and data, returns its offset or -1 */
+static gssize history_file_write(guint32 type, const void *head,
+				 gsize head_len, const void *data,
+				 gsize data_len)
+{
+	THistoryRecord record = {
+		.type = GUINT32_TO_LE(type),
+		.length = GUINT32_TO_LE(head_len + data_len),
+	};
+	gsize size = RECORD_SIZE(head_len + data_len);
+	char *buf = g_malloc0(size);
+	gssize offset = file_len;
+
+	memcpy(buf, &record, sizeof(record));
+	memcpy(buf + sizeof(record), head, head_len);
+	memcpy(buf + sizeof(record) + head_len, data, data_len);
+	if (write_at(file_fd, buf, size, file_len) != 0) {
+		MSG(2, "Can't write to the history file %s: %s", file_path,
+		    strerror(errno));
+		/* Don't leave half a record */
+		if (ftruncate(file_fd, file_len) != 0)
+			MSG(2, "Can't truncate the history file %s: %s",
+			    file_path, strerror(errno));
+		g_free(buf);
+		return -1;
+	}
+	g_free(buf);
+	file_len += size;
+
+	return offset;
+}
+
+/* The number of the settings record with the settings of msg, written if
+   they changed since the last message of its client */
+static int history_file_settings(TSpeechDMessage * msg, guint32 * settings)
+{
+	TFDSetElement *s = &msg->settings;
+	THistorySettingsRecord head = {
+		.uid = GINT32_TO_LE(s->uid),
+		.priority = GUINT32_TO_LE(s->priority),
+		.type = GUINT32_TO_LE(s->type),
+	};
+	THistoryClientSettings *cs;
+	GString *data = g_string_new("");
+	gssize offset;
+
+#define APPEND(str) g_string_append_len(data, (str) ? (str) : "", \
+					(str) ? strlen(str) + 1 : 1)
+	APPEND(s->client_name);
+	APPEND(s->output_module);
+	APPEND(s->msg_settings.voice.language);
+	APPEND(s->msg_settings.voice.name);
+#undef APPEND
+	/* Compared along with the strings */
+	g_string_append_len(data, (const char *)&head, sizeof(head));
+
+	cs = g_hash_table_lookup(client_settings, GINT_TO_POINTER(s->uid));
+	if (cs && g_string_equal(cs->data, data)) {
+		g_string_free(data, TRUE);
+		*settings = cs->settings;
+		return 0;
+	}
+
+	*settings = settings_offsets->len;
+	head.settings = GUINT32_TO_LE(*settings);
+	offset = history_file_write(HISTORY_RECORD_SETTINGS, &head,
+				    sizeof(head), data->str,
+				    data->len - sizeof(head));
+	if (offset < 0) {
+		g_string_free(data, TRUE);
+		return -1;
+	}
+	g_array_append_val(settings_offsets, offset);
+
+	cs = g_new(THistoryClientSettings, 1);
+	cs->settings = *settings;
+	cs->data = data;
+	g_hash_table_replace(client_settings, GINT_TO_POINTER(s->uid), cs);
+
+	return 0;
+}
+
+static const char *history_file_settings_record(guint32 settings,
+						guint32 * length)
+{
+	if (settings >= settings_offsets->len
+	    || g_array_index(settings_offsets, gsize, settings) == NO_OFFSET)
+		return NULL;
+	return history_file_record(g_array_index(settings_offsets, gsize,
+						 settings),
+				   HISTORY_RECORD_SETTINGS, length);
+}
+
+static gboolean history_file_text_record(gsize offset,
+					 THistoryTextRecord * text,
+					 const char **stored, gsize * stored_len)
+{
+	const char *data;
+	guint32 length;
+
+	data = history_file_record(offset, HISTORY_RECORD_TEXT, &length);
+	if (data == NULL || length < sizeof(*text))
+		return FALSE;
+	memcpy(text, data, sizeof(*text));
+	text->id = GUINT32_FROM_LE(text->id);
+	text->settings = GUINT32_FROM_LE(text->settings);
+	text->bytes = GUINT32_FROM_LE(text->bytes);
+	text->flags = GUINT32_FROM_LE(text->flags);
+	if (stored) {
+		*stored = data + sizeof(*text);
+		*stored_len = length - sizeof(*text);
+	}
+
+	return TRUE;
+}
+
+gssize history_file_add(TSpeechDMessage * msg)
+{
+	THistoryTextRecord text = { 0 };
+	guint32 settings, flags = 0;
+	gsize bytes = strlen(msg->buf), stored_len = bytes;
+	const char *stored = msg->buf;
+	char *compressed = NULL;
+	gssize offset;
+
+	if (file_fd < 0 || history_file_settings(msg, &settings) != 0)
+		return -1;
+
+#ifdef HAVE_LZ4
+	if (bytes >= COMPRESS_MIN && bytes <= LZ4_MAX_INPUT_SIZE) {
+		int bound = LZ4_compressBound(bytes);
+		int len;
+
+		compressed = g_malloc(bound);
+		len = LZ4_compress_default(msg->buf, compressed, bytes, bound);
+		if (len > 0 && len < bytes) {
+			stored = compressed;
+			stored_len = len;
+			flags |= HISTORY_TEXT_LZ4;
+		}
+	}
+#endif
+	if (msg->segment & SEGMENT_CONT)
+		flags |= HISTORY_TEXT_PART;
+
+	text.time = GUINT64_TO_LE(msg->time);
+	text.id = GUINT32_TO_LE(msg->id);
+	text.settings = GUINT32_TO_LE(settings);
+	text.bytes = GUINT32_TO_LE(bytes);
+	text.flags = GUINT32_TO_LE(flags);
+	offset = history_file_write(HISTORY_RECORD_TEXT, &text, sizeof(text),
+				    stored, stored_len);
+	g_free(compressed);
+	if (offset >= 0)
+		file_texts++;
+
+	return offset;
+}
+
+char *history_file_get_text(gsize offset)
+{
+	THistoryTextRecord text;
+	const char *stored;
+	gsize stored_len;
+	char *buf;
+
+	if (!history_file_text_record(offset, &text, &stored, &stored_len))
+		return NULL;
+
+	if (!(text.flags & HISTORY_TEXT_LZ4)) {
+		if (stored_len != text.bytes)
+			return NULL;
+		return g_strndup(stored, stored_len);
+	}
+
+#ifdef HAVE_LZ4
+	/* LZ4 does not compress more than that, don't trust bytes beyond */
+	if (text.bytes > stored_len * 255 + 16)
+		return NULL;
+	buf = g_malloc(text.bytes + 1);
+	if (LZ4_decompress_safe(stored, buf, stored_len, text.bytes)
+	    != text.bytes) {
+		g_free(buf);
+		return NULL;
+	}
+	buf[text.bytes] = '\0';
+	return buf;
+#else
+	(void)buf;
+	MSG(2, "Can't read compressed history, built without lz4");
+	return NULL;
+#endif
+}
+
+char *history_file_get_client_name(gsize offset)
+{
+	THistoryTextRecord text;
+	const char *data;
+	guint32 length;
+
+	if (!history_file_text_record(offset, &text, NULL, NULL))
+		return NULL;
+	data = history_file_settings_record(text.settings, &length);
+	if (data == NULL || length <= sizeof(THistorySettingsRecord))
+		return NULL;
+
+	data += sizeof(THistorySettingsRecord);
+	length -= sizeof(THistorySettingsRecord);
+	return g_strndup(data, strnlen(data, length));
+}
+
+guint history_file_texts(void)
+{
+	return file_texts;
+}
+
+const char *history_file_path(void)
+{
+	return file_path;
+}
+
+/* The uid of the client of the given settings, or 0 */
+static int history_file_settings_uid(guint32 settings)
+{
+	THistorySettingsRecord head;
+	const char *data;
+	guint32 length;
+
+	data = history_file_settings_record(settings, &length);
+	if (data == NULL || length < sizeof(head))
+		return 0;
+	memcpy(&head, data, sizeof(head));
+	return GINT32_FROM_LE(head.uid);
+}
+
+static void history_file_load(THistoryFileLoad load)
+{
+	THistoryRecord record;
+	THistorySettingsRecord head;
+	THistoryTextRecord text;
+	gsize offset = HISTORY_FILE_MAGIC_LEN, none = NO_OFFSET;
+	guint32 type, length, settings;
+	int uid;
+
+	while (offset + sizeof(record) <= file_map_len) {
+		memcpy(&record, file_map + offset, sizeof(record));
+		type = GUINT32_FROM_LE(record.type);
+		length = GUINT32_FROM_LE(record.length);
+		if (RECORD_SIZE(length) > file_map_len - offset)
+			break;
+
+		if (type == HISTORY_RECORD_SETTINGS && length >= sizeof(head)) {
+			memcpy(&head, file_map + offset + sizeof(record),
+			       sizeof(head));
+			settings = GUINT32_FROM_LE(head.settings);
+			if (settings > settings_offsets->len + 1024 * 1024)
+				break;
+			while (settings_offsets->len <= settings)
+				g_array_append_val(settings_offsets, none);
+			g_array_index(settings_offsets, gsize, settings) = offset;
+		} else if (type == HISTORY_RECORD_TEXT
+			   && history_file_text_record(offset, &text, NULL,
+						       NULL)) {
+			uid = history_file_settings_uid(text.settings);
+			file_texts++;
+			if (uid)
+				load(text.id, uid,
+				     !!(text.flags & HISTORY_TEXT_PART), offset);
+		} else if (type != HISTORY_RECORD_SETTINGS
+			   && type != HISTORY_RECORD_TEXT)
+			break;
+
+		offset += RECORD_SIZE(length);
+	}
+
+	if (offset != file_len) {
+		MSG(2, "Dropping the %zu broken bytes at the end of the "
+		    "history file %s", file_len - offset, file_path);
+		if (ftruncate(file_fd, offset) != 0)
+			MSG(2, "Can't truncate the history file %s: %s",
+			    file_path, strerror(errno));
+		file_len = offset;
+	}
+}
+
+int history_file_open(const char *path, THistoryFileLoad load)
+{
+	struct stat st;
+
+	history_file_close();
+
+	/* What was spoken is nobody else's business */
+	file_fd = g_open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (file_fd < 0 || fstat(file_fd, &st) != 0) {
+		MSG(1, "Can't open the history file %s: %s", path,
+		    strerror(errno));
+		history_file_close();
+		return -1;
+	}
+	file_path = g_strdup(path);
+	file_len = st.st_size;
+	settings_offsets = g_array_new(FALSE, FALSE, sizeof(gsize));
+	client_settings = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						NULL, (GDestroyNotify)
+						client_settings_free);
+
+	if (file_len == 0) {
+		if (write_at(file_fd, HISTORY_FILE_MAGIC,
+			     HISTORY_FILE_MAGIC_LEN, 0) != 0) {
+			MSG(1, "Can't write to the history file %s: %s", path,
+			    strerror(errno));
+			history_file_close();
+			return -1;
+		}
+		file_len = HISTORY_FILE_MAGIC_LEN;
+	}
+
+	if (history_file_map() != 0
+	    || file_len < HISTORY_FILE_MAGIC_LEN
+	    || memcmp(file_map, HISTORY_FILE_MAGIC, HISTORY_FILE_MAGIC_LEN)) {
+		MSG(1, "%s is not a history file", path);
+		history_file_close();
+		return -1;
+	}
+
+	history_file_load(load);
+
+	return 0;
+}
+
+void history_file_close(void)
+{
+	if (file_map)
+		munmap(file_map, file_map_len);
+	file_map = NULL;
+	file_map_len = 0;
+	if (file_fd >= 0)
+		close(file_fd);
+	file_fd = -1;
+	file_len = 0;
+	file_texts = 0;
+	g_free(file_path);
+	file_path = NULL;
+	if (settings_offsets)
+		g_array_free(settings_offsets, TRUE);
+	settings_offsets = NULL;
+	if (client_settings)
+		g_hash_table_destroy(client_settings);
+	client_settings = NULL;
+}
+
+/* Copy the record at offset to fd at *len */
+static int history_file_copy(int fd, gsize offset, guint32 length, gsize * len)
+{
+	if (write_at(fd, file_map + offset, RECORD_SIZE(length), *len) != 0)
+		return -1;
+	*len += RECORD_SIZE(length);
+	return 0;
+}
+
+int history_file_compact(gsize ** offsets, guint n)
+{
+	char *new_path;
+	GArray *new_settings;
+	gsize *new_offsets, len = HISTORY_FILE_MAGIC_LEN, none = NO_OFFSET;
+	THistoryTextRecord text;
+	guint32 length;
+	guint i, texts = 0;
+	int fd, ret = -1;
+
+	if (file_fd < 0 || history_file_map() != 0)
+		return -1;
+
+	new_path = g_strconcat(file_path, ".new", NULL);
+	fd = g_open(new_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		MSG(2, "Can't create %s: %s", new_path, strerror(errno));
+		g_free(new_path);
+		return -1;
+	}
+
+	new_settings = g_array_new(FALSE, FALSE, sizeof(gsize));
+	for (i = 0; i < settings_offsets->len; i++)
+		g_array_append_val(new_settings, none);
+	new_offsets = g_new(gsize, n);
+
+	if (write_at(fd, HISTORY_FILE_MAGIC, HISTORY_FILE_MAGIC_LEN, 0) != 0)
+		goto out;
+	for (i = 0; i < n; i++) {
+		new_offsets[i] = NO_OFFSET;
+		if (!history_file_text_record(*offsets[i], &text, NULL, NULL))
+			continue;
+
+		if (text.settings < new_settings->len
+		    && g_array_index(new_settings, gsize, text.settings)
+		    == NO_OFFSET
+		    && history_file_settings_record(text.settings, &length)) {
+			g_array_index(new_settings, gsize, text.settings) = len;
+			if (history_file_copy(fd, g_array_index(settings_offsets,
+								gsize,
+								text.settings),
+					      length, &len) != 0)
+				goto out;
+		}
+
+		history_file_record(*offsets[i], HISTORY_RECORD_TEXT, &length);
+		new_offsets[i] = len;
+		if (history_file_copy(fd, *offsets[i], length, &len) != 0)
+			goto out;
+		texts++;
+	}
+
+	if (fdatasync(fd) != 0 || g_rename(new_path, file_path) != 0)
+		goto out;
+
+	MSG(4, "Compacted the history file %s from %zu to %zu bytes",
+	    file_path, file_len, len);
+	for (i = 0; i < n; i++)
+		*offsets[i] = new_offsets[i];
+	munmap(file_map, file_map_len);
+	file_map = NULL;
+	file_map_len = 0;
+	close(file_fd);
+	file_fd = fd;
+	fd = -1;
+	file_len = len;
+	file_texts = texts;
+	g_array_free(settings_offsets, TRUE);
+	settings_offsets = new_settings;
+	new_settings = NULL;
+	/* Their settings may not have been kept */
+	g_hash_table_remove_all(client_settings);
+	ret = 0;
+
+out:
+	if (ret != 0) {
+		MSG(2, "Can't compact the history file %s: %s", file_path,
+		    strerror(errno));
+		g_unlink(new_path);
+	}
+	if (fd >= 0)
+		close(fd);
+	if (new_settings)
+		g_array_free(new_settings, TRUE);
+	g_free(new_offsets);
+	g_free(new_path);
+
+	return ret;
+}
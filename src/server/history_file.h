@@ -0,0 +1,89 @@
+/*
+ * history_file.h - Persistent history of the messages
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef HISTORY_FILE_H
+#define HISTORY_FILE_H
+
+#include "speechd.h"
+
+/* A history file is made of the HISTORY_FILE_MAGIC bytes, then of records,
+ * each a THistoryRecord followed by its data, padded to 8 bytes.  The
+ * settings a message was spoken with are recorded once for all the
+ * following messages of the client which have the same, and the messages
+ * only refer to them by their number.  The fields are little endian.  The
+ * file is only appended to, and read through a mapping of it. */
+
+#define HISTORY_FILE_MAGIC "SPDHIS1\n"
+#define HISTORY_FILE_MAGIC_LEN 8
+
+typedef enum {
+	HISTORY_RECORD_SETTINGS = 1,	/* THistorySettingsRecord */
+	HISTORY_RECORD_TEXT = 2,	/* THistoryTextRecord */
+} EHistoryRecordType;
+
+typedef struct {
+	guint32 type;		/* EHistoryRecordType */
+	guint32 length;		/* of the data which follows, without padding */
+} THistoryRecord;
+
+/* Followed by the client name, output module, language and voice name,
+ * each terminated by a NUL */
+typedef struct {
+	guint32 settings;	/* its number, for the text records */
+	gint32 uid;		/* of the client */
+	guint32 priority;
+	guint32 type;		/* SPDMessageType */
+} THistorySettingsRecord;
+
+#define HISTORY_TEXT_LZ4	1	/* the text is compressed */
+#define HISTORY_TEXT_PART	2	/* continues the previous text of id */
+
+/* Followed by the text */
+typedef struct {
+	guint64 time;		/* when the message was received, in s */
+	guint32 id;		/* of the message */
+	guint32 settings;	/* the settings record it was spoken with */
+	guint32 bytes;		/* of the text, once uncompressed */
+	guint32 flags;		/* HISTORY_TEXT_* */
+} THistoryTextRecord;
+
+/* Called for each text record found when opening the file */
+typedef void (*THistoryFileLoad) (guint id, int uid, gboolean part,
+				  gsize offset);
+
+/* Open the file, creating it if needed, and load its text records */
+int history_file_open(const char *path, THistoryFileLoad load);
+void history_file_close(void);
+/* The path of the opened file, or NULL */
+const char *history_file_path(void);
+
+/* Append the text of msg, returns the offset of its record or -1 */
+gssize history_file_add(TSpeechDMessage * msg);
+/* The text of the record at offset, to be freed */
+char *history_file_get_text(gsize offset);
+/* The client name of the message at offset, to be freed */
+char *history_file_get_client_name(gsize offset);
+/* Number of text records in the file */
+guint history_file_texts(void);
+
+/* Rewrite the file with only the text records at *offsets[0..n-1], in
+ * that order, and their settings, updating the offsets */
+int history_file_compact(gsize ** offsets, guint n);
+
+#endif /* HISTORY_FILE_H */
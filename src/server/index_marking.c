@@ -27,104 +27,156 @@
 
 #include "index_marking.h"
 
+/* The characters insert_index_marks() has to look at, the others are copied
+ * as they are.  They are all ASCII, so they can't be part of a multibyte
+ * UTF-8 character and the text can be scanned bytewise. */
+static const char index_mark_specials[] = "<>&.?!";
+
+/* Whether the end of a sentence at @p next deserves an index mark */
+static int index_mark_boundary(const char *next)
+{
+	if (*next == '\0')
+		return 0;
+	if (*next == '<' || *next == '&')
+		return 1;
+	return g_unichar_isspace(g_utf8_get_char(next));
+}
+
 void insert_index_marks(TSpeechDMessage * msg, SPDDataMode ssml_mode)
 {
 	GString *marked_text;
-	char *pos;
-	char character[6];
-	char character2[6];
-	gunichar u_char;
-	int n = 0;
-	int ret;
+	GArray *marks;
+	const char *pos;
+	gsize len, run;
+	guint offset;
 	int inside_tag = 0;
 
-	marked_text = g_string_new("");
-
 	assert(msg != NULL);
 	assert(msg->buf != NULL);
 
 	MSG2(5, "index_marking", "MSG before index marking: |%s|, ssml_mode=%d",
 	     msg->buf, ssml_mode);
 
+	/* Room for the text and a mark every few words, so that it is
+	   seldom reallocated */
+	len = strlen(msg->buf);
+	marked_text = g_string_sized_new(len + len / 4 + 32);
+	marks = g_array_new(FALSE, FALSE, sizeof(guint));
+
 	if (ssml_mode == SPD_DATA_TEXT)
-		g_string_printf(marked_text, "<speak>");
+		g_string_append(marked_text, "<speak>");
 
 	pos = msg->buf;
-	while (pos) {
-		ret = spd_utf8_read_char(pos, character);
-		if (ret == 0 || (strlen(character) == 0))
+	while (1) {
+		/* strcspn() is vectorized by the libc */
+		run = strcspn(pos, index_mark_specials);
+		g_string_append_len(marked_text, pos, run);
+		pos += run;
+		if (*pos == '\0')
 			break;
-		u_char = g_utf8_get_char(character);
 
-		if (u_char == '<') {
+		switch (*pos) {
+		case '<':
 			if (ssml_mode == SPD_DATA_SSML) {
 				inside_tag = 1;
-				g_string_append_printf(marked_text, "%s",
-						       character);
+				g_string_append_c(marked_text, *pos);
 			} else
-				g_string_append_printf(marked_text, "&lt;");
-		} else if (u_char == '>') {
+				g_string_append(marked_text, "&lt;");
+			break;
+		case '>':
 			if (ssml_mode == SPD_DATA_SSML) {
 				inside_tag = 0;
-				g_string_append_printf(marked_text, "%s",
-						       character);
+				g_string_append_c(marked_text, *pos);
 			} else
-				g_string_append_printf(marked_text, "&gt;");
-		} else if (u_char == '&') {
-			if (ssml_mode == SPD_DATA_SSML) {
-				g_string_append_printf(marked_text, "%s",
-						       character);
-			} else {
-				if (!inside_tag)
-					g_string_append_printf(marked_text,
-							       "&amp;");
-			}
-		} else
-		    if (((u_char == '.') || (u_char == '?') || (u_char == '!'))
-			&& !inside_tag) {
-			pos = g_utf8_find_next_char(pos, NULL);
-			ret = spd_utf8_read_char(pos, character2);
-			if ((ret == 0) || (strlen(character2) == 0)) {
-				g_string_append_printf(marked_text, "%s",
-						       character);
-				MSG2(6, "index_marking", "MSG altering 1: |%s|",
-				     marked_text->str);
-				break;
-			}
-			u_char = g_utf8_get_char(character2);
-			if ((g_unichar_isspace(u_char)) || (u_char == '<')
-			    || (u_char == '&')) {
+				g_string_append(marked_text, "&gt;");
+			break;
+		case '&':
+			if (ssml_mode == SPD_DATA_SSML)
+				g_string_append_c(marked_text, *pos);
+			else
+				g_string_append(marked_text, "&amp;");
+			break;
+		default:
+			/* The end of a sentence */
+			g_string_append_c(marked_text, *pos);
+			if (!inside_tag && index_mark_boundary(pos + 1)) {
 				g_string_append_printf(marked_text,
-						       "%s" SD_MARK_HEAD "%d"
+						       SD_MARK_HEAD "%u"
 						       SD_MARK_TAIL,
-						       character, n);
-				n++;
-				MSG2(6, "index_marking", "MSG altering 2: |%s|",
-				     marked_text->str);
-				continue;
-			} else {
-				g_string_append_printf(marked_text, "%s",
-						       character);
-				MSG2(6, "index_marking", "MSG altering 3: |%s|",
-				     marked_text->str);
-				continue;
+						       marks->len);
+				offset = marked_text->len;
+				g_array_append_val(marks, offset);
+				MSG2(6, "index_marking", "MSG mark %u at %u",
+				     marks->len - 1, offset);
 			}
-		} else {
-			g_string_append_printf(marked_text, "%s", character);
+			break;
 		}
-
-		pos = g_utf8_find_next_char(pos, NULL);
+		pos++;
 	}
 
 	if (ssml_mode == SPD_DATA_TEXT)
-		g_string_append_printf(marked_text, "</speak>");
+		g_string_append(marked_text, "</speak>");
 
 	g_free(msg->buf);
+	msg->bytes = marked_text->len;
 	msg->buf = g_string_free(marked_text, 0);
+	forget_index_marks(msg);
+	msg->index_marks = marks;
 
 	MSG2(5, "index_marking", "MSG after index marking: |%s|", msg->buf);
 }
 
+void insert_index_marks_ssml(TSpeechDMessage * msg, const SsmlText * ssml)
+{
+	GArray *marks;
+
+	assert(msg != NULL);
+
+	marks = g_array_new(FALSE, FALSE, sizeof(guint));
+	g_free(msg->buf);
+	msg->buf = ssml_serialize(ssml, marks);
+	msg->bytes = strlen(msg->buf);
+	forget_index_marks(msg);
+	msg->index_marks = marks;
+
+	MSG2(5, "index_marking", "MSG after index marking: |%s|", msg->buf);
+}
+
+void forget_index_marks(TSpeechDMessage * msg)
+{
+	if (msg->index_marks != NULL) {
+		g_array_free(msg->index_marks, TRUE);
+		msg->index_marks = NULL;
+	}
+}
+
+/* Whether index mark _mark_ is where insert_index_marks() recorded it, and
+   if so where it starts */
+static int index_mark_recorded(TSpeechDMessage * msg, int mark, guint * start)
+{
+	char str_mark[64];
+	guint offset;
+	int len;
+
+	if (msg->index_marks == NULL || mark < 0
+	    || (guint) mark >= msg->index_marks->len)
+		return 0;
+
+	len = sprintf(str_mark, SD_MARK_HEAD "%d" SD_MARK_TAIL, mark);
+	offset = g_array_index(msg->index_marks, guint, mark);
+	if (offset < (guint) len
+	    || memcmp(msg->buf + offset - len, str_mark, len)) {
+		/* Should not happen, but be safe and look for it */
+		MSG2(2, "index_marking", "Index mark %d is not at %u",
+		     mark, offset);
+		return 0;
+	}
+
+	if (start != NULL)
+		*start = offset - len;
+	return 1;
+}
+
 /* Finds the index mark specified in _mark_ . */
 char *find_index_mark(TSpeechDMessage * msg, int mark)
 {
@@ -134,6 +186,11 @@ char *find_index_mark(TSpeechDMessage * msg, int mark)
 
 	MSG(5, "Trying to find index mark %d", mark);
 
+	if (index_mark_recorded(msg, mark, NULL)) {
+		MSG(5, "Index mark found in the recorded offsets");
+		return msg->buf + g_array_index(msg->index_marks, guint, mark);
+	}
+
 	/* Fix this for variable space number */
 	sprintf(str_mark, SD_MARK_HEAD "%d" SD_MARK_TAIL, mark);
 
@@ -148,22 +205,79 @@ char *find_index_mark(TSpeechDMessage * msg, int mark)
 	return pos;
 }
 
+static GString *strip_index_marks_start(SPDDataMode ssml_mode)
+{
+	if (ssml_mode == SPD_DATA_SSML)
+		return g_string_new("<speak>");
+	else
+		return g_string_new("");
+}
+
+static char *strip_index_marks_finish(GString * str, SPDDataMode ssml_mode)
+{
+	char *p_str;
+	char *strret;
+
+	if (ssml_mode == SPD_DATA_TEXT) {
+		p_str = strstr(str->str, "</speak>");
+		if (p_str != NULL)
+			*p_str = 0;
+	}
+
+	strret = g_string_free(str, 0);
+
+	MSG2(5, "index_marking", "Message after stripping index marks: |%s|",
+	     strret);
+
+	return strret;
+}
+
+char *strip_index_marks_after(TSpeechDMessage * msg, int mark,
+			      SPDDataMode ssml_mode)
+{
+	GString *str;
+	guint from, start, i;
+	char *pos;
+
+	if (mark < 0)
+		return strip_index_marks(msg->buf, ssml_mode);
+
+	if (!index_mark_recorded(msg, mark, NULL)) {
+		pos = find_index_mark(msg, mark);
+		if (pos == NULL)
+			return NULL;
+		return strip_index_marks(pos, ssml_mode);
+	}
+
+	MSG2(5, "index_marking", "Slicing the message after index mark %d",
+	     mark);
+
+	str = strip_index_marks_start(ssml_mode);
+	from = g_array_index(msg->index_marks, guint, mark);
+	for (i = mark + 1; i < msg->index_marks->len; i++) {
+		if (!index_mark_recorded(msg, i, &start)) {
+			g_string_free(str, TRUE);
+			return strip_index_marks(msg->buf + from, ssml_mode);
+		}
+		g_string_append_len(str, msg->buf + from, start - from);
+		from = g_array_index(msg->index_marks, guint, i);
+	}
+	g_string_append(str, msg->buf + from);
+
+	return strip_index_marks_finish(str, ssml_mode);
+}
+
 /* Deletes all index marks from the given text */
 char *strip_index_marks(const char *buf, SPDDataMode ssml_mode)
 {
 	GString *str;
-	char *strret;
 
 	char str_mark[] = SD_MARK_HEAD;
 
 	const char *p;
 	const char *p_old;
-	char *p_str;
 
-	if (ssml_mode == SPD_DATA_SSML)
-		str = g_string_new("<speak>");
-	else
-		str = g_string_new("");
+	str = strip_index_marks_start(ssml_mode);
 
 	MSG2(5, "index_marking", "Message before stripping index marks: |%s|",
 	     buf);
@@ -188,16 +302,5 @@ char *strip_index_marks(const char *buf, SPDDataMode ssml_mode)
 			p++;
 	}
 
-	if (ssml_mode == SPD_DATA_TEXT) {
-		p_str = strstr(str->str, "</speak>");
-		if (p_str != NULL)
-			*p_str = 0;
-	}
-
-	strret = g_string_free(str, 0);
-
-	MSG2(5, "index_marking", "Message after stripping index marks: |%s|",
-	     strret);
-
-	return strret;
+	return strip_index_marks_finish(str, ssml_mode);
 }
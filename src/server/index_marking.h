@@ -21,6 +21,7 @@
  */
 
 #include "speechd.h"
+#include "ssml.h"
 
 #ifndef INDEX_MARKING_H
 #define INDEX_MARKING_H
@@ -30,8 +31,15 @@
 #define SD_MARK_HEAD "<mark name=\""SD_MARK_BODY
 #define SD_MARK_TAIL "\"/>"
 
-/* Insert index marks into a message. */
+/* Insert index marks into a message, recording where they are. */
 void insert_index_marks(TSpeechDMessage * msg, SPDDataMode ssml_mode);
+/* The same for an SSML message whose text is already parsed in ssml, as
+   left by insert_symbols(), so that it doesn't have to be parsed again. */
+void insert_index_marks_ssml(TSpeechDMessage * msg, const SsmlText * ssml);
+
+/* Drop the positions of the index marks of a message, to be called
+   whenever its buffer gets replaced. */
+void forget_index_marks(TSpeechDMessage * msg);
 
 /* Find the index mark specified as _mark_ and return the
 rest of the text after that index mark. */
@@ -41,4 +49,11 @@ char *find_index_mark(TSpeechDMessage * msg, int mark);
    allocated string. */
 char *strip_index_marks(const char *buf, SPDDataMode ssml_mode);
 
+/* Return a newly allocated string of the text of _msg_ after the index mark
+   _mark_ (the whole text if negative) without its index marks, or NULL if
+   there is no such mark.  This uses the positions recorded by
+   insert_index_marks() when possible. */
+char *strip_index_marks_after(TSpeechDMessage * msg, int mark,
+			      SPDDataMode ssml_mode);
+
 #endif /* INDEX_MARKING_H */
@@ -0,0 +1,241 @@
+/*
+ * latency.c - Measuring where time goes before a message is heard
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Each message carries the times at which it reached the stages of
+ * ELatencyStage until it gets spoken.  From then on the module reader and
+ * the playback threads record the next stages in the trace of the message
+ * being spoken, and once it is over the time spent until each stage is
+ * added to the histograms returned by GET STATISTICS.  It is also logged
+ * at level 5 with the kind "latency", for CustomLogFile.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "speechd.h"
+#include "msg.h"
+#include "latency.h"
+
+/* Bucket n counts the durations of n bits in microseconds, the last one
+ * also the longer ones (from about 4s) */
+#define LATENCY_BUCKETS 24
+
+typedef struct {
+	guint count;
+	gint64 sum;
+	gint64 max;
+	guint buckets[LATENCY_BUCKETS];
+} TLatencyHistogram;
+
+static const char *const latency_stage_names[LATENCY_STAGES] = {
+	"received", "queued", "dequeued", "settings_sent", "speak_sent",
+	"begin", "first_audio", "first_write"
+};
+
+/* Time until each stage from the stage reached before it, and from
+ * LATENCY_RECEIVED to the last stage reached for the total */
+static TLatencyHistogram latency_histograms[LATENCY_STAGES];
+static TLatencyHistogram latency_total;
+
+/* The trace of the message being spoken */
+static TLatencyTrace latency_current;
+static guint latency_current_id;
+static gboolean latency_current_active;
+
+static pthread_mutex_t latency_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void latency_trace_init(TLatencyTrace * trace)
+{
+	memset(trace, 0, sizeof(*trace));
+	trace->at[LATENCY_RECEIVED] = g_get_monotonic_time();
+}
+
+void latency_mark(TLatencyTrace * trace, ELatencyStage stage)
+{
+	if (!trace->at[stage])
+		trace->at[stage] = g_get_monotonic_time();
+}
+
+static void latency_histogram_add(TLatencyHistogram * histogram,
+				  gint64 duration)
+{
+	int bucket = 0;
+
+	if (duration < 0)
+		duration = 0;
+	while (bucket < LATENCY_BUCKETS - 1 && duration >> bucket)
+		bucket++;
+
+	histogram->count++;
+	histogram->sum += duration;
+	histogram->max = MAX(histogram->max, duration);
+	histogram->buckets[bucket]++;
+}
+
+/* Account the trace of the message being spoken, latency_mutex is held */
+static void latency_account_current(void)
+{
+	GString *log = NULL;
+	gint64 last;
+	int stage;
+
+	if (!latency_current_active)
+		return;
+	latency_current_active = FALSE;
+
+	last = latency_current.at[LATENCY_RECEIVED];
+	if (!last)
+		return;
+
+	if (SpeechdOptions.log_level >= 5 || custom_log_kind != NULL)
+		log = g_string_new("");
+	for (stage = LATENCY_RECEIVED + 1; stage < LATENCY_STAGES; stage++) {
+		gint64 at = latency_current.at[stage];
+
+		if (!at)
+			continue;
+		latency_histogram_add(&latency_histograms[stage], at - last);
+		if (log)
+			g_string_append_printf(log, " %s +%" G_GINT64_FORMAT "us",
+					       latency_stage_names[stage],
+					       at - last);
+		last = at;
+	}
+	latency_histogram_add(&latency_total,
+			      last - latency_current.at[LATENCY_RECEIVED]);
+
+	if (log) {
+		MSG2(5, "latency", "Latency of message %u:%s, total %"
+		     G_GINT64_FORMAT "us", latency_current_id, log->str,
+		     last - latency_current.at[LATENCY_RECEIVED]);
+		g_string_free(log, TRUE);
+	}
+}
+
+void latency_speaking(TLatencyTrace * trace, guint msg_id)
+{
+	pthread_mutex_lock(&latency_mutex);
+	latency_account_current();
+	latency_current = *trace;
+	latency_current_id = msg_id;
+	latency_current_active = TRUE;
+	pthread_mutex_unlock(&latency_mutex);
+}
+
+void latency_mark_speaking(ELatencyStage stage)
+{
+	pthread_mutex_lock(&latency_mutex);
+	if (latency_current_active)
+		latency_mark(&latency_current, stage);
+	pthread_mutex_unlock(&latency_mutex);
+}
+
+void latency_speaking_done(void)
+{
+	pthread_mutex_lock(&latency_mutex);
+	latency_account_current();
+	pthread_mutex_unlock(&latency_mutex);
+}
+
+void latency_first_write(void)
+{
+	latency_mark_speaking(LATENCY_FIRST_WRITE);
+}
+
+static void latency_histogram_print(GString * result, const char *name,
+				    const TLatencyHistogram * histogram)
+{
+	int bucket;
+
+	g_string_append_printf(result, C_OK_GET "-%s %u", name,
+			       histogram->count);
+	if (histogram->count) {
+		g_string_append_printf(result, " avg=%" G_GINT64_FORMAT
+				       "us max=%" G_GINT64_FORMAT "us",
+				       histogram->sum / histogram->count,
+				       histogram->max);
+		for (bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++)
+			if (histogram->buckets[bucket])
+				g_string_append_printf(result, " <%luus:%u",
+						       1UL << bucket,
+						       histogram->buckets
+						       [bucket]);
+		if (histogram->buckets[bucket])
+			g_string_append_printf(result, " >=%luus:%u",
+					       1UL << (bucket - 1),
+					       histogram->buckets[bucket]);
+	}
+	g_string_append(result, NEWLINE);
+}
+
+static void latency_histogram_metrics(GString * out, const char *stage,
+				      const TLatencyHistogram * histogram)
+{
+	guint cumulated = 0;
+	int bucket;
+
+	for (bucket = 0; bucket < LATENCY_BUCKETS - 1; bucket++) {
+		cumulated += histogram->buckets[bucket];
+		g_string_append_printf(out, "speechd_latency_seconds_bucket"
+				       "{stage=\"%s\",le=\"%g\"} %u\n", stage,
+				       (double)(1UL << bucket) / G_USEC_PER_SEC,
+				       cumulated);
+	}
+	g_string_append_printf(out, "speechd_latency_seconds_bucket"
+			       "{stage=\"%s\",le=\"+Inf\"} %u\n"
+			       "speechd_latency_seconds_sum{stage=\"%s\"} %g\n"
+			       "speechd_latency_seconds_count{stage=\"%s\"} %u\n",
+			       stage, histogram->count, stage,
+			       (double)histogram->sum / G_USEC_PER_SEC, stage,
+			       histogram->count);
+}
+
+void latency_metrics(GString * out)
+{
+	int stage;
+
+	g_string_append(out, "# HELP speechd_latency_seconds Time the spoken "
+			"messages took to reach each stage from the previous "
+			"one, see GET STATISTICS.\n"
+			"# TYPE speechd_latency_seconds histogram\n");
+	pthread_mutex_lock(&latency_mutex);
+	for (stage = LATENCY_RECEIVED + 1; stage < LATENCY_STAGES; stage++)
+		latency_histogram_metrics(out, latency_stage_names[stage],
+					  &latency_histograms[stage]);
+	latency_histogram_metrics(out, "total", &latency_total);
+	pthread_mutex_unlock(&latency_mutex);
+}
+
+char *latency_statistics(void)
+{
+	GString *result = g_string_new("");
+	int stage;
+
+	pthread_mutex_lock(&latency_mutex);
+	for (stage = LATENCY_RECEIVED + 1; stage < LATENCY_STAGES; stage++)
+		latency_histogram_print(result, latency_stage_names[stage],
+					&latency_histograms[stage]);
+	latency_histogram_print(result, "total", &latency_total);
+	pthread_mutex_unlock(&latency_mutex);
+
+	g_string_append(result, OK_GET);
+	return g_string_free(result, FALSE);
+}
@@ -0,0 +1,70 @@
+/*
+ * latency.h - Measuring where time goes before a message is heard
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef LATENCY_H
+#define LATENCY_H
+
+#include <glib.h>
+
+/* The steps of a message from the client to the audio device, in order */
+typedef enum {
+	LATENCY_RECEIVED,	/* Its text was read from the client */
+	LATENCY_QUEUED,		/* Put in the priority queues */
+	LATENCY_DEQUEUED,	/* Taken by speak() */
+	LATENCY_SETTINGS_SENT,	/* The module got the settings */
+	LATENCY_SPEAK_SENT,	/* The module got the text */
+	LATENCY_BEGIN,		/* The module reported 701 BEGIN */
+	LATENCY_FIRST_AUDIO,	/* The first 705 audio came from the module */
+	LATENCY_FIRST_WRITE,	/* The first samples went to the audio device */
+	LATENCY_STAGES
+} ELatencyStage;
+
+/* When a message reached each stage, in g_get_monotonic_time() units, or 0
+ * when it did not (e.g. modules playing audio themselves send none) */
+typedef struct {
+	gint64 at[LATENCY_STAGES];
+} TLatencyTrace;
+
+/* Start a trace at LATENCY_RECEIVED */
+void latency_trace_init(TLatencyTrace * trace);
+
+/* Record that the message of trace reached stage now, unless it did
+ * already */
+void latency_mark(TLatencyTrace * trace, ELatencyStage stage);
+
+/* The module now speaks the message of trace, the next stages are recorded
+ * with latency_mark_speaking().  The trace of the message spoken before is
+ * accounted if it was not yet. */
+void latency_speaking(TLatencyTrace * trace, guint msg_id);
+void latency_mark_speaking(ELatencyStage stage);
+
+/* The message being spoken is over, account its trace */
+void latency_speaking_done(void);
+
+/* For module_speak_queue_set_first_write_callback() */
+void latency_first_write(void);
+
+/* Reply to GET STATISTICS: the durations between the stages, as
+ * histograms */
+char *latency_statistics(void);
+
+/* The same histograms in the Prometheus text format */
+void latency_metrics(GString * out);
+
+#endif /* LATENCY_H */
@@ -0,0 +1,339 @@
+/*
+ * metrics.c - Counters of the server exported for monitoring
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The counters are only incremented atomically where things happen.  With
+ * MetricsInterval, the main loop writes them every so many seconds to the
+ * metrics.prom file of the runtime directory, in the Prometheus text format
+ * (e.g. for the textfile collector of node_exporter), along with the
+ * queue depths and the latency histograms of latency.c.  The file is
+ * replaced atomically, so that it can be read at any time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib/gstdio.h>
+
+#include "speechd.h"
+#include "history.h"
+#include "speak_queue.h"
+#include "latency.h"
+#include "metrics.h"
+#include "output.h"
+#include "symbols.h"
+
+guint metrics_counters[METRICS_COUNTERS];
+guint metrics_messages[SPD_PROGRESS];
+
+static guint metrics_source;
+static char *metrics_file;
+
+static const char *const metrics_priorities[SPD_PROGRESS] = {
+	"important", "message", "text", "notification", "progress"
+};
+
+static void metrics_print_counter(GString * out, const char *name,
+				  const char *help, guint value)
+{
+	g_string_append_printf(out, "# HELP speechd_%s %s\n"
+			       "# TYPE speechd_%s counter\n"
+			       "speechd_%s %u\n", name, help, name, name, value);
+}
+
+static void metrics_print_by_priority(GString * out, const char *name,
+				      const char *type, const char *help,
+				      const guint * values)
+{
+	int i;
+
+	g_string_append_printf(out, "# HELP speechd_%s %s\n"
+			       "# TYPE speechd_%s %s\n", name, help, name, type);
+	for (i = 0; i < SPD_PROGRESS; i++)
+		g_string_append_printf(out, "speechd_%s{priority=\"%s\"} %u\n",
+				       name, metrics_priorities[i], values[i]);
+}
+
+/* In the order of the series of metrics_print_audio() */
+static void metrics_audio_values(const SPDSpeakQueueStats * stats,
+				 double *values)
+{
+	values[0] = stats->messages;
+	values[1] = stats->underruns;
+	values[2] = stats->underrun_us / 1e6;
+	values[3] = stats->underrun_max_us / 1e6;
+	values[4] = stats->first_audio_us / 1e6;
+	values[5] = stats->first_audio_max_us / 1e6;
+	values[6] = stats->xruns;
+	values[7] = stats->suspends;
+}
+
+/* What the speak queue saw of the audio of each module played by the
+ * server, and of them all without a module label */
+static void metrics_print_audio(GString * out)
+{
+	static const struct {
+		const char *name, *type, *help;
+	} series[] = {
+		{"audio_messages_total", "counter",
+		 "Messages whose audio was played by the server."},
+		{"speak_queue_underruns_total", "counter",
+		 "Times the speak queue ran out of audio while playing a "
+		 "message."},
+		{"speak_queue_underrun_seconds_total", "counter",
+		 "Time spent waiting for audio in the middle of messages."},
+		{"speak_queue_underrun_max_seconds", "gauge",
+		 "Longest wait for audio in the middle of a message."},
+		{"audio_first_seconds_total", "counter",
+		 "Time from the beginning of messages to their first audio."},
+		{"audio_first_max_seconds", "gauge",
+		 "Longest time from the beginning of a message to its first "
+		 "audio."},
+		{"audio_xruns_total", "counter",
+		 "Times the audio device ran out of audio."},
+		{"audio_suspends_total", "counter",
+		 "Times the audio device got suspended."},
+	};
+	SPDSpeakQueueStats stats;
+	double values[G_N_ELEMENTS(series)];
+	GList *gl;
+	unsigned i;
+
+	for (i = 0; i < G_N_ELEMENTS(series); i++) {
+		g_string_append_printf(out, "# HELP speechd_%s %s\n"
+				       "# TYPE speechd_%s %s\n", series[i].name,
+				       series[i].help, series[i].name,
+				       series[i].type);
+		for (gl = output_modules; gl != NULL; gl = gl->next) {
+			OutputModule *module = gl->data;
+
+			module_speak_queue_get_stats(&module->audio_stats,
+						     &stats);
+			metrics_audio_values(&stats, values);
+			g_string_append_printf(out, "speechd_%s{module=\"%s\"} "
+					       "%.15g\n", series[i].name,
+					       module->name, values[i]);
+		}
+		module_speak_queue_get_stats(NULL, &stats);
+		metrics_audio_values(&stats, values);
+		g_string_append_printf(out, "speechd_%s %.15g\n",
+				       series[i].name, values[i]);
+	}
+}
+
+/* The traffic with each module, see output_get_traffic() */
+static void metrics_print_traffic(GString * out)
+{
+	static const char *const commands[OUTPUT_CMDS] = {
+		"set", "speak", "stop"
+	};
+	static const struct {
+		const char *name, *help;
+	} series[] = {
+		{"module_sent_bytes_total", "Bytes sent to the output module."},
+		{"module_received_bytes_total",
+		 "Bytes received from the output module."},
+		{"module_replies_total", "Replies of the output module."},
+		{"module_events_total", "Events reported by the output module."},
+		{"module_audio_bytes_total",
+		 "Bytes of samples received from the output module."},
+	};
+	OutputModuleTraffic traffic;
+	GList *gl;
+	unsigned i;
+	int cmd;
+
+	for (i = 0; i < G_N_ELEMENTS(series); i++) {
+		g_string_append_printf(out, "# HELP speechd_%s %s\n"
+				       "# TYPE speechd_%s counter\n",
+				       series[i].name, series[i].help,
+				       series[i].name);
+		for (gl = output_modules; gl != NULL; gl = gl->next) {
+			OutputModule *module = gl->data;
+			guint64 values[G_N_ELEMENTS(series)];
+
+			output_get_traffic(module, &traffic);
+			values[0] = traffic.bytes_sent;
+			values[1] = traffic.bytes_received;
+			values[2] = traffic.replies;
+			values[3] = traffic.events;
+			values[4] = traffic.audio_bytes;
+			g_string_append_printf(out, "speechd_%s{module=\"%s\"} %"
+					       G_GUINT64_FORMAT "\n",
+					       series[i].name, module->name,
+					       values[i]);
+		}
+	}
+
+	g_string_append(out, "# HELP speechd_module_command_seconds Round "
+			"trips of the commands to the output module.\n"
+			"# TYPE speechd_module_command_seconds summary\n");
+	for (gl = output_modules; gl != NULL; gl = gl->next) {
+		OutputModule *module = gl->data;
+
+		output_get_traffic(module, &traffic);
+		for (cmd = 0; cmd < OUTPUT_CMDS; cmd++)
+			g_string_append_printf(out, "speechd_module_command_seconds"
+					       "_sum{module=\"%s\",command=\"%s\"}"
+					       " %g\n"
+					       "speechd_module_command_seconds"
+					       "_count{module=\"%s\",command=\"%s\"}"
+					       " %u\n", module->name,
+					       commands[cmd],
+					       traffic.command_us[cmd] / 1e6,
+					       module->name, commands[cmd],
+					       traffic.commands[cmd]);
+	}
+	g_string_append(out, "# HELP speechd_module_command_max_seconds Longest "
+			"round trip of a command to the output module.\n"
+			"# TYPE speechd_module_command_max_seconds gauge\n");
+	for (gl = output_modules; gl != NULL; gl = gl->next) {
+		OutputModule *module = gl->data;
+
+		output_get_traffic(module, &traffic);
+		for (cmd = 0; cmd < OUTPUT_CMDS; cmd++)
+			g_string_append_printf(out, "speechd_module_command_max"
+					       "_seconds{module=\"%s\","
+					       "command=\"%s\"} %g\n",
+					       module->name, commands[cmd],
+					       traffic.command_max_us[cmd] / 1e6);
+	}
+}
+
+/* What the subsystems hold, see mem_account() */
+static void metrics_print_memory(GString * out)
+{
+	gsize bytes[MEM_SUBSYSTEMS];
+	guint objects[MEM_SUBSYSTEMS];
+	int i;
+
+	for (i = 0; i < MEM_SUBSYSTEMS; i++)
+		mem_usage(i, &bytes[i], &objects[i]);
+
+	g_string_append(out, "# HELP speechd_memory_bytes Memory held by "
+			"each subsystem.\n"
+			"# TYPE speechd_memory_bytes gauge\n");
+	for (i = 0; i < MEM_SUBSYSTEMS; i++)
+		g_string_append_printf(out, "speechd_memory_bytes"
+				       "{subsystem=\"%s\"} %zu\n",
+				       mem_subsystem_name(i), bytes[i]);
+	g_string_append(out, "# HELP speechd_memory_objects Objects held by "
+			"each subsystem.\n"
+			"# TYPE speechd_memory_objects gauge\n");
+	for (i = 0; i < MEM_SUBSYSTEMS; i++)
+		g_string_append_printf(out, "speechd_memory_objects"
+				       "{subsystem=\"%s\"} %u\n",
+				       mem_subsystem_name(i), objects[i]);
+}
+
+static gboolean metrics_write(gpointer user_data)
+{
+	GString *out = g_string_sized_new(4096);
+	GError *error = NULL;
+	guint messages[SPD_PROGRESS];
+	guint depths[SPD_PROGRESS];
+	guint history;
+	guint symbols_hits, symbols_misses;
+	int i;
+
+	for (i = 0; i < SPD_PROGRESS; i++)
+		messages[i] = g_atomic_int_get(&metrics_messages[i]);
+
+	pthread_mutex_lock(&element_free_mutex);
+	depths[0] = g_queue_get_length(MessageQueue->p1);
+	depths[1] = g_queue_get_length(MessageQueue->p2);
+	depths[2] = g_queue_get_length(MessageQueue->p3);
+	depths[3] = g_queue_get_length(MessageQueue->p4);
+	depths[4] = g_queue_get_length(MessageQueue->p5);
+	history = history_get_count();
+	pthread_mutex_unlock(&element_free_mutex);
+
+	metrics_print_by_priority(out, "messages_total", "counter",
+				  "Messages received from the clients.",
+				  messages);
+	metrics_print_by_priority(out, "queue_depth", "gauge",
+				  "Messages waiting to be spoken.", depths);
+	metrics_print_counter(out, "canceled_total",
+			      "Messages canceled or stopped.",
+			      g_atomic_int_get(&metrics_counters
+					       [METRICS_CANCELED]));
+	metrics_print_counter(out, "module_restarts_total",
+			      "Output modules reloaded after they died.",
+			      g_atomic_int_get(&metrics_counters
+					       [METRICS_MODULE_RESTARTS]));
+	metrics_print_counter(out, "connections_total",
+			      "Client connections accepted.",
+			      g_atomic_int_get(&metrics_counters
+					       [METRICS_CONNECTIONS]));
+	g_string_append_printf(out, "# HELP speechd_clients Connected clients.\n"
+			       "# TYPE speechd_clients gauge\n"
+			       "speechd_clients %d\n", client_count);
+	g_string_append_printf(out, "# HELP speechd_history_messages "
+			       "Messages kept in history.\n"
+			       "# TYPE speechd_history_messages gauge\n"
+			       "speechd_history_messages %u\n", history);
+	symbols_cache_stats(&symbols_hits, &symbols_misses);
+	metrics_print_counter(out, "symbols_cache_hits_total",
+			      "Texts whose symbols were found preprocessed.",
+			      symbols_hits);
+	metrics_print_counter(out, "symbols_cache_misses_total",
+			      "Texts whose symbols had to be preprocessed.",
+			      symbols_misses);
+	metrics_print_audio(out);
+	metrics_print_traffic(out);
+	metrics_print_memory(out);
+	latency_metrics(out);
+
+	if (!g_file_set_contents(metrics_file, out->str, out->len, &error)) {
+		MSG(3, "Can't write metrics to %s: %s", metrics_file,
+		    error->message);
+		g_error_free(error);
+	}
+	g_string_free(out, TRUE);
+	return TRUE;
+}
+
+void metrics_start(void)
+{
+	metrics_stop();
+	if (SpeechdOptions.metrics_interval <= 0
+	    || SpeechdOptions.runtime_speechd_dir == NULL)
+		return;
+
+	metrics_file = g_strdup_printf("%s/metrics.prom",
+				       SpeechdOptions.runtime_speechd_dir);
+	MSG(4, "Writing metrics to %s every %d s", metrics_file,
+	    SpeechdOptions.metrics_interval);
+	metrics_source = g_timeout_add_seconds(SpeechdOptions.metrics_interval,
+					       metrics_write, NULL);
+}
+
+void metrics_stop(void)
+{
+	if (metrics_source) {
+		g_source_remove(metrics_source);
+		metrics_source = 0;
+	}
+	if (metrics_file) {
+		g_unlink(metrics_file);
+		g_free(metrics_file);
+		metrics_file = NULL;
+	}
+}
@@ -0,0 +1,53 @@
+/*
+ * metrics.h - Counters of the server exported for monitoring
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "speechd.h"
+
+typedef enum {
+	METRICS_CANCELED,	/* Messages canceled or stopped */
+	METRICS_MODULE_RESTARTS,	/* Dead modules reloaded */
+	METRICS_CONNECTIONS,	/* Clients which connected */
+	METRICS_COUNTERS
+} EMetricsCounter;
+
+extern guint metrics_counters[METRICS_COUNTERS];
+/* Messages received, indexed by priority - 1 */
+extern guint metrics_messages[SPD_PROGRESS];
+
+static inline void metrics_count(EMetricsCounter counter)
+{
+	g_atomic_int_inc((gint *) & metrics_counters[counter]);
+}
+
+static inline void metrics_count_message(SPDPriority priority)
+{
+	g_atomic_int_inc((gint *) & metrics_messages[priority - 1]);
+}
+
+/* Write the metrics file every MetricsInterval seconds, or stop to if it
+ * is 0, according to the configuration just read */
+void metrics_start(void);
+
+/* Remove the metrics file */
+void metrics_stop(void);
+
+#endif /* METRICS_H */
@@ -0,0 +1,391 @@
+/*
+ * microbench.c - Measure the text transformations of the server
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is linked with the objects of the server, built without its main(),
+ * and runs insert_symbols(), insert_index_marks(), escape_dot(),
+ * deescape_dot() and parse() over a few fixed corpora, without any client
+ * or module.  It prints on stdout the time per byte and per call, and the
+ * allocations per call, as JSON.  The symbols are read from the locale
+ * directory of the source tree.
+ *
+ * The functions which take over or modify their input are given a copy of
+ * the corpus, whose cost is measured apart and subtracted.  The corpora are
+ * bigger than what the symbols cache keeps by default, so that the symbols
+ * are really processed each time.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <time.h>
+
+#include "speechd.h"
+#include "configuration.h"
+#include "index_marking.h"
+#include "symbols.h"
+#include "output.h"
+#include "parse.h"
+#include "set.h"
+
+/* Allocations are counted by wrapping those of the libc */
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static gint bench_allocs;
+
+void *malloc(size_t size)
+{
+	g_atomic_int_inc(&bench_allocs);
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	g_atomic_int_inc(&bench_allocs);
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	g_atomic_int_inc(&bench_allocs);
+	return __libc_realloc(ptr, size);
+}
+
+#define BENCH_ALLOCS() g_atomic_int_get(&bench_allocs)
+#else
+#define BENCH_ALLOCS() 0
+#endif
+
+typedef struct {
+	const char *name;
+	const char *seed;	/* Repeated until the corpus is big enough */
+	SPDDataMode ssml_mode;
+	char *text;
+	size_t bytes;
+	char *escaped;		/* With the dots escaped as on the socket */
+} BenchCorpus;
+
+static BenchCorpus bench_corpora[] = {
+	{"text",
+	 "The quick brown fox jumps over the lazy dog.  Is it not?  It is!\n"
+	 ".A line starting with a dot, and the next one.\n",
+	 SPD_DATA_TEXT},
+	{"ssml",
+	 "<s>The <emphasis>quick</emphasis> brown fox <mark name=\"m\"/>jumps"
+	 " over the &lt;lazy&gt; dog.</s> <s>Is it not? It is!</s>\n",
+	 SPD_DATA_SSML},
+	{"code",
+	 "if (a->b[i] != NULL && (x & 0x1f) <= 3) { *p++ = ~y % 2; }\n"
+	 "#define CAT(a, b) a##b /* \"quoted\" 'c' */ // ok? [$@^|]\n",
+	 SPD_DATA_TEXT},
+	{"cjk",
+	 "今天天气很好。我们去公园散步吧！你觉得怎么样？"
+	 "東京は晴れです。「こんにちは」と言いました。\n",
+	 SPD_DATA_TEXT},
+};
+
+static const char *const bench_commands[] = {
+	"SET SELF RATE 20\r\n",
+	"SET SELF PUNCTUATION most\r\n",
+	"SET SELF PRIORITY text\r\n",
+	"GET RATE\r\n",
+	"HELP\r\n",
+};
+
+static int iterations = 1000;
+static size_t corpus_size = 2048;
+static const char *locales = "en,de,fr,ja,zh_CN";
+
+/* The fake client parse() runs for */
+#define BENCH_FD 1000
+
+static gint64 bench_now_ns(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * G_GINT64_CONSTANT(1000000000) + now.tv_nsec;
+}
+
+typedef struct {
+	double ns;		/* Per call */
+	double allocs;		/* Per call */
+} BenchResult;
+
+typedef void (*BenchFunc) (BenchCorpus * corpus, gpointer data);
+
+static BenchResult bench_run(BenchFunc func, BenchCorpus * corpus,
+			     gpointer data)
+{
+	BenchResult result;
+	guint allocs;
+	gint64 start;
+	int i;
+
+	/* Let caches and lazily loaded tables settle */
+	func(corpus, data);
+
+	allocs = BENCH_ALLOCS();
+	start = bench_now_ns();
+	for (i = 0; i < iterations; i++)
+		func(corpus, data);
+	result.ns = (double)(bench_now_ns() - start) / iterations;
+	result.allocs = (double)(BENCH_ALLOCS() - allocs) / iterations;
+
+	return result;
+}
+
+static void bench_copy(BenchCorpus * corpus, gpointer data)
+{
+	g_free(g_strdup(corpus->text));
+}
+
+/* Run func, which copies the corpus, and print its results without the
+ * cost of the copy */
+static void bench_print(const char *indent, const char *name,
+			BenchFunc func, BenchCorpus * corpus, gpointer data,
+			size_t bytes, gboolean copies, gboolean last)
+{
+	BenchResult result = bench_run(func, corpus, data);
+
+	if (copies) {
+		BenchResult copy = bench_run(bench_copy, corpus, NULL);
+
+		result.ns = MAX(result.ns - copy.ns, 0);
+		result.allocs = MAX(result.allocs - copy.allocs, 0);
+	}
+
+	printf("%s\"%s\": {\"bytes\": %zu, \"ns_per_byte\": %.3f, "
+	       "\"ns_per_call\": %.1f, \"allocs_per_call\": %.2f}%s\n",
+	       indent, name, bytes, result.ns / bytes, result.ns,
+	       result.allocs, last ? "" : ",");
+}
+
+static void bench_message_init(TSpeechDMessage * msg, BenchCorpus * corpus,
+			       const char *language)
+{
+	memset(msg, 0, sizeof(*msg));
+	msg->buf = g_strdup(corpus->text);
+	msg->bytes = corpus->bytes;
+	msg->settings.type = SPD_MSGTYPE_TEXT;
+	msg->settings.ssml_mode = corpus->ssml_mode;
+	msg->settings.symbols_preprocessing = SYMLVL_CHAR;
+	msg->settings.msg_settings.punctuation_mode = SPD_PUNCT_ALL;
+	msg->settings.msg_settings.voice.language = (char *)language;
+}
+
+static void bench_insert_symbols(BenchCorpus * corpus, gpointer data)
+{
+	TSpeechDMessage msg;
+
+	bench_message_init(&msg, corpus, data);
+	insert_symbols(&msg, 0, NULL);
+	g_free(msg.buf);
+}
+
+static void bench_insert_index_marks(BenchCorpus * corpus, gpointer data)
+{
+	TSpeechDMessage msg;
+
+	bench_message_init(&msg, corpus, "en");
+	insert_index_marks(&msg, corpus->ssml_mode);
+	forget_index_marks(&msg);
+	g_free(msg.buf);
+}
+
+static void bench_escape_dot(BenchCorpus * corpus, gpointer data)
+{
+	char *copy = g_strdup(corpus->text);
+	char *escaped = escape_dot(copy);
+
+	if (escaped != copy)
+		g_free(escaped);
+	g_free(copy);
+}
+
+static void bench_deescape_dot(BenchCorpus * corpus, gpointer data)
+{
+	g_free(deescape_dot(corpus->escaped, strlen(corpus->escaped)));
+}
+
+static void bench_parse(BenchCorpus * corpus, gpointer data)
+{
+	const char *command = data;
+
+	g_free(parse(command, strlen(command), BENCH_FD));
+}
+
+static void corpus_init(BenchCorpus * corpus)
+{
+	GString *text = g_string_new("");
+	char *copy, *escaped, **lines;
+
+	if (corpus->ssml_mode == SPD_DATA_SSML)
+		g_string_append(text, "<speak>");
+	while (text->len < corpus_size)
+		g_string_append(text, corpus->seed);
+	if (corpus->ssml_mode == SPD_DATA_SSML)
+		g_string_append(text, "</speak>");
+	corpus->bytes = text->len;
+	corpus->text = g_string_free(text, FALSE);
+
+	/* What a client sends: dots escaped, and CRLF line ends */
+	copy = g_strdup(corpus->text);
+	escaped = escape_dot(copy);
+	lines = g_strsplit(escaped, "\n", -1);
+	corpus->escaped = g_strjoinv("\r\n", lines);
+	g_strfreev(lines);
+	if (escaped != copy)
+		g_free(escaped);
+	g_free(copy);
+}
+
+/* Set up what the functions need of the server, and a client for parse() */
+static void bench_init(void)
+{
+	TFDSetElement *settings;
+	int *fd, *uid, *uid2;
+	const char *const *file;
+	static const char *const symbols_files[] = {
+		"gender-neutral.dic", "font-variants.dic", "symbols.dic",
+		"emojis.dic", "orca.dic", "orca-chars.dic", NULL
+	};
+
+	speechd_options_init();
+	SpeechdOptions.log_level = 0;
+	logfile = stderr;
+	debug_logfile = stderr;
+
+	load_default_global_set_options();
+	for (file = symbols_files; *file; file++)
+		symbols_preprocessing_add_file(*file);
+
+	fd_settings = g_hash_table_new_full(g_int_hash, g_int_equal,
+					    (GDestroyNotify) g_free, NULL);
+	fd_uid = g_hash_table_new_full(g_int_hash, g_int_equal,
+				       (GDestroyNotify) g_free,
+				       (GDestroyNotify) g_free);
+	speechd_sockets_status_init();
+
+	speechd_socket_register(BENCH_FD);
+	settings = default_fd_set();
+	settings->fd = BENCH_FD;
+	settings->uid = 1;
+	fd = g_new(int, 1);
+	uid = g_new(int, 1);
+	uid2 = g_new(int, 1);
+	*fd = BENCH_FD;
+	*uid = *uid2 = 1;
+	g_hash_table_insert(fd_settings, uid, settings);
+	g_hash_table_insert(fd_uid, fd, uid2);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n iterations] [-s corpus bytes] "
+		"[-l locale,...]\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned i, n = G_N_ELEMENTS(bench_corpora);
+	char **locale_list, **locale;
+	int c;
+
+	while ((c = getopt(argc, argv, "n:s:l:")) != -1) {
+		switch (c) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 's':
+			corpus_size = atoi(optarg);
+			break;
+		case 'l':
+			locales = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (iterations < 1)
+		usage(argv[0]);
+
+	bench_init();
+	for (i = 0; i < n; i++)
+		corpus_init(&bench_corpora[i]);
+
+	printf("{\n\t\"config\": {\"iterations\": %d, \"corpus_bytes\": %zu, "
+	       "\"locales\": \"%s\"},\n", iterations, corpus_size, locales);
+
+	locale_list = g_strsplit(locales, ",", -1);
+	printf("\t\"insert_symbols\": {\n");
+	for (locale = locale_list; *locale; locale++) {
+		printf("\t\t\"%s\": {\n", *locale);
+		for (i = 0; i < n; i++)
+			bench_print("\t\t\t", bench_corpora[i].name,
+				    bench_insert_symbols, &bench_corpora[i],
+				    *locale, bench_corpora[i].bytes, TRUE,
+				    i == n - 1);
+		printf("\t\t}%s\n", locale[1] ? "," : "");
+	}
+	printf("\t},\n");
+	g_strfreev(locale_list);
+
+	printf("\t\"insert_index_marks\": {\n");
+	for (i = 0; i < n; i++)
+		bench_print("\t\t", bench_corpora[i].name,
+			    bench_insert_index_marks, &bench_corpora[i], NULL,
+			    bench_corpora[i].bytes, TRUE, i == n - 1);
+	printf("\t},\n");
+
+	printf("\t\"escape_dot\": {\n");
+	for (i = 0; i < n; i++)
+		bench_print("\t\t", bench_corpora[i].name, bench_escape_dot,
+			    &bench_corpora[i], NULL, bench_corpora[i].bytes,
+			    TRUE, i == n - 1);
+	printf("\t},\n");
+
+	printf("\t\"deescape_dot\": {\n");
+	for (i = 0; i < n; i++)
+		bench_print("\t\t", bench_corpora[i].name, bench_deescape_dot,
+			    &bench_corpora[i], NULL,
+			    strlen(bench_corpora[i].escaped), FALSE,
+			    i == n - 1);
+	printf("\t},\n");
+
+	printf("\t\"parse\": {\n");
+	for (i = 0; i < G_N_ELEMENTS(bench_commands); i++) {
+		char *name = g_strndup(bench_commands[i],
+				       strcspn(bench_commands[i], "\r"));
+
+		bench_print("\t\t", name, bench_parse, NULL,
+			    (gpointer) bench_commands[i],
+			    strlen(bench_commands[i]), FALSE,
+			    i == G_N_ELEMENTS(bench_commands) - 1);
+		g_free(name);
+	}
+	printf("\t}\n}\n");
+
+	return 0;
+}
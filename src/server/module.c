@@ -25,6 +25,7 @@
 #endif
 
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
 #include <netinet/in.h>
@@ -33,10 +34,17 @@
 #include <dirent.h>
 #include <glib.h>
 #include <dotconf.h>
+#ifdef USE_DLOPEN
+#include <dlfcn.h>
+#else
+#include <ltdl.h>
+#endif
 
 #include "speechd.h"
 #include "output.h"
 #include "module.h"
+#include "speaking.h"
+#include "metrics.h"
 
 static char *spd_get_path(const char *filename, const char *startdir)
 {
@@ -54,12 +62,328 @@ static char *spd_get_path(const char *filename, const char *startdir)
 	return ret;
 }
 
+static void free_reply(gpointer data)
+{
+	g_string_free(data, TRUE);
+}
+
+static void free_voices(SPDVoice ** voices)
+{
+	int i;
+
+	if (voices == NULL)
+		return;
+	for (i = 0; voices[i]; i++) {
+		g_free(voices[i]->name);
+		g_free(voices[i]->language);
+		g_free(voices[i]->variant);
+		g_free(voices[i]);
+	}
+	g_free(voices);
+}
+
+/* Account the voices kept by a module in MEM_VOICES, with sign 1 when
+   keeping them and -1 when freeing them */
+static void account_voices(SPDVoice ** voices, gsize bytes, int sign)
+{
+	int i;
+
+	if (voices == NULL)
+		return;
+	for (i = 0; voices[i]; i++) ;
+	mem_account(MEM_VOICES, sign * (gssize) bytes, sign * i);
+}
+
+/* Append a string to the pool of voices_compact(), only once if intern is
+   set, and return its offset */
+static gsize voices_pool_add(GString * pool, GHashTable * interned,
+			     const char *str, int intern)
+{
+	gpointer found;
+	gsize offset;
+
+	if (intern && (found = g_hash_table_lookup(interned, str)))
+		return GPOINTER_TO_SIZE(found) - 1;
+
+	offset = pool->len;
+	g_string_append_len(pool, str, strlen(str) + 1);
+	if (intern)
+		g_hash_table_insert(interned, (gpointer) str,
+				    GSIZE_TO_POINTER(offset + 1));
+	return offset;
+}
+
+/*
+ * The voices a module keeps for its whole life are in one block, to be
+ * freed with g_free(): the NULL-terminated array, the SPDVoice structures,
+ * and the strings.  Thousands of voices share a few languages and variants,
+ * those are only stored once.  Returns the block and its size in *bytes.
+ */
+static SPDVoice **voices_compact(SPDVoice ** voices, gsize * bytes)
+{
+	GHashTable *interned = g_hash_table_new(g_str_hash, g_str_equal);
+	GString *pool = g_string_new(NULL);
+	SPDVoice **compact, *structs;
+	gsize *offsets;
+	char *strings;
+	int i, n;
+
+	for (n = 0; voices[n]; n++) ;
+	offsets = g_new(gsize, 3 * n);
+	for (i = 0; i < n; i++) {
+		offsets[3 * i] = voices_pool_add(pool, interned,
+						 voices[i]->name, 0);
+		offsets[3 * i + 1] = voices_pool_add(pool, interned,
+						     voices[i]->language, 1);
+		offsets[3 * i + 2] = voices_pool_add(pool, interned,
+						     voices[i]->variant, 1);
+	}
+
+	*bytes = (n + 1) * sizeof(*compact) + n * sizeof(*structs) + pool->len;
+	compact = g_malloc(*bytes);
+	structs = (SPDVoice *) (compact + n + 1);
+	strings = (char *) (structs + n);
+	memcpy(strings, pool->str, pool->len);
+	for (i = 0; i < n; i++) {
+		structs[i].name = strings + offsets[3 * i];
+		structs[i].language = strings + offsets[3 * i + 1];
+		structs[i].variant = strings + offsets[3 * i + 2];
+		compact[i] = &structs[i];
+	}
+	compact[n] = NULL;
+
+	g_free(offsets);
+	g_string_free(pool, TRUE);
+	g_hash_table_destroy(interned);
+
+	return compact;
+}
+
+static void voices_index_add(GHashTable * index, char *language,
+			     SPDVoice * voice)
+{
+	GPtrArray *voices = g_hash_table_lookup(index, language);
+
+	if (voices == NULL) {
+		voices = g_ptr_array_new();
+		g_hash_table_insert(index, language, voices);
+	} else
+		g_free(language);
+	g_ptr_array_add(voices, voice);
+}
+
+static void voices_index_terminate(gpointer key, gpointer value,
+				   gpointer user_data)
+{
+	g_ptr_array_add(value, NULL);
+}
+
+/* Index the voices by what LIST SYNTHESIS_VOICES filters them with, see
+   output_voice_matches() */
+static GHashTable *voices_index(SPDVoice ** voices)
+{
+	GHashTable *index =
+	    g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+				  (GDestroyNotify) g_ptr_array_unref);
+	char *language, *dash;
+	int i;
+
+	for (i = 0; voices[i]; i++) {
+		language = g_ascii_strdown(voices[i]->language, -1);
+		dash = strchr(language, '-');
+		if (dash)
+			voices_index_add(index,
+					 g_strndup(language, dash - language),
+					 voices[i]);
+		voices_index_add(index, language, voices[i]);
+	}
+	g_hash_table_foreach(index, voices_index_terminate, NULL);
+
+	return index;
+}
+
+/* Keep the voices of a module, taking them over */
+static void output_module_set_voices(OutputModule * module, SPDVoice ** voices)
+{
+	SPDVoice **compact;
+	gsize bytes;
+
+	if (voices == NULL)
+		return;
+	compact = voices_compact(voices, &bytes);
+	free_voices(voices);
+
+	module->voices_bytes = bytes;
+	account_voices(compact, bytes, 1);
+	/* Ready before the voices, which tell that it is there */
+	module->voices_by_language = voices_index(compact);
+	g_atomic_pointer_set(&module->voices, compact);
+}
+
+/* Free the voices reported by the module when it was started */
+static void output_module_free_voices(OutputModule * module)
+{
+	account_voices(module->voices, module->voices_bytes, -1);
+	g_free(module->voices);
+	module->voices = NULL;
+	module->voices_bytes = 0;
+	if (module->voices_by_language)
+		g_hash_table_destroy(module->voices_by_language);
+	module->voices_by_language = NULL;
+}
+
+/*
+ * The voices of each module are also kept in
+ * $XDG_RUNTIME_DIR/speech-dispatcher/voices/<module>, so that a lazily
+ * loaded module does not have to be started to list them after a restart.
+ * The first line is a key made of the binary and configuration of the module,
+ * the file is ignored when they changed.  The next ones are
+ * name\tlanguage\tvariant.
+ */
+
+#define VOICES_CACHE_VERSION "SPDVOICES 1"
+
+static gchar *module_voices_cache_path(OutputModule * module)
+{
+	if (SpeechdOptions.runtime_speechd_dir == NULL)
+		return NULL;
+	return g_strdup_printf("%s/voices/%s",
+			       SpeechdOptions.runtime_speechd_dir,
+			       module->name);
+}
+
+/* The key of the current binary and configuration of the module */
+static gchar *module_voices_cache_key(OutputModule * module)
+{
+	struct stat prog, conf;
+
+	if (module->filename == NULL || stat(module->filename, &prog) != 0)
+		return NULL;
+	if (module->configfilename == NULL
+	    || stat(module->configfilename, &conf) != 0) {
+		conf.st_mtime = 0;
+		conf.st_size = 0;
+	}
+
+	return g_strdup_printf(VOICES_CACHE_VERSION "\t%s\t%lld\t%lld\t%s\t%lld\t%lld",
+			       module->filename,
+			       (long long) prog.st_mtime,
+			       (long long) prog.st_size,
+			       module->configfilename ? module->configfilename : "",
+			       (long long) conf.st_mtime,
+			       (long long) conf.st_size);
+}
+
+static void module_voices_cache_save(OutputModule * module, SPDVoice ** voices)
+{
+	gchar *path, *key, *dir;
+	GString *contents;
+	GError *error = NULL;
+	int i;
+
+	path = module_voices_cache_path(module);
+	key = module_voices_cache_key(module);
+	if (path == NULL || key == NULL) {
+		g_free(path);
+		g_free(key);
+		return;
+	}
+
+	contents = g_string_new(key);
+	g_string_append_c(contents, '\n');
+	for (i = 0; voices[i]; i++)
+		g_string_append_printf(contents, "%s\t%s\t%s\n",
+				       voices[i]->name, voices[i]->language,
+				       voices[i]->variant);
+
+	dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, S_IRWXU);
+	g_free(dir);
+	if (!g_file_set_contents(path, contents->str, contents->len, &error)) {
+		MSG(3, "Can't save the voices of %s: %s", module->name,
+		    error->message);
+		g_error_free(error);
+	}
+
+	g_string_free(contents, TRUE);
+	g_free(key);
+	g_free(path);
+}
+
+static SPDVoice **module_voices_cache_load(OutputModule * module)
+{
+	gchar *path, *key, *contents = NULL;
+	gchar **lines = NULL;
+	GPtrArray *voices = NULL;
+	int i;
+
+	path = module_voices_cache_path(module);
+	key = module_voices_cache_key(module);
+	if (path == NULL || key == NULL
+	    || !g_file_get_contents(path, &contents, NULL, NULL))
+		goto out;
+
+	lines = g_strsplit(contents, "\n", -1);
+	if (lines[0] == NULL || strcmp(lines[0], key)) {
+		MSG(4, "The cached voices of %s are out of date", module->name);
+		goto out;
+	}
+
+	voices = g_ptr_array_new();
+	for (i = 1; lines[i] && lines[i][0]; i++) {
+		gchar **atoms = g_strsplit(lines[i], "\t", 3);
+		SPDVoice *voice;
+
+		if (g_strv_length(atoms) != 3) {
+			g_strfreev(atoms);
+			MSG(3, "Invalid cached voice for %s: %s",
+			    module->name, lines[i]);
+			continue;
+		}
+		voice = g_malloc(sizeof(SPDVoice));
+		voice->name = atoms[0];
+		voice->language = atoms[1];
+		voice->variant = atoms[2];
+		g_free(atoms);
+		g_ptr_array_add(voices, voice);
+	}
+	g_ptr_array_add(voices, NULL);
+	MSG(4, "Loaded %u cached voices of %s", voices->len - 1,
+	    module->name);
+
+out:
+	g_strfreev(lines);
+	g_free(contents);
+	g_free(key);
+	g_free(path);
+
+	return voices ? (SPDVoice **) g_ptr_array_free(voices, FALSE) : NULL;
+}
+
 void destroy_module(OutputModule * module)
 {
+	/* Wait for those which found it before it was removed from the list */
+	output_modules_change_begin();
+	output_modules_change_end();
+
+	output_modules_changed();
 	close(module->pipe_speak[0]);
 	close(module->pipe_speak[1]);
 	if (module->stderr_redirect >= 0)
 		close(module->stderr_redirect);
+	output_module_join(module);
+	output_join_reader(module);
+	g_async_queue_unref(module->replies);
+	g_hash_table_destroy(module->sent_settings);
+	pthread_mutex_destroy(&module->lock);
+	if (module->audio_ring) {
+		munmap(module->audio_ring, module->audio_ring_len);
+		mem_account(MEM_AUDIO_RINGS, -(gssize) module->audio_ring_len,
+			    -1);
+	}
+	spd_audio_codec_free(module->audio_codec);
+	output_module_free_voices(module);
+	module_speak_queue_unset_stats(&module->audio_stats);
 	g_free(module->name);
 	g_free(module->filename);
 	g_free(module->configfilename);
@@ -69,19 +393,45 @@ void destroy_module(OutputModule * module)
 	g_free(module);
 }
 
+/*
+ * The variants of generic are looked for in each module directory, and again
+ * on reload, and most depend on the same few commands: the commands found,
+ * and the configuration files whose dependencies were all there, as of their
+ * modification time, are remembered so that each gets checked only once.
+ * What was missing is checked again, it may have been installed since.
+ */
+typedef struct {
+	time_t mtime;
+	off_t size;
+} GenericConfChecked;
+
+static GHashTable *generic_cmd_found;	/* commands found */
+static GHashTable *generic_conf_checked;	/* path -> GenericConfChecked */
+
 /*
  * Check that we can execute the configured command
  */
 DOTCONF_CB(GenericCmdDependency_cb)
 {
 	unsigned *missing_dep = ctx;
-	char s[5 + strlen(cmd->data.str) + 17 + 1];
+	char *path;
 
 	if (!cmd->data.str[0])
 		return NULL;
 
-	snprintf(s, sizeof(s), "type %s > /dev/null 2>&1", cmd->data.str);
-	if (system(s) != 0)
+	if (!generic_cmd_found)
+		generic_cmd_found = g_hash_table_new_full(g_str_hash,
+							  g_str_equal,
+							  g_free, NULL);
+	if (g_hash_table_contains(generic_cmd_found, cmd->data.str))
+		return NULL;
+
+	/* What the shell would run, without starting one */
+	path = g_find_program_in_path(cmd->data.str);
+	if (path) {
+		g_hash_table_add(generic_cmd_found, g_strdup(cmd->data.str));
+		g_free(path);
+	} else
 	{
 		MSG(5, "Did not find command %s", cmd->data.str);
 		(*missing_dep)++;
@@ -177,6 +527,7 @@ static GList *detect_generic_modules(GList *modules, const char *dirname, const
 		};
 		configfile_t *configfile;
 		unsigned missing_dep = 0;
+		GenericConfChecked *checked;
 
 		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
 			continue;
@@ -208,22 +559,40 @@ static GList *detect_generic_modules(GList *modules, const char *dirname, const
 
 		/* Check for actual binaries and ports given by GenericCmdDependency and GenericPortDependency */
 
-		configfile = dotconf_create(file_path, options,
-					    &missing_dep, CASE_INSENSITIVE);
-		if (!configfile) {
-			MSG(5, "Ignoring %s: Can not parse config file", file_path);
-			g_free(file_path);
-			continue;
-		}
-		configfile->errorhandler = (dotconf_errorhandler_t) ignore_errors;
+		if (!generic_conf_checked)
+			generic_conf_checked =
+			    g_hash_table_new_full(g_str_hash, g_str_equal,
+						  g_free, g_free);
+		checked = g_hash_table_lookup(generic_conf_checked, file_path);
+		if (!checked || checked->mtime != fileinfo.st_mtime
+		    || checked->size != fileinfo.st_size) {
+			configfile = dotconf_create(file_path, options,
+						    &missing_dep,
+						    CASE_INSENSITIVE);
+			if (!configfile) {
+				MSG(5, "Ignoring %s: Can not parse config file", file_path);
+				g_free(file_path);
+				continue;
+			}
+			configfile->errorhandler = (dotconf_errorhandler_t) ignore_errors;
 
-		if (dotconf_command_loop(configfile) == 0) {
-			MSG(5, "Ignoring %s: Can not parse config file", file_path);
-			g_free(file_path);
+			if (dotconf_command_loop(configfile) == 0) {
+				MSG(5, "Ignoring %s: Can not parse config file", file_path);
+				g_free(file_path);
+				dotconf_cleanup(configfile);
+				continue;
+			}
 			dotconf_cleanup(configfile);
-			continue;
+
+			if (missing_dep == 0) {
+				checked = g_new(GenericConfChecked, 1);
+				checked->mtime = fileinfo.st_mtime;
+				checked->size = fileinfo.st_size;
+				g_hash_table_insert(generic_conf_checked,
+						    g_strdup(file_path),
+						    checked);
+			}
 		}
-		dotconf_cleanup(configfile);
 
 		if (missing_dep != 0) {
 			MSG(5, "Ignoring %s: did not find %d dependency",
@@ -308,7 +677,15 @@ GList *detect_output_modules(GList *modules, const char *dirname, const char *us
 			continue;
 		}
 
+		/* The libraries of in-process modules sit along them */
+		if (g_str_has_suffix(entry->d_name, ".so")
+		    || g_str_has_suffix(entry->d_name, ".la"))
+			continue;
+
 		module_name = entry->d_name + FNAME_PREFIX_LENGTH;
+		/* Only useful with a host to talk to, see remote.conf */
+		if (!strcmp(module_name, "remote"))
+			continue;
 		if (strcmp(module_name, "generic") != 0) {
 			module_parameters = g_malloc(6 * sizeof(char *));
 			module_parameters[0] = g_strdup(module_name);
@@ -335,38 +712,64 @@ GList *detect_output_modules(GList *modules, const char *dirname, const char *us
 	return modules;
 }
 
-OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
-				 const char *mod_cfgfile, const char *mod_dbgfile,
-				 const char *mod_prog_dir, const char *mod_cfg_dir)
+/* Allocate a module and find its files, without starting it */
+static OutputModule *output_module_new(const char *mod_name, const char *mod_prog,
+				       const char *mod_cfgfile, const char *mod_dbgfile,
+				       const char *mod_prog_dir, const char *mod_cfg_dir)
 {
 	OutputModule *module;
-	int fr;
-	char *argv[3] = { 0, 0, 0 };
-	int ret;
 	char *module_conf_dir;
-	char *rep_line = NULL;
-	FILE *f;
-	size_t n = 0;
-	char s;
-	GString *reply;
 	struct stat fileinfo;
-	int i;
 
 	if (mod_name == NULL)
 		return NULL;
 
-	module = (OutputModule *) g_malloc(sizeof(OutputModule));
+	/* Zeroed, so that the fields added later can't be left unset */
+	module = g_new0(OutputModule, 1);
 	if (!module)
 		return NULL;
-	if (pipe(module->pipe_speak) != 0) {
+	/* Modules may be forked concurrently, don't let them inherit the pipes
+	   of each other */
+	if (!g_unix_open_pipe(module->pipe_speak, FD_CLOEXEC, NULL)) {
 		g_free(module);
 		return NULL;
 	}
 
 	module->name = (char *)g_strdup(mod_name);
+	module->sent_settings = g_hash_table_new_full(g_str_hash, g_str_equal,
+						      g_free, g_free);
+	module->replies = g_async_queue_new_full(free_reply);
+	module->reader_started = 0;
+	module->reader_done = 0;
+	pthread_mutex_init(&module->lock, NULL);
+	module->audio_ring = NULL;
+	module->audio_ring_len = 0;
 	module->progdir = g_strdup(mod_prog_dir);
 	module->configdir = g_strdup(mod_cfg_dir);
 	module->stderr_redirect = -1;
+	module->pipe_in[0] = module->pipe_in[1] = -1;
+	module->pipe_out[0] = module->pipe_out[1] = -1;
+	module->stream_out = NULL;
+	module->pid = 0;
+	module->working = 0;
+	module->audio = NULL;
+	module->audio_codec = NULL;
+	module->lazy = 0;
+	module->deferred = 0;
+	module->started = 0;
+	module->last_used = 0;
+	module->start_failed = 0;
+	module->voices = NULL;
+	module->voices_bytes = 0;
+	module->voices_by_language = NULL;
+	module->standby = NULL;
+	module->standby_starting = 0;
+	module->in_process = 0;
+	module->library = NULL;
+	module->inprocess = NULL;
+	memset(&module->lookahead, 0, sizeof(module->lookahead));
+	memset(&module->audio_stats, 0, sizeof(module->audio_stats));
+	memset(&module->traffic, 0, sizeof(module->traffic));
 
 	if (module->progdir) {
 		module->filename = (char *)spd_get_path(mod_prog, module->progdir);
@@ -399,33 +802,384 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 		MSG(4, "Built configfilename %s", module->configfilename);
 	}
 
+	module->file_mtime = stat(module->filename, &fileinfo) == 0
+	    ? fileinfo.st_mtime : 0;
+	module->configfile_mtime = stat(module->configfilename, &fileinfo) == 0
+	    ? fileinfo.st_mtime : 0;
+
 	if (mod_dbgfile != NULL)
 		module->debugfilename = g_strdup(mod_dbgfile);
 	else
 		module->debugfilename = NULL;
 
-	if (!strcmp(mod_name, "testing")) {
+	return module;
+}
+
+/* Kill a module whose initialization failed, and release what was set up
+   for its process, so that it may be started again */
+static void output_module_abort(OutputModule * module)
+{
+	GString *reply;
+	int i;
+
+	if (module->pid > 0) {
+		kill(module->pid, 9);
+		waitpid(module->pid, NULL, WNOHANG);
+		module->pid = 0;
+	}
+	output_module_join(module);
+	module->working = 0;
+	module->started = 0;
+	output_join_reader(module);
+	module->reader_done = 0;
+	while ((reply = g_async_queue_try_pop(module->replies)))
+		free_reply(reply);
+	if (module->stream_out) {
+		fclose(module->stream_out);
+		module->stream_out = NULL;
+		module->pipe_out[0] = -1;
+	}
+	for (i = 0; i < 2; i++) {
+		if (module->pipe_in[i] >= 0)
+			close(module->pipe_in[i]);
+		if (module->pipe_out[i] >= 0)
+			close(module->pipe_out[i]);
+		module->pipe_in[i] = -1;
+		module->pipe_out[i] = -1;
+	}
+	if (module->stderr_redirect >= 0) {
+		close(module->stderr_redirect);
+		module->stderr_redirect = -1;
+	}
+	if (module->audio_ring) {
+		munmap(module->audio_ring, module->audio_ring_len);
+		mem_account(MEM_AUDIO_RINGS, -(gssize) module->audio_ring_len,
+			    -1);
+		module->audio_ring = NULL;
+		module->audio_ring_len = 0;
+	}
+	spd_audio_codec_free(module->audio_codec);
+	module->audio_codec = NULL;
+	g_hash_table_remove_all(module->sent_settings);
+}
+
+/* == COMPRESSED AUDIO == */
+
+/* Names of the modules to ask for compressed audio, typically remote ones */
+static GList *compression_requests;
+
+void module_add_compression_request(const char *module_name)
+{
+	if (g_list_find_custom(compression_requests, module_name,
+			       (GCompareFunc) strcmp))
+		return;
+	compression_requests = g_list_append(compression_requests,
+					     g_strdup(module_name));
+}
+
+int module_wants_compression(const char *module_name)
+{
+	return g_list_find_custom(compression_requests, module_name,
+				  (GCompareFunc) strcmp) != NULL;
+}
+
+/* == IN-PROCESS MODULES == */
+
+/* Names of the modules to run from their shared library */
+static GList *inprocess_requests;
+
+/* Libraries whose module is running.  The code of a module keeps its state
+   in globals, so it can only run once at a time, further instances of it,
+   like spare ones, get a process.  Modules are started from several
+   threads, hence the mutex. */
+static GHashTable *inprocess_running;
+static pthread_mutex_t inprocess_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* See spd_module_run() in src/modules/module_main.h */
+typedef int (*module_run_t) (int in_fd, int out_fd, const char *configfile);
+
+/* How long output_module_join() waits for the thread of a module which was
+   told to quit, before abandoning it */
+#define INPROCESS_JOIN_TIMEOUT 5
+
+/* Shared by the thread and the module, whichever is done last frees it */
+typedef struct {
+	module_run_t run;
+	int in_fd;
+	int out_fd;
+	char *configfile;
+	char *name;
+	char *libname;
+	void *library;
+	int done;
+	int abandoned;
+	pthread_cond_t done_cond;
+} InProcessStart;
+
+void module_add_inprocess_request(const char *module_name)
+{
+	if (g_list_find_custom(inprocess_requests, module_name,
+			       (GCompareFunc) strcmp))
+		return;
+	inprocess_requests = g_list_append(inprocess_requests,
+					   g_strdup(module_name));
+}
+
+static int module_wants_inprocess(const char *module_name)
+{
+	return g_list_find_custom(inprocess_requests, module_name,
+				  (GCompareFunc) strcmp) != NULL;
+}
+
+static char *module_library_name(OutputModule * module)
+{
+	return g_strdup_printf("%s.so", module->filename);
+}
+
+static void module_library_close(void *library)
+{
+#ifdef USE_DLOPEN
+	dlclose(library);
+#else
+	lt_dlclose(library);
+	lt_dlexit();
+#endif
+}
+
+static void inprocess_start_free(InProcessStart * start)
+{
+	pthread_cond_destroy(&start->done_cond);
+	g_free(start->configfile);
+	g_free(start->name);
+	g_free(start->libname);
+	g_free(start);
+}
+
+/* Also run when FATAL() makes the module end just its thread */
+static void module_inprocess_done(void *data)
+{
+	InProcessStart *start = data;
+
+	pthread_mutex_lock(&inprocess_mutex);
+	start->done = 1;
+	if (start->abandoned) {
+		/* Nobody waits for us any more, release the library ourselves */
+		MSG(3, "Abandoned thread of module %s terminated", start->name);
+		module_library_close(start->library);
+		g_hash_table_remove(inprocess_running, start->libname);
+		pthread_mutex_unlock(&inprocess_mutex);
+		inprocess_start_free(start);
+		return;
+	}
+	pthread_cond_broadcast(&start->done_cond);
+	pthread_mutex_unlock(&inprocess_mutex);
+}
+
+static void *module_inprocess_thread(void *data)
+{
+	InProcessStart *start = data;
+	int ret;
+
+	pthread_cleanup_push(module_inprocess_done, start);
+	ret = start->run(start->in_fd, start->out_fd, start->configfile);
+	MSG(4, "In-process module %s returned %d", start->name, ret);
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+/* Run the module from its library in a thread of ours, over the pipes which
+   a process would have as stdin and stdout.  Returns -1 when it should rather
+   be started as a process. */
+static int output_module_start_inprocess(OutputModule * module)
+{
+	InProcessStart *start;
+	module_run_t run = NULL;
+	char *libname;
+	void *library;
+	const char *error;
+
+	module->in_process = 0;
+	if (!module_wants_inprocess(module->name))
+		return -1;
+
+	libname = module_library_name(module);
+	pthread_mutex_lock(&inprocess_mutex);
+	if (!inprocess_running)
+		inprocess_running = g_hash_table_new_full(g_str_hash,
+							  g_str_equal,
+							  g_free, NULL);
+	if (g_hash_table_contains(inprocess_running, libname)) {
+		pthread_mutex_unlock(&inprocess_mutex);
+		MSG(3, "%s is already running, starting module %s as a process",
+		    libname, module->name);
+		g_free(libname);
+		return -1;
+	}
+
+#ifdef USE_DLOPEN
+	library = dlopen(libname, RTLD_NOW | RTLD_LOCAL);
+	if (library)
+		run = (module_run_t) dlsym(library, "spd_module_run");
+	error = dlerror();
+#else
+	library = lt_dlinit() == 0 ? lt_dlopen(libname) : NULL;
+	if (library)
+		run = (module_run_t) lt_dlsym(library, "spd_module_run");
+	error = lt_dlerror();
+#endif
+	if (run == NULL) {
+		pthread_mutex_unlock(&inprocess_mutex);
+		MSG(2, "Can't load %s, starting module %s as a process: %s",
+		    libname, module->name, error ? error : "no spd_module_run");
+		if (library)
+			module_library_close(library);
+#ifndef USE_DLOPEN
+		else
+			lt_dlexit();
+#endif
+		g_free(libname);
+		return -1;
+	}
+
+	start = g_new0(InProcessStart, 1);
+	start->run = run;
+	start->in_fd = module->pipe_in[0];
+	start->out_fd = module->pipe_out[1];
+	start->configfile = g_strdup(module->configfilename);
+	start->name = g_strdup(module->name);
+	start->libname = g_strdup(libname);
+	start->library = library;
+	pthread_cond_init(&start->done_cond, NULL);
+	if (spd_pthread_create(&module->thread, NULL, module_inprocess_thread,
+			       start) != 0) {
+		pthread_mutex_unlock(&inprocess_mutex);
+		MSG(2, "Can't create a thread for module %s", module->name);
+		inprocess_start_free(start);
+		module_library_close(library);
+		g_free(libname);
+		return -1;
+	}
+	MSG(2, "Module %s runs in the server from %s", module->name, libname);
+	g_hash_table_add(inprocess_running, libname);
+	pthread_mutex_unlock(&inprocess_mutex);
+
+	module->in_process = 1;
+	module->library = library;
+	module->inprocess = start;
+	/* They belong to its thread now */
+	module->pipe_in[0] = -1;
+	module->pipe_out[1] = -1;
+
+	return 0;
+}
+
+void output_module_join(OutputModule * module)
+{
+	InProcessStart *start = module->inprocess;
+	struct timespec deadline;
+	int err = 0, devnull;
+
+	if (module->library == NULL)
+		return;
+
+	/* It returns at the end of its input, if it did not get QUIT */
+	if (module->pipe_in[1] >= 0) {
+		close(module->pipe_in[1]);
+		module->pipe_in[1] = -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += INPROCESS_JOIN_TIMEOUT;
+	pthread_mutex_lock(&inprocess_mutex);
+	while (!start->done && err != ETIMEDOUT)
+		err = pthread_cond_timedwait(&start->done_cond,
+					     &inprocess_mutex, &deadline);
+	if (!start->done) {
+		/* A stuck module must not hang us, its thread cleans up after
+		   itself if it ever returns.  Until then its library stays
+		   loaded and marked as running. */
+		MSG(2, "Thread of module %s did not terminate in %d seconds,"
+		    " abandoning it", module->name, INPROCESS_JOIN_TIMEOUT);
+		start->abandoned = 1;
+		/* Its output descriptor becomes /dev/null, so that our reader
+		   gets the end of the pipe and what it still writes is lost */
+		devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (devnull >= 0) {
+			dup2(devnull, start->out_fd);
+			close(devnull);
+		}
+		pthread_detach(module->thread);
+		pthread_mutex_unlock(&inprocess_mutex);
+		module->inprocess = NULL;
+		module->library = NULL;
+		return;
+	}
+	pthread_mutex_unlock(&inprocess_mutex);
+
+	pthread_join(module->thread, NULL);
+	MSG(4, "Thread of module %s terminated", module->name);
+
+	pthread_mutex_lock(&inprocess_mutex);
+	module_library_close(module->library);
+	g_hash_table_remove(inprocess_running, start->libname);
+	pthread_mutex_unlock(&inprocess_mutex);
+	inprocess_start_free(start);
+	module->inprocess = NULL;
+	module->library = NULL;
+}
+
+/* Print the three strings on stderr, from the child of fork() */
+static void module_child_error(const char *before, const char *name,
+			       const char *after)
+{
+	ssize_t ret;
+
+	ret = write(2, before, strlen(before));
+	ret = write(2, name, strlen(name));
+	ret = write(2, after, strlen(after));
+	(void) ret;
+}
+
+/* Start the process of an allocated module and initialize it */
+static int output_module_start(OutputModule * module)
+{
+	int fr, fd;
+	char *argv[3] = { 0, 0, 0 };
+	int ret;
+	char *rep_line = NULL;
+	FILE *f;
+	size_t n = 0;
+	char s;
+	GString *reply;
+
+	if (!strcmp(module->name, "testing")) {
 		module->pipe_in[1] = 1;	/* redirect to stdin */
 		module->pipe_out[0] = 0;	/* redirect to stdout */
-		return module;
+		module->started = 1;
+		return 0;
 	}
 
-	if ((pipe(module->pipe_in) != 0)
-	    || (pipe(module->pipe_out) != 0)) {
+	if (!g_unix_open_pipe(module->pipe_in, FD_CLOEXEC, NULL)
+	    || !g_unix_open_pipe(module->pipe_out, FD_CLOEXEC, NULL)) {
 		MSG(3, "Can't open pipe! Module not loaded.");
-		destroy_module(module);
-		return NULL;
+		output_module_abort(module);
+		return -1;
 	}
 
+	if (output_module_start_inprocess(module) == 0)
+		goto started;
+
 	argv[0] = module->filename;
-	if (mod_cfgfile) {
+	if (module->configfilename) {
 		argv[1] = module->configfilename;
 	}
 
 	/* Open the file for child stderr (logging) redirection */
 	if (module->debugfilename != NULL) {
 		module->stderr_redirect = open(module->debugfilename,
-					       O_WRONLY | O_CREAT | O_TRUNC,
+					       O_WRONLY | O_CREAT | O_TRUNC
+					       | O_CLOEXEC,
 					       S_IRUSR | S_IWUSR);
 		if (module->stderr_redirect == -1)
 			MSG(1,
@@ -449,11 +1203,18 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	fr = fork();
 	if (fr == -1) {
 		printf("Can't fork, error! Module not loaded.");
-		destroy_module(module);
-		return NULL;
+		output_module_abort(module);
+		return -1;
 	}
 
 	if (fr == 0) {
+		sigset_t no_signals;
+
+		/* We may be forked from a thread which blocks all signals, and
+		   the module would inherit that */
+		sigemptyset(&no_signals);
+		pthread_sigmask(SIG_SETMASK, &no_signals, NULL);
+
 		ret = dup2(module->pipe_in[0], 0);
 		close(module->pipe_in[0]);
 		close(module->pipe_in[1]);
@@ -468,16 +1229,17 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 		}
 
 		execvp(argv[0], argv);
-		MSG(1,
-		    "Exec of module \"%s\" with config \"%s\" failed with error %d: %s",
-		    argv[0], argv[1] ? argv[1] : "<none>", errno,
-		    strerror(errno));
-		exit(1);
+		/* Only async-signal-safe calls in the child of a threaded
+		   process: the parent reports the failure from waitpid() */
+		module_child_error("Exec of module \"", argv[0], "\" failed\n");
+		_exit(1);
 	}
 
 	module->pid = fr;
 	close(module->pipe_in[0]);
 	close(module->pipe_out[1]);
+	module->pipe_in[0] = -1;
+	module->pipe_out[1] = -1;
 
 	usleep(100);		/* So that the other child has at least time to fail
 				   with the execlp */
@@ -486,11 +1248,13 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 		MSG(2,
 		    "ERROR: Can't load output module %s with binary %s. Bad filename in configuration?",
 		    module->name, module->filename);
-		destroy_module(module);
-		return NULL;
+		output_module_abort(module);
+		return -1;
 	}
 
+started:
 	module->working = 1;
+	module->started = 1;
 	MSG(2, "Module %s loaded.", module->name);
 
 	/* Create a stream from the socket */
@@ -507,13 +1271,22 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	if (output_send_data("INIT\n", module, 0) != 0) {
 		MSG(1, "ERROR: Something wrong with %s, can't initialize",
 		    module->name);
-		output_close(module);
-		destroy_module(module);
-		return NULL;
+		output_module_abort(module);
+		return -1;
 	}
 
 	reply = g_string_new("\n---------------\n");
-	f = fdopen(dup(module->pipe_out[0]), "r");
+	fd = fcntl(module->pipe_out[0], F_DUPFD_CLOEXEC, 0);
+	f = fd >= 0 ? fdopen(fd, "r") : NULL;
+	if (f == NULL) {
+		MSG(1, "ERROR: Can't read the replies of module %s: %s",
+		    module->name, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		g_string_free(reply, TRUE);
+		output_module_abort(module);
+		return -1;
+	}
 	while (1) {
 		ret = getline(&rep_line, &n, f);
 		if (ret <= 0) {
@@ -522,8 +1295,8 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 			g_string_free(reply, TRUE);
 			free(rep_line);
 			fclose(f);
-			destroy_module(module);
-			return NULL;
+			output_module_abort(module);
+			return -1;
 		}
 		assert(rep_line != NULL);
 		MSG(5, "Reply from output module: %ld %s", (long) n, rep_line);
@@ -533,8 +1306,8 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 			g_string_free(reply, TRUE);
 			free(rep_line);
 			fclose(f);
-			destroy_module(module);
-			return NULL;
+			output_module_abort(module);
+			return -1;
 		}
 
 		if (rep_line[3] != '-') {
@@ -552,12 +1325,9 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	if (s == '3') {
 		MSG(1, "ERROR: Module %s failed to initialize. Reason: %s",
 		    module->name, reply->str);
-		module->working = 0;
-		kill(module->pid, 9);
-		waitpid(module->pid, NULL, WNOHANG);
-		destroy_module(module);
 		g_string_free(reply, TRUE);
-		return NULL;
+		output_module_abort(module);
+		return -1;
 	}
 
 	if (s == '2')
@@ -566,6 +1336,11 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 
 	g_string_free(reply, 1);
 
+	if (output_start_reader(module) != 0) {
+		output_module_abort(module);
+		return -1;
+	}
+
 	if (SpeechdOptions.debug) {
 		MSG(4, "Switching debugging on for output module %s",
 		    module->name);
@@ -577,11 +1352,8 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	if (ret != 0) {
 		MSG(1,
 		    "ERROR: Can't initialize audio in output module, see reason above.");
-		module->working = 0;
-		kill(module->pid, 9);
-		waitpid(module->pid, NULL, WNOHANG);
-		destroy_module(module);
-		return NULL;
+		output_module_abort(module);
+		return -1;
 	}
 
 	/* Send log level configuration setting */
@@ -589,11 +1361,8 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 	if (ret != 0) {
 		MSG(1,
 		    "ERROR: Can't set the log level inin the output module.");
-		module->working = 0;
-		kill(module->pid, 9);
-		waitpid(module->pid, NULL, WNOHANG);
-		destroy_module(module);
-		return NULL;
+		output_module_abort(module);
+		return -1;
 	}
 
 	/* Try to get the list of voices */
@@ -603,43 +1372,311 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 		 * on this module */
 		MSG(1,
 		    "ERROR: Can't get a list of voices from the output module.");
-		module->working = 0;
-		kill(module->pid, 9);
-		waitpid(module->pid, NULL, WNOHANG);
+		output_module_abort(module);
+		return -1;
+	}
+	/* Keep them for listing them without asking the module again.  When
+	   it is restarted, others may be using the previous list, which is
+	   up to date anyway. */
+	module_voices_cache_save(module, voices);
+	if (module->voices == NULL)
+		output_module_set_voices(module, voices);
+	else
+		free_voices(voices);
+	module->last_used = g_get_monotonic_time();
+
+	return 0;
+}
+
+
+OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
+				 const char *mod_cfgfile, const char *mod_dbgfile,
+				 const char *mod_prog_dir, const char *mod_cfg_dir)
+{
+	OutputModule *module;
+
+	module = output_module_new(mod_name, mod_prog, mod_cfgfile, mod_dbgfile,
+				   mod_prog_dir, mod_cfg_dir);
+	if (module == NULL)
+		return NULL;
+
+	if (output_module_start(module) != 0) {
 		destroy_module(module);
 		return NULL;
 	}
-	for (i = 0; voices[i]; i++) {
-		g_free(voices[i]->name);
-		g_free(voices[i]->language);
-		g_free(voices[i]->variant);
-		g_free(voices[i]);
-	}
-	g_free(voices);
 
 	return module;
 }
 
+/* Register a module to be started only when it is needed */
+static OutputModule *register_output_module(const char *mod_name, const char *mod_prog,
+					    const char *mod_cfgfile, const char *mod_dbgfile,
+					    const char *mod_prog_dir, const char *mod_cfg_dir)
+{
+	OutputModule *module;
+
+	module = output_module_new(mod_name, mod_prog, mod_cfgfile, mod_dbgfile,
+				   mod_prog_dir, mod_cfg_dir);
+	if (module == NULL)
+		return NULL;
+
+	module->lazy = 1;
+	output_module_set_voices(module, module_voices_cache_load(module));
+	MSG(3, "Module %s will be started when needed", module->name);
+
+	return module;
+}
+
+/* Serializes starting and stopping lazy modules */
+static pthread_mutex_t module_start_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* How long to wait before trying to start a module again, in us */
+#define MODULE_START_RETRY (30 * G_USEC_PER_SEC)
+
+int start_output_module(OutputModule * module)
+{
+	gint64 now = g_get_monotonic_time();
+	int ret = 0;
+
+	pthread_mutex_lock(&module_start_mutex);
+	if (!module->started) {
+		if (module->start_failed
+		    && now - module->start_failed < MODULE_START_RETRY) {
+			pthread_mutex_unlock(&module_start_mutex);
+			return -1;
+		}
+		MSG(3, "Starting module %s on demand", module->name);
+		ret = output_module_start(module);
+		if (ret != 0) {
+			MSG(1, "ERROR: Can't start module %s", module->name);
+			module->start_failed = now;
+		} else
+			module->start_failed = 0;
+	} else if (!module->working)
+		/* It crashed, leave it to reload_output_module() */
+		ret = -1;
+	if (ret == 0)
+		module->last_used = g_get_monotonic_time();
+	pthread_mutex_unlock(&module_start_mutex);
+
+	return ret;
+}
+
+/* Stop a lazily started module, keeping its metadata and voices */
+static void stop_output_module(OutputModule * module)
+{
+	MSG(3, "Stopping idle module %s", module->name);
+
+	output_close_locked(module);
+	/* Already waited for */
+	module->pid = 0;
+	output_module_abort(module);
+}
+
+/* Whether module has not been used for timeout, with module_start_mutex and
+   then its lock held for it to stay so */
+static int output_module_idle(OutputModule * module, gint64 now,
+			      gint64 timeout)
+{
+	return module->lazy && !module->deferred && module->started
+	    && module->working && now - module->last_used >= timeout
+	    && module != speaking_module;
+}
+
+void stop_idle_output_modules(gint64 timeout)
+{
+	gint64 now = g_get_monotonic_time();
+	GList *gl;
+
+	pthread_mutex_lock(&module_start_mutex);
+	for (gl = output_modules; gl != NULL; gl = gl->next) {
+		OutputModule *module = gl->data;
+
+		if (!output_module_idle(module, now, timeout))
+			continue;
+		/* Wait for whoever is talking to it, and check again, it may
+		   just have started speaking */
+		output_lock(module);
+		if (output_module_idle(module, g_get_monotonic_time(), timeout))
+			stop_output_module(module);
+		output_unlock(module);
+	}
+	pthread_mutex_unlock(&module_start_mutex);
+}
+
 int unload_output_module(OutputModule * module)
 {
 	assert(module != NULL);
 
 	MSG(3, "Unloading module name=%s", module->name);
 
-	output_close(module);
+	if (module->standby)
+		unload_output_module(module->standby);
 
-	close(module->pipe_in[1]);
-	close(module->pipe_out[0]);
+	if (module->started) {
+		output_close(module);
+
+		close(module->pipe_in[1]);
+		close(module->pipe_out[0]);
+	}
 
 	destroy_module(module);
 
 	return 0;
 }
 
+/* == STANDBY PROCESSES == */
+
+/* Names of the modules to keep a spare process of */
+static GList *standby_requests;
+
+void module_add_standby_request(const char *module_name)
+{
+	if (g_list_find_custom(standby_requests, module_name,
+			       (GCompareFunc) strcmp))
+		return;
+	standby_requests = g_list_append(standby_requests,
+					 g_strdup(module_name));
+}
+
+static int module_wants_standby(const char *module_name)
+{
+	return g_list_find_custom(standby_requests, module_name,
+				  (GCompareFunc) strcmp) != NULL;
+}
+
+/* The spare logs to the other one of name.log and name-standby.log, so
+   that the two processes don't write over each other */
+static char *module_standby_debugfile(const char *debugfile)
+{
+	if (debugfile == NULL)
+		return NULL;
+	if (g_str_has_suffix(debugfile, "-standby.log"))
+		return g_strdup_printf("%.*s.log",
+				       (int) strlen(debugfile) - 12, debugfile);
+	if (g_str_has_suffix(debugfile, ".log"))
+		return g_strdup_printf("%.*s-standby.log",
+				       (int) strlen(debugfile) - 4, debugfile);
+	return g_strdup_printf("%s-standby", debugfile);
+}
+
+/* Find the module which a spare was started for.  It may have been
+   replaced meanwhile, so by name. */
+static OutputModule *module_standby_owner(OutputModule * standby)
+{
+	GList *gl;
+
+	for (gl = output_modules; gl != NULL; gl = gl->next) {
+		OutputModule *module = gl->data;
+
+		if (!strcmp(module->name, standby->name))
+			return module;
+	}
+	return NULL;
+}
+
+/* Back in the main loop with a spare which was started */
+static gboolean module_standby_started(gpointer data)
+{
+	OutputModule *standby = data;
+	OutputModule *module = module_standby_owner(standby);
+
+	if (module)
+		module->standby_starting = 0;
+
+	if (!standby->started) {
+		MSG(1, "ERROR: Can't start a standby process of module %s",
+		    standby->name);
+		destroy_module(standby);
+		return FALSE;
+	}
+	if (module == NULL || module->standby != NULL) {
+		unload_output_module(standby);
+		return FALSE;
+	}
+
+	MSG(3, "Standby process of module %s is ready", module->name);
+	module->standby = standby;
+
+	if (module->started && !module->working)
+		/* It died while its spare was starting */
+		reload_output_module(module);
+
+	return FALSE;
+}
+
+static void *module_standby_thread(void *data)
+{
+	OutputModule *standby = data;
+
+	output_module_start(standby);
+	g_idle_add(module_standby_started, standby);
+
+	return NULL;
+}
+
+/* Start a spare process of the module in the background, if it should
+   have one */
+static void module_standby_spawn(OutputModule * module)
+{
+	OutputModule *standby;
+	char *debugfile;
+
+	if (module->standby || module->standby_starting
+	    || !module_wants_standby(module->name))
+		return;
+
+	debugfile = module_standby_debugfile(module->debugfilename);
+	standby = output_module_new(module->name, module->filename,
+				    module->configfilename, debugfile,
+				    module->progdir, module->configdir);
+	g_free(debugfile);
+	if (standby == NULL)
+		return;
+
+	module->standby_starting = 1;
+	if (spd_task_run(module_standby_thread, standby) != 0) {
+		module->standby_starting = 0;
+		destroy_module(standby);
+	}
+}
+
+/* Replace the dead modules which have a spare, and spare processes which
+   died themselves */
+static gboolean module_check_standbys(gpointer data)
+{
+	GList *gl, *next;
+
+	for (gl = output_modules; gl != NULL; gl = next) {
+		OutputModule *module = gl->data;
+
+		/* reload_output_module() replaces the element */
+		next = gl->next;
+
+		if (module->standby && !module->standby->working) {
+			MSG(2, "Standby process of module %s died",
+			    module->name);
+			unload_output_module(module->standby);
+			module->standby = NULL;
+			module_standby_spawn(module);
+		}
+		if (module->standby && module->started && !module->working)
+			reload_output_module(module);
+	}
+
+	return FALSE;
+}
+
+void module_crashed(OutputModule * module)
+{
+	if (module_wants_standby(module->name))
+		g_idle_add(module_check_standbys, NULL);
+}
+
 int reload_output_module(OutputModule * old_module)
 {
 	OutputModule *new_module;
-	int pos;
+	int pos, retired;
 
 	assert(old_module != NULL);
 	assert(old_module->name != NULL);
@@ -647,27 +1684,74 @@ int reload_output_module(OutputModule * old_module)
 	if (old_module->working)
 		return 0;
 
+	if (old_module->lazy) {
+		/* Just start it again when it is needed */
+		pthread_mutex_lock(&module_start_mutex);
+		if (old_module->started && !old_module->working) {
+			MSG(3, "Output module %s will be restarted when needed",
+			    old_module->name);
+			output_module_abort(old_module);
+			metrics_count(METRICS_MODULE_RESTARTS);
+		}
+		pthread_mutex_unlock(&module_start_mutex);
+		return 0;
+	}
+
 	MSG(3, "Reloading output module %s", old_module->name);
 
 	output_close(old_module);
 	close(old_module->pipe_in[1]);
 	close(old_module->pipe_out[0]);
 
-	new_module = load_output_module(old_module->name, old_module->filename,
-					old_module->configfilename,
-					old_module->debugfilename,
-					old_module->progdir,
-					old_module->configdir);
-	if (new_module == NULL) {
-		MSG(3, "Can't load module %s while reloading modules.",
+	if (old_module->standby && old_module->standby->working) {
+		MSG(3, "Switching to the standby process of output module %s",
 		    old_module->name);
-		return -1;
+		new_module = old_module->standby;
+		old_module->standby = NULL;
+	} else {
+		if (old_module->standby) {
+			unload_output_module(old_module->standby);
+			old_module->standby = NULL;
+		}
+		new_module = load_output_module(old_module->name,
+						old_module->filename,
+						old_module->configfilename,
+						old_module->debugfilename,
+						old_module->progdir,
+						old_module->configdir);
+		if (new_module == NULL) {
+			MSG(3, "Can't load module %s while reloading modules.",
+			    old_module->name);
+			return -1;
+		}
 	}
 
+	/* Keep counting its audio from where it was */
+	module_speak_queue_get_stats(&old_module->audio_stats,
+				     &new_module->audio_stats);
+	output_get_traffic(old_module, &new_module->traffic);
+	new_module->traffic.stop_sent = 0;
+
+	/* The speaking thread looks modules up with this held */
+	pthread_mutex_lock(&element_free_mutex);
+	output_modules_change_begin();
 	pos = g_list_index(output_modules, old_module);
+	output_modules_changed();
 	output_modules = g_list_remove(output_modules, old_module);
 	output_modules = g_list_insert(output_modules, new_module, pos);
-	destroy_module(old_module);
+	output_modules_change_end();
+	/* The speaking thread may still wait for its last events */
+	retired = speaking_retire_module(old_module);
+	pthread_mutex_unlock(&element_free_mutex);
+	if (!retired)
+		destroy_module(old_module);
+	metrics_count(METRICS_MODULE_RESTARTS);
+
+	/* Get a spare ready for the next time */
+	module_standby_spawn(new_module);
+
+	/* It may have come back with other voices */
+	report_voices_changed();
 
 	return 0;
 }
@@ -804,26 +1888,227 @@ module_add_load_request(char *module_name, char *module_cmd,
 	    module_params[5]);
 }
 
+/*
+ * On reload, the modules loaded until then are put aside, and those which
+ * are requested again with the same binary and configuration file, neither
+ * modified since, are kept running as long as what modules get from the
+ * server configuration did not change either.  The others are unloaded.
+ */
+static GList *reload_modules;
+static gchar *modules_environment;
+
+void module_reload_begin(void)
+{
+	module_deferred_join();
+	/* The speaking thread looks modules up with this held */
+	pthread_mutex_lock(&element_free_mutex);
+	output_modules_change_begin();
+	output_modules_changed();
+	reload_modules = g_list_concat(reload_modules, output_modules);
+	output_modules = NULL;
+	output_modules_change_end();
+	pthread_mutex_unlock(&element_free_mutex);
+}
+
+/* Take back the module put aside which matches the request, if any */
+static OutputModule *module_reload_take(char **module_params, int lazily)
+{
+	OutputModule *probe, *module = NULL;
+	GList *lp;
+
+	probe = output_module_new(module_params[0], module_params[1],
+				  module_params[2], module_params[3],
+				  module_params[4], module_params[5]);
+	if (probe == NULL)
+		return NULL;
+
+	for (lp = reload_modules; lp != NULL; lp = lp->next) {
+		OutputModule *old = lp->data;
+
+		if (strcmp(old->name, probe->name))
+			continue;
+		if (!strcmp(old->filename, probe->filename)
+		    && !strcmp(old->configfilename, probe->configfilename)
+		    && !g_strcmp0(old->debugfilename, probe->debugfilename)
+		    && old->file_mtime == probe->file_mtime
+		    && old->configfile_mtime == probe->configfile_mtime
+		    && (old->started || old->lazy == lazily)) {
+			module = old;
+			reload_modules = g_list_delete_link(reload_modules, lp);
+			MSG(3, "Module %s unchanged, keeping it", module->name);
+		}
+		break;
+	}
+
+	destroy_module(probe);
+	return module;
+}
+
+/* A module being loaded by module_load_requested_modules() */
+typedef struct {
+	char **params;
+	OutputModule *module;
+	pthread_t thread;
+	int threaded;
+} ModuleLoad;
+
+static void *module_load_thread(void *data)
+{
+	ModuleLoad *load = data;
+	char **module_params = load->params;
+
+	load->module =
+	    load_output_module(module_params[0], module_params[1],
+			       module_params[2], module_params[3],
+			       module_params[4], module_params[5]);
+
+	return NULL;
+}
+
+/* Whether a module is only to be registered for now.  The dummy module is
+   always started, to have something to fall back to, and so are the modules
+   which are to have a spare process. */
+static int module_load_lazily(char **module_params)
+{
+	return SpeechdOptions.module_lazy_load
+	    && !module_wants_standby(module_params[0])
+	    && strcmp(module_params[0], "dummy")
+	    && strcmp(module_params[0], "testing");
+}
+
+/* Whether a module is to be started in the background, same exceptions */
+static int module_load_deferred(char **module_params)
+{
+	return SpeechdOptions.module_deferred_start
+	    && !SpeechdOptions.module_lazy_load
+	    && !module_wants_standby(module_params[0])
+	    && strcmp(module_params[0], "dummy")
+	    && strcmp(module_params[0], "testing");
+}
+
+/*
+ * With ModuleDeferredStart, the modules are only registered while loading
+ * the configuration, so that the server can already answer its clients, and
+ * are started in the background.  Whoever needs one meanwhile just waits for
+ * it in start_output_module().
+ */
+static GArray *deferred_threads;
+
+static void *module_deferred_thread(void *data)
+{
+	OutputModule *module = data;
+
+	if (start_output_module(module) == 0)
+		MSG(3, "Module %s started in the background", module->name);
+
+	return NULL;
+}
+
+static void module_deferred_start(OutputModule *module)
+{
+	pthread_t thread;
+
+	module->deferred = 1;
+	if (deferred_threads == NULL)
+		deferred_threads = g_array_new(FALSE, FALSE, sizeof(pthread_t));
+	if (spd_pthread_create(&thread, NULL, module_deferred_thread,
+			       module) == 0)
+		g_array_append_val(deferred_threads, thread);
+	else
+		/* It will get started when it is needed */
+		MSG(1, "ERROR: Can't start module %s in the background",
+		    module->name);
+}
+
+/* Before the modules can be unloaded */
+void module_deferred_join(void)
+{
+	guint i;
+
+	if (deferred_threads == NULL)
+		return;
+	for (i = 0; i < deferred_threads->len; i++)
+		pthread_join(g_array_index(deferred_threads, pthread_t, i), NULL);
+	g_array_set_size(deferred_threads, 0);
+}
+
 /*
  * module_load_requested_modules: load all modules requested by calls
  * to module_add_load_request.
+ * The modules are started and initialized concurrently, since most of the
+ * time is spent waiting for them, but they are added to output_modules in
+ * the order of the requests.
  * Returns: nothing.
  * Parameters: none.
  */
 void module_load_requested_modules(void)
 {
-	while (NULL != requested_modules) {
-		OutputModule *new_module;
-		char **module_params = requested_modules->data;
+	ModuleLoad *loads;
+	GList *lp;
+	guint n, i;
+
+	gchar *environment;
+	int keep;
+
+	n = g_list_length(requested_modules);
+	loads = g_malloc0(n * sizeof(*loads));
+
+	environment = output_module_environment();
+	keep = modules_environment && !strcmp(environment, modules_environment);
+	g_free(modules_environment);
+	modules_environment = environment;
+
+	for (lp = requested_modules, i = 0; keep && lp != NULL;
+	     lp = lp->next, i++)
+		loads[i].module =
+		    module_reload_take(lp->data,
+				       module_load_lazily(lp->data));
+
+	/* Before starting the new ones, which may need the same resources */
+	g_list_foreach(reload_modules, (GFunc) unload_output_module, NULL);
+	g_list_free(reload_modules);
+	reload_modules = NULL;
+
+	for (lp = requested_modules, i = 0; lp != NULL; lp = lp->next, i++) {
+		loads[i].params = lp->data;
+		if (loads[i].module != NULL)
+			/* Kept from before the reload */
+			continue;
+		if (module_load_lazily(loads[i].params)
+		    || module_load_deferred(loads[i].params))
+			loads[i].module =
+			    register_output_module(loads[i].params[0],
+						   loads[i].params[1],
+						   loads[i].params[2],
+						   loads[i].params[3],
+						   loads[i].params[4],
+						   loads[i].params[5]);
+		else if (spd_pthread_create(&loads[i].thread, NULL,
+				       module_load_thread, &loads[i]) == 0)
+			loads[i].threaded = 1;
+		else
+			module_load_thread(&loads[i]);
+	}
 
-		new_module =
-		    load_output_module(module_params[0], module_params[1],
-				       module_params[2], module_params[3],
-				       module_params[4], module_params[5]);
+	for (i = 0; i < n; i++) {
+		char **module_params = loads[i].params;
 
-		if (new_module != NULL)
+		if (loads[i].threaded)
+			pthread_join(loads[i].thread, NULL);
+
+		if (loads[i].module != NULL) {
+			pthread_mutex_lock(&element_free_mutex);
+			output_modules_change_begin();
 			output_modules =
-			    g_list_append(output_modules, new_module);
+			    g_list_append(output_modules, loads[i].module);
+			output_modules_change_end();
+			pthread_mutex_unlock(&element_free_mutex);
+			if (!loads[i].module->lazy)
+				module_standby_spawn(loads[i].module);
+			else if (!loads[i].module->started
+				 && module_load_deferred(module_params))
+				module_deferred_start(loads[i].module);
+		}
 
 		g_free(module_params[0]);
 		g_free(module_params[1]);
@@ -832,10 +2117,13 @@ void module_load_requested_modules(void)
 		g_free(module_params[4]);
 		g_free(module_params[5]);
 		g_free(module_params);
-		requested_modules =
-		    g_list_delete_link(requested_modules, requested_modules);
 	}
 
+	g_free(loads);
+	g_list_free(requested_modules);
+	requested_modules = NULL;
+	output_modules_changed();
+
 	if (output_modules && !GlobalFDSet.output_module) {
 		OutputModule *first_module = output_modules->data;
 		GlobalFDSet.output_module = first_module->name;
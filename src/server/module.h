@@ -24,16 +24,59 @@
 #define MODULE_H
 
 #include <stdlib.h>
+#include <pthread.h>
 #include <glib.h>
 #include <spd_audio.h>
+#include <spd_audio_ring.h>
+#include "spd_audio_codec.h"
+#include <speechd_types.h>
+#include "speak_queue.h"
 
+/* Commands whose round trip with the module is timed */
+typedef enum {
+	OUTPUT_CMD_SET,
+	OUTPUT_CMD_SPEAK,		/* also CHAR, KEY and SOUND_ICON */
+	OUTPUT_CMD_STOP,		/* until the module reports it stopped */
+	OUTPUT_CMDS
+} OutputCommand;
+
+/* Traffic with a module, updated by output.c, see output_get_traffic() */
+typedef struct {
+	guint64 bytes_sent;
+	guint64 bytes_received;
+	guint replies;
+	guint events;
+	guint64 audio_bytes;	/* samples received with 705 events */
+	guint commands[OUTPUT_CMDS];
+	guint64 command_us[OUTPUT_CMDS];	/* sum of the round trips */
+	guint command_max_us[OUTPUT_CMDS];
+	gint64 stop_sent;	/* monotonic time of a STOP not reported yet */
+} OutputModuleTraffic;
+
+/* A message synthesized ahead by a module, see output_lookahead().  Used by
+   output.c under its lookahead_mutex. */
 typedef struct {
+	int active;		/* there is a look-ahead */
+	guint id;		/* id of the message, 0 once discarded */
+	char *buf;		/* its text as sent to the module */
+	GQueue events;		/* staged by the reader thread */
+	size_t bytes;
+	int done;		/* the module sent the last event */
+	int overflow;		/* staging was given up */
+	int replaying;		/* the message is being spoken */
+	guint tag;		/* the id its events carry, with message_ids */
+	int gain;		/* of its audio, see module_speak_queue_set_gain() */
+} OutputLookahead;
+
+typedef struct OutputModule {
 	char *name;
 	char *filename;
 	char *configfilename;
 	char *debugfilename;
 	char *progdir;
 	char *configdir;
+	time_t file_mtime;	/* of filename and configfilename when created */
+	time_t configfile_mtime;
 	int pipe_in[2];
 	int pipe_out[2];
 	int pipe_speak[2];
@@ -42,6 +85,43 @@ typedef struct {
 	pid_t pid;
 	int working;
 	AudioID *audio;
+	/* Settings last sent to the module with SET, name -> value */
+	GHashTable *sent_settings;
+	pthread_mutex_t lock;	/* held while exchanging a command and its reply */
+	int lock_cancelstate;	/* of the speaking thread before it took it */
+	pthread_t reader;	/* reads replies and events from the module */
+	int reader_started;
+	int reader_done;	/* the module closed its output */
+	GAsyncQueue *replies;	/* replies not consumed by output_read_reply() yet */
+	SPDAudioRing *audio_ring;	/* shared with the module for its audio */
+	size_t audio_ring_len;
+	SPDAudioCodec *audio_codec;	/* decodes its audio, see ModuleCompressAudio */
+	int message_ids;	/* tags messages and events, see output_lookahead() */
+	OutputLookahead lookahead;
+	/* State of the message it speaks, set up by output_speak() */
+	int end_queued;		/* its 702 END reached the speak queue */
+	int stop_requested;
+	int pause_requested;
+	int pause_queued;	/* the speak queue got paused at a mark */
+	int events_pending;	/* see output_events_begin() */
+	int lazy;		/* only started when needed, see start_output_module() */
+	int deferred;		/* lazy, but started right away in the background */
+	int started;		/* the module process was started */
+	gint64 last_used;	/* monotonic time the module was last picked */
+	gint64 start_failed;	/* monotonic time it last failed to start */
+	SPDVoice **voices;	/* all its voices, set once, see output_list_voices() */
+	gsize voices_bytes;	/* the size of their block */
+	/* Lowercase language, and language without its region, -> NULL
+	   terminated GPtrArray of the voices which have it, in order */
+	GHashTable *voices_by_language;
+	SPDSpeakQueueStats audio_stats;	/* of its audio played by the server */
+	OutputModuleTraffic traffic;
+	struct OutputModule *standby;	/* started spare process, see ModuleStandby */
+	int standby_starting;	/* one is being started in the background */
+	int in_process;		/* runs in a thread of ours, see ModuleInProcess */
+	void *library;		/* its shared library, while the thread runs */
+	void *inprocess;	/* what the thread shares with us */
+	pthread_t thread;
 } OutputModule;
 #define AUDIOID_TOOPEN ((AudioID*) (-1))
 
@@ -50,7 +130,24 @@ OutputModule *load_output_module(const char *mod_name, const char *mod_prog,
 				 const char *mod_cfgfile, const char *mod_dbgfile,
 				 const char *mod_prog_dir, const char *mod_cfg_dir);
 int unload_output_module(OutputModule * module);
+/* Start a lazily loaded module if needed, returns 0 if it is working */
+int start_output_module(OutputModule * module);
+/* Stop the lazily loaded modules which were not used for timeout us */
+void stop_idle_output_modules(gint64 timeout);
 int reload_output_module(OutputModule * old_module);
+/* Keep a started spare process of the module, to replace it if it dies */
+void module_add_standby_request(const char *module_name);
+/* Switch a dead module to its spare process, if it has one.  This may be
+   called from any thread, the switch is done in the main loop. */
+void module_crashed(OutputModule * module);
+/* Run the module from its shared library in a thread of the server */
+void module_add_inprocess_request(const char *module_name);
+/* Have the module compress the audio it sends, if it can */
+void module_add_compression_request(const char *module_name);
+int module_wants_compression(const char *module_name);
+/* Wait for the thread of an in-process module, making it quit if it was not
+   sent QUIT */
+void output_module_join(OutputModule * module);
 int output_module_debug(OutputModule * module);
 int output_module_nodebug(OutputModule * module);
 void destroy_module(OutputModule * module);
@@ -58,6 +155,11 @@ void destroy_module(OutputModule * module);
 void module_add_load_request(char *module_name, char *module_cmd,
 			     char *module_cfgfile, char *module_dbgfile,
 			     char *module_cmd_dir, char *module_cfg_dir);
+/* Put the loaded modules aside, for module_load_requested_modules() to
+   keep running those which are requested again the same way */
+void module_reload_begin(void);
+/* Wait for the modules being started in the background */
+void module_deferred_join(void);
 void module_load_requested_modules(void);
 guint module_number_of_requested_modules(void);
 
@@ -85,6 +85,10 @@
 #define OK_DEBUGGING					"262 OK DEBUGGING SET" NEWLINE
 
 #define OK_PITCH_RANGE_SET				"263 OK PITCH RANGE SET" NEWLINE
+#define OK_SOUND_ICON_MIXING_SET		"264 OK SOUND ICON MIXING SET" NEWLINE
+#define OK_AUDIO_RETRIEVAL_SET			"265 OK AUDIO RETRIEVAL SET" NEWLINE
+#define OK_COALESCING_SET				"266 OK COALESCING SET" NEWLINE
+#define OK_INDEX_MARK_INTERVAL_SET		"267 OK INDEX MARK INTERVAL SET" NEWLINE
 
 #define OK_NOT_IMPLEMENTED				"299 OK BUT NOT IMPLEMENTED -- DOES NOTHING" NEWLINE
 
@@ -123,6 +127,10 @@
 #define ERR_COULDNT_SET_SSML_MODE		"315 ERR COULDNT SET SSML MODE" NEWLINE
 #define ERR_COULDNT_SET_NOTIFICATION	"316 ERR COULDNT SET NOTIFICATION" NEWLINE
 #define ERR_COULDNT_SET_DEBUGGING		"317 ERR COULDNT SET DEBUGGING" NEWLINE
+#define ERR_COULDNT_SET_SOUND_ICON_MIXING	"318 ERR COULDNT SET SOUND ICON MIXING" NEWLINE
+#define ERR_COULDNT_SET_AUDIO_RETRIEVAL	"319 ERR COULDNT SET AUDIO RETRIEVAL" NEWLINE
+#define ERR_COULDNT_SET_COALESCING		"322 ERR COULDNT SET COALESCING" NEWLINE
+#define ERR_COULDNT_SET_INDEX_MARK_INTERVAL	"323 ERR COULDNT SET INDEX MARK INTERVAL" NEWLINE
 
 #define ERR_NO_SND_ICONS				"320 ERR NO SOUND ICONS" NEWLINE
 #define ERR_CANT_REPORT_VOICES			"321 ERR MODULE CANT REPORT VOICES" NEWLINE
@@ -134,6 +142,9 @@
 
 #define ERR_COULDNT_SET_PITCH_RANGE		"340 ERR COULDNT SET PITCH RANGE" NEWLINE
 
+#define ERR_TOO_MANY_MESSAGES			"352 ERR TOO MANY MESSAGES" NEWLINE
+#define ERR_CLIENT_QUEUE_FULL			"353 ERR CLIENT QUEUE FULL" NEWLINE
+
 #define ERR_NOT_IMPLEMENTED				"380 ERR NOT YET IMPLEMENTED" NEWLINE
 
 #define ERR_INVALID_COMMAND				"500 ERR INVALID COMMAND" NEWLINE
@@ -143,6 +154,7 @@
 #define ERR_NOT_A_STRING				"512 ERR PARAMETER NOT A STRING" NEWLINE
 #define ERR_PARAMETER_NOT_ON_OFF		"513 ERR PARAMETER NOT ON OR OFF" NEWLINE
 #define ERR_PARAMETER_INVALID			"514 ERR PARAMETER INVALID" NEWLINE
+#define ERR_NO_FILE_DESCRIPTOR			"515 ERR NO FILE DESCRIPTOR PASSED" NEWLINE
 
 #define EVENT_INDEX_MARK_C				"700"
 #define EVENT_INDEX_MARK				EVENT_INDEX_MARK_C" INDEX MARK" NEWLINE
@@ -156,5 +168,9 @@
 #define EVENT_PAUSED					EVENT_PAUSED_C" PAUSED" NEWLINE
 #define EVENT_RESUMED_C					"705"
 #define EVENT_RESUMED					EVENT_RESUMED_C" RESUMED" NEWLINE
+#define EVENT_VOICES_CHANGED_C			"706"
+#define EVENT_VOICES_CHANGED				EVENT_VOICES_CHANGED_C" VOICES CHANGED" NEWLINE
+#define EVENT_AUDIO_C					"707"
+#define EVENT_AUDIO						EVENT_AUDIO_C" AUDIO" NEWLINE
 
 #endif /* MSG_H */
@@ -31,6 +31,7 @@
 #include "speechd.h"
 
 #include "options.h"
+#include "symbols.h"
 
 #include <i18n.h>
 
@@ -50,10 +51,11 @@ static const struct option spd_long_options[] = {
 	{"help", no_argument, 0, 'h'},
 	{"timeout", required_argument, 0, 't'},
 	{"module-dir", required_argument, 0, 'm'},
+	{"compile-symbols", required_argument, 0, 'y'},
 	{0, 0, 0, 0}
 };
 
-static const char *const spd_short_options = "dsal:L:c:S:p:P:C:t:vDhm:";
+static const char *const spd_short_options = "dsal:L:c:S:p:P:C:t:vDhm:y:";
 
 void options_print_help(char *argv[])
 {
@@ -101,6 +103,10 @@ void options_print_help(char *argv[])
 	printf(_("Set path to configuration\n"));
 	printf("  -m, --module-dir      ");
 	printf(_("Set path to modules\n"));
+	printf("  -y, --compile-symbols ");
+	printf(_("Compile the symbols files found in a locale directory\n"));
+	printf("                        ");
+	printf(_("for faster loading, and exit\n"));
 	printf("  -v, --version         ");
 	printf(_("Report version of this program\n"));
 	printf("  -D, --debug           ");
@@ -242,6 +248,9 @@ void options_parse(int argc, char *argv[])
 		case 't':
 			SPD_OPTION_SET_INT(server_timeout);
 			break;
+		case 'y':
+			exit(symbols_compile_dir(optarg) < 0 ? 1 : 0);
+			break;
 		default:
 			MSG(2, "Unrecognized option\n");
 			options_print_help(argv);
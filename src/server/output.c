@@ -23,12 +23,19 @@
 #include <config.h>
 #endif
 
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <fdsetconv.h>
 #include <safe_io.h>
 #include "output.h"
 #include "parse.h"
 #include "speak_queue.h"
 #include "index_marking.h"
+#include "sem_functions.h"
+#include "spd_audio_convert.h"
+#include "set.h"
+#include "msg.h"
+#include "server.h"
 
 #ifndef HAVE_STRNDUP
 /*
@@ -55,92 +62,376 @@ char *strndup(const char *s, size_t n)
 }
 #endif /* HAVE_STRNDUP */
 
-static pthread_t output_thread;
-static void *output_thread_func(void *data);
-static int output_end_queued;
-static int output_stop_requested;
-static int output_pause_requested;
-static int output_pause_queued;
+static void *output_reader_func(void *data);
+static void output_lookahead_discard(OutputModule * output);
+static void output_lookahead_wait(OutputModule * output);
+static int output_lookahead_synthesized(OutputModule * output);
 
-static void output_open_audio(OutputModule *output)
+/* Fills the parameters of spd_audio_open(), the numbers are printed into
+ * MIN_LENGTH and IDLE_TIMEOUT, both of 11 bytes */
+static void output_audio_pars(void **pars, const char *name,
+			      char *min_length, char *idle_timeout)
 {
-	void *pars[9] = { NULL };
-	char min_length[11];
-	char *error, *first_error = 0;
-	gchar **outputs;
-	int i;
-
 	pars[0] = GlobalFDSet.audio_oss_device;
 	pars[1] = GlobalFDSet.audio_alsa_device;
 	pars[2] = GlobalFDSet.audio_nas_server;
 	pars[3] = GlobalFDSet.audio_pulse_device;
-	snprintf(min_length, sizeof(min_length), "%u", GlobalFDSet.audio_pulse_min_length);
+	snprintf(min_length, 11, "%u", GlobalFDSet.audio_pulse_min_length);
 	pars[4] = min_length;
-	pars[5] = output->name;
+	pars[5] = (void *) name;
+	snprintf(idle_timeout, 11, "%u", GlobalFDSet.audio_alsa_idle_timeout);
+	pars[6] = idle_timeout;
+	pars[7] = SpeechdOptions.audio_file_path;
+	pars[8] = SpeechdOptions.audio_rtp_destination;
+	pars[9] = SpeechdOptions.audio_sink_real_time ? "1" : NULL;
+}
+
+/* The methods of AudioOutputMethod are tried at startup, all at once, so
+ * that the first utterance does not pay for the ones which do not work.  */
+typedef enum {
+	OUTPUT_PROBE_PENDING,
+	OUTPUT_PROBE_OK,
+	OUTPUT_PROBE_FAILED
+} OutputProbeState;
+
+typedef struct {
+	gchar *method;
+	OutputProbeState state;
+	pthread_t thread;
+	gboolean started;
+} OutputAudioProbe;
+
+static pthread_mutex_t output_probe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_probe_cond = PTHREAD_COND_INITIALIZER;
+static OutputAudioProbe *output_probes;
+static int output_probes_n;
+
+static void *output_probe_func(void *data)
+{
+	OutputAudioProbe *probe = data;
+	void *pars[11] = { NULL };
+	char min_length[11];
+	char idle_timeout[11];
+	char *error;
+	AudioID *audio;
+
+	output_audio_pars(pars, "speech-dispatcher", min_length, idle_timeout);
+	audio = spd_audio_open(probe->method, pars, &error);
+	if (audio) {
+		MSG(4, "Audio output method %s works", probe->method);
+		spd_audio_close(audio);
+	} else {
+		MSG(4, "Audio output method %s does not work: %s",
+		    probe->method, error);
+		g_free(error);
+	}
+
+	pthread_mutex_lock(&output_probe_mutex);
+	probe->state = audio ? OUTPUT_PROBE_OK : OUTPUT_PROBE_FAILED;
+	pthread_cond_broadcast(&output_probe_cond);
+	pthread_mutex_unlock(&output_probe_mutex);
+
+	return NULL;
+}
+
+/* The probes are replaced from the main loop, and looked at by whoever
+ * opens audio, with output_probe_mutex held */
+static void output_probe_free(void)
+{
+	OutputAudioProbe *probes;
+	int probes_n, i;
+
+	pthread_mutex_lock(&output_probe_mutex);
+	probes = output_probes;
+	probes_n = output_probes_n;
+	pthread_mutex_unlock(&output_probe_mutex);
+
+	/* They take the mutex to tell they are done */
+	for (i = 0; i < probes_n; i++) {
+		if (probes[i].started)
+			pthread_join(probes[i].thread, NULL);
+	}
+
+	pthread_mutex_lock(&output_probe_mutex);
+	output_probes = NULL;
+	output_probes_n = 0;
+	pthread_mutex_unlock(&output_probe_mutex);
+
+	for (i = 0; i < probes_n; i++)
+		g_free(probes[i].method);
+	g_free(probes);
+}
+
+/* Starts probing the audio output methods of the configuration */
+void output_probe_audio(void)
+{
+	OutputAudioProbe *probes;
+	gchar **outputs;
+	int probes_n, i;
+
+	/* After a reload, wait for the previous probes */
+	output_probe_free();
 
 	outputs = g_strsplit(GlobalFDSet.audio_output_method, ",", 0);
-	for (i = 0; NULL != outputs[i]; i++) {
-		output->audio =
-		    spd_audio_open(outputs[i], pars, &error);
-		if (output->audio) {
-			DBG("Using %s audio output method", outputs[i]);
-			g_strfreev(outputs);
-
-			/* Volume is controlled by the synthesizer. Always play at normal on audio device. */
-			if (spd_audio_set_volume(output->audio, 85) < 0) {
-				DBG("Can't set volume. audio not initialized?");
-			}
+	probes_n = g_strv_length(outputs);
+	probes = g_new0(OutputAudioProbe, probes_n);
+	for (i = 0; i < probes_n; i++) {
+		probes[i].method = g_strdup(outputs[i]);
+		probes[i].state = OUTPUT_PROBE_PENDING;
+	}
+	g_strfreev(outputs);
 
-			g_free(first_error);
-			return;
+	pthread_mutex_lock(&output_probe_mutex);
+	output_probes = probes;
+	output_probes_n = probes_n;
+	pthread_mutex_unlock(&output_probe_mutex);
+
+	for (i = 0; i < probes_n; i++) {
+		if (spd_pthread_create(&probes[i].thread, NULL,
+				       output_probe_func, &probes[i]) == 0) {
+			probes[i].started = TRUE;
+		} else {
+			MSG(1, "Can't create a thread to probe %s audio",
+			    probes[i].method);
+			pthread_mutex_lock(&output_probe_mutex);
+			probes[i].state = OUTPUT_PROBE_FAILED;
+			pthread_cond_broadcast(&output_probe_cond);
+			pthread_mutex_unlock(&output_probe_mutex);
+		}
+	}
+}
+
+/* Returns the first audio output method of the configuration which works,
+ * waiting for the probes to tell, or NULL if none does */
+static gchar *output_probed_audio_method(void)
+{
+	gchar *method = NULL;
+	int i;
+
+	pthread_mutex_lock(&output_probe_mutex);
+	for (i = 0; i < output_probes_n; i++) {
+		if (output_probes[i].state == OUTPUT_PROBE_PENDING) {
+			pthread_cond_wait(&output_probe_cond,
+					  &output_probe_mutex);
+			/* They may have been replaced meanwhile */
+			i = -1;
+			continue;
 		}
-		DBG("Can't use %s: %s", outputs[i], error);
-		if (!first_error)
-			first_error = error;
+		if (output_probes[i].state == OUTPUT_PROBE_OK) {
+			method = g_strdup(output_probes[i].method);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&output_probe_mutex);
+
+	return method;
+}
+
+/* Opens METHOD for OUTPUT, keeps the first error in FIRST_ERROR */
+static gboolean output_try_audio(OutputModule * output, const char *method,
+				 void **pars, char **first_error)
+{
+	char *error;
+
+	output->audio = spd_audio_open(method, pars, &error);
+	if (!output->audio) {
+		DBG("Can't use %s: %s", method, error);
+		if (!*first_error)
+			*first_error = error;
 		else
 			g_free(error);
+		return FALSE;
+	}
+
+	DBG("Using %s audio output method", method);
+
+	/* Volume is controlled by the synthesizer. Always play at normal on audio device. */
+	if (spd_audio_set_volume(output->audio, 85) < 0) {
+		DBG("Can't set volume. audio not initialized?");
+	}
+
+	if (SpeechdOptions.audio_sample_rate
+	    && spd_audio_set_rate(output->audio,
+				  SpeechdOptions.audio_sample_rate) < 0)
+		DBG("Can't resample to %d Hz",
+		    SpeechdOptions.audio_sample_rate);
+
+	return TRUE;
+}
+
+static void output_open_audio(OutputModule *output)
+{
+	void *pars[11] = { NULL };
+	char min_length[11];
+	char idle_timeout[11];
+	char *first_error = 0;
+	gchar **outputs;
+	gchar *probed;
+	int i;
+
+	output_audio_pars(pars, output->name, min_length, idle_timeout);
+
+	/* Try the method which was found to work first, and the others in
+	 * case it does not any more */
+	probed = output_probed_audio_method();
+	if (probed && output_try_audio(output, probed, pars, &first_error)) {
+		g_free(probed);
+		return;
+	}
+
+	outputs = g_strsplit(GlobalFDSet.audio_output_method, ",", 0);
+	for (i = 0; NULL != outputs[i]; i++) {
+		if (probed && !strcmp(outputs[i], probed))
+			continue;
+		if (output_try_audio(output, outputs[i], pars, &first_error))
+			break;
 	}
 
-	MSG(1, "Opening audio failed: %s\n", first_error);
+	if (!output->audio)
+		MSG(1, "Opening audio failed: %s\n", first_error);
 	g_free(first_error);
+	g_free(probed);
 	g_strfreev(outputs);
 }
 
+/* Whether we apply the volume of the messages for output */
+static gboolean output_server_volume(OutputModule * output)
+{
+	return SpeechdOptions.audio_server_volume && output->audio != NULL;
+}
+
+/* The gain the audio of msg gets in the speak queue */
+static int output_message_gain(TSpeechDMessage * msg, OutputModule * output)
+{
+	if (output_server_volume(output))
+		return spd_audio_volume_gain(msg->settings.msg_settings.volume);
+	return 256;
+}
+
+/* The message being spoken has its audio sent to its client, see
+ * output_send_client_audio() */
+static int output_retrieving;
+static int output_retrieve_id;
+static int output_retrieve_uid;
+/* The client did not read the audio of the message, the rest is dropped */
+static int output_retrieve_stalled;
+
+/* Whether the events of the message being spoken go through the speak queue,
+ * otherwise they are reported as they come from the module */
+static int output_speak_queue(OutputModule * output)
+{
+	return output->audio && !output_retrieving;
+}
+
 void output_set_speaking_monitor(TSpeechDMessage * msg, OutputModule * output)
 {
 	/* Set the speaking-monitor so that we know who is speaking */
 	speaking_module = output;
-	if (output->audio) {
+	/* Only modules which send us their audio can give it to the client */
+	output_retrieving = msg->settings.audio_retrieval && output->audio;
+	output_retrieve_id = msg->id;
+	output_retrieve_uid = msg->settings.uid;
+	output_retrieve_stalled = 0;
+	if (msg->settings.audio_retrieval && !output->audio)
+		MSG(3, "Module %s plays audio itself, can't send it to the client",
+		    output->name);
+	if (output->audio && !output_retrieving) {
 		if (output->audio == AUDIOID_TOOPEN)
 			output_open_audio(output);
 		module_audio_id = output->audio;
 	}
+	module_speak_queue_set_gain(output_message_gain(msg, output));
 	speaking_uid = msg->settings.uid;
 	speaking_gid = msg->settings.reparted;
 }
 
-OutputModule *get_output_module_by_name(const char *name)
+/*
+ * Modules are looked up by name for each message, through an index of
+ * output_modules which gets rebuilt on the next lookup once
+ * output_modules_changed() was called.  That must be done before a module
+ * gets removed from the list or freed.
+ */
+static GHashTable *output_index;
+static guint output_index_generation;
+static guint output_modules_generation = 1;
+static pthread_mutex_t output_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void output_modules_changed(void)
 {
-	OutputModule *output;
-	int i;
+	g_atomic_int_inc(&output_modules_generation);
+}
+
+/* Held for reading by the threads other than the main loop which look
+   modules up and use them, and for writing to change the list of modules or
+   before destroying one, so that they never use a module freed meanwhile */
+static pthread_rwlock_t output_modules_rwlock = PTHREAD_RWLOCK_INITIALIZER;
+
+void output_modules_use_begin(void)
+{
+	pthread_rwlock_rdlock(&output_modules_rwlock);
+}
+
+void output_modules_use_end(void)
+{
+	pthread_rwlock_unlock(&output_modules_rwlock);
+}
 
-	for (i = 0; i < g_list_length(output_modules); i++) {
-		output = g_list_nth_data(output_modules, i);
-		if (!strcmp(output->name, name)) {
-			if (output->working)
-				return output;
-			else
-				return NULL;
+void output_modules_change_begin(void)
+{
+	pthread_rwlock_wrlock(&output_modules_rwlock);
+}
+
+void output_modules_change_end(void)
+{
+	pthread_rwlock_unlock(&output_modules_rwlock);
+}
+
+/* Find a module, whether it is working or not */
+static OutputModule *output_find_module(const char *name)
+{
+	OutputModule *output;
+	guint generation;
+	GList *gl;
+
+	pthread_mutex_lock(&output_index_mutex);
+	generation = g_atomic_int_get(&output_modules_generation);
+	if (!output_index || output_index_generation != generation) {
+		if (!output_index)
+			output_index = g_hash_table_new(g_str_hash, g_str_equal);
+		else
+			g_hash_table_remove_all(output_index);
+		/* The first one of a name is the one which gets used */
+		for (gl = g_list_last(output_modules); gl != NULL;
+		     gl = gl->prev) {
+			output = gl->data;
+			g_hash_table_insert(output_index, output->name, output);
 		}
+		output_index_generation = generation;
 	}
+	output = g_hash_table_lookup(output_index, name);
+	pthread_mutex_unlock(&output_index_mutex);
 
-	return NULL;
+	return output;
+}
+
+OutputModule *get_output_module_by_name(const char *name)
+{
+	OutputModule *output = output_find_module(name);
+
+	if (output == NULL)
+		return NULL;
+	if (output->lazy && start_output_module(output) != 0)
+		return NULL;
+	if (output->working)
+		return output;
+	else
+		return NULL;
 }
 
 OutputModule *get_some_output_module_by_name(const char *name)
 {
 	OutputModule *output = NULL;
-	int i, len;
+	GList *gl;
 
 	if (name != NULL) {
 		MSG(5, "Desired output module is %s", name);
@@ -161,12 +452,13 @@ OutputModule *get_some_output_module_by_name(const char *name)
 	MSG(3, "Couldn't load default output module, trying other modules");
 
 	/* Try all other output modules other than dummy */
-	len = g_list_length(output_modules);
-	for (i = 0; i < len; i++) {
-		output = g_list_nth_data(output_modules, i);
+	for (gl = output_modules; gl != NULL; gl = gl->next) {
+		output = gl->data;
 		if (0 == strcmp(output->name, "dummy"))
 			continue;
 
+		if (output->lazy)
+			start_output_module(output);
 		if (output->working) {
 			MSG(3, "Output module %s seems to be working, using it",
 			    output->name);
@@ -213,34 +505,161 @@ OutputModule *get_output_module(const TSpeechDMessage * message)
  * Note: commands are send to the output modules both from the clients and from
  * the speaking thread. They both use output_lock/unlock around sending a
  * command and getting a reply, to avoid getting the reply for each other.
+ * The lock is per module, so that talking to one module does not wait for
+ * another one; the state of the message being spoken is protected by the
+ * lock of speaking_module.
  *
  * During speech, the output module sends asynchronous events (marks,
- * audio). This is handled along the way. We however need them to be handled
- * also when there is no client or speaking command. We thus also start a thread
- * that merely processes them.
+ * audio). Each module has a reader thread which reads everything the module
+ * sends: it queues replies for output_read_reply() and processes events
+ * right away, whether or not somebody is waiting for a reply.
  */
 
-static int oldstate;
-void
-static output_lock(void)
+void output_lock(OutputModule * output)
 {
+	int oldstate = PTHREAD_CANCEL_ENABLE;
+
 	if (pthread_self() == speak_thread)
 		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
-	pthread_mutex_lock(&output_layer_mutex);
+	pthread_mutex_lock(&output->lock);
+	/* Only the holder of the lock uses it */
+	output->lock_cancelstate = oldstate;
 }
 
-void
-static output_unlock(void)
+void output_unlock(OutputModule * output)
 {
-	pthread_mutex_unlock(&output_layer_mutex);
+	int oldstate = output->lock_cancelstate;
+
+	pthread_mutex_unlock(&output->lock);
 	if (pthread_self() == speak_thread)
 		pthread_setcancelstate(oldstate, NULL);
 }
 
+/* Unlocks the module named output in the calling function */
 #define OL_RET(value) \
-	do {  output_unlock(); \
+	do {  output_unlock(output); \
 		return (value); } while (0)
 
+/* Maximum size of a raw audio frame we accept from a module */
+#define MAX_RAW_AUDIO (16 * 1024 * 1024)
+
+/* Protects the traffic of all the modules, which is updated by the threads
+   talking to them and by their reader threads */
+static pthread_mutex_t output_traffic_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void output_traffic_bytes(OutputModule * output, gsize sent,
+				 gsize received)
+{
+	pthread_mutex_lock(&output_traffic_mutex);
+	output->traffic.bytes_sent += sent;
+	output->traffic.bytes_received += received;
+	pthread_mutex_unlock(&output_traffic_mutex);
+}
+
+/* Count a reply, an event, or audio_bytes of samples received */
+static void output_traffic_received(OutputModule * output, guint replies,
+				    guint events, gsize audio_bytes)
+{
+	pthread_mutex_lock(&output_traffic_mutex);
+	output->traffic.replies += replies;
+	output->traffic.events += events;
+	output->traffic.audio_bytes += audio_bytes;
+	pthread_mutex_unlock(&output_traffic_mutex);
+}
+
+/* Account the round trip of cmd, which was sent at start */
+static void output_traffic_command(OutputModule * output, OutputCommand cmd,
+				   gint64 start)
+{
+	gint64 elapsed = g_get_monotonic_time() - start;
+	guint max = MIN(elapsed, G_MAXUINT);
+
+	pthread_mutex_lock(&output_traffic_mutex);
+	output->traffic.commands[cmd]++;
+	output->traffic.command_us[cmd] += elapsed;
+	output->traffic.command_max_us[cmd] =
+	    MAX(output->traffic.command_max_us[cmd], max);
+	pthread_mutex_unlock(&output_traffic_mutex);
+}
+
+/* The module reported the end of a message with event, which completes
+   the round trip of a STOP if it stopped.  Modules which were already done
+   do not report anything for a STOP, it gets forgotten at the next end. */
+static void output_traffic_end(OutputModule * output, const char *event)
+{
+	gint64 start;
+
+	pthread_mutex_lock(&output_traffic_mutex);
+	start = output->traffic.stop_sent;
+	output->traffic.stop_sent = 0;
+	pthread_mutex_unlock(&output_traffic_mutex);
+	if (start && !strncmp(event, "703", 3))
+		output_traffic_command(output, OUTPUT_CMD_STOP, start);
+}
+
+void output_get_traffic(OutputModule * output, OutputModuleTraffic * copy)
+{
+	pthread_mutex_lock(&output_traffic_mutex);
+	*copy = output->traffic;
+	pthread_mutex_unlock(&output_traffic_mutex);
+}
+
+/* Log the traffic with output, to compare modules from their logs */
+static void output_log_traffic(OutputModule * output)
+{
+	static const char *const commands[OUTPUT_CMDS] = {
+		"SET", "SPEAK", "STOP"
+	};
+	OutputModuleTraffic traffic;
+	int cmd;
+
+	output_get_traffic(output, &traffic);
+	MSG(4, "Module %s: %" G_GUINT64_FORMAT " bytes sent, %"
+	    G_GUINT64_FORMAT " received, %u replies, %u events, %"
+	    G_GUINT64_FORMAT " bytes of audio", output->name,
+	    traffic.bytes_sent, traffic.bytes_received, traffic.replies,
+	    traffic.events, traffic.audio_bytes);
+	for (cmd = 0; cmd < OUTPUT_CMDS; cmd++)
+		if (traffic.commands[cmd])
+			MSG(4, "Module %s: %u %s, avg=%" G_GUINT64_FORMAT
+			    "us max=%uus", output->name, traffic.commands[cmd],
+			    commands[cmd],
+			    traffic.command_us[cmd] / traffic.commands[cmd],
+			    traffic.command_max_us[cmd]);
+}
+
+/* Read the samples announced by a 705-RAW header line, or the packets
+   announced by a 705-OPUS one, straight into the message */
+static int output_read_raw_audio(OutputModule * output, GString * rstr,
+				 const char *line)
+{
+	int bits, num_channels, sample_rate, num_samples, big_endian;
+	size_t size, pos;
+	int fields;
+
+	if (!strncmp(line, "705-OPUS ", 9))
+		fields = sscanf(line, "705-OPUS %d %d %d %*d %zu", &num_channels,
+				&sample_rate, &num_samples, &size) + 2;
+	else
+		fields = sscanf(line, "705-RAW %d %d %d %d %d %zu", &bits,
+				&num_channels, &sample_rate, &num_samples,
+				&big_endian, &size);
+	if (fields != 6 || size > MAX_RAW_AUDIO) {
+		MSG2(2, "output_module", "ERROR: bogus raw audio header %s",
+		     line);
+		return -1;
+	}
+
+	pos = rstr->len;
+	g_string_set_size(rstr, pos + size);
+	if (fread(rstr->str + pos, 1, size, output->stream_out) != size) {
+		MSG(2, "Error: Broken pipe to module while reading audio.");
+		return -1;
+	}
+
+	return 0;
+}
+
 GString *output_read_message(OutputModule * output)
 {
 	GString *rstr;
@@ -264,6 +683,13 @@ GString *output_read_message(OutputModule * output)
 			MSG(5, "Got %d bytes from output module over socket",
 			    bytes);
 			g_string_append_len(rstr, line, bytes);
+			if ((!strncmp(line, "705-RAW ", 8)
+			     || !strncmp(line, "705-OPUS ", 9))
+			    && output_read_raw_audio(output, rstr, line) != 0) {
+				output->working = 0;
+				output_check_module(output);
+				errors = TRUE;
+			}
 		}
 		/* terminate if we reached the last line (without '-' after numcode) */
 	} while (!errors && !((strlen(line) < 4) || (line[3] == ' ')));
@@ -274,96 +700,89 @@ GString *output_read_message(OutputModule * output)
 	if (errors) {
 		g_string_free(rstr, TRUE);
 		rstr = NULL;
-	}
+	} else
+		output_traffic_bytes(output, 0, rstr->len);
 
 	return rstr;
 }
 
-/*
- * Read a message.
- * If read_events is 1, we only return event messages
- * If read_events is 0, we only return non-event messages
- */
-static pthread_mutex_t output_read_mutex = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t output_reply_cond = PTHREAD_COND_INITIALIZER;
-static pthread_cond_t output_event_cond = PTHREAD_COND_INITIALIZER;
-static GString *output_reply;
-static GString *output_event;
-static int output_reading_message;
+/* Protects the events_pending of the modules, which is set while the reader
+   thread of a module may still process events of the message it speaks */
+static pthread_mutex_t output_events_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t output_events_cond = PTHREAD_COND_INITIALIZER;
 
-GString *output_read_reply(OutputModule * output)
+static void output_events_begin(OutputModule * output)
 {
-	GString *message = NULL;
-	pthread_mutex_lock(&output_read_mutex);
-	while (!message) {
-		while (output_reading_message && !output_reply)
-			/* Somebody reading events, wait for it */
-			pthread_cond_wait(&output_reply_cond, &output_read_mutex);
-
-		if (output_reply) {
-			/* The other thread got a message for us, consume it */
-			message = output_reply;
-			output_reply = NULL;
-			/* And tell the other thread we got it */
-			pthread_cond_signal(&output_event_cond);
-			break;
-		}
+	pthread_mutex_lock(&output_events_mutex);
+	output->events_pending = 1;
+	pthread_mutex_unlock(&output_events_mutex);
+}
 
-		if (!output_reading_message) {
-			/* Nobody reading, do read */
-			message = output_read_message(output);
-			if (!message)
-				/* Module broke */
-				break;
-			if (message->str[0] == '7') {
-				/* An event, leave it up to the event thread */
-				output_event = message;
-				message = NULL;
-				/* Wait for it to consume it */
-				while (output_event)
-					pthread_cond_wait(&output_reply_cond, &output_read_mutex);
-			}
-		}
+static void output_events_done(OutputModule * output)
+{
+	pthread_mutex_lock(&output_events_mutex);
+	output->events_pending = 0;
+	pthread_cond_broadcast(&output_events_cond);
+	pthread_mutex_unlock(&output_events_mutex);
+}
+
+static void output_events_wait(OutputModule * output)
+{
+	pthread_mutex_lock(&output_events_mutex);
+	while (output->events_pending)
+		pthread_cond_wait(&output_events_cond, &output_events_mutex);
+	pthread_mutex_unlock(&output_events_mutex);
+}
+
+int output_start_reader(OutputModule * output)
+{
+	int ret;
+
+	ret = spd_pthread_create(&output->reader, NULL, output_reader_func,
+				 output);
+	if (ret != 0) {
+		MSG(1, "ERROR: Can't create the reader thread for module %s",
+		    output->name);
+		return -1;
 	}
-	pthread_mutex_unlock(&output_read_mutex);
-	return message;
+	output->reader_started = 1;
+
+	return 0;
 }
 
-GString *output_read_event(OutputModule * output)
+void output_join_reader(OutputModule * output)
 {
-	GString *message = NULL;
-	pthread_mutex_lock(&output_read_mutex);
-	while (!message) {
-		while (output_reading_message && !output_event)
-			/* Somebody reading replies, wait for it */
-			pthread_cond_wait(&output_event_cond, &output_read_mutex);
+	if (!output->reader_started)
+		return;
+	pthread_join(output->reader, NULL);
+	output->reader_started = 0;
+}
 
-		if (output_event) {
-			/* The other thread got a message for us, consume it */
-			message = output_event;
-			output_event = NULL;
-			/* And tell the other thread we got it */
-			pthread_cond_signal(&output_reply_cond);
-			break;
-		}
+/* Get the next reply of the module, NULL if the module broke */
+GString *output_read_reply(OutputModule * output)
+{
+	GString *message;
+
+	if (!output->reader_started) {
+		/* Still initializing the module, nobody else reads */
+		message = output_read_message(output);
+		if (message)
+			output_traffic_received(output, 1, 0, 0);
+		return message;
+	}
 
-		if (!output_reading_message) {
-			/* Nobody reading, do read */
-			message = output_read_message(output);
-			if (!message)
-				/* Module broke */
-				break;
-			if (message->str[0] != '7') {
-				/* A reply, leave it up to the reply thread */
-				output_reply = message;
-				message = NULL;
-				/* Wait for it to consume it */
-				while (output_reply)
-					pthread_cond_wait(&output_event_cond, &output_read_mutex);
-			}
-		}
+	if (g_atomic_int_get(&output->reader_done)
+	    && g_async_queue_length(output->replies) <= 0)
+		return NULL;
+
+	message = g_async_queue_pop(output->replies);
+	if (message->len == 0) {
+		/* Pushed by the reader when the module went away */
+		g_string_free(message, TRUE);
+		return NULL;
 	}
-	pthread_mutex_unlock(&output_read_mutex);
+	output_traffic_received(output, 1, 0, 0);
+
 	return message;
 }
 
@@ -377,6 +796,13 @@ int output_send_data(const char *cmd, OutputModule * output, int wfr)
 	if (cmd == NULL)
 		return -1;
 
+	if (!strcmp(cmd, "STOP\n")) {
+		/* Timed until the module reports it stopped */
+		pthread_mutex_lock(&output_traffic_mutex);
+		output->traffic.stop_sent = g_get_monotonic_time();
+		pthread_mutex_unlock(&output_traffic_mutex);
+	}
+
 	ret = safe_write(output->pipe_in[1], cmd, strlen(cmd));
 	fflush(NULL);
 	if (ret == -1) {
@@ -386,6 +812,7 @@ int output_send_data(const char *cmd, OutputModule * output, int wfr)
 		output_check_module(output);
 		return -1;	/* Broken pipe */
 	}
+	output_traffic_bytes(output, strlen(cmd), 0);
 	MSG2(5, "output_module", "Command sent to output module: |%s| (%d)",
 	     cmd, wfr);
 
@@ -444,27 +871,64 @@ static void free_voice(gpointer data)
 	}
 }
 
-SPDVoice **output_get_voices(OutputModule * module, const char *language, const char *variant)
+/* Parse the 200-name\tlanguage\tvariant lines of a LIST VOICES reply in
+   place, returns the number of voices or -1 on bad syntax */
+static int output_parse_voices(char *reply, GPtrArray *voices)
 {
-	SPDVoice **voice_dscr;
+	char *line, *next, *language, *variant;
 	SPDVoice *voice;
+
+	for (line = reply; *line; line = next) {
+		next = strchr(line, '\n');
+		if (next)
+			*next++ = 0;
+		else
+			next = line + strlen(line);
+
+		if (strlen(line) <= 4) {
+			MSG(1,
+			    "ERROR: Bad communication from driver in synth_voices");
+			return -1;
+		}
+		if (line[3] == ' ')
+			break;
+		if (line[3] != '-')
+			continue;
+
+		// Name, language, variant
+		language = strchr(line + 4, '\t');
+		variant = language ? strchr(language + 1, '\t') : NULL;
+		if (variant == NULL)
+			return -1;
+		*language++ = 0;
+		*variant++ = 0;
+		/* Later fields are for newer servers */
+		variant[strcspn(variant, "\t")] = 0;
+
+		voice = g_malloc(sizeof(SPDVoice));
+		voice->name = g_strdup(line + 4);
+		voice->language = g_strdup(language);
+		voice->variant = g_strdup(variant);
+		g_ptr_array_add(voices, voice);
+	}
+
+	return voices->len;
+}
+
+SPDVoice **output_get_voices(OutputModule * module, const char *language, const char *variant)
+{
+	GPtrArray *voices;
 	GString *reply;
-	gchar **lines;
-	gchar **atoms;
-	GQueue *voices;
-	int i;
-	int numvoices = 0;
-	gboolean errors = FALSE;
 	int err;
 	char *command;
 	char *all_command = "LIST VOICES\n";
 
-	output_lock();
-
 	if (module == NULL) {
 		MSG(1, "ERROR: Can't list voices for broken output module");
-		OL_RET(NULL);
+		return NULL;
 	}
+
+	output_lock(module);
 	command = g_strdup_printf("LIST VOICES%s%s%s%s\n",
 				  language ? " " : "",
 				  language ? language : "",
@@ -475,86 +939,114 @@ retry:
 	if (command != all_command)
 		free(command);
 	if (err < 0) {
-		output_unlock();
+		output_unlock(module);
 		return NULL;
 	}
 	reply = output_read_reply(module);
 
 	if (reply == NULL) {
-		output_unlock();
+		output_unlock(module);
 		return NULL;
 	}
 
-	lines = g_strsplit(reply->str, "\n", -1);
-	g_string_free(reply, TRUE);
-
-	if (!strncmp(lines[0], "300", 3) && command != all_command) {
+	if (!strncmp(reply->str, "300", 3) && command != all_command) {
 		/* Old module that doesn't support filtering? Try to get it all
 		 * instead */
-		g_strfreev(lines);
+		g_string_free(reply, TRUE);
 		command = all_command;
 		goto retry;
 	}
+	output_unlock(module);
 
-	voices = g_queue_new();
-	for (i = 0; !errors && (lines[i] != NULL); i++) {
-		MSG(1, "LINE here:|%s|", lines[i]);
-		if (strlen(lines[i]) <= 4) {
-			MSG(1,
-			    "ERROR: Bad communication from driver in synth_voices");
-			errors = TRUE;
-		} else if (lines[i][3] == ' ')
-			break;
-		else if (lines[i][3] == '-') {
-			atoms = g_strsplit(&lines[i][4], "\t", 0);
-			// Name, language, variant
-			if ((atoms[0] == NULL) || (atoms[1] == NULL)
-			    || (atoms[2] == NULL)) {
-				errors = TRUE;
-			} else {
-				//Fill in VoiceDescription
-				voice = g_malloc(sizeof(SPDVoice));
-				voice->name = g_strdup(atoms[0]);
-				voice->language = g_strdup(atoms[1]);
-				voice->variant = g_strdup(atoms[2]);
-				g_queue_push_tail(voices, voice);
-			}
-			g_strfreev(atoms);
-		}
-		/* Should we do something in a final "else" branch? */
-
+	voices = g_ptr_array_new();
+	err = output_parse_voices(reply->str, voices);
+	g_string_free(reply, TRUE);
+	if (err < 0) {
+		g_ptr_array_foreach(voices, (GFunc) free_voice, NULL);
+		g_ptr_array_free(voices, TRUE);
+		return NULL;
 	}
 
-	numvoices = g_queue_get_length(voices);
+	g_ptr_array_add(voices, NULL);
+	return (SPDVoice **) g_ptr_array_free(voices, FALSE);
+}
 
-	if (errors == TRUE) {
-		g_queue_free_full(voices, (GDestroyNotify)free_voice);
-		g_strfreev(lines);
-		output_unlock();
-		return NULL;
+/* Whether a voice matches the filter of LIST VOICES, the same way as
+   the modules do it */
+static int output_voice_matches(const SPDVoice * voice, const char *language,
+				const char *variant)
+{
+	const char *dash;
+
+	if (language == NULL)
+		return 1;
+	if (strcasecmp(language, voice->language)) {
+		/* Not exactly the requested locale, but maybe the language? */
+		dash = strchr(voice->language, '-');
+		if (dash == NULL
+		    || strlen(language) != (size_t) (dash - voice->language)
+		    || strncasecmp(language, voice->language,
+				   dash - voice->language))
+			return 0;
 	}
+	if (variant != NULL && strcasecmp(variant, voice->variant))
+		return 0;
 
-	voice_dscr = g_malloc((numvoices + 1) * sizeof(SPDVoice *));
+	return 1;
+}
 
-	for (i = 0; i < numvoices; i++) {
-		voice_dscr[i] = g_queue_pop_head(voices);
-	}
+/* Copy the cached voices of a module which match the filter */
+static SPDVoice **output_copy_voices(SPDVoice **voices, const char *language,
+				     const char *variant)
+{
+	SPDVoice **copy;
+	int i, j, n;
 
-	voice_dscr[i] = NULL;
-	g_queue_free(voices);
-	g_strfreev(lines);
+	for (n = 0; voices[n]; n++) ;
+	copy = g_malloc((n + 1) * sizeof(SPDVoice *));
+	for (i = 0, j = 0; i < n; i++) {
+		if (!output_voice_matches(voices[i], language, variant))
+			continue;
+		copy[j] = g_malloc(sizeof(SPDVoice));
+		copy[j]->name = g_strdup(voices[i]->name);
+		copy[j]->language = g_strdup(voices[i]->language);
+		copy[j]->variant = g_strdup(voices[i]->variant);
+		j++;
+	}
+	copy[j] = NULL;
 
-	output_unlock();
-	return voice_dscr;
+	return copy;
 }
 
 SPDVoice **output_list_voices(const char *module_name, const char *language, const char *variant)
 {
-	OutputModule *module = get_some_output_module_by_name(module_name);
+	OutputModule *module;
+	SPDVoice **voices;
+
+	/* Don't start a lazily loaded module just to list its voices */
+	module = module_name ? output_find_module(module_name) : NULL;
+	if (module == NULL || (!module->working && !module->lazy)
+	    || g_atomic_pointer_get(&module->voices) == NULL)
+		module = get_some_output_module_by_name(module_name);
 	if (module == NULL) {
 		MSG(1, "ERROR: Can't list voices for module %s", module_name ? module_name : "default");
 		return NULL;
 	}
+
+	/* The voices it reported when it was started, or in a previous run */
+	voices = g_atomic_pointer_get(&module->voices);
+	if (voices != NULL && language != NULL) {
+		static SPDVoice *none[] = { NULL };
+		gchar *key = g_ascii_strdown(language, -1);
+		GPtrArray *found = g_hash_table_lookup(module->voices_by_language,
+						       key);
+
+		g_free(key);
+		voices = found ? (SPDVoice **) found->pdata : none;
+	}
+	if (voices != NULL)
+		return output_copy_voices(voices, language, variant);
+
 	return output_get_voices(module, language, variant);
 }
 
@@ -588,21 +1080,39 @@ SPDVoice **output_list_voices(const char *module_name, const char *language, con
 	do {  err = output_send_data(data"\n", output, 1); \
 		OL_RET(err); } while (0)
 
-#define ADD_SET_INT(name) \
-	g_string_append_printf(set_str, #name"=%d\n", msg->settings.name)
-#define ADD_SET_STR(name) \
+/* Append name=value to set_str unless the module already has this value */
+static void output_add_setting(OutputModule * output, GString * set_str,
+			       const char *name, const char *value)
+{
+	const char *sent;
+
+	sent = g_hash_table_lookup(output->sent_settings, name);
+	if (sent != NULL && !strcmp(sent, value))
+		return;
+
+	g_string_append_printf(set_str, "%s=%s\n", name, value);
+	g_hash_table_replace(output->sent_settings, g_strdup(name),
+			     g_strdup(value));
+}
+
+#define ADD_SET_NUM(name) \
 do { \
-	if (msg->settings.name != NULL && msg->settings.name[0] != '\0') { \
-		g_string_append_printf(set_str, #name"=%s\n", msg->settings.name); \
-	}else{ \
-		g_string_append_printf(set_str, #name"=NULL\n"); \
-	} \
+	val = g_strdup_printf("%d", msg->settings.msg_settings.name); \
+	output_add_setting(output, set_str, #name, val); \
+	g_free(val); \
+} while (0)
+#define ADD_SET_STR(name, value) \
+do { \
+	if (value != NULL && value[0] != '\0') \
+		output_add_setting(output, set_str, name, value); \
+	else \
+		output_add_setting(output, set_str, name, "NULL"); \
 } while (0)
 #define ADD_SET_STR_C(name, fconv) \
 do { \
 	val = fconv(msg->settings.msg_settings.name); \
 	if (val != NULL && val[0] != '\0'){ \
-		g_string_append_printf(set_str, #name"=%s\n", val); \
+		output_add_setting(output, set_str, #name, val); \
 	} \
 	g_free(val); \
 } while (0)
@@ -611,53 +1121,64 @@ int output_send_settings(TSpeechDMessage * msg, OutputModule * output)
 {
 	GString *set_str;
 	char *val;
+	gint64 start;
 	int err;
 
 	MSG(4, "Module set parameters.");
 	set_str = g_string_new("");
-	g_string_append_printf(set_str, "pitch=%d\n",
-			       msg->settings.msg_settings.pitch);
-	g_string_append_printf(set_str, "pitch_range=%d\n",
-			       msg->settings.msg_settings.pitch_range);
-	g_string_append_printf(set_str, "rate=%d\n",
-			       msg->settings.msg_settings.rate);
-	g_string_append_printf(set_str, "volume=%d\n",
-			       msg->settings.msg_settings.volume);
+	ADD_SET_NUM(pitch);
+	ADD_SET_NUM(pitch_range);
+	ADD_SET_NUM(rate);
+	if (output_server_volume(output))
+		/* Only sent once, we scale from there */
+		output_add_setting(output, set_str, "volume", "100");
+	else
+		ADD_SET_NUM(volume);
 	ADD_SET_STR_C(punctuation_mode, EPunctMode2str);
 	ADD_SET_STR_C(spelling_mode, ESpellMode2str);
 	ADD_SET_STR_C(cap_let_recogn, ECapLetRecogn2str);
+	ADD_SET_STR("language", msg->settings.msg_settings.voice.language);
+
+	/* Modules reset the voice type when a synthesis voice gets unset,
+	   so the voice has to go again, before the synthesis voice */
+	val = msg->settings.msg_settings.voice.name;
+	if (val == NULL || val[0] == '\0')
+		val = "NULL";
+	if (g_strcmp0(g_hash_table_lookup(output->sent_settings,
+					  "synthesis_voice"), val))
+		g_hash_table_remove(output->sent_settings, "voice");
 	val = EVoice2str(msg->settings.msg_settings.voice_type);
-	if (val != NULL && val[0] != '\0') {
-		g_string_append_printf(set_str, "voice=%s\n", val);
-	}
+	if (val != NULL && val[0] != '\0')
+		output_add_setting(output, set_str, "voice", val);
 	g_free(val);
-	if (msg->settings.msg_settings.voice.language != NULL
-		&& msg->settings.msg_settings.voice.language[0] != '\0') {
-		g_string_append_printf(set_str, "language=%s\n",
-				       msg->settings.msg_settings.voice.
-				       language);
-	} else {
-		g_string_append_printf(set_str, "language=NULL\n");
-	}
-	if (msg->settings.msg_settings.voice.name != NULL
-		&& msg->settings.msg_settings.voice.name[0] != '\0') {
-		g_string_append_printf(set_str, "synthesis_voice=%s\n",
-				       msg->settings.msg_settings.voice.name);
-	} else {
-		g_string_append_printf(set_str, "synthesis_voice=NULL\n");
-	}
+	ADD_SET_STR("synthesis_voice", msg->settings.msg_settings.voice.name);
 
-	SEND_CMD_N("SET");
-	SEND_DATA_N(set_str->str);
-	SEND_CMD_N(".");
+	if (set_str->len == 0) {
+		/* The module already has all of these */
+		g_string_free(set_str, 1);
+		return 0;
+	}
 
+	/* Don't trust what we sent unless the module acknowledges it */
+	start = g_get_monotonic_time();
+	err = output_send_data("SET\n", output, 1);
+	if (err >= 0)
+		err = output_send_data(set_str->str, output, 0);
+	if (err >= 0)
+		err = output_send_data(".\n", output, 1);
 	g_string_free(set_str, 1);
+	if (err < 0) {
+		g_hash_table_remove_all(output->sent_settings);
+		return err;
+	}
+	output_traffic_command(output, OUTPUT_CMD_SET, start);
 
 	return 0;
 }
 
-#undef ADD_SET_INT
+#undef ADD_SET_NUM
 #undef ADD_SET_STR
+#undef ADD_SET_STR_C
 
 #define ADD_SET_INT(name) \
 	g_string_append_printf(set_str, #name"=%d\n", GlobalFDSet.name)
@@ -670,6 +1191,111 @@ do { \
 	} \
 } while (0)
 
+/* Give back the ring space of a shared audio frame we drop */
+static void output_release_audio_ring(OutputModule * output, const char *msg)
+{
+	uint32_t start;
+	size_t size;
+
+	if (!output->audio_ring || strncmp(msg, "705-SHM ", 8))
+		return;
+	if (sscanf(msg, "705-SHM %*d %*d %*d %*d %*d %u %zu", &start, &size) == 2)
+		spd_audio_ring_set(&output->audio_ring->tail, start + size);
+}
+
+/* Size of the ring of in-process modules when AudioSharedMemorySize is 0 */
+#define OUTPUT_INPROCESS_RING_KB 256
+
+/* Create a shared-memory ring for the module audio and pass it to the
+   module, which may refuse it and keep using the pipe.  A module running in
+   our process just gets the address of the ring. */
+static void output_setup_audio_ring(OutputModule * output)
+{
+	SPDAudioRing *ring;
+	GString *set_str;
+	char *name;
+	size_t size, len, kbytes = SpeechdOptions.audio_ring_size;
+	void *map;
+	int fd, err;
+
+	if (output->in_process && kbytes == 0)
+		kbytes = OUTPUT_INPROCESS_RING_KB;
+	if (kbytes == 0)
+		return;
+
+	for (size = 1; size < kbytes * 1024; size <<= 1) ;
+	len = sizeof(*ring) + size;
+
+	if (output->in_process) {
+		map = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (map == MAP_FAILED) {
+			MSG(2, "Could not allocate audio ring: %s",
+			    strerror(errno));
+			return;
+		}
+		name = g_strdup_printf("@%p", map);
+		goto mapped;
+	}
+
+	name = g_strdup_printf("/speechd-%d-%s", getpid(), output->name);
+	fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+	if (fd < 0) {
+		MSG(2, "Could not create shared audio ring %s: %s", name,
+		    strerror(errno));
+		g_free(name);
+		return;
+	}
+	if (ftruncate(fd, len) != 0) {
+		MSG(2, "Could not size shared audio ring %s: %s", name,
+		    strerror(errno));
+		close(fd);
+		shm_unlink(name);
+		g_free(name);
+		return;
+	}
+	map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		MSG(2, "Could not map shared audio ring %s: %s", name,
+		    strerror(errno));
+		shm_unlink(name);
+		g_free(name);
+		return;
+	}
+
+mapped:
+	ring = map;
+	ring->magic = SPD_AUDIO_RING_MAGIC;
+	ring->size = size;
+	ring->head = 0;
+	ring->tail = 0;
+
+	set_str = g_string_new("");
+	g_string_append_printf(set_str, "audio_ring=%s\n", name);
+	err = output_send_data("AUDIO\n", output, 1)
+	    || output_send_data(set_str->str, output, 0)
+	    || output_send_data(".\n", output, 1);
+	g_string_free(set_str, 1);
+
+	/* The module has mapped it by now, if it ever will */
+	if (!output->in_process)
+		shm_unlink(name);
+	g_free(name);
+
+	if (err) {
+		MSG(4, "Module %s does not use a shared audio ring", output->name);
+		munmap(map, len);
+		return;
+	}
+
+	MSG(4, "Module %s sends audio through a %zu bytes ring", output->name,
+	    size);
+	output->audio_ring = ring;
+	output->audio_ring_len = len;
+	mem_account(MEM_AUDIO_RINGS, len, 1);
+}
+
 static int output_server_audio(OutputModule * output)
 {
 	GString *set_str;
@@ -685,18 +1311,91 @@ static int output_server_audio(OutputModule * output)
 
 	g_string_free(set_str, 1);
 
-	output->audio = AUDIOID_TOOPEN;
+	/* Ask for raw audio frames, older modules refuse this parameter and
+	 * keep sending HDLC-escaped ones, which we still understand */
+	if (output_send_data("AUDIO\n", output, 1) == 0
+	    && output_send_data("audio_framing=binary\n", output, 0) == 0
+	    && output_send_data(".\n", output, 1) == 0)
+		MSG(4, "Module %s sends binary audio frames", output->name);
+
+	/* Have it take the next message while it still synthesizes, older
+	 * modules refuse and only get it once they are done */
+	output->message_ids = 0;
+	if (SpeechdOptions.audio_look_ahead
+	    && output_send_data("AUDIO\n", output, 1) == 0
+	    && output_send_data("message_ids=1\n", output, 0) == 0
+	    && output_send_data(".\n", output, 1) == 0) {
+		output->message_ids = 1;
+		MSG(4, "Module %s tags its messages", output->name);
+	}
+
+	/* Have the modules behind a slow link compress their frames, those
+	 * refusing it keep sending raw ones */
+	if (module_wants_compression(output->name) && !output->in_process
+	    && spd_audio_codec_available(SPD_AUDIO_CODEC_OPUS)) {
+		if (output_send_data("AUDIO\n", output, 1) == 0
+		    && output_send_data("audio_codec=" SPD_AUDIO_CODEC_OPUS "\n",
+					output, 0) == 0
+		    && output_send_data(".\n", output, 1) == 0) {
+			spd_audio_codec_free(output->audio_codec);
+			output->audio_codec =
+			    spd_audio_codec_new(SPD_AUDIO_CODEC_OPUS);
+			MSG(4, "Module %s sends compressed audio", output->name);
+		} else
+			MSG(3, "Module %s can't compress its audio",
+			    output->name);
+	}
+
+	output_setup_audio_ring(output);
+
+	/* Keep the audio we opened before the module was restarted */
+	if (output->audio == NULL)
+		output->audio = AUDIOID_TOOPEN;
 
 	MSG(3, "Initialized for server audio for %s\n", output->name);
 	return 0;
 
 }
 
+/* Have the module schedule its threads as configured, older modules refuse
+ * and keep the default scheduling */
+static void output_send_schedule(OutputModule * output)
+{
+	GString *set_str;
+
+	if (SpeechdOptions.audio_realtime_priority == 0
+	    && SpeechdOptions.synthesis_nice == 0
+	    && SpeechdOptions.audio_cpus == NULL
+	    && SpeechdOptions.synthesis_cpus == NULL)
+		return;
+
+	set_str = g_string_new("");
+	g_string_append_printf(set_str, "audio_cpus=%s\n",
+			       SpeechdOptions.audio_cpus ?
+			       SpeechdOptions.audio_cpus : "NULL");
+	g_string_append_printf(set_str, "audio_realtime_priority=%d\n",
+			       SpeechdOptions.audio_realtime_priority);
+	g_string_append_printf(set_str, "synthesis_cpus=%s\n",
+			       SpeechdOptions.synthesis_cpus ?
+			       SpeechdOptions.synthesis_cpus : "NULL");
+	g_string_append_printf(set_str, "synthesis_nice=%d\n",
+			       SpeechdOptions.synthesis_nice);
+
+	if (output_send_data("SET\n", output, 1) != 0
+	    || output_send_data(set_str->str, output, 0) != 0
+	    || output_send_data(".\n", output, 1) != 0)
+		MSG(3, "Module %s can't schedule its threads", output->name);
+	g_string_free(set_str, 1);
+}
+
 int output_send_audio_settings(OutputModule * output)
 {
 	GString *set_str;
+	gchar *probed;
 	int err;
 
+	output_send_schedule(output);
+
 	/* First try to get output through server */
 	MSG(4, "Trying to make output module use audio output through server.");
 	if (output_server_audio(output) == 0)
@@ -707,7 +1406,15 @@ int output_send_audio_settings(OutputModule * output)
 	output->audio = NULL;
 	MSG(4, "Module set parameters.");
 	set_str = g_string_new("");
-	ADD_SET_STR(audio_output_method);
+	probed = output_probed_audio_method();
+	if (probed) {
+		/* Spare the module the methods which do not work */
+		g_string_append_printf(set_str, "audio_output_method=%s\n",
+				       probed);
+		g_free(probed);
+	} else {
+		ADD_SET_STR(audio_output_method);
+	}
 	ADD_SET_STR(audio_oss_device);
 	ADD_SET_STR(audio_alsa_device);
 	ADD_SET_STR(audio_nas_server);
@@ -715,6 +1422,14 @@ int output_send_audio_settings(OutputModule * output)
 	//ADD_SET_STR(audio_pulse_server);
 	ADD_SET_STR(audio_pulse_device);
 	ADD_SET_INT(audio_pulse_min_length);
+	g_string_append_printf(set_str, "audio_file_path=%s\n",
+			       SpeechdOptions.audio_file_path ?
+			       SpeechdOptions.audio_file_path : "NULL");
+	g_string_append_printf(set_str, "audio_rtp_destination=%s\n",
+			       SpeechdOptions.audio_rtp_destination ?
+			       SpeechdOptions.audio_rtp_destination : "NULL");
+	g_string_append_printf(set_str, "audio_sink_real_time=%d\n",
+			       SpeechdOptions.audio_sink_real_time);
 
 	SEND_CMD_N("AUDIO");
 	SEND_DATA_N(set_str->str);
@@ -725,6 +1440,31 @@ int output_send_audio_settings(OutputModule * output)
 	return 0;
 }
 
+gchar *output_module_environment(void)
+{
+	return g_strdup_printf("%s|%s|%s|%s|%s|%d|%d|%d|%d|%d|%s|%d|%s|%s|%s|%d",
+			       GlobalFDSet.audio_output_method,
+			       GlobalFDSet.audio_oss_device,
+			       GlobalFDSet.audio_alsa_device,
+			       GlobalFDSet.audio_nas_server,
+			       GlobalFDSet.audio_pulse_device,
+			       GlobalFDSet.audio_pulse_min_length,
+			       GlobalFDSet.audio_alsa_idle_timeout,
+			       GlobalFDSet.log_level,
+			       SpeechdOptions.audio_ring_size,
+			       SpeechdOptions.audio_realtime_priority,
+			       SpeechdOptions.audio_cpus ?
+			       SpeechdOptions.audio_cpus : "",
+			       SpeechdOptions.synthesis_nice,
+			       SpeechdOptions.synthesis_cpus ?
+			       SpeechdOptions.synthesis_cpus : "",
+			       SpeechdOptions.audio_file_path ?
+			       SpeechdOptions.audio_file_path : "",
+			       SpeechdOptions.audio_rtp_destination ?
+			       SpeechdOptions.audio_rtp_destination : "",
+			       SpeechdOptions.audio_sink_real_time);
+}
+
 int output_send_loglevel_setting(OutputModule * output)
 {
 	GString *set_str;
@@ -753,7 +1493,7 @@ int output_send_debug(OutputModule * output, int flag, const char *log_path)
 
 	MSG(4, "Module sending debug flag %d with file %s", flag, log_path);
 
-	output_lock();
+	output_lock(output);
 	if (flag) {
 		cmd_str = g_strdup_printf("DEBUG ON %s \n", log_path);
 		err = output_send_data(cmd_str, output, 1);
@@ -775,7 +1515,56 @@ int output_send_debug(OutputModule * output, int flag, const char *log_path)
 
 	}
 
-	OL_RET(0);
+	OL_RET(0);
+}
+
+/* Send the command and the text of msg, the lock of output is held */
+static int output_send_message(TSpeechDMessage * msg, OutputModule * output)
+{
+	const char *cmd = NULL;
+	char *line;
+	gint64 start = g_get_monotonic_time();
+	int err;
+
+	switch (msg->settings.type) {
+	case SPD_MSGTYPE_TEXT:
+		cmd = "SPEAK";
+		break;
+	case SPD_MSGTYPE_SOUND_ICON:
+		cmd = "SOUND_ICON";
+		break;
+	case SPD_MSGTYPE_CHAR:
+		cmd = "CHAR";
+		break;
+	case SPD_MSGTYPE_KEY:
+		cmd = "KEY";
+		break;
+	default:
+		MSG(2, "Invalid message type in output_speak()!");
+	}
+
+	if (cmd != NULL) {
+		if (output->message_ids)
+			line = g_strdup_printf("%s %u\n", cmd, msg->id);
+		else
+			line = g_strdup_printf("%s\n", cmd);
+		err = output_send_data(line, output, 1);
+		g_free(line);
+		if (err < 0)
+			return err;
+	}
+
+	if (!strcmp(msg->buf, " "))
+		err = output_send_data("space", output, 0);
+	else
+		err = output_send_data(msg->buf, output, 0);
+	if (err < 0)
+		return err;
+
+	err = output_send_data("\n.\n", output, 1);
+	if (err >= 0)
+		output_traffic_command(output, OUTPUT_CMD_SPEAK, start);
+	return err;
 }
 
 int output_speak(TSpeechDMessage * msg, OutputModule *output)
@@ -787,18 +1576,24 @@ int output_speak(TSpeechDMessage * msg, OutputModule *output)
 	if (msg == NULL)
 		return -1;
 
-	output_lock();
+	output_lock(output);
+
+	/* The module may still be busy with a message synthesized ahead */
+	output_lookahead_discard(output);
+	output_lookahead_wait(output);
 
 	newbuf = escape_dot(msg->buf);
 	if (newbuf != msg->buf) {
 		g_free(msg->buf);
 		msg->buf = newbuf;
+		forget_index_marks(msg);
 	}
 	msg->bytes = -1;
 
 	output_set_speaking_monitor(msg, output);
 
-	if (module_audio_id) {
+	if (module_audio_id && !output_retrieving) {
+		module_speak_queue_set_stats(&output->audio_stats);
 		if (!module_speak_queue_before_synth()) {
 			MSG(3, "Warning: couldn't begin speak queue");
 		}
@@ -807,39 +1602,29 @@ int output_speak(TSpeechDMessage * msg, OutputModule *output)
 	ret = output_send_settings(msg, output);
 	if (ret != 0)
 		OL_RET(ret);
+	latency_mark(&msg->latency, LATENCY_SETTINGS_SENT);
 
 	MSG(4, "Module speak!");
 
-	switch (msg->settings.type) {
-	case SPD_MSGTYPE_TEXT:
-		SEND_CMD("SPEAK"); break;
-	case SPD_MSGTYPE_SOUND_ICON:
-		SEND_CMD("SOUND_ICON");
-		break;
-	case SPD_MSGTYPE_CHAR:
-		SEND_CMD("CHAR");
-		break;
-	case SPD_MSGTYPE_KEY:
-		SEND_CMD("KEY");
-		break;
-	default:
-		MSG(2, "Invalid message type in output_speak()!");
-	}
+	/* From now on the reader thread processes the events of this message */
+	output->end_queued = 0;
+	output->stop_requested = 0;
+	output->pause_requested = 0;
+	output->pause_queued = 0;
+	output_events_begin(output);
 
-	if (!strcmp(msg->buf, " "))
-		SEND_DATA("space");
-	else
-		SEND_DATA(msg->buf);
-	SEND_CMD("\n.");
+	/* Before its events may come */
+	latency_speaking(&msg->latency, msg->id);
+	err = output_send_message(msg, output);
+	if (err < 0)
+		OL_RET(err);
+	latency_mark_speaking(LATENCY_SPEAK_SENT);
 
-	/* Start a thread that will process the module events */
-	output_end_queued = 0;
-	output_stop_requested = 0;
-	output_pause_requested = 0;
-	output_pause_queued = 0;
-	spd_pthread_create(&output_thread, NULL, output_thread_func, output);
+	if (output->message_ids && SpeechdOptions.audio_look_ahead)
+		/* It can take the next message right away */
+		speaking_semaphore_post();
 
-	output_unlock();
+	output_unlock(output);
 
 	return 0;
 }
@@ -849,52 +1634,77 @@ int output_stop()
 	int err;
 	OutputModule *output;
 
-	output_lock();
+	output = speaking_module;
+	if (output == NULL)
+		return 0;
+
+	output_lock(output);
 
-	if (speaking_module == NULL)
+	if (output != speaking_module)
+		/* It was done meanwhile */
 		OL_RET(0);
-	else
-		output = speaking_module;
 
-	if (output->audio)
+	output_lookahead_discard(output);
+
+	if (output_speak_queue(output))
 	{
-		if (output_end_queued) {
+		if (output->end_queued) {
 			MSG(4, "module is already done, stop speak_queue directly");
 			module_speak_queue_stop();
 			OL_RET(0);
 		}
 		MSG(4, "stopping speak_queue");
-		output_stop_requested = 1;
+		output->stop_requested = 1;
 		module_speak_queue_flush();
+		if (output_lookahead_synthesized(output))
+			/* The end comes from what was staged */
+			OL_RET(0);
 	}
 
 	MSG(4, "Module stop!");
 	SEND_DATA("STOP\n");
 
+	if (output_speak_queue(output)) {
+		/* Silence what is queued and in the device right away rather
+		 * than when the module acknowledges, its 703 then finds the
+		 * speak queue already stopped.  The next message still waits
+		 * for that acknowledgement in output_is_speaking(). */
+		MSG(4, "stopping speak_queue without waiting for the module");
+		module_speak_queue_stop();
+	}
+
 	OL_RET(0);
 }
 
 size_t output_pause()
 {
-	static int err;
-	static OutputModule *output;
+	int err;
+	OutputModule *output;
+
+	output = speaking_module;
+	if (output == NULL)
+		return 0;
 
-	output_lock();
+	output_lock(output);
 
-	if (speaking_module == NULL)
+	if (output != speaking_module)
+		/* It was done meanwhile */
 		OL_RET(0);
-	else
-		output = speaking_module;
 
-	if (output->audio)
+	output_lookahead_discard(output);
+
+	if (output_speak_queue(output))
 	{
-		if (output_end_queued) {
+		if (output->end_queued) {
 			MSG(4, "module is already done, pause speak_queue directly");
 			module_speak_queue_pause();
 			OL_RET(0);
 		}
 		MSG(4, "pausing speak_queue");
-		output_pause_requested = 1;
+		output->pause_requested = 1;
+		if (output_lookahead_synthesized(output))
+			/* The end comes from what was staged */
+			OL_RET(0);
 	}
 
 	MSG(4, "Module pause!");
@@ -943,14 +1753,17 @@ void module_report_event_begin(void)
 }
 void module_report_event_end(void)
 {
+	latency_speaking_done();
 	output_queue_new_event(SPEAK_QUEUE_QET_END);
 }
 void module_report_event_broken(void)
 {
+	latency_speaking_done();
 	output_queue_new_event(SPEAK_QUEUE_QET_BROKEN);
 }
 void module_report_event_stop(void)
 {
+	latency_speaking_done();
 	output_queue_new_event(SPEAK_QUEUE_QET_STOP);
 }
 void module_report_event_pause(void)
@@ -962,24 +1775,85 @@ void module_speak_queue_cancel(void)
 	/* Not needed */
 }
 
-static int output_module_is_speaking(OutputModule * output)
+/* Stops the message of client uid, which does not read its audio.  This
+ * runs in the main loop, since the reader thread has to read the answer of
+ * the module to STOP. */
+static gboolean output_stop_stalled_client(gpointer data)
 {
-	GString *response;
-	int retcode = -1;
+	pthread_mutex_lock(&element_free_mutex);
+	speaking_stop(GPOINTER_TO_INT(data));
+	pthread_mutex_unlock(&element_free_mutex);
+	return FALSE;
+}
 
-	MSG(5, "output_module_is_speaking()");
+/* Sends the samples of track to the client of the message being spoken as
+ * a 707 event, framed like the 705-RAW audio of the modules */
+static gboolean output_send_client_audio(const AudioTrack * track,
+					 AudioFormat format)
+{
+	TFDSetElement *settings;
+	char header[128];
+	struct iovec iov[3];
+	size_t size;
+	int ret;
 
-	if (output == NULL) {
-		MSG(5, "output==NULL in output_module_is_speaking()");
-		module_report_event_broken();
-		return -1;
+	if (output_retrieve_stalled)
+		return FALSE;
+
+	settings = get_client_settings_by_uid(output_retrieve_uid);
+	if (settings == NULL || !settings->active)
+		return FALSE;
+
+	size = (size_t) track->num_channels * track->num_samples
+	    * track->bits / 8;
+	iov[0].iov_base = header;
+	iov[0].iov_len = snprintf(header, sizeof(header),
+				  EVENT_AUDIO_C "-%d\r\n" EVENT_AUDIO_C "-%d\r\n"
+				  EVENT_AUDIO_C "-RAW %d %d %d %d %d %zu\r\n",
+				  output_retrieve_id, output_retrieve_uid,
+				  track->bits, track->num_channels,
+				  track->sample_rate, track->num_samples,
+				  (int) format, size);
+	iov[1].iov_base = track->samples;
+	iov[1].iov_len = size;
+	iov[2].iov_base = EVENT_AUDIO;
+	iov[2].iov_len = strlen(EVENT_AUDIO);
+
+	/* Whole frames go through the output buffer of the client, after
+	   the replies and events it holds, never half written.  Retrieval
+	   runs faster than playback, so this waits for the client to read. */
+	ret = server_send_data(settings->fd, iov, 3);
+
+	if (ret == 1) {
+		/* Rather than keeping all of its audio, stop the message */
+		MSG(2, "Client %d does not read its audio, stopping the message",
+		    output_retrieve_uid);
+		output_retrieve_stalled = 1;
+		g_idle_add(output_stop_stalled_client,
+			   GINT_TO_POINTER(output_retrieve_uid));
+		return FALSE;
 	}
-
-	response = output_read_event(output);
-	if (response == NULL) {
-		module_report_event_broken();
-		return -1;
+	if (ret == -1) {
+		MSG(2, "Can't send audio to client %d: %s", output_retrieve_uid,
+		    strerror(errno));
+		return FALSE;
 	}
+	return TRUE;
+}
+
+/* Plays the audio of the module, or gives it to the client which asked */
+static gboolean output_add_audio(AudioTrack * track, AudioFormat format)
+{
+	if (output_retrieving)
+		return output_send_client_audio(track, format);
+	return module_speak_queue_add_audio(track, format);
+}
+
+/* Process an event from the module, return 0 when it was the last one of the
+   message, 1 if more are to come and a negative value on errors */
+static int output_handle_event(OutputModule * output, GString * response)
+{
+	int retcode = -1;
 
 	MSG2(5, "output_module", "Event from output module while speaking: |%s|",
 	     response->str);
@@ -997,7 +1871,8 @@ static int output_module_is_speaking(OutputModule * output)
 	if (!strncmp(response->str, "701", 3))
 	{
 		MSG2(5, "output_module", "got begin");
-		if (output->audio) {
+		latency_mark_speaking(LATENCY_BEGIN);
+		if (output_speak_queue(output)) {
 			if (!module_speak_queue_before_play())
 				MSG(3, "Warning: couldn't add begin to speak queue");
 		} else {
@@ -1007,13 +1882,13 @@ static int output_module_is_speaking(OutputModule * output)
 	else if (!strncmp(response->str, "702", 3))
 	{
 		MSG2(5, "output_module", "got end");
-		if (output->audio) {
-			if (output_stop_requested) {
+		if (output_speak_queue(output)) {
+			if (output->stop_requested) {
 				MSG(4, "we sent STOP too late, now tell the speak queue");
 				module_speak_queue_stop();
-			} else if (output_pause_requested) {
+			} else if (output->pause_requested) {
 				MSG(4, "we sent PAUSE too late, now tell the speak queue");
-				if (!output_pause_queued)
+				if (!output->pause_queued)
 					module_speak_queue_pause();
 				if (!module_speak_queue_add_end())
 					MSG(3, "Warning: couldn't add end to speak queue");
@@ -1022,7 +1897,10 @@ static int output_module_is_speaking(OutputModule * output)
 					MSG(3, "Warning: couldn't add end to speak queue");
 				/* module is done, if stop is requested we'll have to
 				 * tell speak_queue directly */
-				output_end_queued = 1;
+				output->end_queued = 1;
+				if (SpeechdOptions.audio_look_ahead)
+					/* It can synthesize the next message */
+					speaking_semaphore_post();
 			}
 		} else {
 			module_report_event_end();
@@ -1032,8 +1910,8 @@ static int output_module_is_speaking(OutputModule * output)
 	else if (!strncmp(response->str, "703", 3))
 	{
 		MSG2(5, "output_module", "got stopped");
-		if (output->audio) {
-			if (!output_pause_queued)
+		if (output_speak_queue(output)) {
+			if (!output->pause_queued)
 				module_speak_queue_stop();
 		}
 		else
@@ -1043,8 +1921,8 @@ static int output_module_is_speaking(OutputModule * output)
 	else if (!strncmp(response->str, "704", 3))
 	{
 		MSG2(5, "output_module", "got paused");
-		if (output->audio) {
-			if (!output_pause_queued)
+		if (output_speak_queue(output)) {
+			if (!output->pause_queued)
 				module_speak_queue_pause();
 			if (!module_speak_queue_add_end())
 				MSG(3, "Warning: couldn't add end to speak queue");
@@ -1063,15 +1941,15 @@ static int output_module_is_speaking(OutputModule * output)
 				    p - response->str - 4);
 		MSG2(5, "output_module", "Detected INDEX MARK: %s",
 		     index_mark);
-		if (output->audio) {
-			if (!(output_stop_requested || (output_pause_requested && output_pause_queued))) {
+		if (output_speak_queue(output)) {
+			if (!(output->stop_requested || (output->pause_requested && output->pause_queued))) {
 				if (!module_speak_queue_add_mark(index_mark))
 					MSG(3, "Warning: couldn't add mark to speak queue");
-				if (output_pause_requested &&
+				if (output->pause_requested &&
 					!strncmp(index_mark, SD_MARK_BODY, SD_MARK_BODY_LEN)) {
 					MSG(5, "Pausing the queue at mark %s", index_mark);
 					module_speak_queue_pause();
-					output_pause_queued = 1;
+					output->pause_queued = 1;
 				}
 			}
 		} else {
@@ -1090,8 +1968,8 @@ static int output_module_is_speaking(OutputModule * output)
 				    p - response->str - 4);
 		MSG2(5, "output_module", "Detected sound icon: %s",
 		     icon);
-		if (output->audio &&
-			!(output_stop_requested || (output_pause_requested && output_pause_queued))) {
+		if (output_speak_queue(output) &&
+			!(output->stop_requested || (output->pause_requested && output->pause_queued))) {
 			if (!module_speak_queue_add_sound_icon(icon))
 				MSG(3, "Warning: couldn't add icon to speak queue");
 		}
@@ -1115,8 +1993,102 @@ static int output_module_is_speaking(OutputModule * output)
 			goto out;
 		}
 
-		if (output_stop_requested || (output_pause_requested && output_pause_queued)) {
+		if (output->stop_requested || (output->pause_requested && output->pause_queued)) {
 			MSG2(5, "output_module", "Discarding audio still coming from the synth");
+			output_release_audio_ring(output, response->str);
+			goto out;
+		}
+		latency_mark_speaking(LATENCY_FIRST_AUDIO);
+
+		if (!strncmp(response->str, "705-SHM ", 8)) {
+			/* The samples are in the shared ring */
+			SPDAudioRing *ring = output->audio_ring;
+			uint32_t start;
+
+			if (!ring
+			    || sscanf(response->str, "705-SHM %d %d %d %d %d %u %zu",
+				   &track.bits, &track.num_channels,
+				   &track.sample_rate, &track.num_samples,
+				   (int *) &format, &start, &size) != 7
+			    || size > ring->size
+			    || (start & (ring->size - 1)) + size > ring->size
+			    || size != (size_t) track.num_channels *
+			    track.num_samples * track.bits / 8) {
+				MSG2(2, "output_module",
+					"ERROR: bogus shared audio frame");
+				retcode = -5;
+				goto out;
+			}
+			track.samples = (void *) (SPD_AUDIO_RING_DATA(ring)
+					+ (start & (ring->size - 1)));
+
+			MSG2(5, "output_module", "Got shared audio: %zd bytes", size);
+			output_traffic_received(output, 0, 0, size);
+
+			if (!output_add_audio(&track, format))
+				MSG2(2, "output_module", "Audio interrupted");
+
+			/* The playback queue or the client has its own copy */
+			spd_audio_ring_set(&ring->tail, start + size);
+			goto out;
+		}
+
+		if (!strncmp(response->str, "705-OPUS ", 9)) {
+			/* Compressed framing, decode right before playing */
+			if (sscanf(response->str, "705-OPUS %*d %*d %*d %*d %zu",
+				   &size) != 1
+			    || (q = memchr(p, '\n', end - p)) == NULL
+			    || size > end - (q + 1)) {
+				MSG2(2, "output_module",
+					"ERROR: bogus compressed audio frame");
+				retcode = -5;
+				goto out;
+			}
+			*q = '\0';
+			if (!output->audio_codec
+			    || spd_audio_codec_decode(output->audio_codec,
+						      response->str, q + 1, size,
+						      &track, &format) != 0) {
+				MSG2(2, "output_module",
+					"ERROR: can't decode audio %s",
+					response->str);
+				retcode = -5;
+				goto out;
+			}
+
+			MSG2(5, "output_module", "Got compressed audio: %zd bytes",
+			     size);
+			output_traffic_received(output, 0, 0, size);
+
+			if (!output_add_audio(&track, format))
+				MSG2(2, "output_module", "Audio interrupted");
+			g_free(track.samples);
+			goto out;
+		}
+
+		if (!strncmp(response->str, "705-RAW ", 8)) {
+			/* Binary framing, the samples follow the header line */
+			size = 0;
+			if (sscanf(response->str, "705-RAW %d %d %d %d %d %zu",
+				   &track.bits, &track.num_channels,
+				   &track.sample_rate, &track.num_samples,
+				   (int *) &format, &size) != 6
+			    || (q = memchr(p, '\n', end - p)) == NULL
+			    || size > end - (q + 1)
+			    || size != (size_t) track.num_channels *
+			    track.num_samples * track.bits / 8) {
+				MSG2(2, "output_module",
+					"ERROR: bogus raw audio frame");
+				retcode = -5;
+				goto out;
+			}
+			track.samples = (void *) (q + 1);
+
+			MSG2(5, "output_module", "Got raw audio: %zd bytes", size);
+			output_traffic_received(output, 0, 0, size);
+
+			if (!output_add_audio(&track, format))
+				MSG2(2, "output_module", "Audio interrupted");
 			goto out;
 		}
 
@@ -1237,8 +2209,9 @@ static int output_module_is_speaking(OutputModule * output)
 
 		MSG2(5, "output_module",
 			"Got audio: eventually %zd bytes", size);
+		output_traffic_received(output, 0, 0, size);
 
-		gboolean ret = module_speak_queue_add_audio(&track, format);
+		gboolean ret = output_add_audio(&track, format);
 
 		free(track.samples);
 
@@ -1257,24 +2230,501 @@ out:
 	return retcode;
 }
 
-/* For server-side audio, this is called in a separate thread, to consume output
- * from the module in parallel of handling audio processing and feedback to client */
-static void *output_thread_func(void *data)
+/*
+ * Look-ahead: once the speaking module is done synthesizing its message while
+ * the speak queue still plays it, the next message of the same priority is
+ * sent to the module already.  The reader thread stages the events of that
+ * message in the lookahead of the module instead of handling them.  When
+ * speak() then takes the message from its queue, a task of the pool hands the staged events to the speak queue
+ * and the reader thread leaves it the events still to come.  Otherwise, e.g.
+ * on stop or when another message got queued first, the staged events are
+ * dropped and the module is stopped.  Each module has its own look-ahead,
+ * those of the other modules are discarded when a message gets spoken.
+ *
+ * Modules which take message_ids tag the events with the id of the message
+ * and queue the messages they get while synthesizing: they get the next
+ * message as soon as speaking the previous one started, the reader thread
+ * tells their events apart by id, and only the message ahead gets stopped
+ * when discarding it.
+ */
+
+/* Staged audio beyond which we rather synthesize again later */
+#define MAX_LOOKAHEAD_AUDIO (16 * 1024 * 1024)
+
+/* Protects the lookahead of all the modules */
+static pthread_mutex_t lookahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lookahead_cond = PTHREAD_COND_INITIALIZER;
+
+static int output_event_is_last(const GString * event)
+{
+	return !strncmp(event->str, "702", 3) || !strncmp(event->str, "703", 3)
+	    || !strncmp(event->str, "704", 3);
+}
+
+/* The id at the end of event, from a module which tags its messages */
+static guint output_event_id(const GString * event)
+{
+	const char *end = event->str + event->len;
+	const char *p;
+
+	if (end > event->str && end[-1] == '\n')
+		end--;
+	for (p = end; p > event->str && p[-1] != ' ' && p[-1] != '\n'; p--) ;
+	if (p == event->str || p[-1] != ' ')
+		return 0;
+	return strtoul(p, NULL, 10);
+}
+
+static void output_lookahead_drop_events(OutputModule * output)
+{
+	GString *event;
+
+	while ((event = g_queue_pop_head(&output->lookahead.events)) != NULL) {
+		output_release_audio_ring(output, event->str);
+		g_string_free(event, TRUE);
+	}
+	output->lookahead.bytes = 0;
+}
+
+static void output_lookahead_reset(OutputModule * output)
+{
+	OutputLookahead *ahead = &output->lookahead;
+
+	ahead->active = 0;
+	ahead->id = 0;
+	g_free(ahead->buf);
+	ahead->buf = NULL;
+	ahead->bytes = 0;
+	ahead->done = 0;
+	ahead->overflow = 0;
+	ahead->replaying = 0;
+	ahead->tag = 0;
+	ahead->gain = 256;
+	pthread_cond_broadcast(&lookahead_cond);
+}
+
+/* Can output synthesize a message ahead now? */
+int output_lookahead_ready(OutputModule * output)
+{
+	int ready;
+
+	if (!SpeechdOptions.audio_look_ahead || output == NULL
+	    || !output_speak_queue(output) || output != speaking_module
+	    || (!output->end_queued && !output->message_ids))
+		return 0;
+
+	pthread_mutex_lock(&lookahead_mutex);
+	ready = !output->lookahead.active;
+	pthread_mutex_unlock(&lookahead_mutex);
+
+	return ready;
+}
+
+/* Settings of a message which preempts what output speaks */
+typedef struct {
+	OutputModule *output;
+	TSpeechDMessage msg;
+} TOutputPreempt;
+
+static void *output_preempt_settings(void *data)
+{
+	TOutputPreempt *preempt = data;
+	OutputModule *output = preempt->output;
+
+	output_lock(output);
+	/* Unless the next message was sent meanwhile */
+	if (output == speaking_module && output->stop_requested) {
+		if (output_send_settings(&preempt->msg, output) == 0)
+			MSG(5, "Sent the settings of message %u ahead",
+			    preempt->msg.id);
+	}
+	output_unlock(output);
+
+	g_free(preempt->msg.settings.msg_settings.voice.language);
+	g_free(preempt->msg.settings.msg_settings.voice.name);
+	g_free(preempt);
+	return NULL;
+}
+
+/* msg got queued to preempt what output is speaking, which was just asked to
+ * stop: send its settings from another thread while the module is stopping,
+ * so that only its text is left to send once the module is done.  Its audio
+ * takes over at the speak queue, which output_stop() already flushed. */
+void output_preempt(TSpeechDMessage * msg, OutputModule * output)
+{
+	TOutputPreempt *preempt;
+
+	output_lock(output);
+	if (output != speaking_module || !output_speak_queue(output)
+	    || !output->stop_requested || msg->settings.audio_retrieval) {
+		output_unlock(output);
+		return;
+	}
+
+	preempt = g_new0(TOutputPreempt, 1);
+	preempt->output = output;
+	preempt->msg.id = msg->id;
+	preempt->msg.settings.msg_settings = msg->settings.msg_settings;
+	preempt->msg.settings.msg_settings.voice.language =
+	    g_strdup(msg->settings.msg_settings.voice.language);
+	preempt->msg.settings.msg_settings.voice.name =
+	    g_strdup(msg->settings.msg_settings.voice.name);
+	preempt->msg.settings.msg_settings.voice.variant = NULL;
+
+	if (spd_task_run(output_preempt_settings, preempt) != 0) {
+		MSG(2, "Can't create the preemption thread, the settings "
+		    "of message %u will follow the stop", msg->id);
+		g_free(preempt->msg.settings.msg_settings.voice.language);
+		g_free(preempt->msg.settings.msg_settings.voice.name);
+		g_free(preempt);
+	}
+
+	output_unlock(output);
+}
+
+/* Send msg to output while the speak queue still plays the message output has
+ * finished synthesizing, returns 0 on success.  msg is a copy of the queued
+ * message, which becomes ours. */
+int output_lookahead(TSpeechDMessage * msg, OutputModule * output)
+{
+	int err;
+	char *newbuf;
+
+	output_lock(output);
+
+	if (!output_lookahead_ready(output) || output->stop_requested
+	    || output->pause_requested) {
+		mem_free_message(msg);
+		OL_RET(-1);
+	}
+
+	newbuf = escape_dot(msg->buf);
+	if (newbuf != msg->buf) {
+		g_free(msg->buf);
+		msg->buf = newbuf;
+		forget_index_marks(msg);
+	}
+
+	err = output_send_settings(msg, output);
+	if (err != 0) {
+		mem_free_message(msg);
+		OL_RET(err);
+	}
+
+	MSG(4, "Module speak ahead!");
+
+	pthread_mutex_lock(&lookahead_mutex);
+	output->lookahead.active = 1;
+	output->lookahead.id = msg->id;
+	output->lookahead.tag = msg->id;
+	output->lookahead.buf = msg->buf;
+	output->lookahead.gain = output_message_gain(msg, output);
+	output->lookahead.done = 0;
+	output->lookahead.overflow = 0;
+	pthread_mutex_unlock(&lookahead_mutex);
+
+	err = output_send_message(msg, output);
+	/* Its text is kept for when it gets spoken */
+	msg->buf = NULL;
+	mem_free_message(msg);
+	if (err < 0)
+		OL_RET(err);
+
+	OL_RET(0);
+}
+
+/* Drop what output synthesized ahead and stop it if it is still at it,
+ * the lock of output is held */
+static void output_lookahead_discard(OutputModule * output)
+{
+	OutputLookahead *ahead = &output->lookahead;
+	int stop;
+	char *cmd;
+
+	pthread_mutex_lock(&lookahead_mutex);
+	if (!ahead->active || !ahead->id) {
+		pthread_mutex_unlock(&lookahead_mutex);
+		return;
+	}
+
+	MSG(4, "Discarding the message synthesized ahead");
+	output_lookahead_drop_events(output);
+	stop = !ahead->done;
+	if (stop) {
+		/* The reader thread drops the rest until the module is done */
+		ahead->id = 0;
+		g_free(ahead->buf);
+		ahead->buf = NULL;
+	}
+	/* Leave the message being spoken alone if we can */
+	if (output->message_ids)
+		cmd = g_strdup_printf("STOP %u\n", ahead->tag);
+	else
+		cmd = g_strdup("STOP\n");
+	if (!stop)
+		output_lookahead_reset(output);
+	pthread_mutex_unlock(&lookahead_mutex);
+
+	if (stop)
+		output_send_data(cmd, output, 0);
+	g_free(cmd);
+}
+
+/* Wait until output is done with a discarded look-ahead */
+static void output_lookahead_wait(OutputModule * output)
+{
+	pthread_mutex_lock(&lookahead_mutex);
+	while (output->lookahead.active && !output->lookahead.id
+	       && !output->lookahead.replaying)
+		pthread_cond_wait(&lookahead_cond, &lookahead_mutex);
+	pthread_mutex_unlock(&lookahead_mutex);
+}
+
+/* Is output speaking a message it has already synthesized entirely? */
+static int output_lookahead_synthesized(OutputModule * output)
+{
+	int ret;
+
+	pthread_mutex_lock(&lookahead_mutex);
+	ret = output->lookahead.active && output->lookahead.replaying
+	    && output->lookahead.done;
+	pthread_mutex_unlock(&lookahead_mutex);
+
+	return ret;
+}
+
+/* Called by the reader thread, returns 1 if it must not handle event */
+static int output_lookahead_stage(OutputModule * output, GString * event)
+{
+	OutputLookahead *ahead = &output->lookahead;
+	int last = output_event_is_last(event);
+	guint id = output->message_ids ? output_event_id(event) : 0;
+
+	pthread_mutex_lock(&lookahead_mutex);
+	if (!ahead->active || (output->message_ids && id != ahead->tag)) {
+		pthread_mutex_unlock(&lookahead_mutex);
+		return 0;
+	}
+
+	if (!ahead->replaying && !ahead->id) {
+		/* Discarded, wait for the module to be done with it */
+		output_release_audio_ring(output, event->str);
+		g_string_free(event, TRUE);
+		if (last)
+			output_lookahead_reset(output);
+		pthread_mutex_unlock(&lookahead_mutex);
+		return 1;
+	}
+
+	if (!ahead->replaying && ahead->overflow) {
+		output_release_audio_ring(output, event->str);
+		g_string_free(event, TRUE);
+	} else {
+		g_queue_push_tail(&ahead->events, event);
+		ahead->bytes += event->len;
+		if (!ahead->replaying && ahead->bytes > MAX_LOOKAHEAD_AUDIO) {
+			MSG(4, "Too much audio synthesized ahead, dropping it");
+			output_lookahead_drop_events(output);
+			ahead->overflow = 1;
+		}
+	}
+	if (last)
+		ahead->done = 1;
+	pthread_cond_broadcast(&lookahead_cond);
+	pthread_mutex_unlock(&lookahead_mutex);
+
+	return 1;
+}
+
+/* The module of the look-ahead went away */
+static void output_lookahead_gone(OutputModule * output)
+{
+	pthread_mutex_lock(&lookahead_mutex);
+	if (output->lookahead.active) {
+		output->lookahead.done = 1;
+		if (!output->lookahead.replaying) {
+			output_lookahead_drop_events(output);
+			output_lookahead_reset(output);
+		}
+		pthread_cond_broadcast(&lookahead_cond);
+	}
+	pthread_mutex_unlock(&lookahead_mutex);
+}
+
+/* Hands the staged events to the speak queue like the reader thread would */
+static void *output_lookahead_replay(void *data)
+{
+	OutputModule *output = data;
+	OutputLookahead *ahead = &output->lookahead;
+	GString *event;
+	int last, ret;
+
+	pthread_mutex_lock(&lookahead_mutex);
+	/* The staged audio is the one of the message synthesized ahead, not
+	   of the one which was speaking when it got staged */
+	module_speak_queue_set_gain(ahead->gain);
+	do {
+		while (g_queue_is_empty(&ahead->events) && !ahead->done)
+			pthread_cond_wait(&lookahead_cond, &lookahead_mutex);
+		event = g_queue_pop_head(&ahead->events);
+		last = ahead->done && g_queue_is_empty(&ahead->events);
+		if (last)
+			/* The reader thread handles the next messages itself */
+			output_lookahead_reset(output);
+		pthread_mutex_unlock(&lookahead_mutex);
+
+		if (event == NULL)
+			/* The module went away */
+			break;
+
+		if (output->stop_requested && !output_event_is_last(event)) {
+			output_release_audio_ring(output, event->str);
+			g_string_free(event, TRUE);
+			ret = 1;
+		} else
+			ret = output_handle_event(output, event);
+		if (ret <= 0)
+			output_events_done(output);
+
+		pthread_mutex_lock(&lookahead_mutex);
+	} while (!last);
+	pthread_mutex_unlock(&lookahead_mutex);
+
+	return NULL;
+}
+
+/* Drop what the other modules synthesized ahead, with element_free_mutex
+ * held so that output_modules stays as it is */
+static void output_lookahead_discard_others(OutputModule * output)
+{
+	OutputModule *other;
+	GList *gl;
+	int active;
+
+	check_locked(&element_free_mutex);
+	for (gl = output_modules; gl != NULL; gl = gl->next) {
+		other = gl->data;
+		if (other == output)
+			continue;
+		pthread_mutex_lock(&lookahead_mutex);
+		active = other->lookahead.active;
+		pthread_mutex_unlock(&lookahead_mutex);
+		if (!active)
+			continue;
+		/* It can end on its own while we use another module */
+		output_lock(other);
+		output_lookahead_discard(other);
+		output_unlock(other);
+	}
+}
+
+/* Speak msg from what output synthesized ahead, returns 1 if it was not
+ * synthesized ahead and output_speak() is to be used */
+int output_speak_lookahead(TSpeechDMessage * msg, OutputModule * output)
+{
+	OutputLookahead *ahead = &output->lookahead;
+	int active;
+
+	output_lookahead_discard_others(output);
+
+	pthread_mutex_lock(&lookahead_mutex);
+	active = ahead->active;
+	pthread_mutex_unlock(&lookahead_mutex);
+	if (!active)
+		return 1;
+
+	output_lock(output);
+
+	pthread_mutex_lock(&lookahead_mutex);
+	if (!ahead->active || ahead->id != msg->id
+	    || ahead->overflow || ahead->replaying) {
+		pthread_mutex_unlock(&lookahead_mutex);
+		output_lookahead_discard(output);
+		OL_RET(1);
+	}
+
+	MSG(4, "Speaking the message synthesized ahead");
+	ahead->replaying = 1;
+	ahead->id = 0;
+	g_free(msg->buf);
+	msg->buf = ahead->buf;
+	ahead->buf = NULL;
+	forget_index_marks(msg);
+	pthread_mutex_unlock(&lookahead_mutex);
+	msg->bytes = -1;
+
+	output_set_speaking_monitor(msg, output);
+	/* Settings and text were sent before it was taken from the queue */
+	latency_speaking(&msg->latency, msg->id);
+
+	if (module_audio_id) {
+		if (!module_speak_queue_before_synth()) {
+			MSG(3, "Warning: couldn't begin speak queue");
+		}
+	}
+
+	output->end_queued = 0;
+	output->stop_requested = 0;
+	output->pause_requested = 0;
+	output->pause_queued = 0;
+	output_events_begin(output);
+
+	if (spd_task_run(output_lookahead_replay, output) != 0) {
+		MSG(1, "ERROR: Can't create the look-ahead thread, "
+		    "replaying synchronously");
+		output_unlock(output);
+		output_lookahead_replay(output);
+		return 0;
+	}
+
+	OL_RET(0);
+}
+
+/* Runs for the whole life of the module, to consume its output in parallel of
+ * handling audio processing and feedback to client */
+static void *output_reader_func(void *data)
 {
 	OutputModule *output = data;
+	GString *message;
 	int ret;
 
-	while (1) {
-		ret = output_module_is_speaking(output);
-		if (ret < 0) {
-			MSG2(3, "output_module", "output_module_is_speaking error");
-			pthread_exit(NULL);
+	while ((message = output_read_message(output)) != NULL) {
+		if (message->str[0] != '7') {
+			g_async_queue_push(output->replies, message);
+			continue;
 		}
-		if (ret == 0) {
+
+		output_traffic_received(output, 0, 1, 0);
+		if (output_event_is_last(message))
+			output_traffic_end(output, message->str);
+
+		if (output_lookahead_stage(output, message))
+			continue;
+
+		ret = output_handle_event(output, message);
+		if (ret < 0)
+			MSG2(3, "output_module", "output_handle_event error");
+		if (ret <= 0) {
 			MSG2(4, "output_module", "finished getting data from output module");
-			pthread_exit(NULL);
+			output_events_done(output);
 		}
 	}
+
+	MSG2(4, "output_module", "Module %s closed its output", output->name);
+	g_atomic_int_set(&output->reader_done, 1);
+	g_async_queue_push(output->replies, g_string_new(""));
+	output_lookahead_gone(output);
+	if (speaking_module == output) {
+		/* Tell the speaking thread if it waits for events from us */
+		pthread_mutex_lock(&output_events_mutex);
+		ret = output->events_pending;
+		pthread_mutex_unlock(&output_events_mutex);
+		if (ret)
+			module_report_event_broken();
+		output_events_done(output);
+	}
+
+	return NULL;
 }
 
 int output_is_speaking(char **index_mark)
@@ -1335,7 +2785,7 @@ int output_is_speaking(char **index_mark)
 	if (end) {
 		/* Wait for all audio processing to terminate before cleaning
 		 * everything */
-		pthread_join(output_thread, NULL);
+		output_events_wait(output);
 	}
 
 	return 0;
@@ -1362,29 +2812,49 @@ waitpid_with_timeout(pid_t pid, int *status_ptr, int options, size_t timeout)
 
 int output_close(OutputModule * module)
 {
-	int err;
 	int ret;
-	OutputModule *output;
-	output = module;
 
-	if (output == NULL)
+	if (module == NULL)
 		return -1;
 
-	output_lock();
+	output_lock(module);
+	ret = output_close_locked(module);
+	output_unlock(module);
+
+	return ret;
+}
+
+int output_close_locked(OutputModule * module)
+{
+	int err;
+	int ret;
 
-	assert(output->name != NULL);
-	MSG(3, "Closing module \"%s\"...", output->name);
-	if (output->working) {
-		SEND_DATA("STOP\n");
-		SEND_CMD("QUIT");
+	assert(module->name != NULL);
+	MSG(3, "Closing module \"%s\"...", module->name);
+	output_log_traffic(module);
+	if (module->working) {
+		err = output_send_data("STOP\n", module, 0);
+		if (err >= 0)
+			err = output_send_data("QUIT\n", module, 1);
+		if (err < 0)
+			return err;
 		usleep(100);
 		/* So that the module has some time to exit() correctly */
 	}
 
+	if (module->in_process) {
+		/* QUIT made its thread return, which closed its output */
+		MSG(4, "Waiting for the thread of module %s", module->name);
+		output_module_join(module);
+		output_join_reader(module);
+		return 0;
+	}
+
 	MSG(4, "Waiting for module pid %d", module->pid);
 	ret = waitpid_with_timeout(module->pid, NULL, 0, 1000);
 	if (ret > 0) {
 		MSG(4, "Ok, module closed successfully.");
+		output_join_reader(module);
 	} else if (ret == 0) {
 		int ret2;
 		MSG(1, "ERROR: Timed out when waiting for child cancellation");
@@ -1394,6 +2864,7 @@ int output_close(OutputModule * module)
 		ret2 = waitpid_with_timeout(module->pid, NULL, 0, 1000);
 		if (ret2 > 0) {
 			MSG(3, "Module terminated");
+			output_join_reader(module);
 		} else {
 			MSG(1,
 			    "ERROR: Module is not able to terminate, giving up.");
@@ -1403,7 +2874,7 @@ int output_close(OutputModule * module)
 		    "ERROR: waitpid() failed when waiting for child (module).");
 	}
 
-	OL_RET(0);
+	return 0;
 }
 
 #undef SEND_CMD
@@ -1422,6 +2893,16 @@ int output_check_module(OutputModule * output)
 	    output->pid);
 
 	if (output->working == 0) {
+		/* Get its spare process in, if it has one */
+		module_crashed(output);
+
+		if (output->in_process) {
+			/* It can not have crashed without us */
+			MSG(2, "Output module %s stopped answering.",
+			    output->name);
+			return 0;
+		}
+
 		/* Investigate on why it crashed */
 		ret = waitpid(output->pid, &status, WNOHANG);
 		if (ret == 0) {
@@ -23,8 +23,14 @@
 #include "speaking.h"
 
 OutputModule *get_output_module(const TSpeechDMessage * message);
+/* To be called when output_modules or a module in it is about to change */
+void output_modules_changed(void);
 
 int output_speak(TSpeechDMessage * msg, OutputModule *output);
+int output_lookahead_ready(OutputModule * output);
+int output_lookahead(TSpeechDMessage * msg, OutputModule * output);
+int output_speak_lookahead(TSpeechDMessage * msg, OutputModule * output);
+void output_preempt(TSpeechDMessage * msg, OutputModule * output);
 int output_stop(void);
 size_t output_pause(void);
 int output_is_speaking(char **index_mark);
@@ -36,12 +42,30 @@ char *escape_dot(char *otext);
 
 void output_set_speaking_monitor(TSpeechDMessage * msg, OutputModule * output);
 GString *output_read_reply(OutputModule * output);
+int output_start_reader(OutputModule * output);
+void output_join_reader(OutputModule * output);
 int output_send_data(const char *cmd, OutputModule * output, int wfr);
+/* Copy the traffic with output as it is consistent */
+void output_get_traffic(OutputModule * output, OutputModuleTraffic * copy);
 int output_send_settings(TSpeechDMessage * msg, OutputModule * output);
 int output_send_audio_settings(OutputModule * output);
+/* What the modules get from the server configuration when started */
+gchar *output_module_environment(void);
+void output_probe_audio(void);
 int output_send_loglevel_setting(OutputModule * output);
 SPDVoice **output_get_voices(OutputModule * output, const char *language, const char *variant);
 int waitpid_with_timeout(pid_t pid, int *status_ptr, int options,
 			 size_t timeout);
+/* Held while exchanging a command and its reply with output */
+void output_lock(OutputModule * output);
+void output_unlock(OutputModule * output);
 int output_close(OutputModule * module);
+/* The same, with the lock of module held, see output_lock() */
+int output_close_locked(OutputModule * module);
 SPDVoice **output_list_voices(const char *module_name, const char *language, const char *variant);
+/* Around looking modules up and using them outside of the main loop */
+void output_modules_use_begin(void);
+void output_modules_use_end(void);
+/* Around changing the list of modules, and before destroying one */
+void output_modules_change_begin(void);
+void output_modules_change_end(void);
@@ -24,6 +24,10 @@
 #endif
 
 #include <ctype.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "speechd.h"
 
@@ -34,6 +38,7 @@
 #include "sem_functions.h"
 #include "output.h"
 #include "fdsetconv.h"
+#include "speak_queue.h"
 
 /*
   Parse() receives input data and parses them. It can
@@ -46,29 +51,76 @@
 #define BLOCK_NO 0
 #define BLOCK_OK 1
 
-#define CHECK_SSIP_COMMAND(cmd_name, parse_function, allowed_in_block)\
-	if(!strcmp(command, cmd_name)){ \
-		g_free(command); \
-		if ((allowed_in_block == BLOCK_NO) && speechd_socket->inside_block) \
-			return g_strdup(ERR_NOT_ALLOWED_INSIDE_BLOCK); \
-		return (char*) (parse_function) (buf, bytes, fd, speechd_socket);	\
-	}
-
 #define NOT_ALLOWED_INSIDE_BLOCK() \
 	if(speechd_socket->inside_block > 0) \
 		return g_strdup(ERR_NOT_ALLOWED_INSIDE_BLOCK);
 
 #define ALLOWED_INSIDE_BLOCK() ;
 
+static char *parse_speak(const char *buf, const int bytes, char **params,
+			 const int fd, TSpeechDSock * speechd_socket);
+static char *parse_speak_fd(const char *buf, const int bytes, char **params,
+			    const int fd, TSpeechDSock * speechd_socket);
+static char *queue_text(const int fd, TSpeechDSock * speechd_socket,
+			char *text, size_t bytes);
+static char *parse_bye(const char *buf, const int bytes, char **params,
+		       const int fd, TSpeechDSock * speechd_socket);
+
+typedef char *(*SSIPCommandParser) (const char *buf, const int bytes,
+				     char **params, const int fd,
+				     TSpeechDSock * speechd_socket);
+
+typedef struct {
+	const char *name;
+	SSIPCommandParser parse;
+	int allowed_in_block;
+} SSIPCommand;
+
+/* Table of SSIP commands, looked up through ssip_commands_table */
+static const SSIPCommand ssip_commands[] = {
+	{"set", parse_set, BLOCK_OK},
+	{"history", parse_history, BLOCK_NO},
+	{"stop", parse_stop, BLOCK_NO},
+	{"cancel", parse_cancel, BLOCK_NO},
+	{"pause", parse_pause, BLOCK_NO},
+	{"resume", parse_resume, BLOCK_NO},
+	{"sound_icon", parse_snd_icon, BLOCK_OK},
+	{"char", parse_char, BLOCK_OK},
+	{"key", parse_key, BLOCK_OK},
+	{"list", parse_list, BLOCK_NO},
+	{"get", parse_get, BLOCK_NO},
+	{"help", parse_help, BLOCK_NO},
+	{"block", parse_block, BLOCK_OK},
+	{"speak", parse_speak, BLOCK_OK},
+	{"speak_fd", parse_speak_fd, BLOCK_OK},
+	{"bye", parse_bye, BLOCK_OK},
+	{"quit", parse_bye, BLOCK_OK},
+};
+
+static GHashTable *ssip_commands_table = NULL;
+
+static const SSIPCommand *ssip_command_lookup(const char *name)
+{
+	if (ssip_commands_table == NULL) {
+		int i;
+
+		ssip_commands_table = g_hash_table_new(g_str_hash, g_str_equal);
+		for (i = 0; i < G_N_ELEMENTS(ssip_commands); i++)
+			g_hash_table_insert(ssip_commands_table,
+					    (gpointer) ssip_commands[i].name,
+					    (gpointer) & ssip_commands[i]);
+	}
+
+	return g_hash_table_lookup(ssip_commands_table, name);
+}
+
 char *parse(const char *buf, const int bytes, const int fd)
 {
-	TSpeechDMessage *new;
 	char *command;
 	int end_data;
 	char *pos;
-	int reparted;
-	int msg_uid;
-	GString *ok_queued_reply;
+	char *text;
+	size_t bytes_queued;
 	TSpeechDSock *speechd_socket = speechd_socket_get_by_fd(fd);
 	assert(speechd_socket);
 
@@ -82,8 +134,15 @@ char *parse(const char *buf, const int bytes, const int fd)
 	/* First the condition that we are not in data mode and we
 	 * are awaiting commands */
 	if (speechd_socket->awaiting_data == 0) {
+		const SSIPCommand *ssip_command;
+		char **params;
+		char *reply;
+
+		/* Split the line into parameters just once */
+		params = get_params(buf, bytes);
+
 		/* Read the command */
-		command = get_param(buf, 0, bytes, 1);
+		command = get_param(params, 0, 1);
 
 		MSG(5, "Command caught: \"%s\"", command);
 
@@ -93,48 +152,25 @@ char *parse(const char *buf, const int bytes, const int fd)
 		if (command == NULL) {
 			if (SPEECHD_DEBUG)
 				FATAL("Invalid buffer for parse()\n");
+			g_strfreev(params);
 			return g_strdup(ERR_INTERNAL);
 		}
 
-		CHECK_SSIP_COMMAND("set", parse_set, BLOCK_OK);
-		CHECK_SSIP_COMMAND("history", parse_history, BLOCK_NO);
-		CHECK_SSIP_COMMAND("stop", parse_stop, BLOCK_NO);
-		CHECK_SSIP_COMMAND("cancel", parse_cancel, BLOCK_NO);
-		CHECK_SSIP_COMMAND("pause", parse_pause, BLOCK_NO);
-		CHECK_SSIP_COMMAND("resume", parse_resume, BLOCK_NO);
-		CHECK_SSIP_COMMAND("sound_icon", parse_snd_icon, BLOCK_OK);
-		CHECK_SSIP_COMMAND("char", parse_char, BLOCK_OK);
-		CHECK_SSIP_COMMAND("key", parse_key, BLOCK_OK)
-		    CHECK_SSIP_COMMAND("list", parse_list, BLOCK_NO);
-		CHECK_SSIP_COMMAND("get", parse_get, BLOCK_NO);
-		CHECK_SSIP_COMMAND("help", parse_help, BLOCK_NO);
-		CHECK_SSIP_COMMAND("block", parse_block, BLOCK_OK);
-
-		if (!strcmp(command, "bye") || !strcmp(command, "quit")) {
-			MSG(4, "Bye received.");
-			/* Send a reply to the socket */
-			if (write(fd, OK_BYE, strlen(OK_BYE))) {
-				MSG(2,
-				    "ERROR: Can't write OK_BYE message to client socket: %s",
-				    strerror(errno));
-			}
+		ssip_command = ssip_command_lookup(command);
+		g_free(command);
 
-			speechd_connection_destroy(fd);
-			/* This is internal Speech Dispatcher message, see serve() */
-			g_free(command);
-			return g_strdup("999 CLIENT GONE");	/* This is an internal message, not part of SSIP */
-		}
+		if (ssip_command == NULL)
+			reply = g_strdup(ERR_INVALID_COMMAND);
+		else if ((ssip_command->allowed_in_block == BLOCK_NO)
+			 && speechd_socket->inside_block)
+			reply = g_strdup(ERR_NOT_ALLOWED_INSIDE_BLOCK);
+		else
+			/* Note that speechd_socket is gone after BYE */
+			reply = ssip_command->parse(buf, bytes, params, fd,
+						    speechd_socket);
 
-		if (!strcmp(command, "speak")) {
-			g_free(command);
-			/* Ckeck if we have enough space in awaiting_data table for
-			 * this client, that can have higher file descriptor that
-			 * everything we got before */
-			server_data_on(fd);
-			return g_strdup(OK_RECEIVE_DATA);
-		}
-		g_free(command);
-		return g_strdup(ERR_INVALID_COMMAND);
+		g_strfreev(params);
+		return reply;
 
 		/* The other case is that we are in awaiting_data mode and
 		 * we are waiting for text that is coming through the chanel */
@@ -161,8 +197,10 @@ enddata:
 				speechd_socket->o_bytes -= 2;
 
 			/* Check if message contains any data */
-			if (speechd_socket->o_bytes == 0)
+			if (speechd_socket->o_bytes == 0) {
+				server_data_off(fd);
 				return g_strdup(OK_MSG_CANCELED);
+			}
 
 			/* Check buffer for proper UTF-8 encoding */
 			if (!g_utf8_validate
@@ -171,40 +209,27 @@ enddata:
 				MSG(4,
 				    "ERROR: Invalid character encoding on input (failed UTF-8 validation)");
 				MSG(4, "Rejecting this message.");
+				server_data_off(fd);
 				return g_strdup(ERR_INVALID_ENCODING);
 			}
 
-			new =
-			    (TSpeechDMessage *)
-			    g_malloc(sizeof(TSpeechDMessage));
-			new->bytes = speechd_socket->o_bytes;
+			bytes_queued = speechd_socket->o_bytes;
 			assert(speechd_socket->o_buf != NULL);
-			new->buf =
-			    deescape_dot(speechd_socket->o_buf->str,
-					 new->bytes);
-			reparted = speechd_socket->inside_block;
-			MSG(5, "New buf is now: |%s|", new->buf);
-			if ((msg_uid =
-			     queue_message(new, fd, 1, SPD_MSGTYPE_TEXT,
-					   reparted)) == 0) {
-				if (SPEECHD_DEBUG)
-					FATAL("Can't queue message\n");
-				g_free(new->buf);
-				g_free(new);
-				return g_strdup(ERR_INTERNAL);
-			}
-
+			/* The data were already de-escaped while receiving them,
+			   so just move the buffer over to the message. */
+			g_string_truncate(speechd_socket->o_buf, bytes_queued);
+			text = g_string_free(speechd_socket->o_buf, 0);
+			speechd_socket->o_buf = NULL;
 			/* Clear the counter of bytes in the output buffer. */
 			server_data_off(fd);
-			ok_queued_reply = g_string_new("");
-			g_string_printf(ok_queued_reply,
-					C_OK_MESSAGE_QUEUED "-%d" NEWLINE
-					OK_MESSAGE_QUEUED, msg_uid);
-			return g_string_free(ok_queued_reply, 0);
+
+			return queue_text(fd, speechd_socket, text,
+					  bytes_queued);
 		}
 
 		{
 			int real_bytes;
+			const char *data = buf;
 			if (bytes >= 5) {
 				if ((pos = strstr(buf, "\r\n." NEWLINE))) {
 					real_bytes = pos - buf;
@@ -216,11 +241,19 @@ enddata:
 			} else {
 				real_bytes = bytes;
 			}
+			/* Every line either starts the message or follows
+			 * \r\n, so this is where an escaped dot may be; see
+			 * deescape_dot() */
+			if ((real_bytes >= 2) && (data[0] == '.')
+			    && (data[1] == '.')) {
+				data++;
+				real_bytes--;
+			}
 			/* Get the number of bytes read before, sum it with the number of bytes read
 			 * now and store again in the counter */
 			speechd_socket->o_bytes += real_bytes;
 
-			g_string_insert_len(speechd_socket->o_buf, -1, buf,
+			g_string_append_len(speechd_socket->o_buf, data,
 					    real_bytes);
 		}
 	}
@@ -233,8 +266,6 @@ enddata:
 
 }
 
-#undef CHECK_SSIP_COMMAND
-
 #define CHECK_PARAM(param) \
 	if (param == NULL){ \
 		MSG(4, "Missing parameter from client"); \
@@ -244,7 +275,7 @@ enddata:
 #define GET_PARAM_INT(name, pos) \
 	{ \
 		char *helper; \
-		helper = get_param(buf, pos, bytes, 0); \
+		helper = get_param(params, pos, 0); \
 		CHECK_PARAM(helper); \
 		if (!isanum(helper)){ \
 			g_free(helper); \
@@ -258,7 +289,7 @@ enddata:
 #define NO_CONV 0
 
 #define GET_PARAM_STR(name, pos, up_lo_case) \
-	name = get_param(buf, pos, bytes, up_lo_case); \
+	name = get_param(params, pos, up_lo_case); \
 	CHECK_PARAM(name);
 
 /* Tests if cmd is the same as str AND deallocates cmd if
@@ -266,9 +297,137 @@ enddata:
 #define TEST_CMD(cmd, str) \
 	(!strcmp(cmd, str) ? g_free(cmd), 1 : 0 )
 
+/* Queue _bytes_ of _text_, which the new message takes over, as the next
+   text message of the client on _fd_ and return the reply for it. */
+static char *queue_text(const int fd, TSpeechDSock * speechd_socket,
+			char *text, size_t bytes)
+{
+	TSpeechDMessage *new;
+	int msg_uid;
+	char *refused;
+
+	refused = server_admit_message(fd, bytes);
+	if (refused != NULL) {
+		g_free(text);
+		return refused;
+	}
+
+	new = (TSpeechDMessage *) g_malloc(sizeof(TSpeechDMessage));
+	new->bytes = bytes;
+	new->buf = text;
+	new->index_marks = NULL;
+	new->mem_bytes = 0;
+	new->segment = 0;
+	latency_trace_init(&new->latency);
+
+	MSG(5, "New buf is now: |%s|", new->buf);
+	if (speechd_socket->inside_block)
+		msg_uid = queue_message(new, fd, 1, SPD_MSGTYPE_TEXT,
+					speechd_socket->inside_block);
+	else
+		msg_uid = queue_text_message(new, fd);
+	if (msg_uid == 0) {
+		if (SPEECHD_DEBUG)
+			FATAL("Can't queue message\n");
+		g_free(new->buf);
+		g_free(new);
+		return g_strdup(ERR_INTERNAL);
+	}
+
+	return g_strdup_printf(C_OK_MESSAGE_QUEUED "-%d" NEWLINE
+			       OK_MESSAGE_QUEUED, msg_uid);
+}
+
+static char *parse_speak(const char *buf, const int bytes, char **params,
+			 const int fd, TSpeechDSock * speechd_socket)
+{
+	/* Ckeck if we have enough space in awaiting_data table for
+	 * this client, that can have higher file descriptor that
+	 * everything we got before */
+	server_data_on(fd);
+	return g_strdup(OK_RECEIVE_DATA);
+}
+
+/* SPEAK_FD takes the text from a sealed memfd the client passed along with
+   the command, which avoids sending large texts through the socket.  The
+   seals guarantee the text can't change or go away while we read it. */
+static char *parse_speak_fd(const char *buf, const int bytes, char **params,
+			    const int fd, TSpeechDSock * speechd_socket)
+{
+#ifdef F_GET_SEALS
+	const int seals = F_SEAL_SHRINK | F_SEAL_WRITE;
+	struct stat st;
+	char *text;
+	void *map;
+	int text_bytes;
+	int text_fd;
+	int text_seals;
+	int i;
+
+	GET_PARAM_INT(text_bytes, 1);
+
+	if (speechd_socket->n_passed_fds == 0)
+		return g_strdup(ERR_NO_FILE_DESCRIPTOR);
+	text_fd = speechd_socket->passed_fds[0];
+	speechd_socket->n_passed_fds--;
+	for (i = 0; i < speechd_socket->n_passed_fds; i++)
+		speechd_socket->passed_fds[i] = speechd_socket->passed_fds[i + 1];
+
+	/* -1 when it is no memfd would have all bits set */
+	text_seals = fcntl(text_fd, F_GET_SEALS);
+	if (text_bytes < 0 || text_seals < 0 || (text_seals & seals) != seals
+	    || fstat(text_fd, &st) < 0 || st.st_size < text_bytes) {
+		MSG(4, "Rejecting SPEAK_FD: not a sealed memfd of the given size");
+		close(text_fd);
+		return g_strdup(ERR_PARAMETER_INVALID);
+	}
+	if (text_bytes == 0) {
+		close(text_fd);
+		return g_strdup(OK_MSG_CANCELED);
+	}
+
+	map = mmap(NULL, text_bytes, PROT_READ, MAP_PRIVATE, text_fd, 0);
+	close(text_fd);
+	if (map == MAP_FAILED) {
+		MSG(4, "Can't map the SPEAK_FD text: %s", strerror(errno));
+		return g_strdup(ERR_INTERNAL);
+	}
+
+	if (!g_utf8_validate(map, text_bytes, NULL)) {
+		MSG(4, "ERROR: Invalid character encoding on SPEAK_FD input "
+		    "(failed UTF-8 validation)");
+		munmap(map, text_bytes);
+		return g_strdup(ERR_INVALID_ENCODING);
+	}
+	/* The message owns a NUL-terminated copy, as for SPEAK */
+	text = g_strndup(map, text_bytes);
+	munmap(map, text_bytes);
+
+	MSG(5, "Got %d bytes of text through SPEAK_FD", text_bytes);
+	return queue_text(fd, speechd_socket, text, text_bytes);
+#else
+	return g_strdup(ERR_NOT_IMPLEMENTED);
+#endif
+}
+
+static char *parse_bye(const char *buf, const int bytes, char **params,
+		       const int fd, TSpeechDSock * speechd_socket)
+{
+	MSG(4, "Bye received.");
+	/* Send a reply to the socket, after the replies to the previous
+	   commands and what the client did not read yet */
+	speechd_socket->replies[speechd_socket->n_replies++] = g_strdup(OK_BYE);
+	if (server_flush_replies(fd) == -1)
+		MSG(2, "ERROR: Can't write OK_BYE message to client socket");
+
+	speechd_connection_close(fd);
+	/* This is internal Speech Dispatcher message, see serve() */
+	return g_strdup("999 CLIENT GONE");	/* This is an internal message, not part of SSIP */
+}
+
 /* Parses @history commands and calls the appropriate history_ functions. */
-char *parse_history(const char *buf, const int bytes, const int fd,
-		    const TSpeechDSock * speechd_socket)
+char *parse_history(const char *buf, const int bytes, char **params,
+		    const int fd, TSpeechDSock * speechd_socket)
 {
 	char *cmd_main;
 	GET_PARAM_STR(cmd_main, 1, CONV_DOWN);
@@ -290,7 +449,7 @@ char *parse_history(const char *buf, const int bytes, const int fd,
 			int client_id = get_client_uid_by_fd(fd);
 
 			/* TODO: This needs to be (sim || am)-plified */
-			who = get_param(buf, 3, bytes, 1);
+			who = get_param(params, 3, 1);
 			CHECK_PARAM(who);
 			if (!strcmp(who, "self"))
 				/* TODO: Get all our messages, that should be allowed but how many to get... */
@@ -316,7 +475,7 @@ char *parse_history(const char *buf, const int bytes, const int fd,
 		} else if (TEST_CMD(hist_get_sub, "message")) {
 			int msg_id;
 			GET_PARAM_INT(msg_id, 3);
-			return (char *)history_get_message(msg_id);
+			return (char *)history_get_message(fd, msg_id);
 		} else {
 			return g_strdup(ERR_MISSING_PARAMETER);
 		}
@@ -372,7 +531,7 @@ char *parse_history(const char *buf, const int bytes, const int fd,
 #define SSIP_SET_COMMAND(param) \
 	if (who == 0) ret = set_ ## param ## _self(fd, param); \
 	else if (who == 1) ret = set_ ## param ## _uid(uid, param); \
-	else if (who == 2) ret = set_ ## param ## _all(param); \
+	else if (who == 2) ret = set_ ## param ## _all(fd, param); \
 
 #define SSIP_ON_OFF_PARAM(param, ok_message, err_message, inside_block) \
 	if (!strcmp(set_sub, #param)){ \
@@ -394,8 +553,8 @@ char *parse_history(const char *buf, const int bytes, const int fd,
 		return g_strdup(ok_message); \
 	}
 
-char *parse_set(const char *buf, const int bytes, const int fd,
-		const TSpeechDSock * speechd_socket)
+char *parse_set(const char *buf, const int bytes, char **params,
+		const int fd, TSpeechDSock * speechd_socket)
 {
 	int who;		/* 0 - self, 1 - uid specified, 2 - all */
 	int uid = -1;		/* uid of the client (only if who == 1) */
@@ -414,6 +573,8 @@ char *parse_set(const char *buf, const int bytes, const int fd,
 		who = 1;
 		uid = atoi(who_s);
 		g_free(who_s);
+		if (!client_same_owner(fd, uid))
+			return g_strdup(ERR_ID_NOT_EXIST);
 	} else {
 		g_free(who_s);
 		return g_strdup(ERR_PARAMETER_INVALID);
@@ -463,38 +624,10 @@ char *parse_set(const char *buf, const int bytes, const int fd,
 		return g_strdup(OK_LANGUAGE_SET);
 	} else if (TEST_CMD(set_sub, "synthesis_voice")) {
 		char *synthesis_voice = NULL;
-		char *tmp = NULL;
-		gchar **split_command;
-		int i;
 
-		split_command = g_strsplit(buf, " ", 0);
-		for (i = 0; split_command[i] != NULL; i++) {
-			tmp = NULL;
-
-			if (i == 3) {
-				if (g_str_has_suffix(split_command[i], "\n")) {
-					synthesis_voice = g_strndup(split_command[i], strlen(split_command[i]) - 2);
-				} else {
-					synthesis_voice = g_strdup(split_command[i]);
-				}
-			} else if (i > 3) {
-				if (g_str_has_suffix(split_command[i], "\n")) {
-					tmp = g_strndup(split_command[i], strlen(split_command[i]) - 2);
-					g_free(split_command[i]);
-					split_command[i] = tmp;
-					tmp = NULL;
-				}
-
-				tmp = g_strjoin(" ", synthesis_voice, split_command[i], NULL);
-				g_free(synthesis_voice);
-				synthesis_voice = tmp;
-			}
-		}
-
-		g_strfreev(split_command);
-
-		if (i < 3)
-			synthesis_voice = NULL;
+		/* The voice name may contain spaces */
+		if (g_strv_length(params) > 3)
+			synthesis_voice = g_strjoinv(" ", params + 3);
 
 		SSIP_SET_COMMAND(synthesis_voice);
 		g_free(synthesis_voice);
@@ -644,6 +777,17 @@ char *parse_set(const char *buf, const int bytes, const int fd,
 		if (ret)
 			return g_strdup(ERR_COULDNT_SET_PAUSE_CONTEXT);
 		return g_strdup(OK_PAUSE_CONTEXT_SET);
+	} else if (TEST_CMD(set_sub, "index_mark_interval")) {
+		int index_mark_interval;
+		GET_PARAM_INT(index_mark_interval, 3);
+
+		if (index_mark_interval < 0)
+			return g_strdup(ERR_PARAMETER_INVALID);
+
+		SSIP_SET_COMMAND(index_mark_interval);
+		if (ret)
+			return g_strdup(ERR_COULDNT_SET_INDEX_MARK_INTERVAL);
+		return g_strdup(OK_INDEX_MARK_INTERVAL_SET);
 	} else
 		SSIP_ON_OFF_PARAM(spelling,
 				  OK_SPELLING_SET, ERR_COULDNT_SET_SPELLING,
@@ -652,6 +796,15 @@ char *parse_set(const char *buf, const int bytes, const int fd,
 		SSIP_ON_OFF_PARAM(ssml_mode,
 				  OK_SSML_MODE_SET, ERR_COULDNT_SET_SSML_MODE,
 				  ALLOWED_INSIDE_BLOCK())
+	else
+		SSIP_ON_OFF_PARAM(sound_icon_mixing,
+				  OK_SOUND_ICON_MIXING_SET,
+				  ERR_COULDNT_SET_SOUND_ICON_MIXING,
+				  NOT_ALLOWED_INSIDE_BLOCK())
+	else
+		SSIP_ON_OFF_PARAM(coalescing,
+				  OK_COALESCING_SET, ERR_COULDNT_SET_COALESCING,
+				  NOT_ALLOWED_INSIDE_BLOCK())
 	else
 		SSIP_ON_OFF_PARAM(debug,
 				  g_strdup_printf("262-%s" NEWLINE OK_DEBUGGING,
@@ -685,6 +838,27 @@ char *parse_set(const char *buf, const int bytes, const int fd,
 		if (ret)
 			return g_strdup(ERR_COULDNT_SET_NOTIFICATION);
 		return g_strdup(OK_NOTIFICATION_SET);
+	} else if (TEST_CMD(set_sub, "audio_retrieval")) {
+		char *par_s;
+		int par;
+
+		if (who != 0)
+			return g_strdup(ERR_PARAMETER_INVALID);
+
+		GET_PARAM_STR(par_s, 3, CONV_DOWN);
+
+		if (TEST_CMD(par_s, "on"))
+			par = 1;
+		else if (TEST_CMD(par_s, "off"))
+			par = 0;
+		else {
+			g_free(par_s);
+			return g_strdup(ERR_PARAMETER_NOT_ON_OFF);
+		}
+
+		if (set_audio_retrieval_self(fd, par))
+			return g_strdup(ERR_COULDNT_SET_AUDIO_RETRIEVAL);
+		return g_strdup(OK_AUDIO_RETRIEVAL_SET);
 	}
 
 	g_free(set_sub);
@@ -693,8 +867,8 @@ char *parse_set(const char *buf, const int bytes, const int fd,
 
 #undef SSIP_SET_COMMAND
 
-char *parse_stop(const char *buf, const int bytes, const int fd,
-		 const TSpeechDSock * speechd_socket)
+char *parse_stop(const char *buf, const int bytes, char **params,
+		 const int fd, TSpeechDSock * speechd_socket)
 {
 	int uid = 0;
 	char *who_s;
@@ -703,7 +877,15 @@ char *parse_stop(const char *buf, const int bytes, const int fd,
 
 	GET_PARAM_STR(who_s, 1, CONV_DOWN);
 
-	if (TEST_CMD(who_s, "all")) {
+	if (TEST_CMD(who_s, "all") && SpeechdOptions.multi_user) {
+		GList *uids = get_client_uids_of_owner(fd), *gl;
+
+		pthread_mutex_lock(&element_free_mutex);
+		for (gl = uids; gl != NULL; gl = gl->next)
+			speaking_stop(GPOINTER_TO_INT(gl->data));
+		pthread_mutex_unlock(&element_free_mutex);
+		g_list_free(uids);
+	} else if (TEST_CMD(who_s, "all")) {
 		pthread_mutex_lock(&element_free_mutex);
 		speaking_stop_all();
 		pthread_mutex_unlock(&element_free_mutex);
@@ -718,7 +900,7 @@ char *parse_stop(const char *buf, const int bytes, const int fd,
 		uid = atoi(who_s);
 		g_free(who_s);
 
-		if (uid <= 0)
+		if (uid <= 0 || !client_same_owner(fd, uid))
 			return g_strdup(ERR_ID_NOT_EXIST);
 		pthread_mutex_lock(&element_free_mutex);
 		speaking_stop(uid);
@@ -731,8 +913,8 @@ char *parse_stop(const char *buf, const int bytes, const int fd,
 	return g_strdup(OK_STOPPED);
 }
 
-char *parse_cancel(const char *buf, const int bytes, const int fd,
-		   const TSpeechDSock * speechd_socket)
+char *parse_cancel(const char *buf, const int bytes, char **params,
+		   const int fd, TSpeechDSock * speechd_socket)
 {
 	int uid = 0;
 	char *who_s;
@@ -741,7 +923,13 @@ char *parse_cancel(const char *buf, const int bytes, const int fd,
 
 	GET_PARAM_STR(who_s, 1, CONV_DOWN);
 
-	if (TEST_CMD(who_s, "all")) {
+	if (TEST_CMD(who_s, "all") && SpeechdOptions.multi_user) {
+		GList *uids = get_client_uids_of_owner(fd), *gl;
+
+		for (gl = uids; gl != NULL; gl = gl->next)
+			speaking_cancel(GPOINTER_TO_INT(gl->data));
+		g_list_free(uids);
+	} else if (TEST_CMD(who_s, "all")) {
 		speaking_cancel_all();
 	} else if (TEST_CMD(who_s, "self")) {
 		uid = get_client_uid_by_fd(fd);
@@ -752,7 +940,7 @@ char *parse_cancel(const char *buf, const int bytes, const int fd,
 		uid = atoi(who_s);
 		g_free(who_s);
 
-		if (uid <= 0)
+		if (uid <= 0 || !client_same_owner(fd, uid))
 			return g_strdup(ERR_ID_NOT_EXIST);
 		speaking_cancel(uid);
 	} else {
@@ -763,8 +951,8 @@ char *parse_cancel(const char *buf, const int bytes, const int fd,
 	return g_strdup(OK_CANCELED);
 }
 
-char *parse_pause(const char *buf, const int bytes, const int fd,
-		  const TSpeechDSock * speechd_socket)
+char *parse_pause(const char *buf, const int bytes, char **params,
+		  const int fd, TSpeechDSock * speechd_socket)
 {
 	int uid = 0;
 	char *who_s;
@@ -773,30 +961,26 @@ char *parse_pause(const char *buf, const int bytes, const int fd,
 
 	GET_PARAM_STR(who_s, 1, CONV_DOWN);
 
-	/* Note: In this case, the semaphore has a special meaning
-	   to allow the speaking loop detect the request for pause */
-
+	/* The speaking thread does the pausing, the clients are looked up here
+	   since fd_uid belongs to the main loop.  Without MultiUser, they all
+	   have the same owner. */
 	if (TEST_CMD(who_s, "all")) {
-		pause_requested = 1;
-		pause_requested_fd = fd;
-		speaking_semaphore_post();
+		GList *uids = get_client_uids_of_owner(fd), *gl;
+
+		for (gl = uids; gl != NULL; gl = gl->next)
+			speaking_request_pause(fd, GPOINTER_TO_INT(gl->data));
+		g_list_free(uids);
 	} else if (TEST_CMD(who_s, "self")) {
 		uid = get_client_uid_by_fd(fd);
 		if (uid == 0)
 			return g_strdup(ERR_INTERNAL);
-		pause_requested = 2;
-		pause_requested_fd = fd;
-		pause_requested_uid = uid;
-		speaking_semaphore_post();
+		speaking_request_pause(fd, uid);
 	} else if (isanum(who_s)) {
 		uid = atoi(who_s);
 		g_free(who_s);
-		if (uid <= 0)
+		if (uid <= 0 || !client_same_owner(fd, uid))
 			return g_strdup(ERR_ID_NOT_EXIST);
-		pause_requested = 2;
-		pause_requested_fd = fd;
-		pause_requested_uid = uid;
-		speaking_semaphore_post();
+		speaking_request_pause(fd, uid);
 	} else {
 		g_free(who_s);
 		return g_strdup(ERR_PARAMETER_INVALID);
@@ -805,8 +989,8 @@ char *parse_pause(const char *buf, const int bytes, const int fd,
 	return g_strdup(OK_PAUSED);
 }
 
-char *parse_resume(const char *buf, const int bytes, const int fd,
-		   const TSpeechDSock * speechd_socket)
+char *parse_resume(const char *buf, const int bytes, char **params,
+		   const int fd, TSpeechDSock * speechd_socket)
 {
 	int uid = 0;
 	char *who_s;
@@ -815,7 +999,13 @@ char *parse_resume(const char *buf, const int bytes, const int fd,
 
 	GET_PARAM_STR(who_s, 1, CONV_DOWN);
 
-	if (TEST_CMD(who_s, "all")) {
+	if (TEST_CMD(who_s, "all") && SpeechdOptions.multi_user) {
+		GList *uids = get_client_uids_of_owner(fd), *gl;
+
+		for (gl = uids; gl != NULL; gl = gl->next)
+			speaking_resume(GPOINTER_TO_INT(gl->data));
+		g_list_free(uids);
+	} else if (TEST_CMD(who_s, "all")) {
 		speaking_resume_all();
 	} else if (TEST_CMD(who_s, "self")) {
 		uid = get_client_uid_by_fd(fd);
@@ -825,7 +1015,7 @@ char *parse_resume(const char *buf, const int bytes, const int fd,
 	} else if (isanum(who_s)) {
 		uid = atoi(who_s);
 		g_free(who_s);
-		if (uid <= 0)
+		if (uid <= 0 || !client_same_owner(fd, uid))
 			return g_strdup(ERR_ID_NOT_EXIST);
 		speaking_resume(uid);
 	} else {
@@ -836,13 +1026,60 @@ char *parse_resume(const char *buf, const int bytes, const int fd,
 	return g_strdup(OK_RESUMED);
 }
 
-char *parse_general_event(const char *buf, const int bytes, const int fd,
-			  const TSpeechDSock * speechd_socket,
+/* Plays the sound icon over the current speech if the client asked for it,
+   returns the id given to it, or 0 if it has to be queued */
+static int mix_sound_icon(const int fd, const char *name)
+{
+	TFDSetElement *settings;
+	char *path;
+	int id = 0;
+
+	if (!SpeechdOptions.sound_icon_preload_folder)
+		return 0;
+	settings = get_client_settings_by_fd(fd);
+	if (!settings || !settings->sound_icon_mixing || strchr(name, '/'))
+		return 0;
+
+	path = g_build_filename(SpeechdOptions.sound_icon_preload_folder,
+				name, NULL);
+	if (module_speak_queue_mix_sound_icon(path)) {
+		/* Same id space as queue_message() */
+		id = ++last_message_id;
+		MSG(4, "Mixing sound icon %s over the speech", path);
+	}
+	g_free(path);
+	return id;
+}
+
+/* The mixed icon never goes through the queue, so its events are
+   sent right after the reply, in the same write to keep them ordered */
+static char *mixed_sound_icon_reply(const int fd, int id)
+{
+	TFDSetElement *settings = get_client_settings_by_fd(fd);
+	GString *reply;
+
+	reply = g_string_new(NULL);
+	g_string_printf(reply, C_OK_MESSAGE_QUEUED "-%d" NEWLINE
+			OK_MESSAGE_QUEUED, id);
+	if (settings && (settings->notification & SPD_BEGIN))
+		g_string_append_printf(reply, EVENT_BEGIN_C "-%d" NEWLINE
+				       EVENT_BEGIN_C "-%d" NEWLINE EVENT_BEGIN,
+				       id, settings->uid);
+	if (settings && (settings->notification & SPD_END))
+		g_string_append_printf(reply, EVENT_END_C "-%d" NEWLINE
+				       EVENT_END_C "-%d" NEWLINE EVENT_END,
+				       id, settings->uid);
+	return g_string_free(reply, FALSE);
+}
+
+char *parse_general_event(const char *buf, const int bytes, char **params,
+			  const int fd, TSpeechDSock * speechd_socket,
 			  SPDMessageType type)
 {
 	char *param;
 	TSpeechDMessage *msg;
 	int msg_uid;
+	char *refused;
 
 	GET_PARAM_STR(param, 1, NO_CONV);
 
@@ -868,9 +1105,25 @@ char *parse_general_event(const char *buf, const int bytes, const int fd,
 		param = g_strdup(" ");
 	}
 
+	if (type == SPD_MSGTYPE_SOUND_ICON && !speechd_socket->inside_block
+	    && (msg_uid = mix_sound_icon(fd, param)) != 0) {
+		g_free(param);
+		return mixed_sound_icon_reply(fd, msg_uid);
+	}
+
+	refused = server_admit_message(fd, strlen(param));
+	if (refused != NULL) {
+		g_free(param);
+		return refused;
+	}
+
 	msg = (TSpeechDMessage *) g_malloc(sizeof(TSpeechDMessage));
 	msg->bytes = strlen(param);
 	msg->buf = g_strdup(param);
+	msg->index_marks = NULL;
+	msg->mem_bytes = 0;
+	msg->segment = 0;
+	latency_trace_init(&msg->latency);
 
 	msg_uid = queue_message(msg, fd, 1, type, speechd_socket->inside_block);
 	if (msg_uid == 0) {
@@ -885,29 +1138,80 @@ char *parse_general_event(const char *buf, const int bytes, const int fd,
 			       OK_MESSAGE_QUEUED, msg_uid);
 }
 
-char *parse_snd_icon(const char *buf, const int bytes, const int fd,
-		     const TSpeechDSock * speechd_socket)
+char *parse_snd_icon(const char *buf, const int bytes, char **params,
+		     const int fd, TSpeechDSock * speechd_socket)
 {
-	return parse_general_event(buf, bytes, fd, speechd_socket,
+	return parse_general_event(buf, bytes, params, fd, speechd_socket,
 				   SPD_MSGTYPE_SOUND_ICON);
 }
 
-char *parse_char(const char *buf, const int bytes, const int fd,
-		 const TSpeechDSock * speechd_socket)
+char *parse_char(const char *buf, const int bytes, char **params,
+		 const int fd, TSpeechDSock * speechd_socket)
 {
-	return parse_general_event(buf, bytes, fd, speechd_socket,
+	return parse_general_event(buf, bytes, params, fd, speechd_socket,
 				   SPD_MSGTYPE_CHAR);
 }
 
-char *parse_key(const char *buf, const int bytes, const int fd,
-		const TSpeechDSock * speechd_socket)
+char *parse_key(const char *buf, const int bytes, char **params,
+		const int fd, TSpeechDSock * speechd_socket)
 {
-	return parse_general_event(buf, bytes, fd, speechd_socket,
+	return parse_general_event(buf, bytes, params, fd, speechd_socket,
 				   SPD_MSGTYPE_KEY);
 }
 
-char *parse_list(const char *buf, const int bytes, const int fd,
-		 const TSpeechDSock * speechd_socket)
+typedef struct {
+	char *module;
+	char *language;
+	char *variant;
+} TListVoicesArgs;
+
+static void list_voices_args_free(gpointer data)
+{
+	TListVoicesArgs *args = data;
+
+	g_free(args->module);
+	g_free(args->language);
+	g_free(args->variant);
+	g_free(args);
+}
+
+/* Run by a server worker for LIST SYNTHESIS_VOICES */
+static char *list_voices_reply(gpointer data)
+{
+	TListVoicesArgs *args = data;
+	SPDVoice **voices;
+	GString *result;
+	int i;
+
+	/* Looked up again by name, and kept from being destroyed meanwhile */
+	output_modules_use_begin();
+	voices = output_list_voices(args->module, args->language,
+				    args->variant);
+	output_modules_use_end();
+	if (voices == NULL)
+		return g_strdup(ERR_CANT_REPORT_VOICES);
+
+	result = g_string_new("");
+	for (i = 0;; i++) {
+		if (voices[i] == NULL)
+			break;
+		g_string_append_printf(result,
+				       C_OK_VOICES "-%s\t%s\t%s" NEWLINE,
+				       voices[i]->name,
+				       voices[i]->language,
+				       voices[i]->variant);
+		g_free(voices[i]->name);
+		g_free(voices[i]->language);
+		g_free(voices[i]->variant);
+		g_free(voices[i]);
+	}
+	g_string_append(result, OK_VOICE_LIST_SENT);
+	g_free(voices);
+	return g_string_free(result, 0);
+}
+
+char *parse_list(const char *buf, const int bytes, char **params,
+		 const int fd, TSpeechDSock * speechd_socket)
 {
 	char *list_type;
 	char *voice_list;
@@ -946,51 +1250,31 @@ char *parse_list(const char *buf, const int bytes, const int fd,
 	} else if (TEST_CMD(list_type, "synthesis_voices")) {
 		int uid;
 		TFDSetElement *settings;
-		SPDVoice **voices;
-		GString *result;
-		int i;
-		char *language;
-		char *variant;
+		TListVoicesArgs *args;
 
 		uid = get_client_uid_by_fd(fd);
 		settings = get_client_settings_by_uid(uid);
 		if (settings == NULL)
 			return g_strdup(ERR_INTERNAL);
 
-		language = get_param(buf, 2, bytes, NO_CONV);
-		variant = get_param(buf, 3, bytes, NO_CONV);
+		/* The module may have to be asked, which can take long, so
+		   don't hold the main loop meanwhile */
+		args = g_new0(TListVoicesArgs, 1);
+		args->module = g_strdup(settings->output_module);
+		args->language = get_param(params, 2, NO_CONV);
+		args->variant = get_param(params, 3, NO_CONV);
+		server_defer(fd, list_voices_reply, args, list_voices_args_free);
 
-		voices = output_list_voices(settings->output_module, language, variant);
-		g_free(language);
-		g_free(variant);
-		if (voices == NULL)
-			return g_strdup(ERR_CANT_REPORT_VOICES);
-
-		result = g_string_new("");
-		for (i = 0;; i++) {
-			if (voices[i] == NULL)
-				break;
-			g_string_append_printf(result,
-					       C_OK_VOICES "-%s\t%s\t%s" NEWLINE,
-					       voices[i]->name,
-					       voices[i]->language,
-					       voices[i]->variant);
-			g_free(voices[i]->name);
-			g_free(voices[i]->language);
-			g_free(voices[i]->variant);
-			g_free(voices[i]);
-		}
-		g_string_append(result, OK_VOICE_LIST_SENT);
-		g_free(voices);
-		return g_string_free(result, 0);
+		/* The reply is sent once the workers got it */
+		return g_strdup("");
 	} else {
 		g_free(list_type);
 		return g_strdup(ERR_PARAMETER_INVALID);
 	}
 }
 
-char *parse_get(const char *buf, const int bytes, const int fd,
-		const TSpeechDSock * speechd_socket)
+char *parse_get(const char *buf, const int bytes, char **params,
+		const int fd, TSpeechDSock * speechd_socket)
 {
 	char *get_type;
 	GString *result;
@@ -1052,6 +1336,14 @@ char *parse_get(const char *buf, const int bytes, const int fd,
 	} else if (TEST_CMD(get_type, "volume")) {
 		g_string_append_printf(result, C_OK_GET "-%d" NEWLINE OK_GET,
 				       settings->msg_settings.volume);
+	} else if (TEST_CMD(get_type, "statistics")) {
+		g_string_free(result, TRUE);
+		g_free(get_type);
+		return latency_statistics();
+	} else if (TEST_CMD(get_type, "memory")) {
+		g_string_free(result, TRUE);
+		g_free(get_type);
+		return mem_usage_report();
 	} else if (TEST_CMD(get_type, "punctuation")) {
 		char *punct = EPunctMode2str(settings->msg_settings.punctuation_mode);
 		g_string_append_printf(result, C_OK_GET "-%s" NEWLINE OK_GET,
@@ -1064,8 +1356,8 @@ char *parse_get(const char *buf, const int bytes, const int fd,
 	return g_string_free(result, 0);
 }
 
-char *parse_help(const char *buf, const int bytes, const int fd,
-		 const TSpeechDSock * speechd_socket)
+char *parse_help(const char *buf, const int bytes, char **params,
+		 const int fd, TSpeechDSock * speechd_socket)
 {
 	char *help;
 
@@ -1073,6 +1365,7 @@ char *parse_help(const char *buf, const int bytes, const int fd,
 
 	sprintf(help,
 		C_OK_HELP "-  SPEAK           -- say text " NEWLINE
+		C_OK_HELP "-  SPEAK_FD        -- say text from a memfd passed along " NEWLINE
 		C_OK_HELP "-  KEY             -- say a combination of keys " NEWLINE
 		C_OK_HELP "-  CHAR            -- say a character " NEWLINE
 		C_OK_HELP "-  SOUND_ICON      -- execute a sound icon " NEWLINE
@@ -1087,8 +1380,8 @@ char *parse_help(const char *buf, const int bytes, const int fd,
 	return help;
 }
 
-char *parse_block(const char *buf, const int bytes, const int fd,
-		  TSpeechDSock * speechd_socket)
+char *parse_block(const char *buf, const int bytes, char **params,
+		  const int fd, TSpeechDSock * speechd_socket)
 {
 	char *cmd_main;
 	GET_PARAM_STR(cmd_main, 1, CONV_DOWN);
@@ -1192,57 +1485,43 @@ int isanum(const char *str)
 	return 1;
 }
 
-/* Gets command parameter _n_ from the text buffer _buf_
- * which has _bytes_ bytes. Note that the parameter with
- * index 0 is the command itself. */
-char *get_param(const char *buf, const int n, const int bytes,
-		const int lower_case)
+/* Splits the command line _buf_ which has _bytes_ bytes into
+ * its space separated parameters. The trailing \r\n is not
+ * included in the last one. Free the result with g_strfreev(). */
+char **get_params(const char *buf, const int bytes)
 {
-	char *param;
-	char *par;
-	int i, y, z = 0;
-
-	assert(bytes != 0);
-	param = (char *)g_malloc(bytes);
-	assert(param != NULL);
-
-	strcpy(param, "");
-	i = 0;
-
-	/* Read all the parameters one by one,
-	 * but stop after the one with index n,
-	 * while maintaining it's value in _param_ */
-	for (y = 0; y <= n; y++) {
-		z = 0;
-		for (; i < bytes; i++) {
-			if (buf[i] == ' ')
-				break;
-			param[z] = buf[i];
-			z++;
-		}
-		i++;
-	}
+	char *line;
+	char **params;
+	int len = bytes;
 
-	if (z <= 0) {
-		g_free(param);
-		return NULL;
-	}
+	if ((len >= 2) && (buf[len - 2] == '\r') && (buf[len - 1] == '\n'))
+		len -= 2;
 
-	/* Write the trailing zero */
-	if (i >= bytes) {
-		param[z > 1 ? z - 2 : 0] = 0;
-	} else {
-		param[z] = 0;
-	}
+	line = g_strndup(buf, len);
+	params = g_strsplit(line, " ", 0);
+	g_free(line);
 
-	if (lower_case) {
-		par = g_ascii_strdown(param, strlen(param));
-		g_free(param);
-	} else {
-		par = param;
-	}
+	return params;
+}
+
+/* Gets parameter _n_ from the _params_ vector returned by
+ * get_params(). Note that the parameter with index 0 is the
+ * command itself. Returns NULL for a missing or empty parameter. */
+char *get_param(char **params, const int n, const int lower_case)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		if (params[i] == NULL)
+			return NULL;
 
-	return par;
+	if ((params[n] == NULL) || (params[n][0] == '\0'))
+		return NULL;
+
+	if (lower_case)
+		return g_ascii_strdown(params[n], -1);
+	else
+		return g_strdup(params[n]);
 }
 
 /* Read one char  (which _pointer_ is pointing to) from an UTF-8 string
@@ -24,16 +24,62 @@
 #include <config.h>
 #endif
 
+#include <stdint.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 #include <safe_io.h>
 
 #include "speechd.h"
 #include "sem_functions.h"
 
+/* The speaking thread polls speaking_pipe[0], an eventfd when available,
+   for being woken.  At most one wakeup is pending at any time: whatever
+   gets requested before the speaking thread cleared it is seen by the same
+   pass of the speaking thread, so bursts of requests only wake it once. */
+static gint speaking_wakeup_pending;
+
+void speaking_semaphore_init(void)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+	int fd = eventfd(0, EFD_CLOEXEC);
+
+	if (fd >= 0) {
+		speaking_pipe[0] = speaking_pipe[1] = fd;
+		return;
+	}
+	MSG(2, "Can't create the speaking eventfd (%s), using a pipe",
+	    strerror(errno));
+#endif
+	if (pipe(speaking_pipe)) {
+		MSG(1, "Speaking pipe creation failed (%s)", strerror(errno));
+		FATAL("Can't create pipe");
+	}
+}
+
 void speaking_semaphore_post(void)
 {
-	char buf[1];
-	buf[0] = 42;
-	const ssize_t wr_bytes = safe_write(speaking_pipe[1], buf, 1);
-	if (wr_bytes != 1)
-		FATAL("write to polled fd: could not write 1 byte");
+	uint64_t one = 1;
+	size_t size = speaking_pipe[0] == speaking_pipe[1] ? sizeof(one) : 1;
+
+	if (!g_atomic_int_compare_and_exchange(&speaking_wakeup_pending, 0, 1))
+		/* The speaking thread will look in any case */
+		return;
+
+	/* The eventfd takes a 64-bit counter, the pipe a byte of any value */
+	const ssize_t wr_bytes = safe_write(speaking_pipe[1], &one, size);
+	if (wr_bytes != (ssize_t) size)
+		FATAL("write to polled fd: could not write the wakeup");
+}
+
+void speaking_semaphore_clear(void)
+{
+	uint64_t count;
+	size_t size = speaking_pipe[0] == speaking_pipe[1] ? sizeof(count) : 1;
+
+	const ssize_t rd_bytes = safe_read(speaking_pipe[0], &count, size);
+	if (rd_bytes != (ssize_t) size)
+		FATAL("read from polled fd: could not read the wakeup");
+	/* Requests made from now on post a new wakeup */
+	g_atomic_int_set(&speaking_wakeup_pending, 0);
 }
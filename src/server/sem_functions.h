@@ -19,4 +19,10 @@
  * $Id: sem_functions.h,v 1.6 2006-07-11 16:12:27 hanke Exp $
  */
 
+/* Create speaking_pipe */
+void speaking_semaphore_init(void);
+/* Wake the speaking thread, if it is not going to look already */
 void speaking_semaphore_post(void);
+/* Called by the speaking thread when woken, before it looks at what was
+   requested */
+void speaking_semaphore_clear(void);
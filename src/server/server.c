@@ -23,15 +23,43 @@
 #include <config.h>
 #endif
 
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
 #include "speechd.h"
 #include "server.h"
 #include "set.h"
 #include "speaking.h"
 #include "sem_functions.h"
 #include "history.h"
+#include "history_file.h"
+#include "metrics.h"
+#include "capture.h"
+#include "msg.h"
 
 int last_message_id = 0;
 
+/* server_send_data() waits that long at most, in us, for a client to read
+   its output below ClientOutputLimit */
+#define SERVER_DATA_WAIT (2 * G_USEC_PER_SEC)
+
+/* Signaled when the main loop wrote out some of the output of a client */
+static pthread_cond_t server_out_cond = PTHREAD_COND_INITIALIZER;
+
+/* Give msg the settings of the client as they are now, the strings are
+   shared with the other messages queued since the client last changed
+   them */
+static void message_take_settings(TSpeechDMessage * msg,
+				  TFDSetElement * settings, SPDMessageType type)
+{
+	msg->settings = *settings;
+	msg->settings.type = type;
+	spd_fdset_share_strings(&msg->settings, settings);
+	msg->settings.index_mark = g_strdup(settings->index_mark);
+	msg->settings.paused_while_speaking = 0;
+}
+
 /* Put a message into its queue.
  *
  * Parameters:
@@ -48,9 +76,6 @@ int last_message_id = 0;
  * It returns 0 on success, -1 otherwise.
  */
 
-#define COPY_SET_STR(name) \
-	new->settings.name = (char*) g_strdup(settings->name);
-
 /* Queue a message _new_. When fd is a positive number,
 it means we have a new message from the client on connection
 fd and we should fill in the proper settings. When fd is
@@ -61,15 +86,17 @@ that the original client might not be still connected
 to speechd). _history_flag_ indicates if inclusion into
 history is desired and _reparted_ flag indicates whether
 this message is a part of a reparted message (one of a block
-of messages). */
-int
-queue_message(TSpeechDMessage * new, int fd, int history_flag,
-	      SPDMessageType type, int reparted)
+of messages). A _requeued_ message goes back to its place by id
+instead of the tail of its queue. */
+static int
+queue_message_at(TSpeechDMessage * new, int fd, int history_flag,
+		 SPDMessageType type, int reparted, int requeued)
 {
 	TFDSetElement *settings;
 	TSpeechDMessage *message_copy;
 	int id;
-	GList *element;
+	TSpeechDMessage *element;
+	GQueue *queue;
 
 	/* Check function parameters */
 	if (new == NULL)
@@ -98,33 +125,21 @@ queue_message(TSpeechDMessage * new, int fd, int history_flag,
 
 	if (fd > 0) {
 		/* Copy the settings to the new to-be-queued element */
-		new->settings = *settings;
-		new->settings.type = type;
-		new->settings.index_mark = NULL;
-		COPY_SET_STR(client_name);
-		COPY_SET_STR(output_module);
-		COPY_SET_STR(msg_settings.voice.language);
-		COPY_SET_STR(msg_settings.voice.name);
-
-		COPY_SET_STR(index_mark);
-		COPY_SET_STR(audio_output_method);
-		COPY_SET_STR(audio_oss_device);
-		COPY_SET_STR(audio_alsa_device);
-		COPY_SET_STR(audio_nas_server);
-		COPY_SET_STR(audio_pulse_server);
-		COPY_SET_STR(audio_pulse_device);
+		message_take_settings(new, settings, type);
 
 		/* And we set the global id (note that this is really global, not
 		 * depending on the particular client, but unique) */
 		last_message_id++;
 		new->id = last_message_id;
 		new->time = time(NULL);
-
-		new->settings.paused_while_speaking = 0;
+		metrics_count_message(settings->priority);
 	}
 	id = new->id;
 
 	new->settings.reparted = reparted;
+	/* Reloaded messages get prepared again */
+	new->prepared = 0;
+	mem_account_message(new, MEM_MESSAGES);
 
 	MSG(5, "Queueing message |%s| with priority %d", new->buf,
 	    settings->priority);
@@ -133,50 +148,66 @@ queue_message(TSpeechDMessage * new, int fd, int history_flag,
 	/* NOTE: This should be before we put it into queues() to
 	   avoid conflicts with the other thread (it could delete
 	   the message before we would copy it) */
-	//    if (history_flag){
-	if (0) {
+	/* Only kept in the history file, if there is one */
+	if (history_flag && history_file_path()) {
 		pthread_mutex_lock(&element_free_mutex);
 		history_add_message(new);
 		pthread_mutex_unlock(&element_free_mutex);
 	}
 
 	pthread_mutex_lock(&element_free_mutex);
+	latency_mark(&new->latency, LATENCY_QUEUED);
 	/* Put the element new to queue according to it's priority. */
 	check_locked(&element_free_mutex);
 	switch (settings->priority) {
 	case SPD_IMPORTANT:
-		MessageQueue->p1 = g_list_append(MessageQueue->p1, new);
+		queue = MessageQueue->p1;
 		break;
 	case SPD_MESSAGE:
-		MessageQueue->p2 = g_list_append(MessageQueue->p2, new);
+		queue = MessageQueue->p2;
 		break;
 	case SPD_TEXT:
-		MessageQueue->p3 = g_list_append(MessageQueue->p3, new);
+		queue = MessageQueue->p3;
 		break;
 	case SPD_NOTIFICATION:
-		MessageQueue->p4 = g_list_append(MessageQueue->p4, new);
+		queue = MessageQueue->p4;
 		break;
 	case SPD_PROGRESS:
-		MessageQueue->p5 = g_list_append(MessageQueue->p5, new);
+		queue = MessageQueue->p5;
+		break;
+	default:
+		FATAL("Nonexistent priority given");
+	}
+	if (requeued)
+		queue_insert_message(queue, new);
+	else
+		queue_push_message(queue, new);
+
+	if (settings->priority == SPD_PROGRESS) {
 		//clear last_p5_block if we get new block or no block message
-		element = g_list_last(last_p5_block);
-		if (!element || !element->data
-		    || ((TSpeechDMessage *) (element->data))->
-		    settings.reparted != new->settings.reparted) {
-			g_list_foreach(last_p5_block, (GFunc) mem_free_message,
-				       NULL);
-			g_list_free(last_p5_block);
-			last_p5_block = NULL;
+		element = g_queue_peek_tail(last_p5_block);
+		if (!element || element->settings.reparted !=
+		    new->settings.reparted) {
+			g_queue_foreach(last_p5_block,
+					(GFunc) mem_free_message, NULL);
+			g_queue_clear(last_p5_block);
 		}
 		// insert message
 		message_copy = spd_message_copy(new);
 		if (message_copy != NULL)
-			last_p5_block =
-			    g_list_append(last_p5_block, message_copy);
+			g_queue_push_tail(last_p5_block, message_copy);
+	}
 
-		break;
-	default:
-		FATAL("Nonexistent priority given");
+	/* The client only wants its latest text spoken, drop what it sent
+	   before and nobody heard yet, before it costs anything */
+	if (fd > 0 && settings->coalescing
+	    && (settings->priority == SPD_MESSAGE
+		|| settings->priority == SPD_TEXT)) {
+		int dropped = coalesce_client_messages(new, settings->priority);
+
+		if (dropped)
+			MSG(5, "Message %d replaced %d queued messages", id,
+			    dropped);
 	}
 
 	/* Look what is the highest priority of waiting
@@ -187,6 +218,8 @@ queue_message(TSpeechDMessage * new, int fd, int history_flag,
 	   calls output_stop() should be moved to speaking.c speak()
 	   function in future */
 	resolve_priorities(settings->priority);
+	if (settings->priority == SPD_IMPORTANT)
+		speaking_preempt(new);
 	pthread_mutex_unlock(&element_free_mutex);
 
 	speaking_semaphore_post();
@@ -196,7 +229,173 @@ queue_message(TSpeechDMessage * new, int fd, int history_flag,
 	return id;
 }
 
-#undef COPY_SET_STR
+int
+queue_message(TSpeechDMessage * new, int fd, int history_flag,
+	      SPDMessageType type, int reparted)
+{
+	return queue_message_at(new, fd, history_flag, type, reparted, 0);
+}
+
+int requeue_message(TSpeechDMessage * msg)
+{
+	return queue_message_at(msg, -msg->settings.uid, 0, msg->settings.type,
+				msg->settings.reparted, 1);
+}
+
+/* Whether text[start, end) has something to say */
+static gboolean segment_has_text(const char *start, const char *end)
+{
+	for (; start < end; start++)
+		if (!g_ascii_isspace(*start))
+			return TRUE;
+	return FALSE;
+}
+
+/* Where to end the segment of text starting at start, at most max bytes
+   long: after the last end of sentence in its second half, or else after
+   its last space, or else at least on a character boundary */
+static const char *segment_end(const char *start, int max)
+{
+	const char *p, *end = start + max;
+
+	for (p = end - 1; p > start + max / 2; p--)
+		if ((p[-1] == '.' || p[-1] == '?' || p[-1] == '!'
+		     || p[-1] == '\n') && g_ascii_isspace(*p))
+			return p + 1;
+	for (p = end - 1; p > start + max / 2; p--)
+		if (g_ascii_isspace(*p))
+			return p + 1;
+	for (p = end; p > start + 1 && (*p & 0xc0) == 0x80; p--) ;
+	return p;
+}
+
+/* Queue a long text message as messages of at most SpeakSegmentLength
+   bytes, so that the module gets to speak the first of them without
+   getting the whole text, and the next ones while it plays, with
+   AudioLookAhead.  They are a block for the stops and priorities, and
+   share the id of the message, whose begin is reported by the first one and
+   end by the last one.  Returns the id, or 0 on failure like
+   queue_message(). */
+int queue_text_message(TSpeechDMessage * new, int fd)
+{
+	TFDSetElement *settings = get_client_settings_by_fd(fd);
+	int max = SpeechdOptions.speak_segment_length;
+	const char *start, *end, *text_end;
+	GPtrArray *segments;
+	TSpeechDMessage *part;
+	char *text;
+	int gid, id, i;
+
+	if (max <= 0 || new->bytes <= max + max / 2 || settings == NULL
+	    || settings->ssml_mode == SPD_DATA_SSML
+	    || (settings->priority != SPD_MESSAGE
+		&& settings->priority != SPD_TEXT))
+		return queue_message(new, fd, 1, SPD_MSGTYPE_TEXT, 0);
+
+	segments = g_ptr_array_new();
+	text_end = new->buf + new->bytes;
+	for (start = new->buf; start < text_end; start = end) {
+		end = text_end - start > max + max / 2
+		    ? segment_end(start, max) : text_end;
+		if (segment_has_text(start, end))
+			g_ptr_array_add(segments, g_strndup(start, end - start));
+	}
+	if (segments->len < 2) {
+		g_ptr_array_foreach(segments, (GFunc) g_free, NULL);
+		g_ptr_array_free(segments, TRUE);
+		return queue_message(new, fd, 1, SPD_MSGTYPE_TEXT, 0);
+	}
+
+	MSG(5, "Queueing message of %d bytes as %u segments", new->bytes,
+	    segments->len);
+	gid = ++SpeechdStatus.max_gid;
+
+	g_free(new->buf);
+	new->buf = g_ptr_array_index(segments, 0);
+	new->bytes = strlen(new->buf);
+	new->segment = SEGMENT_MORE;
+	id = queue_message(new, fd, 1, SPD_MSGTYPE_TEXT, gid);
+	if (id == 0)
+		goto out;
+
+	for (i = 1; i < segments->len; i++) {
+		text = g_ptr_array_index(segments, i);
+		g_ptr_array_index(segments, i) = NULL;
+
+		part = g_malloc(sizeof(TSpeechDMessage));
+		part->buf = text;
+		part->bytes = strlen(text);
+		part->index_marks = NULL;
+		part->mem_bytes = 0;
+		part->segment = SEGMENT_CONT;
+		if (i < segments->len - 1)
+			part->segment |= SEGMENT_MORE;
+		latency_trace_init(&part->latency);
+		message_take_settings(part, settings, SPD_MSGTYPE_TEXT);
+		part->id = id;
+		part->time = time(NULL);
+
+		/* A negative fd keeps the settings and id */
+		queue_message(part, -settings->uid, 1, SPD_MSGTYPE_TEXT, gid);
+	}
+
+out:
+	for (i = 1; i < segments->len; i++)
+		g_free(g_ptr_array_index(segments, i));
+	g_ptr_array_free(segments, TRUE);
+
+	return id;
+}
+
+char *server_admit_message(int fd, size_t bytes)
+{
+	TSpeechDSock *speechd_socket = speechd_socket_get_by_fd(fd);
+	int uid = get_client_uid_by_fd(fd);
+	guint queued;
+	gsize queued_bytes;
+
+	assert(speechd_socket);
+
+	/* Token bucket: the client earns ClientMessageRate messages per
+	   second, of which it can save up to ClientMessageBurst */
+	if (SpeechdOptions.client_message_rate > 0) {
+		gint64 now = g_get_monotonic_time();
+
+		speechd_socket->tokens += (now - speechd_socket->tokens_time)
+		    * SpeechdOptions.client_message_rate / 1e6;
+		if (speechd_socket->tokens > SpeechdOptions.client_message_burst)
+			speechd_socket->tokens =
+			    SpeechdOptions.client_message_burst;
+		speechd_socket->tokens_time = now;
+		if (speechd_socket->tokens < 1) {
+			MSG(4, "Client on fd %d sends too many messages, "
+			    "refusing one", fd);
+			return g_strdup(ERR_TOO_MANY_MESSAGES);
+		}
+	}
+
+	if (SpeechdOptions.client_queue_messages > 0
+	    || SpeechdOptions.client_queue_size > 0) {
+		pthread_mutex_lock(&element_free_mutex);
+		speaking_client_queued(uid, &queued, &queued_bytes);
+		pthread_mutex_unlock(&element_free_mutex);
+
+		if ((SpeechdOptions.client_queue_messages > 0
+		     && queued >= SpeechdOptions.client_queue_messages)
+		    || (SpeechdOptions.client_queue_size > 0
+			&& queued_bytes + bytes >
+			(gsize) SpeechdOptions.client_queue_size * 1024)) {
+			MSG(4, "Queue of client on fd %d is full (%u messages, "
+			    "%lu bytes), refusing a message", fd, queued,
+			    (unsigned long)queued_bytes);
+			return g_strdup(ERR_CLIENT_QUEUE_FULL);
+		}
+	}
+
+	if (SpeechdOptions.client_message_rate > 0)
+		speechd_socket->tokens--;
+	return NULL;
+}
 
 /* Switch data mode on for the particular client. */
 void server_data_on(int fd)
@@ -206,7 +405,10 @@ void server_data_on(int fd)
 	/* Mark this client as ,,sending data'' */
 	speechd_socket->awaiting_data = 1;
 	/* Create new output buffer */
-	speechd_socket->o_buf = g_string_new("");
+	if (speechd_socket->o_buf)
+		g_string_free(speechd_socket->o_buf, 1);
+	speechd_socket->o_bytes = 0;
+	speechd_socket->o_buf = g_string_sized_new(SOCKET_READ_SIZE);
 	MSG(4, "Switching to data mode...");
 	return;
 }
@@ -216,75 +418,481 @@ void server_data_off(int fd)
 {
 	TSpeechDSock *speechd_socket = speechd_socket_get_by_fd(fd);
 	assert(speechd_socket);
-	assert(speechd_socket->o_buf);
 	speechd_socket->o_bytes = 0;
-	g_string_free(speechd_socket->o_buf, 1);
+	/* The buffer may already have been handed over to a message */
+	if (speechd_socket->o_buf)
+		g_string_free(speechd_socket->o_buf, 1);
 	speechd_socket->o_buf = NULL;
 	return;
 }
 
-/* Serve the client on _fd_ if we got some activity. */
-int serve(int fd)
+/* Writing out of the client on _fd_ became possible again */
+static gboolean server_output_ready(gint fd, GIOCondition condition,
+				    gpointer user_data)
 {
-	char *reply;		/* Reply to the client */
-	int ret;
+	TSpeechDSock *speechd_socket;
+	gboolean again = FALSE, done = FALSE;
+	ssize_t ret;
 
-	{
-		size_t bytes = 0;	/* Number of bytes we got */
-		int buflen = BUF_SIZE;
-		char *buf = (char *)g_malloc(buflen + 1);
+	pthread_mutex_lock(&socket_com_mutex);
+	speechd_socket = speechd_socket_get_by_fd(fd);
+	if (speechd_socket == NULL) {
+		pthread_mutex_unlock(&socket_com_mutex);
+		return FALSE;
+	}
 
-		/* Read data from socket */
-		/* Read exactly one complete line, the `parse' routine relies on it */
-		{
-			while (1) {
-				int n = read(fd, buf + bytes, 1);
-				if (n <= 0) {
-					g_free(buf);
-					return -1;
-				}
-				/* Note, bytes is a 0-based index into buf. */
-				if ((buf[bytes] == '\n')
-				    && (bytes >= 1) && (buf[bytes - 1] == '\r')) {
-					buf[++bytes] = '\0';
+	ret = write(fd, speechd_socket->out->str, speechd_socket->out->len);
+	if (ret > 0) {
+		g_string_erase(speechd_socket->out, 0, ret);
+		pthread_cond_broadcast(&server_out_cond);
+	} else if (ret == -1 && errno != EAGAIN && errno != EINTR) {
+		MSG(5, "write() error: %s", strerror(errno));
+		/* It is going away, the main loop will notice */
+		g_string_truncate(speechd_socket->out, 0);
+		pthread_cond_broadcast(&server_out_cond);
+	}
+
+	if (speechd_socket->out->len > 0) {
+		again = TRUE;
+	} else {
+		speechd_socket->out_source = 0;
+		if (speechd_socket->out_dropped) {
+			MSG(3, "Client on fd %d reads again, %d events were "
+			    "dropped", fd, speechd_socket->out_dropped);
+			speechd_socket->out_dropped = 0;
+		}
+		/* It said BYE and now has everything */
+		done = speechd_socket->closing;
+	}
+	pthread_mutex_unlock(&socket_com_mutex);
+
+	if (done)
+		speechd_connection_destroy(fd);
+
+	return again;
+}
+
+/* Write the _iovcnt_ buffers of _iov_ for the client on _fd_ as far as it
+   takes them without blocking, and keep the rest in its output buffer for
+   the main loop.  Events (_droppable_) which would make the buffer go
+   beyond ClientOutputLimit are dropped instead.  Must be called with
+   socket_com_mutex held.  Returns -1 on a write error, 0 otherwise. */
+static int server_write(int fd, TSpeechDSock * speechd_socket,
+			struct iovec *iov, int iovcnt, int droppable)
+{
+	size_t total = 0;
+	ssize_t ret;
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		total += iov[i].iov_len;
+
+	/* Keep the order, nothing is written before what is already waiting */
+	if (speechd_socket->out->len > 0) {
+		if (droppable && speechd_socket->out->len + total >
+		    (size_t) SpeechdOptions.client_output_limit * 1024) {
+			if (speechd_socket->out_dropped++ == 0)
+				MSG(3, "Client on fd %d does not read, dropping "
+				    "its events", fd);
+			return 0;
+		}
+	} else {
+		while (iovcnt > 0) {
+			ret = writev(fd, iov, iovcnt);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN || errno == EWOULDBLOCK)
 					break;
-				}
-				if (buf[bytes] == '\0')
-					buf[bytes] = '?';
-				if ((++bytes) == buflen) {
-					buflen *= 2;
-					buf = g_realloc(buf, buflen + 1);
-				}
+				MSG(5, "writev() error: %s", strerror(errno));
+				return -1;
+			}
+			/* Skip what was written, it may be only part of it */
+			while (iovcnt > 0 && (size_t) ret >= iov->iov_len) {
+				ret -= iov->iov_len;
+				iov++;
+				iovcnt--;
 			}
+			if (iovcnt > 0) {
+				iov->iov_base = (char *)iov->iov_base + ret;
+				iov->iov_len -= ret;
+			}
+		}
+		if (iovcnt == 0)
+			return 0;
+	}
+
+	for (i = 0; i < iovcnt; i++)
+		g_string_append_len(speechd_socket->out, iov[i].iov_base,
+				    iov[i].iov_len);
+	if (!speechd_socket->out_source)
+		speechd_socket->out_source =
+		    g_unix_fd_add(fd, G_IO_OUT, server_output_ready, NULL);
+	return 0;
+}
+
+int server_send_event(int fd, const char *event)
+{
+	TSpeechDSock *speechd_socket;
+	struct iovec iov;
+	int ret = -1;
+
+	iov.iov_base = (char *)event;
+	iov.iov_len = strlen(event);
+
+	pthread_mutex_lock(&socket_com_mutex);
+	speechd_socket = speechd_socket_get_by_fd(fd);
+	if (speechd_socket != NULL)
+		ret = server_write(fd, speechd_socket, &iov, 1, 1);
+	pthread_mutex_unlock(&socket_com_mutex);
+
+	return ret;
+}
+
+int server_send_data(int fd, struct iovec *iov, int iovcnt)
+{
+	TSpeechDSock *speechd_socket;
+	gint64 deadline = g_get_monotonic_time() + SERVER_DATA_WAIT;
+	size_t limit = (size_t) SpeechdOptions.client_output_limit * 1024;
+	struct timespec ts;
+	int ret = -1;
+
+	pthread_mutex_lock(&socket_com_mutex);
+	/* The data can't be dropped without breaking its framing, so the
+	   caller is held back while the client does not read.  The client
+	   may go away meanwhile, it is looked up again each time. */
+	while ((speechd_socket = speechd_socket_get_by_fd(fd)) != NULL
+	       && speechd_socket->out->len >= limit
+	       && g_get_monotonic_time() < deadline) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100 * 1000 * 1000;
+		if (ts.tv_nsec >= 1000 * 1000 * 1000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000 * 1000 * 1000;
 		}
+		pthread_cond_timedwait(&server_out_cond, &socket_com_mutex,
+				       &ts);
+	}
+	if (speechd_socket != NULL) {
+		if (speechd_socket->out->len >= limit) {
+			MSG(3, "Client on fd %d does not read its data", fd);
+			ret = 1;
+		} else
+			ret = server_write(fd, speechd_socket, iov, iovcnt, 0);
+	}
+	pthread_mutex_unlock(&socket_com_mutex);
+
+	return ret;
+}
 
-		/* Parse the data and read the reply */
-		MSG2(5, "protocol", "%d:DATA:|%s| (%lu)", fd, buf, (unsigned long) bytes);
-		reply = parse(buf, bytes, fd);
-		g_free(buf);
+/* Write all the replies collected for the client on _fd_ with a single
+   writev(). Returns -1 on a write error, 0 otherwise. */
+int server_flush_replies(int fd)
+{
+	TSpeechDSock *speechd_socket = speechd_socket_get_by_fd(fd);
+	struct iovec replies[MAX_PENDING_REPLIES];
+	int ret;
+	int i;
+
+	assert(speechd_socket);
+	if (speechd_socket->n_replies == 0)
+		return 0;
+
+	for (i = 0; i < speechd_socket->n_replies; i++) {
+		replies[i].iov_base = speechd_socket->replies[i];
+		replies[i].iov_len = strlen(speechd_socket->replies[i]);
 	}
 
+	pthread_mutex_lock(&socket_com_mutex);
+	ret = server_write(fd, speechd_socket, replies,
+			   speechd_socket->n_replies, 0);
+	pthread_mutex_unlock(&socket_com_mutex);
+
+	for (i = 0; i < speechd_socket->n_replies; i++)
+		g_free(speechd_socket->replies[i]);
+	speechd_socket->n_replies = 0;
+
+	return ret;
+}
+
+/* Pass one complete line to parse() and return the reply to be sent to
+   the client, or NULL if there is nothing to send. _line_ must be
+   NUL-terminated and _bytes_ long including the final \r\n. */
+static char *serve_line(int fd, const char *line, size_t bytes)
+{
+	char *reply;		/* Reply to the client */
+
+	/* Parse the data and read the reply */
+	MSG2(5, "protocol", "%d:DATA:|%s| (%lu)", fd, line, (unsigned long) bytes);
+	capture_line(fd, line, bytes);
+	reply = parse(line, bytes, fd);
+
 	if (reply == NULL)
 		FATAL("Internal error, reply from parse() is NULL!");
 
-	/* Send the reply to the socket */
-	if (strlen(reply) == 0) {
+	/* Don't reply to data etc. */
+	if ((strlen(reply) == 0) || (reply[0] == '9')) {
 		g_free(reply);
-		return 0;
+		return NULL;
 	}
-	if (reply[0] != '9') {	/* Don't reply to data etc. */
-		pthread_mutex_lock(&socket_com_mutex);
-		MSG2(5, "protocol", "%d:REPLY:|%s|", fd, reply);
-		ret = write(fd, reply, strlen(reply));
-		g_free(reply);
-		pthread_mutex_unlock(&socket_com_mutex);
-		if (ret == -1) {
-			MSG(5, "write() error: %s", strerror(errno));
-			return -1;
+
+	MSG2(5, "protocol", "%d:REPLY:|%s|", fd, reply);
+	return reply;
+}
+
+/* Read the next chunk of data from _fd_ into the input buffer. Local
+   clients may pass file descriptors along for SPEAK_FD, these are kept in
+   the order they came, those beyond MAX_PASSED_FDS are closed. */
+static ssize_t server_receive(int fd, TSpeechDSock * speechd_socket)
+{
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * MAX_PASSED_FDS)];
+	} control;
+	struct iovec iov;
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	ssize_t n;
+
+	iov.iov_base = speechd_socket->i_buf + speechd_socket->i_bytes;
+	iov.iov_len = SOCKET_READ_SIZE;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (n < 0)
+		return n;
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		int *fds = (int *)CMSG_DATA(cmsg);
+		int nfds;
+		int i;
+
+		if (cmsg->cmsg_level != SOL_SOCKET
+		    || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < nfds; i++) {
+			if (speechd_socket->n_passed_fds < MAX_PASSED_FDS)
+				speechd_socket->passed_fds
+				    [speechd_socket->n_passed_fds++] = fds[i];
+			else {
+				MSG(4, "Too many file descriptors passed by "
+				    "client on fd %d", fd);
+				close(fds[i]);
+			}
 		}
-	} else {
-		g_free(reply);
 	}
+	if (msg.msg_flags & MSG_CTRUNC)
+		MSG(4, "File descriptors passed by client on fd %d were "
+		    "dropped", fd);
 
-	return 0;
+	return n;
+}
+
+/* Parse the complete lines in the input buffer of the client on _fd_,
+   looking for line ends from _scan_ on, and send the replies.  This stops
+   early when a command is deferred to a worker, the next lines are kept
+   in the buffer until its reply is sent. */
+static int serve_lines(int fd, TSpeechDSock * speechd_socket, char *scan)
+{
+	char *line;		/* Start of the line to be parsed */
+	char *end;
+	char *buf_end;
+	char *reply;
+	int ret = 0;
+
+	line = speechd_socket->i_buf;
+	buf_end = speechd_socket->i_buf + speechd_socket->i_bytes;
+	while (speechd_socket->job == NULL
+	       && (end = memchr(scan, '\n', buf_end - scan)) != NULL) {
+		scan = end + 1;
+		if (end == line || end[-1] != '\r')
+			continue;
+
+		{
+			/* Terminate the line in place for parse(), i_buf always
+			   has room for one more byte */
+			char saved = end[1];
+			end[1] = '\0';
+			reply = serve_line(fd, line, end + 1 - line);
+			/* The client may have closed the connection with BYE,
+			   in which case its buffer is gone, or only kept for
+			   writing out the rest of its output */
+			if (speechd_socket_get_by_fd(fd) != speechd_socket
+			    || speechd_socket->closing) {
+				g_free(reply);
+				return 0;
+			}
+			end[1] = saved;
+		}
+		line = end + 1;
+
+		if (reply == NULL)
+			continue;
+		speechd_socket->replies[speechd_socket->n_replies++] = reply;
+		/* Don't hold back the message id, events about the message
+		   may be sent to the client as soon as it is queued */
+		if ((speechd_socket->n_replies == MAX_PENDING_REPLIES)
+		    || !strncmp(reply, C_OK_MESSAGE_QUEUED,
+				strlen(C_OK_MESSAGE_QUEUED))) {
+			ret = server_flush_replies(fd);
+			if (ret == -1)
+				break;
+		}
+	}
+
+	/* Send all the replies to the commands we got at once */
+	if (server_flush_replies(fd) == -1)
+		ret = -1;
+
+	/* Keep the incomplete rest for the next time */
+	speechd_socket->i_bytes = buf_end - line;
+	if (line != speechd_socket->i_buf && speechd_socket->i_bytes > 0)
+		memmove(speechd_socket->i_buf, line, speechd_socket->i_bytes);
+
+	return ret;
+}
+
+/* Serve the client on _fd_ if we got some activity. */
+int serve(int fd)
+{
+	TSpeechDSock *speechd_socket = speechd_socket_get_by_fd(fd);
+	char *scan;		/* Where to look for the next line end */
+	ssize_t n;
+	size_t i;
+
+	assert(speechd_socket);
+
+	/* Make room for another chunk of data */
+	while (speechd_socket->i_size - speechd_socket->i_bytes <
+	       SOCKET_READ_SIZE) {
+		if (speechd_socket->i_size == 0)
+			speechd_socket->i_size = SOCKET_READ_SIZE;
+		else
+			speechd_socket->i_size *= 2;
+		speechd_socket->i_buf = g_realloc(speechd_socket->i_buf,
+						  speechd_socket->i_size + 1);
+	}
+
+	/* Read as much as is available, parse() will still get complete
+	   lines only, one at a time, so that several commands sent at once
+	   are all handled in this round */
+	n = server_receive(fd, speechd_socket);
+	if (n <= 0)
+		return -1;
+
+	scan = speechd_socket->i_buf + speechd_socket->i_bytes;
+	for (i = 0; i < n; i++)
+		if (scan[i] == '\0')
+			scan[i] = '?';
+	speechd_socket->i_bytes += n;
+
+	return serve_lines(fd, speechd_socket, scan);
+}
+
+/* Commands deferred to the workers */
+
+#define SERVER_WORKERS 4
+
+struct TServerJob {
+	int fd;
+	TSpeechDSock *socket;	/* NULL once the client is gone */
+	TServerJobFunc func;
+	gpointer data;
+	GDestroyNotify free_data;
+	char *reply;
+};
+
+static GThreadPool *server_workers = NULL;
+
+/* Back in the main loop: send the reply of the job and go on with the
+   commands of the client which came meanwhile */
+static gboolean server_job_done(gpointer user_data)
+{
+	struct TServerJob *job = user_data;
+	TSpeechDSock *speechd_socket = job->socket;
+	int fd = job->fd;
+
+	if (speechd_socket != NULL) {
+		speechd_socket->job = NULL;
+		if (job->reply != NULL && job->reply[0] != '\0') {
+			MSG2(5, "protocol", "%d:REPLY:|%s|", fd, job->reply);
+			speechd_socket->replies[speechd_socket->n_replies++] =
+			    job->reply;
+			job->reply = NULL;
+		}
+		if (serve_lines(fd, speechd_socket, speechd_socket->i_buf) == -1)
+			MSG(2, "Error: Failed to serve client on fd %d!", fd);
+		if (speechd_socket_get_by_fd(fd) == speechd_socket
+		    && speechd_socket->job == NULL)
+			speechd_connection_resume(fd);
+	}
+
+	g_free(job->reply);
+	g_free(job);
+	return FALSE;
+}
+
+static void server_job_work(gpointer data, gpointer user_data)
+{
+	struct TServerJob *job = data;
+
+	job->reply = job->func(job->data);
+	if (job->free_data)
+		job->free_data(job->data);
+	g_idle_add(server_job_done, job);
+}
+
+void server_defer(int fd, TServerJobFunc func, gpointer data,
+		  GDestroyNotify free_data)
+{
+	TSpeechDSock *speechd_socket = speechd_socket_get_by_fd(fd);
+	struct TServerJob *job;
+	GError *error = NULL;
+
+	assert(speechd_socket);
+	assert(speechd_socket->job == NULL);
+
+	job = g_new0(struct TServerJob, 1);
+	job->fd = fd;
+	job->socket = speechd_socket;
+	job->func = func;
+	job->data = data;
+	job->free_data = free_data;
+
+	/* Nothing more is read from the client until the reply is sent */
+	speechd_socket->job = job;
+	speechd_connection_suspend(fd);
+
+	if (!server_workers) {
+		server_workers = g_thread_pool_new(server_job_work, NULL,
+						   SERVER_WORKERS, FALSE,
+						   &error);
+		if (!server_workers) {
+			MSG(2, "Can't create server worker threads: %s",
+			    error->message);
+			g_error_free(error);
+			error = NULL;
+		}
+	}
+
+	if (!server_workers
+	    || !g_thread_pool_push(server_workers, job, &error)) {
+		if (error) {
+			MSG(2, "Can't queue server job: %s", error->message);
+			g_error_free(error);
+		}
+		/* Do it ourself, the reply is still sent from the main loop */
+		server_job_work(job, NULL);
+	}
+}
+
+void server_forget_job(struct TServerJob *job)
+{
+	job->socket = NULL;
 }
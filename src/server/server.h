@@ -26,12 +26,47 @@
 /* serve() reads data from clients and sends it to parse() */
 int serve(int fd);
 
+/* Send the replies collected by serve() so far */
+int server_flush_replies(int fd);
+/* Send an event to the client on fd, it is dropped rather than kept when
+   the client does not read and its output reached ClientOutputLimit */
+int server_send_event(int fd, const char *event);
+/* Send the iovcnt buffers of iov to the client on fd as one piece, after
+   what its output buffer still holds, e.g. a frame of audio.  While that
+   buffer is beyond ClientOutputLimit, it waits for the client to read,
+   for a short while: it returns 1 if the client did not, -1 on errors */
+struct iovec;
+int server_send_data(int fd, struct iovec *iov, int iovcnt);
+
+/* Commands which may block, e.g. on a module, are run by worker threads
+   rather than by the main loop: func(data) runs in a worker and returns
+   the reply to send to the client on fd, then free_data(data) is called
+   there too.  The next commands of the client wait for that reply. */
+struct TServerJob;
+typedef char *(*TServerJobFunc) (gpointer data);
+void server_defer(int fd, TServerJobFunc func, gpointer data,
+		  GDestroyNotify free_data);
+/* The client whose command job runs went away */
+void server_forget_job(struct TServerJob *job);
+
+/* Admission control of the messages of the client on fd: returns NULL
+   if one of bytes bytes may be queued, or the reply to refuse it with */
+char *server_admit_message(int fd, size_t bytes);
+
 /* Switches `receiving data' mode on and off for specified client */
 void server_data_on(int fd);
 void server_data_off(int fd);
 
+/* Id of the last message received */
+extern int last_message_id;
+
 /* Put a message into Dispatcher's queue */
 int queue_message(TSpeechDMessage * new, int fd, int history_flag,
 		  SPDMessageType type, int reparted);
+/* Put a paused message back into its queue, at its place by id and in
+   its block, so that it is said before the rest of its message */
+int requeue_message(TSpeechDMessage * msg);
+/* Same for a text message, which it may split, see SpeakSegmentLength */
+int queue_text_message(TSpeechDMessage * new, int fd);
 
 #endif
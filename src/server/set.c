@@ -25,6 +25,7 @@
 #endif
 
 #include <fnmatch.h>
+#include <unistd.h>
 
 #include "set.h"
 #include "alloc.h"
@@ -61,7 +62,113 @@ int set_priority_uid(int uid, SPDPriority priority)
 	return 0;
 }
 
-#define SET_SELF_ALL(type, param) \
+/*
+ * SET ... all is not applied to each client right away: the change is
+ * logged, and each client catches up with the changes logged since it last
+ * did when its settings get looked up from the main loop, see
+ * client_settings_catch_up().  This keeps SET all cheap with many clients,
+ * and leaves alone the strings the clients which don't speak meanwhile share
+ * with their queued messages.
+ */
+typedef int (*TSetAllFunc) (int uid, gpointer value);
+
+typedef struct {
+	TSetAllFunc func;
+	gpointer value;		/* an int, or an allocated string */
+	gboolean string;
+	int owner;		/* only for the clients of this user, see
+				   client_same_owner() */
+} TSetAllChange;
+
+/* The changes logged so far, the last set_all_log->len of them */
+static guint set_all_count;
+static GArray *set_all_log;
+
+/* Beyond that, all the clients get caught up and the log emptied */
+#define SET_ALL_LOG_MAX 64
+
+static void client_settings_catch_up(TFDSetElement * settings)
+{
+	guint first = set_all_count - (set_all_log ? set_all_log->len : 0);
+	guint i = settings->all_serial;
+
+	if (i == set_all_count)
+		return;
+	/* For the lookups the changes do themselves */
+	settings->all_serial = set_all_count;
+	/* Clients which are gone were not to get them */
+	if (!settings->active)
+		return;
+
+	assert(i >= first);
+	for (; i < set_all_count; i++) {
+		TSetAllChange *change =
+		    &g_array_index(set_all_log, TSetAllChange, i - first);
+
+		if (change->owner != settings->owner)
+			continue;
+		if (change->string) {
+			/* Some setters modify the string */
+			char *value = g_strdup(change->value);
+			change->func(settings->uid, value);
+			g_free(value);
+		} else
+			change->func(settings->uid, change->value);
+	}
+}
+
+static gboolean client_settings_may_catch_up(TFDSetElement * settings)
+{
+	/* The other threads only look at what SET all does not change */
+	return settings != NULL && settings->all_serial != set_all_count
+	    && g_main_context_is_owner(g_main_context_default());
+}
+
+static int set_all(int fd, TSetAllFunc func, gpointer value, gboolean string)
+{
+	TFDSetElement *settings;
+	TSetAllChange change;
+	int ret;
+
+	/* Check the value on the client itself, the others take the same */
+	settings = get_client_settings_by_fd(fd);
+	if (settings == NULL)
+		return 1;
+	ret = func(settings->uid, value);
+	if (ret != 0)
+		return ret;
+
+	if (set_all_log == NULL)
+		set_all_log = g_array_new(FALSE, FALSE, sizeof(TSetAllChange));
+	change.func = func;
+	change.value = string ? g_strdup(value) : value;
+	change.string = string;
+	change.owner = settings->owner;
+	g_array_append_val(set_all_log, change);
+	set_all_count++;
+	settings->all_serial = set_all_count;
+
+	if (set_all_log->len > SET_ALL_LOG_MAX) {
+		GHashTableIter clients;
+		gpointer client;
+		guint i;
+
+		g_hash_table_iter_init(&clients, fd_settings);
+		while (g_hash_table_iter_next(&clients, NULL, &client))
+			client_settings_catch_up(client);
+		for (i = 0; i < set_all_log->len; i++) {
+			TSetAllChange *old =
+			    &g_array_index(set_all_log, TSetAllChange, i);
+			if (old->string)
+				g_free(old->value);
+		}
+		g_array_set_size(set_all_log, 0);
+	}
+
+	return 0;
+}
+
+#define SET_SELF(type, param) \
 	int \
 	set_ ## param ## _self(int fd, type param) \
 	{ \
@@ -69,20 +176,34 @@ int set_priority_uid(int uid, SPDPriority priority)
 		uid = get_client_uid_by_fd(fd); \
 		if (uid == 0) return 1; \
 		return set_ ## param ## _uid(uid, param); \
+	}
+
+#define SET_SELF_ALL(type, param) \
+	SET_SELF(type, param) \
+	static int \
+	set_ ## param ## _all_func(int uid, gpointer value) \
+	{ \
+		return set_ ## param ## _uid(uid, (type) GPOINTER_TO_INT(value)); \
 	} \
 	int \
-	set_ ## param ## _all(type param) \
+	set_ ## param ## _all(int fd, type param) \
 	{ \
-		int i; \
-		int uid; \
-		int err = 0; \
-		for(i=1;i<=SpeechdStatus.max_fd;i++){ \
-			uid = get_client_uid_by_fd(i); \
-			if (uid == 0) continue; \
-			err += set_ ## param ## _uid(uid, param); \
-		} \
-		if (err > 0) return 1; \
-		return 0; \
+		return set_all(fd, set_ ## param ## _all_func, \
+			       GINT_TO_POINTER(param), FALSE); \
+	}
+
+#define SET_SELF_ALL_STR(type, param) \
+	SET_SELF(type, param) \
+	static int \
+	set_ ## param ## _all_func(int uid, gpointer value) \
+	{ \
+		return set_ ## param ## _uid(uid, value); \
+	} \
+	int \
+	set_ ## param ## _all(int fd, type param) \
+	{ \
+		return set_all(fd, set_ ## param ## _all_func, \
+			       (gpointer) param, TRUE); \
 	}
 
 SET_SELF_ALL(int, rate)
@@ -153,7 +274,7 @@ int set_volume_uid(int uid, int volume)
 	return 0;
 }
 
-SET_SELF_ALL(const char *, voice)
+SET_SELF_ALL_STR(const char *, voice)
 
 int set_voice_uid(int uid, const char *voice)
 {
@@ -185,6 +306,7 @@ int set_voice_uid(int uid, const char *voice)
 	if (settings->msg_settings.voice.name != NULL) {
 		g_free(settings->msg_settings.voice.name);
 		settings->msg_settings.voice.name = NULL;
+		spd_fdset_strings_changed(settings);
 	}
 	return 0;
 }
@@ -204,7 +326,8 @@ int set_punctuation_mode_uid(int uid, SPDPunctuation punctuation)
 }
 
 #define SET_PARAM_STR(name) \
-	settings->name = set_param_str(settings->name, name);
+	settings->name = set_param_str(settings->name, name); \
+	spd_fdset_strings_changed(settings);
 
 SET_SELF_ALL(SPDCapitalLetters, capital_letter_recognition)
 
@@ -236,7 +359,7 @@ int set_spelling_uid(int uid, SPDSpelling spelling)
 	return 0;
 }
 
-SET_SELF_ALL(char *, language)
+SET_SELF_ALL_STR(char *, language)
 
 int set_language_uid(int uid, char *language)
 {
@@ -249,6 +372,7 @@ int set_language_uid(int uid, char *language)
 
 	settings->msg_settings.voice.language =
 	    set_param_str(settings->msg_settings.voice.language, language);
+	spd_fdset_strings_changed(settings);
 
 	/* Check if it is not desired to change output module */
 	output_module = g_hash_table_lookup(language_default_modules, language);
@@ -270,7 +394,7 @@ int set_language_uid(int uid, char *language)
 	return 0;
 }
 
-SET_SELF_ALL(const char *, synthesis_voice)
+SET_SELF_ALL_STR(const char *, synthesis_voice)
 
 int set_synthesis_voice_uid(int uid, const char *synthesis_voice)
 {
@@ -282,6 +406,7 @@ int set_synthesis_voice_uid(int uid, const char *synthesis_voice)
 
 	settings->msg_settings.voice.name =
 	    set_param_str(settings->msg_settings.voice.name, synthesis_voice);
+	spd_fdset_strings_changed(settings);
 
 	/* Delete ordinary voice settings so that we don't mix */
 	settings->msg_settings.voice_type = -1;
@@ -296,6 +421,7 @@ int set_synthesis_voice_uid(int uid, const char *synthesis_voice)
 	if (cl_set->val.name != NULL){ \
 		g_free(set->name); \
 		set->name = g_strdup(cl_set->val.name); \
+		spd_fdset_strings_changed(set); \
 		MSG(4,"parameter " #name " set to %s", cl_set->val.name); \
 	}
 
@@ -322,6 +448,8 @@ void update_cl_settings(gpointer data, gpointer user_data)
 	    CHECK_SET_PAR(pause_context, -1)
 	    CHECK_SET_PAR(ssml_mode, -1)
 	    CHECK_SET_PAR(symbols_preprocessing, -1)
+	    CHECK_SET_PAR(coalescing, -1)
+	    CHECK_SET_PAR(index_mark_interval, -1)
 	    CHECK_SET_PAR_STR(msg_settings.voice.language)
 	    CHECK_SET_PAR_STR(output_module)
 
@@ -358,7 +486,7 @@ int set_client_name_self(int fd, const char *client_name)
 	return 0;
 }
 
-SET_SELF_ALL(const char *, output_module)
+SET_SELF_ALL_STR(const char *, output_module)
 
 int set_output_module_uid(int uid, const char *output_module)
 {
@@ -400,6 +528,48 @@ int set_pause_context_uid(int uid, int pause_context)
 	return 0;
 }
 
+SET_SELF_ALL(int, sound_icon_mixing)
+
+int set_sound_icon_mixing_uid(int uid, int sound_icon_mixing)
+{
+	TFDSetElement *settings;
+
+	settings = get_client_settings_by_uid(uid);
+	if (settings == NULL)
+		return 1;
+
+	settings->sound_icon_mixing = sound_icon_mixing;
+	return 0;
+}
+
+SET_SELF_ALL(int, coalescing)
+
+int set_coalescing_uid(int uid, int coalescing)
+{
+	TFDSetElement *settings;
+
+	settings = get_client_settings_by_uid(uid);
+	if (settings == NULL)
+		return 1;
+
+	settings->coalescing = coalescing;
+	return 0;
+}
+
+SET_SELF_ALL(int, index_mark_interval)
+
+int set_index_mark_interval_uid(int uid, int index_mark_interval)
+{
+	TFDSetElement *settings;
+
+	settings = get_client_settings_by_uid(uid);
+	if (settings == NULL)
+		return 1;
+
+	settings->index_mark_interval = index_mark_interval;
+	return 0;
+}
+
 SET_SELF_ALL(SPDDataMode, ssml_mode)
 
 int set_ssml_mode_uid(int uid, SPDDataMode ssml_mode)
@@ -428,12 +598,36 @@ int set_symbols_preprocessing_uid(int uid, gboolean symbols_preprocessing)
 	return 0;
 }
 
-SET_SELF_ALL(int, debug)
+SET_SELF(int, debug)
+
+/* Not a setting of the clients */
+int set_debug_all(int fd, int debug)
+{
+	return set_debug_uid(get_client_uid_by_fd(fd), debug);
+}
+
+/* The log gets what all the users say, so in MultiUser mode only the user
+   running the server may switch it */
+static gboolean debug_allowed(int uid)
+{
+	TFDSetElement *settings;
+
+	if (!SpeechdOptions.multi_user)
+		return TRUE;
+	settings = get_client_settings_by_uid(uid);
+	return settings != NULL && settings->owner == (int)geteuid();
+}
 
 int set_debug_uid(int uid, int debug)
 {
 	char *debug_logfile_path;
 
+	if (!debug_allowed(uid)) {
+		MSG(3, "Refusing to switch debugging for client %d of "
+		    "another user", uid);
+		return 1;
+	}
+
 	/* Do not switch debugging on when already on
 	   and vice-versa */
 	if (SpeechdOptions.debug && debug)
@@ -461,9 +655,13 @@ int set_debug_uid(int uid, int debug)
 		/* Redirecting debugging for all output modules */
 		speechd_modules_debug();
 	} else {
+		logging_flush();
 		SpeechdOptions.debug = 0;
 		speechd_modules_nodebug();
+		/* The log writer may be writing to it */
+		pthread_mutex_lock(&logging_mutex);
 		fclose(debug_logfile);
+		pthread_mutex_unlock(&logging_mutex);
 	}
 	return 0;
 }
@@ -474,6 +672,19 @@ int set_debug_uid(int uid, int debug)
 	else \
 		settings->notification = settings->notification & (~ SPD_ ## state);
 
+/* Only for self, the audio goes to the client connection which asked */
+int set_audio_retrieval_self(int fd, int audio_retrieval)
+{
+	TFDSetElement *settings;
+
+	settings = get_client_settings_by_fd(fd);
+	if (settings == NULL)
+		return 1;
+
+	settings->audio_retrieval = audio_retrieval;
+	return 0;
+}
+
 int set_notification_self(int fd, const char *type, int val)
 {
 	TFDSetElement *settings;
@@ -499,6 +710,8 @@ int set_notification_self(int fd, const char *type, int val)
 		SET_NOTIFICATION_STATE(RESUME);
 	} else if (!strcmp(type, "cancel")) {
 		SET_NOTIFICATION_STATE(CANCEL);
+	} else if (!strcmp(type, "voices_changed")) {
+		SET_NOTIFICATION_STATE(VOICES_CHANGED);
 	} else if (!strcmp(type, "all")) {
 		SET_NOTIFICATION_STATE(END);
 		SET_NOTIFICATION_STATE(BEGIN);
@@ -551,6 +764,10 @@ TFDSetElement *default_fd_set(void)
 	    GlobalFDSet.msg_settings.cap_let_recogn;
 
 	new->pause_context = GlobalFDSet.pause_context;
+	new->sound_icon_mixing = GlobalFDSet.sound_icon_mixing;
+	new->audio_retrieval = GlobalFDSet.audio_retrieval;
+	new->coalescing = GlobalFDSet.coalescing;
+	new->index_mark_interval = GlobalFDSet.index_mark_interval;
 	new->ssml_mode = GlobalFDSet.ssml_mode;
 	new->symbols_preprocessing = GlobalFDSet.symbols_preprocessing;
 	new->notification = GlobalFDSet.notification;
@@ -561,6 +778,10 @@ TFDSetElement *default_fd_set(void)
 	new->hist_sorted = 0;
 	new->index_mark = NULL;
 	new->paused_while_speaking = 0;
+	new->strings = NULL;
+	/* It only gets the SET all issued from now on */
+	new->all_serial = set_all_count;
+	new->owner = -1;
 
 	return (new);
 }
@@ -586,6 +807,8 @@ TFDSetElement *get_client_settings_by_fd(int fd)
 		return NULL;
 
 	settings = g_hash_table_lookup(fd_settings, &uid);
+	if (client_settings_may_catch_up(settings))
+		client_settings_catch_up(settings);
 	return settings;
 }
 
@@ -597,9 +820,47 @@ TFDSetElement *get_client_settings_by_uid(int uid)
 		return NULL;
 
 	element = g_hash_table_lookup(fd_settings, &uid);
+	if (client_settings_may_catch_up(element))
+		client_settings_catch_up(element);
 	return element;
 }
 
+/*
+ * In MultiUser mode, the clients of a user only get to act on each other,
+ * "all" being all of them.  Clients whose user is not known, e.g. over
+ * inet_socket, are together.
+ */
+gboolean client_same_owner(int fd, int uid)
+{
+	TFDSetElement *self, *other;
+
+	if (!SpeechdOptions.multi_user)
+		return TRUE;
+	self = get_client_settings_by_fd(fd);
+	other = get_client_settings_by_uid(uid);
+	return self != NULL && other != NULL && self->owner == other->owner;
+}
+
+GList *get_client_uids_of_owner(int fd)
+{
+	TFDSetElement *self = get_client_settings_by_fd(fd);
+	GHashTableIter iter;
+	gpointer uid;
+	GList *uids = NULL;
+
+	if (self == NULL)
+		return NULL;
+	g_hash_table_iter_init(&iter, fd_uid);
+	while (g_hash_table_iter_next(&iter, NULL, &uid)) {
+		TFDSetElement *other = get_client_settings_by_uid(*(int *)uid);
+
+		if (other != NULL && other->owner == self->owner)
+			uids = g_list_prepend(uids, GINT_TO_POINTER(*(int *)uid));
+	}
+
+	return uids;
+}
+
 void remove_client_settings_by_uid(int uid)
 {
 	TFDSetElement *element;
@@ -30,6 +30,8 @@ TFDSetElement *get_client_settings_by_uid(int uid);
 TFDSetElement *get_client_settings_by_fd(int fd);
 void remove_client_settings_by_uid(int uid);
 int get_client_uid_by_fd(int fd);
+gboolean client_same_owner(int fd, int uid);
+GList *get_client_uids_of_owner(int fd);
 
 int set_priority_uid(int uid, SPDPriority priority);
 int set_language_uid(int uid, char *language);
@@ -49,6 +51,9 @@ int set_output_module_uid(int uid, const char *output_module);
 int set_ssml_mode_uid(int uid, SPDDataMode ssml_mode);
 int set_symbols_preprocessing_uid(int uid, gboolean symbols_preprocessing);
 int set_pause_context_uid(int uid, int pause_context);
+int set_sound_icon_mixing_uid(int uid, int sound_icon_mixing);
+int set_coalescing_uid(int uid, int coalescing);
+int set_index_mark_interval_uid(int uid, int index_mark_interval);
 int set_debug_uid(int uid, int debug);
 int set_debug_destination_uid(int uid, const char *debug_destination);
 
@@ -70,29 +75,36 @@ int set_capital_letter_recognition_self(int fd, SPDCapitalLetters recogn);
 int set_ssml_mode_self(int fd, SPDDataMode ssml_mode);
 int set_symbols_preprocessing_self(int fd, gboolean symbols_preprocessing);
 int set_notification_self(int fd, const char *type, int val);
+int set_audio_retrieval_self(int fd, int audio_retrieval);
 int set_pause_context_self(int fd, int pause_context);
+int set_sound_icon_mixing_self(int fd, int sound_icon_mixing);
+int set_coalescing_self(int fd, int coalescing);
+int set_index_mark_interval_self(int fd, int index_mark_interval);
 int set_debug_self(int fd, int debug);
 int set_debug_destination_self(int fd, const char *debug_destination);
 
-int set_priority_all(SPDPriority priority);
-int set_language_all(char *language);
-int set_rate_all(int rate);
-int set_pitch_all(int pitch);
-int set_pitch_range_all(int pitch_range);
-int set_volume_all(int volume);
-int set_punct_mode_all(int punct);
-int set_cap_let_recog_all(int recog);
-int set_spelling_all(SPDSpelling spelling);
-int set_output_module_all(const char *output_module);
-int set_voice_all(const char *voice);
-int set_synthesis_voice_all(const char *synthesis_voice);
-int set_punctuation_mode_all(SPDPunctuation punctuation);
-int set_capital_letter_recognition_all(SPDCapitalLetters recogn);
-int set_ssml_mode_all(SPDDataMode ssml_mode);
-int set_symbols_preprocessing_all(gboolean symbols_preprocessing);
-int set_pause_context_all(int pause_context);
-int set_debug_all(int debug);
-int set_debug_destination_all(const char *debug_destination);
+int set_priority_all(int fd, SPDPriority priority);
+int set_language_all(int fd, char *language);
+int set_rate_all(int fd, int rate);
+int set_pitch_all(int fd, int pitch);
+int set_pitch_range_all(int fd, int pitch_range);
+int set_volume_all(int fd, int volume);
+int set_punct_mode_all(int fd, int punct);
+int set_cap_let_recog_all(int fd, int recog);
+int set_spelling_all(int fd, SPDSpelling spelling);
+int set_output_module_all(int fd, const char *output_module);
+int set_voice_all(int fd, const char *voice);
+int set_synthesis_voice_all(int fd, const char *synthesis_voice);
+int set_punctuation_mode_all(int fd, SPDPunctuation punctuation);
+int set_capital_letter_recognition_all(int fd, SPDCapitalLetters recogn);
+int set_ssml_mode_all(int fd, SPDDataMode ssml_mode);
+int set_symbols_preprocessing_all(int fd, gboolean symbols_preprocessing);
+int set_pause_context_all(int fd, int pause_context);
+int set_sound_icon_mixing_all(int fd, int sound_icon_mixing);
+int set_coalescing_all(int fd, int coalescing);
+int set_index_mark_interval_all(int fd, int index_mark_interval);
+int set_debug_all(int fd, int debug);
+int set_debug_destination_all(int fd, const char *debug_destination);
 
 TFDSetElement *default_fd_set(void);
 
@@ -39,6 +39,7 @@
 #include "output.h"
 #include "speaking.h"
 #include "sem_functions.h"
+#include "metrics.h"
 
 TSpeechDMessage *current_message = NULL;
 static SPDPriority highest_priority = 0;
@@ -47,16 +48,237 @@ int SPEAKING = 0;
 int poll_count;
 
 OutputModule *speaking_module;
+/* Modules replaced by reload_output_module() while they were speaking, the
+   speaking thread destroys them once it is done with them.  Under
+   element_free_mutex. */
+static GList *retired_modules;
 AudioID *module_audio_id;
 int speaking_uid;
 int speaking_gid;
 
 /* Pause and resume handling */
-int pause_requested;
-int pause_requested_fd;
-int pause_requested_uid;
+typedef struct {
+	int fd;			/* client which asked */
+	int uid;		/* client to pause */
+} TPauseRequest;
+static GQueue pause_requests = G_QUEUE_INIT;
+static pthread_mutex_t pause_requests_mutex = PTHREAD_MUTEX_INITIALIZER;
 int resume_requested;
 
+void speaking_request_pause(int fd, int uid)
+{
+	TPauseRequest *request = g_new(TPauseRequest, 1);
+
+	request->fd = fd;
+	request->uid = uid;
+	pthread_mutex_lock(&pause_requests_mutex);
+	g_queue_push_tail(&pause_requests, request);
+	pthread_mutex_unlock(&pause_requests_mutex);
+	speaking_semaphore_post();
+}
+
+/* Carry out the pause requests made since the last pass, in order,
+   returns whether there were any */
+static gboolean speaking_handle_pause_requests(void)
+{
+	GQueue requests = G_QUEUE_INIT;
+	TPauseRequest *request;
+
+	pthread_mutex_lock(&pause_requests_mutex);
+	requests = pause_requests;
+	g_queue_init(&pause_requests);
+	pthread_mutex_unlock(&pause_requests_mutex);
+
+	if (g_queue_is_empty(&requests))
+		return FALSE;
+
+	while ((request = g_queue_pop_head(&requests)) != NULL) {
+		MSG(4, "Trying to pause...");
+		speaking_pause(request->fd, request->uid);
+		MSG(4, "Paused...");
+		g_free(request);
+	}
+	return TRUE;
+}
+
+/* The wakeups coalesce, so a pass which took a message without speaking it
+   has to wake the next one up for the others, with element_free_mutex
+   held */
+static void speaking_repost_pending(void)
+{
+	if (!g_queue_is_empty(MessageQueue->p1)
+	    || !g_queue_is_empty(MessageQueue->p2)
+	    || !g_queue_is_empty(MessageQueue->p3)
+	    || !g_queue_is_empty(MessageQueue->p4)
+	    || !g_queue_is_empty(MessageQueue->p5))
+		speaking_semaphore_post();
+}
+
+int speaking_retire_module(OutputModule * module)
+{
+	check_locked(&element_free_mutex);
+	if (module != speaking_module)
+		return 0;
+	retired_modules = g_list_prepend(retired_modules, module);
+	return 1;
+}
+
+/* Destroy the retired modules which are not spoken with any more */
+static void speaking_destroy_retired(void)
+{
+	GList *gl, *next, *done = NULL;
+
+	pthread_mutex_lock(&element_free_mutex);
+	for (gl = retired_modules; gl != NULL; gl = next) {
+		next = gl->next;
+		if (gl->data == speaking_module)
+			continue;
+		retired_modules = g_list_remove_link(retired_modules, gl);
+		done = g_list_concat(gl, done);
+	}
+	pthread_mutex_unlock(&element_free_mutex);
+
+	for (gl = done; gl != NULL; gl = gl->next) {
+		MSG(4, "Destroying module %s, replaced while speaking",
+		    ((OutputModule *) gl->data)->name);
+		destroy_module(gl->data);
+	}
+	g_list_free(done);
+}
+
+/* Prepare the text of message for output, returns -1 if it can't be spoken */
+static int speaking_prepare_message(TSpeechDMessage * message,
+				    OutputModule * output)
+{
+	int punct_missing = 0;
+	SsmlText *ssml = NULL;
+
+	if (strcmp(output->name, "flite") == 0 ||
+	    strcmp(output->name, "dtk-generic") == 0 ||
+	    strcmp(output->name, "epos-generic") == 0 ||
+	    strcmp(output->name, "llia_phon-generic") == 0 ||
+	    strcmp(output->name, "mary-generic") == 0 ||
+	    strcmp(output->name, "swift-generic") == 0 ||
+	    strcmp(output->name, "pico") == 0)
+		/* These don't support punctuation */
+		/* FIXME: rather make them express it */
+		punct_missing = 1;
+
+	if (message->settings.type == SPD_MSGTYPE_CHAR
+	    && (guchar) message->buf[0] < 0x80 && message->buf[1] == '\0') {
+		/* Typing echo, ASCII is left as it is by the normalization */
+		insert_symbols(message, punct_missing, NULL);
+	} else if (message->settings.type == SPD_MSGTYPE_TEXT ||
+	    message->settings.type == SPD_MSGTYPE_CHAR) {
+		gchar *normalized = g_utf8_normalize(message->buf, -1,
+				G_NORMALIZE_ALL_COMPOSE);
+		if (!normalized) {
+			MSG(2, "Error: Not UTF-8 valid");
+			return -1;
+		}
+		if (strcmp(message->buf, normalized)) {
+			MSG(5, "text: Normalized '%s' to '%s'", message->buf, normalized);
+		}
+		g_free(message->buf);
+		message->buf = normalized;
+		insert_symbols(message, punct_missing, &ssml);
+	}
+
+	/* Insert index marks into textual messages, reusing the SSML parsed
+	   for the symbols if we have it */
+	if (message->settings.type == SPD_MSGTYPE_TEXT) {
+		if (ssml != NULL)
+			insert_index_marks_ssml(message, ssml);
+		else
+			insert_index_marks(message,
+					   message->settings.ssml_mode);
+	}
+	ssml_text_free(ssml);
+
+	return 0;
+}
+
+/* msg, an important message, was just queued and stopped what is being
+   spoken: while the module stops, prepare it and have its settings sent, so
+   that it can be spoken as soon as the module is done */
+void speaking_preempt(TSpeechDMessage * msg)
+{
+	OutputModule *output = speaking_module;
+	const char *name;
+
+	check_locked(&element_free_mutex);
+	/* It waits for the current important message otherwise */
+	if (!SPEAKING || output == NULL || highest_priority == SPD_IMPORTANT)
+		return;
+
+	/* Don't start another module from here, only reuse this one */
+	name = msg->settings.output_module ? msg->settings.output_module
+	    : GlobalFDSet.output_module;
+	if (g_strcmp0(name, output->name))
+		return;
+
+	if (speaking_prepare_message(msg, output) != 0)
+		return;
+	msg->bytes = strlen(msg->buf);
+	msg->prepared = 1;
+
+	output_preempt(msg, output);
+}
+
+/* The message get_message_from_queues() would return next, if it has the
+   priority of the message being spoken */
+static TSpeechDMessage *speaking_peek_message(void)
+{
+	SPDPriority prio;
+	GList *gl;
+
+	check_locked(&element_free_mutex);
+	for (prio = SPD_IMPORTANT; prio <= SPD_PROGRESS; prio++) {
+		gl = g_queue_peek_head_link(speaking_get_queue(prio));
+		for (; gl != NULL; gl = g_list_next(gl)) {
+			if (message_nto_speak(gl->data, NULL))
+				continue;
+			return prio == highest_priority ? gl->data : NULL;
+		}
+	}
+
+	return NULL;
+}
+
+/* Once the speaking module is done synthesizing, have it synthesize the
+   next message while the current one is still being played */
+static void speaking_look_ahead(void)
+{
+	TSpeechDMessage *message, *ahead;
+	OutputModule *output = speaking_module;
+
+	if (!output_lookahead_ready(output))
+		return;
+
+	pthread_mutex_lock(&element_free_mutex);
+	message = speaking_peek_message();
+	if (message == NULL || !g_queue_is_empty(last_p5_block)
+	    || message->settings.audio_retrieval || message->prepared
+	    || get_output_module(message) != output) {
+		pthread_mutex_unlock(&element_free_mutex);
+		return;
+	}
+
+	/* The message itself is only prepared once it gets spoken, and the
+	   queue is not held while talking to the module.  The module is kept
+	   from being destroyed meanwhile. */
+	ahead = spd_message_copy(message);
+	output_modules_use_begin();
+	pthread_mutex_unlock(&element_free_mutex);
+
+	if (speaking_prepare_message(ahead, output) == 0) {
+		MSG(5, "Synthesizing message %u ahead", ahead->id);
+		output_lookahead(ahead, output);
+	} else
+		mem_free_message(ahead);
+	output_modules_use_end();
+}
+
 /*
   Speak() is responsible for getting right text from right
   queue in right time and saying it loud through the corresponding
@@ -92,14 +314,9 @@ void *speak(void *data)
 		    poll_fds[0].revents, poll_fds[1].revents);
 		if ((revents = poll_fds[0].revents)) {
 			if (revents & POLLIN) {
-				char buf[1];
 				MSG(5,
 				    "wait_for_poll: activity in Speech Dispatcher");
-				const ssize_t rd_bytes =
-				    safe_read(poll_fds[0].fd, buf, 1);
-				if (rd_bytes != 1)
-					FATAL
-					    ("read from polled fd: could not read 1 byte");
+				speaking_semaphore_clear();
 			}
 		}
 		if (poll_count > 1) {
@@ -119,34 +336,37 @@ void *speak(void *data)
 				}
 			}
 		}
+		if (retired_modules != NULL)
+			speaking_destroy_retired();
 
 		/* Handle pause requests */
-		if (pause_requested) {
-			MSG(4, "Trying to pause...");
-			if (pause_requested == 1)
-				speaking_pause_all(pause_requested_fd);
-			if (pause_requested == 2)
-				speaking_pause(pause_requested_fd,
-					       pause_requested_uid);
-			MSG(4, "Paused...");
-			pause_requested = 0;
+		if (speaking_handle_pause_requests()) {
+			pthread_mutex_lock(&element_free_mutex);
+			speaking_repost_pending();
+			pthread_mutex_unlock(&element_free_mutex);
 			continue;
 		}
 
 		if (SPEAKING) {
 			MSG(5,
 			    "Continuing because already speaking in speak()");
+			speaking_look_ahead();
 			continue;
 		}
 
 		/* Handle resume requests */
-		if (resume_requested) {
+		if (g_atomic_int_get(&resume_requested)) {
 			GList *gl;
 
 			MSG(5, "Resume requested");
 
+			/* Put messages set aside for paused clients back */
+			pthread_mutex_lock(&element_free_mutex);
+			speaking_unpark_messages();
+			pthread_mutex_unlock(&element_free_mutex);
+
 			/* Is there any message after resume? */
-			if (g_list_length(MessagePausedList) != 0) {
+			if (MessagePausedList != NULL) {
 				while (1) {
 					pthread_mutex_lock(&element_free_mutex);
 					gl = g_list_find_custom
@@ -175,28 +395,18 @@ void *speak(void *data)
 				}
 			}
 			MSG(5, "End of resume processing");
-			resume_requested = 0;
+			g_atomic_int_set(&resume_requested, 0);
 		}
 
 		MSG(5, "Locking element_free_mutex in speak()");
 		pthread_mutex_lock(&element_free_mutex);
 		/* Handle postponed priority progress message */
 		check_locked(&element_free_mutex);
-		if ((g_list_length(last_p5_block) != 0)
-		    && (g_list_length(MessageQueue->p5) == 0)) {
+		if (!g_queue_is_empty(last_p5_block)
+		    && g_queue_is_empty(MessageQueue->p5)) {
 			/* Transfer messages from last_p5_block to priority 2 (message) queue */
-			while (g_list_length(last_p5_block) != 0) {
-				GList *item;
-				item = g_list_first(last_p5_block);
-				message = item->data;
-				check_locked(&element_free_mutex);
-				MessageQueue->p2 =
-				    g_list_insert_sorted(MessageQueue->p2,
-							 message, sortbyuid);
-				last_p5_block =
-				    g_list_remove_link(last_p5_block, item);
-				g_list_free1(item);
-			}
+			message = g_queue_peek_tail(last_p5_block);
+			queue_merge_by_id(MessageQueue->p2, last_p5_block);
 			assert(message != NULL);
 			highest_priority = SPD_MESSAGE;
 			stop_priority_older_than(SPD_TEXT, message->id);
@@ -214,6 +424,7 @@ void *speak(void *data)
 				MSG(5, "No message in the queue");
 				continue;
 			}
+			latency_mark(&message->latency, LATENCY_DEQUEUED);
 		}
 
 		/* Isn't the parent client of this message paused?
@@ -222,6 +433,7 @@ void *speak(void *data)
 			MSG(4, "Inserting message to paused list...");
 			MessagePausedList =
 			    g_list_append(MessagePausedList, message);
+			speaking_repost_pending();
 			pthread_mutex_unlock(&element_free_mutex);
 			continue;
 		}
@@ -231,52 +443,29 @@ void *speak(void *data)
 		if (output == NULL) {
 			MSG(3, "Output module doesn't work...");
 			output_check_module(output);
+			speaking_repost_pending();
 			pthread_mutex_unlock(&element_free_mutex);
 			continue;
 		}
 
-		int punct_missing = 0;
-		if (strcmp(output->name, "flite") == 0 ||
-		    strcmp(output->name, "dtk-generic") == 0 ||
-		    strcmp(output->name, "epos-generic") == 0 ||
-		    strcmp(output->name, "llia_phon-generic") == 0 ||
-		    strcmp(output->name, "mary-generic") == 0 ||
-		    strcmp(output->name, "swift-generic") == 0 ||
-		    strcmp(output->name, "pico") == 0)
-			/* These don't support punctuation */
-			/* FIXME: rather make them express it */
-			punct_missing = 1;
-
-		if (message->settings.type == SPD_MSGTYPE_TEXT ||
-		    message->settings.type == SPD_MSGTYPE_CHAR) {
-			gchar *normalized = g_utf8_normalize(message->buf, -1,
-					G_NORMALIZE_ALL_COMPOSE);
-			if (!normalized) {
-				MSG(2, "Error: Not UTF-8 valid");
+		/* Write the message to the output layer, unless it was
+		   synthesized ahead already. */
+		ret = output_speak_lookahead(message, output);
+		if (ret == 1) {
+			if (!message->prepared
+			    && speaking_prepare_message(message, output) != 0) {
+				speaking_repost_pending();
 				pthread_mutex_unlock(&element_free_mutex);
 				continue;
 			}
-			if (strcmp(message->buf, normalized)) {
-				MSG(5, "text: Normalized '%s' to '%s'", message->buf, normalized);
-			}
-			g_free(message->buf);
-			message->buf = normalized;
-			insert_symbols(message, punct_missing);
-		}
-
-		/* Insert index marks into textual messages */
-		if (message->settings.type == SPD_MSGTYPE_TEXT) {
-			insert_index_marks(message,
-					   message->settings.ssml_mode);
+			ret = output_speak(message, output);
 		}
 
-		/* Write the message to the output layer. */
-		ret = output_speak(message, output);
-
 		MSG(4, "Message sent to output module");
 		if (ret == -1) {
 			MSG(2, "Error: Output module failed");
 			output_check_module(output);
+			speaking_repost_pending();
 			pthread_mutex_unlock(&element_free_mutex);
 			continue;
 		}
@@ -284,6 +473,7 @@ void *speak(void *data)
 			MSG(2,
 			    "ERROR: Can't say message. Module reported error in speaking: %d",
 			    ret);
+			speaking_repost_pending();
 			pthread_mutex_unlock(&element_free_mutex);
 			continue;
 		}
@@ -328,20 +518,14 @@ void *speak(void *data)
 		current_message = message;
 
 		/* Check if the last priority 5 message wasn't said yet */
-		if (last_p5_block != NULL) {
-			GList *elem;
+		if (!g_queue_is_empty(last_p5_block)) {
 			TSpeechDMessage *p5_message;
-			elem = g_list_last(last_p5_block);
-			if (elem != NULL) {
-				p5_message = (TSpeechDMessage *) elem->data;
-				if (p5_message->settings.reparted ==
-				    message->settings.reparted) {
-					g_list_foreach(last_p5_block,
-						       (GFunc) mem_free_message,
-						       NULL);
-					g_list_free(last_p5_block);
-					last_p5_block = NULL;
-				}
+			p5_message = g_queue_peek_tail(last_p5_block);
+			if (p5_message->settings.reparted ==
+			    message->settings.reparted) {
+				g_queue_foreach(last_p5_block,
+						(GFunc) mem_free_message, NULL);
+				g_queue_clear(last_p5_block);
 			}
 		}
 
@@ -353,7 +537,6 @@ int reload_message(TSpeechDMessage * msg)
 {
 	TFDSetElement *client_settings;
 	int im;
-	char *pos;
 	char *newtext;
 	char *tptr;
 
@@ -379,30 +562,26 @@ int reload_message(TSpeechDMessage * msg)
 		}
 		MSG(5, "Recovered index mark number: %d", im);
 
-		im += client_settings->pause_context;
+		/* Go back by pause_context sentences */
+		im -= client_settings->pause_context;
 
 		MSG2(5, "index_marking",
-		     "Requested index mark (with context) is %d (%s+%d)", im,
+		     "Requested index mark (with context) is %d (%s-%d)", im,
 		     msg->settings.index_mark, client_settings->pause_context);
-		if (im < 0) {
-			im = 0;
-			pos = msg->buf;
-		} else {
-			pos = find_index_mark(msg, im);
-			if (pos == NULL)
-				return -1;
-		}
-
-		newtext = strip_index_marks(pos, client_settings->ssml_mode);
-		g_free(msg->buf);
+		if (im < 0)
+			/* There isn't enough text before, repeat it all */
+			im = -1;
 
+		newtext = strip_index_marks_after(msg, im,
+						  client_settings->ssml_mode);
 		if (newtext == NULL)
 			return -1;
+		g_free(msg->buf);
+		forget_index_marks(msg);
 		msg->buf = newtext;
 		msg->bytes = strlen(msg->buf);
 
-		if (queue_message
-		    (msg, -msg->settings.uid, 0, SPD_MSGTYPE_TEXT, 0) == 0) {
+		if (requeue_message(msg) == 0) {
 			if (SPEECHD_DEBUG)
 				FATAL("Can't queue message\n");
 			g_free(msg->buf);
@@ -414,8 +593,7 @@ int reload_message(TSpeechDMessage * msg)
 	} else {
 		MSG(5, "Index mark unknown, inserting the whole message.");
 
-		if (queue_message
-		    (msg, -msg->settings.uid, 0, SPD_MSGTYPE_TEXT, 0) == 0) {
+		if (requeue_message(msg) == 0) {
 			if (SPEECHD_DEBUG)
 				FATAL("Can't queue message\n");
 			g_free(msg->buf);
@@ -431,8 +609,7 @@ int reload_message(TSpeechDMessage * msg)
 void speaking_stop(int uid)
 {
 	TSpeechDMessage *msg;
-	GList *gl;
-	GList *queue;
+	GQueue *queue;
 	signed int gid = -1;
 
 	/* Only act if the currently speaking client is the specified one */
@@ -440,44 +617,27 @@ void speaking_stop(int uid)
 		output_stop();
 
 		/* Get the queue where the message being spoken came from */
-		queue = speaking_get_queue(highest_priority);
-		if (queue == NULL)
+		if (highest_priority == 0)
 			return;
+		queue = speaking_get_queue(highest_priority);
 
 		/* Get group ID of the current message */
-		gl = g_list_last(queue);
-		if (gl == NULL)
-			return;
-		if (gl->data == NULL)
+		msg = g_queue_peek_tail(queue);
+		if (msg == NULL)
 			return;
 
-		msg = (TSpeechDMessage *) gl->data;
 		if ((msg->settings.reparted != 0) && (msg->settings.uid == uid)) {
 			gid = msg->settings.reparted;
 		} else {
 			return;
 		}
 
-		while (1) {
-			gl = g_list_last(queue);
-			if (gl == NULL) {
-				speaking_set_queue(highest_priority, queue);
-				return;
-			}
-			if (gl->data == NULL)
+		while ((msg = g_queue_peek_tail(queue)) != NULL) {
+			if ((msg->settings.reparted != gid)
+			    || (msg->settings.uid != uid))
 				return;
-
-			msg = (TSpeechDMessage *) gl->data;
-
-			if ((msg->settings.reparted == gid)
-			    && (msg->settings.uid == uid)) {
-				queue = g_list_remove_link(queue, gl);
-				assert(gl->data != NULL);
-				mem_free_message(gl->data);
-			} else {
-				speaking_set_queue(highest_priority, queue);
-				return;
-			}
+			queue_unlink_message(msg);
+			mem_free_message(msg);
 		}
 	}
 }
@@ -485,43 +645,27 @@ void speaking_stop(int uid)
 void speaking_stop_all()
 {
 	TSpeechDMessage *msg;
-	GList *gl;
-	GList *queue;
+	GQueue *queue;
 
 	output_stop();
 
-	queue = speaking_get_queue(highest_priority);
-	if (queue == NULL)
+	if (highest_priority == 0)
 		return;
+	queue = speaking_get_queue(highest_priority);
 
-	gl = g_list_last(queue);
-	if (gl == NULL)
+	msg = g_queue_peek_tail(queue);
+	if (msg == NULL)
 		return;
-	assert(gl->data != NULL);
-	msg = (TSpeechDMessage *) gl->data;
 
 	if (msg->settings.reparted == 0) {
 		return;
 	}
 
-	while (1) {
-		gl = g_list_last(queue);
-		if (gl == NULL) {
-			speaking_set_queue(highest_priority, queue);
-			return;
-		}
-		if (SPEECHD_DEBUG)
-			assert(gl->data != NULL);
-
-		msg = (TSpeechDMessage *) gl->data;
-		if (msg->settings.reparted == 1) {
-			queue = g_list_remove_link(queue, gl);
-			assert(gl->data != NULL);
-			mem_free_message(gl->data);
-		} else {
-			speaking_set_queue(highest_priority, queue);
+	while ((msg = g_queue_peek_tail(queue)) != NULL) {
+		if (msg->settings.reparted != 1)
 			return;
-		}
+		queue_unlink_message(msg);
+		mem_free_message(msg);
 	}
 }
 
@@ -545,25 +689,6 @@ void speaking_cancel_all()
 	pthread_mutex_unlock(&element_free_mutex);
 }
 
-int speaking_pause_all(int fd)
-{
-	int err = 0;
-	int i;
-	int uid;
-
-	for (i = 1; i <= SpeechdStatus.max_fd; i++) {
-		uid = get_client_uid_by_fd(i);
-		if (uid == 0)
-			continue;
-		err += speaking_pause(i, uid);
-	}
-
-	if (err > 0)
-		return 1;
-	else
-		return 0;
-}
-
 int speaking_pause(int fd, int uid)
 {
 	TFDSetElement *settings;
@@ -611,17 +736,25 @@ int speaking_pause(int fd, int uid)
 
 int speaking_resume_all()
 {
+	GHashTableIter iter;
+	gpointer uid;
+	TFDSetElement *settings;
 	int err = 0;
-	int i;
-	int uid;
 
-	for (i = 1; i <= SpeechdStatus.max_fd; i++) {
-		uid = get_client_uid_by_fd(i);
-		if (uid == 0)
+	g_hash_table_iter_init(&iter, fd_uid);
+	while (g_hash_table_iter_next(&iter, NULL, &uid)) {
+		settings = get_client_settings_by_uid(*(int *)uid);
+		if (settings == NULL) {
+			err++;
 			continue;
-		err += speaking_resume(uid);
+		}
+		settings->paused = 0;
 	}
 
+	/* Wake the speaking thread once for all of them */
+	g_atomic_int_set(&resume_requested, 1);
+	speaking_semaphore_post();
+
 	if (err > 0)
 		return 1;
 	else
@@ -639,7 +772,7 @@ int speaking_resume(int uid)
 	/* Set it to speak again. */
 	settings->paused = 0;
 
-	resume_requested = 1;
+	g_atomic_int_set(&resume_requested, 1);
 	speaking_semaphore_post();
 
 	return 0;
@@ -647,21 +780,13 @@ int speaking_resume(int uid)
 
 int socket_send_msg(int fd, const char *msg)
 {
-	int ret;
-
 	assert(msg != NULL);
-	pthread_mutex_lock(&socket_com_mutex);
 	MSG2(5, "protocol", "%d:REPLY:|%s|", fd, msg);
-	ret = write(fd, msg, strlen(msg));
-	pthread_mutex_unlock(&socket_com_mutex);
-	if (ret < 0) {
-		MSG(1, "write() error: %s", strerror(errno));
-		return -1;
-	}
-	return 0;
+	/* This doesn't block on a client which does not read */
+	return server_send_event(fd, msg);
 }
 
-int report_index_mark(TSpeechDMessage * msg, const char *index_mark)
+static int send_index_mark(int fd, int id, int uid, const char *index_mark)
 {
 	char *cmd;
 	int ret;
@@ -669,9 +794,8 @@ int report_index_mark(TSpeechDMessage * msg, const char *index_mark)
 	cmd = g_strdup_printf(EVENT_INDEX_MARK_C "-%d\r\n"
 			      EVENT_INDEX_MARK_C "-%d\r\n"
 			      EVENT_INDEX_MARK_C "-%s\r\n"
-			      EVENT_INDEX_MARK,
-			      msg->id, msg->settings.uid, index_mark);
-	ret = socket_send_msg(msg->settings.fd, cmd);
+			      EVENT_INDEX_MARK, id, uid, index_mark);
+	ret = socket_send_msg(fd, cmd);
 	g_free(cmd);
 	if (ret) {
 		MSG(1, "ERROR: Can't report index mark!");
@@ -680,12 +804,105 @@ int report_index_mark(TSpeechDMessage * msg, const char *index_mark)
 	return 0;
 }
 
+/* With INDEX_MARK_INTERVAL, the index marks of the message being spoken
+   which come too soon are held back, only the latest one is kept and sent
+   when the interval is over, from the main loop. */
+static pthread_mutex_t held_mark_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	int fd;
+	int id;			/* Message the marks belong to */
+	int uid;
+	char *mark;		/* NULL if none is held */
+	gint64 last;		/* When the previous mark was sent */
+	guint source;
+} held_mark;
+
+/* Send the held index mark, if any, must be called with held_mark_mutex */
+static void send_held_mark(void)
+{
+	if (held_mark.source) {
+		g_source_remove(held_mark.source);
+		held_mark.source = 0;
+	}
+	if (held_mark.mark == NULL)
+		return;
+	/* The client may have gone, and its fd be given to another one */
+	if (get_client_uid_by_fd(held_mark.fd) == held_mark.uid)
+		send_index_mark(held_mark.fd, held_mark.id, held_mark.uid,
+				held_mark.mark);
+	g_free(held_mark.mark);
+	held_mark.mark = NULL;
+	held_mark.last = g_get_monotonic_time();
+}
+
+static gboolean held_mark_timeout(gpointer user_data)
+{
+	pthread_mutex_lock(&held_mark_mutex);
+	/* This source is over anyway */
+	held_mark.source = 0;
+	send_held_mark();
+	pthread_mutex_unlock(&held_mark_mutex);
+	return FALSE;
+}
+
+/* The events about msg must not overtake its last index mark */
+static void report_held_mark(TSpeechDMessage * msg)
+{
+	pthread_mutex_lock(&held_mark_mutex);
+	if (held_mark.id == msg->id)
+		send_held_mark();
+	pthread_mutex_unlock(&held_mark_mutex);
+}
+
+int report_index_mark(TSpeechDMessage * msg, const char *index_mark)
+{
+	gint64 now, interval = msg->settings.index_mark_interval * 1000;
+	int ret = 0;
+
+	if (interval <= 0)
+		return send_index_mark(msg->settings.fd, msg->id,
+				       msg->settings.uid, index_mark);
+
+	pthread_mutex_lock(&held_mark_mutex);
+	if (held_mark.id != msg->id) {
+		/* Marks of a previous message are of no use any more */
+		if (held_mark.source)
+			g_source_remove(held_mark.source);
+		g_free(held_mark.mark);
+		held_mark.mark = NULL;
+		held_mark.source = 0;
+		held_mark.last = 0;
+		held_mark.id = msg->id;
+	}
+	held_mark.fd = msg->settings.fd;
+	held_mark.uid = msg->settings.uid;
+
+	now = g_get_monotonic_time();
+	if (now - held_mark.last >= interval && held_mark.mark == NULL) {
+		held_mark.last = now;
+		ret = send_index_mark(msg->settings.fd, msg->id,
+				      msg->settings.uid, index_mark);
+	} else {
+		g_free(held_mark.mark);
+		held_mark.mark = g_strdup(index_mark);
+		if (!held_mark.source)
+			held_mark.source =
+			    g_timeout_add(MAX(held_mark.last + interval - now,
+					      0) / 1000, held_mark_timeout,
+					  NULL);
+	}
+	pthread_mutex_unlock(&held_mark_mutex);
+
+	return ret;
+}
+
 #define REPORT_STATE(state, ssip_code, ssip_msg) \
 	int \
 	report_ ## state (TSpeechDMessage *msg) \
 	{ \
 		char *cmd; \
 		int ret; \
+		report_held_mark(msg); \
 		cmd = g_strdup_printf(ssip_code"-%d\r\n"ssip_code"-%d\r\n"ssip_msg, \
 		                      msg->id, msg->settings.uid); \
 		ret = socket_send_msg(msg->settings.fd, cmd); \
@@ -703,6 +920,57 @@ REPORT_STATE(begin, EVENT_BEGIN_C, EVENT_BEGIN)
     REPORT_STATE(resume, EVENT_RESUMED_C, EVENT_RESUMED)
     REPORT_STATE(cancel, EVENT_CANCELED_C, EVENT_CANCELED)
 
+static void report_voices_changed_client(gpointer key, gpointer value,
+					 gpointer user_data)
+{
+	TFDSetElement *settings = value;
+	char *cmd;
+
+	if (!settings->active || !(settings->notification & SPD_VOICES_CHANGED))
+		return;
+
+	/* There is no message, but keep the usual event parameters */
+	cmd = g_strdup_printf(EVENT_VOICES_CHANGED_C "-0\r\n"
+			      EVENT_VOICES_CHANGED_C "-%d\r\n"
+			      EVENT_VOICES_CHANGED, settings->uid);
+	if (socket_send_msg(settings->fd, cmd))
+		MSG(2, "ERROR: Can't report voices change!");
+	g_free(cmd);
+}
+
+void report_voices_changed(void)
+{
+	g_hash_table_foreach(fd_settings, report_voices_changed_client, NULL);
+}
+
+static GQueue *speaking_get_client_messages(int uid);
+
+/* Once a part of a split message is reported canceled, the other parts
+   must not report it again */
+static void message_silence_segments(TSpeechDMessage * msg)
+{
+	GQueue *messages;
+	GList *gl;
+	TSpeechDMessage *other;
+
+	check_locked(&element_free_mutex);
+	if (!msg->segment)
+		return;
+
+	if (current_message && current_message != msg
+	    && current_message->id == msg->id)
+		current_message->segment |= SEGMENT_SILENT;
+
+	messages = speaking_get_client_messages(msg->settings.uid);
+	if (messages == NULL)
+		return;
+	for (gl = g_queue_peek_head_link(messages); gl; gl = g_list_next(gl)) {
+		other = gl->data;
+		if (other != msg && other->id == msg->id)
+			other->segment |= SEGMENT_SILENT;
+	}
+}
+
 int is_sb_speaking(void)
 {
 	char *index_mark;
@@ -735,7 +1003,8 @@ int is_sb_speaking(void)
 		if (!strcmp(index_mark, SD_MARK_BODY "begin")) {
 			SPEAKING = 1;
 			if (!settings->paused_while_speaking) {
-				if (settings->notification & SPD_BEGIN)
+				if ((settings->notification & SPD_BEGIN)
+				    && !(current_message->segment & SEGMENT_CONT))
 					report_begin(current_message);
 			} else {
 				if (settings->notification & SPD_RESUME)
@@ -745,7 +1014,8 @@ int is_sb_speaking(void)
 		} else if (!strcmp(index_mark, SD_MARK_BODY "end")) {
 			SPEAKING = 0;
 			poll_count = 1;
-			if (settings->notification & SPD_END)
+			if ((settings->notification & SPD_END)
+			    && !(current_message->segment & SEGMENT_MORE))
 				report_end(current_message);
 			speaking_semaphore_post();
 		} else if (!strcmp(index_mark, SD_MARK_BODY "paused")) {
@@ -759,8 +1029,13 @@ int is_sb_speaking(void)
 		} else if (!strcmp(index_mark, SD_MARK_BODY "stopped")) {
 			SPEAKING = 0;
 			poll_count = 1;
-			if (settings->notification & SPD_CANCEL)
+			metrics_count(METRICS_CANCELED);
+			pthread_mutex_lock(&element_free_mutex);
+			if ((settings->notification & SPD_CANCEL)
+			    && !(current_message->segment & SEGMENT_SILENT))
 				report_cancel(current_message);
+			message_silence_segments(current_message);
+			pthread_mutex_unlock(&element_free_mutex);
 			speaking_semaphore_post();
 		} else if (index_mark != NULL) {
 			if (strncmp(index_mark, SD_MARK_BODY, SD_MARK_BODY_LEN)) {
@@ -805,109 +1080,237 @@ int get_speaking_client_uid(void)
 	return speaking;
 }
 
-GList *queue_remove_message(GList * queue, GList * gl)
+/* Every queued message knows the queue and the link it sits in and is
+   listed under its client's uid in MessageQueue->by_uid, so that it can
+   be taken out of the queues without searching them. */
+static void index_add_message(TSpeechDMessage * msg)
 {
-	TSpeechDMessage *msg;
-	assert(gl != NULL);
-	assert(gl->data != NULL);
-	msg = (TSpeechDMessage *) gl->data;
-	if (msg->settings.notification & SPD_CANCEL)
-		report_cancel(msg);
-	mem_free_message(gl->data);
-	queue = g_list_delete_link(queue, gl);
-	return queue;
+	TClientMessages *client;
+	gpointer uid = GINT_TO_POINTER(msg->settings.uid);
+
+	client = g_hash_table_lookup(MessageQueue->by_uid, uid);
+	if (client == NULL) {
+		client = g_new0(TClientMessages, 1);
+		g_hash_table_insert(MessageQueue->by_uid, uid, client);
+	}
+	g_queue_push_tail(&client->messages, msg);
+	msg->uid_link = g_queue_peek_tail_link(&client->messages);
+	/* Its text may change once prepared, keep what was counted */
+	msg->uid_bytes = msg->bytes;
+	client->bytes += msg->uid_bytes;
 }
 
-GList *empty_queue(GList * queue)
+static void index_remove_message(TSpeechDMessage * msg)
 {
-	int num, i;
-	GList *gl;
+	TClientMessages *client;
+	gpointer uid = GINT_TO_POINTER(msg->settings.uid);
+
+	client = g_hash_table_lookup(MessageQueue->by_uid, uid);
+	assert(client != NULL);
+	g_queue_delete_link(&client->messages, msg->uid_link);
+	msg->uid_link = NULL;
+	client->bytes -= msg->uid_bytes;
+	if (g_queue_is_empty(&client->messages))
+		g_hash_table_remove(MessageQueue->by_uid, uid);
+}
 
-	num = g_list_length(queue);
-	for (i = 0; i <= num - 1; i++) {
-		gl = g_list_first(queue);
-		queue = queue_remove_message(queue, gl);
+void speaking_client_messages_free(gpointer data)
+{
+	TClientMessages *client = data;
+
+	g_queue_clear(&client->messages);
+	g_free(client);
+}
+
+void speaking_client_queued(int uid, guint * messages, gsize * bytes)
+{
+	TClientMessages *client;
+
+	check_locked(&element_free_mutex);
+	client = g_hash_table_lookup(MessageQueue->by_uid,
+				     GINT_TO_POINTER(uid));
+	*messages = client ? g_queue_get_length(&client->messages) : 0;
+	*bytes = client ? client->bytes : 0;
+}
+
+/* Insert msg into queue before sibling, or at its tail if sibling
+   is NULL */
+static void queue_link_message(GQueue * queue, GList * sibling,
+			       TSpeechDMessage * msg)
+{
+	check_locked(&element_free_mutex);
+	if (sibling != NULL) {
+		g_queue_insert_before(queue, sibling, msg);
+		msg->link = g_list_previous(sibling);
+	} else {
+		g_queue_push_tail(queue, msg);
+		msg->link = g_queue_peek_tail_link(queue);
 	}
+	msg->queue = queue;
+	index_add_message(msg);
+}
 
-	return queue;
+void queue_push_message(GQueue * queue, TSpeechDMessage * msg)
+{
+	queue_link_message(queue, NULL, msg);
+}
+
+void queue_insert_message(GQueue * queue, TSpeechDMessage * msg)
+{
+	GList *pos;
+
+	check_locked(&element_free_mutex);
+	/* Before the other parts of its message, which share its id */
+	for (pos = g_queue_peek_head_link(queue);
+	     pos != NULL && sortbyuid(pos->data, msg) < 0;
+	     pos = g_list_next(pos)) ;
+	queue_link_message(queue, pos, msg);
+}
+
+void queue_unlink_message(TSpeechDMessage * msg)
+{
+	check_locked(&element_free_mutex);
+	assert(msg->queue != NULL);
+	g_queue_delete_link(msg->queue, msg->link);
+	msg->queue = NULL;
+	msg->link = NULL;
+	index_remove_message(msg);
+}
+
+/* Move msg to the tail of another queue, it stays in the index */
+static void queue_move_message(TSpeechDMessage * msg, GQueue * queue)
+{
+	check_locked(&element_free_mutex);
+	g_queue_unlink(msg->queue, msg->link);
+	g_queue_push_tail_link(queue, msg->link);
+	msg->queue = queue;
+}
+
+void queue_remove_message(TSpeechDMessage * msg)
+{
+	assert(msg != NULL);
+	metrics_count(METRICS_CANCELED);
+	if ((msg->settings.notification & SPD_CANCEL)
+	    && !(msg->segment & SEGMENT_SILENT))
+		report_cancel(msg);
+	message_silence_segments(msg);
+	queue_unlink_message(msg);
+	mem_free_message(msg);
+}
+
+void empty_queue(GQueue * queue)
+{
+	TSpeechDMessage *msg;
+
+	while ((msg = g_queue_peek_head(queue)) != NULL)
+		queue_remove_message(msg);
 }
 
-GList *empty_queue_by_time(GList * queue, unsigned int uid)
+void empty_queue_by_time(GQueue * queue, unsigned int uid)
 {
-	int num, i;
 	GList *gl, *gln;
 	TSpeechDMessage *msg;
 
-	num = g_list_length(queue);
-	gl = g_list_first(queue);
-	for (i = 0; i <= num - 1; i++) {
+	for (gl = g_queue_peek_head_link(queue); gl != NULL; gl = gln) {
 		gln = g_list_next(gl);
-		if (gl == NULL)
-			break;
 		assert(gl->data != NULL);
 		msg = gl->data;
-		if (msg->id < uid) {
-			queue = queue_remove_message(queue, gl);
-		}
-		gl = gln;
+		if (msg->id < uid)
+			queue_remove_message(msg);
 	}
-
-	return queue;
 }
 
 int stop_priority(SPDPriority priority)
 {
-	GList *queue;
-
-	queue = speaking_get_queue(priority);
-
 	if (highest_priority == priority) {
 		output_stop();
 	}
 
-	queue = empty_queue(queue);
-
-	speaking_set_queue(priority, queue);
+	empty_queue(speaking_get_queue(priority));
+	empty_queue(speaking_get_paused_queue(priority));
 
 	return 0;
 }
 
 int stop_priority_older_than(SPDPriority priority, unsigned int uid)
 {
-	GList *queue;
-
-	queue = speaking_get_queue(priority);
-
 	if (highest_priority == priority) {
 		output_stop();
 	}
 
-	queue = empty_queue_by_time(queue, uid);
-
-	speaking_set_queue(priority, queue);
+	empty_queue_by_time(speaking_get_queue(priority), uid);
+	empty_queue_by_time(speaking_get_paused_queue(priority), uid);
 
 	return 0;
 }
 
-GList *stop_priority_from_uid(GList * queue, const int uid)
+/* Return the queued messages of client uid, or NULL if there are none */
+static GQueue *speaking_get_client_messages(int uid)
 {
-	GList *ret = queue;
-	GList *gl;
+	TClientMessages *client;
 
-	while ((gl = g_list_find_custom(ret, &uid, p_msg_uid_lc)))
-		ret = queue_remove_message(ret, gl);
+	check_locked(&element_free_mutex);
+	client = g_hash_table_lookup(MessageQueue->by_uid,
+				     GINT_TO_POINTER(uid));
+	return client ? &client->messages : NULL;
+}
 
-	return ret;
+void stop_priority_from_uid(GQueue * queue, const int uid)
+{
+	GQueue *messages;
+	GList *gl, *gln;
+	TSpeechDMessage *msg;
+
+	messages = speaking_get_client_messages(uid);
+	if (messages == NULL)
+		return;
+
+	for (gl = g_queue_peek_head_link(messages); gl != NULL; gl = gln) {
+		/* Removing the last message frees the messages queue */
+		gln = g_list_next(gl);
+		msg = gl->data;
+		if (msg->queue == queue)
+			queue_remove_message(msg);
+	}
+}
+
+/* Cancel the messages of the client of msg still waiting in the queues of
+   priority, but msg and the messages of its block, returns how many */
+int coalesce_client_messages(TSpeechDMessage * msg, SPDPriority priority)
+{
+	GQueue *messages, *queue, *paused;
+	GList *gl, *gln;
+	TSpeechDMessage *old;
+	int n = 0;
+
+	messages = speaking_get_client_messages(msg->settings.uid);
+	if (messages == NULL)
+		return 0;
+	queue = speaking_get_queue(priority);
+	paused = speaking_get_paused_queue(priority);
+
+	for (gl = g_queue_peek_head_link(messages); gl != NULL; gl = gln) {
+		gln = g_list_next(gl);
+		old = gl->data;
+		if (old == msg || (old->queue != queue && old->queue != paused))
+			continue;
+		if (msg->settings.reparted > 0
+		    && old->settings.reparted == msg->settings.reparted)
+			continue;
+		queue_remove_message(old);
+		n++;
+	}
+
+	return n;
 }
 
 void stop_from_uid(const int uid)
 {
-	check_locked(&element_free_mutex);
-	MessageQueue->p1 = stop_priority_from_uid(MessageQueue->p1, uid);
-	MessageQueue->p2 = stop_priority_from_uid(MessageQueue->p2, uid);
-	MessageQueue->p3 = stop_priority_from_uid(MessageQueue->p3, uid);
-	MessageQueue->p4 = stop_priority_from_uid(MessageQueue->p4, uid);
-	MessageQueue->p5 = stop_priority_from_uid(MessageQueue->p5, uid);
+	GQueue *messages;
+
+	/* The index entry goes away together with the last message */
+	while ((messages = speaking_get_client_messages(uid)) != NULL)
+		queue_remove_message(g_queue_peek_head(messages));
 }
 
 /* Determines if this messages is to be spoken
@@ -935,31 +1338,44 @@ gint message_nto_speak(gconstpointer data, gconstpointer nothing)
 		return 1;
 }
 
+/* Remove all messages that are not part of group gid from queue,
+   without reporting them as canceled */
+static void queue_remove_other_groups(GQueue * queue, int gid)
+{
+	GList *gl, *gl_next;
+	TSpeechDMessage *msg;
+
+	for (gl = g_queue_peek_head_link(queue); gl != NULL; gl = gl_next) {
+		gl_next = g_list_next(gl);
+		msg = gl->data;
+		if (msg->settings.reparted != gid) {
+			queue_unlink_message(msg);
+			mem_free_message(msg);
+		}
+	}
+}
+
 void stop_priority_except_first(SPDPriority priority)
 {
-	GList *queue;
+	GQueue *queue;
 	GList *gl;
 	TSpeechDMessage *msg;
-	GList *gl_next;
 	int gid;
 
 	queue = speaking_get_queue(priority);
 
-	gl = g_list_last(queue);
+	gl = g_queue_peek_tail_link(queue);
 
 	if (gl == NULL)
 		return;
-	if (gl->data == NULL)
-		return;
 
 	msg = (TSpeechDMessage *) gl->data;
 	if (msg->settings.reparted <= 0) {
-		queue = g_list_remove_link(queue, gl);
-		speaking_set_queue(priority, queue);
+		g_queue_unlink(queue, gl);
 
 		stop_priority(priority);
 		/* Fill the queue with the list containing only the first message */
-		speaking_set_queue(priority, gl);
+		g_queue_push_tail_link(queue, gl);
 	} else {
 		gid = msg->settings.reparted;
 
@@ -967,19 +1383,9 @@ void stop_priority_except_first(SPDPriority priority)
 			output_stop();
 		}
 
-		gl = g_list_first(queue);
-		while (gl) {
-			gl_next = g_list_next(gl);
-			if (gl->data != NULL) {
-				TSpeechDMessage *msgg = gl->data;
-				if (msgg->settings.reparted != gid) {
-					queue = g_list_remove_link(queue, gl);
-					mem_free_message(msgg);
-				}
-			}
-			gl = gl_next;
-		}
-		speaking_set_queue(priority, queue);
+		queue_remove_other_groups(queue, gid);
+		queue_remove_other_groups(speaking_get_paused_queue(priority),
+					  gid);
 	}
 
 	return;
@@ -1020,17 +1426,13 @@ void resolve_priorities(SPDPriority priority)
 		if (SPEAKING) {
 			GList *gl;
 			check_locked(&element_free_mutex);
-			gl = g_list_last(MessageQueue->p5);
-			check_locked(&element_free_mutex);
-			MessageQueue->p5 =
-			    g_list_remove_link(MessageQueue->p5, gl);
+			gl = g_queue_peek_tail_link(MessageQueue->p5);
 			if (gl != NULL) {
-				check_locked(&element_free_mutex);
-				MessageQueue->p5 =
-				    empty_queue(MessageQueue->p5);
-				if (gl->data != NULL) {
-					MessageQueue->p5 = gl;
-				}
+				g_queue_unlink(MessageQueue->p5, gl);
+				empty_queue(MessageQueue->p5);
+				empty_queue(speaking_get_paused_queue
+					    (SPD_PROGRESS));
+				g_queue_push_tail_link(MessageQueue->p5, gl);
 			}
 		}
 	}
@@ -1039,36 +1441,86 @@ void resolve_priorities(SPDPriority priority)
 
 TSpeechDMessage *get_message_from_queues()
 {
-	GList *gl;
 	SPDPriority prio;
 	TSpeechDMessage *message;
+	time_t expired = 0;
+
+	if (SpeechdOptions.notification_expiry > 0)
+		expired = time(NULL) - SpeechdOptions.notification_expiry;
 
 	/* We will descend through priorities to say more important
 	   messages first. */
 	for (prio = SPD_IMPORTANT; prio <= SPD_PROGRESS; prio++) {
-		GList *current_queue = speaking_get_queue(prio);
+		GQueue *current_queue = speaking_get_queue(prio);
 		check_locked(&element_free_mutex);
-		gl = g_list_first(current_queue);
 
-		while (gl != NULL) {
-			if (message_nto_speak
-			    ((TSpeechDMessage *) gl->data, NULL)) {
-				gl = g_list_next(gl);
+		while ((message = g_queue_peek_head(current_queue)) != NULL) {
+			if (prio >= SPD_NOTIFICATION && message->time < expired) {
+				MSG(5, "Dropping expired message %d",
+				    message->id);
+				queue_remove_message(message);
 				continue;
 			}
-			speaking_set_queue(prio,
-					   g_list_remove_link(current_queue,
-							      gl));
+			if (message_nto_speak(message, NULL)) {
+				/* Set it aside so that we don't have to look
+				   at it again until its client is resumed */
+				queue_move_message(message,
+						   speaking_get_paused_queue
+						   (prio));
+				continue;
+			}
+			queue_unlink_message(message);
 			highest_priority = prio;
-			message = gl->data;
-			g_list_free(gl);
-			return (TSpeechDMessage *) message;
+			return message;
 		}
 	}
 
 	return NULL;
 }
 
+void speaking_unpark_messages(void)
+{
+	SPDPriority prio;
+	GQueue *paused;
+	GQueue resumed = G_QUEUE_INIT;
+	GList *gl, *gln;
+	TSpeechDMessage *msg;
+
+	check_locked(&element_free_mutex);
+	for (prio = SPD_IMPORTANT; prio <= SPD_PROGRESS; prio++) {
+		paused = speaking_get_paused_queue(prio);
+		for (gl = g_queue_peek_head_link(paused); gl != NULL; gl = gln) {
+			gln = g_list_next(gl);
+			msg = gl->data;
+			if (message_nto_speak(msg, NULL))
+				continue;
+			queue_unlink_message(msg);
+			g_queue_push_tail(&resumed, msg);
+		}
+		if (!g_queue_is_empty(&resumed)) {
+			MSG(5, "Putting %u messages of priority %d back",
+			    g_queue_get_length(&resumed), prio);
+			queue_merge_by_id(speaking_get_queue(prio), &resumed);
+		}
+	}
+}
+
+void queue_merge_by_id(GQueue * queue, GQueue * from)
+{
+	GList *pos;
+	TSpeechDMessage *msg;
+
+	check_locked(&element_free_mutex);
+	/* Both queues are ordered by id, so a single pass through queue
+	   suffices to find the place of every element of from */
+	pos = g_queue_peek_head_link(queue);
+	while ((msg = g_queue_pop_head(from)) != NULL) {
+		while (pos != NULL && sortbyuid(pos->data, msg) < 0)
+			pos = g_list_next(pos);
+		queue_link_message(queue, pos, msg);
+	}
+}
+
 gint message_has_uid(gconstpointer msg, gconstpointer uid)
 {
 	if (((TSpeechDMessage *) msg)->settings.uid == *(int *)uid)
@@ -1081,25 +1533,12 @@ gint message_has_uid(gconstpointer msg, gconstpointer uid)
    in any of the queues, otherwise return 0 */
 int client_has_messages(int uid)
 {
-
-	if (g_list_find_custom
-	    (MessageQueue->p5, (gconstpointer) & uid, message_has_uid)
-	    || g_list_find_custom(MessageQueue->p4, (gconstpointer) & uid,
-				  message_has_uid)
-	    || g_list_find_custom(MessageQueue->p3, (gconstpointer) & uid,
-				  message_has_uid)
-	    || g_list_find_custom(MessageQueue->p2, (gconstpointer) & uid,
-				  message_has_uid)
-	    || g_list_find_custom(MessageQueue->p1, (gconstpointer) & uid,
-				  message_has_uid))
-		return 1;
-	else
-		return 0;
+	return speaking_get_client_messages(uid) != NULL;
 }
 
-GList *speaking_get_queue(SPDPriority priority)
+GQueue *speaking_get_queue(SPDPriority priority)
 {
-	GList *queue = NULL;
+	GQueue *queue = NULL;
 
 	assert(priority >= SPD_IMPORTANT && priority <= SPD_PROGRESS);
 
@@ -1125,28 +1564,12 @@ GList *speaking_get_queue(SPDPriority priority)
 	return queue;
 }
 
-void speaking_set_queue(SPDPriority priority, GList * queue)
+GQueue *speaking_get_paused_queue(SPDPriority priority)
 {
 	assert(priority >= SPD_IMPORTANT && priority <= SPD_PROGRESS);
 
 	check_locked(&element_free_mutex);
-	switch (priority) {
-	case SPD_IMPORTANT:
-		MessageQueue->p1 = queue;
-		break;
-	case SPD_MESSAGE:
-		MessageQueue->p2 = queue;
-		break;
-	case SPD_TEXT:
-		MessageQueue->p3 = queue;
-		break;
-	case SPD_NOTIFICATION:
-		MessageQueue->p4 = queue;
-		break;
-	case SPD_PROGRESS:
-		MessageQueue->p5 = queue;
-		break;
-	}
+	return MessageQueue->paused[priority - 1];
 }
 
 gint sortbyuid(gconstpointer a, gconstpointer b)
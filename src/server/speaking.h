@@ -31,9 +31,6 @@ extern int speaking_uid;
 extern int speaking_gid;
 
 /* Pause and resume handling */
-extern int pause_requested;
-extern int pause_requested_fd;
-extern int pause_requested_uid;
 extern int resume_requested;
 
 /* Speak() is responsible for getting right text from right
@@ -53,7 +50,9 @@ void speaking_cancel(int uid);
 void speaking_cancel_all(void);
 
 int speaking_pause(int fd, int uid);
-int speaking_pause_all(int fd);
+/* Have the speaking thread pause the messages of client uid, as requested
+   by the client on fd */
+void speaking_request_pause(int fd, int uid);
 
 int speaking_resume(int uid);
 int speaking_resume_all(void);
@@ -68,6 +67,10 @@ int is_sb_speaking(void);
 void stop_speaking_active_module(void);
 
 int stop_priority(SPDPriority priority);
+void speaking_preempt(TSpeechDMessage * msg);
+/* module is being replaced, with element_free_mutex held: returns 1 if it is
+   speaking, the speaking thread then destroys it once it is done with it */
+int speaking_retire_module(OutputModule * module);
 
 void stop_from_uid(int uid);
 
@@ -81,10 +84,19 @@ void resolve_priorities(SPDPriority priority);
 
 /* Queue interaction helper functions */
 TSpeechDMessage *get_message_from_queues(void);
-GList *speaking_get_queue(SPDPriority priority);
-void speaking_set_queue(SPDPriority priority, GList * queue);
+GQueue *speaking_get_queue(SPDPriority priority);
+/* Messages of paused clients skipped by get_message_from_queues() */
+GQueue *speaking_get_paused_queue(SPDPriority priority);
+/* Move the messages of clients which are no longer paused
+ * back to their queues */
+void speaking_unpark_messages(void);
+/* Move all messages of from into queue, keeping it ordered by id */
+void queue_merge_by_id(GQueue * queue, GQueue * from);
 gint sortbyuid(gconstpointer a, gconstpointer b);
 int client_has_messages(int uid);
+/* Number and bytes of the messages client uid has in the queues */
+void speaking_client_queued(int uid, guint * messages, gsize * bytes);
+void speaking_client_messages_free(gpointer data);
 
 /* Get the unique id of the client who is speaking
  * on some output module */
@@ -97,12 +109,24 @@ int report_end(TSpeechDMessage * msg);
 int report_pause(TSpeechDMessage * msg);
 int report_resume(TSpeechDMessage * msg);
 int report_cancel(TSpeechDMessage * msg);
-
-GList *empty_queue(GList * queue);
-GList *empty_queue_by_time(GList * queue, unsigned int uid);
+/* Tell the clients which asked for it that the lists of output modules
+   and voices may have changed */
+void report_voices_changed(void);
+
+/* Queue msg at the tail of queue */
+void queue_push_message(GQueue * queue, TSpeechDMessage * msg);
+/* Queue msg back at its place by id, before the messages with the same id */
+void queue_insert_message(GQueue * queue, TSpeechDMessage * msg);
+/* Take msg out of its queue without freeing it */
+void queue_unlink_message(TSpeechDMessage * msg);
+/* Take msg out of its queue, report it as canceled and free it */
+void queue_remove_message(TSpeechDMessage * msg);
+void empty_queue(GQueue * queue);
+void empty_queue_by_time(GQueue * queue, unsigned int uid);
 
 int stop_priority_older_than(SPDPriority priority, unsigned int uid);
-GList *stop_priority_from_uid(GList * queue, const int uid);
+void stop_priority_from_uid(GQueue * queue, const int uid);
+int coalesce_client_messages(TSpeechDMessage * msg, SPDPriority priority);
 void stop_priority_except_first(SPDPriority priority);
 
 #endif /* SPEAKING_H */
@@ -29,6 +29,8 @@
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdint.h>
 #ifdef USE_LIBSYSTEMD
 #include <systemd/sd-daemon.h>
@@ -52,6 +54,11 @@
 #include "set.h"
 #include "options.h"
 #include "server.h"
+#include "output.h"
+#include "symbols.h"
+#include "metrics.h"
+#include "capture.h"
+#include "history.h"
 
 #include <i18n.h>
 
@@ -76,7 +83,6 @@ struct SpeechdStatus SpeechdStatus;
 pthread_t speak_thread;
 pthread_mutex_t logging_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t element_free_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t output_layer_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t socket_com_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 GHashTable *fd_settings;
@@ -88,7 +94,7 @@ GList *MessagePausedList;
 
 GList *client_specific_settings;
 
-GList *last_p5_block;
+GQueue *last_p5_block;
 
 TFDSetElement GlobalFDSet;
 
@@ -105,6 +111,7 @@ TSpeechDMode spd_mode;
 
 static gboolean speechd_client_terminate(gpointer key, gpointer value, gpointer user);
 static gboolean speechd_reload_dead_modules(gpointer user_data);
+static gboolean speechd_log_memory_usage(gpointer user_data);
 static gboolean speechd_load_configuration(gpointer user_data);
 enum quit_reason {
 	QUIT_SIGINT,
@@ -170,84 +177,330 @@ void fatal_error(void)
 	i++;
 }
 
-/* Logging messages, level of verbosity is defined between 1 and 5,
- * see documentation */
-void MSG2(int level, const char *kind, const char *format, ...)
+/* Log messages are not written by the threads logging them: each thread
+ * formats its messages into a ring of its own, without taking any lock,
+ * and the log writer thread drains them all into the log files.  Only
+ * errors (level 0 and below) are still written right away, since they
+ * are often followed by exit(), and so is everything when the log writer
+ * is not running.  When a ring is full its messages are dropped and
+ * counted. */
+
+#define LOG_RING_SIZE (64 * 1024)	/* Must be a power of two */
+#define LOG_TEXT_MAX 8192	/* Longer messages are truncated */
+
+/* Where a message goes */
+#define LOG_STD 1
+#define LOG_CUSTOM 2
+#define LOG_DEBUG 4
+#define LOG_STDERR 8
+
+struct log_record {
+	struct timeval tv;
+	unsigned int len;	/* Of the text following the record */
+	int level;
+	int dest;
+};
+
+struct log_ring {
+	struct log_ring *next;
+	size_t head;		/* Written by the thread only */
+	size_t tail;		/* Written by the log writer only */
+	unsigned int dropped;
+	int orphaned;		/* The thread exited */
+	char data[LOG_RING_SIZE];
+};
+
+/* Rings of all threads, only the log writer removes them */
+static struct log_ring *log_rings;
+static pthread_mutex_t log_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t log_ring_key;
+
+static pthread_t log_writer_thread;
+static int log_writer_running;
+static int log_writer_stop;
+static int log_writer_sleeping;
+static int log_wake_pipe[2] = { -1, -1 };
+
+static void log_ring_copy_in(struct log_ring *ring, size_t pos,
+			     const void *src, size_t n)
 {
-	int std_log = level <= SpeechdOptions.log_level;
-	int custom_log = (kind != NULL && custom_log_kind != NULL &&
-			  !strcmp(kind, custom_log_kind) &&
-			  custom_logfile != NULL);
+	size_t off = pos & (LOG_RING_SIZE - 1);
+	size_t first = MIN(n, LOG_RING_SIZE - off);
 
-	if (std_log || custom_log) {
-		va_list args;
-		int i;
+	memcpy(ring->data + off, src, first);
+	memcpy(ring->data, (const char *)src + first, n - first);
+}
 
-		pthread_mutex_lock(&logging_mutex);
+static void log_ring_copy_out(const struct log_ring *ring, size_t pos,
+			      void *dst, size_t n)
+{
+	size_t off = pos & (LOG_RING_SIZE - 1);
+	size_t first = MIN(n, LOG_RING_SIZE - off);
 
-		{
-			{
-				/* Print timestamp */
-				time_t t;
-				char *tstr;
-				struct timeval tv;
-				t = time(NULL);
-				tstr = g_strdup(ctime(&t));
-				gettimeofday(&tv, NULL);
-				assert(tstr);
-				/* Remove the trailing \n */
-				assert(strlen(tstr) > 1);
-				tstr[strlen(tstr) - 1] = 0;
-				if (std_log) {
-					fprintf(logfile, "[%s : %d] speechd: ",
-						tstr, (int)tv.tv_usec);
-					//            fprintf(logfile, "[test : %d] speechd: ",
-					//                     (int) tv.tv_usec);
-				}
-				if (custom_log) {
-					fprintf(custom_logfile,
-						"[%s : %d] speechd: ", tstr,
-						(int)tv.tv_usec);
-				}
-				if (SpeechdOptions.debug) {
-					fprintf(debug_logfile,
-						"[%s : %d] speechd: ", tstr,
-						(int)tv.tv_usec);
-				}
-				g_free(tstr);
-			}
-			for (i = 1; i < level; i++) {
-				if (std_log) {
-					fprintf(logfile, " ");
-				}
-				if (custom_log) {
-					fprintf(custom_logfile, " ");
-				}
-			}
-			if (std_log) {
-				va_start(args, format);
-				vfprintf(logfile, format, args);
-				va_end(args);
-				fprintf(logfile, "\n");
-				fflush(logfile);
-			}
-			if (custom_log) {
-				va_start(args, format);
-				vfprintf(custom_logfile, format, args);
-				va_end(args);
-				fprintf(custom_logfile, "\n");
-				fflush(custom_logfile);
-			}
-			if (SpeechdOptions.debug) {
-				va_start(args, format);
-				vfprintf(debug_logfile, format, args);
-				va_end(args);
-				fprintf(debug_logfile, "\n");
-				fflush(debug_logfile);
+	memcpy(dst, ring->data + off, first);
+	memcpy((char *)dst + first, ring->data, n - first);
+}
+
+static void log_ring_orphan(void *data)
+{
+	struct log_ring *ring = data;
+
+	__atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+/* Queues a message for the log writer, returns FALSE if it must be
+ * written right away instead */
+static gboolean log_push(const struct log_record *rec, const char *text)
+{
+	struct log_ring *ring;
+	size_t size = sizeof(*rec) + rec->len;
+	size_t head, tail;
+
+	if (!__atomic_load_n(&log_writer_running, __ATOMIC_ACQUIRE))
+		return FALSE;
+
+	ring = pthread_getspecific(log_ring_key);
+	if (ring == NULL) {
+		ring = g_malloc0(sizeof(*ring));
+		pthread_setspecific(log_ring_key, ring);
+		pthread_mutex_lock(&log_rings_mutex);
+		ring->next = log_rings;
+		log_rings = ring;
+		pthread_mutex_unlock(&log_rings_mutex);
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if (LOG_RING_SIZE - (head - tail) < size) {
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return TRUE;
+	}
+	log_ring_copy_in(ring, head, rec, sizeof(*rec));
+	log_ring_copy_in(ring, head + sizeof(*rec), text, rec->len);
+	__atomic_store_n(&ring->head, head + size, __ATOMIC_SEQ_CST);
+
+	/* Only one write() per wake up of the log writer */
+	if (__atomic_load_n(&log_writer_sleeping, __ATOMIC_SEQ_CST)
+	    && __atomic_exchange_n(&log_writer_sleeping, 0, __ATOMIC_SEQ_CST)) {
+		if (write(log_wake_pipe[1], "", 1) == -1 && errno != EAGAIN)
+			log_writer_sleeping = 1;
+	}
+	return TRUE;
+}
+
+/* Writes a message to its log files, logging_mutex must be held */
+static void log_write(const struct log_record *rec, const char *text)
+{
+	char tstr[32];
+	time_t t = rec->tv.tv_sec;
+	int indent = MAX(rec->level - 1, 0);
+	int usec = (int)rec->tv.tv_usec;
+
+	ctime_r(&t, tstr);
+	/* Remove the trailing \n */
+	tstr[strcspn(tstr, "\n")] = 0;
+
+	if (rec->dest & LOG_STD)
+		fprintf(logfile, "[%s : %d] speechd: %*s%.*s\n", tstr, usec,
+			indent, "", (int)rec->len, text);
+	if ((rec->dest & LOG_CUSTOM) && custom_logfile != NULL)
+		fprintf(custom_logfile, "[%s : %d] speechd: %*s%.*s\n", tstr,
+			usec, indent, "", (int)rec->len, text);
+	if ((rec->dest & LOG_DEBUG) && SpeechdOptions.debug)
+		fprintf(debug_logfile, "[%s : %d] speechd: %.*s\n", tstr, usec,
+			(int)rec->len, text);
+	if (rec->dest & LOG_STDERR)
+		fprintf(stderr, "%.*s\n", (int)rec->len, text);
+}
+
+static void log_flush_files(void)
+{
+	fflush(logfile);
+	if (custom_logfile != NULL)
+		fflush(custom_logfile);
+	if (SpeechdOptions.debug)
+		fflush(debug_logfile);
+	fflush(stderr);
+}
+
+/* Writes the messages queued in all the rings, in the order of their
+ * timestamps, logging_mutex must be held */
+static void log_drain(void)
+{
+	static char text[LOG_TEXT_MAX];
+	struct log_ring *ring, **p;
+	unsigned int dropped;
+
+	pthread_mutex_lock(&log_rings_mutex);
+	while (1) {
+		struct log_ring *first = NULL;
+		struct log_record rec, first_rec;
+
+		for (ring = log_rings; ring; ring = ring->next) {
+			if (ring->tail
+			    == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+				continue;
+			log_ring_copy_out(ring, ring->tail, &rec, sizeof(rec));
+			if (first == NULL || timercmp(&rec.tv, &first_rec.tv, <)) {
+				first = ring;
+				first_rec = rec;
 			}
 		}
+		if (first == NULL)
+			break;
+		log_ring_copy_out(first, first->tail + sizeof(first_rec), text,
+				  first_rec.len);
+		log_write(&first_rec, text);
+		__atomic_store_n(&first->tail,
+				 first->tail + sizeof(first_rec) + first_rec.len,
+				 __ATOMIC_RELEASE);
+	}
+
+	for (p = &log_rings; (ring = *p);) {
+		dropped = __atomic_exchange_n(&ring->dropped, 0,
+					      __ATOMIC_RELAXED);
+		if (dropped)
+			fprintf(logfile, "speechd: %u log messages dropped\n",
+				dropped);
+		if (__atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE)
+		    && ring->tail == __atomic_load_n(&ring->head,
+						     __ATOMIC_ACQUIRE)) {
+			*p = ring->next;
+			g_free(ring);
+			continue;
+		}
+		p = &ring->next;
+	}
+	pthread_mutex_unlock(&log_rings_mutex);
+
+	log_flush_files();
+}
+
+static gboolean log_pending(void)
+{
+	struct log_ring *ring;
+	gboolean pending = FALSE;
+
+	pthread_mutex_lock(&log_rings_mutex);
+	for (ring = log_rings; ring && !pending; ring = ring->next)
+		pending = ring->tail != __atomic_load_n(&ring->head,
+							__ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&log_rings_mutex);
+	return pending;
+}
+
+static void *log_writer(void *arg)
+{
+	struct pollfd pfd = { log_wake_pipe[0], POLLIN, 0 };
+	char buf[64];
+
+	set_speaking_thread_parameters();
+
+	while (!__atomic_load_n(&log_writer_stop, __ATOMIC_ACQUIRE)) {
+		pthread_mutex_lock(&logging_mutex);
+		log_drain();
 		pthread_mutex_unlock(&logging_mutex);
+
+		__atomic_store_n(&log_writer_sleeping, 1, __ATOMIC_SEQ_CST);
+		if (!log_pending())
+			poll(&pfd, 1, -1);
+		__atomic_store_n(&log_writer_sleeping, 0, __ATOMIC_SEQ_CST);
+		while (read(log_wake_pipe[0], buf, sizeof(buf)) > 0) ;
 	}
+	return NULL;
+}
+
+/* Starts writing the log from a thread of its own.  Must be called after
+ * daemon(), which does not keep threads. */
+void logging_start(void)
+{
+	if (log_writer_running)
+		return;
+	if (pipe(log_wake_pipe) == -1) {
+		MSG(2, "Can't create the log writer pipe: %s", strerror(errno));
+		return;
+	}
+	fcntl(log_wake_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(log_wake_pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(log_wake_pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(log_wake_pipe[1], F_SETFD, FD_CLOEXEC);
+	pthread_key_create(&log_ring_key, log_ring_orphan);
+
+	log_writer_stop = 0;
+	if (pthread_create(&log_writer_thread, NULL, log_writer, NULL)) {
+		MSG(2, "Can't create the log writer thread");
+		return;
+	}
+	__atomic_store_n(&log_writer_running, 1, __ATOMIC_RELEASE);
+}
+
+/* Writes the pending messages and goes back to writing them right away */
+void logging_stop(void)
+{
+	if (!log_writer_running)
+		return;
+	__atomic_store_n(&log_writer_running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&log_writer_stop, 1, __ATOMIC_RELEASE);
+	if (write(log_wake_pipe[1], "", 1) == -1 && errno != EAGAIN)
+		MSG(2, "Can't wake up the log writer: %s", strerror(errno));
+	pthread_join(log_writer_thread, NULL);
+	logging_flush();
+}
+
+/* Writes the messages queued so far */
+void logging_flush(void)
+{
+	pthread_mutex_lock(&logging_mutex);
+	log_drain();
+	pthread_mutex_unlock(&logging_mutex);
+}
+
+static void log_message(int level, int dest, const char *format,
+			va_list args)
+{
+	struct log_record rec;
+	char text[LOG_TEXT_MAX];
+	int n;
+
+	gettimeofday(&rec.tv, NULL);
+	n = vsnprintf(text, sizeof(text), format, args);
+	if (n < 0)
+		return;
+	rec.len = MIN((unsigned int)n, sizeof(text) - 1);
+	rec.level = level;
+	rec.dest = dest;
+
+	if (level > 0 && log_push(&rec, text))
+		return;
+
+	pthread_mutex_lock(&logging_mutex);
+	/* Keep the order of the queued messages */
+	log_drain();
+	log_write(&rec, text);
+	log_flush_files();
+	pthread_mutex_unlock(&logging_mutex);
+}
+
+/* Logging messages, level of verbosity is defined between 1 and 5,
+ * see documentation */
+void MSG2(int level, const char *kind, const char *format, ...)
+{
+	int dest = 0;
+	va_list args;
+
+	if (level <= SpeechdOptions.log_level)
+		dest |= LOG_STD;
+	if (kind != NULL && custom_log_kind != NULL && custom_logfile != NULL
+	    && !strcmp(kind, custom_log_kind))
+		dest |= LOG_CUSTOM;
+	if (!dest)
+		return;
+	if (SpeechdOptions.debug)
+		dest |= LOG_DEBUG;
+
+	va_start(args, format);
+	log_message(level, dest, format, args);
+	va_end(args);
 }
 
 /* The main logging function for Speech Dispatcher,
@@ -255,77 +508,32 @@ void MSG2(int level, const char *kind, const char *format, ...)
    5 less important. Loglevels after 4 can contain private
    data. -1 logs also to stderr. See Speech Dispatcher
    documentation */
-/* TODO: Define this in terms of MSG somehow. I don't
-   know how to pass '...' arguments to another C function */
 void MSG(int level, const char *format, ...)
 {
+	int dest = 0;
+	va_list args;
+
+	if (level <= SpeechdOptions.log_level)
+		dest |= LOG_STD;
+	if (SpeechdOptions.debug)
+		dest |= LOG_DEBUG;
+	if (!dest)
+		return;
+	assert((level >= -1) && (level <= 5));
+	if (level == -1)
+		dest |= LOG_STDERR;
 
-	if ((level <= SpeechdOptions.log_level)
-	    || (SpeechdOptions.debug)) {
-		va_list args;
-		int i;
-		pthread_mutex_lock(&logging_mutex);
-		{
-			/* Print timestamp */
-			{
-				time_t t;
-				char *tstr;
-				struct timeval tv;
-				t = time(NULL);
-				tstr = g_strdup(ctime(&t));
-				gettimeofday(&tv, NULL);
-				/* Remove the trailing \n */
-				assert(tstr);
-				assert(strlen(tstr) > 1);
-				assert((level >= -1) && (level <= 5));
-				tstr[strlen(tstr) - 1] = 0;
-				/* Write timestamps */
-				if (level <= SpeechdOptions.log_level)
-					fprintf(logfile, "[%s : %d] speechd: ",
-						tstr, (int)tv.tv_usec);
-				if (SpeechdOptions.debug)
-					fprintf(debug_logfile,
-						"[%s : %d] speechd: ", tstr,
-						(int)tv.tv_usec);
-				/*                fprintf(logfile, "[%s : %d] speechd: ",
-				   tstr, (int) tv.tv_usec); */
-				g_free(tstr);
-			}
-
-			for (i = 1; i < level; i++) {
-				fprintf(logfile, " ");
-			}
-			/* Log to ordinary logfile */
-			if (level <= SpeechdOptions.log_level) {
-				va_start(args, format);
-				vfprintf(logfile, format, args);
-				va_end(args);
-				fprintf(logfile, "\n");
-				fflush(logfile);
-			}
-			/* Log into debug logfile */
-			if (SpeechdOptions.debug) {
-				va_start(args, format);
-				vfprintf(debug_logfile, format, args);
-				va_end(args);
-				fprintf(debug_logfile, "\n");
-				fflush(debug_logfile);
-			}
-			/* Log also into stderr for loglevel -1 */
-			if (level == -1) {
-				va_start(args, format);
-				vfprintf(stderr, format, args);
-				va_end(args);
-				fprintf(stderr, "\n");
-				fflush(stderr);
-			}
-		}
-		pthread_mutex_unlock(&logging_mutex);
-	}
+	va_start(args, format);
+	log_message(level, dest, format, args);
+	va_end(args);
 }
 
 /* --- CLIENTS / CONNECTIONS MANAGING --- */
 
+/* A client which said BYE is given that long to read the rest of its
+   output, in ms */
+#define SPEECHD_CLOSE_TIMEOUT 2000
+
 /* Initialize sockets status table */
 int speechd_sockets_status_init(void)
 {
@@ -347,26 +555,64 @@ int speechd_socket_register(int fd)
 	speechd_socket = g_malloc(sizeof(TSpeechDSock));
 	speechd_socket->o_buf = NULL;
 	speechd_socket->o_bytes = 0;
+	speechd_socket->i_buf = NULL;
+	speechd_socket->i_bytes = 0;
+	speechd_socket->i_size = 0;
+	speechd_socket->n_replies = 0;
+	speechd_socket->n_passed_fds = 0;
 	speechd_socket->awaiting_data = 0;
 	speechd_socket->inside_block = 0;
+	speechd_socket->job = NULL;
+	speechd_socket->out = g_string_new(NULL);
+	speechd_socket->out_source = 0;
+	speechd_socket->out_dropped = 0;
+	speechd_socket->closing = 0;
+	speechd_socket->close_source = 0;
+	speechd_socket->tokens = SpeechdOptions.client_message_burst;
+	speechd_socket->tokens_time = g_get_monotonic_time();
 	fd_key = g_malloc(sizeof(int));
 	*fd_key = fd;
+	/* The speaking thread looks up the sockets to send events */
+	pthread_mutex_lock(&socket_com_mutex);
 	g_hash_table_insert(speechd_sockets_status, fd_key, speechd_socket);
+	pthread_mutex_unlock(&socket_com_mutex);
 	return 0;
 }
 
 /* Free a TSpeechDSock structure including it's data */
 void speechd_socket_free(TSpeechDSock * speechd_socket)
 {
+	int i;
+
+	if (speechd_socket->job)
+		server_forget_job(speechd_socket->job);
+	for (i = 0; i < speechd_socket->n_replies; i++)
+		g_free(speechd_socket->replies[i]);
+	for (i = 0; i < speechd_socket->n_passed_fds; i++)
+		close(speechd_socket->passed_fds[i]);
 	if (speechd_socket->o_buf)
 		g_string_free(speechd_socket->o_buf, 1);
+	if (speechd_socket->out_source)
+		g_source_remove(speechd_socket->out_source);
+	if (speechd_socket->close_source)
+		g_source_remove(speechd_socket->close_source);
+	if (speechd_socket->out->len > 0)
+		MSG(4, "Dropping %lu bytes the client did not read",
+		    (unsigned long)speechd_socket->out->len);
+	g_string_free(speechd_socket->out, 1);
+	g_free(speechd_socket->i_buf);
 	g_free(speechd_socket);
 }
 
 /* Unregister a socket for SSIP communication */
 int speechd_socket_unregister(int fd)
 {
-	return (!g_hash_table_remove(speechd_sockets_status, &fd));
+	int ret;
+
+	pthread_mutex_lock(&socket_com_mutex);
+	ret = !g_hash_table_remove(speechd_sockets_status, &fd);
+	pthread_mutex_unlock(&socket_com_mutex);
+	return ret;
 }
 
 /* Get a pointer to the TSpeechDSock structure for a given file descriptor */
@@ -375,6 +621,60 @@ TSpeechDSock *speechd_socket_get_by_fd(int fd)
 	return g_hash_table_lookup(speechd_sockets_status, &fd);
 }
 
+/* Replies are small and mostly answer a request the client waits on, so
+   Nagle's algorithm would only hold them back until the client's delayed
+   ACK. */
+static void speechd_tcp_setup(int client_socket)
+{
+	int flag = 1;
+
+	if (SpeechdOptions.tcp_nodelay
+	    && setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &flag,
+			  sizeof(flag)))
+		MSG(2, "Error: Can't set TCP_NODELAY: %s", strerror(errno));
+
+	if (SpeechdOptions.tcp_keepalive > 0) {
+		int idle = SpeechdOptions.tcp_keepalive;
+
+		if (setsockopt(client_socket, SOL_SOCKET, SO_KEEPALIVE, &flag,
+			       sizeof(flag)))
+			MSG(2, "Error: Can't set SO_KEEPALIVE: %s",
+			    strerror(errno));
+#ifdef TCP_KEEPIDLE
+		else if (setsockopt(client_socket, IPPROTO_TCP, TCP_KEEPIDLE,
+				    &idle, sizeof(idle)))
+			MSG(2, "Error: Can't set TCP_KEEPIDLE: %s",
+			    strerror(errno));
+#else
+		(void)idle;
+#endif
+	}
+
+	if (SpeechdOptions.tcp_send_buffer > 0) {
+		int size = SpeechdOptions.tcp_send_buffer * 1024;
+
+		if (setsockopt(client_socket, SOL_SOCKET, SO_SNDBUF, &size,
+			       sizeof(size)))
+			MSG(2, "Error: Can't set SO_SNDBUF: %s",
+			    strerror(errno));
+	}
+}
+
+/* The system user of a client of the local socket, or -1 */
+static int speechd_client_owner(int client_socket)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(client_socket, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0)
+		return cred.uid;
+	MSG(2, "Error: Can't get the credentials of the client: %s",
+	    strerror(errno));
+#endif
+	return -1;
+}
+
 /* activity is on server_socket (request for a new connection) */
 int speechd_connection_new(int server_socket)
 {
@@ -399,6 +699,14 @@ int speechd_connection_new(int server_socket)
 		SpeechdStatus.max_fd = client_socket;
 	MSG(4, "Adding client on fd %d", client_socket);
 
+	/* A client which doesn't read must not block us, what it does not
+	   take is kept in its output buffer */
+	fcntl(client_socket, F_SETFL,
+	      fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+
+	if (client_address.sin_family == AF_INET)
+		speechd_tcp_setup(client_socket);
+
 	speechd_socket_register(client_socket);
 
 	/* Create a record in fd_settings */
@@ -412,6 +720,8 @@ int speechd_connection_new(int server_socket)
 	}
 	new_fd_set->fd = client_socket;
 	new_fd_set->uid = ++SpeechdStatus.max_uid;
+	if (SpeechdOptions.multi_user && client_address.sin_family == AF_UNIX)
+		new_fd_set->owner = speechd_client_owner(client_socket);
 	p_client_socket = (int *)g_malloc(sizeof(int));
 	p_client_uid = (int *)g_malloc(sizeof(int));
 	p_client_uid2 = (int *)g_malloc(sizeof(int));
@@ -427,12 +737,34 @@ int speechd_connection_new(int server_socket)
 	MSG(4, "Data structures for client on fd %d created", client_socket);
 
 	client_count++;
+	metrics_count(METRICS_CONNECTIONS);
+	capture_connect(client_socket);
 	check_client_count();
 
 	return 0;
 
 }
 
+void speechd_connection_suspend(int fd)
+{
+	TFDSetElement *fdset_element = get_client_settings_by_fd(fd);
+
+	if (fdset_element != NULL && fdset_element->fd_source) {
+		g_source_remove(fdset_element->fd_source);
+		fdset_element->fd_source = 0;
+	}
+}
+
+void speechd_connection_resume(int fd)
+{
+	TFDSetElement *fdset_element = get_client_settings_by_fd(fd);
+
+	if (fdset_element != NULL && fdset_element->active
+	    && !fdset_element->fd_source)
+		fdset_element->fd_source =
+		    g_unix_fd_add(fd, G_IO_IN, client_process_incoming, NULL);
+}
+
 int speechd_connection_destroy(int fd)
 {
 	TFDSetElement *fdset_element;
@@ -445,10 +777,17 @@ int speechd_connection_destroy(int fd)
 	if (fdset_element != NULL) {
 		fdset_element->fd = -1;
 		fdset_element->active = 0;
-		g_source_remove(fdset_element->fd_source);
+		if (fdset_element->fd_source)
+			g_source_remove(fdset_element->fd_source);
 		/* The fdset_element will be freed and removed from the
 		   hash table as soon as the client no longer has any
 		   message in the queues, check out the speak() function */
+		if (fdset_element->paused) {
+			/* Let speak() put the messages it set aside for
+			   this client back into the queues */
+			g_atomic_int_set(&resume_requested, 1);
+			speaking_semaphore_post();
+		}
 	} else if (SPEECHD_DEBUG) {
 		DIE("Can't find settings for this client\n");
 	}
@@ -458,6 +797,7 @@ int speechd_connection_destroy(int fd)
 	g_hash_table_remove(fd_uid, &fd);
 
 	speechd_socket_unregister(fd);
+	capture_disconnect(fd);
 
 	MSG(4, "Closing clients file descriptor %d", fd);
 
@@ -476,6 +816,44 @@ int speechd_connection_destroy(int fd)
 	return 0;
 }
 
+/* The client which said BYE did not read the rest of its output in time */
+static gboolean speechd_connection_close_timeout(gpointer data)
+{
+	int fd = GPOINTER_TO_INT(data);
+	TSpeechDSock *speechd_socket = speechd_socket_get_by_fd(fd);
+
+	if (speechd_socket != NULL) {
+		speechd_socket->close_source = 0;
+		speechd_connection_destroy(fd);
+	}
+	return FALSE;
+}
+
+void speechd_connection_close(int fd)
+{
+	TSpeechDSock *speechd_socket;
+	int pending;
+
+	/* Nothing more is read from it, but it still gets the reply to BYE
+	   and what it did not read yet, see server_output_ready() */
+	speechd_connection_suspend(fd);
+	shutdown(fd, SHUT_RD);
+
+	pthread_mutex_lock(&socket_com_mutex);
+	speechd_socket = speechd_socket_get_by_fd(fd);
+	speechd_socket->closing = 1;
+	pending = speechd_socket->out->len > 0;
+	pthread_mutex_unlock(&socket_com_mutex);
+
+	if (pending)
+		speechd_socket->close_source =
+		    g_timeout_add(SPEECHD_CLOSE_TIMEOUT,
+				  speechd_connection_close_timeout,
+				  GINT_TO_POINTER(fd));
+	else
+		speechd_connection_destroy(fd);
+}
+
 static gboolean speechd_client_terminate(gpointer key, gpointer value, gpointer user)
 {
 	TFDSetElement *set;
@@ -558,6 +936,24 @@ void speechd_module_nodebug(gpointer data, gpointer user_data)
 	return;
 }
 
+/* How often to look for idle modules, in seconds */
+#define MODULE_IDLE_CHECK 5
+
+static gboolean speechd_stop_idle_modules(gpointer user_data)
+{
+	if (SpeechdOptions.module_lazy_load
+	    && SpeechdOptions.module_idle_timeout > 0)
+		stop_idle_output_modules((gint64) SpeechdOptions.module_idle_timeout
+					 * G_USEC_PER_SEC);
+	return TRUE;
+}
+
+static gboolean speechd_log_memory_usage(gpointer user_data)
+{
+	mem_usage_log();
+	return TRUE;
+}
+
 static gboolean speechd_reload_dead_modules(gpointer user_data)
 {
 	/* Reload dead modules */
@@ -608,19 +1004,29 @@ void speechd_options_init(void)
 
 void speechd_init()
 {
+	int i;
+
 	SpeechdStatus.max_uid = 0;
 	SpeechdStatus.max_gid = 0;
 
 	/* Initialize inter-thread comm pipe */
-	if (pipe(speaking_pipe)) {
-		MSG(1, "Speaking pipe creation failed (%s)", strerror(errno));
-		FATAL("Can't create pipe");
-	}
+	speaking_semaphore_init();
 
 	/* Initialize Speech Dispatcher priority queue */
 	MessageQueue = g_malloc0(sizeof(TSpeechDQueue));
 	if (MessageQueue == NULL)
 		FATAL("Couldn't allocate memory for MessageQueue.");
+	MessageQueue->p1 = g_queue_new();
+	MessageQueue->p2 = g_queue_new();
+	MessageQueue->p3 = g_queue_new();
+	MessageQueue->p4 = g_queue_new();
+	MessageQueue->p5 = g_queue_new();
+	for (i = 0; i < SPD_PROGRESS; i++)
+		MessageQueue->paused[i] = g_queue_new();
+	MessageQueue->by_uid = g_hash_table_new_full(g_direct_hash,
+						     g_direct_equal, NULL,
+						     speaking_client_messages_free);
+	last_p5_block = g_queue_new();
 
 	/* Initialize lists */
 	MessagePausedList = NULL;
@@ -640,7 +1046,6 @@ void speechd_init()
 
 	speechd_sockets_status_init();
 
-	pause_requested = 0;
 	resume_requested = 0;
 
 	/* Perform some functionality tests */
@@ -685,8 +1090,6 @@ void speechd_init()
 		    g_list_length(output_modules),
 		    g_list_length(output_modules) > 1 ? "s" : "");
 	}
-
-	last_p5_block = NULL;
 }
 
 static gint modules_compare (gconstpointer a, gconstpointer b)
@@ -745,22 +1148,56 @@ static gint modules_compare (gconstpointer a, gconstpointer b)
 	return strcmp(name_a, name_b);
 }
 
+static void *speechd_symbols_preload(void *data)
+{
+	char **languages = data;
+	char **language;
+
+	for (language = languages; *language; language++)
+		symbols_preprocessing_preload(*language);
+	g_strfreev(languages);
+
+	return NULL;
+}
+
+/* Build the symbol processors of the configured languages in the background */
+static void speechd_symbols_preload_start(void)
+{
+	GPtrArray *languages = g_ptr_array_new();
+	GHashTableIter iter;
+	gpointer language;
+
+	if (GlobalFDSet.msg_settings.voice.language)
+		g_ptr_array_add(languages,
+				g_strdup(GlobalFDSet.msg_settings.voice.language));
+	if (language_default_modules) {
+		g_hash_table_iter_init(&iter, language_default_modules);
+		while (g_hash_table_iter_next(&iter, &language, NULL))
+			g_ptr_array_add(languages, g_strdup(language));
+	}
+	g_ptr_array_add(languages, NULL);
+
+	if (spd_task_run(speechd_symbols_preload, languages->pdata) != 0) {
+		MSG(1, "Can't create the symbols preload thread");
+		g_strfreev((char **) languages->pdata);
+	}
+	g_ptr_array_free(languages, FALSE);
+}
+
 static gboolean speechd_load_configuration(gpointer user_data)
 {
 	configfile_t *configfile = NULL;
 	GList *detected_modules = NULL;
 
-	/* Clean previous configuration */
-	if (output_modules != NULL) {
-		g_list_foreach(output_modules, speechd_modules_terminate, NULL);
-		g_list_free(output_modules);
-		output_modules = NULL;
-	}
+	/* Clean previous configuration, the modules which do not change are
+	 * kept running by module_load_requested_modules() */
+	module_reload_begin();
 
 	/* Make sure there aren't any more child processes left */
 	while (waitpid(-1, NULL, WNOHANG) > 0) ;
 
 	/* Load new configuration */
+	symbols_preprocessing_reset();
 	load_default_global_set_options();
 
 	spd_num_options = 0;
@@ -784,6 +1221,8 @@ static gboolean speechd_load_configuration(gpointer user_data)
 		MSG(2, "Configuration has been read from \"%s\"",
 		    SpeechdOptions.conf_file);
 
+		output_probe_audio();
+
 		/* We need to load modules here, since this is called both by speechd_init
 		 * and to handle SIGHUP. */
 		if (module_number_of_requested_modules() < 1) {
@@ -821,10 +1260,25 @@ static gboolean speechd_load_configuration(gpointer user_data)
 		module_load_requested_modules();
 	} else {
 		MSG(1, "Can't open %s", SpeechdOptions.conf_file);
+		/* Nothing requested, unload the previous modules */
+		module_load_requested_modules();
 	}
 
 	free_config_options(spd_options, &spd_num_options);
 
+	if (SpeechdOptions.symbols_preload)
+		speechd_symbols_preload_start();
+
+	/* For our own playback thread, the modules get it when starting */
+	spd_playback_schedule_set(SpeechdOptions.audio_realtime_priority,
+				  SpeechdOptions.audio_cpus);
+
+	metrics_start();
+	capture_start();
+	pthread_mutex_lock(&element_free_mutex);
+	history_start();
+	pthread_mutex_unlock(&element_free_mutex);
+
 	return TRUE;
 }
 
@@ -1082,6 +1536,8 @@ void check_client_count(void)
 
 /* --- MAIN --- */
 
+/* The microbenchmarks link the rest of the server with their own main() */
+#ifndef SPEECHD_NO_MAIN
 int main(int argc, char *argv[])
 {
 	int ret;
@@ -1350,13 +1806,17 @@ int main(int argc, char *argv[])
 			return -1;
 	}
 
+	logging_start();
+
 	/* Set up the main loop and register signals */
         main_loop = g_main_loop_new(g_main_context_default(), FALSE);
 	g_unix_signal_add(SIGINT, speechd_quit, (void*) (uintptr_t) QUIT_SIGINT);
 	g_unix_signal_add(SIGTERM, speechd_quit, (void*) (uintptr_t) QUIT_SIGTERM);
 	g_unix_signal_add(SIGHUP, speechd_load_configuration, NULL);
 	g_unix_signal_add(SIGUSR1, speechd_reload_dead_modules, NULL);
+	g_unix_signal_add(SIGUSR2, speechd_log_memory_usage, NULL);
 	(void)signal(SIGPIPE, SIG_IGN);
+	g_timeout_add_seconds(MODULE_IDLE_CHECK, speechd_stop_idle_modules, NULL);
 
 	MSG(4, "Creating new thread for speak()");
 	ret = pthread_create(&speak_thread, NULL, speak, NULL);
@@ -1367,6 +1827,17 @@ int main(int argc, char *argv[])
 	ret = module_speak_queue_init(SpeechdOptions.max_queue_size, &status);
 	if (ret != 0)
 		FATAL("Speak queue thread failed: %s!\n", status);
+	if (SpeechdOptions.audio_queue_high_ms)
+		module_speak_queue_set_watermarks(SpeechdOptions.audio_queue_low_ms,
+						  SpeechdOptions.audio_queue_high_ms);
+	module_speak_queue_set_sound_icon_cache(
+		(size_t) SpeechdOptions.sound_icon_cache_size * 1024);
+	if (SpeechdOptions.sound_icon_preload_folder)
+		module_speak_queue_preload_sound_icons(
+			SpeechdOptions.sound_icon_preload_folder);
+	module_speak_queue_set_mix_gain(SpeechdOptions.sound_icon_mix_speech_gain,
+					SpeechdOptions.sound_icon_mix_gain);
+	module_speak_queue_set_first_write_callback(latency_first_write);
 
 	SpeechdStatus.max_fd = server_socket;
 
@@ -1402,8 +1873,10 @@ int main(int argc, char *argv[])
 
 	MSG(2, "Closing open output modules...");
 	/*  Call the close() function of each registered output module. */
+	module_deferred_join();
 	g_list_foreach(output_modules, speechd_modules_terminate, NULL);
 	g_list_free(output_modules);
+	output_modules = NULL;
 
 	MSG(2, "Closing server connection...");
 	if (close(server_socket) == -1)
@@ -1411,16 +1884,23 @@ int main(int argc, char *argv[])
 
 	MSG(4, "Removing pid file");
 	destroy_pid_file();
+	metrics_stop();
+	capture_stop();
+	pthread_mutex_lock(&element_free_mutex);
+	history_stop();
+	pthread_mutex_unlock(&element_free_mutex);
 
 	fflush(NULL);
 
 	g_main_loop_unref(main_loop);
 	main_loop = NULL;
 
+	logging_stop();
 	MSG(2, "Speech Dispatcher terminated correctly");
 
 	exit(0);
 }
+#endif /* SPEECHD_NO_MAIN */
 
 void check_locked(pthread_mutex_t * lock)
 {
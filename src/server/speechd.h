@@ -45,33 +45,16 @@
 #include <glib.h>
 #include <glib-unix.h>
 
-#include <semaphore.h>
-#include <sys/ipc.h>
-#include <sys/sem.h>
-
 #define SPEECHD_DEBUG 0
 
-/* Definition of semun needed for semaphore manipulation */
-/* TODO: This fixes compilation for Mac OS X but might not be a correct
-   solution for other platforms. A better check is needed, possibly including
-   _POSIX_C_SOURCE and friends*/
-#if (defined(__GNU_LIBRARY__) && !defined(_SEM_SEMUN_UNDEFINED)) || defined(__APPLE__)
-/* union semun is defined by including <sys/sem.h> */
-#else
-/* according to X/OPEN we have to define it ourselves */
-union semun {
-	int val;		/* value for SETVAL */
-	struct semid_ds *buf;	/* buffer for IPC_STAT, IPC_SET */
-	unsigned short int *array;	/* array for GETALL, SETALL */
-	struct seminfo *__buf;	/* buffer for IPC_INFO */
-};
-#endif
-
 #include <speechd_types.h>
 #include "module.h"
 #include "compare.h"
 #include "common.h"
 
+/* Shared copy of the string settings of a client, see alloc.c */
+typedef struct TFDSetStrings TFDSetStrings;
+
 typedef struct {
 	unsigned int uid;	/* Unique ID of the client */
 	int fd;			/* File descriptor the client is on. */
@@ -93,17 +76,31 @@ typedef struct {
 	int reparted;
 	unsigned int min_delay_progress;
 	int pause_context;	/* Number of words that should be repeated after a pause */
+	int sound_icon_mixing;	/* Sound icons may play over the current speech */
+	int audio_retrieval;	/* The audio is sent to the client, not played */
+	int coalescing;		/* A new message replaces the queued ones */
+	int index_mark_interval;	/* Minimum ms between index mark events */
 	char *index_mark;	/* Current index mark for the message (only if paused) */
 
 	char *audio_output_method;
 	char *audio_oss_device;
 	char *audio_alsa_device;
+	int audio_alsa_idle_timeout;	/* s to keep ALSA set up, 0 not to */
 	char *audio_nas_server;
 	char *audio_pulse_server;
 	char *audio_pulse_device;
 	int audio_pulse_min_length;
 	int log_level;
 
+	/* For a client, the cached shared copy of its string settings.
+	   For a message, the shared copy its string settings point into,
+	   or NULL if the message owns them. */
+	TFDSetStrings *strings;
+
+	/* For a client, how many SET all it caught up with, see set.c */
+	guint all_serial;
+	int owner;		/* its system user in MultiUser mode, or -1 */
+
 	/* TODO: Should be moved out */
 	unsigned int hist_cur_uid;
 	int hist_cur_pos;
@@ -119,6 +116,15 @@ typedef struct {
 /* Size of the buffer for socket communication */
 #define BUF_SIZE 128
 
+/* How much we try to read from a client socket at once */
+#define SOCKET_READ_SIZE 4096
+
+/* How many replies we collect before writing them to the client */
+#define MAX_PENDING_REPLIES 64
+
+/* How many file descriptors passed with SCM_RIGHTS are kept for SPEAK_FD */
+#define MAX_PASSED_FDS 8
+
 /* Mode of speechd execution */
 typedef enum {
 	SPD_MODE_DAEMON,	/* Run as daemon (background, ...) */
@@ -129,13 +135,37 @@ extern TSpeechDMode spd_mode;
 
 /*  TSpeechDQueue is a queue for messages. */
 typedef struct {
-	GList *p1;		/* important */
-	GList *p2;		/* text */
-	GList *p3;		/* message */
-	GList *p4;		/* notification */
-	GList *p5;		/* progress */
+	GQueue *p1;		/* important */
+	GQueue *p2;		/* text */
+	GQueue *p3;		/* message */
+	GQueue *p4;		/* notification */
+	GQueue *p5;		/* progress */
+	/* Messages of paused clients, set aside by get_message_from_queues()
+	   until their client is resumed or gone, indexed by priority - 1 */
+	GQueue *paused[SPD_PROGRESS];
+	/* Queued messages of each client, uid -> TClientMessages */
+	GHashTable *by_uid;
 } TSpeechDQueue;
 
+/* Queued messages of a client, see MessageQueue->by_uid */
+typedef struct {
+	GQueue messages;
+	gsize bytes;		/* of their texts, as they were queued */
+} TClientMessages;
+
+#include "latency.h"
+
+/* Subsystems whose memory is accounted, see mem_account() */
+typedef enum {
+	MEM_MESSAGES,		/* queued or being spoken */
+	MEM_HISTORY,		/* kept in history */
+	MEM_SYMBOLS,		/* symbols files and their processors */
+	MEM_SYMBOLS_CACHE,	/* processed texts */
+	MEM_VOICES,		/* voice lists of the modules */
+	MEM_AUDIO_RINGS,	/* audio shared with the modules */
+	MEM_SUBSYSTEMS
+} TMemSubsystem;
+
 /*  TSpeechDMessage is an element of TSpeechDQueue,
     that is, some text with or without index marks
     inside  and it's configuration. */
@@ -145,8 +175,23 @@ typedef struct {
 	char *buf;		/* the actual text */
 	int bytes;		/* number of bytes in buf */
 	TFDSetElement settings;	/* settings of the client when queueing this message */
+	GQueue *queue;		/* queue the message is waiting in, or NULL */
+	GList *link;		/* link of the message in queue */
+	GList *uid_link;	/* link of the message in the by_uid index */
+	gsize uid_bytes;	/* bytes it accounts for in the by_uid index */
+	GArray *index_marks;	/* offsets in buf after each index mark, or NULL */
+	int prepared;		/* buf was already prepared for the module */
+	TLatencyTrace latency;	/* when it went through each stage */
+	TMemSubsystem mem_subsystem;	/* where mem_bytes are accounted */
+	gsize mem_bytes;	/* accounted by mem_account_message(), or 0 */
+	int segment;		/* SEGMENT_* when part of a split message */
 } TSpeechDMessage;
 
+/* Parts of a long message split by the server, see queue_text_message() */
+#define SEGMENT_MORE	1	/* more parts follow */
+#define SEGMENT_CONT	2	/* continues the previous part */
+#define SEGMENT_SILENT	4	/* the cancel of the message was reported */
+
 #include "alloc.h"
 #include "speaking.h"
 
@@ -157,6 +202,9 @@ extern struct SpeechdOptions {
 	int socket_path_set;
 	int port, port_set;
 	int localhost_access_only, localhost_access_only_set;
+	int tcp_nodelay;	/* don't delay small replies to inet clients */
+	int tcp_keepalive;	/* s of idleness before probing them, 0 for none */
+	int tcp_send_buffer;	/* kB of socket send buffer, 0 for the default */
 	int log_level, log_level_set;
 	char *pid_file;
 	char *conf_file;
@@ -173,8 +221,42 @@ extern struct SpeechdOptions {
 	char *debug_logfile;
 	int max_history_messages;	/* Maximum of messages in history before they expire */
 	int max_queue_size;
+	int audio_ring_size;	/* kB of shared memory for module audio, 0 for none */
+	int audio_queue_low_ms;	/* Speak queue watermarks, 0 to bound by MaxQueueSize */
+	int audio_queue_high_ms;
+	int audio_look_ahead;	/* synthesize the next message while playing */
+	int speak_segment_length;	/* split longer text messages, in bytes */
+	int audio_realtime_priority;	/* SCHED_FIFO priority of playback */
+	char *audio_cpus;	/* CPUs to play audio on, NULL for any */
+	int synthesis_nice;	/* nice level of the module threads */
+	char *synthesis_cpus;	/* CPUs to synthesize on, NULL for any */
+	int audio_sample_rate;	/* Hz the server plays at, 0 for the module's */
+	int audio_server_volume;	/* scale audio instead of the synthesizers */
+	char *audio_file_path;	/* where the file output method writes */
+	char *audio_rtp_destination;	/* host:port the rtp one streams to */
+	int audio_sink_real_time;	/* pace them as if they played the audio */
+	int symbols_preload;	/* build symbol processors at startup */
+	int module_lazy_load;	/* start modules only when they are needed */
+	int module_idle_timeout;	/* s before stopping unused lazy modules */
+	int module_deferred_start;	/* start modules while already serving */
+	int multi_user;		/* keep the clients of each system user apart,
+				   not configurable until their audio and
+				   priorities are kept apart too */
+	int sound_icon_cache_size;	/* kB of decoded sound icons to keep */
+	char *sound_icon_preload_folder;	/* also where mixed icons are found */
+	int sound_icon_mix_speech_gain;	/* percent */
+	int sound_icon_mix_gain;
 	int server_timeout;
 	int server_timeout_set;
+	int client_output_limit;	/* kB of output kept for a stalled client */
+	int client_message_rate;	/* messages/s a client may send, 0 for any */
+	int client_message_burst;	/* messages it may send at once above that */
+	int client_queue_messages;	/* messages a client may have queued, 0 for any */
+	int client_queue_size;	/* kB of text a client may have queued, 0 for any */
+	int notification_expiry;	/* s before unspoken notifications are dropped */
+	int metrics_interval;	/* s between writes of the metrics file, 0 for none */
+	char *protocol_capture_file;	/* where SSIP sessions are recorded */
+	char *history_file;	/* where the history of messages is kept */
 } SpeechdOptions;
 
 extern struct SpeechdStatus {
@@ -187,9 +269,11 @@ extern struct SpeechdStatus {
 extern pthread_t speak_thread;
 extern pthread_mutex_t logging_mutex;
 extern pthread_mutex_t element_free_mutex;
-extern pthread_mutex_t output_layer_mutex;
 extern pthread_mutex_t socket_com_mutex;
 
+/* Number of connected clients */
+extern int client_count;
+
 /* Table of all configured (and succesfully loaded) output modules */
 extern GList *output_modules;
 
@@ -209,7 +293,7 @@ extern GList *MessagePausedList;
 extern GList *client_specific_settings;
 
 /* Saves the last received priority progress message */
-extern GList *last_p5_block;
+extern GQueue *last_p5_block;
 
 /* Global default settings */
 extern TFDSetElement GlobalFDSet;
@@ -224,6 +308,23 @@ typedef struct {
 	int inside_block;
 	size_t o_bytes;
 	GString *o_buf;
+	char *i_buf;		/* Data read from the socket but not parsed yet */
+	size_t i_bytes;		/* Number of bytes waiting in i_buf */
+	size_t i_size;		/* Allocated size of i_buf (without the trailing 0) */
+	char *replies[MAX_PENDING_REPLIES];	/* Replies not sent yet */
+	int n_replies;
+	int passed_fds[MAX_PASSED_FDS];	/* Received, not claimed by SPEAK_FD yet */
+	int n_passed_fds;
+	struct TServerJob *job;	/* Command run by a worker, see server_defer() */
+	/* The rest is shared with the speaking thread, under socket_com_mutex */
+	GString *out;		/* Output the client did not take yet */
+	guint out_source;	/* Watch for writing out, 0 when out is empty */
+	int out_dropped;	/* Events dropped since out got full */
+	int closing;		/* Said BYE, closed once out is written */
+	guint close_source;	/* Timeout closing it anyway */
+	double tokens;		/* Messages the client may send now, see
+				   server_admit_message() */
+	gint64 tokens_time;	/* When tokens was last refilled */
 } TSpeechDSock;
 int speechd_sockets_status_init(void);
 int speechd_socket_register(int fd);
@@ -251,6 +352,11 @@ int isanum(const char *str);
 /* Functions used in speechd.c only */
 int speechd_connection_new(int server_socket);
 int speechd_connection_destroy(int fd);
+/* The client on fd said BYE: close it once it has what it did not read */
+void speechd_connection_close(int fd);
+/* Stop and start again reading the commands of the client on fd */
+void speechd_connection_suspend(int fd);
+void speechd_connection_resume(int fd);
 void speechd_modules_terminate(gpointer data, gpointer user_data);
 void speechd_modules_reload(gpointer data, gpointer user_data);
 void speechd_modules_debug(void);
@@ -262,6 +368,9 @@ int create_pid_file(void);
 void destroy_pid_file(void);
 
 void logging_init(void);
+void logging_start(void);
+void logging_stop(void);
+void logging_flush(void);
 
 void check_locked(pthread_mutex_t * lock);
 
@@ -0,0 +1,236 @@
+/*
+ * ssml.c - SSML texts split into their text and their tags
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * We need not ever speak the SSML syntax, so we need to skip the tags.
+ *
+ * For lookbehind and lookahead rules of the symbols to be able to run, we
+ * have to really remove the tags from the text, but we want to remember
+ * where they were.
+ *
+ * We thus build an array of the positions of the tags, that the replacement
+ * function will update, so we know where to put back the tags.  Putting
+ * them back is also when index marks get inserted, so that the text does
+ * not have to be parsed again for them.
+ *
+ * Alongside, we also have to untranslate/translate the xml entities for tag
+ * characters.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#include "ssml.h"
+#include "index_marking.h"
+
+SsmlText *ssml_parse(const gchar *text)
+{
+	const gchar *cur, *curtag = NULL;
+	SsmlText *ssml;
+	GArray *tags;
+	SsmlTags block = { 0, 0, 0, NULL };
+	GString *str;
+	gchar name[7];		/* Current tag name, only need to recognize against "mark", "/mark", "!--" for now */
+	gsize namepos = 0;
+
+	int filling_tag = 0;	/* Whether we are stack tags, or text */
+	int in_tag = 0;		/* Whether we are within a tag */
+	int in_tag_name = 0;	/* Whether we are within the name part of a tag */
+	int in_apos = 0;	/* Whether we are within a '' string in a tag */
+	int in_quote = 0;	/* Whether we are within a "" string in a tag */
+
+	tags = g_array_new(FALSE, FALSE, sizeof(SsmlTags));
+	str = g_string_sized_new(strlen(text));
+
+	for (cur = text; *cur; cur++) {
+		guchar c = *cur;
+
+		if (!in_tag) {
+			if (c == '<') {
+				in_tag = 1;
+				in_tag_name = 1;
+				namepos = 0;
+				if (!filling_tag) {
+					/* Note the tags position in the text */
+					block.pos = str->len;
+					/* A priori only deferrable tags */
+					block.deferrable = 1;
+					curtag = cur;
+					filling_tag = 1;
+				}
+			} else {
+				if (filling_tag) {
+					/* Some text, dump the tags and switch to text */
+					block.tags = g_strndup(curtag, cur - curtag);
+					g_array_append_val(tags, block);
+					filling_tag = 0;
+				}
+
+				if (c == '&') {
+					/* Unescape ssml character sequences */
+					if (!strncmp(cur, "&quot;", 6)) {
+						cur += 5;
+						g_string_append_c(str, '"');
+					} else if (!strncmp(cur, "&apos;", 6)) {
+						cur += 5;
+						g_string_append_c(str, '\'');
+					} else if (!strncmp(cur, "&lt;", 4)) {
+						cur += 3;
+						g_string_append_c(str, '<');
+					} else if (!strncmp(cur, "&gt;", 4)) {
+						cur += 3;
+						g_string_append_c(str, '>');
+					} else if (!strncmp(cur, "&amp;", 5)) {
+						cur += 4;
+						g_string_append_c(str, '&');
+					} else
+						g_string_append_c(str, c);
+				} else {
+					/* Pure text, append as such */
+					g_string_append_c(str, c);
+				}
+			}
+		} else {
+			if (in_apos) {
+				if (c == '\'')
+					in_apos = 0;
+			} else if (in_quote) {
+				if (c == '"')
+					in_quote = 0;
+			} else if (c == '\'') {
+				in_apos = 1;
+			} else if (c == '"') {
+				in_quote = 1;
+			} else {
+				if (in_tag_name) {
+					if (c == '>' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+						in_tag_name = 0;
+						name[namepos] = '\0';
+						if (strcmp(name, "mark")
+						 && strcmp(name, "/mark")
+						 && strcmp(name, "mark/")
+						 && strcmp(name, "!--")) {
+							/* This is a non-deferrable tag */
+							block.deferrable = 0;
+						}
+					} else {
+						if (namepos < sizeof(name) - 1) {
+							name[namepos++] = c;
+						}
+					}
+				}
+				if (c == '>')
+					in_tag = 0;
+			}
+		}
+	}
+	/* Trailing tags content */
+	if (filling_tag) {
+		block.tags = g_strndup(curtag, cur - curtag);
+		g_array_append_val(tags, block);
+	}
+
+	ssml = g_new(SsmlText, 1);
+	ssml->text = g_string_free(str, FALSE);
+	ssml->ntags = tags->len;
+	ssml->tags = (SsmlTags *) g_array_free(tags, FALSE);
+
+	return ssml;
+}
+
+/* The characters which get escaped again */
+static const char ssml_escaped[] = "\"'<>&";
+
+gchar *ssml_serialize(const SsmlText *ssml, GArray *marks)
+{
+	GString *str;
+	const gchar *text = ssml->text;
+	const gchar *cur;
+	const SsmlTags *curtags = ssml->tags;
+	gint ntags = ssml->ntags;
+	gsize len = strlen(text);
+	guint offset;
+
+	str = g_string_sized_new(len + len / 4 + 32);
+
+	for (cur = text; *cur; cur++) {
+		guchar c;
+
+		while (ntags && cur - text == curtags->pos) {
+			/* We reached the position of a block of tags, put them back */
+			g_string_append(str, curtags->tags);
+			curtags++;
+			ntags--;
+		}
+
+		c = *cur;
+
+		/* Re-escape ssml character sequences */
+		if (c == '"')
+			g_string_append(str, "&quot;");
+		else if (c == '\'')
+			g_string_append(str, "&apos;");
+		else if (c == '<')
+			g_string_append(str, "&lt;");
+		else if (c == '>')
+			g_string_append(str, "&gt;");
+		else if (c == '&')
+			g_string_append(str, "&amp;");
+		else
+			g_string_append_c(str, c);
+
+		/* The end of a sentence, if followed by a tag, an entity or a
+		   space, see index_mark_boundary() */
+		if (marks != NULL && (c == '.' || c == '?' || c == '!')
+		    && ((ntags && cur + 1 - text == curtags->pos)
+			|| (cur[1] != '\0'
+			    && (strchr(ssml_escaped, cur[1])
+				|| g_unichar_isspace(g_utf8_get_char(cur + 1)))))) {
+			g_string_append_printf(str, SD_MARK_HEAD "%u" SD_MARK_TAIL,
+					       marks->len);
+			offset = str->len;
+			g_array_append_val(marks, offset);
+		}
+	}
+
+	while (ntags) {
+		/* Trailing tags */
+		g_string_append(str, curtags->tags);
+		curtags++;
+		ntags--;
+	}
+
+	return g_string_free(str, FALSE);
+}
+
+void ssml_text_free(SsmlText *ssml)
+{
+	gint i;
+
+	if (ssml == NULL)
+		return;
+	for (i = 0; i < ssml->ntags; i++)
+		g_free(ssml->tags[i].tags);
+	g_free(ssml->tags);
+	g_free(ssml->text);
+	g_free(ssml);
+}
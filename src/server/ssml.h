@@ -0,0 +1,51 @@
+/*
+ * ssml.h - SSML texts split into their text and their tags
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This software is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef SSML_H
+#define SSML_H
+
+#include <glib.h>
+
+/* A block of consecutive tags, found at some position of the text */
+typedef struct {
+	gsize pos;		/* Its position in the text */
+	gssize shift;		/* How much its position is shifted by the current replacements */
+	gint deferrable;	/* Whether it is fine to defer the tag (e.g. a mark or comment) */
+	gchar *tags;		/* The content of the tags */
+} SsmlTags;
+
+/* An SSML text parsed once: the text with the entities of the tag
+ * characters replaced, and where the tags were.  The positions of the tags
+ * can be updated while the text gets changed, e.g. by the symbols. */
+typedef struct {
+	gchar *text;
+	SsmlTags *tags;		/* In the order of their positions */
+	gint ntags;
+} SsmlText;
+
+SsmlText *ssml_parse(const gchar *ssml);
+
+/* Put the tags back into the text and return it as SSML again.  If marks is
+ * not NULL, index marks are also put at the ends of the sentences, and
+ * their offsets are appended to it, as insert_index_marks() does. */
+gchar *ssml_serialize(const SsmlText *ssml, GArray *marks);
+
+void ssml_text_free(SsmlText *ssml);
+
+#endif /* SSML_H */
@@ -33,11 +33,16 @@
  * a file (both simple and complex) are loaded into a SpeechSymbols (note the
  * plural form) structure.
  *
- * The loaded symbols are compiled into GLib PCRE regular expressions
- * (originally a Python one, but they are compatible enough) and converted to
- * a fully usable form into a list of SpeechSymbolProcessor.  These processors
- * are then usable to pre-process an input text with
- * speech_symbols_processor_process_text().
+ * Parsing the files takes a while for the bigger ones, so at installation
+ * they are compiled by speech-dispatcher --compile-symbols into a binary form
+ * next to them (see symbols_compile_dir()), which speech_symbols_new() just
+ * maps and copies when it is still up to date with the text file.
+ *
+ * The loaded symbols are converted to a fully usable form into a list of
+ * SpeechSymbolProcessor: simple symbols go into a trie, and complex symbols
+ * are compiled into a GLib PCRE regular expression (originally a Python one,
+ * but they are compatible enough).  These processors are then usable to
+ * pre-process an input text with speech_symbols_processor_process_text().
  *
  * The loading steps are automatically handled when calling
  * speech_symbols_processor_new().  To avoid re-processing files more than
@@ -52,10 +57,19 @@
  * This loading is aware of locale strings syntax and will fallback on the
  * language code alone if the language-country combo isn't found.
  *
- * WARNING: this module is NOT thread-safe.  Most notably, the caches are not
- * thread-safe, so the public API insert_symbols() shouldn't be balled from
- * several threads at once.  This should not be an issue, as it is supposed to
- * be called from the speak thread only.
+ * The results of insert_symbols() for the last texts are also kept in an LRU
+ * cache, since screen readers keep sending the same strings.
+ *
+ * insert_symbols() can be called from any thread.  Processors are never
+ * modified once built, they are shared with a reference count, which keeps
+ * them alive while a text is being processed even if the configuration gets
+ * reloaded meanwhile.  symbols_mutex protects the caches, and is only held to
+ * look them up or change them.  symbols_build_mutex is held while building
+ * processors (and thus while using G_symbols_dicts and symbols_files), so
+ * that building the processors of a new locale does not hold the users of
+ * the other ones.  With SymbolsPreprocPreload, the processors of the
+ * configured languages are built by a thread at startup, so that the first
+ * message does not wait for them.
  *
  * This file is mostly a 1:1 translation of NVDA's python code doing the same
  * thing, with slight simplifications or adaptations for C, and removal of
@@ -73,16 +87,11 @@
 #endif
 
 #include <ctype.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "symbols.h"
-
-/* This denotes the position of some SSML tags */
-struct tags {
-	gsize pos;		/* Its position in the text */
-	gssize shift;		/* How much its position is shifted by the current replacements */
-	gint deferrable;	/* Whether it is fine to defer the tag (e.g. a mark or comment) */
-	gchar *tags;		/* The content of the tags */
-};
+#include "ssml.h"
 
 /* Speech symbol preserve modes */
 typedef enum {
@@ -114,6 +123,7 @@ typedef struct {
 	GSList *complex_symbols;
 	/* table of identifier(string):symbol(SpeechSymbol) */
 	GHashTable *symbols;
+	gsize mem_bytes;	/* accounted in MEM_SYMBOLS once loaded, or 0 */
 } SpeechSymbols;
 
 /* Describes a name->value translation for a field that should be loaded
@@ -123,25 +133,52 @@ typedef struct {
 	int value;
 } IntFieldDesc;
 
+/* A node of the trie of simple symbol identifiers, one per byte */
+typedef struct {
+	guint child;		/* first node for the next byte, 0 if none */
+	guint sibling;		/* next node for another byte at this depth */
+	guchar byte;
+	SpeechSymbol *sym;	/* symbol whose identifier ends here, or NULL */
+} SymbolTrieNode;
+
 /* Represents a loaded and cached set of symbols in a usable form */
 typedef struct {
 	gchar *source;
 
-	struct tags *tags; /* tags attached to the text */
-	gint ntags; /* number of elements in tags array */
-
-	GRegex *regex; /* compiled regular expression for parsing input */
+	GRegex *regex; /* compiled regular expression for complex symbols, or NULL */
+	/* Trie of the simple symbols, node 0 is unused so that 0 means none */
+	GArray *trie;
+	guint trie_root[256];
 	/* Table of identifier(string):symbol(SpeechSymbol).
 	 * Indexes are pointers to symbol->identifier. */
 	GHashTable *symbols;
 	/* list of SpeechSymbol (weak pointers to entries in @c symbols) */
 	GSList *complex_list;
+	gsize mem_bytes;	/* accounted in MEM_SYMBOLS once built, or 0 */
+} SpeechSymbolProcessor;
+
+/* A list of SpeechSymbolProcessor, shared between their users */
+typedef struct {
+	gint refs;
+	GSList *list;
+	/* What single characters become at SYMLVL_CHAR, indexed by
+	 * symbols_char_key(), under symbols_mutex */
+	GHashTable *chars;
+} SpeechSymbolProcessors;
+
+/* State of the processing of a text by a SpeechSymbolProcessor, which itself
+ * is left untouched */
+typedef struct {
+	const SpeechSymbolProcessor *ssp;
+
+	SsmlTags *tags; /* tags attached to the text */
+	gint ntags; /* number of elements in tags array */
 
 	/* Level requested by user */
 	SymLvl level;
 	/* Level to be supported */
 	SymLvl support_level;
-} SpeechSymbolProcessor;
+} SpeechSymbolPass;
 
 /* Map of locale code to arbitrary data. */
 typedef GHashTable LocaleMap;
@@ -151,12 +188,24 @@ typedef gpointer (*LocaleMapCreateDataFunc) (const gchar *locale, const gchar *f
 
 /* Map of SpeechSymbols, indexed by their locale and file */
 static LocaleMap *G_symbols_dicts = NULL;
-/* Map of SpeechSymbolProcessor lists, indexed by their locale */
+/* Map of SpeechSymbolProcessors, indexed by their locale */
 static LocaleMap *G_processors = NULL;
+/* Locales for which no processors could be built, so that the language
+ * alone is used for them without trying again */
+static GHashTable *G_processors_missing = NULL;
 
 /* List of files to load */
 static GSList *symbols_files;
 
+/* Held while using or changing G_processors and the result cache */
+static pthread_mutex_t symbols_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Held while building processors, before symbols_mutex if both are needed */
+static pthread_mutex_t symbols_build_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Changed whenever the caches are dropped */
+static guint symbols_generation;
+
+static void symbols_cache_clear(void);
+
 SymLvl str2SymLvl(const char *str)
 {
 	SymLvl punct;
@@ -236,228 +285,6 @@ static gpointer locale_map_fetch(LocaleMap *map, const gchar *locale, const gcha
 	return NULL;
 }
 
-/*--------------------- Escaping xml tags in ssml text ----------------------*/
-
-/*
- * We need not ever speak the SSML syntax, so we need to skip the tags.
- *
- * For lookbehind and lookahead rules to be able to run, we have to really
- * remove the tags from the text, but we want to remember where they were.
- *
- * We thus build an array of the positions of the tags, that the replacement
- * function will update, so we know where to put back the tags.
- *
- * Alongside, we also have to untranslate/translate the xml entities for tag characters.
- */
-
-/* Move tags off from the text */
-static gchar *escape_ssml_text(const gchar *text, struct tags **tags_ret, gint *ntags_ret)
-{
-	const gchar *cur, *curtag = NULL;
-	struct tags *tags;
-	GString *str;
-	gchar name[7];		/* Current tag name, only need to recognize against "mark", "/mark", "!--" for now */
-	gsize namepos = 0;
-
-	int filling_tag;	/* Whether we are stack tags, or text */
-	int in_tag;		/* Whether we are within a tag */
-	int in_tag_name;	/* Whether we are within the name part of a tag */
-	int in_apos;		/* Whether we are within a '' string in a tag */
-	int in_quote;		/* Whether we are within a "" string in a tag */
-	gint ntags;
-
-	/* First count how many blocks of tags we will have */
-	filling_tag = 0;
-	in_tag = 0;
-	in_tag_name = 0;
-	in_apos = 0;
-	in_quote = 0;
-	ntags = 0;
-
-	for (cur = text; *cur; cur++) {
-		guchar c = *cur;
-	
-		if (!in_tag) {
-			if (c == '<') {
-				in_tag = 1;
-				if (!filling_tag) {
-					ntags++;
-					filling_tag = 1;
-				}
-			} else {
-				/* Some text, switch to text */
-				filling_tag = 0;
-			}
-		} else {
-			if (in_apos) {
-				if (c == '\'')
-					in_apos = 0;
-			} else if (in_quote) {
-				if (c == '"')
-					in_quote = 0;
-			} else if (c == '\'') {
-				in_apos = 1;
-			} else if (c == '"') {
-				in_quote = 1;
-			} else if (c == '>') {
-				in_tag = 0;
-			}
-		}
-	}
-
-	/* We can now allocate the array of blocks of tags and restart over, this time filling text and tags */
-	tags = malloc(ntags * sizeof(*tags));
-
-	filling_tag = 0;
-	in_tag = 0;
-	in_apos = 0;
-	in_quote = 0;
-	ntags = 0;
-
-	str = g_string_sized_new(strlen(text));
-
-	for (cur = text; *cur; cur++) {
-		guchar c = *cur;
-
-		if (!in_tag) {
-			if (c == '<') {
-				in_tag = 1;
-				in_tag_name = 1;
-				namepos = 0;
-				if (!filling_tag) {
-					/* Note the tags position in the text */
-					tags[ntags].pos = str->len;
-					/* A priori only deferrable tags */
-					tags[ntags].deferrable = 1;
-					curtag = cur;
-					filling_tag = 1;
-				}
-			} else {
-				if (filling_tag) {
-					/* Some text, dump the tags and switch to text */
-					tags[ntags].tags = g_strndup(curtag, cur - curtag);
-					ntags++;
-					filling_tag = 0;
-				}
-
-				if (c == '&') {
-					/* Unescape ssml character sequences */
-					if (!strncmp(cur, "&quot;", 6)) {
-						cur += 5;
-						g_string_append_c(str, '"');
-					} else if (!strncmp(cur, "&apos;", 6)) {
-						cur += 5;
-						g_string_append_c(str, '\'');
-					} else if (!strncmp(cur, "&lt;", 4)) {
-						cur += 3;
-						g_string_append_c(str, '<');
-					} else if (!strncmp(cur, "&gt;", 4)) {
-						cur += 3;
-						g_string_append_c(str, '>');
-					} else if (!strncmp(cur, "&amp;", 5)) {
-						cur += 4;
-						g_string_append_c(str, '&');
-					} else
-						g_string_append_c(str, c);
-				} else {
-					/* Pure text, append as such */
-					g_string_append_c(str, c);
-				}
-			}
-		} else {
-			if (in_apos) {
-				if (c == '\'')
-					in_apos = 0;
-			} else if (in_quote) {
-				if (c == '"')
-					in_quote = 0;
-			} else if (c == '\'') {
-				in_apos = 1;
-			} else if (c == '"') {
-				in_quote = 1;
-			} else {
-				if (in_tag_name) {
-					if (c == '>' || c == ' ' || c == '\t' || c == '\r' || c == '\n') {
-						in_tag_name = 0;
-						name[namepos] = '\0';
-						if (strcmp(name, "mark")
-						 && strcmp(name, "/mark")
-						 && strcmp(name, "mark/")
-						 && strcmp(name, "!--")) {
-							/* This is a non-deferrable tag */
-							tags[ntags].deferrable = 0;
-						}
-					} else {
-						if (namepos < sizeof(name) - 1) {
-							name[namepos++] = c;
-						}
-					}
-				}
-				if (c == '>')
-					in_tag = 0;
-			}
-		}
-	}
-	/* Trailing tags content */
-	if (filling_tag) {
-		tags[ntags].tags = g_strndup(curtag, cur - curtag);
-		ntags++;
-	}
-
-	*tags_ret = tags;
-	*ntags_ret = ntags;
-
-	return g_string_free(str, FALSE);
-}
-
-/* Put back tags into the text */
-static gchar *unescape_ssml_text(const gchar *text, struct tags *tags, gint ntags)
-{
-	GString *str;
-	const gchar *cur;
-	struct tags *curtags = tags;
-
-	str = g_string_sized_new(strlen(text));
-
-	for (cur = text; *cur; cur++) {
-		guchar c;
-
-		while (ntags && cur - text == curtags->pos) {
-			/* We reached the position of a block of tags, put them back */
-			g_string_append(str, curtags->tags);
-			curtags++;
-			ntags--;
-		}
-
-		c = *cur;
-
-		/* Re-escape ssml character sequences */
-		if (c == '"')
-			g_string_append(str, "&quot;");
-		else if (c == '\'')
-			g_string_append(str, "&apos;");
-		else if (c == '<')
-			g_string_append(str, "&lt;");
-		else if (c == '>')
-			g_string_append(str, "&gt;");
-		else if (c == '&')
-			g_string_append(str, "&amp;");
-		else
-			g_string_append_c(str, c);
-	}
-
-	while (ntags) {
-		/* Trailing tags */
-		g_string_append(str, curtags->tags);
-		curtags++;
-		ntags--;
-	}
-
-	free(tags);
-
-	return g_string_free(str, FALSE);
-}
-
 /*----------------- Speech symbol representation and loading ----------------*/
 
 static SpeechSymbol *speech_symbol_new(void)
@@ -483,6 +310,26 @@ static void speech_symbol_free(SpeechSymbol *sym)
 	g_slice_free1(sizeof *sym, sym);
 }
 
+/* Approximate bytes taken by a table of identifier:SpeechSymbol, the hash
+ * table itself counting for 3 pointers per entry */
+static gsize speech_symbols_table_size(GHashTable *symbols)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	gsize bytes = 0;
+
+	g_hash_table_iter_init(&iter, symbols);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		const SpeechSymbol *sym = value;
+
+		bytes += sizeof(*sym) + 3 * sizeof(gpointer)
+		    + mem_strsize(key) + mem_strsize(sym->pattern)
+		    + mem_strsize(sym->replacement)
+		    + mem_strsize(sym->display_name);
+	}
+	return bytes;
+}
+
 /* checks whether the line should be skipped: either blank or commented */
 static int skip_line(const char *line)
 {
@@ -690,30 +537,394 @@ static int speech_symbols_load(SpeechSymbols *ss, const char *filename, gboolean
 	return 0;
 }
 
+static SpeechSymbols *speech_symbols_alloc(void)
+{
+	SpeechSymbols *ss = g_malloc(sizeof *ss);
+
+	ss->complex_symbols = NULL;
+	ss->source = NULL;
+	ss->mem_bytes = 0;
+	ss->symbols = g_hash_table_new_full(g_str_hash, g_str_equal,
+					    g_free,
+					    (GDestroyNotify) speech_symbol_free);
+
+	return ss;
+}
+
 static void speech_symbols_free(SpeechSymbols *ss)
 {
+	if (ss->mem_bytes)
+		mem_account(MEM_SYMBOLS, -(gssize) ss->mem_bytes, -1);
 	g_slist_free_full(ss->complex_symbols, (GDestroyNotify) g_strfreev);
 	g_hash_table_destroy(ss->symbols);
 	g_free(ss->source);
 	g_free(ss);
 }
 
+/*----------------------- Precompiled symbols files --------------------------*/
+
+/* A compiled file is made of a SymbolsCompiledHeader, n_complex
+ * SymbolsCompiledComplex, n_symbols SymbolsCompiledSymbol, and strings_size
+ * bytes of NUL-terminated strings, which the records refer to by their
+ * offset.  It is in the native byte order, as it is generated on the machine
+ * itself, and the magic would not match otherwise. */
+
+#define SYMBOLS_COMPILED_SUFFIX ".bin"
+#define SYMBOLS_COMPILED_MAGIC 0x53505359	/* "SPSY" */
+#define SYMBOLS_COMPILED_VERSION 1
+#define SYMBOLS_COMPILED_NONE G_MAXUINT32	/* offset of a NULL string */
+
+typedef struct {
+	guint32 magic;
+	guint32 version;
+	/* the text file this was compiled from */
+	gint64 source_mtime;
+	guint64 source_size;
+	guint32 n_complex;
+	guint32 n_symbols;
+	guint32 strings_size;
+	guint32 padding;
+} SymbolsCompiledHeader;
+
+typedef struct {
+	guint32 identifier;
+	guint32 pattern;
+} SymbolsCompiledComplex;
+
+typedef struct {
+	guint32 identifier;
+	guint32 replacement;
+	guint32 display_name;
+	gint32 level;
+	gint32 preserve;
+} SymbolsCompiledSymbol;
+
+/* Whether the level and preserve mode are ones the text loader can give */
+static gboolean symbols_compiled_modes_valid(gint32 level, gint32 preserve)
+{
+	switch (level) {
+	case SYMLVL_INVALID:
+	case SYMLVL_NONE:
+	case SYMLVL_SOME:
+	case SYMLVL_MOST:
+	case SYMLVL_ALL:
+	case SYMLVL_CHAR:
+		break;
+	default:
+		return FALSE;
+	}
+	return preserve >= SYMPRES_INVALID && preserve <= SYMPRES_LITERAL;
+}
+
+/* Gets the string at @p offset of the string table, NULL if invalid */
+static const gchar *symbols_compiled_string(const gchar *strings, guint32 size,
+					    guint32 offset, gboolean *valid)
+{
+	if (offset == SYMBOLS_COMPILED_NONE)
+		return NULL;
+	if (offset >= size) {
+		*valid = FALSE;
+		return NULL;
+	}
+	return strings + offset;
+}
+
+/* Loads the compiled version of @p filename into @p ss, if there is one which
+ * is up to date.  The complex symbols are prepended, like
+ * speech_symbols_load_complex_symbol() does. */
+static int speech_symbols_load_compiled(SpeechSymbols *ss, const char *filename)
+{
+	const SymbolsCompiledHeader *header;
+	const SymbolsCompiledComplex *complex;
+	const SymbolsCompiledSymbol *symbols;
+	const gchar *strings;
+	struct stat source, compiled;
+	gchar *path;
+	void *map;
+	gsize min_size;
+	gboolean valid = TRUE;
+	guint32 i;
+	int fd;
+
+	if (stat(filename, &source) < 0)
+		return -1;
+
+	path = g_strconcat(filename, SYMBOLS_COMPILED_SUFFIX, NULL);
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		g_free(path);
+		return -1;
+	}
+	if (fstat(fd, &compiled) < 0 || compiled.st_size < (off_t) sizeof *header) {
+		close(fd);
+		g_free(path);
+		return -1;
+	}
+	map = mmap(NULL, compiled.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		MSG2(1, "symbols", "Failed to map '%s': %s", path, g_strerror(errno));
+		g_free(path);
+		return -1;
+	}
+
+	header = map;
+	min_size = sizeof *header
+		 + (gsize) header->n_complex * sizeof *complex
+		 + (gsize) header->n_symbols * sizeof *symbols
+		 + header->strings_size;
+	if (header->magic != SYMBOLS_COMPILED_MAGIC
+	    || header->version != SYMBOLS_COMPILED_VERSION
+	    || compiled.st_size != min_size) {
+		MSG2(2, "symbols", "Ignoring invalid compiled file '%s'", path);
+		goto err;
+	}
+	if (header->source_mtime != source.st_mtime
+	    || header->source_size != source.st_size) {
+		MSG2(3, "symbols", "Ignoring '%s' which is out of date", path);
+		goto err;
+	}
+
+	complex = (const void *) (header + 1);
+	symbols = (const void *) (complex + header->n_complex);
+	strings = (const void *) (symbols + header->n_symbols);
+	if (header->strings_size && strings[header->strings_size - 1] != '\0') {
+		MSG2(2, "symbols", "Ignoring invalid compiled file '%s'", path);
+		goto err;
+	}
+
+	for (i = 0; i < header->n_complex && valid; i++) {
+		const gchar *identifier, *pattern;
+		char **parts;
+
+		identifier = symbols_compiled_string(strings, header->strings_size,
+						     complex[i].identifier, &valid);
+		pattern = symbols_compiled_string(strings, header->strings_size,
+						  complex[i].pattern, &valid);
+		if (!identifier || !pattern) {
+			valid = FALSE;
+			break;
+		}
+
+		parts = g_new(char *, 3);
+		parts[0] = g_strdup(identifier);
+		parts[1] = g_strdup(pattern);
+		parts[2] = NULL;
+		ss->complex_symbols = g_slist_prepend(ss->complex_symbols, parts);
+	}
+
+	for (i = 0; i < header->n_symbols && valid; i++) {
+		const SymbolsCompiledSymbol *csym = &symbols[i];
+		const gchar *identifier;
+		SpeechSymbol *sym;
+
+		identifier = symbols_compiled_string(strings, header->strings_size,
+						     csym->identifier, &valid);
+		if (!identifier
+		    || !symbols_compiled_modes_valid(csym->level, csym->preserve)) {
+			valid = FALSE;
+			break;
+		}
+
+		sym = speech_symbol_new();
+		sym->identifier = g_strdup(identifier);
+		sym->replacement = g_strdup(symbols_compiled_string(strings,
+			header->strings_size, csym->replacement, &valid));
+		sym->display_name = g_strdup(symbols_compiled_string(strings,
+			header->strings_size, csym->display_name, &valid));
+		sym->level = csym->level;
+		sym->preserve = csym->preserve;
+		g_hash_table_insert(ss->symbols, sym->identifier, sym);
+	}
+
+	if (!valid) {
+		MSG2(2, "symbols", "Ignoring invalid compiled file '%s'", path);
+		/* Do not keep half of it */
+		g_slist_free_full(ss->complex_symbols, (GDestroyNotify) g_strfreev);
+		ss->complex_symbols = NULL;
+		g_hash_table_remove_all(ss->symbols);
+		goto err;
+	}
+
+	MSG2(5, "symbols", "Loaded compiled file '%s'", path);
+	munmap(map, compiled.st_size);
+	g_free(path);
+
+	return 0;
+
+err:
+	munmap(map, compiled.st_size);
+	g_free(path);
+
+	return -1;
+}
+
+/* Appends @p str to the string table, returning its offset */
+static guint32 symbols_compiled_add_string(GString *strings, const gchar *str)
+{
+	guint32 offset = strings->len;
+
+	if (!str)
+		return SYMBOLS_COMPILED_NONE;
+	g_string_append_len(strings, str, strlen(str) + 1);
+
+	return offset;
+}
+
+/* Writes the compiled version of @p ss, loaded from @p filename */
+static int speech_symbols_save_compiled(SpeechSymbols *ss, const char *filename)
+{
+	SymbolsCompiledHeader header = { 0, };
+	GString *records, *strings;
+	GHashTableIter iter;
+	gpointer value;
+	struct stat source;
+	GError *error = NULL;
+	GSList *node;
+	gchar *path;
+	int ret = 0;
+
+	if (stat(filename, &source) < 0) {
+		MSG2(1, "symbols", "Failed to stat '%s': %s", filename, g_strerror(errno));
+		return -1;
+	}
+
+	header.magic = SYMBOLS_COMPILED_MAGIC;
+	header.version = SYMBOLS_COMPILED_VERSION;
+	header.source_mtime = source.st_mtime;
+	header.source_size = source.st_size;
+	header.n_complex = g_slist_length(ss->complex_symbols);
+	header.n_symbols = g_hash_table_size(ss->symbols);
+
+	/* The header is filled for real once the strings are known */
+	records = g_string_new(NULL);
+	g_string_append_len(records, (const gchar *) &header, sizeof header);
+	strings = g_string_new(NULL);
+
+	for (node = ss->complex_symbols; node; node = node->next) {
+		char **parts = node->data;
+		SymbolsCompiledComplex complex;
+
+		complex.identifier = symbols_compiled_add_string(strings, parts[0]);
+		complex.pattern = symbols_compiled_add_string(strings, parts[1]);
+		g_string_append_len(records, (const gchar *) &complex, sizeof complex);
+	}
+
+	g_hash_table_iter_init(&iter, ss->symbols);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		SpeechSymbol *sym = value;
+		SymbolsCompiledSymbol csym;
+
+		csym.identifier = symbols_compiled_add_string(strings, sym->identifier);
+		csym.replacement = symbols_compiled_add_string(strings, sym->replacement);
+		csym.display_name = symbols_compiled_add_string(strings, sym->display_name);
+		csym.level = sym->level;
+		csym.preserve = sym->preserve;
+		g_string_append_len(records, (const gchar *) &csym, sizeof csym);
+	}
+
+	header.strings_size = strings->len;
+	memcpy(records->str, &header, sizeof header);
+	g_string_append_len(records, strings->str, strings->len);
+
+	path = g_strconcat(filename, SYMBOLS_COMPILED_SUFFIX, NULL);
+	/* This writes to a temporary file first, and renames it */
+	if (!g_file_set_contents(path, records->str, records->len, &error)) {
+		MSG2(1, "symbols", "Failed to write '%s': %s", path, error->message);
+		g_error_free(error);
+		ret = -1;
+	}
+	g_free(path);
+	g_string_free(records, TRUE);
+	g_string_free(strings, TRUE);
+
+	return ret;
+}
+
+int symbols_compile_dir(const char *dir)
+{
+	GDir *locales, *files;
+	const gchar *locale, *file;
+	GError *error = NULL;
+	int compiled = 0, failed = 0;
+
+	locales = g_dir_open(dir, 0, &error);
+	if (!locales) {
+		MSG2(1, "symbols", "Failed to open '%s': %s", dir, error->message);
+		g_error_free(error);
+		return -1;
+	}
+
+	while ((locale = g_dir_read_name(locales))) {
+		gchar *locale_dir = g_build_filename(dir, locale, NULL);
+
+		files = g_dir_open(locale_dir, 0, NULL);
+		if (!files) {
+			/* Not a locale directory */
+			g_free(locale_dir);
+			continue;
+		}
+
+		while ((file = g_dir_read_name(files))) {
+			gchar *path;
+			SpeechSymbols *ss;
+
+			if (!g_str_has_suffix(file, ".dic"))
+				continue;
+
+			path = g_build_filename(locale_dir, file, NULL);
+			ss = speech_symbols_alloc();
+			if (speech_symbols_load(ss, path, TRUE) >= 0) {
+				/* Stored in the order of the file */
+				ss->complex_symbols = g_slist_reverse(ss->complex_symbols);
+				if (speech_symbols_save_compiled(ss, path) >= 0)
+					compiled++;
+				else
+					failed++;
+			} else
+				failed++;
+			speech_symbols_free(ss);
+			g_free(path);
+		}
+
+		g_dir_close(files);
+		g_free(locale_dir);
+	}
+	g_dir_close(locales);
+
+	MSG2(2, "symbols", "Compiled %d symbols files in %s, %d failed",
+	     compiled, dir, failed);
+
+	return failed ? -1 : 0;
+}
+
+/* Account a loaded SpeechSymbols, which does not change any more */
+static void speech_symbols_account(SpeechSymbols *ss)
+{
+	GSList *node;
+
+	ss->mem_bytes = sizeof(*ss) + mem_strsize(ss->source)
+	    + speech_symbols_table_size(ss->symbols);
+	for (node = ss->complex_symbols; node; node = node->next) {
+		gchar **key_val = node->data;
+
+		ss->mem_bytes += sizeof(*node) + 3 * sizeof(gchar *)
+		    + mem_strsize(key_val[0]) + mem_strsize(key_val[1]);
+	}
+	mem_account(MEM_SYMBOLS, ss->mem_bytes, 1);
+}
+
 /* Loads a symbols file for @p locale.
  * Returns a SpeechSymbols*, or NULL on error. */
 static gpointer speech_symbols_new(const gchar *locale, const gchar *file)
 {
-	SpeechSymbols *ss = g_malloc(sizeof *ss);
+	SpeechSymbols *ss = speech_symbols_alloc();
 	gchar *path;
 
-	ss->complex_symbols = NULL;
-	ss->source = NULL;
-	ss->symbols = g_hash_table_new_full(g_str_hash, g_str_equal,
-					    g_free,
-					    (GDestroyNotify) speech_symbol_free);
-
 	path = g_build_filename(LOCALE_DATA, locale, file, NULL);
 	MSG2(5, "symbols", "Trying to load %s for '%s' from '%s'", file, locale, path);
-	if (speech_symbols_load(ss, path, TRUE) >= 0) {
+	if (speech_symbols_load_compiled(ss, path) >= 0
+	    || speech_symbols_load(ss, path, TRUE) >= 0) {
 		MSG2(5, "symbols", "Successful");
 		/* The elements are added to the start of the list in
 		 * speech_symbols_load_complex_symbol() for better speed (as adding to
@@ -721,6 +932,7 @@ static gpointer speech_symbols_new(const gchar *locale, const gchar *file)
 		 * order they are in the file, so reverse the list. */
 		ss->complex_symbols = g_slist_reverse(ss->complex_symbols);
 		ss->source = g_strdup(file);
+		speech_symbols_account(ss);
 	} else {
 		/* Nothing loaded in the end */
 		MSG2(5, "symbols", "Failed");
@@ -741,24 +953,51 @@ static SpeechSymbols *get_locale_speech_symbols(const gchar *locale, const gchar
 	return locale_map_fetch(G_symbols_dicts, locale, file, speech_symbols_new);
 }
 
+/* Drop what was computed from the files, both mutexes are held */
+static void symbols_preprocessing_invalidate(void)
+{
+	if (G_processors)
+		g_hash_table_remove_all(G_processors);
+	if (G_processors_missing)
+		g_hash_table_remove_all(G_processors_missing);
+	symbols_cache_clear();
+	symbols_generation++;
+}
+
 void symbols_preprocessing_add_file(const char *name)
 {
 	MSG2(5, "symbols", "Will load symbol file %s", name);
+	pthread_mutex_lock(&symbols_build_mutex);
+	pthread_mutex_lock(&symbols_mutex);
 	symbols_files = g_slist_append(symbols_files, g_strdup(name));
+	symbols_preprocessing_invalidate();
+	pthread_mutex_unlock(&symbols_mutex);
+	pthread_mutex_unlock(&symbols_build_mutex);
 }
 
-/*------------------ Speech symbol compilation & processing -----------------*/
-
-/* sort function sorting strings by length, longest first */
-static gint list_sort_string_longest_first(gconstpointer a, gconstpointer b)
+void symbols_preprocessing_reset(void)
 {
-	return strlen(b) - strlen(a);
+	pthread_mutex_lock(&symbols_build_mutex);
+	pthread_mutex_lock(&symbols_mutex);
+	g_slist_free_full(symbols_files, g_free);
+	symbols_files = NULL;
+	symbols_preprocessing_invalidate();
+	pthread_mutex_unlock(&symbols_mutex);
+	/* The files may have changed too */
+	if (G_symbols_dicts)
+		g_hash_table_remove_all(G_symbols_dicts);
+	pthread_mutex_unlock(&symbols_build_mutex);
 }
 
+/*------------------ Speech symbol compilation & processing -----------------*/
+
 static void speech_symbols_processor_free(SpeechSymbolProcessor *ssp)
 {
+	if (ssp->mem_bytes)
+		mem_account(MEM_SYMBOLS, -(gssize) ssp->mem_bytes, -1);
 	if (ssp->regex)
 		g_regex_unref(ssp->regex);
+	g_array_free(ssp->trie, TRUE);
 	g_slist_free(ssp->complex_list);
 	if (ssp->symbols)
 		g_hash_table_unref(ssp->symbols);
@@ -766,11 +1005,52 @@ static void speech_symbols_processor_free(SpeechSymbolProcessor *ssp)
 	g_free(ssp);
 }
 
-static void speech_symbols_processor_list_free(GSList *sspl)
+static SpeechSymbolProcessors *speech_symbols_processors_ref(SpeechSymbolProcessors *sspl)
+{
+	if (sspl)
+		g_atomic_int_inc(&sspl->refs);
+	return sspl;
+}
+
+static void speech_symbols_processors_unref(SpeechSymbolProcessors *sspl)
+{
+	if (!sspl || !g_atomic_int_dec_and_test(&sspl->refs))
+		return;
+	g_slist_free_full(sspl->list, (GDestroyNotify) speech_symbols_processor_free);
+	g_hash_table_unref(sspl->chars);
+	g_free(sspl);
+}
+
+/* Adds the identifier of a simple symbol to the trie */
+static void speech_symbols_processor_add_simple(SpeechSymbolProcessor *ssp, SpeechSymbol *sym)
 {
-	GSList *e;
-	for (e = sspl; e; e = e->next)
-		speech_symbols_processor_free(e->data);
+	const guchar *c = (const guchar *) sym->identifier;
+	guint parent = 0, node;
+	SymbolTrieNode *n;
+
+	for (; *c; c++) {
+		node = parent ? g_array_index(ssp->trie, SymbolTrieNode, parent).child
+			      : ssp->trie_root[*c];
+		while (node && g_array_index(ssp->trie, SymbolTrieNode, node).byte != *c)
+			node = g_array_index(ssp->trie, SymbolTrieNode, node).sibling;
+
+		if (!node) {
+			SymbolTrieNode new_node = { 0, 0, *c, NULL };
+
+			node = ssp->trie->len;
+			if (parent) {
+				n = &g_array_index(ssp->trie, SymbolTrieNode, parent);
+				new_node.sibling = n->child;
+				n->child = node;
+			} else
+				ssp->trie_root[*c] = node;
+			g_array_append_val(ssp->trie, new_node);
+		}
+		parent = node;
+	}
+
+	if (parent)
+		g_array_index(ssp->trie, SymbolTrieNode, parent).sym = sym;
 }
 
 /* Loads and compiles speech symbols conversions for @p locale.
@@ -781,17 +1061,11 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 	SpeechSymbols *ssbase;
 	GHashTableIter iter;
 	gpointer key, value;
-	GString *characters;
-	GSList *multi_chars_list = NULL;
-	gchar *escaped;
-	GString *escaped_multi;
 	GString *pattern;
 	GError *error = NULL;
 	GSList *sources = NULL;
 	GSList *node;
-	int has_dash = 0;
-	int has_rbracket = 0;
-	int has_circum = 0;
+	SymbolTrieNode unused = { 0, 0, 0, NULL };
 
 	sources = g_slist_append(sources, syms);
 	/* Always use the base. */
@@ -801,12 +1075,17 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 
 	ssp = g_malloc(sizeof *ssp);
 	ssp->source = g_strdup(syms->source);
+	ssp->regex = NULL;
+	ssp->trie = g_array_new(FALSE, FALSE, sizeof(SymbolTrieNode));
+	g_array_append_val(ssp->trie, unused);
+	memset(ssp->trie_root, 0, sizeof(ssp->trie_root));
 	/* The computed symbol information from all sources. */
 	ssp->symbols = g_hash_table_new_full(g_str_hash, g_str_equal,
 					     g_free,
 					     (GDestroyNotify) speech_symbol_free);
 	/* An indexable list of complex symbols for use in building/executing the regexp. */
 	ssp->complex_list = NULL;
+	ssp->mem_bytes = 0;
 
 	/* Add all complex symbols first, as they take priority. */
 	for (node = sources; node; node = node->next) {
@@ -833,7 +1112,6 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 	ssp->complex_list = g_slist_reverse(ssp->complex_list);
 
 	/* Supplement the data for complex symbols and add all simple symbols. */
-	characters = g_string_new(NULL);
 	for (node = sources; node; node = node->next) {
 		SpeechSymbols *syms = node->data;
 
@@ -849,23 +1127,6 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 				sym = speech_symbol_new();
 				sym->identifier = g_strdup(key);
 				g_hash_table_insert(ssp->symbols, sym->identifier, sym);
-				if (strlen(sym->identifier) == 1) {
-					switch (sym->identifier[0]) {
-						case '-':
-							has_dash = 1;
-							break;
-						case ']':
-							has_rbracket = 1;
-							break;
-						case '^':
-							has_circum = 1;
-							break;
-						default:
-						g_string_append_c(characters, sym->identifier[0]);
-					}
-				} else {
-					multi_chars_list = g_slist_prepend(multi_chars_list, sym->identifier);
-				}
 			}
 			/* If fields weren't explicitly specified, inherit the value from later sources. */
 			if (sym->replacement == NULL)
@@ -899,94 +1160,62 @@ static SpeechSymbolProcessor *speech_symbols_processor_new(const char *locale, S
 			sym->preserve = SYMPRES_NEVER;
 		if (sym->display_name == NULL)
 			sym->display_name = g_strdup(sym->identifier);
-	}
 
-	/* build the regex. */
-
-	/* Make characters into a regexp character set. */
-	escaped = g_regex_escape_string(characters->str, characters->len);
-	g_string_truncate(characters, 0);
-	if (*escaped || has_dash || has_rbracket || has_circum) {
-		g_string_append_printf(characters, "[%s", escaped);
-		if (has_dash)
-			g_string_append_printf(characters, "\\-");
-		if (has_rbracket)
-			g_string_append_printf(characters, "\\]");
-		if (has_circum)
-			g_string_append_printf(characters, "\\^");
-		g_string_append_c(characters, ']');
+		/* Simple symbols are just text, they are looked up in the trie,
+		 * which always gives the longest one matching. */
+		if (!sym->pattern)
+			speech_symbols_processor_add_simple(ssp, sym);
 	}
-	g_free(escaped);
 
-	/* The simple symbols must be ordered longest first so that the longer symbols will match.*/
-	multi_chars_list = g_slist_sort(multi_chars_list, list_sort_string_longest_first);
+	/* build the regex of complex symbols.
+	 * Each complex symbol has its own named group so we know which symbol matched. */
 
 	/* TODO: check the syntax is compatible with GLib */
 	pattern = g_string_new(NULL);
-	/* Strip repeated spaces from the end of the line to stop them from being picked up by repeated. */
-	g_string_append(pattern, "(?P<rstripSpace>  +$)");
-	/* Repeated characters: more than 3 repeats. */
-	if (characters->len) {
-		g_string_append_c(pattern, '|');
-		g_string_append_printf(pattern, "(?P<repeated>(?P<repTmp>%s)(?P=repTmp){3,})", characters->str);
-	}
-	/* Complex symbols.
-	 * Each complex symbol has its own named group so we know which symbol matched. */
 	guint i = 0;
 	for (node = ssp->complex_list; node; node = node->next, i++) {
 		SpeechSymbol *sym = node->data;
-		g_string_append_c(pattern, '|');
+		if (pattern->len)
+			g_string_append_c(pattern, '|');
 		g_string_append_printf(pattern, "(?P<c%u>%s)", i, sym->pattern);
 	}
-	/* Simple symbols.
-	 * These are all handled in one named group.
-	 * Because the symbols are just text, we know which symbol matched just by looking at the matched text. */
-	escaped_multi = g_string_new(NULL);
-	for (node = multi_chars_list; node; node = node->next) {
-		escaped = g_regex_escape_string(node->data, -1);
-		if (escaped_multi->len > 0)
-			g_string_append_c(escaped_multi, '|');
-		g_string_append(escaped_multi, escaped);
-		g_free(escaped);
-	}
-	if (escaped_multi->len || characters->len) {
-		g_string_append_c(pattern, '|');
-		g_string_append_printf(pattern, "(?P<simple>");
-		if (escaped_multi->len)
-			g_string_append_printf(pattern, "%s", escaped_multi->str);
-		if (escaped_multi->len && characters->len)
-			g_string_append_printf(pattern, "|");
-		if (characters->len)
-			g_string_append_printf(pattern, "%s", characters->str);
-		g_string_append_printf(pattern, ")");
-	}
-	g_string_free(escaped_multi, TRUE);
-
-	MSG2(5, "symbols", "building regex: %s", pattern->str);
-	ssp->regex = g_regex_new(pattern->str, G_REGEX_OPTIMIZE, 0, &error);
-	if (!ssp->regex) {
-		/* if regex compilation failed, bail out */
-		MSG2(1, "symbols", "ERROR compiling regular expression: %s. "
-				   "This is likely due to an invalid complex "
-				   "symbol regular expression in locale %s.",
-				   error->message, locale);
-		g_error_free(error);
-		speech_symbols_processor_free(ssp);
-		ssp = NULL;
+
+	if (pattern->len) {
+		MSG2(5, "symbols", "building regex: %s", pattern->str);
+		ssp->regex = g_regex_new(pattern->str, G_REGEX_OPTIMIZE, 0, &error);
+		if (!ssp->regex) {
+			/* if regex compilation failed, bail out */
+			MSG2(1, "symbols", "ERROR compiling regular expression: %s. "
+					   "This is likely due to an invalid complex "
+					   "symbol regular expression in locale %s.",
+					   error->message, locale);
+			g_error_free(error);
+			speech_symbols_processor_free(ssp);
+			ssp = NULL;
+		}
 	}
 
 	g_string_free(pattern, TRUE);
-	g_string_free(characters, TRUE);
-	g_slist_free(multi_chars_list);
 	g_slist_free(sources);
 
+	if (ssp) {
+		/* Not counting the compiled regex, which GLib does not tell */
+		ssp->mem_bytes = sizeof(*ssp) + mem_strsize(ssp->source)
+		    + speech_symbols_table_size(ssp->symbols)
+		    + ssp->trie->len * sizeof(SymbolTrieNode)
+		    + g_slist_length(ssp->complex_list) * sizeof(GSList);
+		mem_account(MEM_SYMBOLS, ssp->mem_bytes, 1);
+	}
+
 	return ssp;
 }
 
-/* Loads and compiles speech symbols conversions for @p locale.
- * Returns a SpeechSymbolProcessor*, or NULL on error */
-static gpointer speech_symbols_processor_list_new(const char *locale, const char *file)
+/* Loads and compiles speech symbols conversions for @p locale, with
+ * symbols_build_mutex held.
+ * Returns a SpeechSymbolProcessors* with one reference, or NULL on error */
+static SpeechSymbolProcessors *speech_symbols_processor_list_new(const char *locale)
 {
+	SpeechSymbolProcessors *processors;
 	SpeechSymbolProcessor *ssp;
 	SpeechSymbols *ss;
 	GSList *sspl = NULL;
@@ -1010,8 +1239,16 @@ static gpointer speech_symbols_processor_list_new(const char *locale, const char
 	 * adding to the end requires walking the whole list), but we want them
 	 * in the order they are in the config, so reverse the list. */
 	sspl = g_slist_reverse(sspl);
+	if (!sspl)
+		return NULL;
 
-	return sspl;
+	processors = g_malloc(sizeof *processors);
+	processors->refs = 1;
+	processors->list = sspl;
+	processors->chars = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+						  NULL, g_free);
+
+	return processors;
 }
 
 /* Fetch a named group that matched.
@@ -1036,7 +1273,7 @@ enum group {
 };
 
 /* Look for the first block of tags strictly after pos, among tags between firsttag and lasttag */
-static gint find_nexttag(struct tags *tags, gint pos, gint firsttag, gint endtag)
+static gint find_nexttag(SsmlTags *tags, gint pos, gint firsttag, gint endtag)
 {
 	gint middletag;
 
@@ -1074,11 +1311,15 @@ static int replace_groups(const GMatchInfo *match_info, GString *result, char *r
 			if (c == '\\')
 				g_string_append_c(result, '\\');
 			else if (c >= '0' && c <= '9') {
-				gchar *res = g_match_info_fetch(match_info, pos + (c - '0'));
+				gchar *res = NULL;
+
+				if (match_info)
+					res = g_match_info_fetch(match_info, pos + (c - '0'));
 				if (res)
 					g_string_append(result, res);
 				else
 					MSG2(1, "symbols", "Unmatched reference \\%c", c);
+				g_free(res);
 			} else {
 				MSG2(1, "symbols", "Invalid reference \\%c", c);
 				g_string_append_c(result, c);
@@ -1092,80 +1333,130 @@ static int replace_groups(const GMatchInfo *match_info, GString *result, char *r
 	return 1;
 }
 
-/* Regular expression callback for applying replacements */
-static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpointer user_data)
+/* Find out which complex symbol matched, and the index of its group */
+static SpeechSymbol *find_complex_symbol(const SpeechSymbolProcessor *ssp, const GMatchInfo *match_info, gint *pos)
 {
-	SpeechSymbolProcessor *ssp = user_data;
-	gchar *capture;
-	enum group captured_group;
-	gchar *group_0;
-	gint start = -1, end = -1;
-	gint prevlen = result->len, shift;
-	gint nexttag, curtag, deferrable;
-	guint i = 0;
 	SpeechSymbol *sym = NULL;
-	gint pos = 0;
-
-	/* First see what we captured */
+	GSList *node;
+	guint i = 0;
 
 	/* FIXME: Python regex API allows to find the name of the group that
 	 *        matched.  As GRegex doesn't have that, what we do here is try
 	 *        and fetch the groups we know, and see if they matched.
 	 *        This is not very optimal, but how can we avoid that? */
 
-	if ((capture = fetch_named_matching(match_info, "rstripSpace"))) {
-		captured_group = RSTRIPSPACE;
-	} else if ((capture = fetch_named_matching(match_info, "repeated"))) {
-		captured_group = REPEATED;
-	} else if ((capture = fetch_named_matching(match_info, "simple"))) {
-		captured_group = SIMPLE;
-	} else {
-		/* Complex symbol. */
-		GSList *node;
-
-		for (node = ssp->complex_list; !sym && node; node = node->next, i++) {
-			gchar *group_name = g_strdup_printf("c%u", i);
-
-			if ((capture = fetch_named_matching(match_info, group_name))) {
-				gchar **all = g_match_info_fetch_all(match_info);
-				gint i;
-
-				pos = -1;
-				/* Find out the index of the match */
-				for (i = 1; all[i]; i++) {
-					if (all[i][0]) {
-						pos = i;
-						break;
-					}
-				}
-				g_strfreev(all);
+	for (node = ssp->complex_list; !sym && node; node = node->next, i++) {
+		gchar *group_name = g_strdup_printf("c%u", i);
+		gchar *capture;
 
-				if (pos != -1)
-					sym = node->data;
+		if ((capture = fetch_named_matching(match_info, group_name))) {
+			gchar **all = g_match_info_fetch_all(match_info);
+			gint j;
+
+			*pos = -1;
+			/* Find out the index of the match */
+			for (j = 1; all[j]; j++) {
+				if (all[j][0]) {
+					*pos = j;
+					break;
+				}
 			}
-			g_free(group_name);
+			g_strfreev(all);
 
-			if (sym)
-				break;
+			if (*pos != -1) {
+				sym = node->data;
+				MSG2(5, "symbols", "replacing <c%u> (complex symbol)", i);
+			}
+			g_free(capture);
 		}
+		g_free(group_name);
+	}
+
+	return sym;
+}
+
+/* Length of the spaces at start to be stripped from the end of the text, 0 if none */
+static gsize match_rstrip_space(const gchar *text, gsize len, gsize start)
+{
+	gsize end = start;
+
+	while (end < len && text[end] == ' ')
+		end++;
+	if (end - start < 2)
+		return 0;
+	/* Like $, also match before a final newline */
+	if (end == len || (text[end] == '\n' && end + 1 == len))
+		return end - start;
+	return 0;
+}
+
+/* Length of more than 3 repeats of a single character symbol at start, 0 if none */
+static gsize match_repeated(const SpeechSymbolProcessor *ssp, const gchar *text, gsize len, gsize start)
+{
+	const SymbolTrieNode *nodes = (const SymbolTrieNode *) ssp->trie->data;
+	guint node = ssp->trie_root[(guchar) text[start]];
+	gsize end = start + 1;
+
+	if (!node || !nodes[node].sym || nodes[node].sym->identifier[1])
+		return 0;
+	while (end < len && text[end] == text[start])
+		end++;
+	if (end - start < 4)
+		return 0;
+	return end - start;
+}
+
+/* Longest simple symbol at start, or NULL */
+static SpeechSymbol *match_simple(const SpeechSymbolProcessor *ssp, const gchar *text, gsize len, gsize start, gsize *end)
+{
+	const SymbolTrieNode *nodes = (const SymbolTrieNode *) ssp->trie->data;
+	guint node = ssp->trie_root[(guchar) text[start]];
+	SpeechSymbol *sym = NULL;
+	gsize cur = start;
 
-		captured_group = COMPLEX;
+	while (node) {
+		if (nodes[node].byte != (guchar) text[cur]) {
+			node = nodes[node].sibling;
+			continue;
+		}
+		cur++;
+		if (nodes[node].sym) {
+			sym = nodes[node].sym;
+			*end = cur;
+		}
+		if (cur >= len)
+			break;
+		node = nodes[node].child;
 	}
 
-	/* Now check where that lies among tags */
+	return sym;
+}
 
-	g_match_info_fetch_pos(match_info, 0, &start, &end);
+/* Appends to result the replacement of the match of the given group at
+ * start..end of text.  sym is the matching symbol for simple and complex
+ * symbols, and match_info the complex symbol match. */
+static void replace_match(SpeechSymbolPass *pass, GString *result,
+			  const gchar *text, gint start, gint end,
+			  enum group captured_group, SpeechSymbol *sym,
+			  const GMatchInfo *match_info, gint pos)
+{
+	const gchar *capture = text + start;
+	gint capture_len = end - start;
+	gint prevlen = result->len, shift;
+	gint nexttag, curtag, deferrable;
+
+	/* Check where that lies among tags */
 
-	nexttag = find_nexttag(ssp->tags, start, 0, ssp->ntags);
+	nexttag = find_nexttag(pass->tags, start, 0, pass->ntags);
 
 	/* Check whether the contained tags are deferrable */
 	deferrable = 1;
-	for (curtag = nexttag; curtag < ssp->ntags; curtag++) {
-		if (ssp->tags[curtag].pos >= end)
+	for (curtag = nexttag; curtag < pass->ntags; curtag++) {
+		if (pass->tags[curtag].pos >= end)
 			/* Don't care about the rest */
 			break;
 		/* This block of tags is within the group */
-		if (!ssp->tags[curtag].deferrable) {
+		if (!pass->tags[curtag].deferrable) {
 			/* Oops, these tags can't be deferred */
 			deferrable = 0;
 			break;
@@ -1173,25 +1464,22 @@ static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpoint
 	}
 
 	if (!deferrable) {
-		group_0 = g_match_info_fetch(match_info, 0);
-		MSG2(1, "symbols", "tags '%s' within group |%s| (at %d..%d), not replacing group :/",
-				   ssp->tags[curtag].tags, group_0, start, end);
-		g_free(group_0);
+		MSG2(1, "symbols", "tags '%s' within group |%.*s| (at %d..%d), not replacing group :/",
+				   pass->tags[curtag].tags, capture_len, capture, start, end);
 
-		g_string_append(result, capture);
-		g_free(capture);
+		g_string_append_len(result, capture, capture_len);
 
-		return FALSE;
+		return;
 	}
 
 	/* Defer these tags */
-	for (curtag = nexttag; curtag < ssp->ntags; curtag++) {
-		if (ssp->tags[curtag].pos >= end)
+	for (curtag = nexttag; curtag < pass->ntags; curtag++) {
+		if (pass->tags[curtag].pos >= end)
 			/* Don't care about the rest */
 			break;
 		/* This block of tags is within the group, defer it after the group */
-		MSG2(5, "symbols", "deferring tags '%s' to %d", ssp->tags[curtag].tags, end);
-		ssp->tags[curtag].pos = end;
+		MSG2(5, "symbols", "deferring tags '%s' to %d", pass->tags[curtag].tags, end);
+		pass->tags[curtag].pos = end;
 	}
 
 	/* Ok, now replace */
@@ -1199,34 +1487,21 @@ static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpoint
 		MSG2(5, "symbols", "replacing <rstripSpace>");
 		/* nothing to do, just don't add it in the result */
 	} else if (captured_group == REPEATED) {
-		/* Repeated character. */
-		char ch[2] = { capture[0], 0 };
-		SpeechSymbol *sym = g_hash_table_lookup(ssp->symbols, ch);
-
+		/* Repeated character, sym is that character */
 		MSG2(5, "symbols", "replacing <repeated>");
 
-		/* this should never happen, but be on the safe side and check it */
-		if (!sym)
-			goto symbol_error;
-
-		if (ssp->level >= sym->level) {
-			g_string_append_printf(result, " %lu %s ", (unsigned long) strlen(capture), sym->replacement);
+		if (pass->level >= sym->level) {
+			g_string_append_printf(result, " %d %s ", capture_len, sym->replacement);
 		} else {
 			g_string_append_c(result, ' ');
 		}
 	} else {
 		const gchar *prefix, *suffix;
+		gint suffix_len;
 
 		/* One of the defined symbols. **/
-		if (captured_group == SIMPLE) {
-			/* Simple symbol. */
-			sym = g_hash_table_lookup(ssp->symbols, capture);
+		if (captured_group == SIMPLE)
 			MSG2(5, "symbols", "replacing <simple>");
-		} else {
-			g_assert(captured_group == COMPLEX);
-			/* Complex symbol, sym and i already set */
-			MSG2(5, "symbols", "replacing <c%u> (complex symbol)", i);
-		}
 
 		/* this should never happen, but be on the safe side and check it */
 		if (!sym)
@@ -1241,58 +1516,139 @@ static gboolean regex_eval(const GMatchInfo *match_info, GString *result, gpoint
 			prefix = " ";
 
 		if (sym->preserve == SYMPRES_ALWAYS ||
-		    (sym->preserve == SYMPRES_NOREP && ssp->level < sym->level))
+		    (sym->preserve == SYMPRES_NOREP && pass->level < sym->level)) {
 			suffix = capture;
-		else if (sym->preserve == SYMPRES_LITERAL)
+			suffix_len = capture_len;
+		} else if (sym->preserve == SYMPRES_LITERAL) {
 			suffix = "";
-		else
+			suffix_len = 0;
+		} else {
 			suffix = " ";
+			suffix_len = 1;
+		}
 
-		if (sym->level > ssp->support_level) {
+		if (sym->level > pass->support_level) {
 			/* Leave it to the module */
-			g_string_append(result, capture);
-		} else if (ssp->level >= sym->level && sym->replacement) {
+			g_string_append_len(result, capture, capture_len);
+		} else if (pass->level >= sym->level && sym->replacement) {
 			g_string_append(result, prefix);
 			MSG2(5, "symbols", "replacing with %s", sym->replacement);
 			replace_groups(match_info, result, sym->replacement, pos);
-			g_string_append(result, suffix);
+			g_string_append_len(result, suffix, suffix_len);
 		} else {
-			g_string_append(result, suffix);
+			g_string_append_len(result, suffix, suffix_len);
 		}
 	}
 
 	goto out;
 
 symbol_error:
-	group_0 = g_match_info_fetch(match_info, 0);
-	MSG2(1, "symbols", "WARNING: no symbol for match |%s| (at %d..%d), this shouldn't happen.",
-	     group_0, start, end);
-	g_free(group_0);
+	MSG2(1, "symbols", "WARNING: no symbol for match |%.*s| (at %d..%d), this shouldn't happen.",
+	     capture_len, capture, start, end);
 
 out:
 	/* content has grown (or shrunk) by this amount */
-	shift = (result->len - prevlen) - strlen(capture);
+	shift = (result->len - prevlen) - capture_len;
 
-	if (nexttag < ssp->ntags)
+	if (nexttag < pass->ntags)
 		/* Update positions of tags beyond this */
-		ssp->tags[nexttag].shift += shift;
+		pass->tags[nexttag].shift += shift;
+}
 
-	g_free(capture);
+/* Converts the symbols of one processor in text.  This is a single pass over
+ * the text, which at each position tries, by order of priority, trailing
+ * spaces, repeated characters, the next match of the complex symbols regex
+ * and the trie of simple symbols.  Returns NULL on error. */
+static gchar *speech_symbols_processor_apply(SpeechSymbolPass *pass, const gchar *text, GError **error)
+{
+	const SpeechSymbolProcessor *ssp = pass->ssp;
+	GString *result;
+	GMatchInfo *match_info = NULL;
+	gsize len = strlen(text);
+	gsize cur = 0, copied = 0, end;
+	gint complex_start = -1, complex_end = -1, pos = 0;
+	gboolean complex_left = ssp->regex != NULL;
+
+	result = g_string_sized_new(len);
+
+	while (cur < len) {
+		enum group captured_group;
+		SpeechSymbol *sym = NULL;
+		gsize match_len;
+
+		if (complex_left && complex_start < (gint) cur) {
+			/* Look for the next complex symbol.  Lookbehinds still
+			 * see the text before cur. */
+			g_match_info_free(match_info);
+			match_info = NULL;
+			if (g_regex_match_full(ssp->regex, text, len, cur, 0,
+					       &match_info, error)) {
+				g_match_info_fetch_pos(match_info, 0,
+						       &complex_start, &complex_end);
+			} else {
+				complex_left = FALSE;
+				if (error && *error) {
+					g_match_info_free(match_info);
+					g_string_free(result, TRUE);
+					return NULL;
+				}
+			}
+		}
+
+		if ((match_len = match_rstrip_space(text, len, cur))) {
+			captured_group = RSTRIPSPACE;
+		} else if ((match_len = match_repeated(ssp, text, len, cur))) {
+			captured_group = REPEATED;
+			sym = ((SymbolTrieNode *) ssp->trie->data)
+			    [ssp->trie_root[(guchar) text[cur]]].sym;
+		} else if (complex_left && complex_start == (gint) cur) {
+			captured_group = COMPLEX;
+			match_len = complex_end - complex_start;
+			sym = find_complex_symbol(ssp, match_info, &pos);
+		} else if ((sym = match_simple(ssp, text, len, cur, &end))) {
+			captured_group = SIMPLE;
+			match_len = end - cur;
+			pos = 0;
+		} else {
+			cur++;
+			continue;
+		}
 
-	return FALSE;
+		g_string_append_len(result, text + copied, cur - copied);
+		replace_match(pass, result, text, cur, cur + match_len,
+			      captured_group, sym, match_info, pos);
+		if (match_len) {
+			cur += match_len;
+			copied = cur;
+		} else {
+			/* Empty complex match, go on after the next character */
+			copied = cur;
+			cur = g_utf8_next_char(text + cur) - text;
+		}
+	}
+	g_string_append_len(result, text + copied, len - copied);
+	g_match_info_free(match_info);
+
+	return g_string_free(result, FALSE);
 }
 
-/* Processes some input and converts symbols in it */
-static gchar *speech_symbols_processor_process_text(GSList *sspl, const gchar *input, SymLvl level, SymLvl support_level, SPDDataMode ssml_mode)
+/* Processes some input and converts symbols in it.  For SSML, if ssml_ret
+ * is not NULL, the processed text is also returned there in its parsed
+ * form, see insert_index_marks_ssml(). */
+static gchar *speech_symbols_processor_process_text(GSList *sspl, const gchar *input, SymLvl level, SymLvl support_level, SPDDataMode ssml_mode, SsmlText **ssml_ret)
 {
 	gchar *text;
 	gchar *processed;
-	struct tags *tags = NULL;
+	SsmlText *ssml = NULL;
+	SsmlTags *tags = NULL;
 	gint ntags = 0, i;
 	GError *error = NULL;
 
 	if (ssml_mode == SPD_DATA_SSML) {
-		text = escape_ssml_text(input, &tags, &ntags);
+		ssml = ssml_parse(input);
+		text = ssml->text;
+		tags = ssml->tags;
+		ntags = ssml->ntags;
 		MSG2(5, "symbols", "escaped ssml '%s' to '%s'", input, text);
 	} else {
 		text = g_strdup(input);
@@ -1300,21 +1656,26 @@ static gchar *speech_symbols_processor_process_text(GSList *sspl, const gchar *i
 
 	for ( ; sspl; sspl = sspl->next) {
 		SpeechSymbolProcessor *ssp = sspl->data;
+		SpeechSymbolPass pass = {
+			.ssp = ssp,
+			.tags = NULL,
+			.ntags = 0,
+			.level = level,
+			.support_level = support_level,
+		};
 
 		if (ssml_mode == SPD_DATA_SSML) {
 			for (i = 0; i < ntags; i++)
 				tags[i].shift = 0;
-			ssp->tags = tags;
-			ssp->ntags = ntags;
-		} else
-			ssp->ntags = 0;
-
-		ssp->level = level;
-		ssp->support_level = support_level;
-		processed = g_regex_replace_eval(ssp->regex, text, -1, 0, 0, regex_eval, ssp, &error);
+			pass.tags = tags;
+			pass.ntags = ntags;
+		}
+
+		processed = speech_symbols_processor_apply(&pass, text, &error);
 		if (!processed) {
 			MSG2(1, "symbols", "ERROR applying regex: %s", error->message);
 			g_error_free(error);
+			error = NULL;
 		} else {
 			MSG2(5, "symbols", "'%s' translated '%s' to '%s'", ssp->source, text, processed);
 			g_free(text);
@@ -1338,31 +1699,431 @@ static gchar *speech_symbols_processor_process_text(GSList *sspl, const gchar *i
 	}
 
 	if (ssml_mode == SPD_DATA_SSML) {
-		processed = unescape_ssml_text(text, tags, ntags);
+		ssml->text = text;
+		processed = ssml_serialize(ssml, NULL);
 		MSG2(5, "symbols", "unescaped ssml '%s' to '%s'", text, processed);
-		g_free(text);
+		if (ssml_ret)
+			*ssml_ret = ssml;
+		else
+			ssml_text_free(ssml);
 	} else
 		processed = text;
 
 	return processed;
 }
 
-/* Gets a possibly cached processor for the given locale */
-static GSList *get_locale_speech_symbols_processor(const gchar *locale)
+/* Each locale to try for @p locale, the language alone being the second one.
+ * Returns NULL when there is no such one. */
+static gchar *speech_symbols_try_locale(const gchar *locale, guint i)
+{
+	gchar **parts;
+	gchar *l = NULL;
+
+	if (i == 0)
+		return g_strdup(locale);
+
+	parts = g_strsplit_set(locale, "_-", 2);
+	if (parts[0] && parts[1])
+		l = g_strdup(parts[0]);
+	g_strfreev(parts);
+
+	return l;
+}
+
+/* Looks up cached processors for @p locale, with symbols_mutex held.  The
+ * language alone is only used once @p locale itself is known to have none. */
+static SpeechSymbolProcessors *lookup_locale_speech_symbols_processor(const gchar *locale)
 {
-	if (!G_processors) {
-		G_processors = locale_map_new((GDestroyNotify) speech_symbols_processor_list_free);
+	SpeechSymbolProcessors *sspl = NULL;
+	gboolean missing = TRUE;
+	guint i;
+
+	if (!G_processors)
+		G_processors = locale_map_new((GDestroyNotify) speech_symbols_processors_unref);
+	if (!G_processors_missing)
+		G_processors_missing = g_hash_table_new_full(g_str_hash, g_str_equal,
+							     g_free, NULL);
+
+	for (i = 0; i < 2 && !sspl && missing; i++) {
+		gchar *l = speech_symbols_try_locale(locale, i);
+
+		if (l) {
+			sspl = g_hash_table_lookup(G_processors, l);
+			missing = g_hash_table_contains(G_processors_missing, l);
+		}
+		g_free(l);
 	}
 
-	return locale_map_fetch(G_processors, locale, NULL, speech_symbols_processor_list_new);
+	return speech_symbols_processors_ref(sspl);
+}
+
+/* Gets possibly cached processors for the given locale, with a reference
+ * which the caller has to drop.  This behaves like locale_map_fetch(), but
+ * building happens without holding symbols_mutex.  The processors are cached
+ * under the locale they were built for. */
+static SpeechSymbolProcessors *get_locale_speech_symbols_processor(const gchar *locale)
+{
+	SpeechSymbolProcessors *sspl = NULL;
+	guint i;
+
+	pthread_mutex_lock(&symbols_mutex);
+	sspl = lookup_locale_speech_symbols_processor(locale);
+	pthread_mutex_unlock(&symbols_mutex);
+	if (sspl)
+		return sspl;
+
+	pthread_mutex_lock(&symbols_build_mutex);
+	for (i = 0; i < 2 && !sspl; i++) {
+		gchar *l = speech_symbols_try_locale(locale, i);
+		gboolean missing;
+
+		if (!l)
+			continue;
+
+		/* Somebody may have built it meanwhile */
+		pthread_mutex_lock(&symbols_mutex);
+		sspl = speech_symbols_processors_ref(g_hash_table_lookup(G_processors, l));
+		missing = g_hash_table_contains(G_processors_missing, l);
+		pthread_mutex_unlock(&symbols_mutex);
+
+		if (sspl || missing) {
+			g_free(l);
+		} else if ((sspl = speech_symbols_processor_list_new(l))) {
+			MSG2(4, "symbols", "Built symbols processors for %s", l);
+			pthread_mutex_lock(&symbols_mutex);
+			g_hash_table_insert(G_processors, l,
+					    speech_symbols_processors_ref(sspl));
+			pthread_mutex_unlock(&symbols_mutex);
+		} else {
+			pthread_mutex_lock(&symbols_mutex);
+			g_hash_table_add(G_processors_missing, l);
+			pthread_mutex_unlock(&symbols_mutex);
+		}
+	}
+	pthread_mutex_unlock(&symbols_build_mutex);
+
+	return sspl;
+}
+
+/*------------------------ Processing long texts ----------------------------*/
+
+/* Texts longer than twice this are cut into segments of about this size,
+ * which are processed at the same time */
+#define SYMBOLS_SEGMENT_SIZE 2048
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	guint pending;		/* segments still being processed */
+	GSList *sspl;
+	SymLvl level;
+	SymLvl support_level;
+} SymbolsSegments;
+
+typedef struct {
+	SymbolsSegments *segments;
+	gchar *text;
+	gchar *processed;
+} SymbolsSegment;
+
+static GThreadPool *G_segments_pool = NULL;
+
+static void symbols_segment_process(SymbolsSegment *segment)
+{
+	SymbolsSegments *segments = segment->segments;
+
+	segment->processed = speech_symbols_processor_process_text(segments->sspl,
+			segment->text, segments->level, segments->support_level,
+			SPD_DATA_TEXT, NULL);
+}
+
+static void symbols_segment_work(gpointer data, gpointer user_data)
+{
+	SymbolsSegment *segment = data;
+	SymbolsSegments *segments = segment->segments;
+
+	symbols_segment_process(segment);
+
+	pthread_mutex_lock(&segments->mutex);
+	segments->pending--;
+	pthread_cond_signal(&segments->cond);
+	pthread_mutex_unlock(&segments->mutex);
+}
+
+/* Where the segment starting at start ends: after the whitespace following
+ * the first end of sentence once it is long enough.  The whitespace stays
+ * in the segment so that end of sentence rules see it. */
+static gsize symbols_segment_end(const gchar *text, gsize len, gsize start)
+{
+	gsize i;
+
+	for (i = start + SYMBOLS_SEGMENT_SIZE; i + 1 < len; i++)
+		if ((text[i] == '.' || text[i] == '!' || text[i] == '?')
+		    && g_ascii_isspace(text[i + 1]))
+			return i + 2;
+
+	return len;
+}
+
+/* Process a long plain text by segments, all but the first one being handed
+ * to worker threads while we process the first one */
+static gchar *speech_symbols_process_segments(GSList *sspl, const gchar *text, SymLvl level, SymLvl support_level)
+{
+	SymbolsSegments segments = {
+		.pending = 0,
+		.sspl = sspl,
+		.level = level,
+		.support_level = support_level,
+	};
+	GPtrArray *array = g_ptr_array_new();
+	SymbolsSegment *segment;
+	GString *result;
+	GError *error = NULL;
+	gsize len = strlen(text), start, end;
+	guint i;
+
+	for (start = 0; start < len; start = end) {
+		end = symbols_segment_end(text, len, start);
+		segment = g_new0(SymbolsSegment, 1);
+		segment->segments = &segments;
+		segment->text = g_strndup(text + start, end - start);
+		g_ptr_array_add(array, segment);
+	}
+	MSG2(5, "symbols", "processing %u segments", array->len);
+
+	if (!G_segments_pool && array->len > 1) {
+		G_segments_pool = g_thread_pool_new(symbols_segment_work, NULL,
+						    g_get_num_processors(),
+						    FALSE, &error);
+		if (!G_segments_pool) {
+			MSG2(2, "symbols", "Can't create symbols threads: %s",
+			     error->message);
+			g_error_free(error);
+			error = NULL;
+		}
+	}
+
+	pthread_mutex_init(&segments.mutex, NULL);
+	pthread_cond_init(&segments.cond, NULL);
+	for (i = 1; i < array->len; i++) {
+		segment = g_ptr_array_index(array, i);
+		pthread_mutex_lock(&segments.mutex);
+		segments.pending++;
+		pthread_mutex_unlock(&segments.mutex);
+		if (!G_segments_pool
+		    || !g_thread_pool_push(G_segments_pool, segment, &error)) {
+			if (error) {
+				MSG2(2, "symbols", "Can't queue segment: %s",
+				     error->message);
+				g_error_free(error);
+				error = NULL;
+			}
+			/* Do it ourself */
+			symbols_segment_work(segment, NULL);
+		}
+	}
+
+	symbols_segment_process(g_ptr_array_index(array, 0));
+
+	pthread_mutex_lock(&segments.mutex);
+	while (segments.pending)
+		pthread_cond_wait(&segments.cond, &segments.mutex);
+	pthread_mutex_unlock(&segments.mutex);
+	pthread_cond_destroy(&segments.cond);
+	pthread_mutex_destroy(&segments.mutex);
+
+	result = g_string_sized_new(len);
+	for (i = 0; i < array->len; i++) {
+		segment = g_ptr_array_index(array, i);
+		g_string_append(result, segment->processed ? segment->processed
+						   : segment->text);
+		g_free(segment->processed);
+		g_free(segment->text);
+		g_free(segment);
+	}
+	g_ptr_array_free(array, TRUE);
+
+	return g_string_free(result, FALSE);
+}
+
+/*------------------------- Processed text cache ---------------------------*/
+
+/* Number of processed texts to remember */
+#define SYMBOLS_CACHE_SIZE 512
+/* Longer texts are hardly repeated, don't keep them */
+#define SYMBOLS_CACHE_MAX_TEXT 1024
+
+typedef struct {
+	gchar *locale;
+	gchar *text;
+	SymLvl level;
+	SymLvl support_level;
+	SPDDataMode ssml_mode;
+	guint hash;
+	gchar *processed;	/* NULL if there was no processor */
+	GList *link;		/* in G_cache_lru */
+} SymbolsCacheEntry;
+
+/* Table of SymbolsCacheEntry, which are both key and value */
+static GHashTable *G_cache = NULL;
+/* Most recently used entries first */
+static GQueue G_cache_lru = G_QUEUE_INIT;
+static guint symbols_cache_hits;
+static guint symbols_cache_misses;
+
+static guint symbols_cache_hash(gconstpointer key)
+{
+	return ((const SymbolsCacheEntry *) key)->hash;
+}
+
+static gboolean symbols_cache_equal(gconstpointer a, gconstpointer b)
+{
+	const SymbolsCacheEntry *ea = a, *eb = b;
+
+	return ea->hash == eb->hash && ea->level == eb->level
+	    && ea->support_level == eb->support_level
+	    && ea->ssml_mode == eb->ssml_mode
+	    && !strcmp(ea->text, eb->text) && !strcmp(ea->locale, eb->locale);
+}
+
+/* Bytes taken by a cache entry, and its links in the table and the LRU */
+static gsize symbols_cache_entry_size(const SymbolsCacheEntry *entry)
+{
+	return sizeof(*entry) + 3 * sizeof(gpointer) + sizeof(GList)
+	    + mem_strsize(entry->locale) + mem_strsize(entry->text)
+	    + mem_strsize(entry->processed);
+}
+
+static void symbols_cache_entry_free(SymbolsCacheEntry *entry)
+{
+	mem_account(MEM_SYMBOLS_CACHE,
+		    -(gssize) symbols_cache_entry_size(entry), -1);
+	g_free(entry->locale);
+	g_free(entry->text);
+	g_free(entry->processed);
+	g_slice_free1(sizeof *entry, entry);
+}
+
+static guint symbols_cache_key_hash(const SymbolsCacheEntry *key)
+{
+	guint hash = g_str_hash(key->text);
+
+	hash = hash * 31 + g_str_hash(key->locale);
+	hash = hash * 31 + key->level;
+	hash = hash * 31 + key->support_level;
+	return hash * 31 + key->ssml_mode;
+}
+
+static void symbols_cache_clear(void)
+{
+	if (!G_cache)
+		return;
+
+	MSG2(4, "symbols", "Dropping %u cached texts, %u hits, %u misses",
+	     g_hash_table_size(G_cache), symbols_cache_hits,
+	     symbols_cache_misses);
+	g_queue_clear(&G_cache_lru);
+	g_hash_table_remove_all(G_cache);
+}
+
+/* Look key up, returns TRUE and sets processed if it is known */
+static gboolean symbols_cache_lookup(SymbolsCacheEntry *key, gchar **processed)
+{
+	SymbolsCacheEntry *entry;
+
+	if (!G_cache)
+		G_cache = g_hash_table_new_full(symbols_cache_hash,
+						symbols_cache_equal,
+						(GDestroyNotify) symbols_cache_entry_free,
+						NULL);
+
+	key->hash = symbols_cache_key_hash(key);
+	entry = g_hash_table_lookup(G_cache, key);
+	if (!entry) {
+		symbols_cache_misses++;
+		return FALSE;
+	}
+
+	symbols_cache_hits++;
+	g_queue_unlink(&G_cache_lru, entry->link);
+	g_queue_push_head_link(&G_cache_lru, entry->link);
+	*processed = g_strdup(entry->processed);
+	return TRUE;
+}
+
+/* Remember the result for key, whose hash was computed by the lookup */
+static void symbols_cache_add(const SymbolsCacheEntry *key, const gchar *processed)
+{
+	SymbolsCacheEntry *entry;
+
+	if (strlen(key->text) > SYMBOLS_CACHE_MAX_TEXT)
+		return;
+
+	if (g_queue_get_length(&G_cache_lru) >= SYMBOLS_CACHE_SIZE) {
+		/* Evict the least recently used one */
+		entry = g_queue_pop_tail(&G_cache_lru);
+		g_hash_table_remove(G_cache, entry);
+	}
+
+	entry = g_slice_alloc(sizeof *entry);
+	*entry = *key;
+	entry->locale = g_strdup(key->locale);
+	entry->text = g_strdup(key->text);
+	entry->processed = g_strdup(processed);
+	g_queue_push_head(&G_cache_lru, entry);
+	entry->link = G_cache_lru.head;
+	g_hash_table_add(G_cache, entry);
+	mem_account(MEM_SYMBOLS_CACHE, symbols_cache_entry_size(entry), 1);
+}
+
+void symbols_cache_stats(guint *hits, guint *misses)
+{
+	pthread_mutex_lock(&symbols_mutex);
+	*hits = symbols_cache_hits;
+	*misses = symbols_cache_misses;
+	pthread_mutex_unlock(&symbols_mutex);
 }
 
 /*----------------------------------- API -----------------------------------*/
 
-/* Process some text, converting symbols according to desired pronunciation. */
-static gchar *process_speech_symbols(const gchar *locale, const gchar *text, SymLvl level, SymLvl support_level, SPDDataMode ssml_mode)
+/*------------------------- Single characters -------------------------------*/
+
+/* At most that many characters are remembered for each locale */
+#define SYMBOLS_CHARS_MAX 4096
+
+/* The index of character c in the chars table of the processors, the
+ * support levels are below 1 << 10 */
+static guint symbols_char_key(gunichar c, SymLvl support_level, SPDDataMode ssml_mode)
 {
-	GSList *sspl;
+	return ((guint) support_level << 22) | ((ssml_mode == SPD_DATA_SSML) << 21) | c;
+}
+
+/* Render character text of sspl at SYMLVL_CHAR and remember it */
+static gchar *symbols_char_render(SpeechSymbolProcessors *sspl, const gchar *text, SymLvl support_level, SPDDataMode ssml_mode, guint generation)
+{
+	guint key = symbols_char_key(g_utf8_get_char(text), support_level, ssml_mode);
+	gchar *processed;
+
+	processed = speech_symbols_processor_process_text(sspl->list, text, SYMLVL_CHAR, support_level, ssml_mode, NULL);
+
+	pthread_mutex_lock(&symbols_mutex);
+	if (generation == symbols_generation
+	    && g_hash_table_size(sspl->chars) < SYMBOLS_CHARS_MAX)
+		g_hash_table_replace(sspl->chars, GUINT_TO_POINTER(key), g_strdup(processed));
+	pthread_mutex_unlock(&symbols_mutex);
+
+	return processed;
+}
+
+/* Process a single character at SYMLVL_CHAR.  This is what typing echoes,
+ * the renderings are kept by the processors of the locale, apart from the
+ * cache of texts which would let them be pushed out by longer ones. */
+static gchar *process_speech_symbols_char(const gchar *locale, const gchar *text, SymLvl support_level, SPDDataMode ssml_mode)
+{
+	SpeechSymbolProcessors *sspl;
+	gchar *processed = NULL;
+	guint key = symbols_char_key(g_utf8_get_char(text), support_level, ssml_mode);
+	guint generation;
 
 	sspl = get_locale_speech_symbols_processor(locale);
 	/* fallback to English if there's no processor for the locale */
@@ -1371,15 +2132,145 @@ static gchar *process_speech_symbols(const gchar *locale, const gchar *text, Sym
 	if (!sspl)
 		return NULL;
 
-	return speech_symbols_processor_process_text(sspl, text, level, support_level, ssml_mode);
+	pthread_mutex_lock(&symbols_mutex);
+	processed = g_strdup(g_hash_table_lookup(sspl->chars, GUINT_TO_POINTER(key)));
+	if (processed)
+		symbols_cache_hits++;
+	else
+		symbols_cache_misses++;
+	generation = symbols_generation;
+	pthread_mutex_unlock(&symbols_mutex);
+
+	if (processed)
+		MSG2(5, "symbols", "character cached: |%s|", text);
+	else
+		processed = symbols_char_render(sspl, text, support_level, ssml_mode, generation);
+
+	speech_symbols_processors_unref(sspl);
+	return processed;
+}
+
+/* Render beforehand the single characters which have a symbol */
+static void symbols_chars_preload(SpeechSymbolProcessors *sspl, SymLvl support_level)
+{
+	GHashTable *chars = g_hash_table_new(g_direct_hash, g_direct_equal);
+	GHashTableIter iter;
+	gpointer identifier;
+	GSList *node;
+	guint generation;
+
+	/* The same character may have symbols in several files */
+	for (node = sspl->list; node; node = node->next) {
+		SpeechSymbolProcessor *ssp = node->data;
+
+		g_hash_table_iter_init(&iter, ssp->symbols);
+		while (g_hash_table_iter_next(&iter, &identifier, NULL)) {
+			const gchar *id = identifier;
+
+			if (id[0] && !*g_utf8_next_char(id))
+				g_hash_table_add(chars, (gpointer) id);
+		}
+	}
+
+	pthread_mutex_lock(&symbols_mutex);
+	generation = symbols_generation;
+	pthread_mutex_unlock(&symbols_mutex);
+
+	g_hash_table_iter_init(&iter, chars);
+	while (g_hash_table_iter_next(&iter, &identifier, NULL))
+		g_free(symbols_char_render(sspl, identifier, support_level, SPD_DATA_TEXT, generation));
+	MSG2(4, "symbols", "Rendered %u characters", g_hash_table_size(chars));
+	g_hash_table_unref(chars);
+}
+
+/* Process some text, converting symbols according to desired pronunciation.
+ * The parsed SSML text is returned in ssml_ret when it was processed here,
+ * not found in the cache. */
+static gchar *process_speech_symbols(const gchar *locale, const gchar *text, SymLvl level, SymLvl support_level, SPDDataMode ssml_mode, SsmlText **ssml_ret)
+{
+	SpeechSymbolProcessors *sspl;
+	gchar *processed = NULL;
+	guint generation;
+	SymbolsCacheEntry key = {
+		.locale = (gchar *) locale,
+		.text = (gchar *) text,
+		.level = level,
+		.support_level = support_level,
+		.ssml_mode = ssml_mode,
+	};
+
+	if (level == SYMLVL_CHAR && text[0] && !*g_utf8_next_char(text))
+		/* The echo of typed characters, keep it short */
+		return process_speech_symbols_char(locale, text, support_level,
+						   ssml_mode);
+
+	pthread_mutex_lock(&symbols_mutex);
+	if (symbols_cache_lookup(&key, &processed)) {
+		MSG2(5, "symbols", "cached: |%s|", text);
+		pthread_mutex_unlock(&symbols_mutex);
+		return processed;
+	}
+	generation = symbols_generation;
+	pthread_mutex_unlock(&symbols_mutex);
+
+	sspl = get_locale_speech_symbols_processor(locale);
+	/* fallback to English if there's no processor for the locale */
+	if (!sspl && g_str_has_prefix(locale, "en") && strchr("_-", locale[2]))
+		sspl = get_locale_speech_symbols_processor("en");
+	if (sspl && ssml_mode != SPD_DATA_SSML && level != SYMLVL_CHAR
+	    && strlen(text) > 2 * SYMBOLS_SEGMENT_SIZE)
+		processed = speech_symbols_process_segments(sspl->list, text, level, support_level);
+	else if (sspl)
+		processed = speech_symbols_processor_process_text(sspl->list, text, level, support_level, ssml_mode, ssml_ret);
+	speech_symbols_processors_unref(sspl);
+
+	pthread_mutex_lock(&symbols_mutex);
+	if (generation == symbols_generation)
+		/* Not computed from files dropped meanwhile */
+		symbols_cache_add(&key, processed);
+	pthread_mutex_unlock(&symbols_mutex);
+
+	return processed;
+}
+
+/* The locale of the symbols for a language, e.g. en_US for en-us */
+static gchar *symbols_locale(const char *language)
+{
+	gchar *locale = g_strdup(language), *dash;
+
+	dash = strchr(locale, '-');
+	if (dash)
+	{
+		char *c;
+		*dash = '_';
+		for (c = dash + 1; *c; c++)
+			*c = toupper(*c);
+	}
+
+	return locale;
 }
 
-void insert_symbols(TSpeechDMessage *msg, int punct_missing)
+void symbols_preprocessing_preload(const char *language)
+{
+	SpeechSymbolProcessors *sspl;
+	gchar *locale = symbols_locale(language);
+
+	MSG2(4, "symbols", "Preloading symbols for %s", locale);
+	sspl = get_locale_speech_symbols_processor(locale);
+	if (!sspl)
+		MSG2(3, "symbols", "No symbols for %s", locale);
+	else
+		symbols_chars_preload(sspl, GlobalFDSet.symbols_preprocessing);
+	speech_symbols_processors_unref(sspl);
+	g_free(locale);
+}
+
+void insert_symbols(TSpeechDMessage *msg, int punct_missing, SsmlText **ssml_ret)
 {
 	gchar *processed;
 	SymLvl level = SYMLVL_NONE;
 	SymLvl support_level = msg->settings.symbols_preprocessing;
-	char *locale = strdup(msg->settings.msg_settings.voice.language), *dash;
+	gchar *locale = symbols_locale(msg->settings.msg_settings.voice.language);
 
 	if (punct_missing && support_level < SYMLVL_ALL)
 		/* The user preferred to let some modules handle some punctuation,
@@ -1396,18 +2287,10 @@ void insert_symbols(TSpeechDMessage *msg, int punct_missing)
 	if (msg->settings.type == SPD_MSGTYPE_CHAR)
 		level = SYMLVL_CHAR;
 
-	dash = strchr(locale, '-');
-	if (dash)
-	{
-		char *c;
-		*dash = '_';
-		for (c = dash + 1; *c; c++)
-			*c = toupper(*c);
-	}
-
 	MSG2(5, "symbols", "processing at level %d, supporting level %d", level, support_level);
 	processed = process_speech_symbols(locale,
-		msg->buf, level, support_level, msg->settings.ssml_mode);
+		msg->buf, level, support_level, msg->settings.ssml_mode, ssml_ret);
+	g_free(locale);
 	if (processed) {
 		MSG2(5, "symbols", "before: |%s|", msg->buf);
 		g_free(msg->buf);
@@ -19,6 +19,7 @@
  */
 
 #include "speechd.h"
+#include "ssml.h"
 
 #ifndef SYMBOLS_H
 #define SYMBOLS_H
@@ -26,8 +27,23 @@
 /* Load symbols from this file */
 void symbols_preprocessing_add_file(const char *name);
 
-/* Converts symbols to words corresponding to a level into a message. */
-void insert_symbols(TSpeechDMessage *msg, int punct_missing);
+/* Forget the files to load, before the configuration gets read again */
+void symbols_preprocessing_reset(void);
+
+/* Compile the symbols files of the locales in @p dir for faster loading */
+int symbols_compile_dir(const char *dir);
+
+/* Build the processors of a language beforehand, from any thread */
+void symbols_preprocessing_preload(const char *language);
+
+/* Get the number of insert_symbols() results found in the cache or not */
+void symbols_cache_stats(guint *hits, guint *misses);
+
+/* Converts symbols to words corresponding to a level into a message.  If
+ * ssml_ret is not NULL and the SSML text of the message had to be parsed,
+ * it is left there, parsed, for insert_index_marks_ssml(), it is left
+ * untouched otherwise. */
+void insert_symbols(TSpeechDMessage *msg, int punct_missing, SsmlText **ssml_ret);
 
 /* Speech symbols punctuation levels */
 typedef enum {
@@ -0,0 +1,141 @@
+/*
+* spd_async.c - test the asynchronous requests of libspeechd
+*
+* Copyright (C) 2026 Brailcom, o.p.s.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "speechd_types.h"
+#include "libspeechd.h"
+
+#define TEST_NAME __FILE__
+#define TEST_REQUESTS (8)
+static SPDConnection *spd;
+
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int n_done;
+static int done_ids[TEST_REQUESTS];
+static int done_results[TEST_REQUESTS];
+
+static void fail(const char *what)
+{
+	printf("%s\n", what);
+	spd_close(spd);
+	exit(1);
+}
+
+/* Records the completions in order, user_data is the rank of the request */
+static void done_cb(SPDConnection * connection, int request_id, int result,
+		    void *user_data)
+{
+	int rank = (int)(long)user_data;
+
+	pthread_mutex_lock(&done_mutex);
+	printf("request %d (%d) done: %d\n", rank, request_id, result);
+	if (connection != spd || rank != n_done || n_done >= TEST_REQUESTS) {
+		printf("Request %d completed out of order\n", rank);
+		exit(1);
+	}
+	done_ids[n_done] = request_id;
+	done_results[n_done] = result;
+	n_done++;
+	pthread_cond_signal(&done_cond);
+	pthread_mutex_unlock(&done_mutex);
+}
+
+static void wait_done(int n)
+{
+	pthread_mutex_lock(&done_mutex);
+	while (n_done < n)
+		pthread_cond_wait(&done_cond, &done_mutex);
+	pthread_mutex_unlock(&done_mutex);
+}
+
+int main(int argc, char *argv[])
+{
+	int ids[TEST_REQUESTS];
+	int n = 0, i;
+
+	spd = spd_open(TEST_NAME, __FUNCTION__, NULL, SPD_MODE_THREADED);
+	if (!spd) {
+		printf("Speech-dispatcher: Failed to open connection. \n");
+		exit(1);
+	}
+
+	if (spd_say_async(spd, SPD_TEXT, NULL, done_cb, NULL) != -1
+	    || spd_execute_command_async(spd, NULL, done_cb, NULL) != -1)
+		fail("An asynchronous request without text was accepted");
+
+	/* All of these return at once, and complete in order */
+	ids[n] = spd_set_voice_rate_async(spd, 30, done_cb, (void *)(long)n);
+	n++;
+	ids[n] = spd_set_voice_pitch_async(spd, -30, done_cb, (void *)(long)n);
+	n++;
+	ids[n] = spd_set_volume_async(spd, 40, done_cb, (void *)(long)n);
+	n++;
+	ids[n] = spd_say_async(spd, SPD_TEXT, "An asynchronous message.",
+			       done_cb, (void *)(long)n);
+	n++;
+	ids[n] = spd_execute_command_async(spd, "SET SELF RATE 1000",
+					   done_cb, (void *)(long)n);
+	n++;
+	ids[n] = spd_stop_async(spd, done_cb, (void *)(long)n);
+	n++;
+	ids[n] = spd_cancel_async(spd, done_cb, (void *)(long)n);
+	n++;
+
+	for (i = 0; i < n; i++)
+		if (ids[i] <= 0 || (i > 0 && ids[i] <= ids[i - 1]))
+			fail("The request ids are not increasing");
+
+	wait_done(n);
+	for (i = 0; i < n; i++)
+		if (done_ids[i] != ids[i])
+			fail("A callback got the id of another request");
+	if (done_results[0] || done_results[1] || done_results[2])
+		fail("An asynchronous setting failed");
+	if (done_results[3] <= 0)
+		fail("spd_say_async() did not give a message id");
+	if (!done_results[4])
+		fail("An invalid command did not fail");
+	if (done_results[5] || done_results[6])
+		fail("spd_stop_async() or spd_cancel_async() failed");
+
+	/* The settings took effect, and the invalid one did not */
+	if (spd_get_voice_rate(spd) != 30 || spd_get_voice_pitch(spd) != -30
+	    || spd_get_volume(spd) != 40)
+		fail("The asynchronous settings were not applied");
+
+	/* The requests not sent yet complete with -1 when closing */
+	n_done = 0;
+	for (i = 0; i < TEST_REQUESTS; i++)
+		if (spd_set_voice_rate_async(spd, i, done_cb,
+					     (void *)(long)i) <= 0)
+			fail("spd_set_voice_rate_async() failed");
+	spd_close(spd);
+	if (n_done != TEST_REQUESTS) {
+		printf("Only %d of the requests completed\n", n_done);
+		exit(1);
+	}
+
+	printf("Asynchronous requests work.\n");
+
+	exit(0);
+}
@@ -0,0 +1,394 @@
+/*
+ * spd_benchmark.c - Measure the throughput and latencies of the server
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is meant to be run against a server which has the null module of
+ * src/modules (e.g. started with --module-dir pointing there), so that the
+ * cost of synthesis does not hide that of the server.  The workload only
+ * depends on the options, and the results are printed on stdout as JSON,
+ * one member per benchmark, to be compared between versions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include "speechd_types.h"
+#include "libspeechd.h"
+
+#define TEST_NAME __FILE__
+/* Seconds to wait for an event before giving up */
+#define EVENT_TIMEOUT 30
+
+static SPDConnection *spd;
+
+static int messages = 1000;
+static int repeats = 100;
+static const char *module = "null";
+static const char *locales = "en,cs,de,es,fr";
+
+/* Highest message ids which began, and which were over */
+static size_t begun_id;
+static size_t done_id;
+static pthread_mutex_t event_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_cond = PTHREAD_COND_INITIALIZER;
+
+static void begin_cb(size_t msg_id, size_t client_id,
+		     SPDNotificationType type)
+{
+	pthread_mutex_lock(&event_mutex);
+	if (msg_id > begun_id)
+		begun_id = msg_id;
+	pthread_cond_broadcast(&event_cond);
+	pthread_mutex_unlock(&event_mutex);
+}
+
+static void done_cb(size_t msg_id, size_t client_id,
+		    SPDNotificationType type)
+{
+	pthread_mutex_lock(&event_mutex);
+	if (msg_id > done_id)
+		done_id = msg_id;
+	pthread_cond_broadcast(&event_cond);
+	pthread_mutex_unlock(&event_mutex);
+}
+
+/* Wait for *id to reach msg_id */
+static void wait_event(size_t *id, size_t msg_id, const char *what)
+{
+	struct timespec deadline;
+	int ret = 0;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += EVENT_TIMEOUT;
+
+	pthread_mutex_lock(&event_mutex);
+	while (*id < msg_id && ret != ETIMEDOUT)
+		ret = pthread_cond_timedwait(&event_cond, &event_mutex,
+					     &deadline);
+	pthread_mutex_unlock(&event_mutex);
+
+	if (ret == ETIMEDOUT) {
+		fprintf(stderr, "Timeout waiting for %s of message %zu\n",
+			what, msg_id);
+		exit(1);
+	}
+}
+
+static double now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static int say(SPDPriority priority, const char *text)
+{
+	int msg_id = spd_say(spd, priority, text);
+
+	if (msg_id < 0) {
+		fprintf(stderr, "Could not send a message\n");
+		exit(1);
+	}
+	return msg_id;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Print the distribution of the n durations of samples, sorting them */
+static void print_stats(const char *name, double *samples, int n)
+{
+	double sum = 0;
+	int i;
+
+	qsort(samples, n, sizeof(*samples), compare_double);
+	for (i = 0; i < n; i++)
+		sum += samples[i];
+
+	printf("\t\t\"%s\": {\"count\": %d, \"min_us\": %.1f, "
+	       "\"median_us\": %.1f, \"p95_us\": %.1f, \"max_us\": %.1f, "
+	       "\"mean_us\": %.1f}", name, n, samples[0], samples[n / 2],
+	       samples[(n * 95) / 100], samples[n - 1], sum / n);
+}
+
+/* Send messages which are spoken instantly, one after the other as fast
+ * as the replies of the server come */
+static void bench_speak_flood(void)
+{
+	double start, sent, done;
+	char text[64];
+	int i, msg_id = 0;
+
+	spd_set_voice_rate(spd, 100);
+
+	start = now_us();
+	for (i = 0; i < messages; i++) {
+		snprintf(text, sizeof(text), "Benchmark message number %d.", i);
+		msg_id = say(SPD_MESSAGE, text);
+	}
+	sent = now_us();
+	wait_event(&done_id, msg_id, "end");
+	done = now_us();
+
+	printf("\t\"speak_flood\": {\"messages\": %d, \"sent_per_second\": "
+	       "%.1f, \"spoken_per_second\": %.1f},\n", messages,
+	       messages * 1e6 / (sent - start),
+	       messages * 1e6 / (done - start));
+}
+
+/* Time from sending CANCEL to getting the CANCEL event, while a long
+ * message is being spoken */
+static void bench_cancel(void)
+{
+	double *samples = malloc(repeats * sizeof(*samples));
+	char text[2001];
+	double start;
+	int i, msg_id;
+
+	/* Long enough not to be over before it gets cancelled */
+	memset(text, 'a', sizeof(text) - 1);
+	text[sizeof(text) - 1] = 0;
+	for (i = 7; i < (int)sizeof(text) - 1; i += 8)
+		text[i] = ' ';
+
+	spd_set_voice_rate(spd, 0);
+
+	for (i = 0; i < repeats; i++) {
+		msg_id = say(SPD_MESSAGE, text);
+		wait_event(&begun_id, msg_id, "begin");
+
+		start = now_us();
+		spd_cancel(spd);
+		wait_event(&done_id, msg_id, "cancel");
+		samples[i] = now_us() - start;
+	}
+
+	printf("\t\"cancel\": {\n");
+	print_stats("latency", samples, repeats);
+	printf("\n\t},\n");
+	free(samples);
+}
+
+/* Time from sending CHAR to the END of the character, as for the echo of
+ * typed characters */
+static void bench_char_echo(void)
+{
+	double *samples = malloc(repeats * sizeof(*samples));
+	double start;
+	int i, msg_id;
+
+	spd_set_voice_rate(spd, 100);
+
+	for (i = 0; i < repeats; i++) {
+		char character[2] = { 'a' + i % 26, 0 };
+
+		start = now_us();
+		msg_id = spd_char(spd, SPD_MESSAGE, character);
+		if (msg_id < 0) {
+			fprintf(stderr, "Could not send a character\n");
+			exit(1);
+		}
+		wait_event(&done_id, msg_id, "end");
+		samples[i] = now_us() - start;
+	}
+
+	printf("\t\"char_echo\": {\n");
+	print_stats("round_trip", samples, repeats);
+	printf("\n\t},\n");
+	free(samples);
+}
+
+/* Characters per second of texts full of symbols, with all punctuation
+ * spoken, in each of the locales */
+static void bench_symbols(void)
+{
+	static const char text[] =
+	    "Price: $42.50 (+15%) & 3 * 7 = 21; see <https://example.org/a?b=c#d>,"
+	    " \"quoted\" 'text' {braces} [brackets] a@b.c ~user/path | x ^ y!";
+	char *list = strdup(locales), *saveptr, *locale;
+	double start, elapsed;
+	int i, msg_id = 0, first = 1;
+
+	spd_set_voice_rate(spd, 100);
+	spd_set_punctuation(spd, SPD_PUNCT_ALL);
+
+	printf("\t\"symbols\": {\n");
+	for (locale = strtok_r(list, ",", &saveptr); locale;
+	     locale = strtok_r(NULL, ",", &saveptr)) {
+		if (spd_set_language(spd, locale)) {
+			fprintf(stderr, "Could not set language %s\n", locale);
+			continue;
+		}
+
+		/* Let the symbols of the locale get loaded */
+		msg_id = say(SPD_MESSAGE, text);
+		wait_event(&done_id, msg_id, "end");
+
+		start = now_us();
+		for (i = 0; i < messages; i++)
+			msg_id = say(SPD_MESSAGE, text);
+		wait_event(&done_id, msg_id, "end");
+		elapsed = now_us() - start;
+
+		printf("%s\t\t\"%s\": {\"messages\": %d, "
+		       "\"chars_per_second\": %.1f}", first ? "" : ",\n",
+		       locale, messages,
+		       (double)messages * (sizeof(text) - 1) * 1e6 / elapsed);
+		first = 0;
+	}
+	printf("\n\t},\n");
+
+	spd_set_punctuation(spd, SPD_PUNCT_NONE);
+	spd_set_language(spd, "en");
+	free(list);
+}
+
+/* Count the entries of a multi-line reply of the server */
+static int reply_entries(const char *reply)
+{
+	const char *line;
+	int n = 0;
+
+	for (line = reply; line && *line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strlen(line) > 4 && line[3] == '-')
+			n++;
+	}
+	return n;
+}
+
+/* Time to list the messages of the history, as it grows */
+static void bench_history(void)
+{
+	double *samples = malloc(repeats * sizeof(*samples));
+	char command[64], *reply;
+	int client_id = spd_get_client_id(spd);
+	int size, sent = 0, i, entries = 0, msg_id = 0, first = 1;
+	char name[32];
+
+	spd_set_voice_rate(spd, 100);
+
+	printf("\t\"history\": {\n");
+	for (size = messages / 100 ? messages / 100 : 1; size <= messages;
+	     size *= 10) {
+		for (; sent < size; sent++)
+			msg_id = say(SPD_MESSAGE, "History benchmark.");
+		wait_event(&done_id, msg_id, "end");
+
+		snprintf(command, sizeof(command),
+			 "HISTORY GET CLIENT_MESSAGES %d 0 %d", client_id, size);
+		for (i = 0; i < repeats; i++) {
+			double start = now_us();
+
+			reply = NULL;
+			spd_execute_command_with_reply(spd, command, &reply);
+			samples[i] = now_us() - start;
+			entries = reply_entries(reply);
+			free(reply);
+		}
+
+		snprintf(name, sizeof(name), "%d", size);
+		printf("%s\t\t\"%s\": {\"entries\": %d,\n", first ? "" : ",\n",
+		       name, entries);
+		print_stats("list", samples, repeats);
+		printf("\n\t\t}");
+		first = 0;
+	}
+	printf("\n\t}\n");
+	free(samples);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-n messages] [-r repeats] "
+		"[-m module] [-l locale,...]\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int c;
+
+	while ((c = getopt(argc, argv, "n:r:m:l:")) != -1) {
+		switch (c) {
+		case 'n':
+			messages = atoi(optarg);
+			break;
+		case 'r':
+			repeats = atoi(optarg);
+			break;
+		case 'm':
+			module = optarg;
+			break;
+		case 'l':
+			locales = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (messages < 1 || repeats < 1)
+		usage(argv[0]);
+
+	spd = spd_open(TEST_NAME, __FUNCTION__, NULL, SPD_MODE_THREADED);
+	if (!spd) {
+		fprintf(stderr, "Failed to open connection\n");
+		exit(1);
+	}
+
+	spd->callback_begin = begin_cb;
+	spd->callback_end = done_cb;
+	spd->callback_cancel = done_cb;
+	if (spd_set_notification_on(spd, SPD_BEGIN) == -1
+	    || spd_set_notification_on(spd, SPD_END) == -1
+	    || spd_set_notification_on(spd, SPD_CANCEL) == -1) {
+		fprintf(stderr, "Could not set notifications\n");
+		spd_close(spd);
+		exit(1);
+	}
+
+	if (spd_set_output_module(spd, module)) {
+		fprintf(stderr, "Could not set output module %s\n", module);
+		spd_close(spd);
+		exit(1);
+	}
+
+	printf("{\n\t\"config\": {\"module\": \"%s\", \"messages\": %d, "
+	       "\"repeats\": %d, \"locales\": \"%s\"},\n",
+	       module, messages, repeats, locales);
+	bench_speak_flood();
+	bench_cancel();
+	bench_char_echo();
+	bench_symbols();
+	bench_history();
+	printf("}\n");
+
+	spd_close(spd);
+	return 0;
+}
@@ -0,0 +1,136 @@
+/*
+* spd_list_cache.c - test the cache of module and voice lists
+*
+* Copyright (C) 2026 Brailcom, o.p.s.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "speechd_types.h"
+#include "libspeechd.h"
+
+#define TEST_NAME __FILE__
+static SPDConnection *spd;
+
+static void fail(const char *what)
+{
+	printf("%s\n", what);
+	spd_close(spd);
+	exit(1);
+}
+
+/* Whether both lists have the same strings */
+static int same_list(char **a, char **b)
+{
+	int i;
+
+	if (a == NULL || b == NULL)
+		return 0;
+	for (i = 0; a[i] && b[i]; i++)
+		if (strcmp(a[i], b[i]))
+			return 0;
+	return a[i] == b[i];
+}
+
+static int same_voices(SPDVoice ** a, SPDVoice ** b)
+{
+	int i;
+
+	if (a == NULL || b == NULL)
+		return 0;
+	for (i = 0; a[i] && b[i]; i++)
+		if (strcmp(a[i]->name, b[i]->name))
+			return 0;
+	return a[i] == b[i];
+}
+
+int main(int argc, char *argv[])
+{
+	char **modules, **cached_modules, **voices, **cached_voices;
+	SPDVoice **synth, **cached_synth;
+
+	/* The changes are reported as events, only read in threaded mode */
+	spd = spd_open(TEST_NAME, __FUNCTION__, NULL, SPD_MODE_SINGLE);
+	if (!spd) {
+		printf("Speech-dispatcher: Failed to open connection. \n");
+		exit(1);
+	}
+	if (spd_set_list_cache(spd, 1) != -1)
+		fail("The list cache was enabled in single mode");
+	spd_close(spd);
+
+	spd = spd_open(TEST_NAME, __FUNCTION__, NULL, SPD_MODE_THREADED);
+	if (!spd) {
+		printf("Speech-dispatcher: Failed to open connection. \n");
+		exit(1);
+	}
+
+	modules = spd_list_modules(spd);
+	voices = spd_list_voices(spd);
+	synth = spd_list_synthesis_voices(spd);
+	if (modules == NULL || voices == NULL || synth == NULL)
+		fail("Can't list the modules and voices");
+
+	if (spd_set_list_cache(spd, 1))
+		fail("spd_set_list_cache() failed");
+
+	/* The first calls fill the cache, the next ones are answered from
+	   it, all with what the server says */
+	cached_modules = spd_list_modules(spd);
+	if (!same_list(modules, cached_modules))
+		fail("The modules listed with the cache differ");
+	/* Each call gets its own copy */
+	if (cached_modules[0])
+		cached_modules[0][0] = '*';
+	free_spd_modules(cached_modules);
+	cached_modules = spd_list_modules(spd);
+	if (!same_list(modules, cached_modules))
+		fail("The cached modules differ");
+	free_spd_modules(cached_modules);
+
+	cached_voices = spd_list_voices(spd);
+	free_spd_symbolic_voices(cached_voices);
+	cached_voices = spd_list_voices(spd);
+	if (!same_list(voices, cached_voices))
+		fail("The cached voices differ");
+	free_spd_symbolic_voices(cached_voices);
+
+	cached_synth = spd_list_synthesis_voices(spd);
+	free_spd_voices(cached_synth);
+	cached_synth = spd_list_synthesis_voices(spd);
+	if (!same_voices(synth, cached_synth))
+		fail("The cached synthesis voices differ");
+	free_spd_voices(cached_synth);
+
+	/* And without it again */
+	if (spd_set_list_cache(spd, 0))
+		fail("Can't disable the list cache");
+	cached_modules = spd_list_modules(spd);
+	if (!same_list(modules, cached_modules))
+		fail("The modules listed after the cache differ");
+	free_spd_modules(cached_modules);
+
+	free_spd_modules(modules);
+	free_spd_symbolic_voices(voices);
+	free_spd_voices(synth);
+
+	printf("The list cache works.\n");
+	spd_close(spd);
+
+	exit(0);
+}
@@ -0,0 +1,152 @@
+/*
+* spd_pause_segments.c - test pausing a message split in segments
+*
+* Copyright (C) 2026 Brailcom, o.p.s.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+/*
+ * The server must be run with a SpeakSegmentLength of a few hundred
+ * bytes, so that the message is split.  When it is resumed, the rest of
+ * the part that was paused has to be said before the next parts: the
+ * client must get the resume before the end, and nothing after it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include "speechd_types.h"
+#include "libspeechd.h"
+
+#define TEST_NAME __FILE__
+#define TEST_WAIT_COUNT (60)
+#define TEST_SENTENCES (40)
+static SPDConnection *spd;
+static volatile int n_events;
+static SPDNotificationType event_list[16];
+
+static const char *events[] = {
+	"SPD_EVENT_BEGIN",
+	"SPD_EVENT_END",
+	"SPD_EVENT_INDEX_MARK",
+	"SPD_EVENT_CANCEL",
+	"SPD_EVENT_PAUSE",
+	"SPD_EVENT_RESUME"
+};
+
+/* Callback for Speech Dispatcher notifications */
+static void notification_cb(size_t msg_id, size_t client_id,
+			    SPDNotificationType type)
+{
+	printf("notification %s received\n", events[type]);
+	if (n_events < sizeof(event_list) / sizeof(event_list[0]))
+		event_list[n_events] = type;
+	n_events++;
+}
+
+/* Wait for the event number n to arrive, and check its type */
+static void wait_event(int n, SPDNotificationType type)
+{
+	int count = 0;
+
+	while (n_events <= n) {
+		sleep(1);
+		if (count++ == TEST_WAIT_COUNT) {
+			printf("%s wait count exceeded\n", events[type]);
+			spd_close(spd);
+			exit(1);
+		}
+	}
+	if (event_list[n] != type) {
+		printf("Got %s instead of %s\n", events[event_list[n]],
+		       events[type]);
+		spd_close(spd);
+		exit(1);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static char text[TEST_SENTENCES * 80];
+	int result, i;
+
+	/* Open Speech Dispatcher connection */
+	spd = spd_open(TEST_NAME, __FUNCTION__, NULL, SPD_MODE_THREADED);
+	if (!spd) {
+		printf("Speech-dispatcher: Failed to open connection. \n");
+		exit(1);
+	}
+
+	spd->callback_begin = spd->callback_end = spd->callback_cancel =
+	    spd->callback_pause = spd->callback_resume = notification_cb;
+
+	result = spd_set_notification_on(spd, SPD_BEGIN);
+	result |= spd_set_notification_on(spd, SPD_END);
+	result |= spd_set_notification_on(spd, SPD_CANCEL);
+	result |= spd_set_notification_on(spd, SPD_PAUSE);
+	result |= spd_set_notification_on(spd, SPD_RESUME);
+	result |= spd_set_data_mode(spd, SPD_DATA_TEXT);
+	if (result == -1) {
+		printf("Could not set the notifications and data mode\n");
+		spd_close(spd);
+		exit(1);
+	}
+
+	for (i = 1; i <= TEST_SENTENCES; i++)
+		sprintf(text + strlen(text), "This is sentence number %d "
+			"of a message long enough to be split. ", i);
+
+	printf("Sending a message of %zu bytes\n", strlen(text));
+	result = spd_say(spd, SPD_TEXT, text);
+	if (result == -1) {
+		printf("spd_say() failed. \n");
+		spd_close(spd);
+		exit(1);
+	}
+
+	wait_event(0, SPD_EVENT_BEGIN);
+	sleep(2);
+	printf("Pausing\n");
+	if (spd_pause(spd) == -1) {
+		printf("spd_pause() failed. \n");
+		spd_close(spd);
+		exit(1);
+	}
+	wait_event(1, SPD_EVENT_PAUSE);
+
+	printf("Resuming\n");
+	if (spd_resume(spd) == -1) {
+		printf("spd_resume() failed. \n");
+		spd_close(spd);
+		exit(1);
+	}
+	wait_event(2, SPD_EVENT_RESUME);
+	wait_event(3, SPD_EVENT_END);
+
+	/* The paused part would be said last if it was queued at the tail */
+	sleep(2);
+	if (n_events != 4) {
+		printf("Got %d events after the end\n", n_events - 4);
+		spd_close(spd);
+		exit(1);
+	}
+
+	printf("Message resumed in order.\n");
+	spd_close(spd);
+
+	exit(0);
+}
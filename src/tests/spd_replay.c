@@ -0,0 +1,343 @@
+/*
+ * spd_replay.c - Send again the SSIP sessions recorded by the server
+ *
+ * Copyright (C) 2026 Brailcom, o.p.s.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ * See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This reads a file written by a server with ProtocolCaptureFile (see
+ * src/server/capture.h) and opens a connection for each of the recorded
+ * clients, sending their lines with the recorded timing, or as fast as the
+ * replies come with -f.  The time from each command to its reply is
+ * printed as JSON by command, as with spd_benchmark, along with how late
+ * the lines were sent compared to the recording.  The messages of
+ * SPEAK_FD can not be replayed, since their file descriptors are gone.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <glib.h>
+#include "speechd_types.h"
+#include "libspeechd.h"
+#include "capture.h"
+
+#define TEST_NAME __FILE__
+
+static gboolean fast;
+static double speed = 1;
+
+/* A recorded client, by its fd in the capture */
+typedef struct {
+	SPDConnection *spd;
+	GString *input;		/* what the server sent, not read yet */
+	gboolean data;		/* sending the text of SPEAK etc. */
+} Client;
+
+/* Durations in us by command, and of them all */
+static GHashTable *samples;
+static GArray *all_samples;
+static double late_max;
+static unsigned lines;
+
+static double now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+static void client_free(gpointer data)
+{
+	Client *client = data;
+
+	spd_close(client->spd);
+	g_string_free(client->input, TRUE);
+	g_free(client);
+}
+
+/* Read the next line from the server, skipping events */
+static gboolean client_read_reply(Client * client, char **reply)
+{
+	char buf[4096], *end;
+	ssize_t n;
+
+	for (;;) {
+		while ((end = memchr(client->input->str, '\n',
+				     client->input->len))) {
+			char *line = g_strndup(client->input->str,
+					       end + 1 - client->input->str);
+
+			g_string_erase(client->input, 0,
+				       end + 1 - client->input->str);
+			/* Events (7xx) come whenever they want */
+			if (line[0] == '7') {
+				g_free(line);
+				continue;
+			}
+			/* Only the last line of replies has a space */
+			if (strlen(line) > 3 && line[3] == ' ') {
+				*reply = line;
+				return TRUE;
+			}
+			g_free(line);
+		}
+
+		n = read(client->spd->socket, buf, sizeof(buf));
+		if (n <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		g_string_append_len(client->input, buf, n);
+	}
+}
+
+static void add_sample(const char *command, double duration)
+{
+	GArray *array = g_hash_table_lookup(samples, command);
+
+	if (array == NULL) {
+		array = g_array_new(FALSE, FALSE, sizeof(double));
+		g_hash_table_insert(samples, g_strdup(command), array);
+	}
+	g_array_append_val(array, duration);
+	g_array_append_val(all_samples, duration);
+}
+
+/* The command of the line, e.g. SPEAK or SET VOICE_RATE, the "." line ending
+ * data being reported as DATA */
+static char *line_command(const char *line, size_t bytes)
+{
+	char **words = g_strsplit_set(line, " \r\n", 4);
+	char *command, *upper;
+
+	if (words[0] == NULL || words[0][0] == 0)
+		command = g_strdup("EMPTY");
+	else if (!g_ascii_strcasecmp(words[0], "SET") && words[1] && words[2])
+		command = g_strdup_printf("SET %s", words[2]);
+	else if ((!g_ascii_strcasecmp(words[0], "HISTORY")
+		  || !g_ascii_strcasecmp(words[0], "GET")
+		  || !g_ascii_strcasecmp(words[0], "LIST")) && words[1])
+		command = g_strdup_printf("%s %s", words[0], words[1]);
+	else
+		command = g_strdup(words[0]);
+	g_strfreev(words);
+
+	upper = g_ascii_strup(command, -1);
+	g_free(command);
+	return upper;
+}
+
+static void replay_line(Client * client, const char *line, size_t bytes)
+{
+	gboolean end_data = client->data && bytes <= 3 && line[0] == '.'
+	    && (line[1] == '\r' || line[1] == '\n');
+	char *command, *reply;
+	double start;
+
+	if (write(client->spd->socket, line, bytes) != (ssize_t) bytes) {
+		fprintf(stderr, "Could not send to the server: %s\n",
+			strerror(errno));
+		exit(1);
+	}
+	lines++;
+
+	/* The text lines of SPEAK have no reply */
+	if (client->data && !end_data)
+		return;
+
+	start = now_us();
+	if (!client_read_reply(client, &reply)) {
+		/* e.g. after BYE */
+		return;
+	}
+	command = end_data ? g_strdup("DATA") : line_command(line, bytes);
+	add_sample(command, now_us() - start);
+
+	if (end_data)
+		client->data = FALSE;
+	else if (!strncmp(reply, "230", 3))
+		client->data = TRUE;
+
+	g_free(command);
+	g_free(reply);
+}
+
+static gboolean read_record(FILE * f, TCaptureRecord * record, char **data)
+{
+	if (fread(record, sizeof(*record), 1, f) != 1)
+		return FALSE;
+	record->time = GUINT64_FROM_LE(record->time);
+	record->connection = GUINT32_FROM_LE(record->connection);
+	record->type = GUINT16_FROM_LE(record->type);
+	record->length = GUINT32_FROM_LE(record->length);
+
+	*data = g_malloc(record->length + 1);
+	if (record->length && fread(*data, record->length, 1, f) != 1) {
+		g_free(*data);
+		return FALSE;
+	}
+	(*data)[record->length] = 0;
+	return TRUE;
+}
+
+static void replay(FILE * f)
+{
+	GHashTable *clients = g_hash_table_new_full(g_direct_hash,
+						    g_direct_equal, NULL,
+						    client_free);
+	TCaptureRecord record;
+	double start = now_us();
+	char *data;
+
+	while (read_record(f, &record, &data)) {
+		gpointer key = GUINT_TO_POINTER(record.connection);
+		Client *client = g_hash_table_lookup(clients, key);
+
+		if (!fast) {
+			double at = start + record.time / speed;
+			double wait = at - now_us();
+
+			if (wait > 0)
+				g_usleep(wait);
+			else if (-wait > late_max)
+				late_max = -wait;
+		}
+
+		switch (record.type) {
+		case CAPTURE_CONNECT:
+			client = g_new0(Client, 1);
+			client->spd = spd_open(TEST_NAME, "replay", NULL,
+					       SPD_MODE_SINGLE);
+			if (!client->spd) {
+				fprintf(stderr, "Failed to open connection\n");
+				exit(1);
+			}
+			client->input = g_string_new(NULL);
+			g_hash_table_replace(clients, key, client);
+			break;
+		case CAPTURE_LINE:
+			if (client)
+				replay_line(client, data, record.length);
+			break;
+		case CAPTURE_DISCONNECT:
+			g_hash_table_remove(clients, key);
+			break;
+		}
+		g_free(data);
+	}
+
+	g_hash_table_destroy(clients);
+}
+
+static int compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Print the distribution of the durations of samples, sorting them */
+static void print_stats(const char *name, GArray * array, const char *sep)
+{
+	double *s = (double *)array->data, sum = 0;
+	int i, n = array->len;
+
+	g_array_sort(array, compare_double);
+	for (i = 0; i < n; i++)
+		sum += s[i];
+
+	printf("\t\t\"%s\": {\"count\": %d, \"min_us\": %.1f, "
+	       "\"median_us\": %.1f, \"p95_us\": %.1f, \"max_us\": %.1f, "
+	       "\"mean_us\": %.1f}%s\n", name, n, s[0], s[n / 2],
+	       s[(n * 95) / 100], s[n - 1], sum / n, sep);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-f] [-s speed] capture\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	char magic[CAPTURE_MAGIC_LEN];
+	GList *commands, *gl;
+	double start, elapsed;
+	FILE *f;
+	int c;
+
+	while ((c = getopt(argc, argv, "fs:")) != -1) {
+		switch (c) {
+		case 'f':
+			fast = TRUE;
+			break;
+		case 's':
+			speed = atof(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1 || speed <= 0)
+		usage(argv[0]);
+
+	f = fopen(argv[optind], "rb");
+	if (!f) {
+		fprintf(stderr, "Can't open %s: %s\n", argv[optind],
+			strerror(errno));
+		exit(1);
+	}
+	if (fread(magic, sizeof(magic), 1, f) != 1
+	    || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)) {
+		fprintf(stderr, "%s is not a capture of the server\n",
+			argv[optind]);
+		exit(1);
+	}
+
+	samples = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					(GDestroyNotify) g_array_unref);
+	all_samples = g_array_new(FALSE, FALSE, sizeof(double));
+
+	start = now_us();
+	replay(f);
+	elapsed = now_us() - start;
+	fclose(f);
+
+	printf("{\n\t\"config\": {\"fast\": %s, \"speed\": %g},\n",
+	       fast ? "true" : "false", speed);
+	printf("\t\"replay\": {\"lines\": %u, \"seconds\": %.3f, "
+	       "\"late_max_us\": %.1f},\n", lines, elapsed / 1e6, late_max);
+	printf("\t\"replies\": {\n");
+	commands = g_list_sort(g_hash_table_get_keys(samples),
+			       (GCompareFunc) strcmp);
+	for (gl = commands; gl; gl = gl->next)
+		print_stats(gl->data, g_hash_table_lookup(samples, gl->data),
+			    ",");
+	g_list_free(commands);
+	if (all_samples->len)
+		print_stats("all", all_samples, "");
+	printf("\t}\n}\n");
+
+	g_array_unref(all_samples);
+	g_hash_table_destroy(samples);
+	return 0;
+}
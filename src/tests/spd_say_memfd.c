@@ -0,0 +1,131 @@
+/*
+* spd_say_memfd.c - test SPEAK_FD through spd_say_memfd() and spd_say()
+*
+* Copyright (C) 2026 Brailcom, o.p.s.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "speechd_types.h"
+#include "libspeechd.h"
+
+#define TEST_NAME __FILE__
+static SPDConnection *spd;
+
+static void fail(const char *what)
+{
+	printf("%s\n", what);
+	spd_close(spd);
+	exit(1);
+}
+
+#ifdef HAVE_MEMFD_CREATE
+/* A memfd holding text, sealed with seals */
+static int text_memfd(const char *text, int seals)
+{
+	size_t len = strlen(text);
+	int fd;
+
+	fd = memfd_create("spd_say_memfd", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0)
+		fail("memfd_create() failed");
+	if (write(fd, text, len) != (ssize_t) len)
+		fail("Can't write the text into the memfd");
+	if (seals && fcntl(fd, F_ADD_SEALS, seals) < 0)
+		fail("Can't seal the memfd");
+	return fd;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+#ifdef HAVE_MEMFD_CREATE
+	const char *text = "This text was passed in a memfd.";
+	const int seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+	char *big;
+	size_t big_len = 100000, i;
+	int fd, ret;
+
+	spd = spd_open(TEST_NAME, __FUNCTION__, NULL, SPD_MODE_SINGLE);
+	if (!spd) {
+		printf("Speech-dispatcher: Failed to open connection. \n");
+		exit(1);
+	}
+
+	fd = text_memfd(text, seals);
+	ret = spd_say_memfd(spd, SPD_TEXT, fd, strlen(text));
+	if (ret <= 0)
+		fail("spd_say_memfd() of a sealed memfd failed");
+	printf("Message %d sent through SPEAK_FD\n", ret);
+
+	/* Only the given bytes are said, the fd stays ours */
+	ret = spd_say_memfd(spd, SPD_TEXT, fd, 4);
+	if (ret <= 0)
+		fail("spd_say_memfd() of the start of the memfd failed");
+	if (fcntl(fd, F_GETFD) < 0)
+		fail("spd_say_memfd() closed the fd");
+
+	/* More bytes than the memfd has */
+	if (spd_say_memfd(spd, SPD_TEXT, fd, strlen(text) + 1) != -1)
+		fail("SPEAK_FD accepted more bytes than the memfd holds");
+	close(fd);
+
+	/* The server could see it change under its feet */
+	fd = text_memfd(text, 0);
+	if (spd_say_memfd(spd, SPD_TEXT, fd, strlen(text)) != -1)
+		fail("SPEAK_FD accepted a memfd which is not sealed");
+	close(fd);
+
+	if (spd_say_memfd(spd, SPD_TEXT, -1, 10) != -1)
+		fail("spd_say_memfd() accepted an invalid fd");
+
+	/* spd_say() hands large texts over through SPEAK_FD by itself */
+	big = malloc(big_len + 1);
+	memset(big, 'a', big_len);
+	for (i = 80; i < big_len; i += 80)
+		big[i] = ' ';
+	big[big_len] = 0;
+	ret = spd_say(spd, SPD_TEXT, big);
+	free(big);
+	if (ret <= 0)
+		fail("spd_say() of a large text failed");
+
+	/* The connection is still in sync after the refused ones */
+	if (spd_cancel(spd) == -1)
+		fail("spd_cancel() failed");
+
+	printf("SPEAK_FD works.\n");
+	spd_close(spd);
+
+	exit(0);
+#else
+	printf("memfd_create() is not available\n");
+	exit(77);
+#endif
+}
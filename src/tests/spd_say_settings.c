@@ -0,0 +1,119 @@
+/*
+* spd_say_settings.c - test spd_say_with_settings()
+*
+* Copyright (C) 2026 Brailcom, o.p.s.
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2, or (at your option)
+* any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+* See the GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*
+*/
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "speechd_types.h"
+#include "libspeechd.h"
+
+#define TEST_NAME __FILE__
+static SPDConnection *spd;
+
+static void fail(const char *what)
+{
+	printf("%s\n", what);
+	spd_close(spd);
+	exit(1);
+}
+
+/* Check that the settings given last are those of the connection */
+static void check_settings(int rate, int pitch, int volume,
+			   const char *language)
+{
+	char *lang;
+
+	if (spd_get_voice_rate(spd) != rate)
+		fail("The rate was not set");
+	if (spd_get_voice_pitch(spd) != pitch)
+		fail("The pitch was not set");
+	if (spd_get_volume(spd) != volume)
+		fail("The volume was not set");
+	lang = spd_get_language(spd);
+	if (lang == NULL || strcmp(lang, language))
+		fail("The language was not set");
+	free(lang);
+}
+
+int main(int argc, char *argv[])
+{
+	SPDSettings settings = { 0 };
+	int ret;
+
+	spd = spd_open(TEST_NAME, __FUNCTION__, NULL, SPD_MODE_SINGLE);
+	if (!spd) {
+		printf("Speech-dispatcher: Failed to open connection. \n");
+		exit(1);
+	}
+
+	/* No settings at all is a plain spd_say() */
+	ret = spd_say_with_settings(spd, SPD_TEXT, NULL, "Without settings.");
+	if (ret <= 0)
+		fail("spd_say_with_settings() without settings failed");
+
+	settings.set = SPD_SETTING_RATE | SPD_SETTING_PITCH
+	    | SPD_SETTING_VOLUME | SPD_SETTING_LANGUAGE
+	    | SPD_SETTING_PUNCTUATION;
+	settings.rate = 20;
+	settings.pitch = -10;
+	settings.volume = 30;
+	settings.language = "en";
+	settings.punctuation = SPD_PUNCT_SOME;
+	ret = spd_say_with_settings(spd, SPD_TEXT, &settings,
+				    "With some settings.");
+	if (ret <= 0)
+		fail("spd_say_with_settings() failed");
+	printf("Message %d sent with its settings\n", ret);
+	check_settings(20, -10, 30, "en");
+
+	/* Only the flagged settings are sent */
+	settings.set = SPD_SETTING_RATE;
+	settings.rate = -20;
+	settings.pitch = 50;
+	if (spd_say_with_settings(spd, SPD_TEXT, &settings, "Slower.") <= 0)
+		fail("spd_say_with_settings() with one setting failed");
+	check_settings(-20, -10, 30, "en");
+
+	/* Invalid settings are refused, and nothing changes */
+	settings.set = SPD_SETTING_RATE | SPD_SETTING_VOLUME;
+	settings.rate = 0;
+	settings.volume = 200;
+	if (spd_say_with_settings(spd, SPD_TEXT, &settings, "Too loud.") != -1)
+		fail("An out of range volume was accepted");
+	settings.set = SPD_SETTING_LANGUAGE;
+	settings.language = NULL;
+	if (spd_say_with_settings(spd, SPD_TEXT, &settings, "No language.")
+	    != -1)
+		fail("A NULL language was accepted");
+	check_settings(-20, -10, 30, "en");
+
+	/* The connection still works after them */
+	if (spd_cancel(spd) == -1)
+		fail("spd_cancel() failed");
+
+	printf("spd_say_with_settings() works.\n");
+	spd_close(spd);
+
+	exit(0);
+}